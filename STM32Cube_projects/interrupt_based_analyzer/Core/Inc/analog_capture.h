@@ -0,0 +1,57 @@
+/**
+  ******************************************************************************
+  * @file           : analog_capture.h
+  * @brief          : One ADC channel sampled beside the edges, on the
+  *                   capture clock
+  ******************************************************************************
+  * With ANALOG_CAPTURE, PA1 (ADC12_IN1) is sampled by ADC1 at a rate set
+  * with host command 'a' rate_hz(4), 0 to stop, while the edge engine
+  * runs. TIM1 paces the conversions: it counts the TIM2 prescaler's ticks
+  * and is started by the TIM2 update, as CAPTURE_IC_DMA's TIM4 is, so the
+  * conversions fall on the clock that stamps the edges, every period
+  * ticks from the wrap it started on. DMA1 channel 1 moves each result
+  * into a RAM ring; the main loop only packs what it finds there.
+  *
+  * Samples go into the edge stream as MARKER_BUS records, two to a
+  * record, in the time order of the edges around them:
+  *   BUS_ANALOG         time of the first sample,
+  *                      data = first | second << 12 | kind << 24
+  *   BUS_ANALOG_PERIOD  ahead of the first record of each start,
+  *                      data = ticks between samples | kind << 24
+  * The second sample of a record is period ticks after the first. A ring
+  * the main loop fell a whole ring behind on is skipped to its newest
+  * samples; the times of the records show the gap.
+  *
+  * The period is a whole number of ticks, at most 65536 (TIM1 is 16
+  * bits), so slower rates take the slowest the clock preset allows, and
+  * at most ANALOG_MAX_HZ. 'H' keeps the rate and recomputes the period.
+  * The ADC runs at 12 MHz with a 28.5 cycle sample time: 3.4 us per
+  * conversion, for sources up to about 50 kOhm.
+  ******************************************************************************
+  */
+
+#ifndef __ANALOG_CAPTURE_H
+#define __ANALOG_CAPTURE_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include "main.h"
+
+#define ANALOG_RING_SIZE 256            // DMA ring depth in samples, power of 2
+#define ANALOG_RING_MASK (ANALOG_RING_SIZE - 1)
+#define ANALOG_ADC_CHANNEL 1            // PA1
+#define ANALOG_MAX_HZ 50000             // what the edge stream carries beside edges
+#define ANALOG_MAX_PERIOD 65536         // ticks, TIM1's full count
+#define ANALOG_SAMPLE_BITS 12
+
+void analog_capture_start(uint32_t period);
+void analog_capture_stop(void);
+void analog_capture_drain(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* __ANALOG_CAPTURE_H */
@@ -0,0 +1,58 @@
+/**
+  ******************************************************************************
+  * @file           : board_sync.h
+  * @brief          : Shared reference pulse for merging several analyzers'
+  *                   captures into one timeline
+  ******************************************************************************
+  * Each board's clock runs off its own crystal, so two analyzers on one
+  * system drift apart by tens of ppm and start at unrelated times. One
+  * board, the master, drives a pulse every period_ms on PA8 (TIM1 CH1,
+  * 1 ms high); that line is wired to PA2 of every board, the master's
+  * own included, with a common ground. PA2 is TIM2 CH3, whose input
+  * capture latches the rising edge in the same TIM2 ticks that stamp the
+  * edges, so every board times the same physical edge to one tick.
+  *
+  * Host command 'Y' mode(1) period_ms(2) picks BOARD_SYNC_OFF, _LISTEN
+  * or _MASTER. Each pulse becomes one MARKER_BUS record of kind BUS_SYNC
+  * at the pulse's clock time:
+  *   data = pulse count(16) | SYNC_FLAG_* << 16 | kind << 24
+  * board_merge.py pairs the pulses of the captures and fits every
+  * board's clock to the master's.
+  *
+  * The TIM2 interrupt rebuilds the 32-bit time of the 16-bit capture, so
+  * it must run within one TIM2 period (65536 ticks, 0.9 ms at 72 MHz);
+  * a pulse the main loop has not sent yet is replaced by the next, which
+  * the count shows.
+  ******************************************************************************
+  */
+
+#ifndef __BOARD_SYNC_H
+#define __BOARD_SYNC_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include "main.h"
+
+#define BOARD_SYNC_OFF    0             // 'Y' modes
+#define BOARD_SYNC_LISTEN 1             // timestamp the pulses on PA2
+#define BOARD_SYNC_MASTER 2             // also drive them on PA8
+
+#define BOARD_SYNC_MIN_MS 2             // pulse period limits, TIM1 at 10 kHz
+#define BOARD_SYNC_MAX_MS 6553
+
+#define SYNC_FLAG_MASTER 0x01           // BUS_SYNC flags: this board drives the pulse
+
+extern volatile uint32_t board_sync_pending;    // a pulse waits for board_sync_poll
+
+void board_sync_configure(uint32_t mode, uint32_t period_ms);
+void board_sync_irq(void);
+void board_sync_poll(void);
+void board_sync_reset(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* __BOARD_SYNC_H */
@@ -0,0 +1,54 @@
+/**
+  ******************************************************************************
+  * @file           : boot_capture.h
+  * @brief          : Edge capture from power-up, held until the host asks
+  ******************************************************************************
+  * Enumeration and the host script's start take seconds, longer than
+  * many targets take to boot. A preset stored with host command 'Z'
+  * mode(1) channels(1) clock(1) makes the next power-ups start the edge
+  * capture before MX_USB_DEVICE_Init: the channel mask ('E', 0 keeps
+  * all) and timestamp clock ('H', 0xFF keeps CAPTURE_CLOCK_PRESET) are
+  * applied, the timers started, and the ring holds the edges as an
+  * armed trigger does, sending nothing:
+  *   BOOT_CAPTURE_FILL  the first ring's worth, later edges counted as
+  *                      drops
+  *   BOOT_CAPTURE_WRAP  the newest ring's worth, the older ones counted
+  *                      in a window marker ahead of them
+  * The host's first 'M' for the edge stream sends them behind its
+  * stream header, timed from power-up; any other stream restart, 'G'
+  * or 'H' ends the hold first. Mode BOOT_CAPTURE_OFF clears the preset.
+  *
+  * The preset lives beside the clock correction in the last flash page
+  * (clock_trim.h), whose rewrite stalls the CPU for about 20 ms.
+  ******************************************************************************
+  */
+
+#ifndef __BOOT_CAPTURE_H
+#define __BOOT_CAPTURE_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include "main.h"
+
+#define BOOT_CAPTURE_OFF  0         // 'Z' modes
+#define BOOT_CAPTURE_FILL 1
+#define BOOT_CAPTURE_WRAP 2
+#define BOOT_CLOCK_KEEP   0xFF      // 'Z' clock: CAPTURE_CLOCK_PRESET
+
+typedef struct
+{
+    uint32_t mode;          // BOOT_CAPTURE_*
+    uint32_t channels;      // 'E' mask, 0 for all
+    uint32_t clock;         // 'H' preset or BOOT_CLOCK_KEEP
+} BootPreset;
+
+uint32_t boot_capture_preset(BootPreset *preset);
+uint32_t boot_capture_store(uint32_t mode, uint32_t channels, uint32_t clock);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* __BOOT_CAPTURE_H */
@@ -0,0 +1,41 @@
+/**
+  ******************************************************************************
+  * @file           : capture_ic.h
+  * @brief          : Timer input-capture + DMA edge capture engine
+  ******************************************************************************
+  * TIM4 runs in lock-step with TIM2 (same prescaler, started by the TIM2
+  * update trigger) so its captured 16-bit counter values share the
+  * TIM2/TIM3 timebase. PB6 is routed to TIM4 TI1 and captured twice: IC1
+  * latches rising edges, IC2 (indirect TI1) latches falling edges. Each
+  * capture register is moved by its own circular DMA channel into a RAM
+  * ring, so no CPU work happens per edge; the main loop only drains.
+  *
+  * The F103 cannot capture both polarities on one IC channel, and of the
+  * timer channels reachable from PB4-PB7 only TIM4 CH1/CH2 have DMA
+  * requests, so the hardware path covers one probe pin. The remaining
+  * channels keep using EXTI.
+  ******************************************************************************
+  */
+
+#ifndef __CAPTURE_IC_H
+#define __CAPTURE_IC_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include "main.h"
+
+#define IC_RING_SIZE 256                // DMA ring depth per polarity, power of 2
+#define IC_RING_MASK (IC_RING_SIZE - 1)
+#define IC_CHANNEL   2                  // event channel number of PB6
+
+void capture_ic_init(void);
+void capture_ic_drain(void);
+void capture_ic_stop(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* __CAPTURE_IC_H */
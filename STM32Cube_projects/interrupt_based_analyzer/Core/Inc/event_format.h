@@ -0,0 +1,236 @@
+/**
+  ******************************************************************************
+  * @file           : event_format.h
+  * @brief          : Packing of the 32-bit event words streamed over USB
+  ******************************************************************************
+  * Edge format (EVENT_FORMAT_SNAPSHOT 0):
+  *   bit 31 edge (1 = rising) | bits 30-29 channel | bits 28-0 timer
+  * Snapshot format (EVENT_FORMAT_SNAPSHOT 1):
+  *   bits 31-28 levels | bits 27-24 changed mask | bits 23-0 timer
+  *
+  * Markers are in-band records that are not edges. In the edge format a
+  * marker has an all-ones time field and its type in bits 31-29; a real
+  * edge landing on that tick is reported one tick early. In the snapshot
+  * format a marker has an empty changed mask, its type in bits 31-28 and
+  * a 24-bit payload. Some marker types are followed by a fixed number of
+  * raw 32-bit payload words.
+  *
+  * With OVERLOAD_PAIRING the edge words between a BUS_OVERLOAD record
+  * that opens a region and the one that closes it are dense: the time
+  * field's low OVERLOAD_QUANTUM_BITS (n) bits are cleared, and in their
+  * place
+  *   bit n-1 second edge present | bit n-2 its edge | bits n-3..n-4 its
+  *   channel | bits n-5..0 its time, in 2^n tick steps after the first
+  * A word holds one edge (low bits all clear) or two, the second of the
+  * same EXTI entry and epoch; a pair that would form the marker escape
+  * goes as two words.
+  *
+  * With STREAM_COMPACT the edge-format words are re-encoded on the way
+  * out as variable-length records carrying time deltas (event_format.c),
+  * and with STREAM_PREDICT edges a per-channel model predicted as runs
+  * of a few bits each.
+  * With STREAM_FRAMED every USB transfer of the stream is preceded by a
+  * StreamFrame header, so the host can check it and find the next one.
+  ******************************************************************************
+  */
+
+#ifndef __EVENT_FORMAT_H
+#define __EVENT_FORMAT_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#ifdef HOST_SIM
+#include "ring_sim.h"
+#else
+#include "main.h"
+#endif
+
+#if EVENT_FORMAT_SNAPSHOT
+#define EVENT_TIME_BITS 24
+#else
+#define EVENT_TIME_BITS 29
+#endif
+#define EVENT_TIME_MASK ((1UL << EVENT_TIME_BITS) - 1)
+
+/* Marker types */
+#define MARKER_EPOCH 0   // the timer field wrapped; payload = epoch count
+#define MARKER_DROP  1   // ring overflow, followed by MARKER_DROP_WORDS raw words:
+                         // lost event count, clock time of first and last loss
+#define MARKER_DROP_WORDS 3
+#define MARKER_INFO  2   // reply to host command 'V', followed by MARKER_INFO_WORDS
+                         // raw words (HOST_INFO_WORDS, see host_cmd.h)
+#define MARKER_INFO_WORDS 5
+#define MARKER_SOF   3   // USB start of frame, followed by MARKER_SOF_WORDS raw words:
+                         // frame count since enumeration, clock time at that SOF
+#define MARKER_SOF_WORDS 2
+#define MARKER_UART  4   // byte decoded on the device (UART_DECODE), followed by
+                         // MARKER_UART_WORDS raw words: clock time of its start
+                         // bit, byte | status << 8 | channel << 16 (uart_decode.h)
+#define MARKER_UART_WORDS 2
+#define MARKER_WINDOW 5  // head of a pre-trigger window (trigger.h), followed by
+                         // MARKER_WINDOW_WORDS raw words laid out as MARKER_DROP's:
+                         // events discarded while armed, clock time of first and last
+#define MARKER_WINDOW_WORDS 3
+#define MARKER_TRIGGER 6  // the trigger fired on the next event, followed by
+                          // MARKER_TRIGGER_WORDS raw words: its clock time
+#define MARKER_TRIGGER_WORDS 1
+#define MARKER_BUS 7     // a sniffed bus byte or condition, followed by
+                         // MARKER_BUS_WORDS raw words: its clock time, then
+                         // byte | aux << 8 | flags << 16 | BUS_* kind << 24
+#define MARKER_BUS_WORDS 2
+#define BUS_SPI 0        // byte PB5, aux PB15 (spi_sniff.h)
+#define BUS_I2C 1        // byte, aux I2C_EVENT_* (i2c_sniff.h)
+#define BUS_STORM 2      // not a bus: byte | aux << 8 edges of a rate-limited
+                         // channel, flags STORM_FLAG_* (storm_limit.h)
+#define BUS_STATS 3      // not a bus: byte | aux << 8 16 bits of an interrupt
+                         // timing value, flags its item (irq_timing.h)
+#define BUS_MEASURE 4    // not a bus: 20-bit value of a channel's window
+                         // summary, flags bits 7-4 field | channel << 2
+                         // (measure.h)
+#define BUS_HEALTH 5     // not a bus: 20-bit value of a link health counter,
+                         // flags bits 7-4 its HEALTH_* item:
+#define HEALTH_EVENTS 0      // ring words written since the last report
+#define HEALTH_BYTES 1       // bytes handed to USB
+#define HEALTH_RING_PEAK 2   // most ring words queued at once
+#define HEALTH_RING_WORDS 3  // ring size in words
+#define HEALTH_DROPPED 4     // events lost to a full ring
+#define HEALTH_USB_BUSY 5    // transfer starts that found USB busy
+#define HEALTH_CMD_LOST 6    // host commands lost to a full command queue
+#define HEALTH_EXTI_MAX 7    // IRQ_TIMING builds: cycles of the longest EXTI handler
+#define HEALTH_PERIOD 15     // microseconds the counters cover; ends the report
+#define BUS_CONFIG 6     // not a bus: echo of a host command the device ran
+                         // (CONFIG_ECHO), byte | aux << 8 two of its argument
+                         // bytes in order, flags its opcode; CONFIG_LAST set on
+                         // the command's last record
+#define CONFIG_LAST 0x80
+#define BUS_SYNC 7       // not a bus: a shared reference pulse, byte | aux << 8
+                         // its count, flags SYNC_FLAG_* (board_sync.h)
+#define BUS_LEVELS 8     // not a bus: snapshot of the probe pins (LEVEL_SNAPSHOT_MS),
+                         // byte bits 3-0 CH4-CH1 levels, aux the channels whose
+                         // edges stream as edges
+#define BUS_HANDOFF 9    // not a bus: 'M' 2 ends the edge stream here, byte the
+                         // engine taking over (CAPTURE_MODE_POLL); its stream
+                         // header follows the last ring word
+#define BUS_FLASH 10     // not a bus: answer to 'O', byte | aux << 8 4 KiB blocks
+                         // of the flash log, flags its FLASH_LOG_* state (flash_log.h)
+#define BUS_FILTER 11    // not a bus: byte | aux << 8 transactions a sniffer's 'X'
+                         // filter dropped since its last report, flags FILTER_*
+#define FILTER_I2C 1     // 'X' bus: I2C transactions by address (i2c_sniff.h)
+#define FILTER_UART 2    // 'X' bus: UART messages by first byte (uart_decode.h)
+#define BUS_ANALOG 12    // not a bus: two 12-bit ADC samples, the first at the
+                         // record's time, the second a period later (analog_capture.h)
+#define BUS_ANALOG_PERIOD 13 // not a bus: 24-bit ticks between BUS_ANALOG samples,
+                         // ahead of the first record of each start
+#define BUS_OVERLOAD 14  // not a bus: the ring passed OVERLOAD_PAIRING's high-water mark
+                         // and the edge words after it are dense (flags OVERLOAD_ENTER),
+                         // or drained below the low-water mark (flags 0); byte the
+                         // quantum bits n, aux the ring words queued then in 1/256ths
+#define OVERLOAD_ENTER 1
+#define BUS_CREDIT 15    // not a bus: byte | aux << 8 KiB of 'c' credit left, flags
+                         // bit 7 CREDIT_HELD, bits 6-0 ring words queued in 1/128ths;
+                         // on each grant, and once when no credit holds the stream
+#define CREDIT_HELD 0x80
+#define BUS_TRIGGER_OUT 16 // not a bus: byte | aux << 8 ticks from the trigger's time to
+                         // PA0 rising, flags TRIG_OUT_* (trigger.h); after MARKER_TRIGGER
+#define BUS_PULSE 17     // not a bus: a pulse ending at the record's time, or a lone
+                         // edge, of a channel sending pulse records (pulse_record.h)
+#define BUS_RECONFIG 18  // not a bus: an 's' commit ran byte commands (after their
+                         // BUS_CONFIG echoes), the probe edges held for aux | flags << 8
+                         // ticks from the record's time (host_cmd.h)
+#define BUS_LATENCY 19   // not a bus: LATENCY_PROBE_MS toggled PA0 at the record's time,
+                         // byte the toggle's number; with flags LATENCY_SENT, the
+                         // transfer carrying that toggle's edge completed at that time
+#define LATENCY_SENT 1
+#define MARKER_MAX_WORDS  5
+
+/* Compact stream (STREAM_COMPACT), see event_format.c */
+#define COMPACT_MARKER_BASE 8   // record types 8-15 are markers
+#define COMPACT_RUN_BYTES 18    // run of predicted edges: header + 32 residual codes (STREAM_PREDICT)
+#if STREAM_PREDICT
+#define COMPACT_MAX_RECORD (25 + COMPACT_RUN_BYTES)   // and the run it ends
+#else
+#define COMPACT_MAX_RECORD 25   // drop record: header + 64-bit delta, count, 64-bit span
+#endif
+
+uint32_t event_compact_encode(uint32_t event, uint8_t *out);
+uint32_t event_compact_flush(uint8_t *out);
+void event_compact_restart(void);
+void event_compact_predict_reset(void);
+void event_compact_frame(const uint8_t *end);
+uint32_t event_compact_idle(void);
+
+/* Framed stream (STREAM_FRAMED), see event_format.c */
+#define FRAME_SYNC 0xA55A
+
+typedef struct
+{
+    uint16_t sync;      // FRAME_SYNC
+    uint16_t length;    // payload bytes after the header
+    uint32_t offset;    // stream bytes framed before this payload
+    uint32_t crc;       // CRC-32 of the two words above and the payload
+} StreamFrame;
+
+void stream_frame_init(void);
+void stream_frame_begin(StreamFrame *frame, const uint8_t *payload, uint32_t length,
+                        uint32_t offset);
+uint32_t stream_frame_done(StreamFrame *frame);
+void stream_frame_build(StreamFrame *frame, const uint8_t *payload, uint32_t length,
+                        uint32_t offset);
+
+#define EVENT_NOT_MARKER 0xFF
+
+/* Marker type of a ring word, EVENT_NOT_MARKER for an event */
+static inline uint32_t event_marker_type(uint32_t word)
+{
+#if EVENT_FORMAT_SNAPSHOT
+    return ((word >> 24) & 0x0F) == 0 ? word >> 28 : EVENT_NOT_MARKER;
+#else
+    return (word & EVENT_TIME_MASK) == EVENT_TIME_MASK ? word >> 29 : EVENT_NOT_MARKER;
+#endif
+}
+
+/* Raw payload words that follow a marker of this type */
+static inline uint32_t event_marker_words(uint32_t type)
+{
+    switch (type)
+    {
+    case MARKER_DROP:    return MARKER_DROP_WORDS;
+    case MARKER_INFO:    return MARKER_INFO_WORDS;
+    case MARKER_SOF:     return MARKER_SOF_WORDS;
+    case MARKER_UART:    return MARKER_UART_WORDS;
+    case MARKER_WINDOW:  return MARKER_WINDOW_WORDS;
+    case MARKER_TRIGGER: return MARKER_TRIGGER_WORDS;
+    case MARKER_BUS:     return MARKER_BUS_WORDS;
+    default:             return 0;
+    }
+}
+
+static inline uint32_t event_pack_edge(uint32_t edge, uint32_t channel, uint32_t time)
+{
+    time &= EVENT_TIME_MASK;
+    if (time == EVENT_TIME_MASK) time--;  // all-ones time is the marker escape
+    return (edge << 31) | (channel << 29) | time;
+}
+
+static inline uint32_t event_pack_snapshot(uint32_t levels, uint32_t changed, uint32_t time)
+{
+    return (levels << 28) | (changed << 24) | (time & EVENT_TIME_MASK);
+}
+
+static inline uint32_t event_pack_marker(uint32_t type, uint32_t payload)
+{
+#if EVENT_FORMAT_SNAPSHOT
+    return (type << 28) | (payload & 0x00FFFFFF);
+#else
+    (void)payload;
+    return (type << 29) | EVENT_TIME_MASK;
+#endif
+}
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* __EVENT_FORMAT_H */
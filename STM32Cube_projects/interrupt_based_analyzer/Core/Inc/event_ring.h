@@ -0,0 +1,253 @@
+/**
+  ******************************************************************************
+  * @file           : event_ring.h
+  * @brief          : Event ring and USB flush policy of the edge engine
+  ******************************************************************************
+  * The ring holds the packed event words (event_format.h) between the
+  * interrupts that push them and the USB transfers that send them. It is
+  * a single-producer, single-consumer queue without locks: producers run
+  * in the EXTI ISR (or with IRQs masked, which makes them one producer)
+  * and only store write_index; the consumer, the main loop's drain and
+  * the USB transmit-complete callback, only stores read_index. Both are
+  * aligned 32-bit words, so each load and store is single-copy atomic on
+  * the Cortex-M3 and neither side masks IRQs to read the other's index.
+  *
+  * Memory ordering: a producer stores a push's words, then RING_BARRIER,
+  * then write_index once for the whole push (ring_publish), so a
+  * consumer that sees the new write_index sees whole events and records.
+  * A consumer loads write_index once (ring_claim, ring_claim_all), then
+  * RING_BARRIER, then the words, and once it has sent or copied them
+  * RING_BARRIER, then read_index (ring_release), so a slot is not reused
+  * while it is still being read. The M3 does not reorder these itself;
+  * the barriers keep the compiler, and a core that does, from it. The
+  * producer stages its words at ring_head, which write_index catches up
+  * with on each push, or only at ring_batch_end while a batch is open:
+  * the EXTI handler publishes all the edges of one entry at once. A
+  * full ring drops events and counts them; the next push that fits puts
+  * a MARKER_DROP record with the lost count and time span ahead of it.
+  *
+  * The flush policy decides when the main loop starts a transfer. Both
+  * are free of HAL calls: with HOST_SIM defined this module builds on a
+  * workstation (Sim/ring_sim.c), where RING_PREEMPT() marks the points
+  * at which the simulator lets an interrupt in. On the target it is
+  * empty.
+  ******************************************************************************
+  */
+
+#ifndef __EVENT_RING_H
+#define __EVENT_RING_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include "event_format.h"
+
+#ifndef RING_PREEMPT
+#define RING_PREEMPT()
+#endif
+#ifndef RING_BARRIER
+#define RING_BARRIER() __DMB()
+#endif
+
+/* Stream flush policies, see capture_set_flush_policy */
+#define FLUSH_LATENCY  0   // send whatever is queued once latency_us has passed
+#define FLUSH_BATCH    1   // send at batch events or after latency_us
+#define FLUSH_ADAPTIVE 2   // FLUSH_BATCH, with the batch growing as the ring fills
+#define FLUSH_DEFAULT_BATCH 16  // 16 events = 64 bytes, until flush_configure
+
+/* Host credit modes, see capture_set_credit ('c') */
+#define CREDIT_OFF   0   // send as fast as USB takes it
+#define CREDIT_START 1   // the credit is the grant: stream bytes the host has room for
+#define CREDIT_ADD   2   // add the grant to the credit left, as the host consumes
+
+#if CAPTURE_RING_EVENTS
+#define MAX_EVENTS CAPTURE_RING_EVENTS	// power of 2
+#define EVENT_MASK (MAX_EVENTS - 1) 	// bitmask to avoid wraparounds
+#else
+/* .capture_ring in STM32F103C8TX_FLASH.ld: the symbol addresses are the values */
+extern uint8_t _capture_ring_events[], _capture_ring_mask[];
+#define MAX_EVENTS ((uint32_t)(uintptr_t)_capture_ring_events)	// largest 2^n that fits in free SRAM
+#define EVENT_MASK ((uint32_t)(uintptr_t)_capture_ring_mask)
+#endif
+
+extern volatile uint32_t event_buffer[];
+extern volatile uint32_t write_index;
+extern volatile uint32_t read_index;
+extern uint32_t ring_head;				// producer's next slot, past write_index in a batch
+extern uint32_t ring_batching;			// a batch is open: pushes stage, not publish
+extern volatile uint32_t dropped_total;	// events lost since power-up
+extern uint32_t drop_pending;			// events lost since the last drop marker
+extern uint32_t drop_first_time;		// clock time of the first and last of them
+extern uint32_t drop_last_time;
+
+void ring_drop(void);
+void ring_reset(void);
+void flush_configure(uint32_t mode, uint32_t batch, uint32_t latency_ticks);
+uint32_t flush_due(uint32_t queued, uint32_t elapsed, uint32_t busy, uint32_t tx_max);
+uint32_t flush_chain_min(void);
+uint32_t flush_wake(uint32_t elapsed, uint32_t *wait);
+uint32_t flush_mode_get(void);
+uint32_t flush_batch_get(void);
+
+/* Ring words queued and not yet released, without masking IRQs: at
+   least this many for the consumer, at most for the producer */
+static inline uint32_t ring_queued(void)
+{
+    return write_index - read_index;
+}
+
+/* Producer: hands the words stored below head to the consumer, or
+   stages them until ring_batch_end while a batch is open */
+static inline void ring_publish(uint32_t head)
+{
+    ring_head = head;
+    if (ring_batching) return;
+    RING_BARRIER();
+    write_index = head;
+}
+
+/* Producer: pushes until ring_batch_end go out under one publish */
+static inline void ring_batch_begin(void)
+{
+    ring_batching = 1;
+}
+
+/* Producer: publishes what the batch staged */
+static inline void ring_batch_end(void)
+{
+    ring_batching = 0;
+    RING_BARRIER();
+    write_index = ring_head;
+}
+
+/* Producer: stores the pending drop marker at head; the next free slot */
+static inline uint32_t ring_put_drop(uint32_t head)
+{
+    if (drop_pending)
+    {
+    	event_buffer[head++ & EVENT_MASK] = event_pack_marker(MARKER_DROP, 0);
+    	event_buffer[head++ & EVENT_MASK] = drop_pending;
+    	event_buffer[head++ & EVENT_MASK] = drop_first_time;
+    	event_buffer[head++ & EVENT_MASK] = drop_last_time;
+    	drop_pending = 0;
+    	RING_PREEMPT();
+    }
+    return head;
+}
+
+/* Ring words a push of words needs, a pending drop marker included */
+static inline uint32_t ring_needed(uint32_t words)
+{
+    return (drop_pending ? MARKER_DROP_WORDS + 1 : 0) + words;
+}
+
+/**
+ * @brief Appends one packed event, or drops it if the ring is full. Once
+ *        there is room again, the drop marker goes in ahead of the event.
+ *        Callers outside the EXTI ISR must mask IRQs
+ * @param data - packed 32-bit event
+ * @retval none
+ */
+static inline void ring_push(uint32_t data)
+{
+    uint32_t needed = ring_needed(1);
+    uint32_t head = ring_head;
+    uint32_t used = head - read_index;
+
+    RING_PREEMPT();
+    if (used + needed > MAX_EVENTS)
+    {
+    	ring_drop();
+    	return;
+    }
+    head = ring_put_drop(head);
+    event_buffer[head++ & EVENT_MASK] = data;
+    RING_PREEMPT();
+    ring_publish(head);
+}
+
+/**
+ * @brief Appends a marker and its raw payload words as one unit, published
+ *        together; the whole record is skipped if the ring cannot take
+ *        it. Callers outside the EXTI ISR must mask IRQs
+ * @param marker - packed marker word
+ * @param words - payload words
+ * @param count - number of payload words
+ * @retval none
+ */
+static inline void ring_push_record(uint32_t marker, const uint32_t *words, uint32_t count)
+{
+    uint32_t needed = ring_needed(1 + count);
+    uint32_t head = ring_head;
+    uint32_t used = head - read_index;
+
+    RING_PREEMPT();
+    if (used + needed > MAX_EVENTS) return;
+    head = ring_put_drop(head);
+    event_buffer[head++ & EVENT_MASK] = marker;
+    while (count--)
+    {
+    	event_buffer[head++ & EVENT_MASK] = *words++;
+    	RING_PREEMPT();
+    }
+    ring_publish(head);
+}
+
+/**
+ * @brief Words the next transfer may send in place: from read_index up
+ *        to the wrap point, at most max
+ * @param max - largest transfer in words
+ * @param start - set to the slot of the first word
+ * @retval word count, 0 if nothing is queued
+ */
+static inline uint32_t ring_claim(uint32_t max, uint32_t *start)
+{
+    uint32_t head = write_index;
+    uint32_t first = read_index;
+    uint32_t pending = head - first;
+    uint32_t to_send;
+
+    RING_BARRIER();
+    first &= EVENT_MASK;
+    to_send = MAX_EVENTS - first;
+    RING_PREEMPT();
+    if (pending < to_send) to_send = pending;
+    if (max < to_send) to_send = max;
+    *start = first;
+    return to_send;
+}
+
+/**
+ * @brief Claims every queued word at once, for a drain that copies them
+ *        out: event_buffer[(first + i) & EVENT_MASK] for i below the
+ *        count, across the wrap point, until ring_release frees them
+ * @param first - set to read_index
+ * @retval word count, 0 if nothing is queued
+ */
+static inline uint32_t ring_claim_all(uint32_t *first)
+{
+    uint32_t head = write_index;
+
+    RING_BARRIER();
+    *first = read_index;
+    return head - *first;
+}
+
+/**
+ * @brief Frees claimed words once they are sent or copied; called from
+ *        the USB transmit-complete callback, or by the main loop's drain
+ * @param words - at most the count ring_claim or ring_claim_all returned
+ * @retval none
+ */
+static inline void ring_release(uint32_t words)
+{
+    RING_BARRIER();
+    read_index += words;
+}
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* __EVENT_RING_H */
@@ -0,0 +1,93 @@
+/**
+  ******************************************************************************
+  * @file           : flash_log.h
+  * @brief          : Offline logging of the compact edge stream to an
+  *                   external SPI NOR flash
+  ******************************************************************************
+  * With FLASH_LOG the edge stream can go to a 25-series SPI NOR flash
+  * (W25Q and the like, 3-byte addresses, up to 16 MiB) instead of USB,
+  * so a capture runs without a host, and is downloaded afterwards as
+  * fast as USB takes it. The chip sits on SPI1: PA4 chip select, PA5
+  * SCK, PA6 MISO, PA7 MOSI, clocked at 18 MHz.
+  *
+  * The log holds the same bytes a live STREAM_COMPACT stream carries,
+  * its StreamHeader first, in FLASH_PAGE_BYTES pages. Each page starts
+  * with the count of its payload bytes, 16-bit little-endian; only a
+  * session's last page is short, and the log ends at the first erased
+  * page (0xFFFF). The main loop encodes the ring into one page buffer
+  * while DMA programs the other, so capture goes on during a program.
+  * Programming never waits for an erase: a session starts on an erased
+  * chip ('O' 1), and a power loss keeps every page written before it.
+  *
+  * Host command 'O' mode(1):
+  *   FLASH_LOG_STOP      end the session: the ring and the page in
+  *                       progress go to flash, then the edge stream
+  *                       restarts on USB
+  *   FLASH_LOG_ERASE     erase the whole chip (tens of seconds)
+  *   FLASH_LOG_START     log the edge stream, on an erased chip only
+  *   FLASH_LOG_DOWNLOAD  stop capturing and send FLASH_DOWNLOAD_MAGIC,
+  *                       the log's byte count and its bytes without the
+  *                       page counts; 'M' restarts the edge stream
+  * The others answer with a MARKER_BUS record of kind BUS_FLASH when
+  * they take effect, in the stream that runs then (a start's goes to the
+  * log), as does a refused download:
+  *   data = 4 KiB blocks used (16) | FLASH_LOG_* state << 16 | kind << 24
+  * A session that fills the chip ends as a stop does, in FLASH_LOG_FULL.
+  * FLASH_LOG_AUTOSTART starts a session at power-up when the chip is
+  * erased, for captures away from any host. 'M' is refused while the
+  * log owns the stream.
+  *
+  * FLASH_LOG_BATCH is for battery-powered logging of slow buses. The
+  * ring goes to flash only once it holds that many events, and the chip
+  * waits in deep power-down between batches, so it wakes once per batch
+  * rather than once per page. With MAIN_LOOP_SLEEP the core sleeps too,
+  * and edges short of a batch do not wake the main loop.
+  ******************************************************************************
+  */
+
+#ifndef __FLASH_LOG_H
+#define __FLASH_LOG_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include "main.h"
+
+#define FLASH_LOG_STOP     0            // 'O' modes
+#define FLASH_LOG_ERASE    1
+#define FLASH_LOG_START    2
+#define FLASH_LOG_DOWNLOAD 3
+
+#define FLASH_LOG_IDLE     0            // states, as BUS_FLASH reports them
+#define FLASH_LOG_ERASING  1
+#define FLASH_LOG_LOGGING  2
+#define FLASH_LOG_SENDING  3            // download under way
+#define FLASH_LOG_FULL     4            // the session ran to the end of the chip
+#define FLASH_LOG_ABSENT   5            // no flash answered at power-up
+
+#define FLASH_PAGE_BYTES 256            // program page of the chip
+#define FLASH_PAGE_PAYLOAD (FLASH_PAGE_BYTES - 2)
+#define FLASH_LOG_MAX_BYTES (16UL << 20)    // 3-byte addressing
+#define FLASH_DOWNLOAD_MAGIC 0x474F4C46UL   // "FLOG", ahead of the byte count
+
+extern volatile uint32_t flash_log_state;
+
+uint32_t flash_log_init(void);
+uint32_t flash_log_erase(void);
+uint32_t flash_log_start(void);
+uint8_t *flash_log_buffer(uint32_t *room);
+void flash_log_commit(uint32_t bytes);
+void flash_log_finish(void);
+void flash_log_poll(void);
+uint32_t flash_log_download(void);
+uint32_t flash_log_read(uint8_t *buf, uint32_t size);
+uint32_t flash_log_asleep(void);
+uint32_t flash_log_bytes(void);
+uint32_t flash_log_report(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* __FLASH_LOG_H */
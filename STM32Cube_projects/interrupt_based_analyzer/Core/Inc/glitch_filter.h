@@ -0,0 +1,42 @@
+/**
+  ******************************************************************************
+  * @file           : glitch_filter.h
+  * @brief          : Minimum pulse width filter of the EXTI channels
+  ******************************************************************************
+  * Host command 'W' gives a channel a minimum pulse width. Its edges are
+  * then held instead of pushed: an edge followed by the next one on the
+  * channel within the width is a glitch, and both are dropped and
+  * counted; an edge that outlives the width is stored at its own time,
+  * by the next edge's interrupt or by the main loop (glitch_poll).
+  *
+  * A held edge reaches the ring up to one main loop pass after the width,
+  * so it may follow newer events of other channels; per-channel order is
+  * kept. The decoded UART and I2C channels and, with CAPTURE_IC_DMA, CH2
+  * are not filtered.
+  ******************************************************************************
+  */
+
+#ifndef __GLITCH_FILTER_H
+#define __GLITCH_FILTER_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include "main.h"
+
+#define GLITCH_ALL_CHANNELS 0xFF        // 'W' channel: set the width of all four
+
+extern volatile uint32_t glitch_mask;       // bit n set while channel n is filtered
+extern volatile uint32_t glitch_suppressed; // glitches dropped since power-up, two edges each
+
+void glitch_configure(uint32_t channel, uint32_t ticks);
+uint32_t glitch_filter(uint32_t levels, uint32_t changed, uint32_t time);
+void glitch_poll(uint32_t now);
+void glitch_reset(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* __GLITCH_FILTER_H */
@@ -0,0 +1,299 @@
+/**
+  ******************************************************************************
+  * @file           : host_cmd.h
+  * @brief          : Commands sent by the host over the CDC OUT endpoint
+  ******************************************************************************
+  * Each command is one opcode byte followed by a fixed number of
+  * little-endian argument bytes. Commands may span OUT packets; unknown
+  * opcodes are skipped one byte at a time. The USB interrupt only queues
+  * whole commands; host_cmd_process() runs them from the main loop and,
+  * with CONFIG_ECHO, echoes each into the edge stream (BUS_CONFIG).
+  * Settings commands apply to a running capture; with 's' several of
+  * them take effect together.
+  *
+  *   'F' mode(1) batch(2) latency_us(4)   set the stream flush policy
+  *   'M' mode(1)                          select the capture engine and
+  *                                        restart its stream, even in
+  *                                        the same mode: the edge stream
+  *                                        starts with a raw StreamHeader
+  *                                        transfer, the poll stream with
+  *                                        a POLL_BLOCK_MAGIC_HEADER block;
+  *                                        2 (ADAPTIVE_CAPTURE builds)
+  *                                        starts with edges and hands
+  *                                        over to poll blocks and back
+  *                                        with the edge rate, see
+  *                                        capture_adapt
+  *   'C' rate_hz(4) mask(1) samples(2)    polling engine settings, as in
+  *                                        the polling firmware
+  *   'R' run(1)                           0 stops capturing, 1 resumes
+  *   'V'                                  report HOST_INFO_WORDS words:
+  *                                        protocol version, HOST_CAP_*
+  *                                        bits, timestamp clock in Hz,
+  *                                        USB transmit queue high-water
+  *                                        mark, glitches suppressed
+  *   'T' rate(4) bytes(2)                 USB_BENCHMARK builds: counter
+  *                                        words per second (0 = as fast
+  *                                        as USB takes them) and largest
+  *                                        transfer (0 = USB_TX_MAX_BYTES)
+  *   'U' channel(1) baud(4) frame(1)      UART_DECODE builds: decode that
+  *                                        channel as UART on the device
+  *                                        and stream its bytes instead
+  *                                        of its edges; channel 0xFF
+  *                                        stops (frame: uart_decode.h)
+  *   'G' type(1) channel(1) value(1)      CAPTURE_TRIGGER builds: hold the
+  *       mask(1) param(4) pre(2)          event stream until a trigger
+  *       post(4)                          fires, keeping the newest pre
+  *                                        ring words, then send post
+  *                                        events (0 = all); see trigger.h
+  *   'd' words(4) ms(4)                   CAPTURE_TRIGGER builds (protocol
+  *                                        6): dump what the armed
+  *                                        trigger holds, TRIG_RECORD's
+  *                                        flight recorder, cut to the
+  *                                        newest words ring words and
+  *                                        ms milliseconds (0: no cut)
+  *   'P' mode(1) cs_channel(1)            CAPTURE_SPI_DMA builds: receive
+  *                                        PB5 (and PB15) with the SPI
+  *                                        peripherals and stream bytes;
+  *                                        mode bit 7 clear stops (mode:
+  *                                        spi_sniff.h)
+  *   'g' ss(1) mask(1) level(1)         SS_GATE builds (protocol 6):
+  *                                        mask the mask's channels'
+  *                                        EXTI lines while channel ss
+  *                                        is not at level (0 active
+  *                                        low), so only the selected
+  *                                        device's transfers interrupt;
+  *                                        ss 0xFF stops
+  *   'I' scl(1) sda(1)                    I2C_SNIFF builds: frame those
+  *                                        channels as I2C on the device
+  *                                        and stream START, STOP and
+  *                                        bytes instead of their edges;
+  *                                        scl 0xFF stops (i2c_sniff.h)
+  *   'W' channel(1) width_ns(4)           GLITCH_FILTER builds: drop
+  *                                        pulses on that channel (0xFF:
+  *                                        all) shorter than width_ns;
+  *                                        0 stops (glitch_filter.h)
+  *   'K' channel(1) rate(4) burst(2)      STORM_LIMIT builds: above rate
+  *                                        edges/s (bursts of burst) that
+  *                                        channel (0xFF: all) sends edge
+  *                                        counts instead; rate 0 stops
+  *                                        (storm_limit.h)
+  *   'E' mask(1)                          edge capture: bit n set keeps
+  *                                        channel n's EXTI line on; the
+  *                                        others stop interrupting
+  *   'H' preset(1)                        timestamp clock: 0 72 MHz, 1 36,
+  *                                        2 18, 3 9, 4 5.14 (power-up),
+  *                                        5 2, 6 1 MHz; restarts the edge
+  *                                        stream and answers as 'V' does
+  *   'N' layout(1)                        EXTI/USB interrupt priorities,
+  *                                        IRQ_LAYOUT_* (irq_timing.h)
+  *   'S'                                  IRQ_TIMING builds: report the
+  *                                        interrupt timing statistics in
+  *                                        the edge stream and clear them
+  *   'Q' mask(1) rate_hz(2)               CHANNEL_MEASURE builds: send
+  *                                        rate_hz frequency and duty
+  *                                        summaries per second of the
+  *                                        channels in mask instead of
+  *                                        their edges; 0 stops
+  *                                        (measure.h)
+  *   'L' ppb(4)                           add a measured clock error
+  *                                        (signed, against the rate 'V'
+  *                                        reports) to the correction kept
+  *                                        in flash, 0x80000000 clears it;
+  *                                        answers as 'V' does
+  *                                        (clock_trim.h)
+  *   'Y' mode(1) period_ms(2)             BOARD_SYNC builds: 0 off, 1
+  *                                        timestamp the shared reference
+  *                                        pulse on PA2, 2 also drive it
+  *                                        every period_ms on PA8
+  *                                        (board_sync.h)
+  *   'J' slot(1)                          DUAL_IMAGE builds: reset into the
+  *                                        interrupt (0) or polling (1)
+  *                                        firmware (boot_slot.h)
+  *   'O' mode(1)                          FLASH_LOG builds: 0 stop logging,
+  *                                        1 erase the flash, 2 log the
+  *                                        edge stream to it, 3 download
+  *                                        the log (flash_log.h)
+  *   'X' bus(1) match(1) mask(1) gap(1)   UART_DECODE or I2C_SNIFF builds
+  *                                        (protocol 6): keep only that
+  *                                        sniffer's transactions whose
+  *                                        address (FILTER_I2C) or first
+  *                                        byte (FILTER_UART, messages
+  *                                        end at gap idle frames) match
+  *                                        under mask, counting the rest
+  *                                        in BUS_FILTER records; mask 0
+  *                                        keeps all (event_format.h)
+  *   'Z' mode(1) channels(1) clock(1)     BOOT_CAPTURE builds (protocol
+  *                                        6): store the preset the next
+  *                                        power-ups capture with before
+  *                                        USB is up, 1 keeping the
+  *                                        first, 2 the newest ring's
+  *                                        worth for the host's first
+  *                                        'M'; 0 clears (boot_capture.h)
+  *   'a' rate_hz(4)                       ANALOG_CAPTURE builds (protocol
+  *                                        6; the upper-case letters are
+  *                                        all taken): sample PA1 this
+  *                                        often beside the edges, as
+  *                                        BUS_ANALOG records; 0 stops
+  *                                        (analog_capture.h)
+  *   'c' mode(1) kib(2)                   FLOW_CREDIT builds (protocol
+  *                                        6): 1 limit the stream to kib
+  *                                        KiB, 2 add kib KiB as the host
+  *                                        consumes, 0 no limit; without
+  *                                        credit the ring holds the
+  *                                        stream, reported in BUS_CREDIT
+  *                                        records (event_ring.h)
+  *   'p' mask(1) levels(1)                PULSE_RECORDS builds (protocol
+  *                                        6): send the pulses of the
+  *                                        mask's channels, high where
+  *                                        levels has the bit, as one
+  *                                        record each instead of two
+  *                                        edges; mask 0 stops
+  *                                        (pulse_record.h)
+  *   's' mode(1)                          CONFIG_STAGE builds (protocol
+  *                                        6): STAGE_BEGIN holds the
+  *                                        settings commands after it in
+  *                                        a shadow block instead of
+  *                                        running them, STAGE_COMMIT
+  *                                        runs them back to back with
+  *                                        the probe edges held, and
+  *                                        marks the swap with a
+  *                                        BUS_RECONFIG record;
+  *                                        STAGE_DISCARD drops them.
+  *                                        'c' grants are not held
+  ******************************************************************************
+  */
+
+#ifndef __HOST_CMD_H
+#define __HOST_CMD_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include "main.h"
+
+#define HOST_CMD_FLUSH  'F'
+#define HOST_CMD_MODE   'M'
+#define HOST_CMD_CONFIG 'C'
+#define HOST_CMD_RUN    'R'
+#define HOST_CMD_INFO   'V'
+#define HOST_CMD_BENCH  'T'
+#define HOST_CMD_UART   'U'
+#define HOST_CMD_TRIGGER 'G'
+#define HOST_CMD_SPI    'P'
+#define HOST_CMD_I2C    'I'
+#define HOST_CMD_GLITCH 'W'
+#define HOST_CMD_CHANNELS 'E'
+#define HOST_CMD_STORM  'K'
+#define HOST_CMD_CLOCK  'H'
+#define HOST_CMD_LAYOUT 'N'
+#define HOST_CMD_STATS  'S'
+#define HOST_CMD_MEASURE 'Q'
+#define HOST_CMD_TRIM   'L'
+#define HOST_CMD_SYNC   'Y'
+#define HOST_CMD_SLOT   'J'
+#define HOST_CMD_FLASH  'O'
+#define HOST_CMD_FILTER 'X'
+#define HOST_CMD_BOOT   'Z'
+#define HOST_CMD_ANALOG 'a'
+#define HOST_CMD_CREDIT 'c'
+#define HOST_CMD_PULSE  'p'
+#define HOST_CMD_STAGE  's'
+#define HOST_CMD_DUMP   'd'
+#define HOST_CMD_GATE   'g'
+
+/* 's' modes */
+#define STAGE_COMMIT  0         // run the staged commands as one change
+#define STAGE_BEGIN   1         // stage the settings commands that follow
+#define STAGE_DISCARD 2         // forget the staged commands
+#define HOST_STAGE_MAX 8        // commands one change holds; more are lost
+
+#define HOST_CMD_QUEUE  8       // commands waiting for the main loop, power of 2
+#define HOST_PROTOCOL_VERSION 6
+#define HOST_INFO_WORDS 5
+
+/* Capability bits of the 'V' reply, the same in both firmwares */
+#define HOST_CAP_EVENTS   (1UL << 0)    // edge event stream
+#define HOST_CAP_POLL     (1UL << 1)    // paced polling blocks
+#define HOST_CAP_DMA      (1UL << 2)    // DMA-paced sampling
+#define HOST_CAP_BURST    (1UL << 3)    // triggered burst capture, 'B'
+#define HOST_CAP_RLE      (1UL << 4)    // run-length blocks
+#define HOST_CAP_STATS    (1UL << 5)    // timing histograms, 'S'
+#define HOST_CAP_FLUSH    (1UL << 6)    // flush policy, 'F'
+#define HOST_CAP_SNAPSHOT (1UL << 7)    // snapshot event format
+#define HOST_CAP_COMPACT  (1UL << 8)    // compact event stream
+#define HOST_CAP_IC_DMA   (1UL << 9)    // CH2 by timer input capture
+#define HOST_CAP_BULK     (1UL << 10)   // vendor-class bulk device
+#define HOST_CAP_FRAMED   (1UL << 11)   // framed event stream
+#define HOST_CAP_BENCH    (1UL << 12)   // USB benchmark pattern, 'T'
+#define HOST_CAP_SOF_SYNC (1UL << 13)   // periodic USB frame/clock pairs
+#define HOST_CAP_ISO      (1UL << 14)   // isochronous stream, alternate setting 1
+#define HOST_CAP_UART     (1UL << 15)   // on-device UART decoding, 'U'
+#define HOST_CAP_TRIGGER  (1UL << 16)   // triggered event stream, 'G'
+#define HOST_CAP_SPI      (1UL << 17)   // SPI sniffing by the SPI peripherals, 'P'
+#define HOST_CAP_I2C      (1UL << 18)   // on-device I2C framing, 'I'
+#define HOST_CAP_GLITCH   (1UL << 19)   // minimum pulse width filter, 'W'
+#define HOST_CAP_CHANNELS (1UL << 20)   // EXTI channel enable mask, 'E'
+#define HOST_CAP_STORM    (1UL << 21)   // per-channel edge rate limit, 'K'
+#define HOST_CAP_CLOCK    (1UL << 22)   // timestamp clock presets, 'H'
+#define HOST_CAP_LAYOUT   (1UL << 23)   // interrupt priority layouts, 'N'
+#define HOST_CAP_MEASURE  (1UL << 24)   // on-device frequency and duty, 'Q'
+#define HOST_CAP_TRIM     (1UL << 25)   // stored clock correction, 'L'
+#define HOST_CAP_WIDE     (1UL << 26)   // 8 or 16 sampled channels, POLL_CHANNELS
+#define HOST_CAP_SYNC     (1UL << 27)   // shared reference pulse between boards, 'Y'
+#define HOST_CAP_DUAL     (1UL << 28)   // both firmwares resident, 'J' switches
+#define HOST_CAP_ADAPTIVE (1UL << 29)   // 'M' 2: edges or poll blocks by the edge rate
+#define HOST_CAP_FLASH_LOG (1UL << 30)  // offline logging to SPI flash, 'O'
+#define HOST_CAP_DECIMATE (1UL << 31)   // min/max window records, 'D' (polling firmware)
+
+/* Stream header: the first bytes of every stream the host starts (see
+ * 'M'), so the host picks its decoder from the stream instead of from
+ * settings that must match the build. Little-endian, STREAM_HEADER_SIZE
+ * bytes; a later version only appends fields, so a host skips size */
+#define STREAM_HEADER_MAGIC   0x4D525453UL  // "STRM"
+#define STREAM_HEADER_VERSION 1
+#define STREAM_HEADER_SIZE    24
+
+#define STREAM_ENCODING_EDGE     1  // one event word per edge, event_format.h
+#define STREAM_ENCODING_SNAPSHOT 2  // one event word per EXTI interrupt
+#define STREAM_ENCODING_BLOCKS   3  // poll sample blocks, found by their magic
+
+#define STREAM_COMPRESSION_NONE    0
+#define STREAM_COMPRESSION_COMPACT 1  // varint time deltas, STREAM_COMPACT
+#define STREAM_COMPRESSION_RLE     2  // run-length sample blocks, POLL_RLE
+#define STREAM_COMPRESSION_PREDICT 3  // compact with predicted edge runs, STREAM_PREDICT
+#define STREAM_COMPRESSION_DECIMATE 4 // window summary blocks, POLL_DECIMATE
+
+#define STREAM_FLAG_FRAMED 0x01       // transfers carry a checked StreamFrame header
+#define STREAM_FLAG_ISO    0x02       // isochronous endpoint: transfers may be lost
+#define STREAM_FLAG_ADAPTIVE 0x04     // 'M' 2: the device may hand over to the other engine
+
+typedef struct
+{
+    uint32_t magic;         // STREAM_HEADER_MAGIC
+    uint8_t version;        // STREAM_HEADER_VERSION
+    uint8_t size;           // STREAM_HEADER_SIZE
+    uint8_t encoding;       // STREAM_ENCODING_*
+    uint8_t compression;    // STREAM_COMPRESSION_*
+    uint8_t channels;       // probe channels the stream carries
+    uint8_t flags;          // STREAM_FLAG_*
+    uint8_t time_bits;      // bits of an event's time field, 32 for blocks
+    uint8_t protocol;       // HOST_PROTOCOL_VERSION
+    uint32_t tick_hz;       // timestamp clock with the stored correction
+    uint32_t capabilities;  // HOST_CAP_* of the build
+    uint32_t check;         // ~ XOR of the words before
+} StreamHeader;
+
+extern volatile uint32_t host_cmd_overruns;
+
+void host_cmd_receive(const uint8_t *buf, uint32_t len);
+void host_cmd_process(void);
+uint32_t host_cmd_capabilities(void);
+void host_stream_header(StreamHeader *header, uint32_t encoding, uint32_t compression,
+                        uint32_t channels, uint32_t flags, uint32_t time_bits, uint32_t tick_hz);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* __HOST_CMD_H */
@@ -0,0 +1,57 @@
+/**
+  ******************************************************************************
+  * @file           : i2c_sniff.h
+  * @brief          : On-device I2C framing of two probe channels
+  ******************************************************************************
+  * With host command 'I' the SCL and SDA channels' edges stop going into
+  * the event ring. The EXTI handler runs them through a small state
+  * machine instead, which pushes one MARKER_BUS record per START, STOP,
+  * address byte and data byte: about 18 edges of a byte and its ACK
+  * become three ring words. A byte record is timed at its first SCL
+  * rise, START and STOP at their SDA edge, as pipeline.I2cStream does.
+  *
+  * Host command 'X' FILTER_I2C match mask keeps only the transactions
+  * whose 7-bit address has match's bits under mask (mask 0 keeps all).
+  * A START waits for its address; a dropped transaction pushes nothing
+  * up to its STOP or the next START, which decides anew. Dropped
+  * transactions are counted and reported as one BUS_FILTER record ahead
+  * of the next kept one, or by i2c_sniff_filter_poll.
+  *
+  * Both lines raising EXTI in one interrupt (CAPTURE_FAST_EXTI) are
+  * ordered the way the bus allows: SDA before a rising SCL (setup) and
+  * after a falling one (hold). Every edge still costs an interrupt, so
+  * the bus rate is bounded by the EXTI handler, not by the ring or USB.
+  ******************************************************************************
+  */
+
+#ifndef __I2C_SNIFF_H
+#define __I2C_SNIFF_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include "main.h"
+
+#define I2C_SNIFF_OFF 0xFF          // 'I' channel that turns framing off
+
+/* Event in bits 15-8 of a BUS_I2C data word; the byte is in bits 7-0 */
+#define I2C_EVENT_START   0         // flag: repeated START
+#define I2C_EVENT_STOP    1
+#define I2C_EVENT_ADDRESS 2         // byte: address << 1 | R/W; flag: ACK
+#define I2C_EVENT_DATA    3         // flag: ACK
+#define I2C_FLAG 0x01               // flag in bits 23-16
+
+extern volatile uint32_t i2c_sniff_mask;  // SCL and SDA channel bits while framing
+
+void i2c_sniff_configure(uint32_t scl_channel, uint32_t sda_channel);
+void i2c_sniff_edges(uint32_t levels, uint32_t changed, uint32_t time);
+void i2c_sniff_reset(void);
+void i2c_sniff_filter(uint32_t match, uint32_t mask);
+void i2c_sniff_filter_poll(uint32_t now, uint32_t ticks);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* __I2C_SNIFF_H */
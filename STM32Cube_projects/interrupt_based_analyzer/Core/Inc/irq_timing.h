@@ -0,0 +1,88 @@
+/**
+  ******************************************************************************
+  * @file           : irq_timing.h
+  * @brief          : Interrupt and hot-path timing statistics and NVIC
+  *                   priority layouts
+  ******************************************************************************
+  * CubeMX gives the EXTI and USB interrupts the same priority, so an edge
+  * that arrives while the USB handler runs waits for it to finish before
+  * its timestamp is taken. Host command 'N' picks a priority layout; with
+  * IRQ_TIMING the handlers are timed with DWT->CYCCNT and host command
+  * 'S' reports, since the previous report:
+  *   - EXTI handler entry to exit, and entry to the timestamp read
+  *   - USB handler entry to exit
+  *   - the main loop's flush: compact encoding copy and transfer start
+  *   - each CDC_Transmit_FS call, from the main loop or the USB handler
+  *   - each packet's copy into USB packet memory (USB_WritePMA, see
+  *     usbd_conf.c), from either; USB_FAST_PMA 0 times the HAL's copy
+  *   - USB handler exits with an EXTI line pending: edges USB held back,
+  *     and the longest such handler, a bound on how long they waited
+  * each timer as count, min, max and mean cycles and a log2 histogram.
+  *
+  * The report is a run of MARKER_BUS records of kind BUS_STATS, all at
+  * the report's clock time, data byte | aux << 8 = the low 16 bits of an
+  * IRQ_ITEM_* value and flags = the item. A value above 16 bits is
+  * followed by a record of the same item with IRQ_ITEM_HIGH set holding
+  * its bits 31-16. Empty histogram bins are left out; IRQ_ITEM_END comes
+  * last.
+  ******************************************************************************
+  */
+
+#ifndef __IRQ_TIMING_H
+#define __IRQ_TIMING_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include "main.h"
+
+/* 'N' layouts; preemption priorities, NVIC_PRIORITYGROUP_4 */
+#define IRQ_LAYOUT_FLAT        0    // CubeMX: EXTI and USB at 0, neither preempts the other
+#define IRQ_LAYOUT_EDGES_FIRST 1    // EXTI at 0 preempts USB at 1
+#define IRQ_LAYOUT_USB_FIRST   2    // USB at 0 preempts EXTI at 1, for comparison
+
+#define IRQ_TIMER_EXTI  0           // EXTI handler entry to exit
+#define IRQ_TIMER_STAMP 1           // EXTI handler entry to the timestamp read
+#define IRQ_TIMER_USB   2           // USB handler entry to exit
+#define IRQ_TIMER_FLUSH 3           // main loop: ring copy and transfer start
+#define IRQ_TIMER_TRANSMIT 4        // one CDC_Transmit_FS call
+#define IRQ_TIMER_PMA   5           // one USB_WritePMA packet copy
+#define IRQ_TIMERS      6
+#define IRQ_TIMING_BINS 16          // bin k: 2^(k-1) to 2^k - 1 cycles, the last one open
+
+/* BUS_STATS record items */
+#define IRQ_ITEM_END         0      // closes the report; value = the layout
+#define IRQ_ITEM_BLOCKED     1      // USB handler exits with an EXTI line pending
+#define IRQ_ITEM_BLOCKED_MAX 2      // cycles of the longest of those handlers
+#define IRQ_ITEM_TIMER       4      // + IRQ_ITEM_STRIDE * IRQ_TIMER_*: count, min, max,
+#define IRQ_ITEM_STRIDE      20     // mean, then the IRQ_TIMING_BINS bins
+#define IRQ_ITEM_HIGH        0x80   // bits 31-16 of the item's value
+
+void irq_set_layout(uint32_t layout);
+
+#if IRQ_TIMING
+extern volatile uint32_t irq_exti_entry;    // DWT->CYCCNT at the EXTI handler's entry
+extern volatile uint32_t irq_stamp_open;    // that handler has not read the clock yet
+
+/* First thing in the EXTI handlers */
+static inline void irq_timing_exti_enter(void)
+{
+    irq_exti_entry = DWT->CYCCNT;
+    irq_stamp_open = 1;
+}
+
+void irq_timing_init(void);
+void irq_timing_stamp(void);
+void irq_timing_exti_exit(void);
+void irq_timing_usb(uint32_t start);
+void irq_timing_add(uint32_t timer, uint32_t start);
+void irq_timing_send(void);
+uint32_t irq_timing_exti_peak(void);
+#endif
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* __IRQ_TIMING_H */
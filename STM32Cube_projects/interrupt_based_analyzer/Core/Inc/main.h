@@ -41,7 +41,10 @@ extern "C" {
 
 /* Exported constants --------------------------------------------------------*/
 /* USER CODE BEGIN EC */
-
+/* Capture engines, see capture_set_mode */
+#define CAPTURE_MODE_EVENTS 0   // EXTI edge events timestamped by TIM2/TIM3
+#define CAPTURE_MODE_POLL   1   // DWT-paced sample blocks (poll_capture.c)
+#define CAPTURE_MODE_ADAPTIVE 2 // 'M' only: edges while the rate allows, blocks above ADAPTIVE_RATE
 /* USER CODE END EC */
 
 /* Exported macro ------------------------------------------------------------*/
@@ -53,7 +56,47 @@ extern "C" {
 void Error_Handler(void);
 
 /* USER CODE BEGIN EFP */
-
+uint32_t get_32bit_timer(void);
+uint32_t capture_clock_hz(void);
+uint32_t extend_16bit_timer(uint16_t captured, uint32_t now);
+void capture_push_event(uint32_t data);
+void capture_push_record(uint32_t marker, const uint32_t *words, uint32_t count);
+void capture_push_reply(uint32_t type, const uint32_t *words, uint32_t count);
+void capture_exti_fast(void);
+void capture_check_epoch(uint32_t time);
+void capture_tx_complete(void);
+void capture_control_complete(void);
+void capture_wake(void);
+void capture_wake_timer_irq(void);
+void capture_set_flush_policy(uint32_t mode, uint32_t batch, uint32_t latency_us);
+void capture_set_mode(uint32_t mode);
+void capture_set_running(uint32_t run);
+void capture_set_clock(uint32_t preset);
+void capture_send_irq_timing(void);
+void capture_send_info(void);
+void capture_echo_command(const uint8_t *cmd, uint32_t len);
+uint32_t capture_swap_begin(void);
+void capture_swap_end(uint32_t start, uint32_t commands);
+void capture_bench_configure(uint32_t rate, uint32_t bytes);
+void capture_sof(uint32_t frame);
+void capture_set_uart_decode(uint32_t channel, uint32_t baud, uint32_t frame);
+void capture_set_analog(uint32_t rate_hz);
+void capture_set_credit(uint32_t mode, uint32_t kib);
+void capture_set_trigger(uint32_t type, uint32_t channel, uint32_t value, uint32_t mask,
+                         uint32_t param, uint32_t pre, uint32_t post);
+void capture_dump(uint32_t words, uint32_t ms);
+void capture_set_spi_sniff(uint32_t mode, uint32_t cs_channel);
+void capture_set_i2c_sniff(uint32_t scl_channel, uint32_t sda_channel);
+void capture_set_filter(uint32_t bus, uint32_t match, uint32_t mask, uint32_t gap);
+void capture_set_glitch_filter(uint32_t channel, uint32_t width_ns);
+void capture_set_storm_limit(uint32_t channel, uint32_t rate, uint32_t burst);
+void capture_set_measure(uint32_t mask, uint32_t rate);
+void capture_set_pulses(uint32_t mask, uint32_t levels);
+void capture_store_edges(uint32_t levels, uint32_t changed, uint32_t time);
+void capture_set_flash_log(uint32_t mode);
+void capture_set_channels(uint32_t mask);
+void capture_set_ss_gate(uint32_t ss_channel, uint32_t mask, uint32_t level);
+void capture_apply_channels(void);
 /* USER CODE END EFP */
 
 /* Private defines -----------------------------------------------------------*/
@@ -79,7 +122,248 @@ void Error_Handler(void);
 #define CH1_EXTI_IRQn EXTI9_5_IRQn
 
 /* USER CODE BEGIN Private defines */
-
+/* Build profile: picks the defaults of the capture geometry below
+ * (transfer size, start-up flush policy, timestamp clock); each one can
+ * still be overridden with -D. main.c checks the result at compile time */
+#define PROFILE_GENERAL     0   // 1 KB transfers, 16 events or 2 ms, 5.14 MHz clock
+#define PROFILE_LOW_LATENCY 1   // 256-byte transfers sent within 250 us
+#define PROFILE_DEEP_BUFFER 2   // 4 KB transfers, 512 events or 20 ms: fewest transfers
+#define PROFILE_MAX_RATE    3   // 72 MHz clock, 4 KB transfers of 256 events or 2 ms
+#ifndef BUILD_PROFILE
+#define BUILD_PROFILE PROFILE_GENERAL
+#endif
+#ifndef CAPTURE_FAST_EXTI
+#define CAPTURE_FAST_EXTI 1    // 1: EXTI IRQs bypass the HAL dispatcher (capture_exti_fast)
+#endif
+#ifndef CAPTURE_CLOCK_DWT
+#define CAPTURE_CLOCK_DWT 0    // 1: timestamp with DWT->CYCCNT (72 MHz, one core read) instead of TIM3:TIM2
+#endif
+#ifndef EVENT_FORMAT_SNAPSHOT
+#define EVENT_FORMAT_SNAPSHOT 0  // 1: one event per IRQ: levels(4) | changed mask(4) | time(24)
+#endif
+#ifndef CAPTURE_PIN_CH0
+#define CAPTURE_PIN_CH0 4  // GPIOB pin of channel 0 (PB4-PB15); the V1 board's PB4-PB7 are the defaults (pin_map.h)
+#endif
+#ifndef CAPTURE_PIN_CH1
+#define CAPTURE_PIN_CH1 5
+#endif
+#ifndef CAPTURE_PIN_CH2
+#define CAPTURE_PIN_CH2 6
+#endif
+#ifndef CAPTURE_PIN_CH3
+#define CAPTURE_PIN_CH3 7
+#endif
+#define CAPTURE_PINS_DEFAULT (CAPTURE_PIN_CH0 == 4 && CAPTURE_PIN_CH1 == 5 && CAPTURE_PIN_CH2 == 6 && CAPTURE_PIN_CH3 == 7)
+#define CAPTURE_EXTI_LINES ((1UL << CAPTURE_PIN_CH0) | (1UL << CAPTURE_PIN_CH1) | \
+                            (1UL << CAPTURE_PIN_CH2) | (1UL << CAPTURE_PIN_CH3))  // EXTI lines of the probe pins
+#ifndef CAPTURE_EXTI_PASSES
+#define CAPTURE_EXTI_PASSES 8  // passes over the pending lines per EXTI entry at most; later edges re-enter
+#endif
+#ifndef CAPTURE_IC_DMA
+#define CAPTURE_IC_DMA 0   // 1: capture CH2 (PB6) with TIM4 input capture + DMA instead of EXTI
+#endif
+#ifndef CAPTURE_SPI_DMA
+#define CAPTURE_SPI_DMA 0   // 1: host command 'P' sniffs SPI on PB5 with SPI1 + DMA; SCK wired to PB3 (spi_sniff.h)
+#endif
+#ifndef SS_GATE
+#define SS_GATE 1   // 1: host command 'g' masks the SPI clock and data channels' EXTI lines while chip select is deasserted
+#endif
+#ifndef CAPTURE_RING_EVENTS
+#define CAPTURE_RING_EVENTS 0   // event ring depth (power of 2); 0: linker sizes it to free SRAM
+#endif
+#ifndef USB_TX_MAX_BYTES
+#if BUILD_PROFILE == PROFILE_LOW_LATENCY
+#define USB_TX_MAX_BYTES 256
+#elif BUILD_PROFILE == PROFILE_DEEP_BUFFER || BUILD_PROFILE == PROFILE_MAX_RATE
+#define USB_TX_MAX_BYTES 4096
+#else
+#define USB_TX_MAX_BYTES 1024   // largest CDC transfer; sent as back-to-back 64-byte packets
+#endif
+#endif
+#ifndef EVENT_CHUNK_SIZE
+#if BUILD_PROFILE == PROFILE_LOW_LATENCY
+#define EVENT_CHUNK_SIZE 1
+#elif BUILD_PROFILE == PROFILE_DEEP_BUFFER
+#define EVENT_CHUNK_SIZE 512
+#elif BUILD_PROFILE == PROFILE_MAX_RATE
+#define EVENT_CHUNK_SIZE 256
+#else
+#define EVENT_CHUNK_SIZE 16   // start-up flush batch in events until host command 'F' (16 * 4 = 64 bytes)
+#endif
+#endif
+#ifndef USB_SEND_INTERVAL_US
+#if BUILD_PROFILE == PROFILE_LOW_LATENCY
+#define USB_SEND_INTERVAL_US 250
+#elif BUILD_PROFILE == PROFILE_DEEP_BUFFER
+#define USB_SEND_INTERVAL_US 20000
+#else
+#define USB_SEND_INTERVAL_US 2000   // start-up flush latency bound until host command 'F'
+#endif
+#endif
+#ifndef CAPTURE_CLOCK_PRESET
+#if BUILD_PROFILE == PROFILE_MAX_RATE
+#define CAPTURE_CLOCK_PRESET 0
+#else
+#define CAPTURE_CLOCK_PRESET 4   // start-up TIM2 clock, 'H' preset: 4 = 5.14 MHz as in the .ioc, 0 = 72 MHz
+#endif
+#endif
+#ifndef STREAM_COMPACT
+#define STREAM_COMPACT 0   // 1: send varint time-delta records instead of 32-bit words
+#endif
+#ifndef STREAM_PREDICT
+#define STREAM_PREDICT 0   // 1: code predictable compact edges as residual runs (event_format.c)
+#endif
+#ifndef STREAM_FRAMED
+#define STREAM_FRAMED 0   // 1: wrap each USB transfer in a header with stream offset and CRC-32
+#endif
+#ifndef STREAM_CRC_DMA
+#define STREAM_CRC_DMA 1   // 1: DMA1 channel 6 feeds the framed stream's CRC unit (event_format.c)
+#endif
+#ifndef USB_VENDOR_CLASS
+#define USB_VENDOR_CLASS 0   // 1: enumerate as a WinUSB/libusb bulk device instead of CDC ACM
+#endif
+#ifndef USB_IN_DOUBLE_BUFFER
+#define USB_IN_DOUBLE_BUFFER 0   // 1: double-buffer the data IN endpoint in PMA (data OUT moves to EP3)
+#endif
+#ifndef USB_ISO_STREAM
+#define USB_ISO_STREAM 0   // 1: stream on an isochronous IN endpoint (alternate setting 1): fixed bandwidth, lossy
+#endif
+#ifndef USB_STRIPE_EPS
+#define USB_STRIPE_EPS 1   // 2-3: stripe each transfer across that many bulk IN endpoints (usbd_vendor.h)
+#endif
+#ifndef USB_CONTROL_EP
+#define USB_CONTROL_EP 0   // 1: replies and telemetry on their own interrupt IN endpoint (interface 1), not in the stream
+#endif
+#ifndef USB_FAST_PMA
+#define USB_FAST_PMA 1   // 1: copy word-aligned IN packets into packet memory a word at a time (usbd_conf.c)
+#endif
+#ifndef USB_LEAN_IRQ
+#define USB_LEAN_IRQ 1   // 1: the USB interrupt loads a bulk IN transfer's next packet itself, bypassing the HAL (usbd_conf.c)
+#endif
+#ifndef USB_TX_QUEUE
+#define USB_TX_QUEUE 4   // transfers CDC_Transmit_FS holds, counting the one on the bus; power of 2, >= 2
+#endif
+#ifndef USB_BENCHMARK
+#define USB_BENCHMARK 0   // 1: no capture; stream a counter pattern for usb_benchmark.py
+#endif
+#ifndef UART_DECODE
+#define UART_DECODE 1   // 1: host command 'U' decodes one channel as UART on the device
+#endif
+#ifndef I2C_SNIFF
+#define I2C_SNIFF 1   // 1: host command 'I' frames two channels as I2C on the device (i2c_sniff.h)
+#endif
+#ifndef GLITCH_FILTER
+#define GLITCH_FILTER 1   // 1: host command 'W' drops pulses shorter than a per-channel width (glitch_filter.h)
+#endif
+#ifndef STORM_LIMIT
+#define STORM_LIMIT 1   // 1: host command 'K' limits each channel's edge rate (storm_limit.h)
+#endif
+#ifndef STORM_WINDOW_US
+#define STORM_WINDOW_US 1000   // a storming channel sends one edge count per window
+#endif
+#ifndef CHANNEL_MEASURE
+#define CHANNEL_MEASURE 1   // 1: host command 'Q' sends per-channel frequency and duty summaries (measure.h)
+#endif
+#ifndef IRQ_TIMING
+#define IRQ_TIMING 0   // 1: time the EXTI and USB handlers, reported on host command 'S' (irq_timing.h)
+#endif
+#ifndef IRQ_LAYOUT
+#define IRQ_LAYOUT 0   // start-up NVIC priority layout, IRQ_LAYOUT_* of irq_timing.h; 'N' changes it
+#endif
+#ifndef CAPTURE_TRIGGER
+#define CAPTURE_TRIGGER 1   // 1: host command 'G' holds the stream until a trigger (trigger.h)
+#endif
+#ifndef RECORDER_BUTTON
+#define RECORDER_BUTTON 0   // 1: a press of a button from PA3 to GND dumps the flight recorder, RECORDER_BUTTON_MS of it (trigger.h)
+#endif
+#ifndef RECORDER_BUTTON_MS
+#define RECORDER_BUTTON_MS 0   // milliseconds of history the button dumps; 0: all the ring holds
+#endif
+#ifndef TRIGGER_OUT
+#define TRIGGER_OUT 0   // PA0 goes high when the trigger fires; 1: from the EXTI ISR, 2: TIM2 CH1 compare, TRIGGER_OUT_DELAY after the edge (trigger.h)
+#endif
+#ifndef TRIGGER_OUT_DELAY
+#define TRIGGER_OUT_DELAY 128   // TRIGGER_OUT 2: ticks from the trigger edge's timestamp to PA0 rising
+#endif
+#ifndef HEALTH_REPORT_MS
+#define HEALTH_REPORT_MS 100   // link health counters in the capture stream this often, 1..500; 0: none
+#endif
+#ifndef LEVEL_SNAPSHOT_MS
+#define LEVEL_SNAPSHOT_MS 100   // probe pin levels in the capture stream this often, and after drops; 0: none
+#endif
+#ifndef LATENCY_PROBE_MS
+#define LATENCY_PROBE_MS 0   // e.g. 200: toggle PA0, wired to a probe channel, this often and stamp the toggle and the transfer that carried its edge (BUS_LATENCY); 0: none
+#endif
+#ifndef CONFIG_ECHO
+#define CONFIG_ECHO 1   // 1: echo each settings command the device ran into the capture stream (BUS_CONFIG)
+#endif
+#ifndef CONFIG_STAGE
+#define CONFIG_STAGE 1   // 1: host command 's' stages settings commands and swaps them in together, edges held (host_cmd.h)
+#endif
+#ifndef BOARD_SYNC
+#define BOARD_SYNC 0   // 1: host command 'Y' drives or timestamps a reference pulse shared by several boards (board_sync.h)
+#endif
+#ifndef FLASH_LOG
+#define FLASH_LOG 0   // 1: host command 'O' logs the compact edge stream to SPI NOR flash on SPI1 (flash_log.h)
+#endif
+#ifndef FLASH_LOG_BATCH
+#define FLASH_LOG_BATCH 0   // e.g. 512: while logging, the ring goes to flash once it holds this many events, the chip in deep power-down between batches (flash_log.h); 0: as it fills
+#endif
+#ifndef FLASH_LOG_AUTOSTART
+#define FLASH_LOG_AUTOSTART 0   // 1: FLASH_LOG builds start logging at power-up when the flash is erased
+#endif
+#ifndef BOOT_CAPTURE
+#define BOOT_CAPTURE 1   // 1: a preset stored with host command 'Z' captures from power-up, held for the host (boot_capture.h)
+#endif
+#ifndef HOST_DTR_GATE
+#define HOST_DTR_GATE 0   // 1: while no reader holds the CDC port's DTR, the ring keeps the newest edges for the host's next 'M'
+#endif
+#ifndef ANALOG_CAPTURE
+#define ANALOG_CAPTURE 0   // 1: host command 'a' samples PA1 with ADC1 + DMA beside the edges, on TIM1 (analog_capture.h)
+#endif
+#ifndef OLED_STATUS
+#define OLED_STATUS 0   // 1: show rates, drops, ring fill and UART bytes on an I2C OLED on PB10/PB11 (oled_status.h)
+#endif
+#ifndef OLED_REFRESH_MS
+#define OLED_REFRESH_MS 250   // OLED_STATUS: a new frame at most this often
+#endif
+#ifndef FLOW_CREDIT
+#define FLOW_CREDIT 1   // 1: host command 'c' grants the bytes the edge stream may send; without credit the ring holds them (event_ring.h)
+#endif
+#ifndef OVERLOAD_PAIRING
+#define OVERLOAD_PAIRING 0   // 1: past 3/4 of the ring, edges pair up two to a word on a coarser clock until it drains to 1/4 (event_format.h)
+#endif
+#ifndef PULSE_RECORDS
+#define PULSE_RECORDS 0   // 1: host command 'p' sends a channel's pulses as one word each instead of two edges (pulse_record.h)
+#endif
+#ifndef OVERLOAD_QUANTUM_BITS
+#define OVERLOAD_QUANTUM_BITS 8   // OVERLOAD_PAIRING: paired edges keep time in 2^n tick steps, the second up to 2^(n-4) - 1 steps later
+#endif
+#ifndef DUAL_IMAGE
+#define DUAL_IMAGE 0   // 1: slot A of the two-image flash layout, link with STM32F103C8TX_FLASH_SLOT.ld (boot_slot.h)
+#endif
+#ifndef RAM_HOT_PATHS
+#define RAM_HOT_PATHS 1   // 1: run the EXTI handlers and the ring drain from SRAM; the ring gets what is left
+#endif
+#ifndef ADAPTIVE_RATE
+#define ADAPTIVE_RATE 200000   // 'M' 2: ring words per second above which edges hand over to poll blocks; 0: no 'M' 2
+#endif
+#ifndef ADAPTIVE_WINDOW_MS
+#define ADAPTIVE_WINDOW_MS 20   // 'M' 2: the rate is judged over windows this long
+#endif
+// the host finds the handoff in the raw ring words, so not with compact or framed streams
+#define ADAPTIVE_CAPTURE (ADAPTIVE_RATE && !USB_BENCHMARK && !STREAM_COMPACT && !STREAM_FRAMED)
+#if RAM_HOT_PATHS
+#define HOT_PATH __attribute__((section(".RamFunc")))   // copied to SRAM with .data, no flash wait states
+#else
+#define HOT_PATH
+#endif
+#ifndef MAIN_LOOP_SLEEP
+#define MAIN_LOOP_SLEEP 0   // 1: the main loop sleeps (WFI) until USB, the ring, the flush timer or SysTick has work for it
+#endif
+#ifndef SOF_SYNC_FRAMES
+#define SOF_SYNC_FRAMES 100   // USB frames (1 ms) between in-band SOF/clock pairs; 0: none
+#endif
 /* USER CODE END Private defines */
 
 #ifdef __cplusplus
@@ -0,0 +1,55 @@
+/**
+  ******************************************************************************
+  * @file           : measure.h
+  * @brief          : On-device frequency, duty cycle and edge count of probe
+  *                   channels
+  ******************************************************************************
+  * Host command 'Q' mask(1) rate_hz(2) measures the channels in mask
+  * instead of streaming their edges: the EXTI handler adds each edge to
+  * the channel's counters, and every 1/rate_hz s the main loop sends one
+  * summary per channel, four MARKER_BUS records of kind BUS_MEASURE at
+  * the window's end time:
+  *   data = value(20) | MEASURE_FIELD_* << 20 | channel << 22 | kind << 24
+  * The rising edge count, the ticks the channel was high, the ticks from
+  * its first to its last rising edge and, last, the window length: the
+  * host gets the frequency from the span and duty from the high time. A
+  * window is at most MEASURE_MAX_TICKS long, so every value fits.
+  *
+  * With mask bit MEASURE_CH2_TIMER (not in CAPTURE_IC_DMA builds) TIM4
+  * counts CH2's (PB6) rising edges in hardware, up to about 36 MHz: its
+  * EXTI line goes off and its summary has no high time or span. The
+  * main loop folds the 16-bit counter into the count, so it must come
+  * round within 65536 edges.
+  ******************************************************************************
+  */
+
+#ifndef __MEASURE_H
+#define __MEASURE_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include "main.h"
+
+#define MEASURE_CH2_TIMER 0x10          // 'Q' mask: count CH2 with TIM4
+#define MEASURE_MAX_TICKS 0xFFFFF       // longest window, the 20-bit value field
+
+#define MEASURE_FIELD_RISES  0          // rising edges in the window
+#define MEASURE_FIELD_HIGH   1          // ticks the channel was high
+#define MEASURE_FIELD_SPAN   2          // ticks from the first to the last rising edge
+#define MEASURE_FIELD_WINDOW 3          // window length in ticks; ends the summary
+
+extern volatile uint32_t measure_mask;  // bit n set while channel n is measured by EXTI
+
+void measure_configure(uint32_t mask, uint32_t window_ticks);
+void measure_edges(uint32_t levels, uint32_t changed, uint32_t time);
+void measure_poll(uint32_t now);
+void measure_reset(void);
+uint32_t measure_lines(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* __MEASURE_H */
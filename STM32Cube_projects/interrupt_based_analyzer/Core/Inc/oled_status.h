@@ -0,0 +1,52 @@
+/**
+  ******************************************************************************
+  * @file           : oled_status.h
+  * @brief          : Live status on a 128x64 I2C OLED
+  ******************************************************************************
+  * With OLED_STATUS the board shows its own state on an SSD1306 or
+  * SSD1309 128x64 OLED (the WEA012864D of the V2 notes, in I2C mode) at
+  * OLED_ADDRESS on I2C2: PB10 SCL, PB11 SDA, 400 kHz. Eight text lines of
+  * 21 characters: the engine and whether it runs, ring words per second,
+  * drops since power-up and in the last period, ring fill and its peak,
+  * and the latest bytes the UART decoder completed, printable ones as
+  * themselves and the others as '.'.
+  *
+  * Nothing of it runs in an interrupt, and the EXTI and USB handlers
+  * never wait for it. oled_status_poll, from the main loop, advances one
+  * step of a transfer at a time by the I2C flags; the bytes themselves
+  * move by DMA1 channel 4 (I2C2_TX) at the lowest DMA priority. A frame
+  * starts every OLED_REFRESH_MS at most, and only while the ring is under
+  * a quarter full; it goes out as one command transfer and eight 128-byte
+  * pages, each rendered from the text just before it is sent, so the
+  * framebuffer is one page. The UART decoder's only cost is a byte store
+  * per frame it completes (oled_status_uart).
+  *
+  * A display that does not acknowledge its address at start-up is taken
+  * as absent and left alone until reset.
+  ******************************************************************************
+  */
+
+#ifndef __OLED_STATUS_H
+#define __OLED_STATUS_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include "main.h"
+
+#define OLED_ADDRESS    0x3C            // 7-bit; 0x3D with the SA0 pin high
+#define OLED_WIDTH      128
+#define OLED_PAGES      8               // 8-pixel rows, one text line each
+#define OLED_COLUMNS    21              // 6-pixel characters per line
+#define OLED_UART_BYTES 64              // UART bytes kept, a power of 2
+
+void oled_status_init(void);
+void oled_status_poll(uint32_t mode, uint32_t running);
+void oled_status_uart(uint32_t value, uint32_t status);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* __OLED_STATUS_H */
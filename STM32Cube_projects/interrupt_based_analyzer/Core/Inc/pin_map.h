@@ -0,0 +1,66 @@
+/**
+  ******************************************************************************
+  * @file           : pin_map.h
+  * @brief          : Channel-to-pin lookup tables of the capture paths
+  ******************************************************************************
+  * CAPTURE_PIN_CH0..CAPTURE_PIN_CH3 in main.h name the GPIOB pin of each
+  * channel; the V1 board's PB4-PB7 is the default. pin_map_init builds
+  * two 256-entry tables from them at start-up, one per byte of a GPIOB
+  * or EXTI word, so any pending-line mask or IDR read becomes channel
+  * bits with two loads and an OR, on any assignment and without a
+  * branch: pin_map_channels(EXTI->PR) is the channels with an edge,
+  * pin_map_channels(GPIOB->IDR) their levels. pin_map_lines goes the
+  * other way, from channel bits to the lines to unmask.
+  *
+  * The pins must be PB4-PB15 so the edges arrive on the EXTI4, EXTI9_5
+  * and EXTI15_10 vectors; pin_map_irqs and pin_map_irq_priority set
+  * whichever of them the assignment uses. The HAL dispatcher and the
+  * peripheral paths that take over one pin (CAPTURE_IC_DMA,
+  * CAPTURE_SPI_DMA, CHANNEL_MEASURE) keep the default assignment.
+  ******************************************************************************
+  */
+
+#ifndef __PIN_MAP_H
+#define __PIN_MAP_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include "main.h"
+
+extern uint8_t pin_map_low[256];        // GPIOB pins 7-0 -> channel bits
+extern uint8_t pin_map_high[256];       // GPIOB pins 15-8 -> channel bits
+extern uint16_t pin_map_line[16];       // channel bits -> GPIOB pins / EXTI lines
+
+/**
+ * @brief Channel bits of a GPIOB pin or EXTI line mask
+ * @param pins - GPIOB->IDR, EXTI->PR or a GPIO_PIN_x mask
+ * @retval bit n set where channel n's pin is set
+ */
+static inline uint32_t pin_map_channels(uint32_t pins)
+{
+    return pin_map_low[pins & 0xFF] | pin_map_high[(pins >> 8) & 0xFF];
+}
+
+/**
+ * @brief GPIOB pins (EXTI lines) of a set of channels
+ * @param channels - bit n set for channel n
+ * @retval the pins' mask
+ */
+static inline uint32_t pin_map_lines(uint32_t channels)
+{
+    return pin_map_line[channels & 0x0F];
+}
+
+void pin_map_init(void);
+void pin_map_irqs(uint32_t enable);
+void pin_map_irqs_hold(uint32_t hold);
+void pin_map_irq_priority(uint32_t priority);
+uint32_t pin_map_irq_pending(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* __PIN_MAP_H */
@@ -0,0 +1,54 @@
+/**
+  ******************************************************************************
+  * @file           : poll_capture.h
+  * @brief          : Paced polling capture engine of the combined image
+  ******************************************************************************
+  * Host command 'M' 1 parks the edge engine and hands the main loop to
+  * this one: GPIOB->IDR is sampled on a DWT->CYCCNT grid and streamed as
+  * the blocks of the polling_based_analyzer firmware (20-byte header,
+  * samples packed 1, 2 or 4 bits wide, fixups for late samples), so
+  * polling_plotter.py reads either image. The two block buffers are
+  * carved out of the event ring, which is idle while polling.
+  *
+  * DMA-paced sampling, bursts and RLE blocks stay in the dedicated
+  * polling firmware: TIM2 is the edge timebase here and the ring is
+  * too small for burst windows.
+  ******************************************************************************
+  */
+
+#ifndef __POLL_CAPTURE_H
+#define __POLL_CAPTURE_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include "main.h"
+
+#define POLL_BLOCK_MAGIC     0xB10C  // BLOCK_MAGIC of the polling firmware
+#define POLL_BLOCK_MAGIC_INFO 0xB111 // BLOCK_MAGIC_INFO, reply to 'V'
+#define POLL_BLOCK_MAGIC_SYNC 0xB112 // BLOCK_MAGIC_SYNC, USB frame/clock pair
+#define POLL_BLOCK_MAGIC_HEADER 0xB114 // BLOCK_MAGIC_HEADER, StreamHeader (host_cmd.h)
+#define POLL_BLOCK_MAGIC_HANDOFF 0xB115 // 'M' 2: edge clock time, CYCCNT, engine after
+#define POLL_HANDOFF_WORDS   3
+#define POLL_BLOCK_DATA      1024    // packed sample bytes per block
+#define POLL_BLOCK_FIXUPS    32      // late samples listed per block
+#define POLL_DEFAULT_PERIOD  72      // CPU cycles per sample (1 MHz)
+#define POLL_MIN_PERIOD      36      // cycles the polling loop needs per sample
+#define POLL_MAX_LATE        1024    // cycles behind its grid the loop may catch up
+#define POLL_FIXUP_LATE      8       // cycles late a sample gets a fixup
+
+uint32_t poll_capture_start(void *mem, uint32_t bytes);
+uint32_t poll_capture_run(void);
+void poll_capture_tx_complete(void);
+void poll_configure(uint32_t rate_hz, uint32_t mask, uint32_t samples);
+void poll_capture_send_info(const uint32_t *words, uint32_t count);
+void poll_capture_send_sync(const uint32_t *words, uint32_t count);
+void poll_capture_send_header(const uint32_t *words, uint32_t count);
+void poll_capture_send_handoff(const uint32_t *words, uint32_t count);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* __POLL_CAPTURE_H */
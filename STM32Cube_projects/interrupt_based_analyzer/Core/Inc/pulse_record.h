@@ -0,0 +1,70 @@
+/**
+  ******************************************************************************
+  * @file           : pulse_record.h
+  * @brief          : One record per pulse on pulse-oriented channels
+  ******************************************************************************
+  * Host command 'p' names channels whose signal is pulses: a step clock,
+  * a PWM output, a sensor's echo. Their edges stop going into the ring
+  * one by one; the leading edge of a pulse is held, and at its trailing
+  * edge the pulse goes out as one edge-format word:
+  *   bit 31 level of the pulse | bits 30-29 channel | bits 28-16 width
+  *   in ticks | bits 15-0 low 16 bits of the trailing edge's time
+  * so a pulse train costs the ring and the link half the words.
+  *
+  * The word has no room for a full time: the host places its end after
+  * the channel's previous record, the anchor, as the one time with those
+  * low bits up to 0xFFFF ticks later. When that cannot be trusted the
+  * pulse goes as a MARKER_BUS record of kind BUS_PULSE instead, which
+  * carries the full time and sets the anchor:
+  *  - the pulse is wider than PULSE_WORD_WIDTH ticks, or ends more than
+  *    0xFFFF ticks after the anchor;
+  *  - the ring lost events since the channel's last record, or did not
+  *    take that record;
+  *  - a trigger is armed or arming, so the ring may trim the anchor
+  *    ahead of the window marker;
+  *  - PULSE_SYNC_EVERY words went out since the last one, so a host that
+  *    lost transfers of a lossy stream finds its place again.
+  * A host that loses a channel's anchor (a drop or window marker) skips
+  * its pulse words until the next BUS_PULSE.
+  *
+  * BUS_PULSE data: width in bits 18-0, PULSE_FLAG_* in bits 21-19, the
+  * channel in bits 23-22; the record's time is the pulse's end. With
+  * PULSE_FLAG_EDGE it is a lone edge to the level at that time instead:
+  * a trailing edge without its leading one, a leading edge that follows
+  * another, or the two ends of a pulse wider than PULSE_BUS_WIDTH. A
+  * record with PULSE_FLAG_OFF ends the channel's pulse records, its
+  * edges stream as edge words again.
+  ******************************************************************************
+  */
+
+#ifndef __PULSE_RECORD_H
+#define __PULSE_RECORD_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include "main.h"
+
+#define PULSE_WORD_WIDTH 0x1FFE         // widest pulse of a word: 0x1FFF would form the marker escape
+#define PULSE_WORD_SPAN  0xFFFF         // latest end of a word after the channel's anchor
+#define PULSE_BUS_WIDTH  0x7FFFF        // widest pulse of a BUS_PULSE record
+#define PULSE_SYNC_EVERY 256            // words per channel between BUS_PULSE records
+
+/* BUS_PULSE flags, data bits 21-19 */
+#define PULSE_FLAG_LEVEL 0x01           // the pulse is high, or the lone edge rises
+#define PULSE_FLAG_EDGE  0x02           // a lone edge, not a pulse
+#define PULSE_FLAG_OFF   0x04           // the channel streams edges again
+
+extern volatile uint32_t pulse_mask;    // bit n set while channel n sends pulse records
+
+void pulse_configure(uint32_t mask, uint32_t levels);
+uint32_t pulse_edges(uint32_t levels, uint32_t changed, uint32_t time, uint32_t words);
+void pulse_resync(void);
+void pulse_reset(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* __PULSE_RECORD_H */
@@ -0,0 +1,63 @@
+/**
+  ******************************************************************************
+  * @file           : spi_sniff.h
+  * @brief          : SPI bus sniffing with the SPI peripherals + DMA
+  ******************************************************************************
+  * Host command 'P' turns SPI1 into a receive-only slave on the probed
+  * data line and lets DMA move every byte into a RAM ring, so a byte
+  * costs no CPU work however fast SCK runs. TIM2 input capture on the
+  * same SCK, prescaled by 8, latches the TIM2/TIM3 time of each byte's
+  * last sampling edge into a second DMA ring. The main loop pairs bytes
+  * with times in order and pushes one MARKER_BUS record per byte.
+  *
+  * Only SPI1 (remapped) reaches a probe pin: PB5, event channel 1, is
+  * its MOSI input. SCK has no probe pin, so the clock line must also be
+  * wired to PB3, where SPI1 SCK and TIM2 CH2 (remapped) both read it.
+  * With SPI_MODE_MISO, SPI2 receives the other data line on PB15 with
+  * SCK wired to PB13 as well; its bytes ride in the same records.
+  *
+  * The chip select stays an ordinary EXTI channel whose edges go into
+  * the ring; its falling edge restarts both SPIs and the capture
+  * prescaler, so a stray clock edge cannot shift the byte framing past
+  * the next transfer. PB5's EXTI line is switched off while sniffing.
+  ******************************************************************************
+  */
+
+#ifndef __SPI_SNIFF_H
+#define __SPI_SNIFF_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include "main.h"
+
+#define SPI_RING_SIZE 512               // DMA ring depth, bytes and times, power of 2
+#define SPI_RING_MASK (SPI_RING_SIZE - 1)
+#define SPI_DATA_CHANNEL 1              // event channel number of PB5 (SPI1 MOSI)
+#define SPI_NO_CS 0xFF                  // 'P' chip select channel: none, never resync
+
+/* 'P' mode byte */
+#define SPI_MODE_CPHA  0x01             // data sampled on the second clock edge
+#define SPI_MODE_CPOL  0x02             // clock idles high
+#define SPI_MODE_LSB   0x04             // least significant bit first
+#define SPI_MODE_MISO  0x08             // also receive PB15 with SPI2
+#define SPI_MODE_ON    0x80             // clear: stop sniffing
+
+/* Flags in bits 23-16 of a BUS_SPI data word */
+#define SPI_FLAG_MISO    0x01           // bits 15-8 hold the PB15 byte
+#define SPI_FLAG_OVERRUN 0x02           // the SPI lost bytes before this one
+
+void spi_sniff_configure(uint32_t mode, uint32_t cs_channel);
+void spi_sniff_enable(uint32_t enable);
+void spi_sniff_select(void);
+void spi_sniff_drain(void);
+uint32_t spi_sniff_lines(void);
+
+extern volatile uint32_t spi_sniff_cs_mask;  // bit n set while channel n is the chip select
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* __SPI_SNIFF_H */
@@ -59,6 +59,9 @@ void EXTI4_IRQHandler(void);
 void USB_LP_CAN1_RX0_IRQHandler(void);
 void EXTI9_5_IRQHandler(void);
 /* USER CODE BEGIN EFP */
+#if BOARD_SYNC
+void TIM2_IRQHandler(void);
+#endif
 
 /* USER CODE END EFP */
 
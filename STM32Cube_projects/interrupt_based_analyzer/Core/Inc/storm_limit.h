@@ -0,0 +1,46 @@
+/**
+  ******************************************************************************
+  * @file           : storm_limit.h
+  * @brief          : Per-channel edge rate limit of the EXTI channels
+  ******************************************************************************
+  * Host command 'K' gives a channel a token bucket: rate edges per second
+  * with bursts of up to burst edges. An edge that finds the bucket empty
+  * switches the channel to summary mode: its edges are only counted, and
+  * every STORM_WINDOW_US the count goes out as one MARKER_BUS record of
+  * kind BUS_STORM instead of the edges. A window with no more edges than
+  * the rate allows ends the storm and the channel streams edges again,
+  * so one oscillating input cannot fill the ring for the other three.
+  *
+  * A summary record's time is the end of its window; the window starts
+  * at the channel's previous edge or summary in the stream.
+  ******************************************************************************
+  */
+
+#ifndef __STORM_LIMIT_H
+#define __STORM_LIMIT_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include "main.h"
+
+#define STORM_ALL_CHANNELS 0xFF         // 'K' channel: set the limit of all four
+
+/* BUS_STORM data word: count in bits 15-0, flags in bits 23-16 */
+#define STORM_FLAG_CHANNEL 0x03         // the channel
+#define STORM_FLAG_LEVEL   0x04         // its level at the end of the window
+#define STORM_FLAG_CALM    0x08         // last summary: edges stream again
+
+extern volatile uint32_t storm_mask;    // bit n set while channel n is limited
+
+void storm_configure(uint32_t channel, uint32_t cost, uint32_t burst, uint32_t window);
+uint32_t storm_limit(uint32_t levels, uint32_t changed, uint32_t time);
+void storm_poll(uint32_t now);
+void storm_reset(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* __STORM_LIMIT_H */
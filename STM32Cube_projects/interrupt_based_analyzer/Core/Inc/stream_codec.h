@@ -0,0 +1,137 @@
+/**
+  ******************************************************************************
+  * @file           : stream_codec.h
+  * @brief          : Codec of the stream formats, shared by firmware and host
+  ******************************************************************************
+  * What both ends of the link must agree on bit for bit, in one place:
+  * the compact record (STREAM_COMPACT, layout in event_format.c), the
+  * edge model and residual codes of predicted runs (STREAM_PREDICT), the
+  * frame CRC (STREAM_FRAMED) and the pulse word (pulse_record.h).
+  *
+  * It makes no HAL calls. The firmware links the encoding half with
+  * event_format.c and pulse_record.c. A host build (HOST_SIM) adds the
+  * decoding half, CODEC_DECODER, and is built two ways:
+  *   a shared library that serial_plotter.py loads through ctypes
+  *     (stream_codec.py), so the host decodes compact streams and checks
+  *     frame CRCs in C with the model the firmware encodes with
+  *   Sim/codec_check.c, which runs event_format.c's encoder on random
+  *     streams into this decoder and checks every event comes back
+  ******************************************************************************
+  */
+
+#ifndef __STREAM_CODEC_H
+#define __STREAM_CODEC_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include "event_format.h"
+
+#ifndef CODEC_DECODER
+#ifdef HOST_SIM
+#define CODEC_DECODER 1
+#else
+#define CODEC_DECODER 0         // the firmware only encodes
+#endif
+#endif
+
+#define CODEC_CHANNELS 4
+#define CODEC_SLACK 3           // largest residual a run codes
+#define CODEC_RUN_MAX 32        // edges of one run record
+#define CODEC_RUN_TYPE (COMPACT_MARKER_BASE + MARKER_EPOCH)  // never sent as a marker
+
+/* Edge model of a predicted stream; encoder and decoder each keep one */
+typedef struct
+{
+    uint64_t last[CODEC_CHANNELS];      // time of each channel's last edge
+    uint32_t gap[CODEC_CHANNELS][2];    // its last two intervals, [0] the newer
+    uint8_t level[CODEC_CHANNELS];      // its level after that edge
+    uint8_t seen[CODEC_CHANNELS];       // edges since the reset, up to 3
+    uint8_t steady[CODEC_CHANNELS];     // its last edge came as predicted
+} CodecModel;
+
+uint32_t codec_put_varint(uint64_t value, uint8_t *out);
+uint32_t codec_put_head(uint32_t type, uint64_t value, uint8_t *out);
+uint32_t codec_put_residual(uint8_t *codes, uint32_t bits, int32_t residual);
+void codec_model_reset(CodecModel *model);
+int32_t codec_model_next(const CodecModel *model, uint64_t now, uint64_t *when);
+void codec_model_learn(CodecModel *model, uint32_t ch, uint64_t time, uint32_t level);
+
+/* Zigzag code of a signed tick difference: small either way, small code */
+static inline uint64_t codec_zigzag(int64_t diff)
+{
+    return ((uint64_t)diff << 1) ^ (uint64_t)(diff >> 63);
+}
+
+static inline int64_t codec_unzigzag(uint64_t value)
+{
+    return (int64_t)(value >> 1) ^ -(int64_t)(value & 1);
+}
+
+/* Pulse word (pulse_record.h): level, channel, width and end time low bits */
+static inline uint32_t codec_pulse_word(uint32_t level, uint32_t ch, uint32_t width, uint32_t end)
+{
+    return (level << 31) | (ch << 29) | (width << 16) | (end & 0xFFFF);
+}
+
+/* End of a pulse word's pulse: the first time after anchor with its low bits */
+static inline uint64_t codec_pulse_end(uint64_t anchor, uint32_t word)
+{
+    return anchor + (uint16_t)((word & 0xFFFF) - (anchor & 0xFFFF));
+}
+
+static inline uint32_t codec_pulse_width(uint32_t word)
+{
+    return (word >> 16) & 0x1FFF;
+}
+
+#if CODEC_DECODER
+
+/* A compact stream's marker record, as decoded */
+typedef struct
+{
+    int64_t time;       // the record's time: first loss, SOF, byte or trigger
+    uint64_t words[MARKER_INFO_WORDS];  // drop and window: count, span; SOF: frame
+                        // count; UART and bus: data word; info: the 'V' words
+    uint32_t type;      // MARKER_*
+} CodecMarker;
+
+/* Where codec_decode puts what it decodes */
+typedef struct
+{
+    int64_t *times;     // edges: time, level after, channel
+    uint8_t *levels;
+    uint8_t *channels;
+    uint32_t edges;     // edges written so far
+    uint32_t edge_room;
+    CodecMarker *markers;
+    uint32_t marker_count;
+    uint32_t marker_room;
+} CodecOutput;
+
+/* Decoder of one compact stream; the bytes of a record it has not had
+   whole stay with the caller */
+typedef struct
+{
+    uint64_t time;      // time of the last record
+    uint32_t predict;   // a STREAM_PREDICT stream
+    int64_t restart_at; // offset of the bytes where a frame's records start, -1 for none
+    CodecModel model;
+} CodecDecoder;
+
+uint32_t codec_decoder_size(void);
+void codec_decoder_restart(CodecDecoder *dec, uint32_t predict);
+void codec_decoder_frame(CodecDecoder *dec, uint32_t offset);
+void codec_decoder_lost(CodecDecoder *dec);
+uint32_t codec_decode(CodecDecoder *dec, const uint8_t *data, uint32_t length, CodecOutput *out);
+uint32_t codec_crc32(uint32_t crc, const uint8_t *data, uint32_t length);
+uint32_t codec_frame_check(const uint8_t *frame, uint32_t length);
+
+#endif /* CODEC_DECODER */
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* __STREAM_CODEC_H */
@@ -0,0 +1,79 @@
+/**
+  ******************************************************************************
+  * @file           : trigger.h
+  * @brief          : Trigger conditions of the edge engine
+  ******************************************************************************
+  * Host command 'G' arms a trigger. Until it fires, the event ring keeps
+  * only the newest pre-trigger events and nothing is sent; the oldest
+  * records are discarded as new ones arrive. When it fires the retained
+  * window goes out, headed by a MARKER_WINDOW record for what was
+  * discarded, then a MARKER_TRIGGER record and the post-trigger events.
+  * The conditions are evaluated on the EXTI edges (trigger_check), so
+  * the decoded UART channel and, with CAPTURE_IC_DMA, CH2 cannot fire it.
+  *
+  * TRIG_RECORD is the flight recorder: a trigger no edge fires. The ring
+  * records with overwrite and nothing goes over USB until host command
+  * 'd' (or the RECORDER_BUTTON) dumps the newest history, cut to a number
+  * of ring words or milliseconds: the window as above, its MARKER_TRIGGER
+  * at the dump's time. The edges of the dump's own transfers follow it;
+  * once the window is sent the recorder arms again.
+  *
+  * With TRIGGER_OUT, PA0 rises when the trigger fires, for an oscilloscope
+  * or another instrument to trigger on, and stays high until the trigger
+  * is armed again:
+  *   TRIGGER_OUT_GPIO     the EXTI ISR sets it as soon as the condition
+  *                        matches: the entry, timestamp and condition
+  *                        cycles after the edge, which vary
+  *   TRIGGER_OUT_COMPARE  TIM2 CH1 in output compare sets it exactly
+  *                        TRIGGER_OUT_DELAY ticks after the trigger
+  *                        edge's timestamp, if the ISR writes the compare
+  *                        in time; when it did not, the ISR sets it (late)
+  * Each trigger is followed in the stream by a MARKER_BUS record of kind
+  * BUS_TRIGGER_OUT at the trigger's time:
+  *   data = ticks from the timestamp to PA0 rising (16) | TRIG_OUT_* flags << 16 | kind << 24
+  * measured after the pin write by the ISR, or the delay when the compare
+  * set it.
+  ******************************************************************************
+  */
+
+#ifndef __TRIGGER_H
+#define __TRIGGER_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include "main.h"
+
+/* Trigger types, bits 6-0 of the 'G' type byte */
+#define TRIG_OFF     0   // stream everything
+#define TRIG_EDGE    1   // edge on channel; value 0 falling, 1 rising, 2 either
+#define TRIG_PATTERN 2   // levels & mask become value
+#define TRIG_LONGER  3   // a pulse at level value on channel ends after more than param ticks
+#define TRIG_SHORTER 4   // ... after fewer than param ticks
+#define TRIG_COUNT   5   // the param-th edge on channel, value as TRIG_EDGE
+#define TRIG_RECORD  6   // none: record until dumped ('d'), then arm again
+#define TRIG_REARM   0x80  // type flag: arm again once the post-trigger window is sent
+
+/* TRIGGER_OUT modes (main.h) */
+#define TRIGGER_OUT_GPIO    1
+#define TRIGGER_OUT_COMPARE 2
+
+/* BUS_TRIGGER_OUT flags */
+#define TRIG_OUT_COMPARE 0x01   // the compare raised PA0, TRIGGER_OUT_DELAY after the edge
+#define TRIG_OUT_LATE    0x02   // the compare time had passed: the ISR raised it
+
+void trigger_configure(uint32_t type, uint32_t channel, uint32_t value, uint32_t mask,
+                       uint32_t param);
+void trigger_arm(uint32_t levels);
+uint32_t trigger_check(uint32_t levels, uint32_t changed, uint32_t time);
+#if TRIGGER_OUT
+void trigger_out_init(void);
+uint32_t trigger_out_fire(uint32_t time);
+#endif
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* __TRIGGER_H */
@@ -0,0 +1,62 @@
+/**
+  ******************************************************************************
+  * @file           : uart_decode.h
+  * @brief          : On-device UART decoding of one probe channel
+  ******************************************************************************
+  * With host command 'U' one channel's edges stop going into the event
+  * ring. The EXTI handler hands them to a software receiver instead,
+  * which samples each bit at its centre from the edge timestamps and
+  * pushes one MARKER_UART record per byte: the clock time of the start
+  * bit, then the byte with its status flags and channel. A byte costs
+  * three ring words instead of up to ten edges, and its timestamp keeps
+  * the capture clock's resolution.
+  *
+  * A bit centre with no edge after it is only sampled by the next edge
+  * or by uart_decode_poll() from the main loop, so the last byte of a
+  * burst goes out one loop pass after its stop bit.
+  *
+  * Host command 'X' FILTER_UART match mask gap keeps only the messages
+  * whose first byte has match's bits under mask (mask 0 keeps all). A
+  * message is the bytes up to an idle line of gap frame times (0: 2).
+  * Dropped messages are counted and reported as one BUS_FILTER record
+  * ahead of the next kept one, or by uart_decode_filter_poll.
+  ******************************************************************************
+  */
+
+#ifndef __UART_DECODE_H
+#define __UART_DECODE_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include "main.h"
+
+#define UART_DECODE_OFF 0xFF        // 'U' channel that turns decoding off
+
+/* 'U' frame byte: bits 3-0 data bits (5-9), bits 5-4 parity (0 none,
+   1 even, 2 odd) */
+#define UART_FRAME_BITS(frame)   ((frame) & 0x0F)
+#define UART_FRAME_PARITY(frame) (((frame) >> 4) & 0x03)
+#define UART_PARITY_NONE 0
+#define UART_PARITY_EVEN 1
+#define UART_PARITY_ODD  2
+
+/* Status flags in bits 15-8 of the MARKER_UART data word */
+#define UART_STATUS_FRAMING 0x01    // stop bit sampled low
+#define UART_STATUS_PARITY  0x02    // parity bit did not match
+
+extern volatile uint32_t uart_decode_mask;  // bit n set while channel n is decoded
+
+void uart_decode_configure(uint32_t channel, uint32_t bit_q8, uint32_t frame);
+void uart_decode_edge(uint32_t level, uint32_t time);
+void uart_decode_poll(uint32_t now);
+void uart_decode_reset(void);
+void uart_decode_filter(uint32_t match, uint32_t mask, uint32_t gap);
+void uart_decode_filter_poll(uint32_t now, uint32_t ticks);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* __UART_DECODE_H */
@@ -0,0 +1,163 @@
+/**
+  ******************************************************************************
+  * @file           : analog_capture.c
+  * @brief          : One ADC channel sampled beside the edges, on the
+  *                   capture clock
+  ******************************************************************************
+  * TIM1 CH1 compares at period - 1 of every period, which is ADC1's
+  * external trigger (EXTSEL 000, TIM1_CC1); PA8 stays a GPIO, so nothing
+  * is driven. The first conversion comes period - 1 ticks after the TIM2
+  * wrap that started TIM1, and the ring's tail sample is next_time.
+  ******************************************************************************
+  */
+
+#include "analog_capture.h"
+#include "event_format.h"
+
+#define ANALOG_RING_SLACK 16            // samples short of a lap that count as one
+
+/* Filled by DMA1 channel 1 (ADC1) */
+static volatile uint16_t samples[ANALOG_RING_SIZE];
+static uint32_t tail = 0;
+static uint32_t next_time;              // clock time of the sample at tail
+static uint32_t period = 0;             // ticks between samples, 0 stopped
+static uint32_t announce = 0;           // BUS_ANALOG_PERIOD goes ahead of the next record
+static uint32_t calibrated = 0;
+
+/**
+ * @brief Powers ADC1 up on PA1 and runs its calibration, once
+ */
+static void analog_adc_init(void)
+{
+    __HAL_RCC_GPIOA_CLK_ENABLE();
+    GPIOA->CRL &= ~(GPIO_CRL_MODE1 | GPIO_CRL_CNF1);   // analog input
+    RCC->CFGR = (RCC->CFGR & ~RCC_CFGR_ADCPRE) | RCC_CFGR_ADCPRE_DIV6;   // 12 MHz, 14 at most
+    __HAL_RCC_ADC1_CLK_ENABLE();
+    ADC1->CR1 = 0;
+    ADC1->SMPR2 = ADC_SMPR2_SMP1_1 | ADC_SMPR2_SMP1_0;   // 28.5 cycles
+    ADC1->SQR1 = 0;                                     // one conversion per trigger
+    ADC1->SQR3 = ANALOG_ADC_CHANNEL;
+    ADC1->CR2 = ADC_CR2_ADON;
+    for (volatile uint32_t wait = 0; wait < 100; wait++);  // tSTAB, and 2 ADC clocks before CAL
+    ADC1->CR2 |= ADC_CR2_RSTCAL;
+    while (ADC1->CR2 & ADC_CR2_RSTCAL);
+    ADC1->CR2 |= ADC_CR2_CAL;
+    while (ADC1->CR2 & ADC_CR2_CAL);
+}
+
+/**
+ * @brief Samples PA1 every ticks capture clock ticks from the next TIM2
+ *        wrap on; the edge engine's clock must be running
+ * @param ticks - sampling period, 1 to ANALOG_MAX_PERIOD
+ * @retval none
+ */
+void analog_capture_start(uint32_t ticks)
+{
+    uint32_t now;
+
+    analog_capture_stop();
+    if (!calibrated)
+    {
+        analog_adc_init();
+        calibrated = 1;
+    }
+
+    __HAL_RCC_TIM1_CLK_ENABLE();
+    TIM1->CR1 = 0;
+    TIM1->SMCR = 0;
+    TIM1->PSC = TIM2->PSC;
+    TIM1->ARR = ticks - 1;
+    TIM1->CCR1 = ticks - 1;
+    TIM1->CCMR1 = TIM_CCMR1_OC1M_2 | TIM_CCMR1_OC1M_1;  // PWM mode 1
+    TIM1->CCER = TIM_CCER_CC1E;
+    TIM1->BDTR = TIM_BDTR_MOE;
+    TIM1->EGR = TIM_EGR_UG;     // loads PSC, clears the count
+
+    DMA1_Channel1->CCR = 0;
+    DMA1_Channel1->CPAR = (uint32_t)&ADC1->DR;
+    DMA1_Channel1->CMAR = (uint32_t)samples;
+    DMA1_Channel1->CNDTR = ANALOG_RING_SIZE;
+    DMA1_Channel1->CCR = DMA_CCR_PL_1 | DMA_CCR_MSIZE_0 | DMA_CCR_PSIZE_0 |
+                         DMA_CCR_MINC | DMA_CCR_CIRC | DMA_CCR_EN;
+    ADC1->CR2 = ADC_CR2_ADON | ADC_CR2_DMA | ADC_CR2_EXTTRIG;   // EXTSEL 000: TIM1 CC1
+    tail = 0;
+
+    // TIM1 starts on the next TIM2 update: arm it well clear of one, so
+    // the wrap it starts on is the one after now
+    __disable_irq();
+    while (TIM2->CNT > 0xFF00);
+    TIM1->SMCR = TIM_SMCR_TS_0 | TIM_SMCR_SMS_2 | TIM_SMCR_SMS_1;   // trigger mode, ITR1 = TIM2 TRGO
+    now = get_32bit_timer();
+    __enable_irq();
+
+    next_time = (now | 0xFFFF) + ticks;
+    period = ticks;
+    announce = 1;
+}
+
+/**
+ * @brief Stops the conversions; the ADC stays powered and calibrated
+ * @retval none
+ */
+void analog_capture_stop(void)
+{
+    if (!period) return;
+
+    TIM1->CR1 = 0;
+    TIM1->SMCR = 0;
+    TIM1->BDTR = 0;
+    ADC1->CR2 = ADC_CR2_ADON;   // a write changing more than ADON starts no conversion
+    DMA1_Channel1->CCR = 0;
+    period = 0;
+}
+
+/**
+ * @brief Packs the samples the DMA ring holds since the last call into
+ *        BUS_ANALOG records, two to a record. Must run before the ring
+ *        laps: ANALOG_RING_SIZE samples, 5 ms at ANALOG_MAX_HZ
+ * @retval none
+ */
+void analog_capture_drain(void)
+{
+    if (!period) return;
+
+    uint32_t head = (ANALOG_RING_SIZE - DMA1_Channel1->CNDTR) & ANALOG_RING_MASK;
+    uint32_t now = get_32bit_timer();  // read after the head: every sample before it is older
+    int32_t late = (int32_t)(now - next_time);
+    uint32_t converted = late < 0 ? 0 : (uint32_t)late / period + 1;   // since tail, by the clock
+    uint32_t ready = (head - tail) & ANALOG_RING_MASK;
+
+    if (converted >= ANALOG_RING_SIZE - ANALOG_RING_SLACK)
+    {
+        // The DMA may have written over tail: go on from the newest samples,
+        // counting the laps the clock says went by
+        int32_t laps = (int32_t)(converted - ready) + ANALOG_RING_SIZE / 2;
+        next_time += (ready + (laps > 0 ? (uint32_t)laps & ~ANALOG_RING_MASK : 0)) * period;
+        tail = head;
+        ready = 0;
+    }
+
+    while (ready >= 2)
+    {
+        uint32_t words[MARKER_BUS_WORDS] = {
+            next_time,
+            (samples[tail] & 0x0FFF) | ((samples[(tail + 1) & ANALOG_RING_MASK] & 0x0FFF) << ANALOG_SAMPLE_BITS) |
+            (BUS_ANALOG << 24)
+        };
+
+        __disable_irq();
+        capture_check_epoch(next_time);
+        if (announce)
+        {
+            uint32_t first[MARKER_BUS_WORDS] = { next_time, period | (BUS_ANALOG_PERIOD << 24) };
+            capture_push_record(event_pack_marker(MARKER_BUS, 0), first, MARKER_BUS_WORDS);
+        }
+        capture_push_record(event_pack_marker(MARKER_BUS, 0), words, MARKER_BUS_WORDS);
+        __enable_irq();
+
+        announce = 0;
+        tail = (tail + 2) & ANALOG_RING_MASK;
+        next_time += 2 * period;
+        ready -= 2;
+    }
+}
@@ -0,0 +1,158 @@
+/**
+  ******************************************************************************
+  * @file           : board_sync.c
+  * @brief          : Shared reference pulse for merging several analyzers'
+  *                   captures into one timeline
+  ******************************************************************************
+  * TIM1 runs at 10 kHz and drives CH1 high for the first 10 counts of
+  * each period. TIM2 CH3 captures PA2's rising edges with no filter, so
+  * every board adds the same input delay.
+  ******************************************************************************
+  */
+
+#include "board_sync.h"
+#include "event_format.h"
+
+#define SYNC_TIM1_HZ 10000              // TIM1 count rate
+#define SYNC_PULSE_COUNTS 10            // 1 ms high
+
+volatile uint32_t board_sync_pending = 0;
+
+static uint32_t sync_flags = 0;         // SYNC_FLAG_* of the records
+static uint32_t pulse_time;             // 32-bit clock time of the latest pulse
+static uint32_t pulse_count = 0;        // pulses seen since 'Y'
+
+/**
+ * @brief Drives a SYNC_PULSE_COUNTS pulse every period_ms on PA8
+ */
+static void board_sync_output_start(uint32_t period_ms)
+{
+    GPIO_InitTypeDef gpio = {0};
+
+    __HAL_RCC_GPIOA_CLK_ENABLE();
+    __HAL_RCC_TIM1_CLK_ENABLE();
+    TIM1->CR1 = 0;
+    TIM1->PSC = SystemCoreClock / SYNC_TIM1_HZ - 1;
+    TIM1->ARR = period_ms * (SYNC_TIM1_HZ / 1000) - 1;
+    TIM1->CCR1 = SYNC_PULSE_COUNTS;
+    TIM1->CCMR1 = TIM_CCMR1_OC1M_2 | TIM_CCMR1_OC1M_1;  // PWM mode 1: high while CNT < CCR1
+    TIM1->CCER = TIM_CCER_CC1E;
+    TIM1->BDTR = TIM_BDTR_MOE;
+    TIM1->EGR = TIM_EGR_UG;
+
+    gpio.Pin = GPIO_PIN_8;
+    gpio.Mode = GPIO_MODE_AF_PP;
+    gpio.Speed = GPIO_SPEED_FREQ_HIGH;
+    HAL_GPIO_Init(GPIOA, &gpio);
+    TIM1->CR1 = TIM_CR1_CEN;
+}
+
+static void board_sync_output_stop(void)
+{
+    TIM1->CR1 = 0;
+    TIM1->BDTR = 0;
+    HAL_GPIO_DeInit(GPIOA, GPIO_PIN_8);
+    __HAL_RCC_TIM1_CLK_DISABLE();
+}
+
+/**
+ * @brief Captures PA2's rising edges with TIM2 CH3, one interrupt each
+ */
+static void board_sync_input_start(void)
+{
+    GPIO_InitTypeDef gpio = {0};
+
+    __HAL_RCC_GPIOA_CLK_ENABLE();
+    gpio.Pin = GPIO_PIN_2;
+    gpio.Mode = GPIO_MODE_INPUT;
+    gpio.Pull = GPIO_PULLDOWN;  // an unwired input stays quiet
+    HAL_GPIO_Init(GPIOA, &gpio);
+
+    TIM2->CCER &= ~(TIM_CCER_CC3E | TIM_CCER_CC3P);
+    TIM2->CCMR2 = (TIM2->CCMR2 & ~(TIM_CCMR2_CC3S | TIM_CCMR2_IC3PSC | TIM_CCMR2_IC3F)) |
+                  TIM_CCMR2_CC3S_0;  // IC3 on TI3, every edge, no filter
+    TIM2->SR = ~(TIM_SR_CC3IF | TIM_SR_CC3OF);
+    TIM2->DIER |= TIM_DIER_CC3IE;
+    TIM2->CCER |= TIM_CCER_CC3E;
+    HAL_NVIC_SetPriority(TIM2_IRQn, 0, 0);  // short, and must come within one TIM2 period
+    HAL_NVIC_EnableIRQ(TIM2_IRQn);
+}
+
+static void board_sync_input_stop(void)
+{
+    HAL_NVIC_DisableIRQ(TIM2_IRQn);
+    TIM2->DIER &= ~TIM_DIER_CC3IE;
+    TIM2->CCER &= ~TIM_CCER_CC3E;
+    TIM2->SR = ~(TIM_SR_CC3IF | TIM_SR_CC3OF);
+}
+
+/**
+ * @brief Starts or stops the reference pulse (host command 'Y'); called
+ *        from the host command parser (main loop)
+ * @param mode - BOARD_SYNC_*
+ * @param period_ms - master's pulse period, clamped to BOARD_SYNC_MIN_MS
+ *        to BOARD_SYNC_MAX_MS
+ * @retval none
+ */
+void board_sync_configure(uint32_t mode, uint32_t period_ms)
+{
+    if (mode > BOARD_SYNC_MASTER) return;
+
+    board_sync_input_stop();
+    if (sync_flags & SYNC_FLAG_MASTER) board_sync_output_stop();
+    board_sync_pending = 0;
+    pulse_count = 0;
+    sync_flags = mode == BOARD_SYNC_MASTER ? SYNC_FLAG_MASTER : 0;
+    if (mode == BOARD_SYNC_OFF) return;
+
+    board_sync_input_start();
+    if (mode == BOARD_SYNC_MASTER)
+    {
+        if (period_ms < BOARD_SYNC_MIN_MS) period_ms = BOARD_SYNC_MIN_MS;
+        if (period_ms > BOARD_SYNC_MAX_MS) period_ms = BOARD_SYNC_MAX_MS;
+        board_sync_output_start(period_ms);
+    }
+}
+
+/**
+ * @brief Latches a captured pulse for the main loop; called from
+ *        TIM2_IRQHandler
+ * @retval none
+ */
+void board_sync_irq(void)
+{
+    if (!(TIM2->SR & TIM_SR_CC3IF)) return;
+
+    uint16_t captured = TIM2->CCR3;  // clears CC3IF
+    uint32_t now = get_32bit_timer();
+
+    TIM2->SR = ~TIM_SR_CC3OF;  // a pulse within one interrupt latency is not a sync pulse
+    pulse_time = extend_16bit_timer(captured, now);
+    pulse_count++;
+    board_sync_pending = 1;
+}
+
+/**
+ * @brief Sends the latched pulse as a BUS_SYNC record; called from the
+ *        main loop in the edge engine with IRQs masked
+ * @retval none
+ */
+void board_sync_poll(void)
+{
+    if (!board_sync_pending) return;
+
+    uint32_t words[MARKER_BUS_WORDS] = {
+        pulse_time,
+        (pulse_count & 0xFFFF) | (sync_flags << 16) | (BUS_SYNC << 24)
+    };
+    board_sync_pending = 0;
+    capture_push_record(event_pack_marker(MARKER_BUS, 0), words, MARKER_BUS_WORDS);
+}
+
+/**
+ * @brief Forgets a pulse latched on a clock that was just restarted
+ */
+void board_sync_reset(void)
+{
+    board_sync_pending = 0;
+}
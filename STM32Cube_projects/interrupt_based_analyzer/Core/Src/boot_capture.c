@@ -0,0 +1,50 @@
+/**
+  ******************************************************************************
+  * @file           : boot_capture.c
+  * @brief          : Edge capture from power-up, held until the host asks
+  ******************************************************************************
+  * The preset is three words from CLOCK_TRIM_BOOT_PRESET in the clock
+  * correction's page: the magic, mode | channels << 8 | clock << 16,
+  * and the inverse of that. An erased or torn record reads as no preset.
+  ******************************************************************************
+  */
+
+#include "boot_capture.h"
+#include "clock_trim.h"
+
+#define BOOT_PRESET_MAGIC 0x544F4F42    // "BOOT"
+
+/**
+ * @brief Reads the stored preset
+ * @param preset - filled in, BOOT_CAPTURE_OFF if none is stored
+ * @retval 1 if the capture starts at power-up
+ */
+uint32_t boot_capture_preset(BootPreset *preset)
+{
+    const uint32_t *record = clock_trim_page() + CLOCK_TRIM_BOOT_PRESET;
+    uint32_t packed = record[1];
+
+    if (record[0] != BOOT_PRESET_MAGIC || record[2] != ~packed) packed = BOOT_CAPTURE_OFF;
+    preset->mode = packed & 0xFF;
+    preset->channels = (packed >> 8) & 0x0F;
+    preset->clock = (packed >> 16) & 0xFF;
+    return preset->mode == BOOT_CAPTURE_FILL || preset->mode == BOOT_CAPTURE_WRAP;
+}
+
+/**
+ * @brief Stores the preset the next power-ups start with (host command
+ *        'Z'); called from the host command parser (main loop)
+ * @param mode - BOOT_CAPTURE_*, BOOT_CAPTURE_OFF to clear it
+ * @param channels - 'E' mask, 0 for all channels
+ * @param clock - 'H' preset, BOOT_CLOCK_KEEP for CAPTURE_CLOCK_PRESET
+ * @retval 1 if stored, 0 if mode is unknown or the flash refused
+ */
+uint32_t boot_capture_store(uint32_t mode, uint32_t channels, uint32_t clock)
+{
+    uint32_t packed = mode | (channels & 0x0F) << 8 | (clock & 0xFF) << 16;
+    uint32_t words[3] = { BOOT_PRESET_MAGIC, packed, ~packed };
+
+    if (mode > BOOT_CAPTURE_WRAP) return 0;
+    if (mode == BOOT_CAPTURE_OFF) words[0] = words[1] = words[2] = 0xFFFFFFFF;
+    return clock_trim_store(CLOCK_TRIM_BOOT_PRESET, words, 3);
+}
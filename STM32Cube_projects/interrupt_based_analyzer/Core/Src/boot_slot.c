@@ -0,0 +1,62 @@
+/**
+  ******************************************************************************
+  * @file           : boot_slot.c
+  * @brief          : Both firmwares resident in flash, switched by a reset
+  ******************************************************************************
+  */
+
+#include "boot_slot.h"
+
+#define BOOT_SLOT_KEY 0xB500U       // DR1 = key | slot; anything else is slot A
+
+static void boot_slot_backup_enable(void)
+{
+    RCC->APB1ENR |= RCC_APB1ENR_PWREN | RCC_APB1ENR_BKPEN;
+    (void)RCC->APB1ENR;  // the clock is on before the first access
+}
+
+/**
+ * @brief Starts slot B's image instead of this one if 'J' asked for it;
+ *        called by slot A first thing in main, before HAL_Init, so the
+ *        other image finds the core as the reset left it
+ * @retval none, or never returns
+ */
+void boot_slot_select(void)
+{
+    const uint32_t *image = (const uint32_t *)BOOT_SLOT_B_ADDRESS;
+
+    boot_slot_backup_enable();
+    if (BKP->DR1 != (BOOT_SLOT_KEY | BOOT_SLOT_B)) return;
+    if ((image[0] & 0xFFF00000UL) != SRAM_BASE) return;  // erased: no stack top in SRAM
+
+    SCB->VTOR = BOOT_SLOT_B_ADDRESS;
+    __set_MSP(image[0]);
+    ((void (*)(void))image[1])();
+}
+
+/**
+ * @brief Resets into the image of slot (host command 'J'); called from
+ *        the host command parser (main loop). The pull-down on D+ makes
+ *        the host see a detach, so the other image enumerates afresh
+ * @param slot - BOOT_SLOT_A or BOOT_SLOT_B
+ * @retval none, or never returns
+ */
+void boot_slot_switch(uint32_t slot)
+{
+    GPIO_InitTypeDef gpio = {0};
+
+    if (slot > BOOT_SLOT_B) return;
+
+    boot_slot_backup_enable();
+    PWR->CR |= PWR_CR_DBP;
+    BKP->DR1 = BOOT_SLOT_KEY | slot;
+
+    USB->CNTR = USB_CNTR_FRES | USB_CNTR_PDWN;  // off the bus
+    HAL_GPIO_WritePin(GPIOA, GPIO_PIN_12, GPIO_PIN_RESET);
+    gpio.Pin = GPIO_PIN_12;
+    gpio.Mode = GPIO_MODE_OUTPUT_PP;
+    gpio.Speed = GPIO_SPEED_FREQ_LOW;
+    HAL_GPIO_Init(GPIOA, &gpio);
+    HAL_Delay(20);
+    NVIC_SystemReset();
+}
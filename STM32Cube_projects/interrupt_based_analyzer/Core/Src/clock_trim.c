@@ -0,0 +1,108 @@
+/**
+  ******************************************************************************
+  * @file           : clock_trim.c
+  * @brief          : Stored correction of the HSE-derived timestamp clocks
+  ******************************************************************************
+  * The page holds one ClockTrim at its start; an erased or torn page
+  * reads as no correction. The interrupt firmware's boot capture preset
+  * (boot_capture.c) shares the page, so a rewrite keeps the first
+  * CLOCK_TRIM_PAGE_WORDS words it does not replace.
+  ******************************************************************************
+  */
+
+#include "clock_trim.h"
+
+#define CLOCK_TRIM_MAGIC 0x434C4B54     // "CLKT"
+
+typedef struct
+{
+    uint32_t magic;     // CLOCK_TRIM_MAGIC
+    int32_t ppb;        // clock error, parts per billion, positive = fast
+    uint32_t check;     // ~ppb
+} ClockTrim;
+
+extern const ClockTrim _clock_trim_page;    // last flash page, STM32F103C8TX_FLASH.ld
+
+/**
+ * @brief Stored clock error in parts per billion, 0 if none
+ */
+int32_t clock_trim_ppb(void)
+{
+    const ClockTrim *trim = &_clock_trim_page;
+
+    if (trim->magic != CLOCK_TRIM_MAGIC || trim->check != ~(uint32_t)trim->ppb) return 0;
+    return trim->ppb;
+}
+
+/**
+ * @brief A nominal HSE-derived clock rate corrected by the stored error
+ * @param hz - nominal rate
+ * @retval the real rate, rounded to 1 Hz
+ */
+uint32_t clock_trim_apply(uint32_t hz)
+{
+    int64_t error = (int64_t)hz * clock_trim_ppb();
+
+    return hz + (int32_t)((error + (error < 0 ? -500000000 : 500000000)) / 1000000000);
+}
+
+/**
+ * @brief The stored records at the start of the page
+ */
+const uint32_t *clock_trim_page(void)
+{
+    return (const uint32_t *)&_clock_trim_page;
+}
+
+/**
+ * @brief Rewrites count words of the page from word offset and keeps the
+ *        page's other records; 0xFFFFFFFF words stay erased. Every record
+ *        starts with its magic and the words go in from the last, so a
+ *        write cut short reads as no record. Stalls the CPU for the erase
+ * @param offset - first word replaced
+ * @param words - its new words
+ * @param count - how many, offset + count at most CLOCK_TRIM_PAGE_WORDS
+ * @retval 1 if stored, 0 if the flash refused
+ */
+uint32_t clock_trim_store(uint32_t offset, const uint32_t *words, uint32_t count)
+{
+    FLASH_EraseInitTypeDef erase = {
+        .TypeErase = FLASH_TYPEERASE_PAGES,
+        .PageAddress = (uint32_t)&_clock_trim_page,
+        .NbPages = 1
+    };
+    uint32_t page[CLOCK_TRIM_PAGE_WORDS];
+    uint32_t bad_page;
+    uint32_t ok;
+
+    for (uint32_t i = 0; i < CLOCK_TRIM_PAGE_WORDS; i++)
+    {
+        page[i] = i - offset < count ? words[i - offset] : clock_trim_page()[i];
+    }
+    HAL_FLASH_Unlock();
+    ok = HAL_FLASHEx_Erase(&erase, &bad_page) == HAL_OK;
+    for (uint32_t i = CLOCK_TRIM_PAGE_WORDS; ok && i-- > 0; )
+    {
+        if (page[i] == 0xFFFFFFFF) continue;
+        ok = HAL_FLASH_Program(FLASH_TYPEPROGRAM_WORD, erase.PageAddress + 4 * i, page[i]) == HAL_OK;
+    }
+    HAL_FLASH_Lock();
+    return ok;
+}
+
+/**
+ * @brief Adds a measured error to the stored correction and rewrites the
+ *        flash page; called from the host command parser (main loop)
+ * @param ppb - error of the clocks as reported by 'V', parts per billion,
+ *        or CLOCK_TRIM_CLEAR
+ * @retval 1 if stored, 0 if out of range or the flash refused
+ */
+uint32_t clock_trim_adjust(int32_t ppb)
+{
+    int64_t total = ppb == CLOCK_TRIM_CLEAR ? 0 : (int64_t)clock_trim_ppb() + ppb;
+    uint32_t words[3] = { CLOCK_TRIM_MAGIC, (uint32_t)total, ~(uint32_t)total };
+
+    if (total > CLOCK_TRIM_MAX_PPB || total < -CLOCK_TRIM_MAX_PPB) return 0;
+    if (total == 0) words[0] = words[1] = words[2] = 0xFFFFFFFF;  // no correction: left erased
+    return clock_trim_store(0, words, 3);
+}
@@ -0,0 +1,443 @@
+/**
+  ******************************************************************************
+  * @file           : event_format.c
+  * @brief          : Compact delta-encoded stream (STREAM_COMPACT)
+  ******************************************************************************
+  * Each ring event becomes one variable-length record:
+  *   byte 0: bits 7-4 type | bit 3 more | bits 2-0 delta bits 2-0
+  *   then LEB128 groups of 7 delta bits while the previous byte's top
+  *   bit (bit 3 for byte 0) is set
+  * Type 0-7 is an edge (edge << 2 | channel), 8-15 is marker type + 8.
+  * delta is the zigzag-encoded signed tick difference to the previous
+  * record, so 2-byte records cover gaps up to 511 ticks (~99 us).
+  * Epoch markers are consumed here: deltas already span wraps. A drop
+  * marker becomes one record whose delta moves to the first lost event,
+  * followed by two LEB128 values: lost count and span in ticks. An info
+  * marker becomes a zero-delta record followed by its words as LEB128. A
+  * SOF marker's delta moves to the latched clock time and is followed by
+  * the frame count; the next record's delta starts from that time. A
+  * UART marker's delta moves to the byte's start bit and is followed by
+  * its data word (byte, status, channel) as LEB128. A window marker is
+  * encoded like a drop marker, under its own type; a trigger marker's
+  * delta moves to the trigger time. A bus marker is encoded like a UART
+  * marker.
+  *
+  * Predicted edges (STREAM_PREDICT): encoder and decoder keep the same
+  * model of each channel, its last edge time and level and its last two
+  * intervals. A channel's next edge is predicted one interval-before-last
+  * after its last edge, which follows clocks of any duty cycle. The next
+  * event is predicted on the channel with the earliest prediction that
+  * has not passed by more than PREDICT_SLACK ticks, among the channels
+  * whose last edge came within PREDICT_SLACK ticks of its own
+  * prediction, so a data line's irregular edges leave its clock alone. An edge that comes on that channel, with the other
+  * level, within PREDICT_SLACK ticks of the prediction joins a run
+  * record, type 8 (the epoch marker's, never sent otherwise): its delta
+  * field holds the run's edge count less one, and the residuals follow
+  * as a static prefix code, packed from bit 0 of each byte on and padded
+  * to whole bytes:
+  *   0 -> 0    +-1 -> 1 0 sign    +-2, +-3 -> 1 1 (|r| - 2) sign
+  * Any other record ends the run, as do PREDICT_RUN_MAX edges and the end
+  * of each packet, and every edge, run or not, updates the model. A
+  * steady clock thus costs 1-2 bits per edge instead of 16. The model
+  * restarts with the stream and, on a framed stream, with the first
+  * record that starts in each frame, so a lost frame does not spoil it.
+  *
+  * Framed stream (STREAM_FRAMED): a StreamFrame header goes in front of
+  * each transfer. offset counts payload bytes since power-up, so a gap
+  * gives the exact number of bytes lost. The CRC comes from the F103 CRC
+  * unit: CRC-32, poly 0x04C11DB7, init 0xFFFFFFFF, no reflection and no
+  * final XOR. It is fed 32-bit words, each one most significant byte
+  * first: sync | length << 16, then offset, then the payload. A partial
+  * last word is zero-padded. With STREAM_CRC_DMA the payload's whole
+  * words go to the unit by memory-to-memory DMA on DMA1 channel 6, at
+  * low priority, so the CPU only starts the pass and collects the CRC.
+  *
+  * The record head, the edge model and the residual codes come from
+  * stream_codec.c, which the host decodes with too.
+  ******************************************************************************
+  */
+
+#include "event_format.h"
+#include "stream_codec.h"
+#include <string.h>
+
+#if STREAM_COMPACT
+
+static uint32_t enc_epoch = 0;
+static uint64_t enc_last_time = 0;
+static uint32_t enc_payload[MARKER_MAX_WORDS];
+static uint32_t enc_payload_type;       // marker the raw words belong to
+static uint32_t enc_payload_words;
+static uint32_t enc_payload_left = 0;   // raw words still owed to that marker
+
+#if STREAM_PREDICT
+static CodecModel pred;
+static uint8_t run_codes[(CODEC_RUN_MAX * 4 + 7) / 8];
+static uint32_t run_edges = 0;
+static uint32_t run_bits = 0;
+static const uint8_t *frame_end = NULL;     // a record written here or past it starts the next frame
+static uint32_t frame_restarted = 0;        // and has restarted the model for it
+#endif
+
+/**
+ * @brief Places a 32-bit clock time on the encoder's 64-bit timeline,
+ *        nearest to the previous record
+ */
+static uint64_t compact_extend(uint32_t clock)
+{
+    return enc_last_time + (int32_t)(clock - (uint32_t)enc_last_time);
+}
+
+static uint32_t compact_put_record(uint32_t type, uint64_t time, uint8_t *out)
+{
+    uint64_t delta = codec_zigzag((int64_t)(time - enc_last_time));
+#if STREAM_PREDICT
+    if (frame_end != NULL && out >= frame_end)
+    {
+        codec_model_reset(&pred);  // the decoder restarts at this record
+        frame_end = NULL;
+        frame_restarted = 1;
+    }
+#endif
+    enc_last_time = time;
+    return codec_put_head(type, delta, out);
+}
+
+#if STREAM_PREDICT
+/**
+ * @brief Writes the run in progress as one record
+ * @param out - destination, room for COMPACT_RUN_BYTES bytes
+ * @retval bytes written, 0 without a run
+ */
+static uint32_t run_flush(uint8_t *out)
+{
+    if (run_edges == 0) return 0;
+    uint32_t n = codec_put_head(CODEC_RUN_TYPE, run_edges - 1, out);
+    uint32_t bytes = (run_bits + 7) / 8;
+    memcpy(out + n, run_codes, bytes);
+    memset(run_codes, 0, bytes);
+    run_edges = 0;
+    run_bits = 0;
+    return n + bytes;
+}
+
+/**
+ * @brief Codes an edge into the run when the model predicted it
+ * @param out - destination, room for COMPACT_RUN_BYTES bytes
+ * @param written - set to the bytes written: a full run's record
+ * @retval 1 if the edge joined the run, 0 if it needs a record
+ */
+static uint32_t predict_edge(uint32_t ch, uint64_t time, uint32_t level, uint8_t *out,
+                             uint32_t *written)
+{
+    uint64_t when;
+    int32_t next = codec_model_next(&pred, enc_last_time, &when);
+    int64_t r = (int64_t)(time - when);
+
+    *written = 0;
+    if (next != (int32_t)ch || level == pred.level[ch] || r < -CODEC_SLACK || r > CODEC_SLACK)
+    {
+        return 0;
+    }
+    run_bits = codec_put_residual(run_codes, run_bits, (int32_t)r);
+
+    enc_last_time = time;
+    codec_model_learn(&pred, ch, time, level);
+    if (++run_edges == CODEC_RUN_MAX) *written = run_flush(out);
+    return 1;
+}
+
+/**
+ * @brief Forgets the edge model, as the decoder does at the same record
+ *        (the start of a stream or of a frame); a run in progress must
+ *        have been flushed
+ * @retval none
+ */
+void event_compact_predict_reset(void)
+{
+    codec_model_reset(&pred);
+}
+
+/**
+ * @brief Starts the records of one frame (STREAM_FRAMED). The model
+ *        restarts with the first record that starts in the frame: the
+ *        next one, unless the last call already wrote a record past its
+ *        frame's end, after the run that record ended, and restarted it
+ *        there. Only such a record can start past the end: a run is
+ *        always flushed before the bytes reach it
+ * @param end - where the next frame starts in this call's output
+ * @retval none
+ */
+void event_compact_frame(const uint8_t *end)
+{
+    if (!frame_restarted) codec_model_reset(&pred);
+    frame_restarted = 0;
+    frame_end = end;
+}
+#endif /* STREAM_PREDICT */
+
+/**
+ * @brief Ends what the encoder holds back at the end of a packet: the
+ *        run of predicted edges in progress (STREAM_PREDICT)
+ * @param out - destination, room for COMPACT_MAX_RECORD bytes
+ * @retval number of bytes written
+ */
+uint32_t event_compact_flush(uint8_t *out)
+{
+#if STREAM_PREDICT
+    return run_flush(out);
+#else
+    (void)out;
+    return 0;
+#endif
+}
+
+/**
+ * @brief Restarts the encoder with the stream: a marker's payload words
+ *        still owed went with the ring, and the edge model starts over
+ * @retval none
+ */
+void event_compact_restart(void)
+{
+    enc_payload_left = 0;
+#if STREAM_PREDICT
+    run_edges = 0;
+    run_bits = 0;
+    memset(run_codes, 0, sizeof(run_codes));
+    frame_end = NULL;
+    frame_restarted = 0;
+    event_compact_predict_reset();
+#endif
+}
+
+/**
+ * @brief Encodes one ring event as a compact record
+ * @param event - edge-format event word from event_buffer
+ * @param out - destination, room for COMPACT_MAX_RECORD bytes
+ * @retval number of bytes written (0 when the event was consumed)
+ */
+static uint32_t compact_encode_record(uint32_t event, uint8_t *out)
+{
+    if (enc_payload_left)
+    {
+        enc_payload[enc_payload_words - enc_payload_left] = event;
+        if (--enc_payload_left) return 0;
+
+        if (enc_payload_type == MARKER_INFO)
+        {
+            uint32_t n = compact_put_record(COMPACT_MARKER_BASE + MARKER_INFO, enc_last_time, out);
+            for (uint32_t i = 0; i < MARKER_INFO_WORDS; i++)
+            {
+                n += codec_put_varint(enc_payload[i], out + n);
+            }
+            return n;
+        }
+        if (enc_payload_type == MARKER_SOF)
+        {
+            // frame count, clock time latched at that SOF
+            uint32_t n = compact_put_record(COMPACT_MARKER_BASE + MARKER_SOF,
+                                            compact_extend(enc_payload[1]), out);
+            return n + codec_put_varint(enc_payload[0], out + n);
+        }
+        if (enc_payload_type == MARKER_TRIGGER)
+        {
+            return compact_put_record(COMPACT_MARKER_BASE + MARKER_TRIGGER,
+                                      compact_extend(enc_payload[0]), out);
+        }
+        if (enc_payload_type == MARKER_UART || enc_payload_type == MARKER_BUS)
+        {
+            // clock time of the byte, then its data word
+            uint32_t n = compact_put_record(COMPACT_MARKER_BASE + enc_payload_type,
+                                            compact_extend(enc_payload[0]), out);
+            return n + codec_put_varint(enc_payload[1], out + n);
+        }
+
+        // drop or window: count, first and last lost clock time
+        uint64_t first = compact_extend(enc_payload[1]);
+        uint64_t last = compact_extend(enc_payload[2]);
+        uint32_t n = compact_put_record(COMPACT_MARKER_BASE + enc_payload_type, first, out);
+        n += codec_put_varint(enc_payload[0], out + n);
+        n += codec_put_varint(last - first, out + n);
+        // an epoch marker may have been lost too: resync from the clock
+        enc_epoch = (uint32_t)(last >> EVENT_TIME_BITS);
+        enc_last_time = last;
+        return n;
+    }
+
+    uint32_t raw_time = event & EVENT_TIME_MASK;
+    uint32_t type = event >> 29;
+
+    if (raw_time == EVENT_TIME_MASK)
+    {
+        if (type == MARKER_EPOCH)
+        {
+            enc_epoch++;
+            return 0;
+        }
+        if (event_marker_words(type))
+        {
+            enc_payload_type = type;
+            enc_payload_words = event_marker_words(type);
+            enc_payload_left = enc_payload_words;
+            return 0;
+        }
+        // edge-format markers carry no time
+        return compact_put_record(COMPACT_MARKER_BASE + type, enc_last_time, out);
+    }
+    return compact_put_record(type, ((uint64_t)enc_epoch << EVENT_TIME_BITS) | raw_time, out);
+}
+
+/**
+ * @brief Encodes one ring event as a compact record; with STREAM_PREDICT
+ *        a predicted edge joins the run in progress instead, and any
+ *        other record is written behind that run
+ * @param event - edge-format event word from event_buffer
+ * @param out - destination, room for COMPACT_MAX_RECORD bytes
+ * @retval number of bytes written (0 when the event was consumed)
+ */
+uint32_t event_compact_encode(uint32_t event, uint8_t *out)
+{
+#if STREAM_PREDICT
+    uint32_t n;
+
+    if (enc_payload_left == 0 && (event & EVENT_TIME_MASK) != EVENT_TIME_MASK)
+    {
+        uint32_t ch = (event >> 29) & 0x3;
+        uint32_t level = event >> 31;
+        uint64_t time = ((uint64_t)enc_epoch << EVENT_TIME_BITS) | (event & EVENT_TIME_MASK);
+
+        if (predict_edge(ch, time, level, out, &n)) return n;
+        n = run_flush(out);
+        n += compact_put_record(event >> 29, time, out + n);
+        codec_model_learn(&pred, ch, time, level);
+        return n;
+    }
+    if (enc_payload_left || event >> 29 == MARKER_EPOCH)
+    {
+        // a marker's words, its header flushed the run; a wrap, no record
+        return compact_encode_record(event, out);
+    }
+    n = run_flush(out);
+    return n + compact_encode_record(event, out + n);
+#else
+    return compact_encode_record(event, out);
+#endif
+}
+
+/**
+ * @brief Tells whether the encoder is between records, so the ring may be
+ *        trimmed at read_index (trigger.h)
+ * @retval 1 if no marker's payload words are still owed
+ */
+uint32_t event_compact_idle(void)
+{
+    return enc_payload_left == 0;
+}
+
+#endif /* STREAM_COMPACT */
+
+#if STREAM_FRAMED
+
+static const uint8_t *frame_tail;       // partial last word of the frame in progress
+static uint32_t frame_tail_bytes;
+
+/**
+ * @brief Clocks the CRC unit, and the DMA that feeds it; call once before
+ *        the first frame
+ * @retval none
+ */
+void stream_frame_init(void)
+{
+    __HAL_RCC_CRC_CLK_ENABLE();
+#if STREAM_CRC_DMA
+    __HAL_RCC_DMA1_CLK_ENABLE();
+#endif
+}
+
+/**
+ * @brief Starts the header for one transfer of the stream: its CRC pass
+ *        runs on DMA with STREAM_CRC_DMA, else here. Abandons a frame
+ *        still in progress. Does not touch the USB or the next offset
+ * @param frame - header to fill in
+ * @param payload - word-aligned payload, unchanged until the frame is done
+ * @param length - payload bytes (at most 65535)
+ * @param offset - stream bytes framed before this payload
+ * @retval none
+ */
+void stream_frame_begin(StreamFrame *frame, const uint8_t *payload, uint32_t length,
+                        uint32_t offset)
+{
+    const uint32_t *words = (const uint32_t *)payload;
+    uint32_t full = length / 4;
+
+    frame->sync = FRAME_SYNC;
+    frame->length = length;
+    frame->offset = offset;
+    frame_tail = payload + full * 4;
+    frame_tail_bytes = length & 3;
+
+#if STREAM_CRC_DMA
+    DMA1_Channel6->CCR = 0;
+    DMA1->IFCR = DMA_IFCR_CGIF6;
+#endif
+    CRC->CR = CRC_CR_RESET;
+    CRC->DR = FRAME_SYNC | (length << 16);
+    CRC->DR = offset;
+#if STREAM_CRC_DMA
+    if (full)
+    {
+        // memory to "peripheral": CMAR walks the payload, CPAR stays on DR
+        DMA1_Channel6->CPAR = (uint32_t)&CRC->DR;
+        DMA1_Channel6->CMAR = (uint32_t)words;
+        DMA1_Channel6->CNDTR = full;
+        DMA1_Channel6->CCR = DMA_CCR_MEM2MEM | DMA_CCR_MSIZE_1 | DMA_CCR_PSIZE_1 |
+                             DMA_CCR_MINC | DMA_CCR_DIR | DMA_CCR_EN;
+    }
+#else
+    for (uint32_t i = 0; i < full; i++)
+    {
+        CRC->DR = words[i];
+    }
+#endif
+}
+
+/**
+ * @brief Completes the frame stream_frame_begin started once the CRC unit
+ *        has had its whole words; not called again after it returned 1
+ * @param frame - the header passed to stream_frame_begin
+ * @retval 1 once frame->crc is in, 0 while the DMA still runs
+ */
+uint32_t stream_frame_done(StreamFrame *frame)
+{
+#if STREAM_CRC_DMA
+    if ((DMA1_Channel6->CCR & DMA_CCR_EN) && !(DMA1->ISR & DMA_ISR_TCIF6)) return 0;
+    DMA1_Channel6->CCR = 0;
+#endif
+    if (frame_tail_bytes)
+    {
+        uint32_t last = 0;
+        memcpy(&last, frame_tail, frame_tail_bytes);
+        CRC->DR = last;
+    }
+    frame->crc = CRC->DR;
+    return 1;
+}
+
+/**
+ * @brief Fills in the header for one transfer of the stream, waiting for
+ *        its CRC. Does not touch the USB or the next offset; the caller
+ *        advances the offset once the transfer is accepted
+ * @param frame - header to fill in
+ * @param payload - word-aligned payload
+ * @param length - payload bytes (at most 65535)
+ * @param offset - stream bytes framed before this payload
+ * @retval none
+ */
+void stream_frame_build(StreamFrame *frame, const uint8_t *payload, uint32_t length,
+                        uint32_t offset)
+{
+    stream_frame_begin(frame, payload, length, offset);
+    while (!stream_frame_done(frame));
+}
+
+#endif /* STREAM_FRAMED */
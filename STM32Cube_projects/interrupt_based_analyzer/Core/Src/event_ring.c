@@ -0,0 +1,158 @@
+/**
+  ******************************************************************************
+  * @file           : event_ring.c
+  * @brief          : Event ring and USB flush policy of the edge engine
+  ******************************************************************************
+  * The ring state and the parts off the push path: drop accounting,
+  * reset and the flush policy. The pushes are inline (event_ring.h), so
+  * the EXTI handler pays no call for them.
+  ******************************************************************************
+  */
+
+#include "event_ring.h"
+
+volatile uint32_t write_index = 0;
+volatile uint32_t read_index = 0;
+uint32_t ring_head = 0;
+uint32_t ring_batching = 0;
+#if CAPTURE_RING_EVENTS
+volatile uint32_t event_buffer[MAX_EVENTS];
+#endif	// else placed by the linker script
+volatile uint32_t dropped_total = 0;
+uint32_t drop_pending = 0;
+uint32_t drop_first_time = 0;
+uint32_t drop_last_time = 0;
+
+static volatile uint32_t flush_mode = FLUSH_BATCH;
+static volatile uint32_t flush_batch = FLUSH_DEFAULT_BATCH;
+static volatile uint32_t flush_latency = 0xFFFFFFFF;	// ticks
+static uint32_t adaptive_batch = FLUSH_DEFAULT_BATCH;
+
+/**
+ * @brief Counts one event that did not fit in event_buffer
+ * @retval none
+ */
+void ring_drop(void)
+{
+    uint32_t time = get_32bit_timer();
+    if (drop_pending == 0) drop_first_time = time;
+    drop_last_time = time;
+    drop_pending++;
+    dropped_total++;
+}
+
+/**
+ * @brief Empties the ring and forgets pending drops; called with IRQs
+ *        masked and no transfer in flight
+ * @retval none
+ */
+void ring_reset(void)
+{
+    write_index = read_index = ring_head = 0;
+    drop_pending = 0;
+}
+
+/**
+ * @brief Sets the flush policy
+ * @param mode - FLUSH_LATENCY, FLUSH_BATCH or FLUSH_ADAPTIVE
+ * @param batch - event count that triggers a send (adaptive: the minimum),
+ *        clamped to 1..MAX_EVENTS / 2
+ * @param latency_ticks - longest time queued events wait for a send
+ * @retval none
+ */
+void flush_configure(uint32_t mode, uint32_t batch, uint32_t latency_ticks)
+{
+    if (batch < 1) batch = 1;
+    if (batch > MAX_EVENTS / 2) batch = MAX_EVENTS / 2;
+
+    flush_mode = mode;
+    flush_batch = batch;
+    flush_latency = latency_ticks;
+    adaptive_batch = batch;
+}
+
+/**
+ * @brief Applies the flush policy
+ * @param queued - events waiting in the ring
+ * @param elapsed - timer ticks since the last send
+ * @param busy - a transfer is in flight
+ * @param tx_max - largest transfer in words, the adaptive batch's ceiling
+ * @retval 1 if the main loop should send now
+ */
+uint32_t flush_due(uint32_t queued, uint32_t elapsed, uint32_t busy, uint32_t tx_max)
+{
+    uint32_t deadline = elapsed >= flush_latency;
+
+    switch (flush_mode)
+    {
+    case FLUSH_LATENCY:
+    	return deadline;
+
+    case FLUSH_ADAPTIVE:
+    	if (busy) return queued >= adaptive_batch || deadline;
+    	// double the batch while a quarter of the ring is queued at send
+    	// time, halve it back towards the minimum when the deadline wins
+    	if (queued >= adaptive_batch)
+    	{
+    		if (queued >= MAX_EVENTS / 4 && adaptive_batch < tx_max)
+    		{
+    			adaptive_batch <<= 1;
+    		}
+    		return 1;
+    	}
+    	if (deadline)
+    	{
+    		if (adaptive_batch > flush_batch) adaptive_batch >>= 1;
+    		return 1;
+    	}
+    	return 0;
+
+    default:
+    	return queued >= flush_batch || deadline;
+    }
+}
+
+/**
+ * @brief Fewest queued events worth chaining a transfer from the
+ *        transmit-complete callback
+ * @retval event count
+ */
+uint32_t flush_chain_min(void)
+{
+    switch (flush_mode)
+    {
+    case FLUSH_LATENCY:  return 1;
+    case FLUSH_ADAPTIVE: return adaptive_batch;
+    default:             return flush_batch;
+    }
+}
+
+/**
+ * @brief When a send of the queued events becomes due, for a main loop
+ *        that sleeps until then (MAIN_LOOP_SLEEP)
+ * @param elapsed - timer ticks since the last send
+ * @param wait - set to the ticks left until the latency deadline, 0 if
+ *        it has passed
+ * @retval queued events that make a send due sooner, 0 if only the
+ *         deadline does
+ */
+uint32_t flush_wake(uint32_t elapsed, uint32_t *wait)
+{
+    *wait = elapsed >= flush_latency ? 0 : flush_latency - elapsed;
+    switch (flush_mode)
+    {
+    case FLUSH_LATENCY:  return 0;
+    case FLUSH_ADAPTIVE: return adaptive_batch;
+    default:             return flush_batch;
+    }
+}
+
+uint32_t flush_mode_get(void)
+{
+    return flush_mode;
+}
+
+uint32_t flush_batch_get(void)
+{
+    return flush_batch;
+}
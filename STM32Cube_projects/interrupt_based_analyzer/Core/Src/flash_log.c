@@ -0,0 +1,436 @@
+/**
+  ******************************************************************************
+  * @file           : flash_log.c
+  * @brief          : Offline logging of the compact edge stream to an
+  *                   external SPI NOR flash
+  ******************************************************************************
+  * SPI1 runs in mode 0 as master with software chip select. Commands and
+  * addresses go out byte by byte; page payloads and download reads move
+  * by DMA1 channel 3 (SPI1_TX) and channel 2 (SPI1_RX), the same channel
+  * pair a transfer of either direction uses. No interrupt is involved:
+  * flash_log_poll, from the main loop, sees a transfer end by the RX
+  * channel's TCIF2 and a program or erase end by the status register.
+  * With FLASH_LOG_BATCH the chip spends the gaps between batches in
+  * deep power-down, about 1 uA instead of tens in standby.
+  ******************************************************************************
+  */
+
+#include "flash_log.h"
+#include "event_format.h"
+#include <string.h>
+
+#define FLASH_CMD_WRITE_ENABLE 0x06
+#define FLASH_CMD_STATUS       0x05
+#define FLASH_CMD_PROGRAM      0x02
+#define FLASH_CMD_READ         0x03
+#define FLASH_CMD_CHIP_ERASE   0xC7
+#define FLASH_CMD_JEDEC_ID     0x9F
+#define FLASH_CMD_WAKE         0xAB     // release from deep power-down
+#define FLASH_CMD_POWER_DOWN   0xB9     // deep power-down
+#define FLASH_STATUS_BUSY      0x01
+#define FLASH_ERASED_COUNT     0xFFFF   // page count of a page never programmed
+#define FLASH_BLOCK_BYTES      4096     // BUS_FLASH counts the log in these
+
+#define FLASH_CS_LOW()  (GPIOA->BRR = GPIO_PIN_4)
+#define FLASH_CS_HIGH() (GPIOA->BSRR = GPIO_PIN_4)
+
+volatile uint32_t flash_log_state = FLASH_LOG_ABSENT;
+
+/* Filled by the main loop and programmed by DMA in turn; the slack takes
+ * the compact record that runs past a page, carried to the next one */
+static uint8_t page_buf[2][FLASH_PAGE_BYTES + COMPACT_MAX_RECORD] __ALIGNED(4);
+static uint32_t fill_sel = 0;           // buffer being filled
+static uint32_t fill_len = 0;           // payload bytes in it so far
+static uint32_t program_count = 0;      // buffers handed to programming, the oldest first
+static uint32_t programming = 0;        // 1: DMA on the bus, 2: the chip is writing
+static uint32_t finishing = 0;          // the session ends once its pages are written
+static uint32_t capacity_pages = 0;     // pages of the chip, up to FLASH_LOG_MAX_BYTES
+static uint32_t log_pages = 0;          // pages of the log, written or being written
+static uint32_t last_count = 0;         // payload bytes of its last page
+static uint32_t read_page = 0;          // download: next page to read
+static uint32_t read_started = 0;       // download: the byte count went out
+static uint32_t powered_down = 0;       // FLASH_LOG_BATCH: the chip sleeps until the next page
+static uint8_t dma_sink;                // RX target of a program
+static const uint8_t dma_fill = 0xFF;   // TX source of a read
+
+static uint8_t flash_byte(uint8_t out)
+{
+    while (!(SPI1->SR & SPI_SR_TXE));
+    *(volatile uint8_t *)&SPI1->DR = out;
+    while (!(SPI1->SR & SPI_SR_RXNE));
+    return *(volatile uint8_t *)&SPI1->DR;
+}
+
+static void flash_command(uint8_t cmd)
+{
+    FLASH_CS_LOW();
+    flash_byte(cmd);
+    FLASH_CS_HIGH();
+}
+
+static void flash_address(uint8_t cmd, uint32_t address)
+{
+    FLASH_CS_LOW();
+    flash_byte(cmd);
+    flash_byte(address >> 16);
+    flash_byte(address >> 8);
+    flash_byte(address);
+}
+
+static uint32_t flash_busy(void)
+{
+    FLASH_CS_LOW();
+    flash_byte(FLASH_CMD_STATUS);
+    uint32_t status = flash_byte(0xFF);
+    FLASH_CS_HIGH();
+    return status & FLASH_STATUS_BUSY;
+}
+
+/**
+ * @brief Brings the chip out of deep power-down, if it is in it. Until
+ *        it is awake (3 us) it leaves MISO to the pull-up, which reads as
+ *        busy
+ */
+static void flash_wake(void)
+{
+    if (!powered_down) return;
+    flash_command(FLASH_CMD_WAKE);
+    while (flash_busy());
+    powered_down = 0;
+}
+
+/**
+ * @brief Clocks len bytes through SPI1 by DMA, behind a command already
+ *        sent with the chip selected
+ * @param tx - bytes to send, NULL for 0xFF fill
+ * @param rx - destination of the bytes received, NULL to discard them
+ * @param len - byte count
+ * @retval none
+ */
+static void flash_dma_start(const uint8_t *tx, uint8_t *rx, uint32_t len)
+{
+    DMA1_Channel2->CCR = 0;
+    DMA1_Channel3->CCR = 0;
+    DMA1->IFCR = DMA_IFCR_CGIF2 | DMA_IFCR_CGIF3;
+    DMA1_Channel2->CPAR = (uint32_t)&SPI1->DR;
+    DMA1_Channel2->CMAR = (uint32_t)(rx ? rx : &dma_sink);
+    DMA1_Channel2->CNDTR = len;
+    DMA1_Channel3->CPAR = (uint32_t)&SPI1->DR;
+    DMA1_Channel3->CMAR = (uint32_t)(tx ? tx : &dma_fill);
+    DMA1_Channel3->CNDTR = len;
+    DMA1_Channel2->CCR = (rx ? DMA_CCR_MINC : 0) | DMA_CCR_EN;  // RX first: no byte is missed
+    DMA1_Channel3->CCR = DMA_CCR_DIR | (tx ? DMA_CCR_MINC : 0) | DMA_CCR_EN;
+}
+
+/**
+ * @brief Ends a DMA transfer once its last byte is in, deselecting the chip
+ * @retval 1 if it had ended
+ */
+static uint32_t flash_dma_done(void)
+{
+    if (!(DMA1->ISR & DMA_ISR_TCIF2)) return 0;
+    while (SPI1->SR & SPI_SR_BSY);
+    FLASH_CS_HIGH();
+    DMA1_Channel2->CCR = 0;
+    DMA1_Channel3->CCR = 0;
+    return 1;
+}
+
+static uint32_t flash_page_count(uint32_t page)
+{
+    flash_address(FLASH_CMD_READ, page * FLASH_PAGE_BYTES);
+    uint32_t count = flash_byte(0xFF);
+    count |= flash_byte(0xFF) << 8;
+    FLASH_CS_HIGH();
+    return count;
+}
+
+/**
+ * @brief Sets up SPI1 and its pins, wakes the chip and finds the end of
+ *        the log it holds, by bisection over the page counts; called once
+ *        at start-up
+ * @retval 1 if a flash answered
+ */
+uint32_t flash_log_init(void)
+{
+    GPIO_InitTypeDef gpio = {0};
+    uint8_t id[3];
+
+    __HAL_RCC_GPIOA_CLK_ENABLE();
+    __HAL_RCC_SPI1_CLK_ENABLE();
+    __HAL_RCC_DMA1_CLK_ENABLE();
+    FLASH_CS_HIGH();
+    gpio.Pin = GPIO_PIN_4;
+    gpio.Mode = GPIO_MODE_OUTPUT_PP;
+    gpio.Speed = GPIO_SPEED_FREQ_HIGH;
+    HAL_GPIO_Init(GPIOA, &gpio);
+    gpio.Pin = GPIO_PIN_5 | GPIO_PIN_7;  // SCK, MOSI
+    gpio.Mode = GPIO_MODE_AF_PP;
+    HAL_GPIO_Init(GPIOA, &gpio);
+    gpio.Pin = GPIO_PIN_6;  // MISO
+    gpio.Mode = GPIO_MODE_INPUT;
+    gpio.Pull = GPIO_PULLUP;  // no chip reads as 0xFF
+    HAL_GPIO_Init(GPIOA, &gpio);
+
+    SPI1->CR1 = SPI_CR1_MSTR | SPI_CR1_SSM | SPI_CR1_SSI | SPI_CR1_BR_0;  // PCLK2 / 4 = 18 MHz
+    SPI1->CR2 = SPI_CR2_RXDMAEN | SPI_CR2_TXDMAEN;
+    SPI1->CR1 |= SPI_CR1_SPE;
+
+    flash_command(FLASH_CMD_WAKE);
+    HAL_Delay(1);
+    FLASH_CS_LOW();
+    flash_byte(FLASH_CMD_JEDEC_ID);
+    for (uint32_t i = 0; i < 3; i++) id[i] = flash_byte(0xFF);
+    FLASH_CS_HIGH();
+    if (id[0] == 0x00 || id[0] == 0xFF || id[2] < 16) return 0;  // capacity byte: log2 of the size
+
+    capacity_pages = (id[2] >= 24 ? FLASH_LOG_MAX_BYTES : 1UL << id[2]) / FLASH_PAGE_BYTES;
+    uint32_t lo = 0, hi = capacity_pages;  // the first erased page is in [lo, hi]
+    while (lo < hi)
+    {
+        uint32_t mid = (lo + hi) / 2;
+        if (flash_page_count(mid) == FLASH_ERASED_COUNT) hi = mid;
+        else lo = mid + 1;
+    }
+    log_pages = lo;
+    last_count = lo ? flash_page_count(lo - 1) : 0;
+    flash_log_state = FLASH_LOG_IDLE;
+    return 1;
+}
+
+/**
+ * @brief Starts erasing the whole chip ('O' FLASH_LOG_ERASE); the state
+ *        stays FLASH_LOG_ERASING until the chip is done
+ * @retval 1 if started, 0 while logging, sending or without a flash
+ */
+uint32_t flash_log_erase(void)
+{
+    if (flash_log_state != FLASH_LOG_IDLE && flash_log_state != FLASH_LOG_FULL) return 0;
+
+    flash_wake();
+    flash_command(FLASH_CMD_WRITE_ENABLE);
+    flash_command(FLASH_CMD_CHIP_ERASE);
+    log_pages = 0;
+    last_count = 0;
+    flash_log_state = FLASH_LOG_ERASING;
+    return 1;
+}
+
+/**
+ * @brief Opens a session on an erased chip ('O' FLASH_LOG_START); the
+ *        caller writes the stream header first
+ * @retval 1 if logging, 0 if the chip holds a log or is busy
+ */
+uint32_t flash_log_start(void)
+{
+    if (flash_log_state != FLASH_LOG_IDLE || log_pages) return 0;
+
+    fill_sel = 0;
+    fill_len = 0;
+    program_count = 0;
+    programming = 0;
+    finishing = 0;
+    flash_log_state = FLASH_LOG_LOGGING;
+    return 1;
+}
+
+/**
+ * @brief Where the main loop encodes the stream next
+ * @param room - set to the payload bytes the page still takes; the buffer
+ *        has COMPACT_MAX_RECORD more
+ * @retval the write position, NULL while both buffers wait for the chip
+ */
+uint8_t *flash_log_buffer(uint32_t *room)
+{
+    if (flash_log_state != FLASH_LOG_LOGGING || finishing || program_count == 2) return NULL;
+    *room = FLASH_PAGE_PAYLOAD - fill_len;
+    return page_buf[fill_sel] + 2 + fill_len;
+}
+
+/**
+ * @brief The oldest buffer handed to programming
+ */
+static uint8_t *flash_log_oldest(void)
+{
+    return page_buf[fill_sel ^ (program_count & 1)];
+}
+
+/**
+ * @brief Hands the page in the fill buffer to programming
+ */
+static void flash_log_hand_over(void)
+{
+    page_buf[fill_sel][0] = (uint8_t)fill_len;
+    page_buf[fill_sel][1] = (uint8_t)(fill_len >> 8);
+    program_count++;
+    fill_sel ^= 1;
+    fill_len = 0;
+}
+
+/**
+ * @brief Adds bytes the main loop wrote at flash_log_buffer; a full page
+ *        goes to programming
+ * @param bytes - at most the room it was given
+ * @retval none
+ */
+void flash_log_commit(uint32_t bytes)
+{
+    fill_len += bytes;
+    if (fill_len == FLASH_PAGE_PAYLOAD) flash_log_hand_over();
+}
+
+/**
+ * @brief Ends the session: the page in progress is written short, and the
+ *        state returns to FLASH_LOG_IDLE when the chip has every page
+ * @retval none
+ */
+void flash_log_finish(void)
+{
+    if (flash_log_state == FLASH_LOG_LOGGING) finishing = 1;
+}
+
+/**
+ * @brief Moves programming and erasing on; called from the main loop.
+ *        A page is programmed with its count and payload only, so a short
+ *        one leaves the rest of the page erased
+ * @retval none
+ */
+void flash_log_poll(void)
+{
+    if (flash_log_state == FLASH_LOG_ERASING)
+    {
+        if (!flash_busy()) flash_log_state = FLASH_LOG_IDLE;
+        return;
+    }
+    if (flash_log_state != FLASH_LOG_LOGGING) return;
+
+    if (programming == 1 && flash_dma_done()) programming = 2;
+    if (programming == 2 && !flash_busy())
+    {
+        const uint8_t *page = flash_log_oldest();
+        last_count = page[0] | (page[1] << 8);
+        log_pages++;
+        program_count--;
+        programming = 0;
+    }
+    if (programming) return;
+
+    if (finishing && fill_len && program_count < 2) flash_log_hand_over();  // the short last page
+    if (program_count == 0)
+    {
+        if (finishing) flash_log_state = FLASH_LOG_IDLE;
+#if FLASH_LOG_BATCH
+        else if (!powered_down)
+        {
+            flash_command(FLASH_CMD_POWER_DOWN);  // until the next batch fills a page
+            powered_down = 1;
+        }
+#endif
+        return;
+    }
+    if (log_pages >= capacity_pages)
+    {
+        program_count = 0;
+        flash_log_state = FLASH_LOG_FULL;
+        return;
+    }
+
+    const uint8_t *page = flash_log_oldest();
+    flash_wake();
+    flash_command(FLASH_CMD_WRITE_ENABLE);
+    flash_address(FLASH_CMD_PROGRAM, log_pages * FLASH_PAGE_BYTES);
+    flash_dma_start(page, NULL, 2 + (page[0] | (page[1] << 8)));
+    programming = 1;
+}
+
+/**
+ * @brief Whether the main loop may sleep while logging: no page is being
+ *        programmed, whose end raises no interrupt, and the chip is in
+ *        deep power-down
+ */
+uint32_t flash_log_asleep(void)
+{
+    return powered_down;
+}
+
+/**
+ * @brief Payload bytes of the log, what a download sends
+ */
+uint32_t flash_log_bytes(void)
+{
+    return log_pages ? (log_pages - 1) * FLASH_PAGE_PAYLOAD + last_count : 0;
+}
+
+/**
+ * @brief Starts a download ('O' FLASH_LOG_DOWNLOAD): flash_log_read then
+ *        returns the log piece by piece
+ * @retval 1 if started, 0 while the chip is busy or without a flash
+ */
+uint32_t flash_log_download(void)
+{
+    if (flash_log_state != FLASH_LOG_IDLE && flash_log_state != FLASH_LOG_FULL) return 0;
+
+    flash_wake();
+    read_page = 0;
+    read_started = 0;
+    flash_log_state = FLASH_LOG_SENDING;
+    return 1;
+}
+
+/**
+ * @brief Reads the next pages of a download and packs their payloads, the
+ *        first piece behind FLASH_DOWNLOAD_MAGIC and the byte count. The
+ *        CPU waits for the read, about 0.5 us a byte, while USB sends the
+ *        previous piece; called from the main loop
+ * @param buf - destination, FLASH_PAGE_BYTES + 8 bytes at least
+ * @param size - its size
+ * @retval bytes in buf; 0 once the log is sent, which ends the download
+ */
+uint32_t flash_log_read(uint8_t *buf, uint32_t size)
+{
+    uint32_t head = 0;
+
+    if (flash_log_state != FLASH_LOG_SENDING) return 0;
+    if (!read_started)
+    {
+        uint32_t words[2] = { FLASH_DOWNLOAD_MAGIC, flash_log_bytes() };
+        memcpy(buf, words, sizeof(words));
+        head = sizeof(words);
+        read_started = 1;
+    }
+    uint32_t pages = (size - head) / FLASH_PAGE_BYTES;
+    if (pages > log_pages - read_page) pages = log_pages - read_page;
+    if (pages == 0)
+    {
+        if (head == 0) flash_log_state = FLASH_LOG_IDLE;
+        return head;
+    }
+
+    flash_address(FLASH_CMD_READ, read_page * FLASH_PAGE_BYTES);
+    flash_dma_start(NULL, buf + head, pages * FLASH_PAGE_BYTES);
+    while (!flash_dma_done());
+    read_page += pages;
+
+    // payloads only: each moves down over the counts before it
+    uint32_t len = head;
+    for (uint32_t i = 0; i < pages; i++)
+    {
+        const uint8_t *page = buf + head + i * FLASH_PAGE_BYTES;
+        uint32_t count = page[0] | (page[1] << 8);
+        if (count > FLASH_PAGE_PAYLOAD) count = FLASH_PAGE_PAYLOAD;
+        memmove(buf + len, page + 2, count);
+        len += count;
+    }
+    return len;
+}
+
+/**
+ * @brief Data of the BUS_FLASH record answering 'O': the log's size in
+ *        4 KiB blocks and the state
+ */
+uint32_t flash_log_report(void)
+{
+    uint32_t blocks = (log_pages * FLASH_PAGE_BYTES + FLASH_BLOCK_BYTES - 1) / FLASH_BLOCK_BYTES;
+
+    return (blocks > 0xFFFF ? 0xFFFF : blocks) | (flash_log_state << 16);
+}
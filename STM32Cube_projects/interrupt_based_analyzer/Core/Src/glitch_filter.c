@@ -0,0 +1,113 @@
+/**
+  ******************************************************************************
+  * @file           : glitch_filter.c
+  * @brief          : Minimum pulse width filter of the EXTI channels
+  ******************************************************************************
+  * Each filtered channel holds at most one edge: its time and the levels
+  * of the interrupt that saw it, so a held edge is stored in the same
+  * form as one pushed right away. Storing goes through
+  * capture_store_edges(), the EXTI handlers' own tail.
+  ******************************************************************************
+  */
+
+#include "glitch_filter.h"
+
+volatile uint32_t glitch_mask = 0;
+volatile uint32_t glitch_suppressed = 0;
+
+static uint32_t width[4];               // minimum pulse width in ticks, 0 = off
+static uint32_t held = 0;               // bit n set while channel n holds an edge
+static uint32_t held_time[4];
+static uint32_t held_levels[4];
+
+/**
+ * @brief Sets one channel's minimum pulse width; called from the host
+ *        command parser (main loop)
+ * @param channel - probe channel 0-3, or GLITCH_ALL_CHANNELS
+ * @param ticks - width in clock ticks, 0 to stop filtering
+ * @retval none
+ */
+void glitch_configure(uint32_t channel, uint32_t ticks)
+{
+    uint32_t mask = glitch_mask;
+
+    for (uint32_t ch = 0; ch < 4; ch++)
+    {
+        if (channel != ch && channel != GLITCH_ALL_CHANNELS) continue;
+        width[ch] = ticks;
+        if (ticks) mask |= 1UL << ch;
+        else mask &= ~(1UL << ch);
+    }
+
+    __disable_irq();
+    glitch_mask = mask;
+    glitch_poll(get_32bit_timer());  // a channel just turned off lets its edge go
+    __enable_irq();
+}
+
+/**
+ * @brief Filters one EXTI interrupt's edges; called from the EXTI ISR
+ * @param levels - CH1-CH4 levels after the edges, bit n = channel n
+ * @param changed - channels with an edge, bit n = channel n
+ * @param time - 32-bit clock time of the edges
+ * @retval the channels of changed whose edges are stored now: the ones
+ *         not filtered
+ */
+uint32_t glitch_filter(uint32_t levels, uint32_t changed, uint32_t time)
+{
+    uint32_t filtered = changed & glitch_mask;
+
+    while (filtered)
+    {
+        uint32_t ch = __CLZ(__RBIT(filtered));  // lowest pending line
+        uint32_t bit = 1UL << ch;
+
+        filtered &= filtered - 1;
+        if (held & bit)
+        {
+            held &= ~bit;
+            if (time - held_time[ch] < width[ch])
+            {
+                glitch_suppressed++;  // the pulse never reached the width
+                continue;
+            }
+            capture_store_edges(held_levels[ch], bit, held_time[ch]);
+        }
+        held |= bit;
+        held_time[ch] = time;
+        held_levels[ch] = levels;
+    }
+    return changed & ~glitch_mask;
+}
+
+/**
+ * @brief Stores the held edges that have outlived their channel's width;
+ *        called from the main loop with IRQs masked
+ * @param now - current 32-bit clock time
+ * @retval none
+ */
+void glitch_poll(uint32_t now)
+{
+    uint32_t pending = held;
+
+    while (pending)
+    {
+        uint32_t ch = __CLZ(__RBIT(pending));
+        uint32_t bit = 1UL << ch;
+
+        pending &= pending - 1;
+        if ((glitch_mask & bit) && now - held_time[ch] < width[ch]) continue;
+        held &= ~bit;
+        capture_store_edges(held_levels[ch], bit, held_time[ch]);
+    }
+}
+
+/**
+ * @brief Forgets the held edges with the ring they were headed for;
+ *        called with IRQs masked
+ * @retval none
+ */
+void glitch_reset(void)
+{
+    held = 0;
+}
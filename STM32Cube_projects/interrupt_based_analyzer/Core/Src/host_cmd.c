@@ -0,0 +1,478 @@
+/**
+  ******************************************************************************
+  * @file           : host_cmd.c
+  * @brief          : Commands sent by the host over the CDC OUT endpoint
+  ******************************************************************************
+  */
+
+#include "host_cmd.h"
+#include "board_sync.h"
+#include "boot_capture.h"
+#include "boot_slot.h"
+#include "clock_trim.h"
+#include "irq_timing.h"
+#include "poll_capture.h"
+#include <string.h>
+
+#define HOST_CMD_MAX 16
+
+static uint8_t cmd_buf[HOST_CMD_MAX];
+static uint32_t cmd_len = 0;
+static uint8_t cmd_queue[HOST_CMD_QUEUE][HOST_CMD_MAX];
+static volatile uint32_t queue_head = 0;   // advanced by the USB interrupt
+static volatile uint32_t queue_tail = 0;   // advanced by the main loop
+volatile uint32_t host_cmd_overruns = 0;   // commands lost to a full queue
+#if CONFIG_STAGE
+static uint8_t stage_block[HOST_STAGE_MAX][HOST_CMD_MAX];  // shadow settings of the next 's' commit
+static uint32_t stage_count = 0;
+static uint32_t staging = 0;               // settings commands go to stage_block
+#endif
+
+static uint32_t get_u16(const uint8_t *p) { return p[0] | (p[1] << 8); }
+static uint32_t get_u32(const uint8_t *p) { return get_u16(p) | (get_u16(p + 2) << 16); }
+
+/**
+ * @brief Total length of a command, opcode included; 0 if unknown
+ */
+static uint32_t cmd_size(uint8_t opcode)
+{
+    switch (opcode)
+    {
+    case HOST_CMD_FLUSH:  return 1 + 1 + 2 + 4;
+    case HOST_CMD_MODE:   return 1 + 1;
+    case HOST_CMD_CONFIG: return 1 + 4 + 1 + 2;
+    case HOST_CMD_RUN:    return 1 + 1;
+    case HOST_CMD_INFO:   return 1;
+    case HOST_CMD_TRIM:   return 1 + 4;
+    case HOST_CMD_LAYOUT: return 1 + 1;
+#if IRQ_TIMING
+    case HOST_CMD_STATS:  return 1;
+#endif
+#if USB_BENCHMARK
+    case HOST_CMD_BENCH:  return 1 + 4 + 2;
+#endif
+#if UART_DECODE
+    case HOST_CMD_UART:   return 1 + 1 + 4 + 1;
+#endif
+#if !USB_BENCHMARK
+    case HOST_CMD_CHANNELS: return 1 + 1;
+#endif
+#if SS_GATE && !USB_BENCHMARK
+    case HOST_CMD_GATE:   return 1 + 1 + 1 + 1;
+#endif
+#if !USB_BENCHMARK && !CAPTURE_CLOCK_DWT
+    case HOST_CMD_CLOCK:  return 1 + 1;
+#endif
+#if CAPTURE_TRIGGER && !USB_BENCHMARK
+    case HOST_CMD_TRIGGER: return 1 + 1 + 1 + 1 + 1 + 4 + 2 + 4;
+    case HOST_CMD_DUMP:   return 1 + 4 + 4;
+#endif
+#if CAPTURE_SPI_DMA
+    case HOST_CMD_SPI:    return 1 + 1 + 1;
+#endif
+#if I2C_SNIFF
+    case HOST_CMD_I2C:    return 1 + 1 + 1;
+#endif
+#if GLITCH_FILTER
+    case HOST_CMD_GLITCH: return 1 + 1 + 4;
+#endif
+#if STORM_LIMIT
+    case HOST_CMD_STORM:  return 1 + 1 + 4 + 2;
+#endif
+#if CHANNEL_MEASURE
+    case HOST_CMD_MEASURE: return 1 + 1 + 2;
+#endif
+#if BOARD_SYNC
+    case HOST_CMD_SYNC:   return 1 + 1 + 2;
+#endif
+#if DUAL_IMAGE
+    case HOST_CMD_SLOT:   return 1 + 1;
+#endif
+#if FLASH_LOG
+    case HOST_CMD_FLASH:  return 1 + 1;
+#endif
+#if UART_DECODE || I2C_SNIFF
+    case HOST_CMD_FILTER: return 1 + 1 + 1 + 1 + 1;
+#endif
+#if BOOT_CAPTURE
+    case HOST_CMD_BOOT:   return 1 + 1 + 1 + 1;
+#endif
+#if ANALOG_CAPTURE
+    case HOST_CMD_ANALOG: return 1 + 4;
+#endif
+#if FLOW_CREDIT
+    case HOST_CMD_CREDIT: return 1 + 1 + 2;
+#endif
+#if PULSE_RECORDS
+    case HOST_CMD_PULSE:  return 1 + 1 + 1;
+#endif
+#if CONFIG_STAGE
+    case HOST_CMD_STAGE:  return 1 + 1;
+#endif
+    default:              return 0;
+    }
+}
+
+static void cmd_execute(const uint8_t *cmd)
+{
+    switch (cmd[0])
+    {
+    case HOST_CMD_FLUSH:
+        capture_set_flush_policy(cmd[1], get_u16(cmd + 2), get_u32(cmd + 4));
+        break;
+    case HOST_CMD_MODE:
+        capture_set_mode(cmd[1]);
+        break;
+    case HOST_CMD_CONFIG:
+        poll_configure(get_u32(cmd + 1), cmd[5], get_u16(cmd + 6));
+        break;
+    case HOST_CMD_RUN:
+        capture_set_running(cmd[1]);
+        break;
+    case HOST_CMD_LAYOUT:
+        irq_set_layout(cmd[1]);
+        break;
+#if IRQ_TIMING
+    case HOST_CMD_STATS:
+        capture_send_irq_timing();
+        break;
+#endif
+    case HOST_CMD_INFO:
+        capture_send_info();
+        break;
+    case HOST_CMD_TRIM:
+        clock_trim_adjust((int32_t)get_u32(cmd + 1));
+        capture_send_info();
+        break;
+#if USB_BENCHMARK
+    case HOST_CMD_BENCH:
+        capture_bench_configure(get_u32(cmd + 1), get_u16(cmd + 5));
+        break;
+#endif
+#if UART_DECODE
+    case HOST_CMD_UART:
+        capture_set_uart_decode(cmd[1], get_u32(cmd + 2), cmd[6]);
+        break;
+#endif
+#if !USB_BENCHMARK
+    case HOST_CMD_CHANNELS:
+        capture_set_channels(cmd[1]);
+        break;
+#endif
+#if SS_GATE && !USB_BENCHMARK
+    case HOST_CMD_GATE:
+        capture_set_ss_gate(cmd[1], cmd[2], cmd[3]);
+        break;
+#endif
+#if !USB_BENCHMARK && !CAPTURE_CLOCK_DWT
+    case HOST_CMD_CLOCK:
+        capture_set_clock(cmd[1]);
+        break;
+#endif
+#if CAPTURE_TRIGGER && !USB_BENCHMARK
+    case HOST_CMD_TRIGGER:
+        capture_set_trigger(cmd[1], cmd[2], cmd[3], cmd[4], get_u32(cmd + 5),
+                            get_u16(cmd + 9), get_u32(cmd + 11));
+        break;
+    case HOST_CMD_DUMP:
+        capture_dump(get_u32(cmd + 1), get_u32(cmd + 5));
+        break;
+#endif
+#if CAPTURE_SPI_DMA
+    case HOST_CMD_SPI:
+        capture_set_spi_sniff(cmd[1], cmd[2]);
+        break;
+#endif
+#if I2C_SNIFF
+    case HOST_CMD_I2C:
+        capture_set_i2c_sniff(cmd[1], cmd[2]);
+        break;
+#endif
+#if GLITCH_FILTER
+    case HOST_CMD_GLITCH:
+        capture_set_glitch_filter(cmd[1], get_u32(cmd + 2));
+        break;
+#endif
+#if STORM_LIMIT
+    case HOST_CMD_STORM:
+        capture_set_storm_limit(cmd[1], get_u32(cmd + 2), get_u16(cmd + 6));
+        break;
+#endif
+#if CHANNEL_MEASURE
+    case HOST_CMD_MEASURE:
+        capture_set_measure(cmd[1], get_u16(cmd + 2));
+        break;
+#endif
+#if BOARD_SYNC
+    case HOST_CMD_SYNC:
+        board_sync_configure(cmd[1], get_u16(cmd + 2));
+        break;
+#endif
+#if DUAL_IMAGE
+    case HOST_CMD_SLOT:
+        boot_slot_switch(cmd[1]);
+        break;
+#endif
+#if FLASH_LOG
+    case HOST_CMD_FLASH:
+        capture_set_flash_log(cmd[1]);
+        break;
+#endif
+#if UART_DECODE || I2C_SNIFF
+    case HOST_CMD_FILTER:
+        capture_set_filter(cmd[1], cmd[2], cmd[3], cmd[4]);
+        break;
+#endif
+#if BOOT_CAPTURE
+    case HOST_CMD_BOOT:
+        boot_capture_store(cmd[1], cmd[2], cmd[3]);
+        break;
+#endif
+#if ANALOG_CAPTURE
+    case HOST_CMD_ANALOG:
+        capture_set_analog(get_u32(cmd + 1));
+        break;
+#endif
+#if FLOW_CREDIT
+    case HOST_CMD_CREDIT:
+        capture_set_credit(cmd[1], get_u16(cmd + 2));
+        break;
+#endif
+#if PULSE_RECORDS
+    case HOST_CMD_PULSE:
+        capture_set_pulses(cmd[1], cmd[2]);
+        break;
+#endif
+    }
+}
+
+/**
+ * @brief HOST_CAP_* bits of this build, reported by 'V'
+ */
+uint32_t host_cmd_capabilities(void)
+{
+    return HOST_CAP_FLUSH
+        | HOST_CAP_LAYOUT
+        | HOST_CAP_TRIM
+#if IRQ_TIMING
+        | HOST_CAP_STATS
+#endif
+#if USB_BENCHMARK
+        | HOST_CAP_BENCH
+#else
+        | HOST_CAP_EVENTS
+#if !USB_ISO_STREAM
+        | HOST_CAP_POLL
+#endif
+#if SOF_SYNC_FRAMES
+        | HOST_CAP_SOF_SYNC
+#endif
+        | HOST_CAP_CHANNELS
+#if !CAPTURE_CLOCK_DWT
+        | HOST_CAP_CLOCK
+#endif
+#if UART_DECODE
+        | HOST_CAP_UART
+#endif
+#if CAPTURE_TRIGGER
+        | HOST_CAP_TRIGGER
+#endif
+#if CAPTURE_SPI_DMA
+        | HOST_CAP_SPI
+#endif
+#if I2C_SNIFF
+        | HOST_CAP_I2C
+#endif
+#if GLITCH_FILTER
+        | HOST_CAP_GLITCH
+#endif
+#if STORM_LIMIT
+        | HOST_CAP_STORM
+#endif
+#if CHANNEL_MEASURE
+        | HOST_CAP_MEASURE
+#endif
+#if BOARD_SYNC
+        | HOST_CAP_SYNC
+#endif
+#if ADAPTIVE_CAPTURE
+        | HOST_CAP_ADAPTIVE
+#endif
+#if FLASH_LOG
+        | HOST_CAP_FLASH_LOG
+#endif
+#endif
+#if DUAL_IMAGE
+        | HOST_CAP_DUAL
+#endif
+#if EVENT_FORMAT_SNAPSHOT
+        | HOST_CAP_SNAPSHOT
+#endif
+#if STREAM_COMPACT
+        | HOST_CAP_COMPACT
+#endif
+#if STREAM_FRAMED
+        | HOST_CAP_FRAMED
+#endif
+#if CAPTURE_IC_DMA
+        | HOST_CAP_IC_DMA
+#endif
+#if USB_VENDOR_CLASS
+        | HOST_CAP_BULK
+#endif
+#if USB_ISO_STREAM
+        | HOST_CAP_ISO
+#endif
+        ;
+}
+
+/**
+ * @brief Fills the header a restarted stream begins with
+ * @param header - filled in, check word included
+ * @param encoding - STREAM_ENCODING_*
+ * @param compression - STREAM_COMPRESSION_*
+ * @param channels - probe channels in the stream
+ * @param flags - STREAM_FLAG_*
+ * @param time_bits - bits of an event's time field, 32 for blocks
+ * @param tick_hz - timestamp clock with the stored correction
+ * @retval none
+ */
+void host_stream_header(StreamHeader *header, uint32_t encoding, uint32_t compression,
+                        uint32_t channels, uint32_t flags, uint32_t time_bits, uint32_t tick_hz)
+{
+    const uint32_t *words = (const uint32_t *)header;
+    uint32_t check = 0;
+
+    header->magic = STREAM_HEADER_MAGIC;
+    header->version = STREAM_HEADER_VERSION;
+    header->size = sizeof(StreamHeader);
+    header->encoding = encoding;
+    header->compression = compression;
+    header->channels = channels;
+    header->flags = flags;
+    header->time_bits = time_bits;
+    header->protocol = HOST_PROTOCOL_VERSION;
+    header->tick_hz = tick_hz;
+    header->capabilities = host_cmd_capabilities();
+    for (uint32_t i = 0; i < sizeof(StreamHeader) / 4 - 1; i++) check ^= words[i];
+    header->check = ~check;
+}
+
+/**
+ * @brief Runs one command and echoes it
+ */
+static void cmd_run(const uint8_t *cmd)
+{
+    cmd_execute(cmd);
+#if CONFIG_ECHO
+    capture_echo_command(cmd, cmd_size(cmd[0]));
+#endif
+}
+
+#if CONFIG_STAGE
+/**
+ * @brief Whether a command changes a setting of the running capture, so
+ *        it may be staged; stream restarts, requests, flash writes and
+ *        credit grants, which the stream waits on, run as they arrive
+ */
+static uint32_t cmd_stageable(uint8_t opcode)
+{
+    switch (opcode)
+    {
+    case HOST_CMD_MODE:
+    case HOST_CMD_CONFIG:
+    case HOST_CMD_RUN:
+    case HOST_CMD_INFO:
+    case HOST_CMD_STATS:
+    case HOST_CMD_BENCH:
+    case HOST_CMD_TRIM:
+    case HOST_CMD_CLOCK:
+    case HOST_CMD_SLOT:
+    case HOST_CMD_FLASH:
+    case HOST_CMD_BOOT:
+    case HOST_CMD_DUMP:
+    case HOST_CMD_CREDIT:
+        return 0;
+    default:
+        return 1;
+    }
+}
+
+/**
+ * @brief Runs 's': starts, commits or discards the staged block
+ */
+static void cmd_stage(uint32_t mode)
+{
+    if (mode == STAGE_COMMIT && staging && stage_count)
+    {
+        uint32_t start = capture_swap_begin();
+        for (uint32_t i = 0; i < stage_count; i++) cmd_run(stage_block[i]);
+        capture_swap_end(start, stage_count);
+    }
+    staging = mode == STAGE_BEGIN;
+    stage_count = 0;
+}
+#endif
+
+/**
+ * @brief Runs the queued commands, or stages the settings commands
+ *        between 's' STAGE_BEGIN and its commit; called from the main loop
+ * @retval none
+ */
+void host_cmd_process(void)
+{
+    while (queue_tail != queue_head)
+    {
+        const uint8_t *cmd = cmd_queue[queue_tail & (HOST_CMD_QUEUE - 1)];
+
+#if CONFIG_STAGE
+        if (cmd[0] == HOST_CMD_STAGE)
+        {
+            cmd_stage(cmd[1]);
+        }
+        else if (staging && cmd_stageable(cmd[0]))
+        {
+            if (stage_count < HOST_STAGE_MAX) memcpy(stage_block[stage_count++], cmd, cmd_size(cmd[0]));
+            else host_cmd_overruns++;
+        }
+        else
+#endif
+        cmd_run(cmd);
+        queue_tail++;
+    }
+}
+
+/**
+ * @brief Feeds bytes received from the host to the command parser and
+ *        queues each complete command; runs in the USB interrupt from
+ *        CDC_Receive_FS
+ * @param buf - received bytes
+ * @param len - number of bytes
+ * @retval none
+ */
+void host_cmd_receive(const uint8_t *buf, uint32_t len)
+{
+    while (len--)
+    {
+        cmd_buf[cmd_len++] = *buf++;
+
+        uint32_t size = cmd_size(cmd_buf[0]);
+        if (size == 0)
+        {
+            cmd_len = 0;  // not an opcode, resync on the next byte
+        }
+        else if (cmd_len == size)
+        {
+            if (queue_head - queue_tail < HOST_CMD_QUEUE)
+            {
+                memcpy(cmd_queue[queue_head & (HOST_CMD_QUEUE - 1)], cmd_buf, size);
+                queue_head++;
+            }
+            else
+            {
+                host_cmd_overruns++;
+            }
+            cmd_len = 0;
+        }
+    }
+}
@@ -0,0 +1,248 @@
+/**
+  ******************************************************************************
+  * @file           : i2c_sniff.c
+  * @brief          : On-device I2C framing of two probe channels
+  ******************************************************************************
+  * The state machine is pipeline.I2cStream's: an SDA edge while SCL is
+  * high is a START (falling) or STOP (rising); otherwise each SCL rise
+  * shifts in the SDA level, eight for a byte and a ninth for its ACK.
+  * Only edges move it, so a stretched clock needs nothing special.
+  ******************************************************************************
+  */
+
+#include "i2c_sniff.h"
+#include "event_format.h"
+#include "pin_map.h"
+
+#define I2C_IDLE  0
+#define I2C_SHIFT 1     // bits of the byte
+#define I2C_ACK   2     // the ninth clock
+
+volatile uint32_t i2c_sniff_mask = 0;
+
+static uint32_t scl_bit;                // channel masks of the two lines
+static uint32_t sda_bit;
+static uint32_t scl_level = 1;
+static uint32_t sda_level = 1;
+static uint32_t state = I2C_IDLE;
+static uint32_t byte_event;             // I2C_EVENT_ADDRESS or _DATA
+static uint32_t value;
+static uint32_t count;
+static uint32_t byte_time;              // clock time of the byte's first SCL rise
+
+static uint32_t filter_match;           // 'X' address filter, mask 0 keeps all
+static uint32_t filter_mask;
+static uint32_t held_time;              // START waiting for its address
+static uint32_t held_flag;
+static uint32_t dropping;               // the transaction in progress is filtered out
+static uint32_t dropped;                // transactions dropped since the last report
+static uint32_t report_time;            // clock time of the last report
+
+/**
+ * @brief Pushes one MARKER_BUS record
+ */
+static void i2c_emit(uint32_t time, uint32_t event, uint32_t byte, uint32_t flag)
+{
+    uint32_t words[MARKER_BUS_WORDS] = {
+        time,
+        byte | (event << 8) | (flag << 16) | (BUS_I2C << 24)
+    };
+    capture_push_record(event_pack_marker(MARKER_BUS, 0), words, MARKER_BUS_WORDS);
+}
+
+/**
+ * @brief Pushes the dropped transaction count as a BUS_FILTER record
+ */
+static void i2c_report(uint32_t time)
+{
+    uint32_t words[MARKER_BUS_WORDS] = {
+        time,
+        dropped | (FILTER_I2C << 16) | (BUS_FILTER << 24)
+    };
+    capture_push_record(event_pack_marker(MARKER_BUS, 0), words, MARKER_BUS_WORDS);
+    dropped = 0;
+    report_time = time;
+}
+
+/**
+ * @brief Decides a filtered transaction by its address byte
+ */
+static void i2c_address(uint32_t time)
+{
+    if (((value >> 1) & filter_mask) != (filter_match & filter_mask))
+    {
+        dropping = 1;
+        if (++dropped == 0xFFFF) i2c_report(time);
+        return;
+    }
+    if (dropped) i2c_report(held_time);
+    i2c_emit(held_time, I2C_EVENT_START, 0, held_flag);
+    i2c_emit(byte_time, I2C_EVENT_ADDRESS, value, sda_level == 0);
+}
+
+static void i2c_begin_byte(uint32_t event)
+{
+    byte_event = event;
+    value = 0;
+    count = 0;
+    state = I2C_SHIFT;
+}
+
+static void i2c_sda(uint32_t level, uint32_t time)
+{
+    if (level != sda_level && scl_level)
+    {
+        if (level == 0)
+        {
+            if (filter_mask)
+            {
+                held_time = time;  // the address decides
+                held_flag = state != I2C_IDLE;
+                dropping = 1;
+            }
+            else
+            {
+                i2c_emit(time, I2C_EVENT_START, 0, state != I2C_IDLE);
+            }
+            i2c_begin_byte(I2C_EVENT_ADDRESS);
+        }
+        else if (state != I2C_IDLE)
+        {
+            if (!dropping) i2c_emit(time, I2C_EVENT_STOP, 0, 0);
+            dropping = 0;
+            state = I2C_IDLE;
+        }
+    }
+    sda_level = level;
+}
+
+static void i2c_scl(uint32_t level, uint32_t time)
+{
+    uint32_t rising = level && !scl_level;
+
+    scl_level = level;
+    if (!rising || state == I2C_IDLE) return;
+    if (state == I2C_ACK)
+    {
+        if (filter_mask && byte_event == I2C_EVENT_ADDRESS)
+        {
+            dropping = 0;
+            i2c_address(time);
+        }
+        else if (!dropping)
+        {
+            i2c_emit(byte_time, byte_event, value, sda_level == 0);
+        }
+        i2c_begin_byte(I2C_EVENT_DATA);
+        return;
+    }
+    if (count == 0) byte_time = time;
+    value = (value << 1) | sda_level;  // MSB first
+    if (++count == 8) state = I2C_ACK;
+}
+
+/**
+ * @brief Selects the SCL and SDA channels; called from the host command
+ *        parser (main loop)
+ * @param scl_channel - probe channel 0-3, I2C_SNIFF_OFF to stop framing
+ * @param sda_channel - probe channel 0-3, not scl_channel
+ * @retval none
+ */
+void i2c_sniff_configure(uint32_t scl_channel, uint32_t sda_channel)
+{
+    if (scl_channel > 3 || sda_channel > 3 || scl_channel == sda_channel)
+    {
+        scl_channel = I2C_SNIFF_OFF;
+    }
+
+    __disable_irq();
+    if (scl_channel == I2C_SNIFF_OFF)
+    {
+        i2c_sniff_mask = 0;
+    }
+    else
+    {
+        scl_bit = 1UL << scl_channel;
+        sda_bit = 1UL << sda_channel;
+        i2c_sniff_mask = scl_bit | sda_bit;
+    }
+    i2c_sniff_reset();
+    __enable_irq();
+}
+
+/**
+ * @brief Feeds one EXTI interrupt's edges of the two lines; called from
+ *        the EXTI ISR
+ * @param levels - CH1-CH4 levels after the edges, bit n = channel n
+ * @param changed - channels with an edge, bit n = channel n
+ * @param time - 32-bit clock time of the edges
+ * @retval none
+ */
+void i2c_sniff_edges(uint32_t levels, uint32_t changed, uint32_t time)
+{
+    uint32_t scl = (levels & scl_bit) != 0;
+    uint32_t sda = (levels & sda_bit) != 0;
+
+    if (!(changed & scl_bit))
+    {
+        i2c_sda(sda, time);
+    }
+    else if (!(changed & sda_bit))
+    {
+        i2c_scl(scl, time);
+    }
+    else if (scl)
+    {
+        i2c_sda(sda, time);  // data set up before the clock rose
+        i2c_scl(scl, time);
+    }
+    else
+    {
+        i2c_scl(scl, time);  // data changed after the clock fell
+        i2c_sda(sda, time);
+    }
+}
+
+/**
+ * @brief Sets the address filter (host command 'X' FILTER_I2C); called
+ *        with IRQs masked. A count still unreported goes out first
+ * @param match - 7-bit address the kept transactions have
+ * @param mask - address bits compared, 0 keeps every transaction
+ * @retval none
+ */
+void i2c_sniff_filter(uint32_t match, uint32_t mask)
+{
+    if (dropped) i2c_report(get_32bit_timer());
+    filter_match = match & 0x7F;
+    filter_mask = mask & 0x7F;
+    i2c_sniff_reset();
+}
+
+/**
+ * @brief Reports the transactions dropped since the last report once it
+ *        is ticks old, so a bus with no kept traffic still shows what it
+ *        carries; called from the main loop with IRQs masked
+ * @param now - get_32bit_timer() value
+ * @param ticks - clock ticks between reports
+ * @retval none
+ */
+void i2c_sniff_filter_poll(uint32_t now, uint32_t ticks)
+{
+    if (dropped && now - report_time >= ticks) i2c_report(now);
+}
+
+/**
+ * @brief Drops a transaction in progress and takes the line levels from
+ *        the pins; decoding resumes at the next START. Called with IRQs
+ *        masked
+ * @retval none
+ */
+void i2c_sniff_reset(void)
+{
+    uint32_t levels = pin_map_channels(GPIOB->IDR);
+
+    state = I2C_IDLE;
+    dropping = 0;
+    scl_level = (levels & scl_bit) != 0;
+    sda_level = (levels & sda_bit) != 0;
+}
@@ -0,0 +1,209 @@
+/**
+  ******************************************************************************
+  * @file           : irq_timing.c
+  * @brief          : Interrupt and hot-path timing statistics and NVIC
+  *                   priority layouts
+  ******************************************************************************
+  * Each handler or region adds its cycles to one timer: a compare per
+  * extreme, a 64-bit add and a histogram bin from __CLZ. Every timer has
+  * one writer at a time (the transmit timer's main loop caller masks the
+  * USB IRQ), so a layout where one handler preempts another needs no
+  * locking; the main loop copies and clears them with IRQs masked.
+  ******************************************************************************
+  */
+
+#include "irq_timing.h"
+#include "event_format.h"
+#include "pin_map.h"
+#include <string.h>
+
+static uint32_t irq_layout = IRQ_LAYOUT_FLAT;
+
+/**
+ * @brief Sets the EXTI and USB preemption priorities; called at start-up
+ *        and from the host command parser (main loop)
+ * @param layout - IRQ_LAYOUT_*
+ * @retval none
+ */
+void irq_set_layout(uint32_t layout)
+{
+    if (layout > IRQ_LAYOUT_USB_FIRST) return;
+
+    uint32_t edges = layout == IRQ_LAYOUT_USB_FIRST;
+    uint32_t usb = layout == IRQ_LAYOUT_EDGES_FIRST;
+
+    pin_map_irq_priority(edges);
+    HAL_NVIC_SetPriority(USB_LP_CAN1_RX0_IRQn, usb, 0);
+    irq_layout = layout;
+}
+
+#if IRQ_TIMING
+typedef struct
+{
+    uint32_t count;
+    uint32_t min;
+    uint32_t max;
+    uint64_t sum;
+    uint32_t bins[IRQ_TIMING_BINS];
+} IrqTimer;
+
+volatile uint32_t irq_exti_entry;
+volatile uint32_t irq_stamp_open = 0;
+
+static IrqTimer timers[IRQ_TIMERS];
+static uint32_t blocked = 0;
+static uint32_t blocked_max = 0;
+static uint32_t exti_peak = 0;      // longest EXTI handler since the last health report
+
+static void timer_clear(IrqTimer *timer)
+{
+    memset(timer, 0, sizeof *timer);
+    timer->min = 0xFFFFFFFF;
+}
+
+static void timer_add(IrqTimer *timer, uint32_t cycles)
+{
+    uint32_t bin = 32 - __CLZ(cycles);
+
+    timer->count++;
+    timer->sum += cycles;
+    if (cycles < timer->min) timer->min = cycles;
+    if (cycles > timer->max) timer->max = cycles;
+    timer->bins[bin < IRQ_TIMING_BINS ? bin : IRQ_TIMING_BINS - 1]++;
+}
+
+/**
+ * @brief Starts the cycle counter and clears the statistics
+ * @retval none
+ */
+void irq_timing_init(void)
+{
+    CoreDebug->DEMCR |= CoreDebug_DEMCR_TRCENA_Msk;
+    DWT->CTRL |= DWT_CTRL_CYCCNTENA_Msk;
+    for (uint32_t t = 0; t < IRQ_TIMERS; t++) timer_clear(&timers[t]);
+}
+
+/**
+ * @brief Times the EXTI handler's timestamp read; called right after it.
+ *        Only the first read of a handler counts
+ * @retval none
+ */
+void irq_timing_stamp(void)
+{
+    if (!irq_stamp_open) return;
+    irq_stamp_open = 0;
+    timer_add(&timers[IRQ_TIMER_STAMP], DWT->CYCCNT - irq_exti_entry);
+}
+
+/**
+ * @brief Last thing in the EXTI handlers
+ * @retval none
+ */
+void irq_timing_exti_exit(void)
+{
+    uint32_t cycles = DWT->CYCCNT - irq_exti_entry;
+
+    timer_add(&timers[IRQ_TIMER_EXTI], cycles);
+    if (cycles > exti_peak) exti_peak = cycles;
+}
+
+/**
+ * @brief Last thing in the USB handler: times it and checks whether an
+ *        edge waited for it
+ * @param start - DWT->CYCCNT at the handler's entry
+ * @retval none
+ */
+void irq_timing_usb(uint32_t start)
+{
+    uint32_t cycles = DWT->CYCCNT - start;
+
+    timer_add(&timers[IRQ_TIMER_USB], cycles);
+    if (pin_map_irq_pending())
+    {
+        blocked++;
+        if (cycles > blocked_max) blocked_max = cycles;
+    }
+}
+
+/**
+ * @brief Adds a hot-path region's cycles to its timer
+ * @param timer - IRQ_TIMER_*
+ * @param start - DWT->CYCCNT at the region's start
+ * @retval none
+ */
+void irq_timing_add(uint32_t timer, uint32_t start)
+{
+    timer_add(&timers[timer], DWT->CYCCNT - start);
+}
+
+/**
+ * @brief Pushes one item, in two records above 16 bits
+ */
+static void stats_put(uint32_t time, uint32_t item, uint32_t value)
+{
+    uint32_t words[MARKER_BUS_WORDS] = {
+        time,
+        (value & 0xFFFF) | (item << 16) | (BUS_STATS << 24)
+    };
+
+    __disable_irq();
+    capture_push_reply(MARKER_BUS, words, MARKER_BUS_WORDS);
+    if (value >> 16)
+    {
+        words[1] = (value >> 16) | ((item | IRQ_ITEM_HIGH) << 16) | (BUS_STATS << 24);
+        capture_push_reply(MARKER_BUS, words, MARKER_BUS_WORDS);
+    }
+    __enable_irq();
+}
+
+/**
+ * @brief Sends the statistics since the last report and clears them
+ *        (host command 'S'); called from the main loop in the edge engine
+ * @retval none
+ */
+void irq_timing_send(void)
+{
+    IrqTimer copy[IRQ_TIMERS];
+    uint32_t copy_blocked, copy_blocked_max;
+
+    __disable_irq();
+    uint32_t time = get_32bit_timer();
+    memcpy(copy, timers, sizeof copy);
+    copy_blocked = blocked;
+    copy_blocked_max = blocked_max;
+    for (uint32_t t = 0; t < IRQ_TIMERS; t++) timer_clear(&timers[t]);
+    blocked = blocked_max = 0;
+    __enable_irq();
+
+    for (uint32_t t = 0; t < IRQ_TIMERS; t++)
+    {
+        const IrqTimer *timer = &copy[t];
+        uint32_t item = IRQ_ITEM_TIMER + IRQ_ITEM_STRIDE * t;
+
+        stats_put(time, item, timer->count);
+        if (timer->count == 0) continue;
+        stats_put(time, item + 1, timer->min);
+        stats_put(time, item + 2, timer->max);
+        stats_put(time, item + 3, (uint32_t)(timer->sum / timer->count));
+        for (uint32_t bin = 0; bin < IRQ_TIMING_BINS; bin++)
+        {
+            if (timer->bins[bin]) stats_put(time, item + 4 + bin, timer->bins[bin]);
+        }
+    }
+    stats_put(time, IRQ_ITEM_BLOCKED, copy_blocked);
+    stats_put(time, IRQ_ITEM_BLOCKED_MAX, copy_blocked_max);
+    stats_put(time, IRQ_ITEM_END, irq_layout);
+}
+
+/**
+ * @brief Longest EXTI handler since the last call, in cycles; called by
+ *        the health report with IRQs masked
+ */
+uint32_t irq_timing_exti_peak(void)
+{
+    uint32_t cycles = exti_peak;
+
+    exti_peak = 0;
+    return cycles;
+}
+#endif
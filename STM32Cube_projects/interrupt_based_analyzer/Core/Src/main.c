@@ -23,6 +23,29 @@
 /* Private includes ----------------------------------------------------------*/
 /* USER CODE BEGIN Includes */
 #include "usbd_cdc_if.h"
+#include "analog_capture.h"
+#include "board_sync.h"
+#include "boot_capture.h"
+#include "boot_slot.h"
+#include "capture_ic.h"
+#include "clock_trim.h"
+#include "event_format.h"
+#include "event_ring.h"
+#include "flash_log.h"
+#include "glitch_filter.h"
+#include "host_cmd.h"
+#include "i2c_sniff.h"
+#include "irq_timing.h"
+#include "measure.h"
+#include "oled_status.h"
+#include "pin_map.h"
+#include "poll_capture.h"
+#include "pulse_record.h"
+#include "spi_sniff.h"
+#include "storm_limit.h"
+#include "trigger.h"
+#include "uart_decode.h"
+#include <string.h>
 /* USER CODE END Includes */
 
 /* Private typedef -----------------------------------------------------------*/
@@ -32,7 +55,167 @@
 
 /* Private define ------------------------------------------------------------*/
 /* USER CODE BEGIN PD */
-
+#if CAPTURE_PIN_CH0 < 4 || CAPTURE_PIN_CH0 > 15 || CAPTURE_PIN_CH1 < 4 || CAPTURE_PIN_CH1 > 15 || \
+    CAPTURE_PIN_CH2 < 4 || CAPTURE_PIN_CH2 > 15 || CAPTURE_PIN_CH3 < 4 || CAPTURE_PIN_CH3 > 15
+#error "CAPTURE_PIN_CH0..3 must be PB4-PB15: the edges are taken on the EXTI4, EXTI9_5 and EXTI15_10 vectors"
+#endif
+#if CAPTURE_EXTI_LINES != (1UL << CAPTURE_PIN_CH0) + (1UL << CAPTURE_PIN_CH1) + (1UL << CAPTURE_PIN_CH2) + (1UL << CAPTURE_PIN_CH3)
+#error "CAPTURE_PIN_CH0..3 must be four different pins"
+#endif
+#if !CAPTURE_PINS_DEFAULT && (!CAPTURE_FAST_EXTI || CAPTURE_IC_DMA || CAPTURE_SPI_DMA)
+#error "A remapped pinout needs the CAPTURE_FAST_EXTI handler; CAPTURE_IC_DMA and CAPTURE_SPI_DMA are wired to the V1 pins"
+#endif
+#if HSE_VALUE / 2 * 9 != 72000000
+#error "SystemClock_Config takes HSE / 2 x 9 (the .ioc's 16 MHz crystal) to the 72 MHz the clock presets and USB need"
+#endif
+#if EVENT_FORMAT_SNAPSHOT && !CAPTURE_FAST_EXTI
+#error "EVENT_FORMAT_SNAPSHOT needs the CAPTURE_FAST_EXTI handler"
+#endif
+#if USB_TX_MAX_BYTES > 65535 || USB_TX_MAX_BYTES < 64
+#error "USB_TX_MAX_BYTES must fit CDC_Transmit_FS (64..65535)"
+#endif
+#if USB_TX_MAX_BYTES % 64
+#error "USB_TX_MAX_BYTES must be whole 64-byte packets: a short packet ends the host's read"
+#endif
+#if CAPTURE_RING_EVENTS & (CAPTURE_RING_EVENTS - 1)
+#error "CAPTURE_RING_EVENTS must be a power of 2: the ring indices wrap with EVENT_MASK"
+#endif
+#if CAPTURE_RING_EVENTS * 4 > 15 * 1024
+#error "CAPTURE_RING_EVENTS does not fit the SRAM left beside the USB stack and other state (README, Memory Budget)"
+#endif
+#if EVENT_CHUNK_SIZE < 1 || EVENT_CHUNK_SIZE * 4 > USB_TX_MAX_BYTES
+#error "EVENT_CHUNK_SIZE must be 1 to one USB_TX_MAX_BYTES transfer of events"
+#endif
+#if CAPTURE_CLOCK_PRESET > 6 || (CAPTURE_CLOCK_DWT && CAPTURE_CLOCK_PRESET != 4)
+#error "CAPTURE_CLOCK_PRESET is an 'H' preset, 0-6; CAPTURE_CLOCK_DWT builds keep 4"
+#endif
+#if STREAM_COMPACT && EVENT_FORMAT_SNAPSHOT
+#error "STREAM_COMPACT encodes the edge format only"
+#endif
+#if STREAM_PREDICT && !STREAM_COMPACT
+#error "STREAM_PREDICT codes compact records: build it with STREAM_COMPACT 1"
+#endif
+#if STREAM_FRAMED && USB_TX_MAX_BYTES > 65535 - 12
+#error "USB_TX_MAX_BYTES plus the frame header must fit CDC_Transmit_FS"
+#endif
+#if USB_ISO_STREAM && !(USB_VENDOR_CLASS && STREAM_FRAMED && !STREAM_COMPACT)
+#error "USB_ISO_STREAM needs USB_VENDOR_CLASS and STREAM_FRAMED without STREAM_COMPACT: frame offsets flag lost packets"
+#endif
+#if USB_ISO_STREAM && USB_IN_DOUBLE_BUFFER
+#error "USB_ISO_STREAM double-buffers EP1 itself: build it with USB_IN_DOUBLE_BUFFER 0"
+#endif
+#if USB_STRIPE_EPS > 1 && !(USB_VENDOR_CLASS && !USB_ISO_STREAM && !USB_IN_DOUBLE_BUFFER)
+#error "USB_STRIPE_EPS needs the bulk vendor class with single-buffered endpoints: USB_VENDOR_CLASS 1, USB_ISO_STREAM 0, USB_IN_DOUBLE_BUFFER 0"
+#endif
+#if USB_STRIPE_EPS < 1 || USB_STRIPE_EPS > 3
+#error "USB_STRIPE_EPS: 1 to 3 bulk IN endpoints fit the PMA"
+#endif
+#if USB_CONTROL_EP && !USB_VENDOR_CLASS
+#error "USB_CONTROL_EP adds an interface to the vendor class: build it with USB_VENDOR_CLASS 1"
+#endif
+#if USB_BENCHMARK && (STREAM_COMPACT || CAPTURE_IC_DMA)
+#error "USB_BENCHMARK streams raw ring words: build it without STREAM_COMPACT and CAPTURE_IC_DMA"
+#endif
+#if UART_DECODE && USB_BENCHMARK
+#error "UART_DECODE needs the capture engine: build USB_BENCHMARK with UART_DECODE 0"
+#endif
+#if I2C_SNIFF && USB_BENCHMARK
+#error "I2C_SNIFF needs the capture engine: build USB_BENCHMARK with I2C_SNIFF 0"
+#endif
+#if GLITCH_FILTER && USB_BENCHMARK
+#error "GLITCH_FILTER needs the capture engine: build USB_BENCHMARK with GLITCH_FILTER 0"
+#endif
+#if STORM_LIMIT && USB_BENCHMARK
+#error "STORM_LIMIT needs the capture engine: build USB_BENCHMARK with STORM_LIMIT 0"
+#endif
+#if CHANNEL_MEASURE && USB_BENCHMARK
+#error "CHANNEL_MEASURE needs the capture engine: build USB_BENCHMARK with CHANNEL_MEASURE 0"
+#endif
+#if HEALTH_REPORT_MS > 500
+#error "HEALTH_REPORT_MS above 500 overflows the 20-bit health byte count"
+#endif
+#if IRQ_TIMING && USB_BENCHMARK
+#error "IRQ_TIMING reports in the capture stream: build USB_BENCHMARK with IRQ_TIMING 0"
+#endif
+#if CAPTURE_SPI_DMA && (CAPTURE_IC_DMA || USB_BENCHMARK)
+#error "CAPTURE_SPI_DMA shares DMA1 channel 4 with CAPTURE_IC_DMA and needs the capture engine"
+#endif
+#if OLED_STATUS && (CAPTURE_IC_DMA || CAPTURE_SPI_DMA)
+#error "OLED_STATUS sends over DMA1 channel 4 (I2C2_TX): build it with CAPTURE_IC_DMA and CAPTURE_SPI_DMA 0"
+#endif
+#if CAPTURE_CLOCK_DWT && (CAPTURE_IC_DMA || CAPTURE_SPI_DMA)
+#error "CAPTURE_IC_DMA and CAPTURE_SPI_DMA latch TIM2 times: build CAPTURE_CLOCK_DWT with both 0"
+#endif
+#if BOARD_SYNC && (CAPTURE_CLOCK_DWT || USB_BENCHMARK)
+#error "BOARD_SYNC latches TIM2 times into the capture stream: build it with CAPTURE_CLOCK_DWT and USB_BENCHMARK 0"
+#endif
+#if MAIN_LOOP_SLEEP && (CAPTURE_IC_DMA || USB_BENCHMARK)
+#error "MAIN_LOOP_SLEEP: the TIM4 DMA drain and the benchmark fill need a spinning main loop"
+#endif
+#if BOOT_CAPTURE && (!CAPTURE_TRIGGER || USB_BENCHMARK)
+#error "BOOT_CAPTURE holds the ring as an armed trigger does: build it with CAPTURE_TRIGGER 1"
+#endif
+#if HOST_DTR_GATE && (!CAPTURE_TRIGGER || USB_BENCHMARK || USB_VENDOR_CLASS || USB_IN_DOUBLE_BUFFER)
+#error "HOST_DTR_GATE follows the CDC DTR line and holds the ring as an armed trigger does: build it with CAPTURE_TRIGGER 1, USB_VENDOR_CLASS and USB_IN_DOUBLE_BUFFER 0"
+#endif
+#if ANALOG_CAPTURE && (BOARD_SYNC || CAPTURE_IC_DMA || CAPTURE_CLOCK_DWT || USB_BENCHMARK)
+#error "ANALOG_CAPTURE paces the ADC with TIM1 on TIM2's ticks into DMA1 channel 1: build it without BOARD_SYNC, CAPTURE_IC_DMA, CAPTURE_CLOCK_DWT and USB_BENCHMARK"
+#endif
+#if MAIN_LOOP_SLEEP && ANALOG_CAPTURE
+#error "MAIN_LOOP_SLEEP: the ADC DMA drain needs a spinning main loop"
+#endif
+#if FLOW_CREDIT && (USB_BENCHMARK || USB_ISO_STREAM)
+#error "FLOW_CREDIT: the host grants back the bytes it read, so neither the benchmark nor a lossy isochronous stream can use it"
+#endif
+#if OVERLOAD_PAIRING && (STREAM_COMPACT || EVENT_FORMAT_SNAPSHOT || USB_BENCHMARK)
+#error "OVERLOAD_PAIRING rewrites edge-format ring words as they are sent raw: build it without STREAM_COMPACT, EVENT_FORMAT_SNAPSHOT and USB_BENCHMARK"
+#endif
+#if OVERLOAD_PAIRING && (!CAPTURE_FAST_EXTI || CAPTURE_IC_DMA)
+#error "OVERLOAD_PAIRING pairs the edges of one capture_exti_fast entry, and every edge word of a region must be paired-format"
+#endif
+#if OVERLOAD_PAIRING && (OVERLOAD_QUANTUM_BITS < 4 || OVERLOAD_QUANTUM_BITS > 16)
+#error "OVERLOAD_QUANTUM_BITS holds the second edge's level, channel and step count: 4-16"
+#endif
+#if PULSE_RECORDS && (STREAM_COMPACT || EVENT_FORMAT_SNAPSHOT || OVERLOAD_PAIRING || USB_BENCHMARK)
+#error "PULSE_RECORDS puts its pulse words in the raw edge-format stream: build it without STREAM_COMPACT, EVENT_FORMAT_SNAPSHOT, OVERLOAD_PAIRING and USB_BENCHMARK"
+#endif
+#if FLASH_LOG && (!STREAM_COMPACT || STREAM_FRAMED || USB_ISO_STREAM || USB_BENCHMARK)
+#error "FLASH_LOG logs the unframed compact stream: STREAM_COMPACT 1, STREAM_FRAMED 0"
+#endif
+#if FLASH_LOG && CAPTURE_SPI_DMA
+#error "FLASH_LOG and CAPTURE_SPI_DMA both need SPI1 and DMA1 channel 2"
+#endif
+#if FLASH_LOG && USB_TX_MAX_BYTES < FLASH_PAGE_BYTES + 8
+#error "FLASH_LOG downloads in compact_packet: USB_TX_MAX_BYTES must hold a page and the byte count"
+#endif
+#if TRIGGER_OUT && (!CAPTURE_TRIGGER || USB_BENCHMARK || TRIGGER_OUT > TRIGGER_OUT_COMPARE)
+#error "TRIGGER_OUT follows the edge engine's trigger: 1 or 2, with CAPTURE_TRIGGER 1 and USB_BENCHMARK 0"
+#endif
+#if TRIGGER_OUT == TRIGGER_OUT_COMPARE && (CAPTURE_CLOCK_DWT || CAPTURE_SPI_DMA)
+#error "TRIGGER_OUT 2 compares on TIM2's ticks with CH1 on PA0: build it without CAPTURE_CLOCK_DWT and CAPTURE_SPI_DMA (which remaps TIM2)"
+#endif
+#if TRIGGER_OUT == TRIGGER_OUT_COMPARE && (TRIGGER_OUT_DELAY < 1 || TRIGGER_OUT_DELAY > 0x7FFF)
+#error "TRIGGER_OUT_DELAY is 1 to 32767 ticks"
+#endif
+#if USB_BENCHMARK
+#define TX_MAX_EVENTS bench_tx_events	// host command 'T' sets the transfer size
+#else
+#define TX_MAX_EVENTS (USB_TX_MAX_BYTES / 4)
+#endif
+#define SOF_SYNC (SOF_SYNC_FRAMES && !USB_BENCHMARK)	// the benchmark ring carries only the pattern
+#define RING_TRIGGER (CAPTURE_TRIGGER && !USB_BENCHMARK)
+#define HEALTH_REPORTS (HEALTH_REPORT_MS && !USB_BENCHMARK)	// the benchmark ring carries only the pattern
+#define LEVEL_SNAPSHOTS (LEVEL_SNAPSHOT_MS && !USB_BENCHMARK)
+#define LATENCY_PROBE (LATENCY_PROBE_MS && !USB_BENCHMARK)
+#define LATENCY_PROBE_PIN GPIO_PIN_0	// PA0, the loopback output
+#define RECORDER_INPUT (RECORDER_BUTTON && RING_TRIGGER)
+#define RECORDER_BUTTON_PIN GPIO_PIN_3	// PA3, pulled up: a press reads low
+#define RECORDER_DEBOUNCE_MS 20
+#define DUMP_TRIM_STEP 64	// ring records a dump cuts per IRQ-masked pass
+#define CONFIG_ECHOES (CONFIG_ECHO && !USB_BENCHMARK)
+#define RING_FRAMED (STREAM_FRAMED && !STREAM_COMPACT)	// ring words sent in place behind a header transfer
+#define COMPACT_FRAME_BYTES (STREAM_FRAMED ? sizeof(StreamFrame) : 0)
+#define FILTER_REPORT_MS 100	// 'X' drop counts go out at least this often while dropping
 /* USER CODE END PD */
 
 /* Private macro -------------------------------------------------------------*/
@@ -45,13 +228,160 @@ TIM_HandleTypeDef htim2;
 TIM_HandleTypeDef htim3;
 
 /* USER CODE BEGIN PV */
-#define EVENT_CHUNK_SIZE 16       		// Number of events to send per packet (16 * 4 = 64 bytes)
-#define USB_SEND_INTERVAL_MS 2    		// Send every 2 ms
-#define MAX_EVENTS 1024					// 2^10
-#define EVENT_MASK (MAX_EVENTS - 1) 	// bitmask to avoid wraparounds
-volatile uint32_t write_index = 0;
-volatile uint32_t read_index = 0;
-volatile uint32_t event_buffer[MAX_EVENTS];
+#if !CAPTURE_CLOCK_DWT
+/* Host command 'H': TIM2 prescalers of the timestamp clock presets, from
+ * 72 MHz (13.9 ns, 32-bit time wraps after 59.6 s) to 1 MHz (71.6 min) */
+static const uint16_t clock_presets[] = {
+	0,		// 72 MHz
+	1,		// 36 MHz
+	3,		// 18 MHz
+	7,		// 9 MHz
+	13,		// 5.14 MHz, MX_TIM2_Init's
+	35,		// 2 MHz
+	71		// 1 MHz
+};
+#endif
+volatile uint8_t usb_busy = 0;			// set while CDC transfers are queued or in flight
+static volatile uint32_t tx_events = 0;	// ring events owned by the USB transfer
+static uint32_t last_epoch = 0;			// timer bits above the event time field
+static uint32_t epoch_count = 0;		// total wraps of the event time field
+static uint32_t channel_mask = 0x0F;		// host command 'E': bit n set while channel n is captured
+#if SS_GATE
+static uint32_t gate_ss = 0;			// host command 'g': chip select channel bit, 0 for no gate
+static uint32_t gate_level = 0;			// gate_ss while it is active high, 0 active low
+static uint32_t gate_lines = 0;			// EXTI lines of the channels it gates
+static uint32_t exti_lines = 0;			// lines capture_apply_channels enabled
+#endif
+static uint32_t flush_latency_us = USB_SEND_INTERVAL_US;	// kept for clock changes
+static volatile uint32_t last_flush_time = 0;	// timer ticks at the last transfer start
+#if STREAM_FRAMED
+static uint32_t frame_offset = 0;		// stream bytes framed so far
+#endif
+#if RING_FRAMED
+static StreamFrame ring_frame;			// header of the ring transfer in flight
+static volatile uint32_t frame_parts = 0;	// its header and payload transfers still queued
+#endif
+#if STREAM_COMPACT
+static uint8_t compact_packet[2][COMPACT_FRAME_BYTES + USB_TX_MAX_BYTES + COMPACT_MAX_RECORD] __ALIGNED(4);
+static uint32_t compact_sel = 0;		// buffer being filled; the other may be in flight
+static volatile uint32_t compact_queued = 0;	// bytes of compact_packet[compact_sel] ready to send
+#if STREAM_FRAMED
+static uint32_t compact_framing = 0;	// bytes of compact_packet[compact_sel] waiting for their CRC
+#endif
+static uint8_t compact_carry_buf[COMPACT_MAX_RECORD];
+static uint32_t compact_carry = 0;		// bytes of a split record waiting for the next packet
+#endif
+static volatile uint32_t capture_mode = CAPTURE_MODE_EVENTS;	// engine owning the pins and USB
+static volatile uint32_t requested_mode = CAPTURE_MODE_EVENTS;
+static volatile uint32_t stream_restart = 0;	// 'M' asked for a fresh stream in the same mode
+static StreamHeader stream_header;		// sent in place, so it outlives the transfer
+#if ADAPTIVE_CAPTURE
+static uint32_t adaptive = 0;			// 'M' 2: the engine follows the edge rate
+static uint32_t adapt_start;			// rate window opened at this clock time, CYCCNT while polling
+static uint32_t adapt_words;			// write_index + dropped_total then
+static uint32_t adapt_changes = 0;		// sample changes polled since then
+#endif
+static uint32_t capture_running = !USB_BENCHMARK;	// 0 while the host has stopped capturing
+#if ANALOG_CAPTURE
+static uint32_t analog_rate = 0;		// 'a' samples per second, 0: off
+#endif
+#if FLOW_CREDIT
+static volatile uint32_t credit_on = 0;	// 'c' limits the stream to the host's credit
+static volatile int32_t credit_left;	// stream bytes the host has room for, may go a transfer below 0
+static volatile uint32_t credit_held = 0;	// a transfer waited for credit since the last grant
+static uint32_t credit_reported = 0;	// the main loop sent the CREDIT_HELD record for it
+#endif
+#if USB_CONTROL_EP
+#define CONTROL_QUEUE_WORDS 256				// power of 2; holds an 'S' report with a few bins each
+#define CONTROL_QUEUE_MASK (CONTROL_QUEUE_WORDS - 1)
+static uint32_t control_queue[CONTROL_QUEUE_WORDS];	// reply records for the control endpoint
+static volatile uint32_t control_head = 0;	// next word written
+static volatile uint32_t control_tail = 0;	// first word not sent yet
+static volatile uint32_t control_sending = 0;	// words of the transfer on the bus, 0 if none
+#endif
+#if OVERLOAD_PAIRING
+#define OVERLOAD_HIGH (MAX_EVENTS - MAX_EVENTS / 4)	// ring words queued that open a dense region
+#define OVERLOAD_LOW (MAX_EVENTS / 4)				// and that close it
+#define OVERLOAD_QUANTUM ((1UL << OVERLOAD_QUANTUM_BITS) - 1)
+#define OVERLOAD_PAIRED (1UL << (OVERLOAD_QUANTUM_BITS - 1))	// dense word bit: a second edge follows
+#define OVERLOAD_REACH (1UL << (OVERLOAD_QUANTUM_BITS - 4))	// quantum steps the second edge may trail by
+static uint32_t overload = 0;			// in a dense region: edges go out paired (event_format.h)
+static uint32_t pair_open = 0;			// the dense word at pair_slot holds one edge
+static uint32_t pair_slot;				// its ring index, staged in the EXTI entry
+static uint32_t pair_time;				// clock time of its edge
+#if RING_TRIGGER
+static uint32_t overload_sent;			// region state the host had when the trigger armed
+static uint32_t overload_trimmed[MARKER_BUS_WORDS];	// last BUS_OVERLOAD record trimmed while armed
+#endif
+#endif
+#if USB_BENCHMARK
+static volatile uint32_t bench_tx_events = USB_TX_MAX_BYTES / 4;	// largest transfer
+static uint32_t bench_rate = 0;			// pattern words per second, 0: as fast as USB drains
+static uint32_t bench_word = 0;			// next pattern word
+static uint32_t bench_clock;			// timer ticks per second
+static uint32_t bench_base_time;		// pacing counts from this clock time...
+static uint32_t bench_base_words;		// ...when this many words were due
+#endif
+#if HEALTH_REPORTS
+static uint32_t health_last_time;		// clock time of the last health report
+static uint32_t health_last_write = 0;	// write_index and dropped_total then
+static uint32_t health_last_dropped = 0;
+static uint32_t health_ring_peak = 0;	// most ring words queued since then
+static volatile uint32_t health_tx_bytes = 0;	// bytes CDC_Transmit_FS accepted since then
+static volatile uint32_t health_usb_busy = 0;	// transfer starts that found USB busy
+static uint32_t health_last_overruns = 0;	// host_cmd_overruns at the last report
+#endif
+#if LEVEL_SNAPSHOTS
+static uint32_t levels_last_time;		// clock time of the last level snapshot
+static uint32_t levels_last_dropped = 0;	// dropped_total then
+static uint32_t levels_due = 1;			// the stream (re)started: snapshot at once
+#endif
+#if LATENCY_PROBE
+static uint32_t latency_last_time;		// clock time of the last toggle
+static uint32_t latency_seq = 0;		// toggles so far, the low byte goes with each record
+static uint32_t latency_slot;			// ring slot of the last toggle's edge word
+static uint32_t latency_waiting = 0;	// that word has not been sent yet
+#endif
+#if FLASH_LOG
+static uint32_t log_state_seen = FLASH_LOG_ABSENT;	// flash_log_state at the last loop pass
+#if FLASH_LOG_BATCH
+static uint32_t log_batch_open = 0;	// a batch is going to flash, until the ring is empty
+#endif
+static uint32_t log_report_due = 0;		// an 'O' answer waits for the stream to restart
+#endif
+#if SOF_SYNC
+static volatile uint32_t sof_frames = 0;		// USB frames since enumeration, extended past 11 bits
+static volatile uint32_t sof_sync_frame;	// frame and clock time of the latest latched pair
+static volatile uint32_t sof_sync_clock;
+static volatile uint32_t sof_pending = 0;		// that pair still has to be sent
+#endif
+#if RING_TRIGGER
+/* Trigger states, see trigger.h */
+#define TRIGGER_STREAM 0	// nothing armed: stream everything
+#define TRIGGER_ARMING 1	// stream held until no ring data is in flight
+#define TRIGGER_ARMED  2	// retaining the newest trigger_pre ring words, nothing sent
+#define TRIGGER_POST   3	// fired: streaming until the post-trigger events are queued
+#define TRIGGER_DONE   4	// window queued: edges ignored until the next 'G'
+#define TRIGGER_DUMP   5	// dumped ('d'): streaming until the window is sent
+#define TRIGGER_RESERVE 16	// ring words kept free while armed, for the window head
+static volatile uint32_t trigger_state = TRIGGER_STREAM;
+static uint32_t trigger_rearm = 0;		// arm again after the post-trigger window
+static uint32_t trigger_pre;			// ring words retained while armed
+static uint32_t trigger_post;			// events queued after the trigger, 0: no limit
+static uint32_t post_left;
+static uint32_t head_epoch;				// epoch field in effect at the oldest ring record
+static uint32_t skipped = 0;			// events discarded while armed
+static uint32_t skipped_first;			// clock time of the first and last of them
+static uint32_t skipped_last;
+static uint32_t dump_end;				// ring index past the dumped window
+#if RECORDER_INPUT
+static uint32_t button_level = 1;		// debounced PA3
+static uint32_t button_time;			// clock time it last changed
+#endif
+#if BOOT_CAPTURE || HOST_DTR_GATE
+static uint32_t ring_held = 0;			// armed since power-up or while no reader holds DTR, released by the host's next 'M'
+#endif
+#endif
 
 /* USER CODE END PV */
 
@@ -61,7 +391,9 @@ static void MX_GPIO_Init(void);
 static void MX_TIM2_Init(void);
 static void MX_TIM3_Init(void);
 /* USER CODE BEGIN PFP */
-
+#if RING_TRIGGER
+static uint32_t capture_trigger_edges(uint32_t levels, uint32_t changed, uint32_t time);
+#endif
 /* USER CODE END PFP */
 
 /* Private user code ---------------------------------------------------------*/
@@ -69,10 +401,15 @@ static void MX_TIM3_Init(void);
 
 /**
  * @brief uses TIM2 and TIM3 master/slave chain to get a 32-bit running
- * timer value; needed to elongate life of logic analzyer
+ * timer value; needed to elongate life of logic analzyer. With
+ * CAPTURE_CLOCK_DWT the cycle counter is that value: one core-local
+ * read instead of three or four peripheral bus reads
  * @retval 32-bit clock time
  */
-uint32_t get_32bit_timer(void) {
+HOT_PATH uint32_t get_32bit_timer(void) {
+#if CAPTURE_CLOCK_DWT
+    return DWT->CYCCNT;
+#else
     uint16_t high1 = TIM3->CNT;
     uint16_t low  = TIM2->CNT;
     uint16_t high2 = TIM3->CNT;
@@ -84,7 +421,78 @@ uint32_t get_32bit_timer(void) {
     }
 
     return ((uint32_t)high1 << 16) | low;
+#endif
+}
+
+/**
+ * @brief Rate of the TIM3:TIM2 clock, set by the TIM2 prescaler, or of
+ *		  the core clock with CAPTURE_CLOCK_DWT
+ * @retval clock ticks per second
+ */
+uint32_t capture_clock_hz(void)
+{
+#if CAPTURE_CLOCK_DWT
+    return SystemCoreClock;
+#else
+    return SystemCoreClock / (htim2.Init.Prescaler + 1);
+#endif
+}
+
+/**
+ * @brief Rebuilds the 32-bit TIM3:TIM2 time of a 16-bit capture; only valid
+ *		  while the capture is less than one TIM2 period (65536 ticks) old
+ * @param captured - capture register value of a timer in step with TIM2
+ * @param now - get_32bit_timer() value read after the capture
+ * @retval 32-bit clock time of the capture
+ */
+uint32_t extend_16bit_timer(uint16_t captured, uint32_t now)
+{
+    uint32_t high = now >> 16;
+    if (captured > (uint16_t)now) high--;   // TIM2 wrapped since the capture
+    return (high << 16) | captured;
+}
+
+#if SS_GATE
+/**
+ * @brief Opens or closes the chip select gate on an edge of its channel:
+ *		  asserted unmasks the gated lines, after clearing the edges
+ *		  they latched while masked, deasserted masks them again. Runs
+ *		  in the EXTI ISR, so it needs no IRQ masking
+ * @param levels - channel levels after the edge, bit n = channel n
+ * @retval none
+ */
+HOT_PATH static inline void capture_gate_edge(uint32_t levels)
+{
+    uint32_t lines = gate_lines & exti_lines;
+
+    if ((levels & gate_ss) == gate_level)
+    {
+    	EXTI->PR = lines;  // other devices' traffic, not timestamped
+    	EXTI->IMR |= lines;
+    }
+    else
+    {
+    	EXTI->IMR &= ~lines;
+    }
+}
+#endif
+
+#if PULSE_RECORDS
+/**
+ * @brief Whether a pulse may go as a word, which needs the channel's
+ *		  previous record on the host: not while a trigger is armed or
+ *		  arming, when the ring may trim that record
+ * @retval 1 if it may
+ */
+HOT_PATH static inline uint32_t capture_pulse_words(void)
+{
+#if RING_TRIGGER
+    return trigger_state == TRIGGER_STREAM;
+#else
+    return 1;
+#endif
 }
+#endif
 
 /**
  * @brief Handles interrupts from the serial channel pins and
@@ -94,118 +502,2704 @@ uint32_t get_32bit_timer(void) {
  * @param GPIO_Pin - Channel pin that caused the interrupt
  * @retval none
  */
-void HAL_GPIO_EXTI_Callback(uint16_t GPIO_Pin)
+HOT_PATH void HAL_GPIO_EXTI_Callback(uint16_t GPIO_Pin)
 {
 
-    uint32_t channel;
-    if      (GPIO_Pin == GPIO_PIN_4) channel = 0;
-    else if (GPIO_Pin == GPIO_PIN_5) channel = 1;
-    else if (GPIO_Pin == GPIO_PIN_6) channel = 2;
-    else if (GPIO_Pin == GPIO_PIN_7) channel = 3;
-    else return;
+    uint32_t bit = pin_map_channels(GPIO_Pin);
+    if (!(channel_mask & bit)) return;  // not a probe pin, or disabled by 'E'
+#if SS_GATE
+    // HAL dispatches on EXTI->PR alone: a gated line latches edges masked
+    if (!(EXTI->IMR & GPIO_Pin)) return;
+#endif
+    uint32_t channel = __CLZ(__RBIT(bit));
 
     uint32_t time = get_32bit_timer();
+#if IRQ_TIMING
+    irq_timing_stamp();
+#endif
     uint8_t pin_state = HAL_GPIO_ReadPin(GPIOB, GPIO_Pin);
     uint32_t edge = (pin_state == GPIO_PIN_SET) ? 1 : 0; // 1 if rising edge, 0 if falling
-    uint32_t data = (edge << 31) | (channel << 29) | (time & 0x1FFFFFFF); // 29-bit mask
 
-    uint32_t next_write = write_index + 1;
-    if (next_write - read_index <= MAX_EVENTS)
+#if CAPTURE_SPI_DMA
+    if ((spi_sniff_cs_mask & (1UL << channel)) && !edge) spi_sniff_select();
+#endif
+#if SS_GATE
+    if (bit & gate_ss) capture_gate_edge(edge ? bit : 0);
+#endif
+#if UART_DECODE
+    if (uart_decode_mask & (1UL << channel))
+    {
+    	uart_decode_edge(edge, time);
+    	return;
+    }
+#endif
+#if I2C_SNIFF
+    if (i2c_sniff_mask & (1UL << channel))
+    {
+    	i2c_sniff_edges(pin_map_channels(GPIOB->IDR), bit, time);
+    	return;
+    }
+#endif
+#if CHANNEL_MEASURE
+    if (measure_mask & (1UL << channel))
     {
-    	event_buffer[write_index & EVENT_MASK] = data;
-    	write_index = next_write;
+    	measure_edges(pin_map_channels(GPIOB->IDR), bit, time);
+    	return;
     }
+#endif
+#if GLITCH_FILTER
+    if (!glitch_filter(pin_map_channels(GPIOB->IDR), bit, time)) return;  // held
+#endif
+#if STORM_LIMIT
+    if (!storm_limit(pin_map_channels(GPIOB->IDR), bit, time)) return;  // counted
+#endif
+#if RING_TRIGGER
+    if (trigger_state != TRIGGER_STREAM &&
+    	!capture_trigger_edges(pin_map_channels(GPIOB->IDR), bit, time)) return;
+#endif
+    capture_check_epoch(time);
+#if PULSE_RECORDS
+    if (!pulse_edges(pin_map_channels(GPIOB->IDR), bit, time, capture_pulse_words())) return;  // a pulse record
+#endif
+    capture_push_event(event_pack_edge(edge, channel, time));
 }
 
-/* USER CODE END 0 */
+/**
+ * @brief One pass of capture_exti_fast over the lines it cleared
+ * @param pending - EXTI lines with an edge
+ * @retval none
+ */
+HOT_PATH static void capture_exti_pass(uint32_t pending)
+{
+    uint32_t time = get_32bit_timer();
+    uint32_t levels = pin_map_channels(GPIOB->IDR);
+    uint32_t changed = pin_map_channels(pending);  // bit n = channel n
+#if IRQ_TIMING
+    irq_timing_stamp();
+#endif
+
+#if CAPTURE_SPI_DMA
+    // chip select asserted: realign the sniffer's byte framing
+    if (changed & spi_sniff_cs_mask & ~levels) spi_sniff_select();
+#endif
+#if SS_GATE
+    // chip select moved: gate its SPI lines, from the next pass on
+    if (changed & gate_ss) capture_gate_edge(levels);
+#endif
+#if UART_DECODE
+    if (changed & uart_decode_mask)
+    {
+    	// the decoded channel's edges become bytes instead of events
+    	uart_decode_edge((levels & uart_decode_mask) != 0, time);
+    	changed &= ~uart_decode_mask;
+    }
+#endif
+#if I2C_SNIFF
+    if (changed & i2c_sniff_mask)
+    {
+    	// SCL and SDA edges become START/STOP and byte records
+    	i2c_sniff_edges(levels, changed & i2c_sniff_mask, time);
+    	changed &= ~i2c_sniff_mask;
+    }
+#endif
+#if CHANNEL_MEASURE
+    if (changed & measure_mask)
+    {
+    	// measured channels' edges become per-window summaries
+    	measure_edges(levels, changed & measure_mask, time);
+    	changed &= ~measure_mask;
+    }
+#endif
+#if GLITCH_FILTER
+    changed = glitch_filter(levels, changed, time);  // filtered channels' edges are held
+#endif
+    capture_store_edges(levels, changed, time);
+}
 
 /**
-  * @brief  The application entry point.
-  * @retval int
-  */
-int main(void)
+ * @brief Register-level EXTI handler for the probe pins' lines, any of
+ *		  their vectors. Each
+ *		  pass reads EXTI->PR and GPIOB->IDR once and takes a single
+ *		  timestamp for every line pending; edges that arrive meanwhile
+ *		  are taken by another pass instead of a tail-chained entry, up
+ *		  to CAPTURE_EXTI_PASSES. With EVENT_FORMAT_SNAPSHOT a pass's
+ *		  edges are written as one event: 4-bit level snapshot, 4-bit
+ *		  changed mask, 24-bit timer; otherwise one legacy event per
+ *		  line. The ring sees the entry's events under one publish
+ * @retval none
+ */
+HOT_PATH void capture_exti_fast(void)
 {
+    uint32_t pending = EXTI->PR & EXTI->IMR & CAPTURE_EXTI_LINES;
+    uint32_t passes = CAPTURE_EXTI_PASSES;
 
-  /* USER CODE BEGIN 1 */
+    ring_batch_begin();
+    while (pending)
+    {
+    	EXTI->PR = pending;  // write 1 to clear
+    	// the lines span up to three vectors: the others have nothing
+    	// left. A line still set pends its vector again, so none is lost
+    	NVIC->ICPR[0] = (1UL << EXTI4_IRQn) | (1UL << EXTI9_5_IRQn);
+#if CAPTURE_EXTI_LINES & 0xFC00
+    	NVIC->ICPR[1] = 1UL << (EXTI15_10_IRQn - 32);
+#endif
+    	capture_exti_pass(pending);
+    	if (--passes == 0) break;
+    	pending = EXTI->PR & EXTI->IMR & CAPTURE_EXTI_LINES;
+    }
+    ring_batch_end();
+}
 
-  /* USER CODE END 1 */
+#if OVERLOAD_PAIRING
+/**
+ * @brief Pushes the BUS_OVERLOAD record that opens or closes a dense
+ *		  region. Callers outside the EXTI ISR must mask IRQs
+ * @param time - 32-bit clock time of the change
+ * @param enter - 1 opens a region, 0 closes it
+ * @retval none
+ */
+static void capture_overload_mark(uint32_t time, uint32_t enter)
+{
+    uint32_t fill = MIN(((ring_head - read_index) << 8) / MAX_EVENTS, 0xFF);
+    uint32_t words[MARKER_BUS_WORDS] = {
+    	time, OVERLOAD_QUANTUM_BITS | (fill << 8) | (enter << 16) | (BUS_OVERLOAD << 24)
+    };
+    uint32_t head = ring_head;
+
+    capture_push_record(event_pack_marker(MARKER_BUS, 0), words, MARKER_BUS_WORDS);
+    if (ring_head == head) return;  // no room: the next edges try again
+    overload = enter;
+    pair_open = 0;
+}
 
-  /* MCU Configuration--------------------------------------------------------*/
+/**
+ * @brief Opens a dense region once the ring holds more than
+ *		  OVERLOAD_HIGH words and closes it below OVERLOAD_LOW, so a
+ *		  consumer that falls behind costs time resolution before it
+ *		  costs edges; called ahead of an EXTI entry's edges
+ * @param time - 32-bit clock time of the edges
+ * @retval none
+ */
+HOT_PATH static void capture_overload_check(uint32_t time)
+{
+    uint32_t queued = ring_head - read_index;
+#if FLOW_CREDIT
+    uint32_t high = credit_held ? OVERLOAD_LOW : OVERLOAD_HIGH;  // a host without credit will not drain it soon
+#else
+    uint32_t high = OVERLOAD_HIGH;
+#endif
+
+    if (overload ? queued >= OVERLOAD_LOW : queued <= high) return;
+#if RING_TRIGGER
+    if (trigger_state == TRIGGER_ARMED) return;  // the held window stays exact
+#endif
+    capture_overload_mark(time, !overload);
+}
 
-  /* Reset of all peripherals, Initializes the Flash interface and the Systick. */
-  HAL_Init();
+/**
+ * @brief Stores one edge of a dense region: into the free half of the
+ *		  previous dense word when that one is still staged in this
+ *		  EXTI entry and the edge is close enough behind it, otherwise
+ *		  as a new word of its own
+ * @param edge - 1 rising, 0 falling
+ * @param channel - 0-3
+ * @param time - 32-bit clock time of the edge
+ * @retval none
+ */
+HOT_PATH static void capture_push_dense(uint32_t edge, uint32_t channel, uint32_t time)
+{
+    uint32_t steps = (time >> OVERLOAD_QUANTUM_BITS) - (pair_time >> OVERLOAD_QUANTUM_BITS);
+    uint32_t head = ring_head;
 
-  /* USER CODE BEGIN Init */
+    // staged words sit between write_index and ring_head; an epoch or
+    // any other record since the first edge ends the pairing
+    if (pair_open && pair_slot == head - 1 && head != write_index && steps < OVERLOAD_REACH)
+    {
+    	uint32_t word = event_buffer[pair_slot & EVENT_MASK] | OVERLOAD_PAIRED |
+    	                (edge << (OVERLOAD_QUANTUM_BITS - 2)) | (channel << (OVERLOAD_QUANTUM_BITS - 4)) | steps;
+    	pair_open = 0;
+    	if ((word & EVENT_TIME_MASK) != EVENT_TIME_MASK)
+    	{
+    		event_buffer[pair_slot & EVENT_MASK] = word;
+    		return;
+    	}
+    }
+    capture_push_event(event_pack_edge(edge, channel, time & ~OVERLOAD_QUANTUM));
+    pair_open = ring_head != head;  // not when the ring dropped it
+    pair_slot = ring_head - 1;
+    pair_time = time;
+}
+#endif
 
-  /* USER CODE END Init */
+/**
+ * @brief Stores one EXTI interrupt's edges in event_buffer, past the
+ *		  rate limit and the trigger while one is armed. The tail of
+ *		  capture_exti_fast, also used for edges the glitch filter
+ *		  held; callers outside the EXTI ISR must mask IRQs
+ * @param levels - CH1-CH4 levels after the edges, bit n = channel n
+ * @param changed - channels with an edge, bit n = channel n
+ * @param time - 32-bit clock time of the edges
+ * @retval none
+ */
+HOT_PATH void capture_store_edges(uint32_t levels, uint32_t changed, uint32_t time)
+{
+#if STORM_LIMIT
+    changed = storm_limit(levels, changed, time);  // a storming channel's edges are counted
+#endif
+#if RING_TRIGGER
+    if (trigger_state != TRIGGER_STREAM && !capture_trigger_edges(levels, changed, time)) return;
+#endif
+    capture_check_epoch(time);
+#if PULSE_RECORDS
+    // a pulse channel's edges become one record per pulse
+    if (changed & pulse_mask) changed = pulse_edges(levels, changed, time, capture_pulse_words());
+#endif
+#if EVENT_FORMAT_SNAPSHOT
+    if (changed)
+    {
+    	capture_push_event(event_pack_snapshot(levels, changed, time));
+    }
+#else
+#if OVERLOAD_PAIRING
+    if (changed) capture_overload_check(time);
+#endif
+    while (changed)
+    {
+    	uint32_t channel = __CLZ(__RBIT(changed));  // lowest pending line
+    	uint32_t edge = (levels >> channel) & 1;
+#if OVERLOAD_PAIRING
+    	if (overload) capture_push_dense(edge, channel, time);
+    	else
+#endif
+    	capture_push_event(event_pack_edge(edge, channel, time));
+    	changed &= changed - 1;
+    }
+#endif
+}
 
-  /* Configure the system clock */
-  SystemClock_Config();
+/**
+ * @brief Emits an epoch marker ahead of the first event whose time field
+ *		  has wrapped, so the host can rebuild a 64-bit timeline. Every
+ *		  producer calls this before pushing; the main loop also calls it
+ *		  so wraps during idle periods are not missed. Callers outside
+ *		  the EXTI ISR must mask IRQs
+ * @param time - 32-bit clock time about to be pushed
+ * @retval none
+ */
+HOT_PATH void capture_check_epoch(uint32_t time)
+{
+    const uint32_t epoch_mask = 0xFFFFFFFFUL >> EVENT_TIME_BITS;
+    uint32_t ahead = ((time >> EVENT_TIME_BITS) - last_epoch) & epoch_mask;
 
-  /* USER CODE BEGIN SysInit */
+    // only move forward; a late (older) timestamp must not re-mark
+    if (ahead == 0 || ahead > (epoch_mask >> 1)) return;
+    while (ahead--)
+    {
+    	last_epoch = (last_epoch + 1) & epoch_mask;
+    	epoch_count++;
+    	capture_push_event(event_pack_marker(MARKER_EPOCH, epoch_count));
+    }
+}
 
-  /* USER CODE END SysInit */
+#if RING_TRIGGER
+/**
+ * @brief Discards the oldest ring record while armed: an event is counted
+ *		  for the window marker, a marker goes with its payload words.
+ *		  Nothing is sent while armed, so the producer side may move
+ *		  read_index here, the one exception to the ring's SPSC rule
+ * @retval none
+ */
+static void capture_trigger_trim(void)
+{
+    const uint32_t epoch_mask = 0xFFFFFFFFUL >> EVENT_TIME_BITS;
+    uint32_t word = event_buffer[read_index & EVENT_MASK];
+    uint32_t type = event_marker_type(word);
 
-  /* Initialize all configured peripherals */
-  MX_GPIO_Init();
-  MX_TIM2_Init();
-  MX_USB_DEVICE_Init();
-  MX_TIM3_Init();
-  /* USER CODE BEGIN 2 */
+    if (type == EVENT_NOT_MARKER)
+    {
+    	uint32_t time = (head_epoch << EVENT_TIME_BITS) | (word & EVENT_TIME_MASK);
+    	if (skipped == 0) skipped_first = time;
+    	skipped_last = time;
+    	skipped++;
+#if OVERLOAD_PAIRING
+    	if (((overload_trimmed[1] >> 16) & OVERLOAD_ENTER) && (word & OVERLOAD_PAIRED)) skipped++;
+#endif
+    	read_index++;
+    	return;
+    }
+    if (type == MARKER_EPOCH) head_epoch = (head_epoch + 1) & epoch_mask;
+#if OVERLOAD_PAIRING
+    if (type == MARKER_BUS && event_buffer[(read_index + 2) & EVENT_MASK] >> 24 == BUS_OVERLOAD)
+    {
+    	overload_trimmed[0] = event_buffer[(read_index + 1) & EVENT_MASK];
+    	overload_trimmed[1] = event_buffer[(read_index + 2) & EVENT_MASK];
+    }
+#endif
+    read_index += 1 + event_marker_words(type);
+}
 
-  HAL_TIM_Base_Start(&htim2);
-  HAL_TIM_Base_Start(&htim3);
-  uint32_t last_usb_send_time = 0;
+/**
+ * @brief Makes room for a record while armed by trimming the oldest ones,
+ *		  so the ring holds at most trigger_pre words
+ * @param needed - ring words about to be pushed
+ * @retval none
+ */
+static void capture_trigger_room(uint32_t needed)
+{
+    if (trigger_state != TRIGGER_ARMED) return;
+    while (ring_head - read_index + needed > trigger_pre) capture_trigger_trim();
+}
 
-  /* USER CODE END 2 */
+/**
+ * @brief Ends the armed state: a window marker for the trimmed events
+ *		  goes in front of the retained ones, which nothing has sent yet.
+ *		  Called from the EXTI ISR or with IRQs masked
+ * @retval none
+ */
+static void capture_trigger_release(void)
+{
+#if OVERLOAD_PAIRING
+    if (((overload_trimmed[1] >> 16) & OVERLOAD_ENTER) != overload_sent)
+    {
+    	// the trimmed words opened or closed a dense region the retained
+    	// ones are in, or out of: its last record goes in front of them
+    	read_index -= 1 + MARKER_BUS_WORDS;  // TRIGGER_RESERVE keeps these free too
+    	event_buffer[read_index & EVENT_MASK] = event_pack_marker(MARKER_BUS, 0);
+    	event_buffer[(read_index + 1) & EVENT_MASK] = overload_trimmed[0];
+    	event_buffer[(read_index + 2) & EVENT_MASK] = overload_trimmed[1];
+    }
+#endif
+    if (skipped)
+    {
+    	read_index -= 1 + MARKER_WINDOW_WORDS;  // TRIGGER_RESERVE keeps these free
+    	event_buffer[read_index & EVENT_MASK] = event_pack_marker(MARKER_WINDOW, 0);
+    	event_buffer[(read_index + 1) & EVENT_MASK] = skipped;
+    	event_buffer[(read_index + 2) & EVENT_MASK] = skipped_first;
+    	event_buffer[(read_index + 3) & EVENT_MASK] = skipped_last;
+    	skipped = 0;
+    }
+    trigger_state = TRIGGER_STREAM;
+#if PULSE_RECORDS
+    pulse_resync();  // the host forgets the pulse anchors at the window marker
+#endif
+#if BOOT_CAPTURE || HOST_DTR_GATE
+    ring_held = 0;
+#endif
+}
 
-  /* Infinite loop */
-  /* USER CODE BEGIN WHILE */
-  while (1)
-  {
+/**
+ * @brief Runs the trigger on one EXTI interrupt's edges and counts the
+ *		  post-trigger window; called from the EXTI ISR
+ * @param levels - CH1-CH4 levels, bit n = channel n
+ * @param changed - channels with an edge, bit n = channel n
+ * @param time - 32-bit clock time of the edges
+ * @retval 1 if the edges go into the ring, 0 if they are ignored
+ */
+static uint32_t capture_trigger_edges(uint32_t levels, uint32_t changed, uint32_t time)
+{
+    if (changed == 0) return 1;
 
-	  uint32_t now = HAL_GetTick(); // milliseconds
+    switch (trigger_state)
+    {
+    case TRIGGER_ARMED:
+    {
+    	if (!trigger_check(levels, changed, time)) return 1;
+#if TRIGGER_OUT
+    	uint32_t out[MARKER_BUS_WORDS] = { time, trigger_out_fire(time) | (BUS_TRIGGER_OUT << 24) };
+#endif
+    	capture_trigger_release();
+    	capture_check_epoch(time);
+    	capture_push_record(event_pack_marker(MARKER_TRIGGER, 0), &time, MARKER_TRIGGER_WORDS);
+#if TRIGGER_OUT
+    	capture_push_record(event_pack_marker(MARKER_BUS, 0), out, MARKER_BUS_WORDS);
+#endif
+    	trigger_state = TRIGGER_POST;
+    	post_left = trigger_post;
+    }
+    	/* fall through: the trigger edges open the post-trigger window */
+    case TRIGGER_POST:
+    {
+    	if (trigger_post == 0) return 1;
+    	uint32_t events = EVENT_FORMAT_SNAPSHOT ? 1 : (uint32_t)__builtin_popcount(changed);
+    	if (events < post_left)
+    	{
+    		post_left -= events;
+    		return 1;
+    	}
+    	trigger_state = trigger_rearm ? TRIGGER_ARMING : TRIGGER_DONE;
+    	return 1;
+    }
+    case TRIGGER_DONE:
+    	return 0;
+    default:
+    	return 1;  // arming: queued as usual, they become the pre-trigger window
+    }
+}
 
-	  __disable_irq();
-	  uint32_t diff = write_index - read_index;
-	  __enable_irq();
+/**
+ * @brief Arms a pending trigger once no ring data is on its way to the
+ *		  host, so the oldest queued record is the next one to trim;
+ *		  called from the main loop
+ * @retval none
+ */
+static void capture_trigger_service(void)
+{
+    const uint32_t epoch_mask = 0xFFFFFFFFUL >> EVENT_TIME_BITS;
 
-	  // Check if it's time to send OR buffer is filling
-	  if ((diff >= EVENT_CHUNK_SIZE) || (now - last_usb_send_time >= USB_SEND_INTERVAL_MS))
-	  {
-		  // Check how many events we can send
-		  uint32_t to_send = MIN(EVENT_CHUNK_SIZE, diff);
+    if (trigger_state == TRIGGER_DUMP && (int32_t)(read_index - dump_end) >= 0)
+    {
+    	trigger_state = trigger_rearm ? TRIGGER_ARMING : TRIGGER_DONE;
+    }
+    if (trigger_state != TRIGGER_ARMING) return;
+#if STREAM_COMPACT
+    if (!event_compact_idle()) return;  // the encoder is inside a record
+#else
+    if (tx_events) return;
+#endif
+    __disable_irq();
+#if OVERLOAD_PAIRING
+    if (overload)
+    {
+    	// the armed window is kept exact: close the region first
+    	uint32_t now = get_32bit_timer();
+    	capture_check_epoch(now);
+    	capture_overload_mark(now, 0);
+    }
+    overload_sent = 2;
+#endif
+    // the epoch field at the oldest queued record: the current one less
+    // the wraps queued since
+    head_epoch = last_epoch;
+    for (uint32_t i = read_index; i != write_index; )
+    {
+    	uint32_t type = event_marker_type(event_buffer[i & EVENT_MASK]);
+    	if (type == MARKER_EPOCH) head_epoch = (head_epoch - 1) & epoch_mask;
+#if OVERLOAD_PAIRING
+    	// the host is in a region at the oldest record if the first
+    	// region record queued closes one
+    	if (type == MARKER_BUS && overload_sent == 2 &&
+    	    event_buffer[(i + 2) & EVENT_MASK] >> 24 == BUS_OVERLOAD)
+    	{
+    		overload_sent = !((event_buffer[(i + 2) & EVENT_MASK] >> 16) & OVERLOAD_ENTER);
+    	}
+#endif
+    	i += type == EVENT_NOT_MARKER ? 1 : 1 + event_marker_words(type);
+    }
+#if OVERLOAD_PAIRING
+    if (overload_sent == 2) overload_sent = overload;
+    overload_trimmed[1] = overload_sent << 16;
+#endif
+    skipped = 0;
+    trigger_arm(pin_map_channels(GPIOB->IDR));
+    trigger_state = TRIGGER_ARMED;
+    capture_trigger_room(0);  // what queued up while arming may exceed the window
+    __enable_irq();
+}
 
-		  if (to_send > 0)
-		  {
-			  uint8_t usb_packet[to_send * 4];
+/**
+ * @brief Arms a trigger (host command 'G'); the stream is held from here
+ *		  until it fires. A trigger still armed is released with what it
+ *		  retained. Called from the host command parser (main loop)
+ * @param type - TRIG_* from trigger.h, optionally with TRIG_REARM
+ * @param channel - probe channel of the edge, pulse and count types
+ * @param value - edge polarity, pulse level or pattern levels
+ * @param mask - channels of the pattern type
+ * @param param - pulse width in ticks, or edge count
+ * @param pre - ring words to retain while armed, 0 for as many as fit
+ * @param post - events to send after the trigger, 0 for no limit
+ * @retval none
+ */
+void capture_set_trigger(uint32_t type, uint32_t channel, uint32_t value, uint32_t mask,
+                         uint32_t param, uint32_t pre, uint32_t post)
+{
+    uint32_t kind = type & ~TRIG_REARM;
+
+    __disable_irq();
+    if (trigger_state == TRIGGER_ARMED) capture_trigger_release();
+    trigger_configure(kind, channel, value, mask, param);
+    trigger_rearm = (type & TRIG_REARM) != 0 || kind == TRIG_RECORD;
+    trigger_pre = pre ? MAX(pre, TRIGGER_RESERVE) : MAX_EVENTS;
+    trigger_pre = MIN(trigger_pre, MAX_EVENTS - TRIGGER_RESERVE);
+    trigger_post = post;
+    trigger_state = kind == TRIG_OFF || kind > TRIG_RECORD ? TRIGGER_STREAM : TRIGGER_ARMING;
+    __enable_irq();
+}
 
-			  for (uint32_t i = 0; i < to_send; ++i)
-			  {
-				  uint32_t event = event_buffer[read_index & EVENT_MASK];
-				  read_index++;
-				  usb_packet[i*4 + 0] = event & 0xFF;
-				  usb_packet[i*4 + 1] = (event >> 8) & 0xFF;
-				  usb_packet[i*4 + 2] = (event >> 16) & 0xFF;
-				  usb_packet[i*4 + 3] = (event >> 24) & 0xFF;
-			  }
+/**
+ * @brief Whether a dump keeps the oldest ring record and so all newer
+ *		  ones: the ring holds no more than words, and the record is an
+ *		  event since cutoff. Markers before the first kept event go
+ * @param words - ring words to keep at most
+ * @param ticks - age limit in ticks, 0 for none
+ * @param cutoff - clock time ticks before the dump
+ * @retval 1 if the cut is done
+ */
+static uint32_t capture_dump_keeps(uint32_t words, uint32_t ticks, uint32_t cutoff)
+{
+    uint32_t word = event_buffer[read_index & EVENT_MASK];
+
+    if (read_index == ring_head) return 1;
+    if (ring_head - read_index > words) return 0;
+    if (ticks == 0) return 1;
+    if (event_marker_type(word) != EVENT_NOT_MARKER) return 0;
+    uint32_t time = (head_epoch << EVENT_TIME_BITS) | (word & EVENT_TIME_MASK);
+    return (int32_t)(time - cutoff) >= 0;
+}
 
-			  // Retry if USB busy
-			  while (CDC_Transmit_FS(usb_packet, to_send * 4) == USBD_BUSY);
-			  last_usb_send_time = now;
-		  }
-	  }
+/**
+ * @brief Dumps what an armed trigger holds, the flight recorder's history
+ *		  (host command 'd' or RECORDER_BUTTON): the oldest records are
+ *		  cut, a few per IRQ-masked pass so the EXTI ISR keeps its
+ *		  latency, and the rest go out as the trigger's window, with a
+ *		  MARKER_TRIGGER at the dump's time. Once they are sent the
+ *		  recorder arms again. Called from the main loop
+ * @param words - newest ring words to send, 0 for all
+ * @param ms - newest milliseconds to send, 0 for all; at most 2^31 ticks
+ * @retval none
+ */
+void capture_dump(uint32_t words, uint32_t ms)
+{
+    uint64_t ticks = (uint64_t)ms * (capture_clock_hz() / 1000);
+    uint32_t cutoff;
+    uint32_t done = 0;
+
+    ticks = MIN(ticks, 0x7FFFFFFFULL);
+    cutoff = get_32bit_timer() - (uint32_t)ticks;
+    if (words == 0) words = MAX_EVENTS;
+    while (!done)
+    {
+    	__disable_irq();
+    	if (trigger_state != TRIGGER_ARMED)
+    	{
+    		__enable_irq();  // nothing armed, or it fired meanwhile
+    		return;
+    	}
+    	for (uint32_t n = 0; n < DUMP_TRIM_STEP && !done; n++)
+    	{
+    		done = capture_dump_keeps(words, (uint32_t)ticks, cutoff);
+    		if (!done) capture_trigger_trim();
+    	}
+    	if (done)
+    	{
+    		uint32_t time = get_32bit_timer();
+    		capture_trigger_release();
+    		capture_check_epoch(time);
+    		capture_push_record(event_pack_marker(MARKER_TRIGGER, 0), &time, MARKER_TRIGGER_WORDS);
+    		dump_end = ring_head;
+    		trigger_state = TRIGGER_DUMP;
+    	}
+    	__enable_irq();
+    }
+}
+#endif
 
-	  // Shut down if timer exceeds 29th bit (~1.74 mins w/ 5.14MHz timer)
-	  if (get_32bit_timer() >= (1UL << 29))
-	  {
-		  HAL_TIM_Base_Stop(&htim2);
-		  HAL_TIM_Base_Stop(&htim3);
-		  HAL_NVIC_DisableIRQ(EXTI4_IRQn);
-		  HAL_NVIC_DisableIRQ(EXTI9_5_IRQn);
-		  write_index = 0;
-		  read_index = 0;
-	  }
+/**
+ * @brief Appends one packed event to event_buffer, dropping it if the
+ *		  ring is full. Once there is room again, a drop marker with the
+ *		  lost count and time span goes in ahead of the event. Callers
+ *		  outside the EXTI ISR must mask IRQs
+ * @param data - packed 32-bit event
+ * @retval none
+ */
+HOT_PATH void capture_push_event(uint32_t data)
+{
+#if RING_TRIGGER
+    capture_trigger_room(ring_needed(1));
+#endif
+    ring_push(data);
+}
+
+/**
+ * @brief Appends a marker and its raw payload words as one unit; the whole
+ *		  record is skipped if the ring cannot take it. Callers outside the
+ *		  EXTI ISR must mask IRQs
+ * @param marker - packed marker word
+ * @param words - payload words
+ * @param count - number of payload words
+ * @retval none
+ */
+HOT_PATH void capture_push_record(uint32_t marker, const uint32_t *words, uint32_t count)
+{
+#if RING_TRIGGER
+    capture_trigger_room(ring_needed(1 + count));
+#endif
+    ring_push_record(marker, words, count);
+}
+
+#if USB_CONTROL_EP
+/**
+ * @brief Puts the queued control records up to the queue's end on the
+ *		  control endpoint, unless a transfer is on it. IRQs masked or
+ *		  from the USB interrupt
+ * @retval none
+ */
+static void capture_control_start(void)
+{
+	uint32_t tail = control_tail & CONTROL_QUEUE_MASK;
+	uint32_t words = MIN(control_head - control_tail, CONTROL_QUEUE_WORDS - tail);
+
+	if (control_sending || !words) return;
+	if (CDC_Transmit_Control((uint8_t *)&control_queue[tail], words * 4) == USBD_OK) control_sending = words;
+}
+
+/**
+ * @brief Releases the control transfer that went out, or that a bus reset
+ *		  aborted, and starts the next; called from the USB interrupt
+ * @retval none
+ */
+void capture_control_complete(void)
+{
+	control_tail += control_sending;
+	control_sending = 0;
+	capture_control_start();
+}
+#endif
+
+/**
+ * @brief Pushes a reply or telemetry record: with USB_CONTROL_EP onto the
+ *		  control endpoint, so it does not queue behind the stream, else
+ *		  into the stream as capture_push_record does. The control
+ *		  endpoint carries edge-format marker words whatever the stream's
+ *		  format, and a record the queue has no room for is skipped.
+ *		  Callers outside the EXTI ISR must mask IRQs
+ * @param type - MARKER_* type
+ * @param words - payload words
+ * @param count - number of payload words
+ * @retval none
+ */
+void capture_push_reply(uint32_t type, const uint32_t *words, uint32_t count)
+{
+#if USB_CONTROL_EP
+	if (CONTROL_QUEUE_WORDS - (control_head - control_tail) < 1 + count) return;
+	control_queue[control_head++ & CONTROL_QUEUE_MASK] = (type << 29) | 0x1FFFFFFF;
+	while (count--) control_queue[control_head++ & CONTROL_QUEUE_MASK] = *words++;
+	capture_control_start();
+#else
+	capture_push_record(event_pack_marker(type, 0), words, count);
+#endif
+}
+
+/**
+ * @brief Selects how the main loop batches events into USB transfers;
+ *		  called from the host command parser (main loop)
+ * @param mode - FLUSH_LATENCY, FLUSH_BATCH or FLUSH_ADAPTIVE
+ * @param batch - event count that triggers a send (adaptive: the minimum)
+ * @param latency_us - longest time queued events wait for a send
+ * @retval none
+ */
+void capture_set_flush_policy(uint32_t mode, uint32_t batch, uint32_t latency_us)
+{
+	if (mode > FLUSH_ADAPTIVE) return;
+
+	flush_latency_us = latency_us;
+	flush_configure(mode, batch, (uint32_t)(((uint64_t)latency_us * capture_clock_hz()) / 1000000));
+}
+
+/**
+ * @brief CDC_Transmit_FS, timed into IRQ_TIMER_TRANSMIT in IRQ_TIMING
+ *		  builds and counted for the health report
+ */
+static inline uint8_t capture_cdc_transmit(uint8_t *buf, uint16_t len)
+{
+#if IRQ_TIMING
+	uint32_t start = DWT->CYCCNT;
+#endif
+	uint8_t status = CDC_Transmit_FS(buf, len);
+
+#if IRQ_TIMING
+	irq_timing_add(IRQ_TIMER_TRANSMIT, start);
+#endif
+#if HEALTH_REPORTS
+	if (status == USBD_OK) health_tx_bytes += len;
+#endif
+#if FLOW_CREDIT
+	if (status == USBD_OK && credit_on) credit_left -= len;
+#endif
+	return status;
+}
+
+#if FLOW_CREDIT
+/**
+ * @brief Holds the stream while the host has granted no credit ('c'),
+ *		  so what it has no room for waits in the ring, where a full
+ *		  ring is counted, instead of in a host buffer that drops it
+ * @retval 1 if no transfer may start
+ */
+static inline uint32_t capture_credit_held(void)
+{
+	if (!credit_on || credit_left > 0) return 0;
+	credit_held = 1;
+	return 1;
+}
+#endif
+
+/**
+ * @brief Starts a USB transfer of queued data unless one is in flight.
+ *		  Runs from the main loop with the USB IRQ masked, and from the
+ *		  transmit-complete callback, which chains back-to-back transfers
+ *		  without waiting for the main loop
+ * @param min_events - ring stream: fewest queued events worth a transfer
+ * @retval none
+ */
+HOT_PATH static void capture_tx_start(uint32_t min_events)
+{
+	if (usb_busy)
+	{
+#if HEALTH_REPORTS
+		health_usb_busy++;
+#endif
+		return;
+	}
+#if RING_TRIGGER
+	// held while armed; ring transfers also wait while arming
+	if (trigger_state == TRIGGER_ARMED || (!STREAM_COMPACT && trigger_state == TRIGGER_ARMING)) return;
+#endif
+
+#if STREAM_COMPACT
+	(void)min_events;
+	if (compact_queued == 0) return;
+#if FLOW_CREDIT
+	if (capture_credit_held()) return;  // a packet may overdraw what is left
+#endif
+	if (capture_cdc_transmit(compact_packet[compact_sel], compact_queued) == USBD_OK)
+	{
+		// the other buffer finished when this transfer was accepted
+		compact_sel ^= 1;
+		compact_queued = 0;
+		last_flush_time = get_32bit_timer();
+	}
+#else
+	// The ring words are already little-endian: send them in place, up
+	// to the wrap point, as one multi-packet transfer. read_index moves
+	// on transmit complete. Producers publish whole events and records
+	// (ring_publish), so pending never counts a half-written one.
+	uint32_t start;
+	uint32_t pending = ring_queued();
+	uint32_t to_send = ring_claim(TX_MAX_EVENTS, &start);
+
+	if (to_send == 0 || pending < min_events) return;
+#if FLOW_CREDIT
+	if (capture_credit_held()) return;
+	if (credit_on) to_send = MIN(to_send, ((uint32_t)credit_left + 3) / 4);
+#endif
+	tx_events = to_send;
+#if RING_FRAMED
+	// The payload stays in the ring, so the header is a transfer of its own,
+	// queued right in front of it. The queue was empty: both fit
+	stream_frame_build(&ring_frame, (const uint8_t *)&event_buffer[start], to_send * 4, frame_offset);
+	if (capture_cdc_transmit((uint8_t *)&ring_frame, sizeof(ring_frame)) == USBD_OK)
+	{
+		frame_parts = 2;
+		capture_cdc_transmit((uint8_t *)&event_buffer[start], to_send * 4);
+		frame_offset += to_send * 4;
+		last_flush_time = get_32bit_timer();
+	}
+#else
+	if (capture_cdc_transmit((uint8_t *)&event_buffer[start], to_send * 4) == USBD_OK)
+	{
+		last_flush_time = get_32bit_timer();
+	}
+#endif
+	else
+	{
+		tx_events = 0;
+	}
+#endif
+}
+
+/**
+ * @brief Releases the ring events of the finished USB transfer and chains
+ *		  the next one if the flush policy already allows it; called from
+ *		  the CDC transmit-complete callback (USB interrupt)
+ * @retval none
+ */
+HOT_PATH void capture_tx_complete(void)
+{
+	if (capture_mode == CAPTURE_MODE_POLL)
+	{
+		poll_capture_tx_complete();
+		return;
+	}
+#if RING_FRAMED
+	if (frame_parts > 1)  // the header went out, the payload is on the bus
+	{
+		frame_parts--;
+		return;
+	}
+	frame_parts = 0;
+#endif
+	ring_release(tx_events);
+	tx_events = 0;
+
+#if RING_FRAMED
+	// No chaining: framing the next transfer is a CRC pass over it, which
+	// the main loop does outside the USB interrupt
+#else
+	capture_tx_start(flush_chain_min());
+#endif
+}
+
+#if MAIN_LOOP_SLEEP
+static volatile uint32_t main_wake = 0;	// an interrupt left work for the main loop
+
+/**
+ * @brief Ends the main loop's sleep (capture_sleep) once this interrupt
+ *		  returns; called from the USB interrupt, which brings commands,
+ *		  SOFs and finished transfers
+ * @retval none
+ */
+void capture_wake(void)
+{
+	main_wake = 1;
+}
+
+/**
+ * @brief Arms the flush timer, TIM2 compare channel 4, to interrupt once
+ *		  ticks from now (channel 2 is the SPI sniffer's, 3 the board
+ *		  sync's). Waits longer than a TIM2 period are left to SysTick
+ * @param ticks - capture clock ticks
+ * @retval none
+ */
+static void capture_wake_timer(uint32_t ticks)
+{
+#if CAPTURE_CLOCK_DWT
+	ticks /= htim2.Init.Prescaler + 1;  // core cycles to TIM2 ticks
+#endif
+	if (ticks > 0xFFFF) return;
+	TIM2->CCR4 = (uint16_t)(TIM2->CNT + MAX(ticks, 1));
+	TIM2->SR = ~TIM_SR_CC4IF;
+	TIM2->DIER |= TIM_DIER_CC4IE;
+	HAL_NVIC_EnableIRQ(TIM2_IRQn);  // board sync turns it off when it stops
+}
+
+/**
+ * @brief The flush timer ran out: disarms it. Taking the interrupt is what
+ *		  wakes the main loop. Called from TIM2_IRQHandler
+ * @retval none
+ */
+void capture_wake_timer_irq(void)
+{
+	if (!(TIM2->SR & TIM2->DIER & TIM_SR_CC4IF)) return;
+	TIM2->DIER &= ~TIM_DIER_CC4IE;
+	TIM2->SR = ~TIM_SR_CC4IF;
+}
+
+/**
+ * @brief Sleeps with WFI until an interrupt leaves the main loop work: a
+ *		  USB interrupt (capture_wake), the ring reaching the flush
+ *		  policy's batch, the latency deadline (the flush timer) or the
+ *		  next SysTick, which paces the pollers. Other interrupts, edges
+ *		  short of the batch above all, run and the core sleeps again
+ *		  without a loop pass, so it leaves the bus and flash to them
+ * @retval none
+ */
+static void capture_sleep(void)
+{
+	uint32_t start = get_32bit_timer();
+	uint32_t tick = HAL_GetTick();
+	uint32_t queued = ring_queued();
+	uint32_t wait;
+	uint32_t batch = flush_wake(start - last_flush_time, &wait);
+	uint32_t wake_words;
+
+#if CAPTURE_SPI_DMA
+	if (spi_sniff_lines()) return;  // its DMA ring raises no interrupt
+#endif
+#if FLASH_LOG
+	if (flash_log_state == FLASH_LOG_LOGGING)
+	{
+		wake_words = FLASH_LOG_BATCH;  // no deadline: the flash takes batches
+		wait = 0;
+	}
+	else
+#endif
+	if (queued == 0)
+	{
+		wake_words = 1;  // the next pass arms the deadline
+		wait = 0;
+	}
+	else
+	{
+		// a passed deadline waits for the transfer in flight (USB)
+		wake_words = wait && batch ? MAX(batch, queued + 1) : MAX_EVENTS + 1;
+		if (wait) capture_wake_timer(wait);
+	}
+	for (;;)
+	{
+		__disable_irq();
+		if (main_wake || ring_queued() >= wake_words || HAL_GetTick() != tick ||
+			(wait && get_32bit_timer() - start >= wait)) break;
+		__WFI();  // a pending interrupt ends it with PRIMASK set,
+		__enable_irq();  // and runs here
+	}
+	main_wake = 0;
+	__enable_irq();
+	TIM2->DIER &= ~TIM_DIER_CC4IE;
+}
+#endif
+
+/**
+ * @brief Requests a capture engine; the main loop switches between blocks
+ *		  or loop passes and restarts the stream behind a stream header,
+ *		  also when the engine stays the same. Called from the host
+ *		  command parser
+ * @param mode - CAPTURE_MODE_EVENTS, CAPTURE_MODE_POLL or, in
+ *		  ADAPTIVE_CAPTURE builds, CAPTURE_MODE_ADAPTIVE
+ * @retval none
+ */
+void capture_set_mode(uint32_t mode)
+{
+#if FLASH_LOG
+	// 'O' 0 ends a session; a download runs to its end
+	if (flash_log_state == FLASH_LOG_LOGGING || flash_log_state == FLASH_LOG_SENDING) return;
+#endif
+#if ADAPTIVE_CAPTURE
+	if (mode == CAPTURE_MODE_ADAPTIVE)
+	{
+		CoreDebug->DEMCR |= CoreDebug_DEMCR_TRCENA_Msk;  // handoffs pair the clock with CYCCNT
+		DWT->CTRL |= DWT_CTRL_CYCCNTENA_Msk;
+		adaptive = 1;
+		mode = CAPTURE_MODE_EVENTS;  // starts with edges
+	}
+	else if (mode <= CAPTURE_MODE_POLL)
+	{
+		adaptive = 0;
+	}
+#endif
+	// poll blocks are not framed: a lost packet would desync the host
+	if (mode <= CAPTURE_MODE_POLL && !USB_BENCHMARK &&
+		!(USB_ISO_STREAM && mode == CAPTURE_MODE_POLL))
+	{
+		requested_mode = mode;
+		stream_restart = 1;
+#if FLOW_CREDIT
+		credit_on = 0;	// the host grants the new stream credit of its own
+		credit_held = 0;
+#endif
+	}
+}
+
+/**
+ * @brief Fills stream_header for the edge stream
+ * @param flags - STREAM_FLAG_* beyond the build's
+ * @retval none
+ */
+static void capture_edge_header(uint32_t flags)
+{
+	host_stream_header(&stream_header,
+	                   EVENT_FORMAT_SNAPSHOT ? STREAM_ENCODING_SNAPSHOT : STREAM_ENCODING_EDGE,
+	                   STREAM_PREDICT ? STREAM_COMPRESSION_PREDICT :
+	                   STREAM_COMPACT ? STREAM_COMPRESSION_COMPACT : STREAM_COMPRESSION_NONE, 4,
+	                   flags | (STREAM_FRAMED ? STREAM_FLAG_FRAMED : 0) | (USB_ISO_STREAM ? STREAM_FLAG_ISO : 0),
+	                   EVENT_TIME_BITS, clock_trim_apply(capture_clock_hz()));
+}
+
+/**
+ * @brief Starts the stream of the engine just switched to with its
+ *		  StreamHeader (host_cmd.h): a raw transfer ahead of any ring
+ *		  data, or the first block while polling. USB must be idle
+ * @retval none
+ */
+static void capture_send_header(void)
+{
+	uint32_t flags = 0;
+#if ADAPTIVE_CAPTURE
+	if (adaptive) flags = STREAM_FLAG_ADAPTIVE;
+#endif
+
+	if (capture_mode == CAPTURE_MODE_POLL)
+	{
+		host_stream_header(&stream_header, STREAM_ENCODING_BLOCKS, STREAM_COMPRESSION_NONE, 4, flags, 32,
+		                   clock_trim_apply(SystemCoreClock));
+		poll_capture_send_header((const uint32_t *)&stream_header, sizeof(stream_header) / 4);
+		return;
+	}
+	capture_edge_header(flags);
+	capture_cdc_transmit((uint8_t *)&stream_header, sizeof(stream_header));
+}
+
+/**
+ * @brief Configures the probe pins for the edge engine (EXTI on both
+ *		  edges, as in MX_GPIO_Init) or as plain inputs for polling
+ * @param exti - 1: EXTI mode, 0: input mode with the EXTI lines off
+ * @retval none
+ */
+static void capture_config_pins(uint32_t exti)
+{
+	GPIO_InitTypeDef GPIO_InitStruct = {0};
+
+	HAL_GPIO_DeInit(GPIOB, CAPTURE_EXTI_LINES);  // also clears the EXTI line setup
+	GPIO_InitStruct.Pin = CAPTURE_EXTI_LINES;
+	GPIO_InitStruct.Mode = exti ? GPIO_MODE_IT_RISING_FALLING : GPIO_MODE_INPUT;
+	GPIO_InitStruct.Pull = GPIO_NOPULL;
+	HAL_GPIO_Init(GPIOB, &GPIO_InitStruct);
+}
+
+/**
+ * @brief Empties the event ring and restarts the edge stream at the
+ *		  current epoch; no transfer from the ring may be in flight
+ * @retval none
+ */
+static void capture_ring_reset(void)
+{
+	__disable_irq();
+	ring_reset();
+	tx_events = 0;
+	last_epoch = (get_32bit_timer() >> EVENT_TIME_BITS) & (0xFFFFFFFFUL >> EVENT_TIME_BITS);
+	last_flush_time = get_32bit_timer();
+#if STREAM_COMPACT
+	compact_queued = 0;
+	compact_carry = 0;
+	event_compact_restart();
+#if STREAM_FRAMED
+	compact_framing = 0;	// the next stream_frame_begin abandons its CRC pass
+#endif
+#endif
+#if RING_FRAMED
+	frame_parts = 0;
+#endif
+#if UART_DECODE
+	uart_decode_reset();
+#endif
+#if GLITCH_FILTER
+	glitch_reset();
+#endif
+#if STORM_LIMIT
+	storm_reset();
+#endif
+#if I2C_SNIFF
+	i2c_sniff_reset();
+#endif
+#if OVERLOAD_PAIRING
+	overload = 0;	// the new stream starts exact
+	pair_open = 0;
+#endif
+#if CHANNEL_MEASURE
+	measure_reset();
+#endif
+#if PULSE_RECORDS
+	pulse_reset();
+#endif
+#if BOARD_SYNC
+	board_sync_reset();
+#endif
+#if HEALTH_REPORTS
+	health_last_write = 0;
+	health_ring_peak = 0;
+#endif
+#if LEVEL_SNAPSHOTS
+	levels_due = 1;
+#endif
+#if LATENCY_PROBE
+	latency_waiting = 0;  // its edge word went with the ring
+#endif
+#if BOOT_CAPTURE || HOST_DTR_GATE
+	if (ring_held)  // the held capture is gone, and it had no condition to re-arm
+	{
+		ring_held = 0;
+		trigger_state = TRIGGER_STREAM;
+	}
+#endif
+#if RING_TRIGGER
+	if (trigger_state == TRIGGER_ARMED || trigger_state == TRIGGER_DUMP) trigger_state = TRIGGER_ARMING;
+	skipped = 0;
+#endif
+	__enable_irq();
+}
+
+#if ANALOG_CAPTURE
+/**
+ * @brief Sampling period of the analog channel in ticks of the current
+ *		  clock, the nearest to analog_rate (not 0) that ANALOG_MAX_HZ
+ *		  and TIM1 allow
+ */
+static uint32_t capture_analog_period(void)
+{
+	uint32_t clock_hz = capture_clock_hz();
+	uint32_t fastest = (clock_hz + ANALOG_MAX_HZ - 1) / ANALOG_MAX_HZ;
+	uint32_t ticks = (clock_hz + analog_rate / 2) / analog_rate;
+
+	if (ticks < fastest) ticks = fastest;
+	return ticks < ANALOG_MAX_PERIOD ? ticks : ANALOG_MAX_PERIOD;
+}
+#endif
+
+/**
+ * @brief Turns the edge engine's probe interrupts (and the CH2 input
+ *		  capture, the analog channel) on or off; the pins stay in EXTI
+ *		  mode
+ * @param enable - 1 to capture edges, 0 to ignore them
+ * @retval none
+ */
+static void capture_events_enable(uint32_t enable)
+{
+	if (enable)
+	{
+		__HAL_GPIO_EXTI_CLEAR_IT(CAPTURE_EXTI_LINES);
+		pin_map_irqs(1);
+#if CAPTURE_IC_DMA
+		capture_ic_init();  // TIM4 rejoins TIM2 on its next update
+#endif
+#if CAPTURE_SPI_DMA
+		spi_sniff_enable(1);
+#endif
+#if ANALOG_CAPTURE
+		if (analog_rate) analog_capture_start(capture_analog_period());  // from TIM2's next wrap
+#endif
+	}
+	else
+	{
+		pin_map_irqs(0);
+#if CAPTURE_IC_DMA
+		capture_ic_stop();
+#endif
+#if CAPTURE_SPI_DMA
+		spi_sniff_enable(0);
+#endif
+#if ANALOG_CAPTURE
+		analog_capture_stop();
+#endif
+	}
+}
+
+#if USB_BENCHMARK
+/**
+ * @brief Restarts the pattern pacing from the current clock time
+ * @retval none
+ */
+static void bench_restart(void)
+{
+	bench_clock = capture_clock_hz();
+	bench_base_time = get_32bit_timer();
+	bench_base_words = bench_word;
+}
+
+/**
+ * @brief Tops the event ring up with the counter pattern, one word per
+ *		  count, as fast as transfers free it or paced to bench_rate; the
+ *		  main loop runs it instead of capturing
+ * @retval none
+ */
+static void bench_fill(void)
+{
+	uint32_t room = MAX_EVENTS - (write_index - read_index);
+
+	if (bench_rate)
+	{
+		uint32_t elapsed = get_32bit_timer() - bench_base_time;
+		if (elapsed >= bench_clock)  // rebase each second, long before the clock wraps
+		{
+			bench_base_time += bench_clock;
+			bench_base_words += bench_rate;
+			elapsed -= bench_clock;
+		}
+		uint32_t due = bench_base_words + (uint32_t)(((uint64_t)elapsed * bench_rate) / bench_clock);
+		room = MIN(room, due - bench_word);
+	}
+	// only the transmit-complete callback runs concurrently, and it only
+	// reads write_index: the words go in, then are published at once
+	uint32_t head = ring_head;
+	while (room--)
+	{
+		event_buffer[head++ & EVENT_MASK] = bench_word++;
+	}
+	ring_publish(head);
+}
+
+/**
+ * @brief Sets up the benchmark pattern (host command 'T'); the flush
+ *		  policy still decides when transfers start
+ * @param rate - pattern words per second, 0 for as fast as USB drains them
+ * @param bytes - largest transfer, 0 for USB_TX_MAX_BYTES
+ * @retval none
+ */
+void capture_bench_configure(uint32_t rate, uint32_t bytes)
+{
+	if (bytes == 0) bytes = USB_TX_MAX_BYTES;
+	bench_tx_events = MAX(1, MIN(bytes, USB_TX_MAX_BYTES) / 4);
+	bench_rate = rate;
+	bench_restart();
+}
+#endif
+
+/**
+ * @brief Stops or resumes capturing (host command 'R'). While stopped,
+ *		  events already queued and epoch markers are still sent, so the
+ *		  timeline carries on across the pause
+ * @param run - 0 to stop, anything else to resume
+ * @retval none
+ */
+void capture_set_running(uint32_t run)
+{
+	run = run != 0;
+	if (run == capture_running) return;
+	capture_running = run;
+#if LEVEL_SNAPSHOTS
+	levels_due = run;  // edges were missed while paused
+#endif
+#if USB_BENCHMARK
+	bench_restart();
+#else
+	if (capture_mode == CAPTURE_MODE_EVENTS) capture_events_enable(run);
+#endif
+}
+
+#if !CAPTURE_CLOCK_DWT
+/**
+ * @brief Changes the timestamp clock (host command 'H'): the TIM2 (and
+ *		  TIM4) prescaler takes the preset's value, the edge stream
+ *		  restarts from an empty ring and an info marker reports the new
+ *		  clock before any edge timed by it. Settings the host gave in
+ *		  time units were converted to ticks of the old clock, so send
+ *		  'U', 'W', 'K', 'Q' and 'G' after this; the flush latency follows
+ * @param preset - index into clock_presets
+ * @retval none
+ */
+void capture_set_clock(uint32_t preset)
+{
+	uint32_t events = capture_mode == CAPTURE_MODE_EVENTS;
+
+	if (preset >= sizeof clock_presets / sizeof clock_presets[0]) return;
+	if (events)
+	{
+		if (capture_running) capture_events_enable(0);
+		while (usb_busy);
+	}
+
+	__disable_irq();
+	htim2.Init.Prescaler = clock_presets[preset];
+	TIM2->PSC = clock_presets[preset];
+	TIM2->EGR = TIM_EGR_UG;  // loads PSC now instead of at the next wrap
+#if SOF_SYNC
+	sof_pending = 0;  // latched on the old clock
+#endif
+	__enable_irq();
+	capture_set_flush_policy(flush_mode_get(), flush_batch_get(), flush_latency_us);
+
+	if (events)
+	{
+		capture_ring_reset();
+		if (capture_running) capture_events_enable(1);  // TIM4 takes the new prescaler
+	}
+	capture_send_info();
+}
+#endif
+
+#if IRQ_TIMING
+/**
+ * @brief Reports the interrupt timing statistics (host command 'S') in
+ *		  the edge stream; the poll engine has no EXTI handlers to time
+ * @retval none
+ */
+void capture_send_irq_timing(void)
+{
+	if (capture_mode == CAPTURE_MODE_EVENTS) irq_timing_send();
+}
+#endif
+
+#if UART_DECODE
+/**
+ * @brief Decodes one channel as UART on the device (host command 'U'):
+ *		  its edges become one MARKER_UART record per byte
+ * @param channel - probe channel 0-3, UART_DECODE_OFF to stream its edges again
+ * @param baud - bit rate
+ * @param frame - data bits and parity, see uart_decode.h
+ * @retval none
+ */
+void capture_set_uart_decode(uint32_t channel, uint32_t baud, uint32_t frame)
+{
+	uint32_t clock_hz = capture_clock_hz();
+
+#if CAPTURE_IC_DMA
+	if (channel == IC_CHANNEL) channel = UART_DECODE_OFF;  // its edges never reach EXTI
+#endif
+	if (baud == 0) channel = UART_DECODE_OFF;
+#if I2C_SNIFF
+	if (i2c_sniff_mask & (1UL << (channel & 0x03))) channel = UART_DECODE_OFF;
+#endif
+	uart_decode_configure(channel, baud ? (uint32_t)(((uint64_t)clock_hz << 8) / baud) : 0, frame);
+}
+#endif
+
+#if I2C_SNIFF
+/**
+ * @brief Frames I2C on the device (host command 'I'): the SCL and SDA
+ *		  channels' edges become MARKER_BUS records per START, STOP and
+ *		  byte
+ * @param scl_channel - probe channel 0-3, I2C_SNIFF_OFF to stream both
+ *		  channels' edges again
+ * @param sda_channel - probe channel 0-3
+ * @retval none
+ */
+void capture_set_i2c_sniff(uint32_t scl_channel, uint32_t sda_channel)
+{
+#if CAPTURE_IC_DMA || UART_DECODE
+	uint32_t lines = (1UL << (scl_channel & 0x03)) | (1UL << (sda_channel & 0x03));
+#endif
+
+#if CAPTURE_IC_DMA
+	if (lines & (1UL << IC_CHANNEL)) scl_channel = I2C_SNIFF_OFF;  // its edges never reach EXTI
+#endif
+#if UART_DECODE
+	if (lines & uart_decode_mask) scl_channel = I2C_SNIFF_OFF;
+#endif
+	i2c_sniff_configure(scl_channel, sda_channel);
+}
+#endif
+
+#if ANALOG_CAPTURE
+/**
+ * @brief Samples the analog channel beside the edges (host command 'a');
+ *		  it runs while the edge engine does, from TIM2's next wrap
+ * @param rate_hz - samples per second, 0 to stop
+ * @retval none
+ */
+void capture_set_analog(uint32_t rate_hz)
+{
+	analog_rate = rate_hz;
+	if (capture_mode != CAPTURE_MODE_EVENTS || !capture_running) return;
+	if (rate_hz) analog_capture_start(capture_analog_period());
+	else analog_capture_stop();
+}
+#endif
+
+#if FLOW_CREDIT
+/**
+ * @brief Pushes a BUS_CREDIT record with the credit left and the ring's
+ *		  fill; called from the main loop. It goes out with the stream,
+ *		  so a CREDIT_HELD one reaches the host with its next grant
+ * @param flags - CREDIT_HELD, or 0 for a grant
+ * @retval none
+ */
+static void capture_credit_report(uint32_t flags)
+{
+	int32_t left = credit_left;
+	uint32_t kib = left > 0 ? MIN((uint32_t)left >> 10, 0xFFFF) : 0;
+	uint32_t fill = MIN((ring_queued() << 7) / MAX_EVENTS, 0x7F);
+	uint32_t words[MARKER_BUS_WORDS];
+
+	if (capture_mode != CAPTURE_MODE_EVENTS) return;
+	__disable_irq();
+	words[0] = get_32bit_timer();
+	words[1] = kib | ((flags | fill) << 16) | (BUS_CREDIT << 24);
+	capture_check_epoch(words[0]);
+	capture_push_reply(MARKER_BUS, words, MARKER_BUS_WORDS);
+	__enable_irq();
+}
+
+/**
+ * @brief Sets the stream bytes the host has room for (host command 'c').
+ *		  The host starts with its buffer's worth and grants back what
+ *		  it consumes; without credit, transfers wait and the ring fills,
+ *		  which OVERLOAD_PAIRING answers early. Called from the host
+ *		  command parser (main loop)
+ * @param mode - CREDIT_OFF, CREDIT_START or CREDIT_ADD
+ * @param kib - KiB granted
+ * @retval none
+ */
+void capture_set_credit(uint32_t mode, uint32_t kib)
+{
+	if (mode > CREDIT_ADD) return;
+
+	__disable_irq();
+	credit_left = (mode == CREDIT_ADD && credit_on ? credit_left : 0) + (int32_t)(kib << 10);
+	credit_on = mode != CREDIT_OFF;
+	credit_held = 0;
+	credit_reported = 0;
+	__enable_irq();
+	if (credit_on) capture_credit_report(0);
+}
+
+/**
+ * @brief Reports a stream held for credit, once per wait; called from
+ *		  the main loop
+ * @retval none
+ */
+static void capture_credit_poll(void)
+{
+	if (!credit_held || credit_reported) return;
+	credit_reported = 1;
+	capture_credit_report(CREDIT_HELD);
+}
+#endif
+
+#if UART_DECODE || I2C_SNIFF
+/**
+ * @brief Filters a sniffer's transactions on the device (host command
+ *		  'X'): those not matching are dropped before the ring and counted
+ *		  in BUS_FILTER records
+ * @param bus - FILTER_I2C or FILTER_UART
+ * @param match - address (I2C) or first byte (UART) kept
+ * @param mask - bits of match compared, 0 keeps everything
+ * @param gap - UART: idle frame times ending a message, 0 for 2
+ * @retval none
+ */
+void capture_set_filter(uint32_t bus, uint32_t match, uint32_t mask, uint32_t gap)
+{
+	__disable_irq();
+#if I2C_SNIFF
+	if (bus == FILTER_I2C) i2c_sniff_filter(match, mask);
+#endif
+#if UART_DECODE
+	if (bus == FILTER_UART) uart_decode_filter(match, mask, gap);
+#endif
+	__enable_irq();
+}
+#endif
+
+/**
+ * @brief Selects the channels the edge capture listens to (host command
+ *		  'E'); a disabled channel's EXTI line stops interrupting, so
+ *		  floating inputs cost no ISR time or ring space
+ * @param mask - bit n set to capture channel n
+ * @retval none
+ */
+void capture_set_channels(uint32_t mask)
+{
+	channel_mask = mask & 0x0F;
+	capture_apply_channels();
+}
+
+/**
+ * @brief Writes the EXTI mask and edge selection of the probe pins'
+ *		  lines: the enabled channels less the lines a peripheral took over
+ * @retval none
+ */
+void capture_apply_channels(void)
+{
+	uint32_t lines = pin_map_lines(channel_mask);
+
+#if CAPTURE_IC_DMA
+	lines &= ~CH2_Pin;  // TIM4 captures PB6
+#endif
+#if CAPTURE_SPI_DMA
+	lines &= ~spi_sniff_lines();
+#endif
+#if CHANNEL_MEASURE
+	lines &= ~measure_lines();
+#endif
+	__disable_irq();
+#if SS_GATE
+	exti_lines = lines;
+	// a closed gate keeps its lines masked; capture_gate_edge opens it
+	uint32_t closed = (pin_map_channels(GPIOB->IDR) & gate_ss) != gate_level ? gate_lines : 0;
+#else
+	uint32_t closed = 0;
+#endif
+	EXTI->IMR = (EXTI->IMR & ~CAPTURE_EXTI_LINES) | (lines & ~closed);
+	EXTI->RTSR = (EXTI->RTSR & ~CAPTURE_EXTI_LINES) | lines;
+	EXTI->FTSR = (EXTI->FTSR & ~CAPTURE_EXTI_LINES) | lines;
+	__HAL_GPIO_EXTI_CLEAR_IT(CAPTURE_EXTI_LINES & ~lines);
+	__enable_irq();
+}
+
+#if SS_GATE
+/**
+ * @brief Gates SPI channels on a chip select (host command 'g'): their
+ *		  EXTI lines interrupt only while ss_channel is at level, so
+ *		  transfers to other devices on the bus cost no ISR time or
+ *		  ring space. The chip select's own edges are still captured
+ * @param ss_channel - probe channel of the chip select, 0xFF to stop
+ * @param mask - bit n gates channel n, SCK and MOSI/MISO
+ * @param level - 0 for an active low chip select, 1 active high
+ * @retval none
+ */
+void capture_set_ss_gate(uint32_t ss_channel, uint32_t mask, uint32_t level)
+{
+	uint32_t ss = ss_channel < 4 ? 1UL << ss_channel : 0;
+
+	gate_ss = ss;
+	gate_level = level ? ss : 0;
+	gate_lines = ss ? pin_map_lines(mask & 0x0F & ~ss) : 0;
+	capture_apply_channels();
+}
+#endif
+
+#if GLITCH_FILTER
+/**
+ * @brief Sets a channel's minimum pulse width (host command 'W'): shorter
+ *		  pulses are dropped and counted in the 'V' reply
+ * @param channel - probe channel 0-3, or GLITCH_ALL_CHANNELS
+ * @param width_ns - minimum pulse width in ns, 0 to stop filtering
+ * @retval none
+ */
+void capture_set_glitch_filter(uint32_t channel, uint32_t width_ns)
+{
+	uint32_t clock_hz = capture_clock_hz();
+
+	glitch_configure(channel, (uint32_t)(((uint64_t)width_ns * clock_hz + 999999999) / 1000000000));
+}
+#endif
+
+#if STORM_LIMIT
+/**
+ * @brief Sets a channel's edge rate limit (host command 'K'): above it
+ *		  the channel sends one summary per STORM_WINDOW_US instead of
+ *		  its edges
+ * @param channel - probe channel 0-3, or STORM_ALL_CHANNELS
+ * @param rate - edges per second allowed, 0 for no limit
+ * @param burst - edges allowed back to back
+ * @retval none
+ */
+void capture_set_storm_limit(uint32_t channel, uint32_t rate, uint32_t burst)
+{
+	uint32_t clock_hz = capture_clock_hz();
+	uint32_t ticks = rate ? MAX(1, clock_hz / rate) : 0;
+
+	storm_configure(channel, ticks, burst,
+	                (uint32_t)((uint64_t)STORM_WINDOW_US * clock_hz / 1000000));
+}
+#endif
+
+#if CHANNEL_MEASURE
+/**
+ * @brief Measures channels on the device (host command 'Q'): their edges
+ *		  become one frequency and duty summary per 1/rate s
+ * @param mask - bit n measures channel n, MEASURE_CH2_TIMER counts CH2
+ *		  with TIM4; 0 streams the edges again
+ * @param rate - summaries per second, 0 stops; the window is at most
+ *		  MEASURE_MAX_TICKS long
+ * @retval none
+ */
+void capture_set_measure(uint32_t mask, uint32_t rate)
+{
+	uint32_t ticks = rate ? capture_clock_hz() / rate : 0;
+
+#if CAPTURE_IC_DMA
+	mask &= ~((1UL << IC_CHANNEL) | MEASURE_CH2_TIMER);  // TIM4 captures PB6
+#endif
+	if (rate == 0) mask = 0;
+	measure_configure(mask, MIN(MAX(ticks, 1), MEASURE_MAX_TICKS));
+	capture_apply_channels();
+}
+#endif
+
+#if PULSE_RECORDS
+/**
+ * @brief Sends channels' pulses as one record each (host command 'p')
+ *		  instead of their leading and trailing edges
+ * @param mask - bit n sends channel n's pulses as records, 0 stops
+ * @param levels - bit n set: channel n's pulses are high, clear: low
+ * @retval none
+ */
+void capture_set_pulses(uint32_t mask, uint32_t levels)
+{
+	pulse_configure(mask, levels);
+}
+#endif
+
+#if CAPTURE_SPI_DMA
+/**
+ * @brief Sniffs SPI with the SPI peripherals (host command 'P'): PB5's
+ *		  edges become one MARKER_BUS record per byte
+ * @param mode - 'P' mode byte, see spi_sniff.h
+ * @param cs_channel - probe channel of the chip select, SPI_NO_CS for none
+ * @retval none
+ */
+void capture_set_spi_sniff(uint32_t mode, uint32_t cs_channel)
+{
+#if UART_DECODE
+	if (uart_decode_mask & (1UL << SPI_DATA_CHANNEL)) mode &= ~SPI_MODE_ON;  // PB5 is taken
+#endif
+	spi_sniff_configure(mode, cs_channel);
+	if (capture_mode != CAPTURE_MODE_EVENTS || !capture_running) spi_sniff_enable(0);
+}
+#endif
+
+/**
+ * @brief Answers host command 'V' in the current stream: an info marker in
+ *		  the event stream, or an info block while polling. The words are
+ *		  the protocol version, the HOST_CAP_* bits, the clock of the
+ *		  stream's timestamps in Hz with the stored correction
+ *		  (clock_trim.h), the most USB transfers queued at
+ *		  once since power-up and the glitches the filter suppressed
+ * @retval none
+ */
+void capture_send_info(void)
+{
+	uint32_t info[HOST_INFO_WORDS] = {
+		HOST_PROTOCOL_VERSION,
+		host_cmd_capabilities(),
+		clock_trim_apply(capture_clock_hz()),
+		usb_tx_queue_peak,
+#if GLITCH_FILTER
+		glitch_suppressed
+#else
+		0
+#endif
+	};
+
+	if (capture_mode == CAPTURE_MODE_POLL)
+	{
+		info[2] = clock_trim_apply(SystemCoreClock);  // DWT->CYCCNT
+		poll_capture_send_info(info, HOST_INFO_WORDS);
+		return;
+	}
+	__disable_irq();
+	capture_push_reply(MARKER_INFO, info, MARKER_INFO_WORDS);
+	__enable_irq();
+}
+
+/**
+ * @brief Echoes a host command the device ran into the edge stream, so a
+ *		  capture records the settings it was taken with: BUS_CONFIG
+ *		  records of two argument bytes each, all at the same clock time.
+ *		  Requests that change nothing ('V', 'S') and the polling stream
+ *		  are left out. Called from the host command parser (main loop)
+ * @param cmd - the command, opcode first
+ * @param len - its length in bytes, opcode included
+ * @retval none
+ */
+void capture_echo_command(const uint8_t *cmd, uint32_t len)
+{
+#if CONFIG_ECHOES
+	if (capture_mode != CAPTURE_MODE_EVENTS || cmd[0] == HOST_CMD_INFO || cmd[0] == HOST_CMD_STATS) return;
+
+	__disable_irq();
+	uint32_t time = get_32bit_timer();
+	for (uint32_t i = 1; ; i += 2)
+	{
+		uint32_t last = i + 2 >= len;
+		uint32_t words[MARKER_BUS_WORDS] = {
+			time,
+			(i < len ? cmd[i] : 0) | (i + 1 < len ? cmd[i + 1] << 8 : 0)
+				| ((cmd[0] | (last ? CONFIG_LAST : 0)) << 16) | (BUS_CONFIG << 24)
+		};
+		capture_push_record(event_pack_marker(MARKER_BUS, 0), words, MARKER_BUS_WORDS);
+		if (last) break;
+	}
+	__enable_irq();
+#else
+	(void)cmd;
+	(void)len;
+#endif
+}
+
+#if CONFIG_STAGE
+/**
+ * @brief Starts an 's' commit: the probe pins' edges are held pending
+ *		  while the staged commands run, so no edge is stored under half
+ *		  of the new settings. Called from the host command parser
+ *		  (main loop)
+ * @retval clock time the edges were held from
+ */
+uint32_t capture_swap_begin(void)
+{
+	pin_map_irqs_hold(1);
+	return get_32bit_timer();
+}
+
+/**
+ * @brief Ends an 's' commit: a BUS_RECONFIG record at the time the edges
+ *		  were held from, with the commands run and the ticks they were
+ *		  held, and the held edges are taken, stamped that late at most
+ * @param start - capture_swap_begin's time
+ * @param commands - staged commands run
+ * @retval none
+ */
+void capture_swap_end(uint32_t start, uint32_t commands)
+{
+	__disable_irq();
+	uint32_t held = get_32bit_timer() - start;
+#if !USB_BENCHMARK
+	if (capture_mode == CAPTURE_MODE_EVENTS)
+	{
+		uint32_t words[MARKER_BUS_WORDS] = {
+			start,
+			commands | (MIN(held, 0xFFFF) << 8) | (BUS_RECONFIG << 24)
+		};
+		capture_push_record(event_pack_marker(MARKER_BUS, 0), words, MARKER_BUS_WORDS);
+	}
+#else
+	(void)held;
+	(void)commands;
+#endif
+	__enable_irq();
+	pin_map_irqs_hold(0);
+}
+#endif
+
+/**
+ * @brief Latches the stream's clock on a USB start of frame, so the host
+ *		  can tie device time to its own USB frame clock. Every
+ *		  SOF_SYNC_FRAMES frames the pair is handed to the main loop; a
+ *		  pair it has not sent yet is replaced. Called from the SOF
+ *		  callback of the USB interrupt
+ * @param frame - 11-bit frame number of this SOF (USB->FNR)
+ * @retval none
+ */
+void capture_sof(uint32_t frame)
+{
+#if SOF_SYNC
+	uint32_t clock = capture_mode == CAPTURE_MODE_POLL ? DWT->CYCCNT : get_32bit_timer();
+	uint32_t frames = sof_frames + ((frame - sof_frames) & USB_FNR_FN);  // also counts missed SOFs
+
+	sof_frames = frames;
+	if (frames - sof_sync_frame < SOF_SYNC_FRAMES) return;
+	sof_sync_frame = frames;
+	sof_sync_clock = clock;
+	sof_pending = 1;
+#else
+	(void)frame;
+#endif
+}
+
+#if SOF_SYNC
+/**
+ * @brief Sends the latest latched SOF pair in the current stream: a SOF
+ *		  marker in the event stream, or a sync block while polling
+ * @retval none
+ */
+static void capture_send_sync(void)
+{
+	__disable_irq();
+	uint32_t sync[MARKER_SOF_WORDS] = { sof_sync_frame, sof_sync_clock };
+	sof_pending = 0;
+	if (capture_mode == CAPTURE_MODE_EVENTS)
+	{
+		capture_push_record(event_pack_marker(MARKER_SOF, 0), sync, MARKER_SOF_WORDS);
+	}
+	__enable_irq();
+
+	if (capture_mode == CAPTURE_MODE_POLL) poll_capture_send_sync(sync, MARKER_SOF_WORDS);
+}
+#endif
+
+#if HEALTH_REPORTS
+/**
+ * @brief Pushes one health counter, saturated to the 20-bit value field
+ */
+static void health_put(uint32_t time, uint32_t item, uint32_t value)
+{
+	uint32_t words[MARKER_BUS_WORDS] = {
+		time,
+		MIN(value, 0xFFFFF) | (item << 20) | (BUS_HEALTH << 24)
+	};
+	capture_push_reply(MARKER_BUS, words, MARKER_BUS_WORDS);
+}
+
+/**
+ * @brief Sends the link health counters since the last report and starts
+ *		  the next period; called from the main loop in the edge engine.
+ *		  The ring peak is sampled once per loop pass, so a burst the
+ *		  transmit-complete chain drains in between shows up lower
+ * @retval none
+ */
+static void capture_send_health(void)
+{
+	__disable_irq();
+	uint32_t time = get_32bit_timer();
+	uint32_t period_us = (uint32_t)(((uint64_t)(time - health_last_time) * 1000000) / capture_clock_hz());
+
+	health_put(time, HEALTH_EVENTS, write_index - health_last_write);
+	health_put(time, HEALTH_BYTES, health_tx_bytes);
+	health_put(time, HEALTH_RING_PEAK, health_ring_peak);
+	health_put(time, HEALTH_RING_WORDS, MAX_EVENTS);
+	health_put(time, HEALTH_DROPPED, dropped_total - health_last_dropped);
+	health_put(time, HEALTH_USB_BUSY, health_usb_busy);
+	health_put(time, HEALTH_CMD_LOST, host_cmd_overruns - health_last_overruns);
+#if IRQ_TIMING
+	health_put(time, HEALTH_EXTI_MAX, irq_timing_exti_peak());
+#endif
+	health_put(time, HEALTH_PERIOD, period_us);
+	// the report's own words count in the next period
+	health_last_write = write_index;
+	health_last_dropped = dropped_total;
+	health_last_overruns = host_cmd_overruns;
+	health_last_time = time;
+	health_ring_peak = 0;
+	health_tx_bytes = 0;
+	health_usb_busy = 0;
+	__enable_irq();
+}
+#endif
+
+#if LEVEL_SNAPSHOTS
+/**
+ * @brief Sends the probe pins' levels, so the host can correct a channel
+ *		  whose edge went missing and a decoder can start mid-capture;
+ *		  called from the main loop in the edge engine. The pins are read
+ *		  before the clock with IRQs masked: an edge after the read is
+ *		  timed after the snapshot. Channels whose edges become bytes,
+ *		  summaries or filtered pulses are left out of the mask. The
+ *		  snapshot is retried until the ring takes it
+ * @retval none
+ */
+static void capture_send_levels(void)
+{
+	uint32_t edges = channel_mask;
+#if UART_DECODE
+	edges &= ~uart_decode_mask;
+#endif
+#if I2C_SNIFF
+	edges &= ~i2c_sniff_mask;
+#endif
+#if CHANNEL_MEASURE
+	edges &= ~measure_mask;
+#endif
+#if GLITCH_FILTER
+	edges &= ~glitch_mask;
+#endif
+#if PULSE_RECORDS
+	edges &= ~pulse_mask;
+#endif
+
+	__disable_irq();
+	uint32_t levels = pin_map_channels(GPIOB->IDR);
+	uint32_t time = get_32bit_timer();
+	uint32_t words[MARKER_BUS_WORDS] = {
+		time,
+		levels | ((edges & 0x0F) << 8) | (BUS_LEVELS << 24)
+	};
+	uint32_t written = write_index;
+	uint32_t dropped = dropped_total;
+	capture_push_record(event_pack_marker(MARKER_BUS, 0), words, MARKER_BUS_WORDS);
+	if (write_index != written)
+	{
+		levels_last_time = time;
+		levels_last_dropped = dropped;
+		levels_due = 0;
+	}
+	__enable_irq();
+}
+#endif
+
+#if LATENCY_PROBE
+/**
+ * @brief Drives the loopback output PA0 low; called once at start-up.
+ *		  A wire from PA0 to a probe channel closes the loop
+ * @retval none
+ */
+static void capture_latency_init(void)
+{
+	GPIO_InitTypeDef GPIO_InitStruct = {0};
+
+	__HAL_RCC_GPIOA_CLK_ENABLE();
+	GPIOA->BRR = LATENCY_PROBE_PIN;
+	GPIO_InitStruct.Pin = LATENCY_PROBE_PIN;
+	GPIO_InitStruct.Mode = GPIO_MODE_OUTPUT_PP;
+	GPIO_InitStruct.Speed = GPIO_SPEED_FREQ_HIGH;
+	HAL_GPIO_Init(GPIOA, &GPIO_InitStruct);
+}
+
+/**
+ * @brief Toggles PA0 and stamps the toggle, so the host can time the
+ *		  probe channel's edge from the pin to its display; called from
+ *		  the main loop in the edge engine. The record goes in with IRQs
+ *		  masked right before the toggle, so the edge lands in the ring
+ *		  word after it unless another channel's edge was pending too.
+ *		  A toggle the ring had no room for is retried next pass
+ * @retval none
+ */
+static void capture_latency_toggle(void)
+{
+	__disable_irq();
+	uint32_t time = get_32bit_timer();
+	uint32_t words[MARKER_BUS_WORDS] = {
+		time,
+		(latency_seq & 0xFF) | (BUS_LATENCY << 24)
+	};
+	uint32_t written = write_index;
+	capture_push_record(event_pack_marker(MARKER_BUS, 0), words, MARKER_BUS_WORDS);
+	if (write_index != written)
+	{
+		GPIOA->ODR ^= LATENCY_PROBE_PIN;
+		latency_slot = write_index;
+		latency_waiting = 1;
+		latency_last_time = time;
+		latency_seq++;
+	}
+	__enable_irq();
+}
+
+/**
+ * @brief Stamps the end of the transfer that carried the last toggle's
+ *		  edge word, once transmit complete has released it; called from
+ *		  the main loop in the edge engine, so the stamp is late by a
+ *		  loop pass at most
+ * @retval none
+ */
+static void capture_latency_sent(void)
+{
+	if ((int32_t)(read_index - latency_slot) <= 0) return;
+
+	__disable_irq();
+	uint32_t words[MARKER_BUS_WORDS] = {
+		get_32bit_timer(),
+		((latency_seq - 1) & 0xFF) | (LATENCY_SENT << 16) | (BUS_LATENCY << 24)
+	};
+	capture_push_record(event_pack_marker(MARKER_BUS, 0), words, MARKER_BUS_WORDS);
+	latency_waiting = 0;
+	__enable_irq();
+}
+#endif
+
+#if RECORDER_INPUT
+/**
+ * @brief Makes PA3 a pulled-up input for the recorder's dump button;
+ *		  called once at start-up
+ * @retval none
+ */
+static void capture_button_init(void)
+{
+	GPIO_InitTypeDef GPIO_InitStruct = {0};
+
+	__HAL_RCC_GPIOA_CLK_ENABLE();
+	GPIO_InitStruct.Pin = RECORDER_BUTTON_PIN;
+	GPIO_InitStruct.Mode = GPIO_MODE_INPUT;
+	GPIO_InitStruct.Pull = GPIO_PULLUP;
+	HAL_GPIO_Init(GPIOA, &GPIO_InitStruct);
+}
+
+/**
+ * @brief Dumps the flight recorder when the button is pressed; a change
+ *		  within RECORDER_DEBOUNCE_MS of the last is contact bounce.
+ *		  Called from the main loop
+ * @param now - 32-bit clock time
+ * @retval none
+ */
+static void capture_button_poll(uint32_t now)
+{
+	uint32_t level = (GPIOA->IDR & RECORDER_BUTTON_PIN) != 0;
+
+	if (level == button_level || now - button_time < capture_clock_hz() / 1000 * RECORDER_DEBOUNCE_MS) return;
+	button_level = level;
+	button_time = now;
+	if (level == 0) capture_dump(0, RECORDER_BUTTON_MS);
+}
+#endif
+
+#if ADAPTIVE_CAPTURE
+/**
+ * @brief Opens a new 'M' 2 rate window on the running engine's clock
+ */
+static void capture_adapt_restart(void)
+{
+	adapt_start = capture_mode == CAPTURE_MODE_POLL ? DWT->CYCCNT : get_32bit_timer();
+	adapt_words = write_index + dropped_total;
+	adapt_changes = 0;
+}
+
+/**
+ * @brief Hands the stream to the other engine for 'M' 2 without losing
+ *		  what the old one queued. Edges to polling: the probe interrupts
+ *		  stop, a BUS_HANDOFF record goes in behind the last edge and the
+ *		  ring is sent to the end before its memory becomes the poll
+ *		  blocks. Polling to edges: the last block is sent. Either way the
+ *		  poll stream carries a POLL_BLOCK_MAGIC_HANDOFF block with the
+ *		  edge clock and DWT->CYCCNT read together, right behind its
+ *		  header or as its last block, so the host can lay the samples
+ *		  on the edge timeline; the edge stream starts with a level
+ *		  snapshot. Called from the main loop
+ * @param mode - CAPTURE_MODE_POLL or CAPTURE_MODE_EVENTS
+ * @retval none
+ */
+static void capture_adapt(uint32_t mode)
+{
+	uint32_t handoff[POLL_HANDOFF_WORDS];
+
+	if (mode == CAPTURE_MODE_POLL)
+	{
+		capture_events_enable(0);
+		__disable_irq();
+		handoff[0] = get_32bit_timer();
+		handoff[1] = DWT->CYCCNT;
+		__enable_irq();
+		handoff[2] = mode;
+
+		// Retried until the ring takes it: the host needs the record to
+		// know the ring words end there
+		uint32_t words[MARKER_BUS_WORDS] = { handoff[0], mode | (BUS_HANDOFF << 24) };
+		uint32_t written = 0;
+		while (!written || ring_queued())
+		{
+			HAL_NVIC_DisableIRQ(USB_LP_CAN1_RX0_IRQn);
+			capture_tx_start(1);
+			HAL_NVIC_EnableIRQ(USB_LP_CAN1_RX0_IRQn);
+			if (written) continue;
+			__disable_irq();
+			uint32_t before = write_index;
+			capture_push_record(event_pack_marker(MARKER_BUS, 0), words, MARKER_BUS_WORDS);
+			written = write_index != before;
+			__enable_irq();
+		}
+
+		HAL_NVIC_DisableIRQ(USB_LP_CAN1_RX0_IRQn);
+		capture_mode = requested_mode = mode;
+#if SOF_SYNC
+		sof_pending = 0;  // latched on the old engine's clock
+#endif
+		HAL_NVIC_EnableIRQ(USB_LP_CAN1_RX0_IRQn);
+		capture_config_pins(0);
+		capture_ring_reset();
+		if (poll_capture_start((void *)event_buffer, MAX_EVENTS * 4))
+		{
+			capture_send_header();
+			poll_capture_send_handoff(handoff, POLL_HANDOFF_WORDS);
+			capture_adapt_restart();
+			return;
+		}
+		adaptive = 0;  // ring too small for two blocks: edges it is
+		capture_mode = requested_mode = CAPTURE_MODE_EVENTS;
+	}
+	else
+	{
+		__disable_irq();
+		handoff[0] = get_32bit_timer();
+		handoff[1] = DWT->CYCCNT;
+		__enable_irq();
+		handoff[2] = mode;
+		poll_capture_send_handoff(handoff, POLL_HANDOFF_WORDS);
+		while (usb_busy);
+
+		HAL_NVIC_DisableIRQ(USB_LP_CAN1_RX0_IRQn);
+		capture_mode = requested_mode = mode;
+#if SOF_SYNC
+		sof_pending = 0;
+#endif
+		HAL_NVIC_EnableIRQ(USB_LP_CAN1_RX0_IRQn);
+		capture_ring_reset();
+	}
+
+	capture_send_header();
+	capture_config_pins(1);
+	if (capture_running) capture_events_enable(1);
+	capture_adapt_restart();
+}
+
+/**
+ * @brief Weighs the ring words of the closing 'M' 2 window in the edge
+ *		  engine; above ADAPTIVE_RATE the poll engine takes over, which
+ *		  costs a fixed bit count per sample however busy the pins are.
+ *		  Not while a trigger holds the stream
+ * @param now - clock time
+ * @retval 1 if the poll engine took over
+ */
+static uint32_t capture_adapt_events(uint32_t now)
+{
+	uint32_t elapsed = now - adapt_start;
+	uint32_t words = write_index + dropped_total - adapt_words;
+
+	if (elapsed < capture_clock_hz() / 1000 * ADAPTIVE_WINDOW_MS) return 0;
+	adapt_start = now;
+	adapt_words += words;
+#if RING_TRIGGER
+	if (trigger_state != TRIGGER_STREAM) return 0;
+#endif
+	if ((uint64_t)words * capture_clock_hz() <= (uint64_t)ADAPTIVE_RATE * elapsed) return 0;
+	capture_adapt(CAPTURE_MODE_POLL);
+	return 1;
+}
+
+/**
+ * @brief Adds up the sample changes of the 'M' 2 window in the poll
+ *		  engine; below a quarter of ADAPTIVE_RATE, so the engines do not
+ *		  flap around the threshold, the edge engine takes over again
+ * @param changes - sample changes of the block just sent
+ * @retval none
+ */
+static void capture_adapt_poll(uint32_t changes)
+{
+	uint32_t elapsed = DWT->CYCCNT - adapt_start;
+
+	adapt_changes += changes;
+	if (elapsed < SystemCoreClock / 1000 * ADAPTIVE_WINDOW_MS) return;
+	if ((uint64_t)adapt_changes * SystemCoreClock * 4 < (uint64_t)ADAPTIVE_RATE * elapsed)
+	{
+		capture_adapt(CAPTURE_MODE_EVENTS);
+		return;
+	}
+	adapt_start += elapsed;
+	adapt_changes = 0;
+}
+#endif
+
+#if BOOT_CAPTURE
+/**
+ * @brief Applies the stored boot capture preset (boot_capture.h) at
+ *		  power-up, before the timers start and USB is initialised, and
+ *		  holds the ring as an armed trigger without a condition does
+ *		  until the host's first 'M'
+ * @retval none
+ */
+static void capture_boot_start(void)
+{
+	BootPreset preset;
+
+	if (!boot_capture_preset(&preset)) return;
+#if !CAPTURE_CLOCK_DWT
+	if (preset.clock < sizeof clock_presets / sizeof clock_presets[0])
+	{
+		htim2.Init.Prescaler = clock_presets[preset.clock];
+		TIM2->PSC = clock_presets[preset.clock];
+		TIM2->EGR = TIM_EGR_UG;
+	}
+#endif
+	if (preset.channels) capture_set_channels(preset.channels);
+
+	__disable_irq();
+	head_epoch = last_epoch;
+	skipped = 0;
+	trigger_pre = preset.mode == BOOT_CAPTURE_WRAP ? MAX_EVENTS - TRIGGER_RESERVE : 0xFFFFFFFF;
+	trigger_state = TRIGGER_ARMED;  // TRIG_OFF never fires
+	ring_held = 1;
+	__enable_irq();
+}
+#endif
+
+#if HOST_DTR_GATE
+/**
+ * @brief Holds the edge stream in the ring while no reader holds DTR, so
+ *		  no transfer goes to a closed port: the ring keeps the newest
+ *		  edges, as an armed trigger without a condition does, and the
+ *		  host's next 'M' sends them behind the stream header. A trigger
+ *		  the host armed keeps its own hold. Called from the main loop
+ * @retval none
+ */
+static void capture_host_service(void)
+{
+	if (CDC_HostAttached_FS() || ring_held) return;
+	if (!capture_running || capture_mode != CAPTURE_MODE_EVENTS || trigger_state != TRIGGER_STREAM) return;
+#if FLASH_LOG
+	if (flash_log_state == FLASH_LOG_LOGGING) return;  // the flash takes the stream, reader or not
+#endif
+
+	__disable_irq();
+	trigger_pre = MAX_EVENTS - TRIGGER_RESERVE;
+	trigger_state = TRIGGER_ARMING;  // TRIG_OFF never fires; armed once nothing is in flight
+	ring_held = 1;
+	__enable_irq();
+}
+#endif
+
+/**
+ * @brief Hands the pins and the USB stream to the requested engine without
+ *		  a reset. Whatever the old engine had not sent yet is discarded;
+ *		  the transfer in flight is let finish first, since both engines
+ *		  use the event ring memory
+ * @retval none
+ */
+static void capture_switch_mode(void)
+{
+	uint32_t mode = requested_mode;
+
+	// From here transmit-complete callbacks no longer chain the old stream
+	HAL_NVIC_DisableIRQ(USB_LP_CAN1_RX0_IRQn);
+	capture_mode = mode;
+	stream_restart = 0;
+#if SOF_SYNC
+	sof_pending = 0;  // latched on the old engine's clock
+#endif
+	HAL_NVIC_EnableIRQ(USB_LP_CAN1_RX0_IRQn);
+
+#if BOOT_CAPTURE || HOST_DTR_GATE
+	if (ring_held && mode == CAPTURE_MODE_EVENTS)
+	{
+		// The held edges follow the header; capture never stopped
+		capture_send_header();
+		__disable_irq();
+		capture_trigger_release();
+		__enable_irq();
+#if ADAPTIVE_CAPTURE
+		capture_adapt_restart();
+#endif
+		return;
+	}
+#endif
+	if (mode == CAPTURE_MODE_POLL)
+	{
+		capture_events_enable(0);
+		capture_config_pins(0);
+		while (usb_busy);
+		capture_ring_reset();  // the ring memory becomes the poll blocks
+
+		if (poll_capture_start((void *)event_buffer, MAX_EVENTS * 4))
+		{
+			capture_send_header();
+			return;
+		}
+#if ADAPTIVE_CAPTURE
+		adaptive = 0;
+#endif
+		mode = requested_mode = CAPTURE_MODE_EVENTS;  // ring too small for two blocks
+		capture_mode = mode;
+	}
+
+	capture_events_enable(0);  // a restart in the edge engine stops it here
+	while (usb_busy);
+	capture_ring_reset();
+	capture_send_header();
+
+	capture_config_pins(1);
+	if (capture_running) capture_events_enable(1);
+#if ADAPTIVE_CAPTURE
+	capture_adapt_restart();
+#endif
+}
+
+#if STREAM_COMPACT
+/**
+ * @brief Encodes the queued ring words as compact records behind the
+ *		  bytes carried over from the last call. Records may straddle
+ *		  the size: the host decodes a byte stream, so what passes it is
+ *		  carried to the next call. The words are claimed in one go and
+ *		  released once encoded
+ * @param out - destination, room for size + COMPACT_MAX_RECORD bytes
+ * @param size - bytes wanted
+ * @retval bytes written, at most size
+ */
+static uint32_t capture_compact_fill(uint8_t *out, uint32_t size)
+{
+	uint32_t len = compact_carry;
+	uint32_t first;
+	uint32_t queued = ring_claim_all(&first);
+	uint32_t taken = 0;
+
+	memcpy(out, compact_carry_buf, compact_carry);
+#if STREAM_PREDICT && STREAM_FRAMED
+	event_compact_frame(out + size);  // the host starts over with this frame's first record
+#endif
+	while (taken < queued && len < size)
+	{
+		len += event_compact_encode(event_buffer[(first + taken++) & EVENT_MASK], out + len);
+	}
+	len += event_compact_flush(out + len);  // no edge waits for the next packet
+	ring_release(taken);
+
+	uint32_t send = MIN(len, size);
+	compact_carry = len - send;
+	memcpy(compact_carry_buf, out + send, compact_carry);
+	return send;
+}
+#endif
+
+#if FLASH_LOG
+/**
+ * @brief Sends the state of the flash log as a BUS_FLASH record
+ */
+static void capture_log_report(void)
+{
+	__disable_irq();
+	uint32_t words[MARKER_BUS_WORDS] = { get_32bit_timer(), flash_log_report() | (BUS_FLASH << 24) };
+	capture_push_reply(MARKER_BUS, words, MARKER_BUS_WORDS);
+	__enable_irq();
+}
+
+/**
+ * @brief Encodes the ring into the flash log's free page buffer, whose
+ *		  full pages go to DMA; what a trigger holds stays in the ring, as
+ *		  it does for USB. With FLASH_LOG_BATCH a batch starts only once
+ *		  the ring holds FLASH_LOG_BATCH events, and runs until it is
+ *		  empty. Called from the main loop while logging
+ * @param all - 1 to drain whatever is queued, batch or not (a stop)
+ * @retval 1 while queued data waits for a page buffer to come free
+ */
+static uint32_t capture_log_drain(uint32_t all)
+{
+	uint8_t *page;
+	uint32_t room;
+
+#if RING_TRIGGER
+	if (trigger_state == TRIGGER_ARMED) return 0;
+#endif
+#if FLASH_LOG_BATCH
+	if (!all && !log_batch_open && ring_queued() < FLASH_LOG_BATCH) return 0;
+	log_batch_open = 1;
+#else
+	(void)all;
+#endif
+	while (ring_queued() || compact_carry)
+	{
+		flash_log_poll();
+		if (flash_log_state != FLASH_LOG_LOGGING) return 0;
+		page = flash_log_buffer(&room);
+		if (page == NULL) return 1;
+		flash_log_commit(capture_compact_fill(page, room));
+	}
+#if FLASH_LOG_BATCH
+	log_batch_open = 0;
+#endif
+	return 0;
+}
+
+/**
+ * @brief Runs host command 'O' (flash_log.h) from the host command parser
+ *		  (main loop), and FLASH_LOG_AUTOSTART at power-up. A session
+ *		  starts as the USB stream does, with a fresh ring behind its
+ *		  StreamHeader, and its end sends everything queued to flash
+ *		  before the USB stream restarts
+ * @param mode - FLASH_LOG_STOP, _ERASE, _START or _DOWNLOAD
+ * @retval none
+ */
+void capture_set_flash_log(uint32_t mode)
+{
+	uint32_t room;
+
+	if (mode == FLASH_LOG_STOP && flash_log_state == FLASH_LOG_LOGGING)
+	{
+		capture_events_enable(0);
+		while (capture_log_drain(1));
+		flash_log_finish();
+		while (flash_log_state == FLASH_LOG_LOGGING) flash_log_poll();
+		stream_restart = 1;  // events resume behind the USB stream's header
+	}
+	else if (mode == FLASH_LOG_ERASE)
+	{
+		flash_log_erase();
+		if (flash_log_state == FLASH_LOG_ERASING) return;  // answered when done
+	}
+	else if (mode == FLASH_LOG_START && capture_mode == CAPTURE_MODE_EVENTS && flash_log_start())
+	{
+		capture_events_enable(0);
+		while (usb_busy);
+		capture_ring_reset();
+		capture_edge_header(0);
+		memcpy(flash_log_buffer(&room), &stream_header, sizeof(stream_header));
+		flash_log_commit(sizeof(stream_header));
+		if (capture_running) capture_events_enable(1);
+	}
+	else if (mode == FLASH_LOG_DOWNLOAD && capture_mode == CAPTURE_MODE_EVENTS && flash_log_download())
+	{
+		// the log goes out through compact_packet, as the stream would
+		capture_events_enable(0);
+		while (usb_busy);
+		capture_ring_reset();
+#if FLOW_CREDIT
+		credit_on = 0;	// flash_log.py reads it without granting
+		credit_held = 0;
+#endif
+		return;
+	}
+	log_report_due = 1;
+}
+
+/**
+ * @brief Moves the flash log on from the main loop: programs pages, sends
+ *		  a download, ends a session that filled the chip as 'O' 0 would
+ *		  and answers 'O' once the edge stream runs again
+ * @retval 1 while a download owns USB and the loop pass
+ */
+static uint32_t capture_log_service(void)
+{
+	flash_log_poll();
+	if (flash_log_state == FLASH_LOG_SENDING)
+	{
+		// read the next piece while the last is on the wire
+		if (compact_queued == 0) compact_queued = flash_log_read(compact_packet[compact_sel], USB_TX_MAX_BYTES);
+		HAL_NVIC_DisableIRQ(USB_LP_CAN1_RX0_IRQn);
+		capture_tx_start(1);
+		HAL_NVIC_EnableIRQ(USB_LP_CAN1_RX0_IRQn);
+		return 1;
+	}
+	if (log_state_seen == FLASH_LOG_ERASING && flash_log_state != FLASH_LOG_ERASING) log_report_due = 1;
+	if (log_state_seen == FLASH_LOG_LOGGING && flash_log_state == FLASH_LOG_FULL)
+	{
+		stream_restart = 1;  // what the ring still holds is lost
+		log_report_due = 1;
+	}
+	log_state_seen = flash_log_state;
+	if (log_report_due && !stream_restart)
+	{
+		log_report_due = 0;
+		capture_log_report();
+	}
+	return 0;
+}
+#endif
+
+/* USER CODE END 0 */
+
+/**
+  * @brief  The application entry point.
+  * @retval int
+  */
+int main(void)
+{
+
+  /* USER CODE BEGIN 1 */
+#if DUAL_IMAGE
+  boot_slot_select();  // the polling firmware in slot B runs instead if 'J' asked for it
+#endif
+  /* USER CODE END 1 */
+
+  /* MCU Configuration--------------------------------------------------------*/
+
+  /* Reset of all peripherals, Initializes the Flash interface and the Systick. */
+  HAL_Init();
+
+  /* USER CODE BEGIN Init */
+
+  /* USER CODE END Init */
+
+  /* Configure the system clock */
+  SystemClock_Config();
+
+  /* USER CODE BEGIN SysInit */
+
+  /* USER CODE END SysInit */
+
+  /* Initialize all configured peripherals */
+  MX_GPIO_Init();
+  MX_TIM2_Init();
+  MX_TIM3_Init();
+  /* USER CODE BEGIN 2 */
+
+#if !CAPTURE_CLOCK_DWT
+  htim2.Init.Prescaler = clock_presets[CAPTURE_CLOCK_PRESET];  // MX_TIM2_Init keeps the .ioc's
+  TIM2->PSC = clock_presets[CAPTURE_CLOCK_PRESET];
+  TIM2->EGR = TIM_EGR_UG;
+#endif
+#if BOOT_CAPTURE
+  capture_boot_start();  // a stored preset captures the target's boot, before USB
+#endif
+#if CAPTURE_IC_DMA
+  capture_ic_init();  // armed before TIM2 so TIM4 starts on its first update
+#endif
+#if IRQ_TIMING
+  irq_timing_init();
+#endif
+#if TRIGGER_OUT
+  trigger_out_init();
+#endif
+#if LATENCY_PROBE
+  capture_latency_init();
+#endif
+#if RECORDER_INPUT
+  capture_button_init();
+#endif
+#if CAPTURE_CLOCK_DWT
+  CoreDebug->DEMCR |= CoreDebug_DEMCR_TRCENA_Msk;
+  DWT->CTRL |= DWT_CTRL_CYCCNTENA_Msk;
+#endif
+#if STREAM_FRAMED
+  stream_frame_init();
+#endif
+#if USB_BENCHMARK
+  capture_events_enable(0);  // the ring carries the pattern; 'R' 1 starts it
+#endif
+  HAL_TIM_Base_Start(&htim2);
+  HAL_TIM_Base_Start(&htim3);
+  // Called here, not by the generated init (.ioc): edges are timed from
+  // power-up, while enumeration and the host take seconds
+  MX_USB_DEVICE_Init();
+  irq_set_layout(IRQ_LAYOUT);  // after MX_USB_DEVICE_Init set the USB priority
+  capture_set_flush_policy(FLUSH_BATCH, EVENT_CHUNK_SIZE, USB_SEND_INTERVAL_US);
+#if FLASH_LOG
+  flash_log_init();
+#if FLASH_LOG_AUTOSTART
+  capture_set_flash_log(FLASH_LOG_START);  // an erased chip logs from power-up
+#endif
+#endif
+#if OLED_STATUS
+  oled_status_init();
+#endif
+
+  /* USER CODE END 2 */
+
+  /* Infinite loop */
+  /* USER CODE BEGIN WHILE */
+  while (1)
+  {
+
+	  host_cmd_process();
+	  if (requested_mode != capture_mode || stream_restart) capture_switch_mode();
+#if OLED_STATUS
+	  oled_status_poll(capture_mode, capture_running);  // one step at most, never waits
+#endif
+#if SOF_SYNC
+	  if (sof_pending) capture_send_sync();
+#endif
+	  if (capture_mode == CAPTURE_MODE_POLL)
+	  {
+		  if (capture_running)
+		  {
+			  uint32_t changes = poll_capture_run();  // one block per pass
+#if ADAPTIVE_CAPTURE
+			  if (adaptive) capture_adapt_poll(changes);
+#else
+			  (void)changes;
+#endif
+		  }
+		  continue;
+	  }
+
+	  uint32_t now = get_32bit_timer(); // timer ticks, for sub-ms latency bounds
+
+#if FLASH_LOG
+	  if (capture_log_service()) continue;
+#endif
+#if CAPTURE_IC_DMA
+	  capture_ic_drain();
+#endif
+#if CAPTURE_SPI_DMA
+	  spi_sniff_drain();
+#endif
+#if GLITCH_FILTER
+	  // Store held edges that outlived the minimum pulse width
+	  __disable_irq();
+	  glitch_poll(get_32bit_timer());
+	  __enable_irq();
+#endif
+#if STORM_LIMIT
+	  // Send the summaries of storm windows that have run their length
+	  __disable_irq();
+	  storm_poll(get_32bit_timer());
+	  __enable_irq();
+#endif
+#if CHANNEL_MEASURE
+	  // Send the channel summaries of a finished window
+	  __disable_irq();
+	  measure_poll(get_32bit_timer());
+	  __enable_irq();
+#endif
+#if BOARD_SYNC
+	  // Send the latest reference pulse
+	  __disable_irq();
+	  board_sync_poll();
+	  __enable_irq();
+#endif
+#if USB_BENCHMARK
+	  if (capture_running) bench_fill();
+#endif
+#if HOST_DTR_GATE
+	  capture_host_service();
+#endif
+#if RING_TRIGGER
+	  capture_trigger_service();
+#endif
+#if RECORDER_INPUT
+	  capture_button_poll(now);
+#endif
+
+#if ADAPTIVE_CAPTURE
+	  if (adaptive && capture_running && capture_adapt_events(now)) continue;
+#endif
+
+	  // a single load of each index: no IRQ masking (event_ring.h)
+	  uint32_t diff = ring_queued();
+#if HEALTH_REPORTS
+	  if (diff > health_ring_peak) health_ring_peak = diff;
+	  if (capture_running && now - health_last_time >= capture_clock_hz() / 1000 * HEALTH_REPORT_MS)
+	  {
+		  capture_send_health();
+	  }
+#endif
+#if LATENCY_PROBE
+	  if (latency_waiting) capture_latency_sent();
+	  else if (capture_running && now - latency_last_time >= capture_clock_hz() / 1000 * LATENCY_PROBE_MS)
+	  {
+		  capture_latency_toggle();
+	  }
+#endif
+#if LEVEL_SNAPSHOTS
+	  if (capture_running && (levels_due || dropped_total != levels_last_dropped ||
+		  now - levels_last_time >= capture_clock_hz() / 1000 * LEVEL_SNAPSHOT_MS))
+	  {
+		  capture_send_levels();
+	  }
+#endif
+
+#if STREAM_COMPACT && STREAM_FRAMED
+	  // The filled buffer goes out once its CRC is in, flush due or not
+	  if (compact_framing && stream_frame_done((StreamFrame *)compact_packet[compact_sel]))
+	  {
+		  compact_queued = compact_framing;
+		  compact_framing = 0;
+		  HAL_NVIC_DisableIRQ(USB_LP_CAN1_RX0_IRQn);
+		  capture_tx_start(1);
+		  HAL_NVIC_EnableIRQ(USB_LP_CAN1_RX0_IRQn);
+	  }
+#endif
+
+#if FLASH_LOG
+	  if (flash_log_state == FLASH_LOG_LOGGING)
+	  {
+		  capture_log_drain(0);  // the flash takes the stream instead of USB
+	  }
+	  else
+#endif
+	  // Back-to-back transfers are chained from the transmit-complete
+	  // callback; the loop only kicks the stream when the policy says so
+	  if (flush_due(diff, now - last_flush_time, usb_busy, TX_MAX_EVENTS)
+#if RING_TRIGGER
+		  && trigger_state != TRIGGER_ARMED
+#endif
+		  )
+	  {
+#if IRQ_TIMING
+		  uint32_t flush_start = DWT->CYCCNT;
+#endif
+#if STREAM_COMPACT
+		  // Fill the free buffer while the other one is on the wire
+		  if (compact_queued == 0 && (diff > 0 || compact_carry > 0)
+#if STREAM_FRAMED
+			  && compact_framing == 0
+#endif
+			  )
+		  {
+			  uint8_t *usb_packet = compact_packet[compact_sel] + COMPACT_FRAME_BYTES;
+			  uint32_t send = capture_compact_fill(usb_packet, USB_TX_MAX_BYTES);
+#if STREAM_FRAMED
+			  // The frame is built here, so transfers still chain from the
+			  // callback; its CRC pass runs on while the loop goes round
+			  stream_frame_begin((StreamFrame *)compact_packet[compact_sel], usb_packet, send, frame_offset);
+			  frame_offset += send;
+			  compact_framing = COMPACT_FRAME_BYTES + send;
+			  if (stream_frame_done((StreamFrame *)compact_packet[compact_sel]))
+			  {
+				  compact_queued = compact_framing;
+				  compact_framing = 0;
+			  }
+#else
+			  compact_queued = COMPACT_FRAME_BYTES + send;
+#endif
+		  }
+#endif
+		  HAL_NVIC_DisableIRQ(USB_LP_CAN1_RX0_IRQn);
+		  capture_tx_start(1);
+		  HAL_NVIC_EnableIRQ(USB_LP_CAN1_RX0_IRQn);
+#if IRQ_TIMING
+		  irq_timing_add(IRQ_TIMER_FLUSH, flush_start);
+#endif
+	  }
+
+#if !USB_BENCHMARK
+	  // Mark time field wraps even when no edges arrive
+	  __disable_irq();
+	  capture_check_epoch(get_32bit_timer());
+	  __enable_irq();
+#endif
+#if UART_DECODE
+	  // Finish a byte whose last bits brought no edge
+	  now = get_32bit_timer();
+	  __disable_irq();
+	  uart_decode_poll(now);
+	  __enable_irq();
+#endif
+#if ANALOG_CAPTURE
+	  analog_capture_drain();
+#endif
+#if FLOW_CREDIT
+	  capture_credit_poll();
+#endif
+#if UART_DECODE || I2C_SNIFF
+	  // Drop counts of a bus whose traffic is all filtered out
+	  now = get_32bit_timer();
+	  __disable_irq();
+#if UART_DECODE
+	  uart_decode_filter_poll(now, capture_clock_hz() / 1000 * FILTER_REPORT_MS);
+#endif
+#if I2C_SNIFF
+	  i2c_sniff_filter_poll(now, capture_clock_hz() / 1000 * FILTER_REPORT_MS);
+#endif
+	  __enable_irq();
+#endif
+#if MAIN_LOOP_SLEEP
+#if FLASH_LOG
+	  if (flash_log_state == FLASH_LOG_LOGGING && !flash_log_asleep()) continue;  // page programs end without an interrupt
+#endif
+	  capture_sleep();
+#endif
 
     /* USER CODE END WHILE */
 
@@ -382,6 +3376,7 @@ static void MX_GPIO_Init(void)
   HAL_NVIC_EnableIRQ(EXTI9_5_IRQn);
 
   /* USER CODE BEGIN MX_GPIO_Init_2 */
+  pin_map_init();
 
   /* USER CODE END MX_GPIO_Init_2 */
 }
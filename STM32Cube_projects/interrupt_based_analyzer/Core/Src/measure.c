@@ -0,0 +1,196 @@
+/**
+  ******************************************************************************
+  * @file           : measure.c
+  * @brief          : On-device frequency, duty cycle and edge count of probe
+  *                   channels
+  ******************************************************************************
+  * An edge costs a subtract and an add to the channel's high time and, on
+  * a rise, a count and a time. An edge that leaves the level where it was
+  * means the EXTI handler missed a pulse; it is counted as one rise. The
+  * main loop closes the window every window ticks (measure_poll).
+  ******************************************************************************
+  */
+
+#include "measure.h"
+#include "event_format.h"
+#include "pin_map.h"
+
+volatile uint32_t measure_mask = 0;
+
+static uint32_t timer_counting = 0;     // TIM4 counts CH2's rising edges
+static uint16_t timer_last;             // TIM4->CNT folded into timer_rises
+static uint32_t timer_rises;
+static uint32_t window;                 // summary window in ticks
+static uint32_t win_start;
+static uint32_t level[4];
+static uint32_t last_edge[4];
+static uint32_t rises[4];
+static uint32_t high[4];
+static uint32_t first_rise[4];
+static uint32_t last_rise[4];
+
+/**
+ * @brief Pushes one field of channel ch's summary
+ */
+static void measure_put(uint32_t time, uint32_t ch, uint32_t field, uint32_t value)
+{
+    uint32_t words[MARKER_BUS_WORDS] = {
+        time,
+        (value > MEASURE_MAX_TICKS ? MEASURE_MAX_TICKS : value)
+            | (field << 20) | (ch << 22) | (BUS_MEASURE << 24)
+    };
+    capture_push_record(event_pack_marker(MARKER_BUS, 0), words, MARKER_BUS_WORDS);
+}
+
+/**
+ * @brief Starts a window for every channel at time
+ */
+static void measure_restart(uint32_t time)
+{
+    uint32_t levels = pin_map_channels(GPIOB->IDR);
+
+    win_start = time;
+    for (uint32_t ch = 0; ch < 4; ch++)
+    {
+        level[ch] = (levels >> ch) & 1;
+        last_edge[ch] = time;
+        rises[ch] = high[ch] = 0;
+    }
+    timer_rises = 0;
+    timer_last = TIM4->CNT;
+}
+
+/**
+ * @brief Runs TIM4 from TI1FP1 (PB6) rising edges, external clock mode 1
+ */
+static void measure_timer_start(void)
+{
+    __HAL_RCC_TIM4_CLK_ENABLE();
+    TIM4->CR1 = 0;
+    TIM4->PSC = 0;
+    TIM4->ARR = 0xFFFF;
+    TIM4->CCMR1 = TIM_CCMR1_CC1S_0;  // IC1 on TI1, no filter
+    TIM4->CCER = 0;                  // rising edges
+    TIM4->SMCR = TIM_SMCR_TS_2 | TIM_SMCR_TS_0 | TIM_SMCR_SMS;  // TI1FP1 clocks the counter
+    TIM4->EGR = TIM_EGR_UG;
+    TIM4->CR1 = TIM_CR1_CEN;
+}
+
+static void measure_timer_stop(void)
+{
+    TIM4->CR1 = 0;
+    TIM4->SMCR = 0;
+    __HAL_RCC_TIM4_CLK_DISABLE();
+}
+
+/**
+ * @brief Selects the measured channels; called from the host command
+ *        parser (main loop)
+ * @param mask - bit n measures channel n, MEASURE_CH2_TIMER counts CH2
+ *        with TIM4; 0 streams every channel's edges again
+ * @param window_ticks - summary window in clock ticks, 1 to
+ *        MEASURE_MAX_TICKS
+ * @retval none
+ */
+void measure_configure(uint32_t mask, uint32_t window_ticks)
+{
+    uint32_t timer = CAPTURE_PINS_DEFAULT && (mask & MEASURE_CH2_TIMER);  // TIM4 counts PB6, channel 2 on V1 only
+
+    __disable_irq();
+    if (timer_counting && !timer) measure_timer_stop();
+    if (timer && !timer_counting) measure_timer_start();
+    timer_counting = timer;
+    measure_mask = mask & 0x0F & ~(timer ? 1UL << 2 : 0);
+    window = window_ticks;
+    measure_restart(get_32bit_timer());
+    __enable_irq();
+}
+
+/**
+ * @brief Adds one EXTI interrupt's edges to the measured channels'
+ *        counters; called from the EXTI ISR
+ * @param levels - CH1-CH4 levels after the edges, bit n = channel n
+ * @param changed - measured channels with an edge, bit n = channel n
+ * @param time - 32-bit clock time of the edges
+ * @retval none
+ */
+void measure_edges(uint32_t levels, uint32_t changed, uint32_t time)
+{
+    while (changed)
+    {
+        uint32_t ch = __CLZ(__RBIT(changed));  // lowest pending line
+        uint32_t now = (levels >> ch) & 1;
+
+        changed &= changed - 1;
+        if (level[ch]) high[ch] += time - last_edge[ch];
+        last_edge[ch] = time;
+        if (now || now == level[ch])  // a rise, or a pulse too short to see
+        {
+            if (rises[ch]++ == 0) first_rise[ch] = time;
+            last_rise[ch] = time;
+        }
+        level[ch] = now;
+    }
+}
+
+/**
+ * @brief Folds TIM4's count and, once the window has run its length,
+ *        sends every measured channel's summary; called from the main
+ *        loop with IRQs masked
+ * @param now - current 32-bit clock time
+ * @retval none
+ */
+void measure_poll(uint32_t now)
+{
+    uint32_t pending = measure_mask;
+    uint32_t length = now - win_start;
+
+    if (timer_counting)
+    {
+        uint16_t count = TIM4->CNT;
+
+        timer_rises += (uint16_t)(count - timer_last);
+        timer_last = count;
+    }
+    if (!(pending || timer_counting) || length < window) return;
+
+    while (pending)
+    {
+        uint32_t ch = __CLZ(__RBIT(pending));
+
+        pending &= pending - 1;
+        if (level[ch]) high[ch] += now - last_edge[ch];
+        last_edge[ch] = now;
+        measure_put(now, ch, MEASURE_FIELD_RISES, rises[ch]);
+        measure_put(now, ch, MEASURE_FIELD_HIGH, high[ch]);
+        measure_put(now, ch, MEASURE_FIELD_SPAN, rises[ch] > 1 ? last_rise[ch] - first_rise[ch] : 0);
+        measure_put(now, ch, MEASURE_FIELD_WINDOW, length);
+        rises[ch] = high[ch] = 0;
+    }
+    if (timer_counting)
+    {
+        measure_put(now, 2, MEASURE_FIELD_RISES, timer_rises);
+        measure_put(now, 2, MEASURE_FIELD_WINDOW, length);
+        timer_rises = 0;
+    }
+    win_start = now;
+}
+
+/**
+ * @brief Restarts the windows with the ring their summaries were headed
+ *        for; called with IRQs masked
+ * @retval none
+ */
+void measure_reset(void)
+{
+    measure_restart(get_32bit_timer());
+}
+
+/**
+ * @brief EXTI lines of the channels TIM4 counts, kept off
+ * @retval CH2_Pin while counting, else 0
+ */
+uint32_t measure_lines(void)
+{
+    return timer_counting ? CH2_Pin : 0;
+}
@@ -0,0 +1,327 @@
+/**
+  ******************************************************************************
+  * @file           : oled_status.c
+  * @brief          : Live status on a 128x64 I2C OLED
+  ******************************************************************************
+  * I2C2 runs as master in fast mode with no interrupt. A transfer is the
+  * START, the address, then the bytes by DMA1 channel 4 and a STOP once
+  * the last byte has left the shift register (BTF); oled_step moves it on
+  * by the flags each time the main loop comes round. An address NACK, a
+  * bus error or a transfer that outlasts OLED_TIMEOUT_MS resets the
+  * peripheral and drops the frame; the next one starts afresh.
+  ******************************************************************************
+  */
+
+#include "oled_status.h"
+#include "event_ring.h"
+
+#define OLED_TIMEOUT_MS   20            // a transfer longer than this is stuck
+#define OLED_CONTROL_CMD  0x00          // control byte: command bytes follow
+#define OLED_CONTROL_DATA 0x40          // control byte: display RAM bytes follow
+
+#define OLED_IDLE         0
+#define OLED_WAIT_START   1
+#define OLED_WAIT_ADDRESS 2
+#define OLED_WAIT_DATA    3
+#define OLED_ABSENT       4
+
+/* SSD1306 set-up; an SSD1309 takes the same bytes and ignores the charge
+ * pump. Horizontal addressing: a frame's pages follow one another */
+static const uint8_t oled_setup[] = {
+    OLED_CONTROL_CMD,
+    0xAE,               // display off
+    0xD5, 0x80,         // clock divide
+    0xA8, 0x3F,         // 64 rows
+    0xD3, 0x00,         // no vertical offset
+    0x40,               // start line 0
+    0x8D, 0x14,         // charge pump on
+    0x20, 0x00,         // horizontal addressing
+    0xA1, 0xC8,         // column 127 and row 63 at the origin: not mirrored
+    0xDA, 0x12,         // alternative COM pins
+    0x81, 0xCF,         // contrast
+    0xD9, 0xF1,         // pre-charge
+    0xDB, 0x40,         // VCOMH
+    0xA4, 0xA6,         // show the RAM, not inverted
+    0xAF,               // display on
+};
+
+/* A frame starts at the top left */
+static const uint8_t oled_home[] = {
+    OLED_CONTROL_CMD, 0x21, 0, OLED_WIDTH - 1, 0x22, 0, OLED_PAGES - 1
+};
+
+/* 5x7 characters 0x20-0x7E, one byte per column, top pixel in bit 0 */
+static const uint8_t oled_font[][5] = {
+    {0x00,0x00,0x00,0x00,0x00}, {0x00,0x00,0x5F,0x00,0x00}, {0x00,0x07,0x00,0x07,0x00}, {0x14,0x7F,0x14,0x7F,0x14},
+    {0x24,0x2A,0x7F,0x2A,0x12}, {0x23,0x13,0x08,0x64,0x62}, {0x36,0x49,0x55,0x22,0x50}, {0x00,0x05,0x03,0x00,0x00},
+    {0x00,0x1C,0x22,0x41,0x00}, {0x00,0x41,0x22,0x1C,0x00}, {0x08,0x2A,0x1C,0x2A,0x08}, {0x08,0x08,0x3E,0x08,0x08},
+    {0x00,0x50,0x30,0x00,0x00}, {0x08,0x08,0x08,0x08,0x08}, {0x00,0x60,0x60,0x00,0x00}, {0x20,0x10,0x08,0x04,0x02},
+    {0x3E,0x51,0x49,0x45,0x3E}, {0x00,0x42,0x7F,0x40,0x00}, {0x42,0x61,0x51,0x49,0x46}, {0x21,0x41,0x45,0x4B,0x31},
+    {0x18,0x14,0x12,0x7F,0x10}, {0x27,0x45,0x45,0x45,0x39}, {0x3C,0x4A,0x49,0x49,0x30}, {0x01,0x71,0x09,0x05,0x03},
+    {0x36,0x49,0x49,0x49,0x36}, {0x06,0x49,0x49,0x29,0x1E}, {0x00,0x36,0x36,0x00,0x00}, {0x00,0x56,0x36,0x00,0x00},
+    {0x08,0x14,0x22,0x41,0x00}, {0x14,0x14,0x14,0x14,0x14}, {0x00,0x41,0x22,0x14,0x08}, {0x02,0x01,0x51,0x09,0x06},
+    {0x32,0x49,0x79,0x41,0x3E}, {0x7E,0x11,0x11,0x11,0x7E}, {0x7F,0x49,0x49,0x49,0x36}, {0x3E,0x41,0x41,0x41,0x22},
+    {0x7F,0x41,0x41,0x22,0x1C}, {0x7F,0x49,0x49,0x49,0x41}, {0x7F,0x09,0x09,0x09,0x01}, {0x3E,0x41,0x49,0x49,0x7A},
+    {0x7F,0x08,0x08,0x08,0x7F}, {0x00,0x41,0x7F,0x41,0x00}, {0x20,0x40,0x41,0x3F,0x01}, {0x7F,0x08,0x14,0x22,0x41},
+    {0x7F,0x40,0x40,0x40,0x40}, {0x7F,0x02,0x0C,0x02,0x7F}, {0x7F,0x04,0x08,0x10,0x7F}, {0x3E,0x41,0x41,0x41,0x3E},
+    {0x7F,0x09,0x09,0x09,0x06}, {0x3E,0x41,0x51,0x21,0x5E}, {0x7F,0x09,0x19,0x29,0x46}, {0x46,0x49,0x49,0x49,0x31},
+    {0x01,0x01,0x7F,0x01,0x01}, {0x3F,0x40,0x40,0x40,0x3F}, {0x1F,0x20,0x40,0x20,0x1F}, {0x3F,0x40,0x38,0x40,0x3F},
+    {0x63,0x14,0x08,0x14,0x63}, {0x07,0x08,0x70,0x08,0x07}, {0x61,0x51,0x49,0x45,0x43}, {0x00,0x7F,0x41,0x41,0x00},
+    {0x02,0x04,0x08,0x10,0x20}, {0x00,0x41,0x41,0x7F,0x00}, {0x04,0x02,0x01,0x02,0x04}, {0x40,0x40,0x40,0x40,0x40},
+    {0x00,0x01,0x02,0x04,0x00}, {0x20,0x54,0x54,0x54,0x78}, {0x7F,0x48,0x44,0x44,0x38}, {0x38,0x44,0x44,0x44,0x20},
+    {0x38,0x44,0x44,0x48,0x7F}, {0x38,0x54,0x54,0x54,0x18}, {0x08,0x7E,0x09,0x01,0x02}, {0x0C,0x52,0x52,0x52,0x3E},
+    {0x7F,0x08,0x04,0x04,0x78}, {0x00,0x44,0x7D,0x40,0x00}, {0x20,0x40,0x44,0x3D,0x00}, {0x7F,0x10,0x28,0x44,0x00},
+    {0x00,0x41,0x7F,0x40,0x00}, {0x7C,0x04,0x18,0x04,0x78}, {0x7C,0x08,0x04,0x04,0x78}, {0x38,0x44,0x44,0x44,0x38},
+    {0x7C,0x14,0x14,0x14,0x08}, {0x08,0x14,0x14,0x18,0x7C}, {0x7C,0x08,0x04,0x04,0x08}, {0x48,0x54,0x54,0x54,0x20},
+    {0x04,0x3F,0x44,0x40,0x20}, {0x3C,0x40,0x40,0x20,0x7C}, {0x1C,0x20,0x40,0x20,0x1C}, {0x3C,0x40,0x30,0x40,0x3C},
+    {0x44,0x28,0x10,0x28,0x44}, {0x0C,0x50,0x50,0x50,0x3C}, {0x44,0x64,0x54,0x4C,0x44}, {0x00,0x08,0x36,0x41,0x00},
+    {0x00,0x00,0x7F,0x00,0x00}, {0x00,0x41,0x36,0x08,0x00}, {0x08,0x04,0x08,0x10,0x08},
+};
+
+static char text[OLED_PAGES][OLED_COLUMNS];   // the frame being sent
+static uint8_t page[1 + OLED_WIDTH];         // control byte and one rendered line
+static volatile uint8_t uart_text[OLED_UART_BYTES];   // written by the EXTI handler
+static volatile uint32_t uart_count = 0;
+
+static uint32_t state = OLED_ABSENT;
+static uint32_t step_time;          // HAL_GetTick when the transfer started
+static const uint8_t *tx_buf;
+static uint32_t tx_len;
+static uint32_t frame_next = 0;     // next transfer of the frame, 0 = none under way
+static uint32_t frame_time;         // HAL_GetTick of the last frame
+static uint32_t last_write;         // write_index then
+static uint32_t last_dropped;       // dropped_total then
+static uint32_t ring_peak;          // most ring words queued since then
+
+/**
+ * @brief Sets up I2C2 at 400 kHz and clears a transfer in progress
+ */
+static void oled_i2c_setup(void)
+{
+    I2C2->CR1 = I2C_CR1_SWRST;
+    I2C2->CR1 = 0;
+    I2C2->CR2 = HAL_RCC_GetPCLK1Freq() / 1000000;               // 36 MHz
+    I2C2->CCR = I2C_CCR_FS | HAL_RCC_GetPCLK1Freq() / (3 * 400000);   // Tlow = 2 Thigh
+    I2C2->TRISE = HAL_RCC_GetPCLK1Freq() / 1000000 * 300 / 1000 + 1;   // 300 ns
+    I2C2->CR1 = I2C_CR1_PE;
+    DMA1_Channel4->CCR = 0;
+    DMA1->IFCR = DMA_IFCR_CGIF4;
+}
+
+/**
+ * @brief Starts a transfer of len bytes of buf to the display
+ */
+static void oled_begin(const uint8_t *buf, uint32_t len)
+{
+    tx_buf = buf;
+    tx_len = len;
+    step_time = HAL_GetTick();
+    state = OLED_WAIT_START;
+    I2C2->CR1 |= I2C_CR1_START;
+}
+
+/**
+ * @brief Moves the transfer on by one step if its flags allow; never
+ *        waits
+ * @retval 0 if the transfer failed
+ */
+static uint32_t oled_step(void)
+{
+    uint32_t sr1 = I2C2->SR1;
+
+    if ((sr1 & (I2C_SR1_AF | I2C_SR1_BERR | I2C_SR1_ARLO)) || HAL_GetTick() - step_time > OLED_TIMEOUT_MS)
+    {
+        oled_i2c_setup();
+        state = OLED_IDLE;
+        frame_next = 0;
+        return 0;
+    }
+    switch (state)
+    {
+    case OLED_WAIT_START:
+        if (!(sr1 & I2C_SR1_SB)) break;
+        I2C2->DR = OLED_ADDRESS << 1;
+        state = OLED_WAIT_ADDRESS;
+        break;
+    case OLED_WAIT_ADDRESS:
+        if (!(sr1 & I2C_SR1_ADDR)) break;
+        DMA1_Channel4->CPAR = (uint32_t)&I2C2->DR;
+        DMA1_Channel4->CMAR = (uint32_t)tx_buf;
+        DMA1_Channel4->CNDTR = tx_len;
+        DMA1_Channel4->CCR = DMA_CCR_DIR | DMA_CCR_MINC | DMA_CCR_EN;   // priority low
+        I2C2->CR2 |= I2C_CR2_DMAEN;
+        (void)I2C2->SR2;   // clears ADDR: the DMA takes over
+        state = OLED_WAIT_DATA;
+        break;
+    case OLED_WAIT_DATA:
+        if (!(DMA1->ISR & DMA_ISR_TCIF4) || !(sr1 & I2C_SR1_BTF)) break;
+        I2C2->CR1 |= I2C_CR1_STOP;
+        I2C2->CR2 &= ~I2C_CR2_DMAEN;
+        DMA1_Channel4->CCR = 0;
+        DMA1->IFCR = DMA_IFCR_CGIF4;
+        state = OLED_IDLE;
+        break;
+    }
+    return 1;
+}
+
+/**
+ * @brief Writes s into a text line from column col
+ */
+static void text_put(uint32_t line, uint32_t col, const char *s)
+{
+    while (*s && col < OLED_COLUMNS) text[line][col++] = *s++;
+}
+
+/**
+ * @brief Writes value right-aligned, ending before column end
+ */
+static void text_number(uint32_t line, uint32_t end, uint32_t value)
+{
+    do
+    {
+        text[line][--end] = '0' + value % 10;
+        value /= 10;
+    } while (value && end);
+}
+
+/**
+ * @brief Fills the text of a frame; ms since the last one
+ */
+static void oled_text(uint32_t mode, uint32_t running, uint32_t ms)
+{
+    uint32_t written = write_index;
+    uint32_t dropped = dropped_total;
+    uint32_t count = uart_count;
+
+    for (uint32_t line = 0; line < OLED_PAGES; line++)
+    {
+        for (uint32_t col = 0; col < OLED_COLUMNS; col++) text[line][col] = ' ';
+    }
+    text_put(0, 0, mode == CAPTURE_MODE_POLL ? "POLL" : "EDGES");
+    text_put(0, 14, running ? "RUN" : "STOPPED");
+    text_put(1, 0, "words/s");
+    text_number(1, OLED_COLUMNS, ms ? (uint32_t)((uint64_t)(written - last_write) * 1000 / ms) : 0);
+    text_put(2, 0, "dropped");
+    text_number(2, OLED_COLUMNS, dropped);
+    text_put(3, 0, " lately");
+    text_number(3, OLED_COLUMNS, dropped - last_dropped);
+    text_put(4, 0, "ring     %  peak    %");
+    text_number(4, 9, (uint32_t)((uint64_t)ring_queued() * 100 / MAX_EVENTS));
+    text_number(4, 20, (uint32_t)((uint64_t)ring_peak * 100 / MAX_EVENTS));
+    text_put(5, 0, "UART bytes");
+    text_number(5, OLED_COLUMNS, count);
+
+    // the latest bytes, oldest first, over the last two lines
+    uint32_t shown = count < 2 * OLED_COLUMNS ? count : 2 * OLED_COLUMNS;
+    for (uint32_t i = 0; i < shown; i++)
+    {
+        uint32_t at = 2 * OLED_COLUMNS - shown + i;
+        text[6 + at / OLED_COLUMNS][at % OLED_COLUMNS] = uart_text[(count - shown + i) & (OLED_UART_BYTES - 1)];
+    }
+
+    last_write = written;
+    last_dropped = dropped;
+    ring_peak = 0;
+}
+
+/**
+ * @brief Renders one text line into the page buffer
+ */
+static void oled_render(uint32_t line)
+{
+    uint8_t *out = page;
+
+    *out++ = OLED_CONTROL_DATA;
+    for (uint32_t col = 0; col < OLED_COLUMNS; col++)
+    {
+        uint32_t c = (uint8_t)text[line][col];
+        const uint8_t *glyph = oled_font[c >= 0x20 && c < 0x7F ? c - 0x20 : '?' - 0x20];
+        for (uint32_t x = 0; x < 5; x++) *out++ = glyph[x];
+        *out++ = 0;
+    }
+    while (out < page + sizeof(page)) *out++ = 0;
+}
+
+/**
+ * @brief Sets up I2C2, its pins and the display; called once at start-up.
+ *        Waits for the set-up bytes, under a millisecond
+ * @retval none
+ */
+void oled_status_init(void)
+{
+    GPIO_InitTypeDef gpio = {0};
+
+    __HAL_RCC_GPIOB_CLK_ENABLE();
+    __HAL_RCC_I2C2_CLK_ENABLE();
+    __HAL_RCC_DMA1_CLK_ENABLE();
+    gpio.Pin = GPIO_PIN_10 | GPIO_PIN_11;  // SCL, SDA
+    gpio.Mode = GPIO_MODE_AF_OD;
+    gpio.Speed = GPIO_SPEED_FREQ_HIGH;
+    HAL_GPIO_Init(GPIOB, &gpio);
+
+    oled_i2c_setup();
+    oled_begin(oled_setup, sizeof(oled_setup));
+    while (state != OLED_IDLE)
+    {
+        if (!oled_step())
+        {
+            state = OLED_ABSENT;   // nothing acknowledged the address
+            return;
+        }
+    }
+    frame_time = HAL_GetTick();
+    last_write = write_index;
+    last_dropped = dropped_total;
+}
+
+/**
+ * @brief Moves the display on by at most one step: a step of the
+ *        transfer under way, the next page of the frame or a new frame;
+ *        called from the main loop on every pass
+ * @param mode - CAPTURE_MODE_* of the engine
+ * @param running - capturing, not stopped by 'R'
+ * @retval none
+ */
+void oled_status_poll(uint32_t mode, uint32_t running)
+{
+    uint32_t queued = ring_queued();
+    if (queued > ring_peak) ring_peak = queued;
+
+    if (state == OLED_ABSENT) return;
+    if (state != OLED_IDLE)
+    {
+        oled_step();
+        return;
+    }
+    if (I2C2->CR1 & I2C_CR1_STOP) return;   // the last STOP is still on the bus
+
+    if (frame_next == 0)
+    {
+        uint32_t now = HAL_GetTick();
+        if (now - frame_time < OLED_REFRESH_MS || queued > MAX_EVENTS / 4) return;
+        oled_text(mode, running, now - frame_time);
+        frame_time = now;
+        frame_next = 1;
+        oled_begin(oled_home, sizeof(oled_home));
+        return;
+    }
+    oled_render(frame_next - 1);
+    frame_next = frame_next == OLED_PAGES ? 0 : frame_next + 1;
+    oled_begin(page, sizeof(page));
+}
+
+/**
+ * @brief Keeps a byte the UART decoder completed for the display; called
+ *        from the EXTI handler (uart_emit)
+ * @param value - the byte
+ * @param status - UART_STATUS_* flags, a bad frame shows as '?'
+ * @retval none
+ */
+void oled_status_uart(uint32_t value, uint32_t status)
+{
+    uint32_t count = uart_count;
+
+    uart_text[count & (OLED_UART_BYTES - 1)] = status ? '?' : (value >= 0x20 && value < 0x7F ? value : '.');
+    uart_count = count + 1;
+}
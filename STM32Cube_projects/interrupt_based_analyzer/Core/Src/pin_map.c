@@ -0,0 +1,174 @@
+/**
+  ******************************************************************************
+  * @file           : pin_map.c
+  * @brief          : Channel-to-pin lookup tables of the capture paths
+  ******************************************************************************
+  * The tables live in SRAM next to the RAM_HOT_PATHS handlers that read
+  * them; 544 bytes buy a lookup with no flash wait states and no
+  * per-board code in the ISR.
+  ******************************************************************************
+  */
+
+#include "pin_map.h"
+
+uint8_t pin_map_low[256];
+uint8_t pin_map_high[256];
+uint16_t pin_map_line[16];
+
+static const uint8_t channel_pins[4] = {
+    CAPTURE_PIN_CH0, CAPTURE_PIN_CH1, CAPTURE_PIN_CH2, CAPTURE_PIN_CH3
+};
+
+static const IRQn_Type channel_irqs[] = {
+#if CAPTURE_EXTI_LINES & 0x0010
+    EXTI4_IRQn,
+#endif
+#if CAPTURE_EXTI_LINES & 0x03E0
+    EXTI9_5_IRQn,
+#endif
+#if CAPTURE_EXTI_LINES & 0xFC00
+    EXTI15_10_IRQn,
+#endif
+};
+static uint32_t held_irqs = 0;          // bit i: pin_map_irqs_hold masked channel_irqs[i]
+
+/**
+ * @brief Builds the lookup tables from CAPTURE_PIN_CH0..3 and moves the
+ *		  probe pins off the CubeMX defaults when the board's differ;
+ *		  called from MX_GPIO_Init before any EXTI line is unmasked
+ * @retval none
+ */
+void pin_map_init(void)
+{
+    for (uint32_t v = 0; v < 256; v++)
+    {
+    	uint8_t low = 0, high = 0;
+    	for (uint32_t ch = 0; ch < 4; ch++)
+    	{
+    		uint32_t pin = channel_pins[ch];
+    		if (pin < 8) low |= ((v >> pin) & 1) << ch;
+    		else high |= ((v >> (pin - 8)) & 1) << ch;
+    	}
+    	pin_map_low[v] = low;
+    	pin_map_high[v] = high;
+    }
+    for (uint32_t mask = 0; mask < 16; mask++)
+    {
+    	uint16_t lines = 0;
+    	for (uint32_t ch = 0; ch < 4; ch++)
+    	{
+    		if (mask & (1UL << ch)) lines |= 1U << channel_pins[ch];
+    	}
+    	pin_map_line[mask] = lines;
+    }
+
+    uint32_t unused = (CH4_Pin | CH3_Pin | CH2_Pin | CH1_Pin) & ~CAPTURE_EXTI_LINES;
+    if (unused == 0) return;  // the CubeMX pins are the board's
+
+    GPIO_InitTypeDef GPIO_InitStruct = {0};
+    HAL_GPIO_DeInit(GPIOB, unused);
+    GPIO_InitStruct.Pin = CAPTURE_EXTI_LINES;
+    GPIO_InitStruct.Mode = GPIO_MODE_IT_RISING_FALLING;
+    GPIO_InitStruct.Pull = GPIO_NOPULL;
+    HAL_GPIO_Init(GPIOB, &GPIO_InitStruct);
+    pin_map_irq_priority(0);
+    pin_map_irqs(1);
+}
+
+/**
+ * @brief Enables (pending edges cleared first) or disables the EXTI
+ *		  vectors the probe pins raise
+ * @param enable - 1 to take edges, 0 to ignore them
+ * @retval none
+ */
+void pin_map_irqs(uint32_t enable)
+{
+    if (enable)
+    {
+#if CAPTURE_EXTI_LINES & 0x0010
+    	HAL_NVIC_ClearPendingIRQ(EXTI4_IRQn);
+    	HAL_NVIC_EnableIRQ(EXTI4_IRQn);
+#endif
+#if CAPTURE_EXTI_LINES & 0x03E0
+    	HAL_NVIC_ClearPendingIRQ(EXTI9_5_IRQn);
+    	HAL_NVIC_EnableIRQ(EXTI9_5_IRQn);
+#endif
+#if CAPTURE_EXTI_LINES & 0xFC00
+    	HAL_NVIC_ClearPendingIRQ(EXTI15_10_IRQn);
+    	HAL_NVIC_EnableIRQ(EXTI15_10_IRQn);
+#endif
+    }
+    else
+    {
+#if CAPTURE_EXTI_LINES & 0x0010
+    	HAL_NVIC_DisableIRQ(EXTI4_IRQn);
+#endif
+#if CAPTURE_EXTI_LINES & 0x03E0
+    	HAL_NVIC_DisableIRQ(EXTI9_5_IRQn);
+#endif
+#if CAPTURE_EXTI_LINES & 0xFC00
+    	HAL_NVIC_DisableIRQ(EXTI15_10_IRQn);
+#endif
+    }
+}
+
+/**
+ * @brief Masks the enabled EXTI vectors of the probe pins, or unmasks
+ *		  the ones it masked. Unlike pin_map_irqs the pending edges are
+ *		  kept: an edge that arrives while held is taken on release
+ * @param hold - 1 to hold the edges, 0 to release them
+ * @retval none
+ */
+void pin_map_irqs_hold(uint32_t hold)
+{
+    for (uint32_t i = 0; i < sizeof channel_irqs / sizeof channel_irqs[0]; i++)
+    {
+    	if (hold && NVIC_GetEnableIRQ(channel_irqs[i]))
+    	{
+    		NVIC_DisableIRQ(channel_irqs[i]);
+    		held_irqs |= 1UL << i;
+    	}
+    	else if (!hold && (held_irqs & (1UL << i)))
+    	{
+    		NVIC_EnableIRQ(channel_irqs[i]);
+    	}
+    }
+    if (!hold) held_irqs = 0;
+}
+
+/**
+ * @brief Sets the preemption priority of the probe pins' EXTI vectors
+ * @param priority - 0 (highest) to 15
+ * @retval none
+ */
+void pin_map_irq_priority(uint32_t priority)
+{
+#if CAPTURE_EXTI_LINES & 0x0010
+    HAL_NVIC_SetPriority(EXTI4_IRQn, priority, 0);
+#endif
+#if CAPTURE_EXTI_LINES & 0x03E0
+    HAL_NVIC_SetPriority(EXTI9_5_IRQn, priority, 0);
+#endif
+#if CAPTURE_EXTI_LINES & 0xFC00
+    HAL_NVIC_SetPriority(EXTI15_10_IRQn, priority, 0);
+#endif
+}
+
+/**
+ * @brief Whether a probe pin's EXTI vector waits for the CPU
+ * @retval nonzero while one is pending
+ */
+uint32_t pin_map_irq_pending(void)
+{
+    uint32_t pending = 0;
+#if CAPTURE_EXTI_LINES & 0x0010
+    pending |= NVIC_GetPendingIRQ(EXTI4_IRQn);
+#endif
+#if CAPTURE_EXTI_LINES & 0x03E0
+    pending |= NVIC_GetPendingIRQ(EXTI9_5_IRQn);
+#endif
+#if CAPTURE_EXTI_LINES & 0xFC00
+    pending |= NVIC_GetPendingIRQ(EXTI15_10_IRQn);
+#endif
+    return pending;
+}
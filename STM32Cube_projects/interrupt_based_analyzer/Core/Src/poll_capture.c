@@ -0,0 +1,330 @@
+/**
+  ******************************************************************************
+  * @file           : poll_capture.c
+  * @brief          : Paced polling capture engine of the combined image
+  ******************************************************************************
+  * Mirrors the CPU-paced path of polling_based_analyzer/Core/Src/main.c;
+  * keep the block layout of both in step.
+  ******************************************************************************
+  */
+
+#include "poll_capture.h"
+#include "pin_map.h"
+#include "usbd_cdc_if.h"
+#include <string.h>
+
+/* Sample i was taken at start + i * period, plus the late cycles of its
+ * fixup if it has one */
+typedef struct
+{
+    uint16_t magic;     // POLL_BLOCK_MAGIC, lets the host resync
+    uint16_t count;     // samples in data
+    uint32_t start;     // DWT->CYCCNT of the first sample
+    uint32_t end;       // DWT->CYCCNT of the last sample
+    uint32_t period;    // CPU cycles between samples
+    uint8_t mask;       // sampled channels, bit n = channel n
+    uint8_t bits;       // bits per packed sample: 1, 2 or 4
+    uint16_t fixups;    // PollFixup entries after the data
+} PollHeader;
+
+typedef struct
+{
+    uint16_t index;     // sample index in the block
+    uint16_t late;      // cycles after start + index * period
+} PollFixup;
+
+/* Packed samples, earliest in the low bits of each byte, zero-padded to
+ * a word, then the fixups */
+typedef struct
+{
+    PollHeader header;
+    uint8_t data[POLL_BLOCK_DATA + 3 + POLL_BLOCK_FIXUPS * sizeof(PollFixup)];
+} PollBlock;
+
+static PollBlock *blocks[2];            // in the event ring while polling
+static uint32_t fill_sel = 0;           // block the sampler is filling
+static volatile uint8_t block_full = 0; // that block waits for USB
+static volatile uint8_t tx_in_flight = 0;
+static uint32_t full_bytes = 0;         // data bytes of the full block
+volatile uint32_t poll_stalls = 0;      // times the sampler lapped USB and waited
+
+static uint32_t sample_period = POLL_DEFAULT_PERIOD;
+static uint32_t block_samples;
+static uint8_t channel_mask = 0x0F;
+static uint8_t sample_bits = 4;
+static uint8_t pack_lut[16];            // channel levels -> masked channels, compacted
+static uint32_t next_sample;            // CYCCNT of the next sample
+#if ADAPTIVE_CAPTURE
+static uint32_t last_sample = 0;        // packed levels of the latest sample
+#endif
+
+static volatile uint8_t config_pending = 0;
+static uint32_t pending_rate;
+static uint8_t pending_mask;
+static uint32_t pending_samples;
+
+static PollFixup fixups[POLL_BLOCK_FIXUPS];
+static uint32_t fixup_count;
+
+/**
+ * @brief Hands the full block to USB and moves the sampler to the other
+ *        one; runs in the transmit-complete callback, or from the main
+ *        loop with the USB interrupt masked
+ */
+static void poll_swap(void)
+{
+    if (!block_full) return;
+    if (CDC_Transmit_FS((uint8_t *)blocks[fill_sel], sizeof(PollHeader) + full_bytes) != USBD_OK) return;
+    tx_in_flight = 1;
+    fill_sel ^= 1;
+    block_full = 0;
+}
+
+/**
+ * @brief Called through capture_tx_complete() while polling, once the
+ *        block in flight may be reused
+ * @retval none
+ */
+void poll_capture_tx_complete(void)
+{
+    tx_in_flight = 0;
+    poll_swap();
+}
+
+static void poll_kick(void)
+{
+    HAL_NVIC_DisableIRQ(USB_LP_CAN1_RX0_IRQn);
+    if (!tx_in_flight) poll_swap();
+    HAL_NVIC_EnableIRQ(USB_LP_CAN1_RX0_IRQn);
+}
+
+/**
+ * @brief Queues the sampler's block; waits while both blocks are taken,
+ *        leaving a gap in the capture
+ */
+static void poll_queue(uint32_t bytes)
+{
+    full_bytes = bytes;
+    block_full = 1;
+    poll_kick();
+
+    if (block_full)
+    {
+        poll_stalls++;
+        while (block_full) poll_kick();
+    }
+}
+
+/**
+ * @brief Requests new polling settings; they apply from the next block.
+ *        Called by the host command parser
+ * @param rate_hz - sample rate, 0 keeps the current one
+ * @param mask - channels to sample (bit n = CH n+1), 0 selects all
+ * @param samples - samples per block, 0 selects the largest that fits
+ * @retval none
+ */
+void poll_configure(uint32_t rate_hz, uint32_t mask, uint32_t samples)
+{
+    pending_rate = rate_hz;
+    pending_mask = mask & 0x0F;
+    pending_samples = samples;
+    config_pending = 1;
+}
+
+static void poll_apply_config(void)
+{
+    config_pending = 0;
+    channel_mask = pending_mask ? pending_mask : 0x0F;
+
+    uint32_t channels = __builtin_popcount(channel_mask);
+    sample_bits = channels == 1 ? 1 : channels == 2 ? 2 : 4;
+    for (uint32_t v = 0; v < 16; v++)
+    {
+        uint8_t packed = 0;
+        uint32_t bit = 0;
+        for (uint32_t ch = 0; ch < 4; ch++)
+        {
+            if (channel_mask & (1 << ch)) packed |= ((v >> ch) & 1) << bit++;
+        }
+        pack_lut[v] = packed;
+    }
+
+    uint32_t max = POLL_BLOCK_DATA * (8 / sample_bits);
+    block_samples = pending_samples;
+    if (block_samples == 0 || block_samples > max) block_samples = max;
+
+    if (pending_rate)
+    {
+        sample_period = (SystemCoreClock + pending_rate / 2) / pending_rate;
+        if (sample_period < POLL_MIN_PERIOD) sample_period = POLL_MIN_PERIOD;
+    }
+}
+
+/**
+ * @brief Takes over memory for the two block buffers and starts the DWT
+ *        cycle counter; the caller has parked the edge engine and no
+ *        transfer from that memory is in flight
+ * @param mem - word-aligned buffer memory (the idle event ring)
+ * @param bytes - its size
+ * @retval 1 on success, 0 if the blocks do not fit
+ */
+uint32_t poll_capture_start(void *mem, uint32_t bytes)
+{
+    if (bytes < 2 * sizeof(PollBlock)) return 0;
+    blocks[0] = (PollBlock *)mem;
+    blocks[1] = blocks[0] + 1;
+    fill_sel = 0;
+    block_full = 0;
+    tx_in_flight = 0;
+
+    CoreDebug->DEMCR |= CoreDebug_DEMCR_TRCENA_Msk;
+    DWT->CTRL |= DWT_CTRL_CYCCNTENA_Msk;
+    next_sample = DWT->CYCCNT;
+
+    // settings sent while the edge engine ran are still pending
+    if (!config_pending) poll_configure(0, channel_mask, block_samples);
+    return 1;
+}
+
+/**
+ * @brief Queues one block of raw words between sample blocks: count =
+ *        words, bits 0, no fixups
+ */
+static void poll_send_words(uint16_t magic, const uint32_t *words, uint32_t count)
+{
+    PollBlock *block = blocks[fill_sel];
+    uint32_t now = DWT->CYCCNT;
+
+    block->header.magic = magic;
+    block->header.count = count;
+    block->header.start = now;
+    block->header.end = now;
+    block->header.period = sample_period;
+    block->header.mask = channel_mask;
+    block->header.bits = 0;
+    block->header.fixups = 0;
+    memcpy(block->data, words, count * 4);
+    poll_queue(count * 4);
+}
+
+/**
+ * @brief Queues one POLL_BLOCK_MAGIC_INFO block between sample blocks
+ * @param words - payload words
+ * @param count - number of words, at most POLL_BLOCK_DATA / 4
+ * @retval none
+ */
+void poll_capture_send_info(const uint32_t *words, uint32_t count)
+{
+    poll_send_words(POLL_BLOCK_MAGIC_INFO, words, count);
+}
+
+/**
+ * @brief Queues the POLL_BLOCK_MAGIC_HEADER block a poll stream starts with
+ * @param words - the StreamHeader's words
+ * @param count - number of words
+ * @retval none
+ */
+void poll_capture_send_header(const uint32_t *words, uint32_t count)
+{
+    poll_send_words(POLL_BLOCK_MAGIC_HEADER, words, count);
+}
+
+/**
+ * @brief Queues the POLL_BLOCK_MAGIC_HANDOFF block of an 'M' 2 engine
+ *        change: the edge clock time and DWT->CYCCNT read together, and
+ *        the engine that runs from there. Right behind the poll
+ *        stream's header it lets the host put samples on the edge
+ *        clock; as the last block it ends the poll stream
+ * @param words - payload words
+ * @param count - POLL_HANDOFF_WORDS
+ * @retval none
+ */
+void poll_capture_send_handoff(const uint32_t *words, uint32_t count)
+{
+    poll_send_words(POLL_BLOCK_MAGIC_HANDOFF, words, count);
+}
+
+/**
+ * @brief Queues one POLL_BLOCK_MAGIC_SYNC block between sample blocks: the
+ *        USB frame count and the DWT->CYCCNT value latched at that SOF
+ * @param words - payload words
+ * @param count - number of words
+ * @retval none
+ */
+void poll_capture_send_sync(const uint32_t *words, uint32_t count)
+{
+    poll_send_words(POLL_BLOCK_MAGIC_SYNC, words, count);
+}
+
+static inline void poll_add_fixup(uint32_t index, uint32_t late)
+{
+    if (fixup_count == POLL_BLOCK_FIXUPS) return;
+    fixups[fixup_count].index = index;
+    fixups[fixup_count].late = late > 0xFFFF ? 0xFFFF : late;
+    fixup_count++;
+}
+
+/**
+ * @brief Samples one block on the grid of the previous one and queues it
+ *        for USB; the main loop calls this while in CAPTURE_MODE_POLL
+ * @retval ADAPTIVE_CAPTURE builds: samples that differ from the one
+ *         before, which 'M' 2 weighs against ADAPTIVE_RATE; else 0
+ */
+uint32_t poll_capture_run(void)
+{
+    if (config_pending) poll_apply_config();
+
+    PollBlock *block = blocks[fill_sel];
+    uint32_t now = DWT->CYCCNT;
+    if ((int32_t)(now - next_sample) > POLL_MAX_LATE) next_sample = now;  // after a stall
+
+    uint32_t next = next_sample;
+    uint32_t period = sample_period;
+    uint32_t count = block_samples;
+    uint32_t bits = sample_bits;
+    uint32_t acc = 0, shift = 0, used = 0;
+    uint32_t changes = 0;
+#if ADAPTIVE_CAPTURE
+    uint32_t last = last_sample;
+#endif
+
+    block->header.magic = POLL_BLOCK_MAGIC;
+    block->header.count = count;
+    block->header.start = next;
+    block->header.period = period;
+    block->header.mask = channel_mask;
+    block->header.bits = bits;
+    fixup_count = 0;
+
+    for (uint32_t i = 0; i < count; i++)
+    {
+        do now = DWT->CYCCNT; while ((int32_t)(now - next) < 0);
+        uint32_t sample = pack_lut[pin_map_channels(GPIOB->IDR)];
+        acc |= sample << shift;
+#if ADAPTIVE_CAPTURE
+        changes += sample != last;
+        last = sample;
+#endif
+        if (now - next > POLL_FIXUP_LATE) poll_add_fixup(i, now - next);
+        next += period;
+        shift += bits;
+        if (shift == 8)
+        {
+            block->data[used++] = acc;
+            acc = 0;
+            shift = 0;
+        }
+    }
+    if (shift) block->data[used++] = acc;
+    next_sample = next;
+#if ADAPTIVE_CAPTURE
+    last_sample = last;
+#endif
+
+    while (used & 3) block->data[used++] = 0;
+    memcpy(&block->data[used], fixups, fixup_count * sizeof(PollFixup));
+    block->header.end = now;
+    block->header.fixups = fixup_count;
+    poll_queue(used + fixup_count * sizeof(PollFixup));
+    return changes;
+}
@@ -0,0 +1,177 @@
+/**
+  ******************************************************************************
+  * @file           : pulse_record.c
+  * @brief          : One record per pulse on pulse-oriented channels
+  ******************************************************************************
+  * A channel's state is its held leading edge and the time of its last
+  * record, which the host holds as the anchor of the next pulse word.
+  * Whether the host holds it is a bit per channel: set by a BUS_PULSE
+  * the ring took, cleared for every channel once the ring drops events
+  * (the drop marker goes ahead of the next push), on a trigger window
+  * and on a new stream.
+  ******************************************************************************
+  */
+
+#include "pulse_record.h"
+#include "event_ring.h"
+#include "stream_codec.h"
+
+volatile uint32_t pulse_mask = 0;
+
+static uint32_t pulse_level = 0;        // bit n set: channel n's pulses are high
+static uint32_t held = 0;               // bit n set: channel n's leading edge waits
+static uint32_t start[4];               // clock time of the leading edge
+static uint32_t anchor[4];              // clock time of the channel's last record
+static uint32_t since_sync[4];          // pulse words since the channel's last BUS_PULSE
+static uint32_t synced = 0;             // bit n set: the host holds channel n's anchor
+static uint32_t announced = 0;          // bit n set: a BUS_PULSE of channel n went out
+static uint32_t seen_dropped = 0;       // dropped_total at the last check
+
+/**
+ * @brief Pushes a BUS_PULSE record of channel ch ending at time; the host
+ *        takes time as the channel's anchor if the ring takes it
+ */
+static void pulse_bus(uint32_t ch, uint32_t time, uint32_t width, uint32_t flags)
+{
+    uint32_t head = ring_head;
+    uint32_t words[MARKER_BUS_WORDS] = {
+        time,
+        width | (flags << 19) | (ch << 22) | (BUS_PULSE << 24)
+    };
+
+    capture_push_record(event_pack_marker(MARKER_BUS, 0), words, MARKER_BUS_WORDS);
+    anchor[ch] = time;
+    since_sync[ch] = 0;
+    announced |= 1UL << ch;
+    if (ring_head != head) synced |= 1UL << ch;
+    else synced &= ~(1UL << ch);  // the ring had no room for it
+}
+
+/**
+ * @brief Sends one completed pulse: a word after a known anchor, else
+ *        a BUS_PULSE record, or two lone edges if it is wider than that
+ */
+static void pulse_send(uint32_t ch, uint32_t level, uint32_t t0, uint32_t t1, uint32_t words)
+{
+    uint32_t width = t1 - t0;
+
+    if (dropped_total != seen_dropped)
+    {
+        seen_dropped = dropped_total;
+        synced = 0;  // the host forgets every anchor at the drop marker
+    }
+    if (words && (synced & (1UL << ch)) && width <= PULSE_WORD_WIDTH &&
+        t1 - anchor[ch] <= PULSE_WORD_SPAN && since_sync[ch] < PULSE_SYNC_EVERY)
+    {
+        capture_push_event(codec_pulse_word(level, ch, width, t1));
+        anchor[ch] = t1;
+        since_sync[ch]++;
+        return;
+    }
+    if (width <= PULSE_BUS_WIDTH)
+    {
+        pulse_bus(ch, t1, width, level);
+        return;
+    }
+    pulse_bus(ch, t0, 0, level | PULSE_FLAG_EDGE);
+    pulse_bus(ch, t1, 0, (level ^ PULSE_FLAG_LEVEL) | PULSE_FLAG_EDGE);
+}
+
+/**
+ * @brief Sets the channels that send pulse records (host command 'p');
+ *        a channel leaving them sends its held leading edge and a
+ *        PULSE_FLAG_OFF record first. Called from the host command
+ *        parser (main loop)
+ * @param mask - bit n sends channel n's pulses as records, 0 stops
+ * @param levels - bit n set: channel n's pulses are high, else low
+ * @retval none
+ */
+void pulse_configure(uint32_t mask, uint32_t levels)
+{
+    mask &= 0x0F;
+    levels &= mask;
+
+    __disable_irq();
+    uint32_t now = get_32bit_timer();
+    uint32_t changing = pulse_mask & ~(mask & ~(pulse_level ^ levels));
+    while (changing)
+    {
+        uint32_t ch = __CLZ(__RBIT(changing));
+        uint32_t bit = 1UL << ch;
+
+        changing &= changing - 1;
+        if (held & bit) pulse_bus(ch, start[ch], 0, ((pulse_level >> ch) & 1) | PULSE_FLAG_EDGE);
+        if ((announced & bit) && !(mask & bit)) pulse_bus(ch, now, 0, PULSE_FLAG_OFF);
+        announced &= mask | ~bit;
+        held &= ~bit;
+        synced &= ~bit;
+    }
+    pulse_level = levels;
+    pulse_mask = mask;
+    __enable_irq();
+}
+
+/**
+ * @brief Turns one EXTI interrupt's edges on pulse channels into pulse
+ *        records; called from the EXTI ISR
+ * @param levels - CH1-CH4 levels after the edges, bit n = channel n
+ * @param changed - channels with an edge, bit n = channel n
+ * @param time - 32-bit clock time of the edges
+ * @param words - 0 while the ring may trim records ahead of a trigger
+ *        window: every pulse then goes as a BUS_PULSE record
+ * @retval the channels of changed whose edges are stored as edges
+ */
+uint32_t pulse_edges(uint32_t levels, uint32_t changed, uint32_t time, uint32_t words)
+{
+    uint32_t pulsed = changed & pulse_mask;
+
+    while (pulsed)
+    {
+        uint32_t ch = __CLZ(__RBIT(pulsed));  // lowest pending line
+        uint32_t bit = 1UL << ch;
+        uint32_t level = (pulse_level >> ch) & 1;
+
+        pulsed &= pulsed - 1;
+        if (((levels >> ch) & 1) == level)
+        {
+            // leading edge: held until the pulse ends
+            if (held & bit) pulse_bus(ch, start[ch], 0, level | PULSE_FLAG_EDGE);
+            held |= bit;
+            start[ch] = time;
+        }
+        else if (held & bit)
+        {
+            held &= ~bit;
+            pulse_send(ch, level, start[ch], time, words);
+        }
+        else
+        {
+            pulse_bus(ch, time, 0, (level ^ PULSE_FLAG_LEVEL) | PULSE_FLAG_EDGE);
+        }
+    }
+    return changed & ~pulse_mask;
+}
+
+/**
+ * @brief The host dropped its anchors (a trigger window opens): the next
+ *        pulse of each channel goes as a BUS_PULSE record. Called from
+ *        the EXTI ISR or with IRQs masked
+ * @retval none
+ */
+void pulse_resync(void)
+{
+    synced = 0;
+}
+
+/**
+ * @brief Forgets the held edges and anchors with the ring they were
+ *        headed for; called with IRQs masked
+ * @retval none
+ */
+void pulse_reset(void)
+{
+    held = 0;
+    synced = 0;
+    announced = 0;
+    seen_dropped = dropped_total;
+}
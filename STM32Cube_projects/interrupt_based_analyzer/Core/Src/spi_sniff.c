@@ -0,0 +1,254 @@
+/**
+  ******************************************************************************
+  * @file           : spi_sniff.c
+  * @brief          : SPI bus sniffing with the SPI peripherals + DMA
+  ******************************************************************************
+  * Every ring fills one entry per byte: DMA1 channel 2 from SPI1->DR,
+  * channel 4 from SPI2->DR and channel 7 from TIM2->CCR2, whose input
+  * capture fires on every eighth sampling edge. Entry i of each ring
+  * therefore belongs to the same byte, and the main loop drains them
+  * with one tail. SPI and DMA registers are set directly; the HAL SPI
+  * driver is not part of this project.
+  ******************************************************************************
+  */
+
+#include "spi_sniff.h"
+#include "event_format.h"
+
+volatile uint32_t spi_sniff_cs_mask = 0;
+
+/* Filled by DMA1 channel 2 (SPI1_RX), 4 (SPI2_RX) and 7 (TIM2_CH2) */
+static volatile uint8_t spi_mosi[SPI_RING_SIZE];
+static volatile uint8_t spi_miso[SPI_RING_SIZE];
+static volatile uint16_t spi_time[SPI_RING_SIZE];
+static uint32_t tail = 0;
+
+static uint32_t sniff_mode = 0;         // 'P' mode byte, SPI_MODE_ON clear while off
+static uint32_t sniff_running = 0;
+static uint32_t overrun_seen = 0;       // SPI_FLAG_OVERRUN already reported since the last select
+
+/**
+ * @brief Points a DMA1 channel at a peripheral data register and runs it
+ *        as a circular ring
+ */
+static void spi_dma_config(DMA_Channel_TypeDef *ch, volatile void *data, volatile void *ring,
+                           uint32_t sizes)
+{
+    ch->CCR = 0;
+    ch->CPAR = (uint32_t)data;
+    ch->CMAR = (uint32_t)ring;
+    ch->CNDTR = SPI_RING_SIZE;
+    ch->CCR = DMA_CCR_PL_1 | sizes | DMA_CCR_MINC | DMA_CCR_CIRC | DMA_CCR_EN;
+}
+
+static uint32_t ring_head(DMA_Channel_TypeDef *ch)
+{
+    return (SPI_RING_SIZE - ch->CNDTR) & SPI_RING_MASK;
+}
+
+/**
+ * @brief Enables one SPI as a receive-only slave with its RX DMA request;
+ *        the slave is always selected (software NSS)
+ */
+static void spi_slave_start(SPI_TypeDef *spi)
+{
+    spi->CR1 = 0;
+    spi->CR2 = SPI_CR2_RXDMAEN;
+    spi->CR1 = SPI_CR1_RXONLY | SPI_CR1_SSM |
+               ((sniff_mode & SPI_MODE_CPHA) ? SPI_CR1_CPHA : 0) |
+               ((sniff_mode & SPI_MODE_CPOL) ? SPI_CR1_CPOL : 0) |
+               ((sniff_mode & SPI_MODE_LSB) ? SPI_CR1_LSBFIRST : 0);
+    (void)spi->DR;
+    (void)spi->SR;
+    spi->CR1 |= SPI_CR1_SPE;
+}
+
+/**
+ * @brief Drops a partial byte: a disabled slave forgets its bit count
+ */
+static void spi_slave_restart(SPI_TypeDef *spi)
+{
+    spi->CR1 &= ~SPI_CR1_SPE;
+    (void)spi->DR;  // with SR, clears a pending overrun
+    (void)spi->SR;
+    spi->CR1 |= SPI_CR1_SPE;
+}
+
+/**
+ * @brief Starts the rings, TIM2 CH2 and the SPIs for the stored mode
+ */
+static void spi_start(void)
+{
+    // the sampling edge: rising when CPOL and CPHA agree
+    uint32_t falling = ((sniff_mode & SPI_MODE_CPOL) != 0) != ((sniff_mode & SPI_MODE_CPHA) != 0);
+
+    tail = 0;
+    overrun_seen = 0;
+
+    TIM2->DIER &= ~TIM_DIER_CC2DE;
+    TIM2->CCER &= ~(TIM_CCER_CC2E | TIM_CCER_CC2P);
+    TIM2->CCMR1 = (TIM2->CCMR1 & ~(TIM_CCMR1_CC2S | TIM_CCMR1_IC2PSC | TIM_CCMR1_IC2F)) |
+                  TIM_CCMR1_CC2S_0 | TIM_CCMR1_IC2PSC;  // TI2, every 8th edge
+    TIM2->CCER |= (falling ? TIM_CCER_CC2P : 0);
+
+    spi_dma_config(DMA1_Channel7, &TIM2->CCR2, spi_time, DMA_CCR_MSIZE_0 | DMA_CCR_PSIZE_0);
+    spi_dma_config(DMA1_Channel2, &SPI1->DR, spi_mosi, 0);
+    spi_slave_start(SPI1);
+    if (sniff_mode & SPI_MODE_MISO)
+    {
+        spi_dma_config(DMA1_Channel4, &SPI2->DR, spi_miso, 0);
+        spi_slave_start(SPI2);
+    }
+
+    TIM2->DIER |= TIM_DIER_CC2DE;
+    TIM2->CCER |= TIM_CCER_CC2E;
+    sniff_running = 1;
+}
+
+/**
+ * @brief Stops the SPIs, TIM2 CH2 and the rings
+ */
+static void spi_stop(void)
+{
+    SPI1->CR1 = 0;
+    SPI2->CR1 = 0;
+    TIM2->DIER &= ~TIM_DIER_CC2DE;
+    TIM2->CCER &= ~TIM_CCER_CC2E;
+    DMA1_Channel2->CCR = 0;
+    DMA1_Channel4->CCR = 0;
+    DMA1_Channel7->CCR = 0;
+    sniff_running = 0;
+}
+
+/**
+ * @brief Selects the SPI mode and chip select, or turns sniffing off;
+ *        called from the host command parser (main loop)
+ * @param mode - 'P' mode byte, SPI_MODE_* above
+ * @param cs_channel - probe channel of the active-low chip select,
+ *        SPI_NO_CS for none
+ * @retval none
+ */
+void spi_sniff_configure(uint32_t mode, uint32_t cs_channel)
+{
+    GPIO_InitTypeDef GPIO_InitStruct = {0};
+
+    __disable_irq();
+    spi_sniff_cs_mask = 0;
+    __enable_irq();
+    spi_stop();
+
+    if (!(mode & SPI_MODE_ON))
+    {
+        uint32_t was_on = sniff_mode & SPI_MODE_ON;
+        sniff_mode = 0;
+        if (was_on) capture_apply_channels();  // PB5 streams edges again if enabled
+        return;
+    }
+
+    __HAL_RCC_AFIO_CLK_ENABLE();
+    __HAL_RCC_DMA1_CLK_ENABLE();
+    __HAL_RCC_SPI1_CLK_ENABLE();
+    __HAL_AFIO_REMAP_SPI1_ENABLE();      // SCK PB3, MOSI PB5
+    __HAL_AFIO_REMAP_TIM2_PARTIAL_1();   // TIM2 CH2 on PB3
+    GPIO_InitStruct.Pin = GPIO_PIN_3;
+    GPIO_InitStruct.Mode = GPIO_MODE_INPUT;
+    GPIO_InitStruct.Pull = GPIO_NOPULL;
+    HAL_GPIO_Init(GPIOB, &GPIO_InitStruct);
+    if (mode & SPI_MODE_MISO)
+    {
+        __HAL_RCC_SPI2_CLK_ENABLE();
+        GPIO_InitStruct.Pin = GPIO_PIN_13 | GPIO_PIN_15;  // SPI2 SCK, MOSI
+        HAL_GPIO_Init(GPIOB, &GPIO_InitStruct);
+    }
+
+    // PB5's edges become bytes: take its EXTI line out of the ring
+    sniff_mode = mode;
+    capture_apply_channels();
+    spi_start();
+    __disable_irq();
+    spi_sniff_cs_mask = cs_channel < 4 && cs_channel != SPI_DATA_CHANNEL ? 1UL << cs_channel : 0;
+    __enable_irq();
+}
+
+/**
+ * @brief EXTI lines the sniffer takes from the edge capture
+ * @retval CH3_Pin while sniffing, else 0
+ */
+uint32_t spi_sniff_lines(void)
+{
+    return (sniff_mode & SPI_MODE_ON) ? CH3_Pin : 0;
+}
+
+/**
+ * @brief Pauses or resumes sniffing with the edge capture; keeps the mode
+ * @param enable - 1 to resume, 0 to pause
+ * @retval none
+ */
+void spi_sniff_enable(uint32_t enable)
+{
+    if (!(sniff_mode & SPI_MODE_ON)) return;
+    if (enable && !sniff_running) spi_start();
+    else if (!enable && sniff_running) spi_stop();
+}
+
+/**
+ * @brief Realigns the byte framing on a chip select falling edge; called
+ *        from the EXTI ISR, while the bus is idle between bytes
+ * @retval none
+ */
+void spi_sniff_select(void)
+{
+    if (!sniff_running) return;
+    spi_slave_restart(SPI1);
+    if (sniff_mode & SPI_MODE_MISO) spi_slave_restart(SPI2);
+    TIM2->CCER &= ~TIM_CCER_CC2E;  // resets the capture prescaler
+    TIM2->CCER |= TIM_CCER_CC2E;
+    overrun_seen = 0;
+}
+
+/**
+ * @brief Moves the bytes received since the last call into event_buffer,
+ *        one MARKER_BUS record each. Must run at least once per TIM2
+ *        period (~12.7 ms at 5.14 MHz) and before SPI_RING_SIZE bytes
+ *        arrive
+ * @retval none
+ */
+void spi_sniff_drain(void)
+{
+    if (!sniff_running) return;
+
+    uint32_t miso = (sniff_mode & SPI_MODE_MISO) != 0;
+    uint32_t ready = (ring_head(DMA1_Channel7) - tail) & SPI_RING_MASK;
+    uint32_t bytes = (ring_head(DMA1_Channel2) - tail) & SPI_RING_MASK;
+    if (bytes < ready) ready = bytes;
+    if (miso)
+    {
+        bytes = (ring_head(DMA1_Channel4) - tail) & SPI_RING_MASK;
+        if (bytes < ready) ready = bytes;
+    }
+    uint32_t now = get_32bit_timer();  // read after the heads: every capture is older
+
+    uint32_t flags = miso ? SPI_FLAG_MISO : 0;
+    uint32_t overrun = (SPI1->SR & SPI_SR_OVR) || (miso && (SPI2->SR & SPI_SR_OVR));
+    if (overrun && !overrun_seen && ready)
+    {
+        flags |= SPI_FLAG_OVERRUN;  // once; the next select clears it
+        overrun_seen = 1;
+    }
+
+    while (ready--)
+    {
+        uint32_t words[MARKER_BUS_WORDS] = {
+            extend_16bit_timer(spi_time[tail], now),
+            spi_mosi[tail] | (miso ? spi_miso[tail] << 8 : 0) | (flags << 16) | (BUS_SPI << 24)
+        };
+        tail = (tail + 1) & SPI_RING_MASK;
+        flags &= ~SPI_FLAG_OVERRUN;
+
+        // EXTI channels produce into the same ring from interrupt context
+        __disable_irq();
+        capture_check_epoch(words[0]);
+        capture_push_record(event_pack_marker(MARKER_BUS, 0), words, MARKER_BUS_WORDS);
+        __enable_irq();
+    }
+}
@@ -22,6 +22,8 @@
 #include "stm32f1xx_it.h"
 /* Private includes ----------------------------------------------------------*/
 /* USER CODE BEGIN Includes */
+#include "board_sync.h"
+#include "irq_timing.h"
 /* USER CODE END Includes */
 
 /* Private typedef -----------------------------------------------------------*/
@@ -46,7 +48,13 @@
 
 /* Private function prototypes -----------------------------------------------*/
 /* USER CODE BEGIN PFP */
-
+/* Edge interrupts run from SRAM in RAM_HOT_PATHS builds */
+HOT_PATH void EXTI4_IRQHandler(void);
+HOT_PATH void EXTI9_5_IRQHandler(void);
+HOT_PATH void EXTI15_10_IRQHandler(void);
+#if USB_LEAN_IRQ
+uint32_t USBD_LL_StreamIRQHandler(PCD_HandleTypeDef *hpcd);   /* usbd_conf.c */
+#endif
 /* USER CODE END PFP */
 
 /* Private user code ---------------------------------------------------------*/
@@ -204,10 +212,22 @@ void SysTick_Handler(void)
 void EXTI4_IRQHandler(void)
 {
   /* USER CODE BEGIN EXTI4_IRQn 0 */
-
+#if IRQ_TIMING
+  irq_timing_exti_enter();
+#endif
+#if CAPTURE_FAST_EXTI
+  capture_exti_fast();
+#if IRQ_TIMING
+  irq_timing_exti_exit();
+#endif
+  return;
+#endif
   /* USER CODE END EXTI4_IRQn 0 */
   HAL_GPIO_EXTI_IRQHandler(CH4_Pin);
   /* USER CODE BEGIN EXTI4_IRQn 1 */
+#if IRQ_TIMING
+  irq_timing_exti_exit();
+#endif
 
   /* USER CODE END EXTI4_IRQn 1 */
 }
@@ -218,10 +238,28 @@ void EXTI4_IRQHandler(void)
 void USB_LP_CAN1_RX0_IRQHandler(void)
 {
   /* USER CODE BEGIN USB_LP_CAN1_RX0_IRQn 0 */
-
+#if IRQ_TIMING
+  uint32_t start = DWT->CYCCNT;
+#endif
+#if USB_LEAN_IRQ
+  /* Packets in the middle of a bulk IN transfer need no stack */
+  if (USBD_LL_StreamIRQHandler(&hpcd_USB_FS))
+  {
+#if IRQ_TIMING
+    irq_timing_usb(start);
+#endif
+    return;
+  }
+#endif
   /* USER CODE END USB_LP_CAN1_RX0_IRQn 0 */
   HAL_PCD_IRQHandler(&hpcd_USB_FS);
   /* USER CODE BEGIN USB_LP_CAN1_RX0_IRQn 1 */
+#if IRQ_TIMING
+  irq_timing_usb(start);
+#endif
+#if MAIN_LOOP_SLEEP
+  capture_wake();
+#endif
 
   /* USER CODE END USB_LP_CAN1_RX0_IRQn 1 */
 }
@@ -232,16 +270,60 @@ void USB_LP_CAN1_RX0_IRQHandler(void)
 void EXTI9_5_IRQHandler(void)
 {
   /* USER CODE BEGIN EXTI9_5_IRQn 0 */
-
+#if IRQ_TIMING
+  irq_timing_exti_enter();
+#endif
+#if CAPTURE_FAST_EXTI
+  capture_exti_fast();
+#if IRQ_TIMING
+  irq_timing_exti_exit();
+#endif
+  return;
+#endif
   /* USER CODE END EXTI9_5_IRQn 0 */
   HAL_GPIO_EXTI_IRQHandler(CH3_Pin);
   HAL_GPIO_EXTI_IRQHandler(CH2_Pin);
   HAL_GPIO_EXTI_IRQHandler(CH1_Pin);
   /* USER CODE BEGIN EXTI9_5_IRQn 1 */
+#if IRQ_TIMING
+  irq_timing_exti_exit();
+#endif
 
   /* USER CODE END EXTI9_5_IRQn 1 */
 }
 
 /* USER CODE BEGIN 1 */
+#if CAPTURE_EXTI_LINES & 0xFC00
+/**
+  * @brief This function handles EXTI line[15:10] interrupts: probe pins
+  *        on PB10-PB15 (pin_map.h), always through capture_exti_fast.
+  */
+void EXTI15_10_IRQHandler(void)
+{
+#if IRQ_TIMING
+  irq_timing_exti_enter();
+#endif
+  capture_exti_fast();
+#if IRQ_TIMING
+  irq_timing_exti_exit();
+#endif
+}
+#endif
+
+#if BOARD_SYNC || MAIN_LOOP_SLEEP
+/**
+  * @brief This function handles TIM2 global interrupt: the reference
+  *        pulse capture (board_sync.h) and the main loop's flush timer.
+  */
+void TIM2_IRQHandler(void)
+{
+#if BOARD_SYNC
+  board_sync_irq();
+#endif
+#if MAIN_LOOP_SLEEP
+  capture_wake_timer_irq();
+#endif
+}
+#endif
 
 /* USER CODE END 1 */
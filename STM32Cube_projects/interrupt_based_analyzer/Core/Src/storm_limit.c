@@ -0,0 +1,183 @@
+/**
+  ******************************************************************************
+  * @file           : storm_limit.c
+  * @brief          : Per-channel edge rate limit of the EXTI channels
+  ******************************************************************************
+  * The bucket is kept in clock ticks: an edge spends cost ticks of
+  * credit, and credit grows by the ticks elapsed up to burst edges'
+  * worth, so an edge costs an add, a compare and a subtract. The main
+  * loop closes the windows of a storm that went quiet (storm_poll).
+  ******************************************************************************
+  */
+
+#include "storm_limit.h"
+#include "event_format.h"
+
+volatile uint32_t storm_mask = 0;
+
+static uint32_t cost[4];                // ticks of credit an edge spends, 0 = no limit
+static uint32_t limit[4];               // credit of a full bucket
+static uint32_t credit[4];
+static uint32_t last[4];                // clock time credit was last added
+static uint32_t window;                 // summary window in ticks
+static uint32_t storming = 0;           // bit n set while channel n sends summaries
+static uint32_t win_start[4];
+static uint32_t win_count[4];
+static uint32_t win_level[4];
+
+/**
+ * @brief Pushes channel ch's summary record for the window ending at time
+ */
+static void storm_emit(uint32_t ch, uint32_t time, uint32_t flags)
+{
+    uint32_t count = win_count[ch] > 0xFFFF ? 0xFFFF : win_count[ch];
+    uint32_t words[MARKER_BUS_WORDS] = {
+        time,
+        count | ((ch | (win_level[ch] << 2) | flags) << 16) | (BUS_STORM << 24)
+    };
+    capture_push_record(event_pack_marker(MARKER_BUS, 0), words, MARKER_BUS_WORDS);
+}
+
+static void storm_refill(uint32_t ch, uint32_t time)
+{
+    uint32_t c = credit[ch] + (time - last[ch]);
+
+    if (c < credit[ch] || c > limit[ch]) c = limit[ch];
+    credit[ch] = c;
+    last[ch] = time;
+}
+
+/**
+ * @brief Ends channel ch's window at time with its summary; a window
+ *        within the rate also ends the storm, with a full bucket
+ */
+static void storm_close(uint32_t ch, uint32_t time)
+{
+    uint32_t calm = (uint64_t)win_count[ch] * cost[ch] <= time - win_start[ch];
+
+    storm_emit(ch, time, calm ? STORM_FLAG_CALM : 0);
+    if (calm)
+    {
+        storming &= ~(1UL << ch);
+        credit[ch] = limit[ch];
+        last[ch] = time;
+    }
+    else
+    {
+        win_start[ch] = time;
+        win_count[ch] = 0;
+    }
+}
+
+/**
+ * @brief Sets one channel's rate limit; called from the host command
+ *        parser (main loop)
+ * @param channel - probe channel 0-3, or STORM_ALL_CHANNELS
+ * @param ticks - clock ticks per edge at the allowed rate, 0 for no limit
+ * @param burst - edges the bucket holds
+ * @param window_ticks - summary window in clock ticks
+ * @retval none
+ */
+void storm_configure(uint32_t channel, uint32_t ticks, uint32_t burst, uint32_t window_ticks)
+{
+    uint64_t full = (uint64_t)ticks * (burst ? burst : 1);
+
+    __disable_irq();
+    uint32_t now = get_32bit_timer();
+    window = window_ticks ? window_ticks : 1;
+    for (uint32_t ch = 0; ch < 4; ch++)
+    {
+        uint32_t bit = 1UL << ch;
+
+        if (channel != ch && channel != STORM_ALL_CHANNELS) continue;
+        if (storming & bit)
+        {
+            storm_emit(ch, now, STORM_FLAG_CALM);  // the storm ends with its limit
+            storming &= ~bit;
+        }
+        cost[ch] = ticks;
+        limit[ch] = full > 0x7FFFFFFF ? 0x7FFFFFFF : (uint32_t)full;
+        credit[ch] = limit[ch];
+        last[ch] = now;
+        if (ticks) storm_mask |= bit;
+        else storm_mask &= ~bit;
+    }
+    __enable_irq();
+}
+
+/**
+ * @brief Passes one EXTI interrupt's edges through the channels' buckets;
+ *        called from the EXTI ISR
+ * @param levels - CH1-CH4 levels after the edges, bit n = channel n
+ * @param changed - channels with an edge, bit n = channel n
+ * @param time - 32-bit clock time of the edges
+ * @retval the channels of changed whose edges are stored
+ */
+uint32_t storm_limit(uint32_t levels, uint32_t changed, uint32_t time)
+{
+    uint32_t limited = changed & storm_mask;
+    uint32_t pass = changed & ~storm_mask;
+
+    while (limited)
+    {
+        uint32_t ch = __CLZ(__RBIT(limited));  // lowest pending line
+        uint32_t bit = 1UL << ch;
+
+        limited &= limited - 1;
+        if ((storming & bit) && time - win_start[ch] >= window) storm_close(ch, time);
+        if (!(storming & bit))
+        {
+            storm_refill(ch, time);
+            if (credit[ch] >= cost[ch])
+            {
+                credit[ch] -= cost[ch];
+                pass |= bit;
+                continue;
+            }
+            storming |= bit;  // bucket empty: summaries from this edge on
+            win_start[ch] = time;
+            win_count[ch] = 0;
+        }
+        win_count[ch]++;
+        win_level[ch] = (levels >> ch) & 1;
+    }
+    return pass;
+}
+
+/**
+ * @brief Closes the summary windows that have run their length and keeps
+ *        the idle buckets' credit current; called from the main loop with
+ *        IRQs masked
+ * @param now - current 32-bit clock time
+ * @retval none
+ */
+void storm_poll(uint32_t now)
+{
+    uint32_t pending = storm_mask;
+
+    while (pending)
+    {
+        uint32_t ch = __CLZ(__RBIT(pending));
+
+        pending &= pending - 1;
+        if (!(storming & (1UL << ch))) storm_refill(ch, now);
+        else if (now - win_start[ch] >= window) storm_close(ch, now);
+    }
+}
+
+/**
+ * @brief Ends the storms with the ring their summaries were headed for;
+ *        called with IRQs masked
+ * @retval none
+ */
+void storm_reset(void)
+{
+    uint32_t now = get_32bit_timer();
+
+    storming = 0;
+    for (uint32_t ch = 0; ch < 4; ch++)
+    {
+        credit[ch] = limit[ch];
+        last[ch] = now;
+    }
+}
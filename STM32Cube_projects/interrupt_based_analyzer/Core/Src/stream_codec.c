@@ -0,0 +1,406 @@
+/**
+  ******************************************************************************
+  * @file           : stream_codec.c
+  * @brief          : Codec of the stream formats, shared by firmware and host
+  ******************************************************************************
+  * The record, run and frame layouts are described in event_format.c,
+  * the pulse word in pulse_record.h. The encoder's state (epoch, marker
+  * words owed, the run in progress) stays in event_format.c; what is
+  * here is what the decoder must do the same way.
+  *
+  * Host shared library, from interrupt_based_analyzer:
+  *   cc -O2 -shared -fPIC -DHOST_SIM -I Sim -I Core/Inc -o ../../python_scripts/interrupt_based_scripts/stream_codec.so Core/Src/stream_codec.c
+  * where serial_plotter.py's NATIVE_CODEC looks for it.
+  ******************************************************************************
+  */
+
+#include "stream_codec.h"
+#include <string.h>
+
+#if STREAM_COMPACT || CODEC_DECODER
+
+uint32_t codec_put_varint(uint64_t value, uint8_t *out)
+{
+    uint32_t n = 0;
+    do
+    {
+        uint8_t b = value & 0x7F;
+        value >>= 7;
+        if (value) b |= 0x80;
+        out[n++] = b;
+    } while (value);
+    return n;
+}
+
+/**
+ * @brief Writes a record's first byte, type and the low 3 bits of value,
+ *        and the rest of value as LEB128
+ * @retval number of bytes written
+ */
+uint32_t codec_put_head(uint32_t type, uint64_t value, uint8_t *out)
+{
+    uint8_t b = (uint8_t)((type << 4) | (value & 0x07));
+    value >>= 3;
+    if (value) b |= 0x08;
+    out[0] = b;
+    return value ? 1 + codec_put_varint(value, out + 1) : 1;
+}
+
+/**
+ * @brief Appends the prefix code of a residual of at most CODEC_SLACK to
+ *        a run's codes, which start zeroed
+ * @param bits - bits of codes already used
+ * @retval bits used after it
+ */
+uint32_t codec_put_residual(uint8_t *codes, uint32_t bits, int32_t residual)
+{
+    uint32_t sign = residual < 0;
+    uint32_t size = sign ? (uint32_t)-residual : (uint32_t)residual;
+    uint32_t code, n;
+
+    if (size == 0)
+    {
+        code = 0;
+        n = 1;
+    }
+    else if (size == 1)
+    {
+        code = 0x1 | sign << 2;
+        n = 3;
+    }
+    else
+    {
+        code = 0x3 | (size - 2) << 2 | sign << 3;
+        n = 4;
+    }
+    for (uint32_t i = 0; i < n; i++, bits++)
+    {
+        codes[bits >> 3] |= ((code >> i) & 1) << (bits & 7);
+    }
+    return bits;
+}
+
+/**
+ * @brief Forgets every channel's edges: no prediction until each has had
+ *        three again
+ * @retval none
+ */
+void codec_model_reset(CodecModel *model)
+{
+    memset(model, 0, sizeof(*model));
+}
+
+/**
+ * @brief Channel whose edge the model expects next, or -1 for none
+ * @param now - time of the last record
+ * @param when - set to the predicted time
+ */
+int32_t codec_model_next(const CodecModel *model, uint64_t now, uint64_t *when)
+{
+    int32_t best = -1;
+
+    for (int32_t ch = 0; ch < CODEC_CHANNELS; ch++)
+    {
+        if (!model->steady[ch]) continue;
+        uint64_t t = model->last[ch] + model->gap[ch][1];
+        if (t + CODEC_SLACK < now) continue;  // passed without an edge
+        if (best < 0 || t < *when)
+        {
+            best = ch;
+            *when = t;
+        }
+    }
+    return best;
+}
+
+void codec_model_learn(CodecModel *model, uint32_t ch, uint64_t time, uint32_t level)
+{
+    if (model->seen[ch])
+    {
+        uint64_t gap = time - model->last[ch];
+        int64_t r = (int64_t)(gap - model->gap[ch][1]);
+        model->steady[ch] = model->seen[ch] == 3 && r >= -CODEC_SLACK && r <= CODEC_SLACK;
+        model->gap[ch][1] = model->gap[ch][0];
+        model->gap[ch][0] = gap > 0xFFFFFFFFUL ? 0xFFFFFFFFUL : (uint32_t)gap;
+    }
+    if (model->seen[ch] < 3) model->seen[ch]++;
+    model->last[ch] = time;
+    model->level[ch] = level;
+}
+
+#endif /* STREAM_COMPACT || CODEC_DECODER */
+
+#if CODEC_DECODER
+
+static uint32_t crc_table[256];
+
+uint32_t codec_decoder_size(void)
+{
+    return sizeof(CodecDecoder);
+}
+
+/**
+ * @brief Starts a new stream, STREAM_PREDICT or not, after its header;
+ *        call it on a zeroed decoder before the first stream. The time
+ *        carries on, as the encoder's does
+ * @retval none
+ */
+void codec_decoder_restart(CodecDecoder *dec, uint32_t predict)
+{
+    dec->predict = predict;
+    dec->restart_at = -1;
+    codec_model_reset(&dec->model);
+}
+
+/**
+ * @brief Marks where a frame's payload starts in the bytes the next
+ *        codec_decode gets: the model restarts at the record there
+ * @retval none
+ */
+void codec_decoder_frame(CodecDecoder *dec, uint32_t offset)
+{
+    if (dec->predict) dec->restart_at = offset;
+}
+
+/**
+ * @brief Bytes were lost: the caller drops the partial record it holds,
+ *        and no frame start is pending in it
+ * @retval none
+ */
+void codec_decoder_lost(CodecDecoder *dec)
+{
+    dec->restart_at = -1;
+}
+
+/**
+ * @brief Reads LEB128 groups from pos on into value, shift bits up
+ * @param more - whether the byte before pos continued the value
+ * @retval the position after it, 0 when the bytes end first
+ */
+static uint32_t get_varint(const uint8_t *data, uint32_t length, uint32_t pos, uint64_t *value,
+                           uint32_t shift, uint32_t more)
+{
+    while (more)
+    {
+        if (pos >= length) return 0;
+        uint8_t byte = data[pos++];
+        if (shift < 64) *value |= (uint64_t)(byte & 0x7F) << shift;
+        shift += 7;
+        more = byte & 0x80;
+    }
+    return pos;
+}
+
+static int32_t get_bit(const uint8_t *data, uint32_t length, uint32_t pos, uint32_t *bit)
+{
+    uint32_t at = pos + (*bit >> 3);
+    if (at >= length) return -1;
+    int32_t b = (data[at] >> (*bit & 7)) & 1;
+    (*bit)++;
+    return b;
+}
+
+/**
+ * @brief Reads one residual code, bit *bit of the codes at pos
+ * @retval 1, or 0 when the bytes end first
+ */
+static uint32_t get_residual(const uint8_t *data, uint32_t length, uint32_t pos, uint32_t *bit,
+                             int32_t *residual)
+{
+    int32_t b = get_bit(data, length, pos, bit);
+    if (b < 0) return 0;
+    if (b == 0)
+    {
+        *residual = 0;
+        return 1;
+    }
+    if ((b = get_bit(data, length, pos, bit)) < 0) return 0;
+    int32_t size = 1;
+    if (b)
+    {
+        int32_t extra = get_bit(data, length, pos, bit);
+        if (extra < 0) return 0;
+        size = 2 + extra;
+    }
+    int32_t sign = get_bit(data, length, pos, bit);
+    if (sign < 0) return 0;
+    *residual = sign ? -size : size;
+    return 1;
+}
+
+static void put_edge(CodecOutput *out, uint64_t time, uint32_t level, uint32_t ch)
+{
+    out->times[out->edges] = (int64_t)time;
+    out->levels[out->edges] = (uint8_t)level;
+    out->channels[out->edges] = (uint8_t)ch;
+    out->edges++;
+}
+
+/**
+ * @brief Decodes a run record whose codes start at pos
+ * @retval the position after it, 0 when the bytes end first or the
+ *         output has no room for its edges
+ */
+static uint32_t decode_run(CodecDecoder *dec, const uint8_t *data, uint32_t length, uint32_t pos,
+                           uint64_t count, CodecOutput *out)
+{
+    uint32_t bit = 0;
+    int32_t residual;
+
+    if (count > out->edge_room - out->edges) return 0;
+    for (uint64_t i = 0; i < count; i++)
+    {
+        if (!get_residual(data, length, pos, &bit, &residual)) return 0;  // the rest is in a later packet
+    }
+    bit = 0;
+    for (uint64_t i = 0; i < count; i++)
+    {
+        get_residual(data, length, pos, &bit, &residual);
+        uint64_t when = 0;
+        int32_t ch = codec_model_next(&dec->model, dec->time, &when);
+        if (ch < 0) continue;  // the model went out of step after lost bytes
+        uint32_t level = !dec->model.level[ch];
+        dec->time = when + (int64_t)residual;
+        codec_model_learn(&dec->model, (uint32_t)ch, dec->time, level);
+        put_edge(out, dec->time, level, (uint32_t)ch);
+    }
+    return pos + (bit + 7) / 8;
+}
+
+/* LEB128 values that follow a marker record's head */
+static uint32_t marker_values(uint32_t type)
+{
+    switch (type)
+    {
+    case MARKER_DROP:
+    case MARKER_WINDOW:  return 2;  // lost count, span in ticks
+    case MARKER_SOF:                // frame count
+    case MARKER_UART:
+    case MARKER_BUS:     return 1;  // data word
+    case MARKER_INFO:    return MARKER_INFO_WORDS;
+    default:             return 0;
+    }
+}
+
+/**
+ * @brief Decodes the record at pos
+ * @retval the position after it, 0 when the bytes end first or the
+ *         output has no room for what it holds
+ */
+static uint32_t decode_record(CodecDecoder *dec, const uint8_t *data, uint32_t length, uint32_t pos,
+                              CodecOutput *out)
+{
+    uint8_t head = data[pos];
+    uint32_t kind = head >> 4;
+    uint64_t delta = head & 0x07;
+    uint32_t end = get_varint(data, length, pos + 1, &delta, 3, head & 0x08);
+
+    if (!end) return 0;
+    if (kind == CODEC_RUN_TYPE && dec->predict)
+    {
+        return decode_run(dec, data, length, end, delta + 1, out);
+    }
+    if (kind < COMPACT_MARKER_BASE)
+    {
+        if (out->edges == out->edge_room) return 0;
+        dec->time += codec_unzigzag(delta);
+        put_edge(out, dec->time, (kind >> 2) & 0x1, kind & 0x3);
+        if (dec->predict) codec_model_learn(&dec->model, kind & 0x3, dec->time, (kind >> 2) & 0x1);
+        return end;
+    }
+
+    CodecMarker marker = {0};
+    marker.type = kind - COMPACT_MARKER_BASE;
+    for (uint32_t i = 0; i < marker_values(marker.type); i++)
+    {
+        if (!(end = get_varint(data, length, end, &marker.words[i], 0, 1))) return 0;
+    }
+    if (marker.type != MARKER_EPOCH && out->marker_count == out->marker_room) return 0;
+    dec->time += codec_unzigzag(delta);
+    marker.time = (int64_t)dec->time;
+    if (marker.type == MARKER_DROP || marker.type == MARKER_WINDOW)
+    {
+        dec->time += marker.words[1];  // the next record counts from the last loss
+    }
+    if (marker.type != MARKER_EPOCH)
+    {
+        out->markers[out->marker_count++] = marker;
+    }
+    return end;
+}
+
+/**
+ * @brief Decodes the whole records at the start of data into out: edges
+ *        in order, and markers in order among themselves
+ * @param data - bytes of the stream (payloads, on a framed stream) from
+ *        the first one not yet decoded
+ * @retval bytes decoded; the rest start a record that continues in a
+ *         later packet, or did not fit in out
+ */
+uint32_t codec_decode(CodecDecoder *dec, const uint8_t *data, uint32_t length, CodecOutput *out)
+{
+    uint32_t pos = 0;
+
+    while (pos < length)
+    {
+        if (dec->restart_at >= 0 && pos >= (uint64_t)dec->restart_at)
+        {
+            codec_model_reset(&dec->model);  // the first record the device encoded for this frame
+            dec->restart_at = -1;
+        }
+        uint32_t end = decode_record(dec, data, length, pos, out);
+        if (!end) break;
+        pos = end;
+    }
+    if (dec->restart_at >= 0)
+    {
+        dec->restart_at = dec->restart_at > pos ? dec->restart_at - pos : 0;
+    }
+    return pos;
+}
+
+/**
+ * @brief CRC-32 as the F103 CRC unit computes it over little-endian
+ *        words: poly 0x04C11DB7, each word most significant byte first;
+ *        a partial last word is zero-padded, as event_format.c feeds it
+ * @param crc - 0xFFFFFFFF to start, or the CRC so far
+ */
+uint32_t codec_crc32(uint32_t crc, const uint8_t *data, uint32_t length)
+{
+    if (crc_table[1] == 0)
+    {
+        for (uint32_t byte = 0; byte < 256; byte++)
+        {
+            uint32_t c = byte << 24;
+            for (int32_t i = 0; i < 8; i++) c = c & 0x80000000 ? (c << 1) ^ 0x04C11DB7 : c << 1;
+            crc_table[byte] = c;
+        }
+    }
+    for (uint32_t i = 0; i < length; i += 4)
+    {
+        for (int32_t j = 3; j >= 0; j--)
+        {
+            uint8_t byte = i + j < length ? data[i + j] : 0;
+            crc = (crc << 8) ^ crc_table[(crc >> 24) ^ byte];
+        }
+    }
+    return crc;
+}
+
+/**
+ * @brief Checks a StreamFrame header against the payload behind it
+ * @param frame - the header, followed by its payload
+ * @param length - payload bytes present
+ * @retval 1 if the sync word, length and CRC match
+ */
+uint32_t codec_frame_check(const uint8_t *frame, uint32_t length)
+{
+    StreamFrame head;
+
+    memcpy(&head, frame, sizeof(head));
+    if (head.sync != FRAME_SYNC || head.length != length) return 0;
+    uint32_t crc = codec_crc32(0xFFFFFFFF, frame, 8);
+    return codec_crc32(crc, frame + sizeof(head), length) == head.crc;
+}
+
+#endif /* CODEC_DECODER */
@@ -0,0 +1,173 @@
+/**
+  ******************************************************************************
+  * @file           : trigger.c
+  * @brief          : Trigger conditions of the edge engine
+  ******************************************************************************
+  * trigger_check() sees every EXTI interrupt's levels and changed mask,
+  * the same inputs the event formats pack, so a condition costs a few
+  * compares per interrupt while armed and nothing otherwise. The ring
+  * retention and the stream gating live with the ring in main.c.
+  ******************************************************************************
+  */
+
+#include "trigger.h"
+
+#if TRIGGER_OUT
+#define TRIGGER_OUT_PIN GPIO_PIN_0      // PA0, TIM2 CH1 without a remap
+#endif
+
+static uint32_t trig_type = TRIG_OFF;
+static uint32_t trig_channel;
+static uint32_t trig_value;
+static uint32_t trig_mask;
+static uint32_t trig_param;
+
+static uint32_t matched;             // TRIG_PATTERN: the pattern held at the last edge
+static uint32_t edges_seen;          // TRIG_COUNT: matching edges since arming
+static uint32_t pulse_start;         // TRIG_LONGER/SHORTER: time of the channel's last edge
+static uint32_t pulse_known;         // ...once an edge has been seen since arming
+
+/**
+ * @brief Selects the condition; called from the host command parser (main
+ *        loop), with the trigger disarmed
+ * @param type - TRIG_* without TRIG_REARM
+ * @param channel - probe channel 0-3 of the edge, pulse and count types
+ * @param value - edge polarity, pulse level or pattern levels
+ * @param mask - channels the pattern looks at
+ * @param param - pulse width in ticks, or edge count
+ * @retval none
+ */
+void trigger_configure(uint32_t type, uint32_t channel, uint32_t value, uint32_t mask,
+                       uint32_t param)
+{
+    trig_type = type;
+    trig_channel = channel & 0x03;
+    trig_value = value;
+    trig_mask = mask & 0x0F;
+    trig_param = param;
+}
+
+/**
+ * @brief Restarts the condition's state; called with IRQs masked
+ * @param levels - current CH1-CH4 levels, bit n = channel n
+ * @retval none
+ */
+void trigger_arm(uint32_t levels)
+{
+    matched = (levels & trig_mask) == (trig_value & trig_mask);  // a pattern already present does not fire
+    edges_seen = 0;
+    pulse_known = 0;
+#if TRIGGER_OUT == TRIGGER_OUT_COMPARE
+    TIM2->CCMR1 = (TIM2->CCMR1 & ~TIM_CCMR1_OC1M) | TIM_CCMR1_OC1M_2;   // forced low
+#elif TRIGGER_OUT
+    GPIOA->BRR = TRIGGER_OUT_PIN;
+#endif
+}
+
+static uint32_t polarity_ok(uint32_t levels)
+{
+    return trig_value > 1 || ((levels >> trig_channel) & 1) == trig_value;
+}
+
+/**
+ * @brief Evaluates the armed condition on one EXTI interrupt; called from
+ *        the EXTI ISR
+ * @param levels - CH1-CH4 levels after the edges, bit n = channel n
+ * @param changed - channels with an edge, bit n = channel n
+ * @param time - 32-bit clock time of the edges
+ * @retval 1 if the trigger fires on these edges
+ */
+uint32_t trigger_check(uint32_t levels, uint32_t changed, uint32_t time)
+{
+    uint32_t hit = (changed >> trig_channel) & 1;
+
+    switch (trig_type)
+    {
+    case TRIG_EDGE:
+        return hit && polarity_ok(levels);
+
+    case TRIG_PATTERN:
+    {
+        uint32_t was = matched;
+        matched = (levels & trig_mask) == (trig_value & trig_mask);
+        return matched && !was;
+    }
+
+    case TRIG_LONGER:
+    case TRIG_SHORTER:
+    {
+        if (!hit) return 0;
+        uint32_t width = time - pulse_start;
+        uint32_t ended = ((levels >> trig_channel) & 1) ^ 1;  // level the pulse had
+        uint32_t fire = pulse_known && ended == trig_value &&
+                        (trig_type == TRIG_LONGER ? width > trig_param : width < trig_param);
+        pulse_start = time;
+        pulse_known = 1;
+        return fire;
+    }
+
+    case TRIG_COUNT:
+        return hit && polarity_ok(levels) && ++edges_seen >= trig_param;  // 0 acts as 1
+
+    default:
+        return 0;
+    }
+}
+
+#if TRIGGER_OUT
+/**
+ * @brief Drives PA0 low, as a push-pull output or as TIM2 CH1; called
+ *        once at start-up
+ * @retval none
+ */
+void trigger_out_init(void)
+{
+    GPIO_InitTypeDef GPIO_InitStruct = {0};
+
+    __HAL_RCC_GPIOA_CLK_ENABLE();
+    GPIOA->BRR = TRIGGER_OUT_PIN;
+    GPIO_InitStruct.Pin = TRIGGER_OUT_PIN;
+    GPIO_InitStruct.Mode = TRIGGER_OUT == TRIGGER_OUT_COMPARE ? GPIO_MODE_AF_PP : GPIO_MODE_OUTPUT_PP;
+    GPIO_InitStruct.Speed = GPIO_SPEED_FREQ_HIGH;
+    HAL_GPIO_Init(GPIOA, &GPIO_InitStruct);
+#if TRIGGER_OUT == TRIGGER_OUT_COMPARE
+    TIM2->CCMR1 = (TIM2->CCMR1 & ~(TIM_CCMR1_CC1S | TIM_CCMR1_OC1PE | TIM_CCMR1_OC1M)) |
+                  TIM_CCMR1_OC1M_2;     // output, no preload, forced low
+    TIM2->CCER = (TIM2->CCER & ~TIM_CCER_CC1P) | TIM_CCER_CC1E;
+#endif
+}
+
+/**
+ * @brief Raises PA0 for a trigger that fired; called from the EXTI ISR
+ *        right after trigger_check
+ * @param time - 32-bit clock time of the trigger edges
+ * @retval ticks from time to PA0 rising | TRIG_OUT_* flags << 16
+ */
+uint32_t trigger_out_fire(uint32_t time)
+{
+#if TRIGGER_OUT == TRIGGER_OUT_COMPARE
+    uint16_t target = (uint16_t)(time + TRIGGER_OUT_DELAY);
+    uint16_t now;
+
+    // Active on match, first against a compare time already gone, so
+    // that CC1IF only ever flags the target's match
+    TIM2->CCR1 = (uint16_t)(time - 1);
+    TIM2->CCMR1 = (TIM2->CCMR1 & ~TIM_CCMR1_OC1M) | TIM_CCMR1_OC1M_0;
+    TIM2->SR = ~TIM_SR_CC1IF;
+    TIM2->CCR1 = target;
+    now = TIM2->CNT;    // read before the flag: a match before it has set it
+    if ((uint16_t)(now - target - 1) < 0x7FFF && !(TIM2->SR & TIM_SR_CC1IF))
+    {
+        TIM2->CCMR1 = (TIM2->CCMR1 & ~TIM_CCMR1_OC1M) | TIM_CCMR1_OC1M_2 | TIM_CCMR1_OC1M_0;   // forced high
+        return (uint16_t)(TIM2->CNT - (uint16_t)time) | ((TRIG_OUT_COMPARE | TRIG_OUT_LATE) << 16);
+    }
+    return TRIGGER_OUT_DELAY | (TRIG_OUT_COMPARE << 16);
+#else
+    uint32_t ticks;
+
+    GPIOA->BSRR = TRIGGER_OUT_PIN;
+    ticks = get_32bit_timer() - time;
+    return ticks < 0xFFFF ? ticks : 0xFFFF;
+#endif
+}
+#endif
@@ -0,0 +1,250 @@
+/**
+  ******************************************************************************
+  * @file           : uart_decode.c
+  * @brief          : On-device UART decoding of one probe channel
+  ******************************************************************************
+  * The receiver keeps the line level after the last edge. Bit k of a
+  * frame is centred (2k + 1) / 2 bit times after the start edge; every
+  * centre that lies before a new edge (or before the time passed to
+  * uart_decode_poll) is sampled at the level the line had until then.
+  * Bit times are in 1/256 ticks, so rates with few ticks per bit do not
+  * drift across the frame.
+  ******************************************************************************
+  */
+
+#include "uart_decode.h"
+#include "event_format.h"
+#include "pin_map.h"
+#if OLED_STATUS
+#include "oled_status.h"
+#endif
+
+volatile uint32_t uart_decode_mask = 0;
+
+static uint32_t uart_channel = UART_DECODE_OFF;
+static uint32_t uart_bit_q8;            // ticks per bit << 8
+static uint32_t uart_data_bits = 8;
+static uint32_t uart_parity = UART_PARITY_NONE;
+static uint32_t uart_frame_bits;        // start, data, parity and stop bit
+
+static uint32_t line_level = 1;         // channel level after its last edge
+static uint32_t in_frame = 0;
+static uint32_t start_time;             // clock time of the start edge
+static uint32_t next_bit;               // next bit of the frame to sample
+static uint32_t next_centre;            // its centre, ticks after start_time
+static uint32_t value;
+static uint32_t ones;                   // 1 bits among data and parity
+
+static uint32_t filter_match;           // 'X' first byte filter, mask 0 keeps all
+static uint32_t filter_mask;
+static uint32_t filter_gap = 2;         // frame times of idle line ending a message
+static uint32_t gap_ticks;
+static uint32_t last_end;               // clock time the last frame ended
+static uint32_t dropping;               // the message in progress is filtered out
+static uint32_t dropped;                // messages dropped since the last report
+static uint32_t report_time;            // clock time of the last report
+
+static uint32_t channel_level(uint32_t channel)
+{
+    return (pin_map_channels(GPIOB->IDR) >> channel) & 1;
+}
+
+/**
+ * @brief Pushes the dropped message count as a BUS_FILTER record
+ */
+static void uart_report(uint32_t time)
+{
+    uint32_t words[MARKER_BUS_WORDS] = {
+        time,
+        dropped | (FILTER_UART << 16) | (BUS_FILTER << 24)
+    };
+    capture_push_record(event_pack_marker(MARKER_BUS, 0), words, MARKER_BUS_WORDS);
+    dropped = 0;
+    report_time = time;
+}
+
+/**
+ * @brief Whether the completed frame belongs to a dropped message; the
+ *        first byte after an idle gap decides for the whole message
+ */
+static uint32_t uart_filtered(void)
+{
+    uint32_t first = start_time - last_end >= gap_ticks;
+
+    last_end = start_time + ((uart_frame_bits * uart_bit_q8) >> 8);
+    if (!first) return dropping;
+    dropping = (value & filter_mask) != (filter_match & filter_mask);
+    if (dropping)
+    {
+        if (++dropped == 0xFFFF) uart_report(start_time);
+    }
+    else if (dropped)
+    {
+        uart_report(start_time);
+    }
+    return dropping;
+}
+
+/**
+ * @brief Pushes the completed frame as a MARKER_UART record
+ */
+static void uart_emit(uint32_t stop)
+{
+    if (filter_mask && uart_filtered()) return;
+
+    uint32_t status = stop ? 0 : UART_STATUS_FRAMING;
+    if (uart_parity != UART_PARITY_NONE && (ones & 1) != (uart_parity == UART_PARITY_ODD))
+    {
+        status |= UART_STATUS_PARITY;
+    }
+
+    uint32_t words[MARKER_UART_WORDS] = {
+        start_time,
+        value | (status << 8) | (uart_channel << 16)
+    };
+    capture_push_record(event_pack_marker(MARKER_UART, 0), words, MARKER_UART_WORDS);
+#if OLED_STATUS
+    oled_status_uart(value, status);
+#endif
+}
+
+/**
+ * @brief Samples the frame's bit centres that lie before time at the
+ *        current line level
+ */
+static void uart_sample_until(uint32_t time)
+{
+    while (in_frame && time - start_time > next_centre)
+    {
+        uint32_t bit = next_bit++;
+        next_centre = ((2 * next_bit + 1) * uart_bit_q8) >> 9;
+
+        if (bit == 0)
+        {
+            if (line_level) in_frame = 0;  // glitch: the start bit did not last
+        }
+        else if (bit <= uart_data_bits)
+        {
+            value |= line_level << (bit - 1);  // LSB first
+            ones += line_level;
+        }
+        else if (bit < uart_frame_bits - 1)
+        {
+            ones += line_level;  // parity bit
+        }
+        else
+        {
+            uart_emit(line_level);
+            in_frame = 0;
+        }
+    }
+}
+
+/**
+ * @brief Selects the decoded channel and its frame; called from the host
+ *        command parser (main loop)
+ * @param channel - probe channel 0-3, UART_DECODE_OFF to stop decoding
+ * @param bit_q8 - bit time in capture clock ticks << 8
+ * @param frame - 'U' frame byte, see uart_decode.h
+ * @retval none
+ */
+void uart_decode_configure(uint32_t channel, uint32_t bit_q8, uint32_t frame)
+{
+    uint32_t data_bits = UART_FRAME_BITS(frame);
+    uint32_t parity = UART_FRAME_PARITY(frame);
+
+    if (channel > 3 || bit_q8 < (2 << 8) || data_bits < 5 || data_bits > 9 ||
+        parity > UART_PARITY_ODD)
+    {
+        channel = UART_DECODE_OFF;
+    }
+
+    __disable_irq();
+    uart_channel = channel;
+    uart_bit_q8 = bit_q8;
+    uart_data_bits = data_bits;
+    uart_parity = parity;
+    uart_frame_bits = 1 + data_bits + (parity != UART_PARITY_NONE) + 1;
+    gap_ticks = ((uint64_t)filter_gap * uart_frame_bits * bit_q8) >> 8;
+    uart_decode_mask = channel == UART_DECODE_OFF ? 0 : 1UL << channel;
+    uart_decode_reset();
+    __enable_irq();
+}
+
+/**
+ * @brief Feeds one edge of the decoded channel; called from the EXTI ISR
+ * @param level - line level after the edge
+ * @param time - 32-bit clock time of the edge
+ * @retval none
+ */
+void uart_decode_edge(uint32_t level, uint32_t time)
+{
+    uart_sample_until(time);
+    line_level = level;
+    if (!in_frame && level == 0)
+    {
+        in_frame = 1;
+        start_time = time;
+        next_bit = 0;
+        next_centre = uart_bit_q8 >> 9;
+        value = 0;
+        ones = 0;
+    }
+}
+
+/**
+ * @brief Samples the bit centres that passed without an edge, so a frame
+ *        ending in high bits completes; called from the main loop with
+ *        IRQs masked
+ * @param now - get_32bit_timer() value read before masking
+ * @retval none
+ */
+void uart_decode_poll(uint32_t now)
+{
+    // an edge still pending in EXTI happened before now: let the ISR run first
+    if (!in_frame || (EXTI->PR & pin_map_lines(uart_decode_mask))) return;
+    uart_sample_until(now);
+}
+
+/**
+ * @brief Sets the message filter (host command 'X' FILTER_UART); called
+ *        with IRQs masked. A count still unreported goes out first
+ * @param match - first byte the kept messages have
+ * @param mask - first byte bits compared, 0 keeps every message
+ * @param gap - idle frame times that end a message, 0 for 2
+ * @retval none
+ */
+void uart_decode_filter(uint32_t match, uint32_t mask, uint32_t gap)
+{
+    if (dropped) uart_report(get_32bit_timer());
+    filter_match = match & 0x1FF;
+    filter_mask = mask & 0x1FF;
+    filter_gap = gap ? gap : 2;
+    gap_ticks = ((uint64_t)filter_gap * uart_frame_bits * uart_bit_q8) >> 8;
+    uart_decode_reset();
+}
+
+/**
+ * @brief Reports the messages dropped since the last report once it is
+ *        ticks old; called from the main loop with IRQs masked
+ * @param now - get_32bit_timer() value
+ * @param ticks - clock ticks between reports
+ * @retval none
+ */
+void uart_decode_filter_poll(uint32_t now, uint32_t ticks)
+{
+    if (dropped && now - report_time >= ticks) uart_report(now);
+}
+
+/**
+ * @brief Drops a frame in progress and takes the line level from the pin;
+ *        called with IRQs masked
+ * @retval none
+ */
+void uart_decode_reset(void)
+{
+    in_frame = 0;
+    dropping = 0;
+    last_end = get_32bit_timer() - gap_ticks;  // the next byte starts a message
+    if (uart_channel != UART_DECODE_OFF) line_level = channel_level(uart_channel);
+}
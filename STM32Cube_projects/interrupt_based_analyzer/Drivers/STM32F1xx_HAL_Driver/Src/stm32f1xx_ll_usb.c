@@ -2813,8 +2813,9 @@ HAL_StatusTypeDef USB_DeActivateRemoteWakeup(USB_TypeDef *USBx)
   * @param   wPMABufAddr address into PMA.
   * @param   wNBytes no. of bytes to be copied.
   * @retval None
+  * @note  Weak: usbd_conf.c replaces it with USB_FAST_PMA or IRQ_TIMING
   */
-void USB_WritePMA(USB_TypeDef const *USBx, uint8_t *pbUsrBuf, uint16_t wPMABufAddr, uint16_t wNBytes)
+__weak void USB_WritePMA(USB_TypeDef const *USBx, uint8_t *pbUsrBuf, uint16_t wPMABufAddr, uint16_t wNBytes)
 {
   uint32_t n = ((uint32_t)wNBytes + 1U) >> 1;
   uint32_t BaseAddr = (uint32_t)USBx;
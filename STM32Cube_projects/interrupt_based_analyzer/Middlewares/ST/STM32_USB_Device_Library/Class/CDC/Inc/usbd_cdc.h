@@ -42,7 +42,11 @@ extern "C" {
   * @{
   */
 #define CDC_IN_EP                                   0x81U  /* EP1 for data IN */
+#if USB_IN_DOUBLE_BUFFER
+#define CDC_OUT_EP                                  0x03U  /* EP3 for data OUT, EP1 is double-buffered IN */
+#else
 #define CDC_OUT_EP                                  0x01U  /* EP1 for data OUT */
+#endif
 #define CDC_CMD_EP                                  0x82U  /* EP2 for CDC commands */
 
 #ifndef CDC_HS_BINTERVAL
@@ -104,6 +108,7 @@ typedef struct _USBD_CDC_Itf
   int8_t (* DeInit)(void);
   int8_t (* Control)(uint8_t cmd, uint8_t *pbuf, uint16_t length);
   int8_t (* Receive)(uint8_t *Buf, uint32_t *Len);
+  int8_t (* TransmitCplt)(uint8_t *Buf, uint32_t *Len, uint8_t epnum);
 
 } USBD_CDC_ItfTypeDef;
 
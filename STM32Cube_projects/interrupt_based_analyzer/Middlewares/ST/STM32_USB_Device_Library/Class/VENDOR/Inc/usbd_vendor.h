@@ -0,0 +1,188 @@
+/**
+  ******************************************************************************
+  * @file    usbd_vendor.h
+  * @brief   Header file for usbd_vendor.c
+  ******************************************************************************
+  * Vendor-specific class: one interface (class 0xFF) with a bulk IN and a
+  * bulk OUT endpoint and nothing else, so the host talks to it through
+  * libusb/WinUSB instead of a serial driver. Windows binds WinUSB without
+  * an INF through the Microsoft OS 1.0 descriptors in usbd_desc.c. The
+  * API mirrors usbd_cdc.h so usbd_cdc_if.c can drive either class.
+  *
+  * The class also describes a high-speed configuration with 512-byte
+  * bulk packets, for a port to a core with a high-speed PHY (the V2
+  * board's USB3300 on an H7 OTG_HS). The F103 always enumerates at full
+  * speed. The receive buffer set with USBD_VENDOR_SetRxBuffer must hold
+  * one packet at the enumerated speed.
+  *
+  * With USB_ISO_STREAM the interface has two alternate settings instead:
+  * 0 with only the bulk OUT endpoint, the default that reserves no
+  * bandwidth, and 1 that adds an isochronous IN endpoint of
+  * VENDOR_ISO_PACKET_SIZE bytes per frame. The host selects 1 to stream.
+  * An isochronous transfer goes out as one packet per frame and a packet
+  * the host misses is not resent.
+  *
+  * With USB_CONTROL_EP the configuration has a second vendor interface,
+  * 1, whose only endpoint is an interrupt IN endpoint for replies and
+  * telemetry. The host polls it every (micro)frame from bandwidth the
+  * bus reserves, so a reply does not wait behind the bulk stream.
+  * Windows binds WinUSB to each interface of the composite device.
+  *
+  * With USB_STRIPE_EPS 2 or 3 the interface has that many bulk IN
+  * endpoints (EP1, EP3, EP4) and each transfer is striped across them,
+  * so a host controller that schedules few transactions per endpoint
+  * per frame keeps several busy. The transfer is cut into
+  * VENDOR_STRIPE_CHUNK chunks; chunk j goes on stripe j % USB_STRIPE_EPS
+  * and every endpoint sends its chunks in order. The last chunk is
+  * shorter than VENDOR_STRIPE_CHUNK (a ZLP if the transfer is a
+  * multiple of it), and a short chunk that is a multiple of the packet
+  * size ends with a ZLP, so a host that reads VENDOR_STRIPE_CHUNK bytes
+  * from each endpoint in turn gets the transfer back in order and knows
+  * where it ends. Each transfer starts again on EP1.
+  ******************************************************************************
+  */
+
+/* Define to prevent recursive inclusion -------------------------------------*/
+#ifndef __USB_VENDOR_H
+#define __USB_VENDOR_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Includes ------------------------------------------------------------------*/
+#include  "usbd_ioreq.h"
+
+/** @addtogroup STM32_USB_DEVICE_LIBRARY
+  * @{
+  */
+
+/** @defgroup usbd_vendor
+  * @brief This file is the Header file for usbd_vendor.c
+  * @{
+  */
+
+
+/** @defgroup usbd_vendor_Exported_Defines
+  * @{
+  */
+#ifndef USB_ISO_STREAM
+#define USB_ISO_STREAM                              0
+#endif
+
+#define VENDOR_IN_EP                                0x81U  /* EP1 for data IN */
+#if USB_IN_DOUBLE_BUFFER || USB_ISO_STREAM
+#define VENDOR_OUT_EP                               0x03U  /* EP3 for data OUT, EP1 is double-buffered IN */
+#else
+#define VENDOR_OUT_EP                               0x01U  /* EP1 for data OUT */
+#endif
+
+#define VENDOR_DATA_FS_MAX_PACKET_SIZE              64U    /* Endpoint IN & OUT Packet size */
+#define VENDOR_DATA_HS_MAX_PACKET_SIZE              512U   /* Endpoint IN & OUT Packet size */
+
+#define VENDOR_ISO_PACKET_SIZE                      128U   /* Isochronous IN packet, both PMA buffers fit */
+
+#ifndef USB_CONTROL_EP
+#define USB_CONTROL_EP                              0
+#endif
+#ifndef USB_STRIPE_EPS
+#define USB_STRIPE_EPS                              1
+#endif
+
+#define VENDOR_STRIPE1_EP                           0x83U  /* EP3 for the second stripe IN */
+#define VENDOR_STRIPE2_EP                           0x84U  /* EP4 for the third stripe IN */
+#define VENDOR_STRIPE_CHUNK                         512U   /* bytes per chunk, a multiple of both speeds' packet */
+
+#define VENDOR_CTRL_EP                              0x82U  /* EP2 for replies and telemetry IN */
+#define VENDOR_CTRL_PACKET_SIZE                     32U    /* Interrupt IN packet, both speeds */
+
+#if USB_ISO_STREAM
+#define USB_VENDOR_CONFIG_DESC_SIZ                  (48U + 16U * USB_CONTROL_EP)
+#else
+#define USB_VENDOR_CONFIG_DESC_SIZ                  (32U + 16U * USB_CONTROL_EP + 7U * (USB_STRIPE_EPS - 1U))
+#endif
+
+/**
+  * @}
+  */
+
+
+/** @defgroup USBD_CORE_Exported_TypesDefinitions
+  * @{
+  */
+
+typedef struct _USBD_VENDOR_Itf
+{
+  int8_t (* Init)(void);
+  int8_t (* DeInit)(void);
+  int8_t (* Receive)(uint8_t *Buf, uint32_t *Len);
+  int8_t (* TransmitCplt)(uint8_t *Buf, uint32_t *Len, uint8_t epnum);
+
+} USBD_VENDOR_ItfTypeDef;
+
+
+typedef struct
+{
+  uint8_t  *RxBuffer;
+  uint8_t  *TxBuffer;
+  uint32_t RxLength;
+  uint32_t TxLength;
+  uint32_t TxSent;      /* isochronous transfer: bytes already in packets */
+  uint32_t AltSetting;
+
+  __IO uint32_t TxState;
+  __IO uint32_t CtrlState;  /* a transfer is on VENDOR_CTRL_EP */
+  uint32_t StripeChunk[3];  /* next chunk of each stripe's endpoint */
+  __IO uint32_t StripeBusy; /* bit n: a chunk is on stripe n */
+}
+USBD_VENDOR_HandleTypeDef;
+
+/**
+  * @}
+  */
+
+/** @defgroup USBD_CORE_Exported_Variables
+  * @{
+  */
+
+extern USBD_ClassTypeDef  USBD_VENDOR;
+#define USBD_VENDOR_CLASS    &USBD_VENDOR
+/**
+  * @}
+  */
+
+/** @defgroup USB_CORE_Exported_Functions
+  * @{
+  */
+uint8_t  USBD_VENDOR_RegisterInterface(USBD_HandleTypeDef   *pdev,
+                                       USBD_VENDOR_ItfTypeDef *fops);
+
+uint8_t  USBD_VENDOR_SetTxBuffer(USBD_HandleTypeDef   *pdev,
+                                 uint8_t  *pbuff,
+                                 uint16_t length);
+
+uint8_t  USBD_VENDOR_SetRxBuffer(USBD_HandleTypeDef   *pdev,
+                                 uint8_t  *pbuff);
+
+uint8_t  USBD_VENDOR_ReceivePacket(USBD_HandleTypeDef *pdev);
+
+uint8_t  USBD_VENDOR_TransmitPacket(USBD_HandleTypeDef *pdev);
+
+uint8_t  USBD_VENDOR_TransmitControl(USBD_HandleTypeDef *pdev,
+                                     uint8_t *pbuff, uint16_t length);
+/**
+  * @}
+  */
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif  /* __USB_VENDOR_H */
+/**
+  * @}
+  */
+
+/**
+  * @}
+  */
@@ -0,0 +1,412 @@
+/**
+  ******************************************************************************
+  * @file           : codec_check.c
+  * @brief          : Host cross-check of the compact encoder and the codec
+  ******************************************************************************
+  * Feeds random ring words through the firmware's encoder,
+  * Core/Src/event_format.c, packet by packet as capture_compact_fill
+  * does, and decodes the bytes with Core/Src/stream_codec.c, the decoder
+  * the host's stream_codec library runs. The words are:
+  *   edges  a steady clock on CH1 (CLOCK_HALF ticks per level, now and
+  *          then off by a few ticks) and random edges on CH2-CH4, one
+  *          gap in WRAP_ODDS most of an epoch long, with the epoch
+  *          markers a wrap sends
+  *   markers  one in MARKER_ODDS words, of every type with payload
+  *          words: drop, info, SOF, UART, window, trigger and bus
+  * The stream goes through twice: as one byte stream read in random
+  * pieces, records straddling them, and framed, each packet behind a
+  * StreamFrame header whose CRC codec_frame_check checks. On the framed
+  * pass the encoder restarts its edge model with each packet, as a
+  * STREAM_FRAMED build does, and the decoder at the same record. Every
+  * edge and marker must come back with its full time. codec_crc32 is
+  * also checked against a model of the F103 CRC unit, a bit at a time,
+  * and the pulse word against its anchor rule.
+  *
+  * Build and run from interrupt_based_analyzer, once per encoder build:
+  *   cc -O2 -DHOST_SIM -DSTREAM_COMPACT=1 -DSTREAM_PREDICT=1 -I Sim -I Core/Inc -o codec_check Sim/codec_check.c Core/Src/event_format.c Core/Src/stream_codec.c
+  *   ./codec_check [events] [seed]
+  * and again with -DSTREAM_PREDICT=0. One row per pass; the exit status
+  * is 1 if any check failed.
+  ******************************************************************************
+  */
+
+#include "stream_codec.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#if !STREAM_COMPACT
+#error "build with -DSTREAM_COMPACT=1: the encoder is the compact one"
+#endif
+
+#define CLOCK_HALF 180          // ticks per level of the CH1 clock: 200 kHz at 72 MHz
+#define CLOCK_JITTER_ODDS 16    // one clock edge in this many is off by up to JITTER ticks
+#define JITTER 5
+#define OTHER_GAP 4000          // longest gap between two edges of CH2-CH4
+#define WRAP_ODDS 20000         // one gap in this many is up to 2^30 ticks
+#define MARKER_ODDS 200
+#define PACKET_MIN 64           // fewest bytes a packet asks for
+#define READ_MAX 512            // most bytes the host reads at once, unframed
+#define PULSE_CHECKS 100000
+
+typedef struct
+{
+    int64_t time;
+    uint32_t level;
+    uint32_t ch;
+} Edge;
+
+static uint32_t rng_state;
+static uint32_t *words;
+static uint32_t word_count;
+static Edge *want_edges;
+static uint32_t want_edge_count;
+static CodecMarker *want_markers;
+static uint32_t want_marker_count;
+
+/* Generator: the clock it runs on, as the encoder sees it */
+static uint64_t now;
+static uint64_t last_record;    // time of the last record the encoder writes
+static uint32_t gen_epoch;
+static uint32_t levels[CODEC_CHANNELS];
+
+static uint32_t rng(void)
+{
+    rng_state ^= rng_state << 13;
+    rng_state ^= rng_state >> 17;
+    rng_state ^= rng_state << 5;
+    return rng_state;
+}
+
+static void push_edge(uint32_t ch, uint64_t t)
+{
+    while ((t >> EVENT_TIME_BITS) > gen_epoch)
+    {
+        words[word_count++] = event_pack_marker(MARKER_EPOCH, 0);
+        gen_epoch++;
+    }
+    levels[ch] ^= 1;
+    uint32_t word = event_pack_edge(levels[ch], ch, (uint32_t)t);
+    Edge *edge = &want_edges[want_edge_count++];
+    edge->time = (int64_t)(((uint64_t)gen_epoch << EVENT_TIME_BITS) | (word & EVENT_TIME_MASK));
+    edge->level = levels[ch];
+    edge->ch = ch;
+    words[word_count++] = word;
+    now = t;
+    last_record = (uint64_t)edge->time;
+}
+
+static void push_marker(uint32_t type)
+{
+    CodecMarker *marker = &want_markers[want_marker_count++];
+    uint32_t *w = &words[word_count];
+
+    memset(marker, 0, sizeof(*marker));
+    marker->type = type;
+    w[0] = event_pack_marker(type, 0);
+    if (type == MARKER_DROP || type == MARKER_WINDOW)
+    {
+        uint64_t first = now + 1 + rng() % 1000;
+        uint64_t last = first + rng() % 100000;
+        w[1] = rng() % 5000;
+        w[2] = (uint32_t)first;
+        w[3] = (uint32_t)last;
+        marker->time = (int64_t)first;
+        marker->words[0] = w[1];
+        marker->words[1] = last - first;
+        now = last_record = last;
+        gen_epoch = (uint32_t)(last >> EVENT_TIME_BITS);  // the encoder resyncs from the clock
+    }
+    else if (type == MARKER_INFO)
+    {
+        for (uint32_t i = 0; i < MARKER_INFO_WORDS; i++)
+        {
+            w[1 + i] = rng();
+            marker->words[i] = w[1 + i];
+        }
+        marker->time = (int64_t)last_record;
+    }
+    else if (type == MARKER_SOF)
+    {
+        uint64_t latched = now - rng() % 2000;
+        w[1] = rng() & 0x7FF;
+        w[2] = (uint32_t)latched;
+        marker->time = (int64_t)latched;
+        marker->words[0] = w[1];
+        last_record = latched;
+    }
+    else if (type == MARKER_TRIGGER)
+    {
+        w[1] = (uint32_t)now;
+        marker->time = (int64_t)now;
+        last_record = now;
+    }
+    else  // UART, bus: clock time, data word
+    {
+        uint64_t start = now - rng() % 2000;
+        w[1] = (uint32_t)start;
+        w[2] = rng();
+        marker->time = (int64_t)start;
+        marker->words[0] = w[2];
+        last_record = start;
+    }
+    word_count += 1 + event_marker_words(type);
+}
+
+/**
+ * @brief Fills words with events of the generator, carrying on from
+ *        where the last call left it
+ */
+static void generate(uint32_t events)
+{
+    uint64_t next[CODEC_CHANNELS];
+
+    word_count = want_edge_count = want_marker_count = 0;
+    for (uint32_t ch = 0; ch < CODEC_CHANNELS; ch++)
+    {
+        next[ch] = now + 1 + rng() % OTHER_GAP;
+    }
+    while (want_edge_count + want_marker_count < events)
+    {
+        if (rng() % MARKER_ODDS == 0)
+        {
+            push_marker(MARKER_DROP + rng() % (MARKER_BUS - MARKER_DROP + 1));
+            for (uint32_t ch = 0; ch < CODEC_CHANNELS; ch++)
+            {
+                if (next[ch] <= now) next[ch] = now + 1 + rng() % OTHER_GAP;
+            }
+            continue;
+        }
+        uint32_t ch = 0;
+        for (uint32_t c = 1; c < CODEC_CHANNELS; c++)
+        {
+            if (next[c] < next[ch]) ch = c;
+        }
+        push_edge(ch, next[ch]);
+        if (ch == 0)
+        {
+            int32_t jitter = rng() % CLOCK_JITTER_ODDS ? 0 : (int32_t)(rng() % (2 * JITTER + 1)) - JITTER;
+            next[0] = now + CLOCK_HALF + jitter;
+        }
+        else
+        {
+            next[ch] = now + 1 + (rng() % WRAP_ODDS ? rng() % OTHER_GAP : rng() % (1UL << 30));
+        }
+    }
+}
+
+/* The F103 CRC unit as RM0008 gives it: each word shifted in MSB first */
+static uint32_t unit_crc(uint32_t crc, const uint8_t *data, uint32_t length)
+{
+    for (uint32_t i = 0; i < length; i += 4)
+    {
+        uint32_t word = 0;
+        memcpy(&word, data + i, length - i < 4 ? length - i : 4);
+        crc ^= word;
+        for (int32_t bit = 0; bit < 32; bit++)
+        {
+            crc = crc & 0x80000000 ? (crc << 1) ^ 0x04C11DB7 : crc << 1;
+        }
+    }
+    return crc;
+}
+
+/**
+ * @brief Encodes words into stream packet by packet, as
+ *        capture_compact_fill does
+ * @param framed - put a StreamFrame header in front of each packet
+ * @retval stream bytes
+ */
+static uint32_t encode(uint8_t *stream, uint32_t framed, uint32_t *crc_errors)
+{
+    static uint8_t out[USB_TX_MAX_BYTES + COMPACT_MAX_RECORD];
+    static uint8_t carry_buf[COMPACT_MAX_RECORD];
+    uint32_t carry = 0;
+    uint32_t taken = 0;
+    uint32_t offset = 0;
+    uint32_t at = 0;
+
+    while (taken < word_count || carry)
+    {
+        uint32_t size = PACKET_MIN + rng() % (USB_TX_MAX_BYTES - PACKET_MIN + 1);
+        uint32_t len = carry;
+
+        memcpy(out, carry_buf, carry);
+#if STREAM_PREDICT
+        if (framed) event_compact_frame(out + size);
+#endif
+        while (taken < word_count && len < size)
+        {
+            len += event_compact_encode(words[taken++], out + len);
+        }
+        len += event_compact_flush(out + len);
+        uint32_t send = len < size ? len : size;
+        carry = len - send;
+        memcpy(carry_buf, out + send, carry);
+
+        if (framed)
+        {
+            StreamFrame frame = { FRAME_SYNC, (uint16_t)send, offset, 0 };
+            memcpy(stream + at, &frame, sizeof(frame));
+            frame.crc = codec_crc32(codec_crc32(0xFFFFFFFF, stream + at, 8), out, send);
+            if (frame.crc != unit_crc(unit_crc(0xFFFFFFFF, stream + at, 8), out, send)) ++*crc_errors;
+            memcpy(stream + at, &frame, sizeof(frame));
+            at += sizeof(frame);
+            offset += send;
+        }
+        memcpy(stream + at, out, send);
+        at += send;
+    }
+    return at;
+}
+
+static int32_t check_pass(const char *name, uint32_t framed)
+{
+    static CodecDecoder dec;
+    uint8_t *stream = malloc((size_t)word_count * 24 + 4096);
+    uint8_t *pending = malloc((size_t)word_count * 24 + 4096);
+    Edge *got_edges = malloc(sizeof(Edge) * ((size_t)want_edge_count + 1));
+    CodecMarker *got_markers = malloc(sizeof(CodecMarker) * ((size_t)want_marker_count + 1));
+    uint32_t room = 8 * (USB_TX_MAX_BYTES + READ_MAX + COMPACT_MAX_RECORD) + CODEC_RUN_MAX;
+    int64_t *times = malloc(sizeof(int64_t) * room);
+    uint8_t *lv = malloc(room);
+    uint8_t *chs = malloc(room);
+    CodecMarker *markers = malloc(sizeof(CodecMarker) * room);
+    uint32_t crc_errors = 0, frame_errors = 0;
+    uint32_t got_edge_count = 0, got_marker_count = 0;
+    uint32_t pending_len = 0;
+    clock_t decode_clock = 0;
+    int32_t failed = 0;
+
+    event_compact_restart();
+    codec_decoder_restart(&dec, STREAM_PREDICT);
+    uint32_t bytes = encode(stream, framed, &crc_errors);
+
+    for (uint32_t at = 0; at < bytes;)
+    {
+        uint32_t take;
+        if (framed)
+        {
+            StreamFrame frame;
+            memcpy(&frame, stream + at, sizeof(frame));
+            if (!codec_frame_check(stream + at, frame.length)) frame_errors++;
+            at += sizeof(frame);
+            take = frame.length;
+            codec_decoder_frame(&dec, pending_len);
+        }
+        else
+        {
+            take = 1 + rng() % READ_MAX;
+            if (take > bytes - at) take = bytes - at;
+        }
+        memcpy(pending + pending_len, stream + at, take);
+        pending_len += take;
+        at += take;
+
+        CodecOutput out = { times, lv, chs, 0, room, markers, 0, room };
+        clock_t start = clock();
+        uint32_t used = codec_decode(&dec, pending, pending_len, &out);
+        decode_clock += clock() - start;
+        memmove(pending, pending + used, pending_len - used);
+        pending_len -= used;
+
+        for (uint32_t i = 0; i < out.edges && got_edge_count < want_edge_count; i++)
+        {
+            got_edges[got_edge_count++] = (Edge){ times[i], lv[i], chs[i] };
+        }
+        for (uint32_t i = 0; i < out.marker_count && got_marker_count < want_marker_count; i++)
+        {
+            got_markers[got_marker_count++] = markers[i];
+        }
+    }
+
+    uint32_t edge_errors = got_edge_count != want_edge_count || pending_len;
+    for (uint32_t i = 0; i < got_edge_count; i++)
+    {
+        const Edge *a = &got_edges[i], *b = &want_edges[i];
+        if (a->time != b->time || a->level != b->level || a->ch != b->ch)
+        {
+            if (!edge_errors++)
+            {
+                printf("  edge %u: got ch %u level %u at %lld, sent ch %u level %u at %lld\n", i,
+                       a->ch, a->level, (long long)a->time, b->ch, b->level, (long long)b->time);
+            }
+        }
+    }
+    uint32_t marker_errors = got_marker_count != want_marker_count;
+    for (uint32_t i = 0; i < got_marker_count; i++)
+    {
+        const CodecMarker *a = &got_markers[i], *b = &want_markers[i];
+        if (a->type != b->type || a->time != b->time || memcmp(a->words, b->words, sizeof(a->words)))
+        {
+            if (!marker_errors++)
+            {
+                printf("  marker %u: got type %u at %lld, sent type %u at %lld\n", i,
+                       a->type, (long long)a->time, b->type, (long long)b->time);
+            }
+        }
+    }
+    failed = edge_errors || marker_errors || crc_errors || frame_errors;
+
+    double seconds = (double)decode_clock / CLOCKS_PER_SEC;
+    printf("%-9s %9u %8u %11u %10.2f %9.1f %6u %6u %6u %6u  %s\n", name, got_edge_count,
+           got_marker_count, bytes, (double)bytes / (want_edge_count + want_marker_count),
+           seconds > 0 ? (got_edge_count + got_marker_count) / seconds / 1e6 : 0.0,
+           edge_errors, marker_errors, crc_errors, frame_errors, failed ? "FAIL" : "ok");
+
+    free(stream);
+    free(pending);
+    free(got_edges);
+    free(got_markers);
+    free(times);
+    free(lv);
+    free(chs);
+    free(markers);
+    return failed;
+}
+
+static int32_t check_pulses(void)
+{
+    uint32_t errors = 0;
+
+    for (uint32_t i = 0; i < PULSE_CHECKS; i++)
+    {
+        uint64_t anchor = ((uint64_t)rng() << 16) ^ rng();
+        uint64_t end = anchor + rng() % 0x10000;    // PULSE_WORD_SPAN
+        uint32_t width = rng() % 0x1FFF;            // up to PULSE_WORD_WIDTH
+        uint32_t level = rng() & 1, ch = rng() & 3;
+        uint32_t word = codec_pulse_word(level, ch, width, (uint32_t)end);
+        if (codec_pulse_end(anchor, word) != end || codec_pulse_width(word) != width ||
+            word >> 31 != level || ((word >> 29) & 3) != ch)
+        {
+            errors++;
+        }
+    }
+    printf("pulse words: %u checked, %u errors\n", PULSE_CHECKS, errors);
+    return errors != 0;
+}
+
+int main(int argc, char **argv)
+{
+    uint32_t events = argc > 1 ? (uint32_t)strtoul(argv[1], NULL, 0) : 1000000;
+    rng_state = argc > 2 ? (uint32_t)strtoul(argv[2], NULL, 0) : (uint32_t)time(NULL);
+    if (rng_state == 0) rng_state = 1;
+    int32_t failed = 0;
+
+    words = malloc(sizeof(uint32_t) * ((size_t)events * 6 + 16));
+    want_edges = malloc(sizeof(Edge) * ((size_t)events + 1));
+    want_markers = malloc(sizeof(CodecMarker) * ((size_t)events + 1));
+    now = last_record = 1UL << 20;
+    gen_epoch = (uint32_t)(now >> EVENT_TIME_BITS);
+
+    printf("seed %u, STREAM_PREDICT %d\n", rng_state, STREAM_PREDICT);
+    printf("%-9s %9s %8s %11s %10s %9s %6s %6s %6s %6s\n", "pass", "edges", "markers", "bytes",
+           "B/event", "Mevt/s", "edge!", "mark!", "crc!", "frame!");
+    generate(events);
+    failed |= check_pass("unframed", 0);
+    generate(events);
+    failed |= check_pass("framed", 1);
+    failed |= check_pulses();
+    return failed ? 1 : 0;
+}
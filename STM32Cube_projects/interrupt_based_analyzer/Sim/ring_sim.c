@@ -0,0 +1,395 @@
+/**
+  ******************************************************************************
+  * @file           : ring_sim.c
+  * @brief          : Host stress test of the event ring and flush policy
+  ******************************************************************************
+  * Runs Core/Src/event_ring.c on a workstation against a model of the
+  * firmware around it, on a simulated 72 MHz clock:
+  *   EXTI   edges arrive at a mean rate with bursts of BURST_EDGES at
+  *          2 MHz; one in RECORD_EVERY is pushed as a MARKER_BUS record.
+  *          Edges due while the handler runs are taken by further
+  *          passes, up to EXTI_PASSES, and one entry's pushes are
+  *          published together, as capture_exti_fast does
+  *   USB    a transfer takes its 64-byte packets at 19 per 1 ms frame;
+  *          the transmit-complete handler releases it and chains the
+  *          next one, as capture_tx_complete does
+  *   main   the loop of main(): ring_queued with no IRQs masked,
+  *          flush_due, then capture_tx_start with
+  *          the USB IRQ masked, and now and then a record pushed with
+  *          IRQs masked, as the statistics reports are
+  * Each RING_PREEMPT() point lets a random few cycles pass and runs the
+  * handlers that are due and allowed in: not masked, not already
+  * running, and of higher priority under the IRQ layout (irq_timing.h).
+  *
+  * Every pushed item carries a sequence number. The transmit-complete
+  * handler checks each transfer's words as they are then, so a word
+  * overwritten while in flight shows: sequence order with no repeats,
+  * gaps equal to the drop markers' counts (apart from records the ring
+  * skipped whole), and record payloads intact.
+  *
+  * Build and run from interrupt_based_analyzer:
+  *   cc -O2 -DHOST_SIM -I Sim -I Core/Inc -o ring_sim Sim/ring_sim.c Core/Src/event_ring.c
+  *   ./ring_sim [events] [edge rate Hz] [batch] [latency us] [seed]
+  * One row per IRQ layout and flush mode; the exit status is 1 if any
+  * check failed.
+  ******************************************************************************
+  */
+
+#include "event_ring.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#define SIM_CLOCK_HZ 72000000ULL    // the core clock, as CAPTURE_CLOCK_DWT
+#define TX_MAX_EVENTS (USB_TX_MAX_BYTES / 4)
+#define USB_PACKET_CYCLES (SIM_CLOCK_HZ / 19000)  // 64-byte bulk packets, 19 per frame
+#define EXTI_CYCLES 60              // handler entry, timestamp and exit
+#define EXTI_PASS_CYCLES 30         // each further pass: PR read, timestamp, push
+#define EXTI_PASSES 8               // CAPTURE_EXTI_PASSES
+#define USB_ISR_CYCLES 300          // CDC callback around the ring release
+#define LOOP_CYCLES 120             // one main loop pass
+#define PREEMPT_JITTER 24           // most cycles that pass at a preemption point
+#define BURST_ODDS 64               // one edge in this many starts a burst
+#define BURST_EDGES 64
+#define BURST_GAP 36                // cycles between burst edges: 2 MHz
+#define RECORD_EVERY 16             // one edge in this many is a MARKER_BUS record
+#define MASKED_EVERY 256            // main loop passes per record pushed with IRQs masked
+#define RECORD_KEY 0xA5A5A5A5       // second payload word = sequence ^ RECORD_KEY
+#define LATENCY_EVERY 256           // sequence numbers per latency sample
+
+enum { LAYOUT_FLAT, LAYOUT_EDGES_FIRST, LAYOUT_USB_FIRST, LAYOUTS };
+static const char *const layout_names[LAYOUTS] = { "flat", "edges-first", "usb-first" };
+static const char *const mode_names[] = { "latency", "batch", "adaptive" };
+
+static uint64_t now;                // simulated cycles
+static uint32_t rng;
+static uint32_t layout;
+static int irq_masked, usb_masked, in_exti, in_usb;
+
+/* Stimulus */
+static uint32_t seq, seq_end;       // next sequence number, and how many to push
+static uint64_t next_edge;
+static uint32_t mean_gap;           // cycles
+static uint32_t burst_left;
+static uint8_t *skipped;            // bit per sequence number: record the ring skipped
+static uint64_t *pushed_at;         // cycle of every LATENCY_EVERY-th push
+
+/* Link */
+static int usb_busy;
+static uint64_t usb_done;
+static uint32_t tx_slot, tx_words;
+static uint32_t last_flush;
+static uint64_t busy_cycles, words_sent;
+static uint32_t transfers;
+
+/* Checker */
+static uint32_t expect;             // next sequence number the stream may hold
+static uint32_t drop_credit;        // lost count of drop markers since the last item
+static uint32_t marker_left, payload[MARKER_MAX_WORDS], payload_n;
+static uint32_t marker_type;
+static uint32_t delivered, records, records_skipped, drop_markers, errors;
+static uint32_t queued_max, latency_n;
+static uint64_t latency_sum, latency_max;
+
+uint32_t get_32bit_timer(void)
+{
+    return (uint32_t)now;
+}
+
+static uint32_t rand32(void)
+{
+    rng ^= rng << 13;
+    rng ^= rng >> 17;
+    rng ^= rng << 5;
+    return rng;
+}
+
+static void fail(const char *what, uint32_t value)
+{
+    if (errors++ < 10) fprintf(stderr, "  %s: %u\n", what, value);
+}
+
+static int is_skipped(uint32_t s)
+{
+    return skipped[s >> 3] & (1 << (s & 7));
+}
+
+static void check_item(uint32_t s)
+{
+    uint32_t missing = 0;
+
+    if (s < expect)
+    {
+        fail("sequence repeated or out of order", s);
+        return;
+    }
+    for (; expect < s; expect++) missing += !is_skipped(expect);
+    if (missing != drop_credit) fail("lost events differ from the drop markers", missing);
+    drop_credit = 0;
+    expect = s + 1;
+    delivered++;
+    if (s % LATENCY_EVERY == 0)
+    {
+        uint64_t latency = now - pushed_at[s / LATENCY_EVERY];
+        latency_sum += latency;
+        latency_n++;
+        if (latency > latency_max) latency_max = latency;
+    }
+}
+
+static void check_word(uint32_t word)
+{
+    if (marker_left)
+    {
+        payload[payload_n++] = word;
+        if (--marker_left) return;
+        if (marker_type == MARKER_DROP)
+        {
+            if (payload[0] == 0 || payload[2] - payload[1] >= 0x80000000u) fail("bad drop marker", payload[0]);
+            drop_credit += payload[0];
+            drop_markers++;
+        }
+        else
+        {
+            if (payload[1] != (payload[0] ^ RECORD_KEY)) fail("torn record", payload[0]);
+            check_item(payload[0]);
+            records++;
+        }
+        return;
+    }
+
+    uint32_t type = event_marker_type(word);
+    if (type == EVENT_NOT_MARKER)
+    {
+        uint32_t s = word & EVENT_TIME_MASK;
+        if (word != event_pack_edge((s >> 2) & 1, s & 3, s)) fail("corrupt edge", s);
+        check_item(s);
+    }
+    else if (type == MARKER_DROP || type == MARKER_BUS)
+    {
+        marker_type = type;
+        marker_left = event_marker_words(type);
+        payload_n = 0;
+    }
+    else
+    {
+        fail("unexpected marker", type);
+    }
+}
+
+static void irq_handlers(void);
+
+void sim_preempt(void)
+{
+    now += rand32() % (PREEMPT_JITTER + 1);
+    irq_handlers();
+}
+
+static void push_record(uint32_t s)
+{
+    uint32_t words[MARKER_BUS_WORDS] = { s, s ^ RECORD_KEY };
+    uint32_t before = ring_head;
+
+    ring_push_record(event_pack_marker(MARKER_BUS, 0), words, MARKER_BUS_WORDS);
+    if (ring_head == before)
+    {
+        skipped[s >> 3] |= 1 << (s & 7);
+        records_skipped++;
+    }
+}
+
+static uint32_t next_seq(void)
+{
+    uint32_t s = seq++;
+    if (s % LATENCY_EVERY == 0) pushed_at[s / LATENCY_EVERY] = now;
+    return s;
+}
+
+/* capture_tx_start's ring path */
+static void tx_start(uint32_t min_events)
+{
+    uint32_t start;
+
+    if (usb_busy) return;
+    uint32_t pending = ring_queued();
+    uint32_t to_send = ring_claim(TX_MAX_EVENTS, &start);
+
+    if (to_send == 0 || pending < min_events) return;
+    uint64_t cycles = (to_send * 4 + 63) / 64 * USB_PACKET_CYCLES;
+    tx_slot = start;
+    tx_words = to_send;
+    usb_busy = 1;
+    usb_done = now + cycles;
+    busy_cycles += cycles;
+    words_sent += to_send;
+    transfers++;
+    last_flush = get_32bit_timer();
+}
+
+static void exti_handler(void)
+{
+    uint32_t passes = EXTI_PASSES;
+
+    in_exti = 1;
+    now += EXTI_CYCLES;
+    ring_batch_begin();
+    do
+    {
+        if (burst_left)
+        {
+            burst_left--;
+            next_edge += BURST_GAP;
+        }
+        else
+        {
+            if (rand32() % BURST_ODDS == 0) burst_left = BURST_EDGES;
+            next_edge += 1 + rand32() % (2 * mean_gap);
+        }
+
+        uint32_t s = next_seq();
+        if (rand32() % RECORD_EVERY == 0) push_record(s);
+        else ring_push(event_pack_edge((s >> 2) & 1, s & 3, s));
+        now += EXTI_PASS_CYCLES;
+    }
+    while (--passes && seq < seq_end && next_edge <= now);
+    ring_batch_end();
+    in_exti = 0;
+}
+
+/* CDC transmit complete: the words went out as they are now */
+static void usb_handler(void)
+{
+    in_usb = 1;
+    now += USB_ISR_CYCLES;
+    for (uint32_t i = 0; i < tx_words; i++) check_word(event_buffer[(tx_slot + i) & EVENT_MASK]);
+    usb_busy = 0;
+    ring_release(tx_words);
+    tx_words = 0;
+    tx_start(flush_chain_min());
+    in_usb = 0;
+}
+
+static void irq_handlers(void)
+{
+    for (;;)
+    {
+        int exti = seq < seq_end && next_edge <= now && !irq_masked && !in_exti &&
+                   (!in_usb || layout == LAYOUT_EDGES_FIRST);
+        int usb = usb_busy && usb_done <= now && !irq_masked && !usb_masked && !in_usb &&
+                  (!in_exti || layout == LAYOUT_USB_FIRST);
+
+        if (exti) exti_handler();
+        else if (usb) usb_handler();
+        else return;
+    }
+}
+
+static void irq_enable(void)
+{
+    irq_masked = 0;
+    irq_handlers();
+}
+
+static void main_pass(void)
+{
+    now += LOOP_CYCLES;
+    irq_handlers();
+
+    if (seq < seq_end && rand32() % MASKED_EVERY == 0)
+    {
+        irq_masked = 1;
+        push_record(next_seq());
+        irq_enable();
+    }
+
+    uint32_t diff = ring_queued();
+    if (diff > queued_max) queued_max = diff;
+
+    if (flush_due(diff, get_32bit_timer() - last_flush, usb_busy, TX_MAX_EVENTS))
+    {
+        usb_masked = 1;
+        tx_start(1);
+        usb_masked = 0;
+        irq_handlers();
+    }
+}
+
+static void run(uint32_t mode, uint32_t batch, uint32_t latency_us, uint32_t seed)
+{
+    now = 0;
+    rng = seed;
+    irq_masked = usb_masked = in_exti = in_usb = 0;
+    seq = 0;
+    next_edge = 0;
+    burst_left = 0;
+    for (uint32_t i = 0; i < (seq_end + 7) / 8; i++) skipped[i] = 0;
+    usb_busy = 0;
+    tx_words = last_flush = transfers = 0;
+    busy_cycles = words_sent = 0;
+    expect = drop_credit = marker_left = payload_n = 0;
+    delivered = records = records_skipped = drop_markers = errors = 0;
+    queued_max = latency_n = 0;
+    latency_sum = latency_max = 0;
+    ring_reset();
+    dropped_total = 0;
+    flush_configure(mode, batch, (uint32_t)(latency_us * (SIM_CLOCK_HZ / 1000000)));
+
+    clock_t host_start = clock();
+    while (seq < seq_end) main_pass();
+    uint64_t drain_end = now + SIM_CLOCK_HZ;
+    while ((ring_queued() || usb_busy) && now < drain_end) main_pass();
+    double host_s = (double)(clock() - host_start) / CLOCKS_PER_SEC;
+
+    // edges lost after the last push have no marker yet
+    uint32_t missing = 0;
+    for (; expect < seq_end; expect++) missing += !is_skipped(expect);
+    if (ring_queued() || usb_busy) fail("ring did not drain", ring_queued());
+    if (missing != drop_pending + drop_credit) fail("lost events at the end differ from the drops", missing);
+    if (delivered + records_skipped + dropped_total != seq_end) fail("items unaccounted for", delivered);
+
+    printf("%-11s %-8s %9u %8u %7u %7u %8.1f %6.1f %7u %8.0f %8.0f %7.2f %6u\n",
+           layout_names[layout], mode_names[mode], delivered, dropped_total, records_skipped,
+           drop_markers, transfers ? (double)words_sent / transfers : 0.0,
+           100.0 * busy_cycles / now, queued_max,
+           latency_n ? latency_sum / latency_n * 1e6 / SIM_CLOCK_HZ : 0.0,
+           latency_max * 1e6 / SIM_CLOCK_HZ,
+           host_s > 0 ? seq_end / host_s / 1e6 : 0.0, errors);
+}
+
+int main(int argc, char **argv)
+{
+    uint32_t events = argc > 1 ? strtoul(argv[1], NULL, 0) : 2000000;
+    uint32_t rate = argc > 2 ? strtoul(argv[2], NULL, 0) : 100000;
+    uint32_t batch = argc > 3 ? strtoul(argv[3], NULL, 0) : FLUSH_DEFAULT_BATCH;
+    uint32_t latency_us = argc > 4 ? strtoul(argv[4], NULL, 0) : 2000;
+    uint32_t seed = argc > 5 ? strtoul(argv[5], NULL, 0) : 0x2545F491;
+    uint32_t failed = 0;
+
+    if (argc > 6 || events == 0 || events >= EVENT_TIME_MASK || rate == 0 || rate > SIM_CLOCK_HZ / 2 || seed == 0)
+    {
+        fprintf(stderr, "Usage: ring_sim [events] [edge rate Hz] [batch] [latency us] [seed != 0]\n");
+        return 2;
+    }
+    seq_end = events;
+    mean_gap = SIM_CLOCK_HZ / rate;
+    skipped = malloc((events + 7) / 8);
+    pushed_at = malloc((events / LATENCY_EVERY + 1) * sizeof *pushed_at);
+    if (!skipped || !pushed_at) return 2;
+
+    printf("ring %u words, %u events at %u Hz mean, batch %u, latency %u us\n",
+           MAX_EVENTS, events, rate, batch, latency_us);
+    printf("%-11s %-8s %9s %8s %7s %7s %8s %6s %7s %8s %8s %7s %6s\n",
+           "layout", "flush", "delivered", "dropped", "skipped", "markers", "words/tx",
+           "link%", "peak", "avg us", "max us", "Mpush/s", "errors");
+    for (layout = 0; layout < LAYOUTS; layout++)
+    {
+        for (uint32_t mode = FLUSH_LATENCY; mode <= FLUSH_ADAPTIVE; mode++)
+        {
+            run(mode, batch, latency_us, seed);
+            failed |= errors != 0;
+        }
+    }
+    free(skipped);
+    free(pushed_at);
+    return failed;
+}
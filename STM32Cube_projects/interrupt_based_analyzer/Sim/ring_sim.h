@@ -0,0 +1,49 @@
+/**
+  ******************************************************************************
+  * @file           : ring_sim.h
+  * @brief          : Stand-in for main.h in the host build (HOST_SIM) of the
+  *                   event ring
+  ******************************************************************************
+  * The firmware options event_format.h and event_ring.h read, with the
+  * target's defaults, and the simulator's clock and preemption hook.
+  ******************************************************************************
+  */
+
+#ifndef __RING_SIM_H
+#define __RING_SIM_H
+
+#include <stdint.h>
+
+#ifndef CAPTURE_RING_EVENTS
+#define CAPTURE_RING_EVENTS 4096   // power of 2; 0 is the linker-sized ring, not simulated
+#endif
+#ifndef EVENT_FORMAT_SNAPSHOT
+#define EVENT_FORMAT_SNAPSHOT 0
+#endif
+#ifndef USB_TX_MAX_BYTES
+#define USB_TX_MAX_BYTES 1024
+#endif
+#ifndef STREAM_COMPACT
+#define STREAM_COMPACT 0
+#endif
+#ifndef STREAM_PREDICT
+#define STREAM_PREDICT 0
+#endif
+#ifndef STREAM_FRAMED
+#define STREAM_FRAMED 0
+#endif
+
+#if !CAPTURE_RING_EVENTS
+#error "the simulator needs a fixed ring: set CAPTURE_RING_EVENTS"
+#endif
+#if STREAM_FRAMED
+#error "the host build has no CRC unit: frames are checked with codec_frame_check"
+#endif
+
+uint32_t get_32bit_timer(void);
+void sim_preempt(void);
+
+#define RING_PREEMPT() sim_preempt()
+#define RING_BARRIER() __asm__ volatile ("" ::: "memory")  // compiler barrier, no __DMB here
+
+#endif /* __RING_SIM_H */
@@ -0,0 +1,207 @@
+/**
+  ******************************************************************************
+  * @file           : stage_check.c
+  * @brief          : Host check of which commands a stage block holds
+  ******************************************************************************
+  * Feeds byte sequences to Core/Src/host_cmd.c as CDC_Receive_FS would
+  * and runs host_cmd_process as the main loop does. The main.c functions
+  * the commands call are stand-ins that log each call with the stage
+  * state at the time:
+  *   held     between 's' STAGE_BEGIN and its commit, settings commands
+  *            ('F', 'E', ...) wait and run inside capture_swap_begin/end,
+  *            in order; STAGE_DISCARD drops them
+  *   at once  requests and credit grants ('V', 'c') run as they arrive,
+  *            a grant included, which the stream waits on: held until
+  *            the commit, it could stall the stream that carries the
+  *            host's reason to commit
+  *
+  * host_cmd.c includes the target's headers, so it builds against the
+  * HAL and CMSIS headers of the project with the default options of
+  * main.h. Build and run from interrupt_based_analyzer:
+  *   cc -O2 -DSTM32F103xB -DUSE_HAL_DRIVER -I Core/Inc -I Drivers/STM32F1xx_HAL_Driver/Inc -I Drivers/CMSIS/Device/ST/STM32F1xx/Include -I Drivers/CMSIS/Include -o stage_check Sim/stage_check.c Core/Src/host_cmd.c
+  *   ./stage_check
+  * One line per case; the exit status is 1 if any check failed.
+  ******************************************************************************
+  */
+
+#include "host_cmd.h"
+#include "event_ring.h"
+#include <stdio.h>
+#include <string.h>
+
+#if !CONFIG_STAGE || !FLOW_CREDIT
+#error "build with CONFIG_STAGE and FLOW_CREDIT on, the defaults"
+#endif
+
+#define LOG_MAX 32
+
+typedef struct
+{
+    uint8_t opcode;     // command the call stands for
+    uint32_t args[3];
+    uint32_t swapping;  // called between capture_swap_begin and capture_swap_end
+} Call;
+
+static Call calls[LOG_MAX];
+static uint32_t call_count;
+static uint32_t swapping;
+static uint32_t swaps;
+
+static void log_call(uint8_t opcode, uint32_t a, uint32_t b, uint32_t c)
+{
+    if (call_count == LOG_MAX) return;
+    calls[call_count++] = (Call){ opcode, { a, b, c }, swapping };
+}
+
+/* Stand-ins for main.c and the modules host_cmd.c calls */
+void capture_set_flush_policy(uint32_t mode, uint32_t batch, uint32_t latency_us)
+{
+    log_call(HOST_CMD_FLUSH, mode, batch, latency_us);
+}
+void capture_set_credit(uint32_t mode, uint32_t kib) { log_call(HOST_CMD_CREDIT, mode, kib, 0); }
+void capture_send_info(void) { log_call(HOST_CMD_INFO, 0, 0, 0); }
+void capture_set_channels(uint32_t mask) { log_call(HOST_CMD_CHANNELS, mask, 0, 0); }
+uint32_t capture_swap_begin(void)
+{
+    swapping = 1;
+    return 0;
+}
+void capture_swap_end(uint32_t start, uint32_t commands)
+{
+    (void)start;
+    (void)commands;
+    swapping = 0;
+    swaps++;
+}
+void capture_echo_command(const uint8_t *cmd, uint32_t len) { (void)cmd; (void)len; }
+void capture_dump(uint32_t words, uint32_t ms) { (void)words; (void)ms; }
+void capture_set_clock(uint32_t preset) { (void)preset; }
+void capture_set_filter(uint32_t bus, uint32_t match, uint32_t mask, uint32_t gap)
+{
+    (void)bus; (void)match; (void)mask; (void)gap;
+}
+void capture_set_glitch_filter(uint32_t channel, uint32_t width_ns) { (void)channel; (void)width_ns; }
+void capture_set_i2c_sniff(uint32_t scl_channel, uint32_t sda_channel) { (void)scl_channel; (void)sda_channel; }
+void capture_set_measure(uint32_t mask, uint32_t rate) { (void)mask; (void)rate; }
+void capture_set_mode(uint32_t mode) { (void)mode; }
+void capture_set_running(uint32_t run) { (void)run; }
+void capture_set_ss_gate(uint32_t ss_channel, uint32_t mask, uint32_t level)
+{
+    (void)ss_channel; (void)mask; (void)level;
+}
+void capture_set_storm_limit(uint32_t channel, uint32_t rate, uint32_t burst)
+{
+    (void)channel; (void)rate; (void)burst;
+}
+void capture_set_trigger(uint32_t type, uint32_t channel, uint32_t value, uint32_t mask,
+                         uint32_t param, uint32_t pre, uint32_t post)
+{
+    (void)type; (void)channel; (void)value; (void)mask; (void)param; (void)pre; (void)post;
+}
+void capture_set_uart_decode(uint32_t channel, uint32_t baud, uint32_t frame)
+{
+    (void)channel; (void)baud; (void)frame;
+}
+uint32_t boot_capture_store(uint32_t mode, uint32_t channels, uint32_t clock)
+{
+    (void)mode; (void)channels; (void)clock;
+    return 0;
+}
+uint32_t clock_trim_adjust(int32_t ppb) { (void)ppb; return 0; }
+void irq_set_layout(uint32_t layout) { (void)layout; }
+void poll_configure(uint32_t rate_hz, uint32_t mask, uint32_t samples)
+{
+    (void)rate_hz; (void)mask; (void)samples;
+}
+
+static void send(const uint8_t *bytes, uint32_t len)
+{
+    host_cmd_receive(bytes, len);
+    host_cmd_process();
+}
+
+static void send_stage(uint32_t mode)
+{
+    const uint8_t cmd[] = { HOST_CMD_STAGE, (uint8_t)mode };
+    send(cmd, sizeof(cmd));
+}
+
+static void send_credit(uint32_t mode, uint32_t kib)
+{
+    const uint8_t cmd[] = { HOST_CMD_CREDIT, (uint8_t)mode, (uint8_t)kib, (uint8_t)(kib >> 8) };
+    send(cmd, sizeof(cmd));
+}
+
+static void send_flush(uint32_t mode, uint32_t batch)
+{
+    const uint8_t cmd[] = { HOST_CMD_FLUSH, (uint8_t)mode, (uint8_t)batch, (uint8_t)(batch >> 8),
+                            0xE8, 0x03, 0, 0 };  // 1000 us
+    send(cmd, sizeof(cmd));
+}
+
+static int32_t report(const char *name, int32_t ok)
+{
+    printf("%-44s %s\n", name, ok ? "ok" : "FAILED");
+    return ok ? 0 : 1;
+}
+
+static void reset_log(void)
+{
+    call_count = 0;
+    swaps = 0;
+}
+
+int main(void)
+{
+    int32_t failed = 0;
+    uint32_t held;
+
+    // a grant inside an open block applies before the commit
+    reset_log();
+    send_stage(STAGE_BEGIN);
+    send_credit(CREDIT_START, 4);
+    failed |= report("'c' start in a stage block runs at once",
+                     call_count == 1 && calls[0].opcode == HOST_CMD_CREDIT &&
+                     calls[0].args[0] == CREDIT_START && calls[0].args[1] == 4 && !calls[0].swapping);
+    send_credit(CREDIT_ADD, 2);
+    failed |= report("'c' add in a stage block runs at once",
+                     call_count == 2 && calls[1].opcode == HOST_CMD_CREDIT &&
+                     calls[1].args[0] == CREDIT_ADD && calls[1].args[1] == 2 && !calls[1].swapping);
+    send_stage(STAGE_COMMIT);
+    failed |= report("a block of grants only commits nothing", call_count == 2 && swaps == 0);
+
+    // settings wait for the commit; the grant between them does not
+    reset_log();
+    send_stage(STAGE_BEGIN);
+    send_flush(FLUSH_BATCH, 32);
+    send_credit(CREDIT_ADD, 8);
+    send_flush(FLUSH_LATENCY, 0);
+    held = call_count;
+    send_stage(STAGE_COMMIT);
+    failed |= report("'F' waits for the commit, 'c' does not",
+                     held == 1 && calls[0].opcode == HOST_CMD_CREDIT && calls[0].args[1] == 8);
+    failed |= report("the commit runs the held 'F's in one swap",
+                     call_count == 3 && swaps == 1 &&
+                     calls[1].opcode == HOST_CMD_FLUSH && calls[1].args[0] == FLUSH_BATCH &&
+                     calls[1].swapping &&
+                     calls[2].opcode == HOST_CMD_FLUSH && calls[2].args[0] == FLUSH_LATENCY &&
+                     calls[2].swapping);
+
+    // a discarded block keeps the grant it let through
+    reset_log();
+    send_stage(STAGE_BEGIN);
+    send_flush(FLUSH_BATCH, 64);
+    send_credit(CREDIT_START, 16);
+    send_stage(STAGE_DISCARD);
+    send_stage(STAGE_COMMIT);
+    failed |= report("a discard drops 'F' but not the grant",
+                     call_count == 1 && calls[0].opcode == HOST_CMD_CREDIT && swaps == 0);
+
+    // outside a block everything runs at once
+    reset_log();
+    send_flush(FLUSH_ADAPTIVE, 16);
+    send_credit(CREDIT_OFF, 0);
+    failed |= report("without a block 'F' and 'c' run at once",
+                     call_count == 2 && !calls[0].swapping && !calls[1].swapping && swaps == 0);
+    return failed ? 1 : 0;
+}
@@ -48,9 +48,11 @@
   * @brief Defines.
   * @{
   */
-/* Define size for the receive and transmit buffer over CDC */
-#define APP_RX_DATA_SIZE  1024
-#define APP_TX_DATA_SIZE  1024
+/* Define size for the receive buffer over CDC: one data OUT packet, which
+   holds any host command; the class re-arms the endpoint after each
+   CDC_Receive_FS. Transfers pass their own buffers, so there is no
+   transmit staging buffer. */
+#define APP_RX_DATA_SIZE  CDC_DATA_FS_MAX_PACKET_SIZE
 /* USER CODE BEGIN EXPORTED_DEFINES */
 
 /* USER CODE END EXPORTED_DEFINES */
@@ -94,7 +96,7 @@
 extern USBD_CDC_ItfTypeDef USBD_Interface_fops_FS;
 
 /* USER CODE BEGIN EXPORTED_VARIABLES */
-
+extern volatile uint32_t usb_tx_queue_peak;
 /* USER CODE END EXPORTED_VARIABLES */
 
 /**
@@ -109,6 +111,12 @@ extern USBD_CDC_ItfTypeDef USBD_Interface_fops_FS;
 uint8_t CDC_Transmit_FS(uint8_t* Buf, uint16_t Len);
 
 /* USER CODE BEGIN EXPORTED_FUNCTIONS */
+#if USB_CONTROL_EP
+uint8_t CDC_Transmit_Control(uint8_t* Buf, uint16_t Len);
+#endif
+#if HOST_DTR_GATE
+uint8_t CDC_HostAttached_FS(void);
+#endif
 
 /* USER CODE END EXPORTED_FUNCTIONS */
 
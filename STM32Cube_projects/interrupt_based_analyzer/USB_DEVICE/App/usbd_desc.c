@@ -71,7 +71,27 @@
 #define USBD_INTERFACE_STRING_FS     "CDC Interface"
 
 /* USER CODE BEGIN PRIVATE_DEFINES */
-
+#if USB_VENDOR_CLASS
+/* Own PID: Windows caches the OS descriptors and the bound driver per
+ * VID/PID, so the bulk build must not reuse the Virtual ComPort one */
+#undef USBD_PID_FS
+#if USB_CONTROL_EP
+#define USBD_PID_FS     22338   /* composite: a second interface to bind */
+#else
+#define USBD_PID_FS     22337
+#endif
+#undef USBD_PRODUCT_STRING_FS
+#define USBD_PRODUCT_STRING_FS     "STM32 Logic Analyzer"
+#undef USBD_CONFIGURATION_STRING_FS
+#define USBD_CONFIGURATION_STRING_FS     "Bulk Config"
+#undef USBD_INTERFACE_STRING_FS
+#define USBD_INTERFACE_STRING_FS     "Bulk Interface"
+#define USBD_DEVICE_CLASS     0x00    /* class given per interface */
+#define USBD_DEVICE_SUBCLASS  0x00
+#else
+#define USBD_DEVICE_CLASS     0x02    /* CDC */
+#define USBD_DEVICE_SUBCLASS  0x02
+#endif
 /* USER CODE END PRIVATE_DEFINES */
 
 /**
@@ -79,7 +99,71 @@
   */
 
 /* USER CODE BEGIN 0 */
+#if USB_VENDOR_CLASS
+#if defined ( __ICCARM__ ) /* IAR Compiler */
+  #pragma data_alignment=4
+#endif /* defined ( __ICCARM__ ) */
+/** Microsoft OS string descriptor: "MSFT100" and the vendor code */
+__ALIGN_BEGIN static uint8_t USBD_MsOsStrDesc[18] __ALIGN_END =
+{
+  18,
+  USB_DESC_TYPE_STRING,
+  'M', 0, 'S', 0, 'F', 0, 'T', 0, '1', 0, '0', 0, '0', 0,
+  USBD_MS_VENDOR_CODE,
+  0x00
+};
+
+#if defined ( __ICCARM__ ) /* IAR Compiler */
+  #pragma data_alignment=4
+#endif /* defined ( __ICCARM__ ) */
+/** Extended Compat ID descriptor: interface 0 is a WinUSB device, so
+  * Windows binds WinUSB (and libusb can open it) without an INF file.
+  * With USB_CONTROL_EP a second section does the same for interface 1 */
+__ALIGN_BEGIN static uint8_t USBD_MsCompatIdDesc[40 + 24 * USB_CONTROL_EP] __ALIGN_END =
+{
+  40 + 24 * USB_CONTROL_EP, 0x00, 0x00, 0x00,   /*dwLength*/
+  0x00, 0x01,                 /*bcdVersion 1.00*/
+  0x04, 0x00,                 /*wIndex: extended compat ID*/
+  0x01 + USB_CONTROL_EP,      /*bCount: a function section per interface*/
+  0, 0, 0, 0, 0, 0, 0,        /*reserved*/
+  0x00,                       /*bFirstInterfaceNumber*/
+  0x01,                       /*reserved*/
+  'W', 'I', 'N', 'U', 'S', 'B', 0, 0,   /*compatibleID*/
+  0, 0, 0, 0, 0, 0, 0, 0,     /*subCompatibleID*/
+  0, 0, 0, 0, 0, 0,           /*reserved*/
+#if USB_CONTROL_EP
+  0x01,                       /*bFirstInterfaceNumber*/
+  0x01,                       /*reserved*/
+  'W', 'I', 'N', 'U', 'S', 'B', 0, 0,   /*compatibleID*/
+  0, 0, 0, 0, 0, 0, 0, 0,     /*subCompatibleID*/
+  0, 0, 0, 0, 0, 0            /*reserved*/
+#endif
+};
 
+/**
+  * @brief  Return the Microsoft OS string descriptor (string index 0xEE)
+  * @param  speed : Current device speed
+  * @param  length : Pointer to data length variable
+  * @retval Pointer to descriptor buffer
+  */
+uint8_t * USBD_FS_MsOsStrDescriptor(USBD_SpeedTypeDef speed, uint16_t *length)
+{
+  UNUSED(speed);
+  *length = sizeof(USBD_MsOsStrDesc);
+  return USBD_MsOsStrDesc;
+}
+
+/**
+  * @brief  Return the Extended Compat ID OS feature descriptor
+  * @param  length : Pointer to data length variable
+  * @retval Pointer to descriptor buffer
+  */
+uint8_t * USBD_FS_MsCompatIdDescriptor(uint16_t *length)
+{
+  *length = sizeof(USBD_MsCompatIdDesc);
+  return USBD_MsCompatIdDesc;
+}
+#endif
 /* USER CODE END 0 */
 
 /** @defgroup USBD_DESC_Private_Macros USBD_DESC_Private_Macros
@@ -150,8 +234,8 @@ __ALIGN_BEGIN uint8_t USBD_FS_DeviceDesc[USB_LEN_DEV_DESC] __ALIGN_END =
   USB_DESC_TYPE_DEVICE,       /*bDescriptorType*/
   0x00,                       /*bcdUSB */
   0x02,
-  0x02,                       /*bDeviceClass*/
-  0x02,                       /*bDeviceSubClass*/
+  USBD_DEVICE_CLASS,          /*bDeviceClass*/
+  USBD_DEVICE_SUBCLASS,       /*bDeviceSubClass*/
   0x00,                       /*bDeviceProtocol*/
   USB_MAX_EP0_SIZE,           /*bMaxPacketSize*/
   LOBYTE(USBD_VID),           /*idVendor*/
@@ -65,7 +65,9 @@
   */
 
 /* USER CODE BEGIN EXPORTED_DEFINES */
-
+/* Microsoft OS 1.0 descriptors of the USB_VENDOR_CLASS build */
+#define USBD_IDX_MS_OS_STR          0xEEU   /* string index Windows probes */
+#define USBD_MS_VENDOR_CODE         0x20U   /* bRequest of the OS feature requests */
 /* USER CODE END EXPORTED_DEFINES */
 
 /**
@@ -120,7 +122,10 @@ extern USBD_DescriptorsTypeDef FS_Desc;
   */
 
 /* USER CODE BEGIN EXPORTED_FUNCTIONS */
-
+#if USB_VENDOR_CLASS
+uint8_t * USBD_FS_MsOsStrDescriptor(USBD_SpeedTypeDef speed, uint16_t *length);
+uint8_t * USBD_FS_MsCompatIdDescriptor(uint16_t *length);
+#endif
 /* USER CODE END EXPORTED_FUNCTIONS */
 
 /**
@@ -26,6 +26,7 @@
 #include "usbd_cdc.h"
 
 /* USER CODE BEGIN Includes */
+#include "irq_timing.h"
 
 /* USER CODE END Includes */
 
@@ -42,6 +43,137 @@ PCD_HandleTypeDef hpcd_USB_FS;
 void Error_Handler(void);
 
 /* USER CODE BEGIN 0 */
+#if USB_FAST_PMA || IRQ_TIMING
+/**
+  * @brief Copies an IN packet into packet memory for the HAL, in place
+  *        of the weak USB_WritePMA of stm32f1xx_ll_usb.c; all but a
+  *        transfer's first packet are copied in the USB interrupt. The PMA
+  *        takes one 16-bit access per 32-bit word of its window. The
+  *        HAL's loop builds each halfword from two byte loads; with
+  *        USB_FAST_PMA a word-aligned source, as the ring, the compact
+  *        buffers and the queues all are, is read a word at a time and
+  *        stored eight halfwords per pass. With IRQ_TIMING every call is
+  *        timed into IRQ_TIMER_PMA
+  * @param USBx: USB peripheral
+  * @param pbUsrBuf: source
+  * @param wPMABufAddr: offset of the endpoint buffer in packet memory
+  * @param wNBytes: bytes to copy
+  * @retval None
+  */
+void USB_WritePMA(USB_TypeDef const *USBx, uint8_t *pbUsrBuf, uint16_t wPMABufAddr, uint16_t wNBytes)
+{
+#if IRQ_TIMING
+  uint32_t start = DWT->CYCCNT;
+#endif
+  __IO uint16_t *pma = (__IO uint16_t *)((uint32_t)USBx + 0x400U + (uint32_t)wPMABufAddr * PMA_ACCESS);
+  uint8_t *src = pbUsrBuf;
+  uint32_t n = wNBytes;
+
+#if USB_FAST_PMA
+  if (((uint32_t)src & 3U) == 0U)
+  {
+    const uint32_t *words = (const uint32_t *)src;
+
+    /* pma[2 * k] is the k-th halfword: PMA_ACCESS 2 */
+    for (; n >= 16U; n -= 16U)
+    {
+      uint32_t w0 = words[0], w1 = words[1], w2 = words[2], w3 = words[3];
+
+      pma[0] = (uint16_t)w0;
+      pma[2] = (uint16_t)(w0 >> 16);
+      pma[4] = (uint16_t)w1;
+      pma[6] = (uint16_t)(w1 >> 16);
+      pma[8] = (uint16_t)w2;
+      pma[10] = (uint16_t)(w2 >> 16);
+      pma[12] = (uint16_t)w3;
+      pma[14] = (uint16_t)(w3 >> 16);
+      pma += 16;
+      words += 4;
+    }
+    for (; n >= 4U; n -= 4U)
+    {
+      uint32_t w = *words++;
+
+      pma[0] = (uint16_t)w;
+      pma[2] = (uint16_t)(w >> 16);
+      pma += 4;
+    }
+    src = (uint8_t *)words;
+  }
+#endif
+  for (; n >= 2U; n -= 2U)
+  {
+    *pma = (uint16_t)(src[0] | (src[1] << 8));
+    pma += PMA_ACCESS;
+    src += 2;
+  }
+  if (n != 0U)
+  {
+    *pma = src[0];
+  }
+#if IRQ_TIMING
+  irq_timing_add(IRQ_TIMER_PMA, start);
+#endif
+}
+#endif
+
+#if USB_LEAN_IRQ
+/**
+  * @brief Streaming fast path of the USB interrupt, ahead of
+  *        HAL_PCD_IRQHandler. While capture streams, nearly every USB
+  *        interrupt is a bulk IN packet gone out in the middle of a
+  *        transfer, which only needs the next packet loaded: that is
+  *        done here, as PCD_EP_ISR_Handler and USB_EPStartXfer would,
+  *        without the HAL's dispatch. Anything else, a transfer's last
+  *        packet included, is left pending for the HAL and the USB
+  *        device stack: endpoint 0, OUT packets, isochronous, interrupt
+  *        and double-buffered endpoints, and the bus events
+  * @param hpcd: PCD handle
+  * @retval 1 when no enabled interrupt is left for HAL_PCD_IRQHandler
+  */
+uint32_t USBD_LL_StreamIRQHandler(PCD_HandleTypeDef *hpcd)
+{
+  USB_TypeDef *USBx = hpcd->Instance;
+  uint16_t wIstr;
+
+  while (((wIstr = (uint16_t)USBx->ISTR) & USB_ISTR_CTR) != 0U)
+  {
+    uint8_t epnum = (uint8_t)(wIstr & USB_ISTR_EP_ID);
+    PCD_EPTypeDef *ep = &hpcd->IN_ep[epnum];
+    uint16_t wEPVal;
+    uint32_t sent;
+    uint32_t len;
+
+    /* DIR = 1: an OUT or SETUP packet is pending on the endpoint */
+    if ((epnum == 0U) || ((wIstr & USB_ISTR_DIR) != 0U))
+    {
+      return 0U;
+    }
+    wEPVal = (uint16_t)PCD_GET_ENDPOINT(USBx, epnum);
+    if (((wEPVal & USB_EP_CTR_TX) == 0U) || ((wEPVal & USB_EP_KIND) != 0U) || (ep->type != EP_TYPE_BULK))
+    {
+      return 0U;
+    }
+    sent = PCD_GET_EP_TX_CNT(USBx, epnum);
+    if (ep->xfer_len <= sent)
+    {
+      return 0U;
+    }
+
+    PCD_CLEAR_TX_EP_CTR(USBx, epnum);
+    ep->xfer_len -= sent;
+    ep->xfer_buff += sent;
+    ep->xfer_count += sent;
+    len = (ep->xfer_len > ep->maxpacket) ? ep->maxpacket : ep->xfer_len;
+    USB_WritePMA(USBx, ep->xfer_buff, (uint16_t)ep->pmaadress, (uint16_t)len);
+    PCD_SET_EP_TX_CNT(USBx, epnum, len);
+    PCD_SET_EP_TX_STATUS(USBx, epnum, USB_EP_TX_VALID);
+  }
+
+  return ((USBx->ISTR & USBx->CNTR) & (USB_ISTR_PMAOVR | USB_ISTR_ERR | USB_ISTR_WKUP | USB_ISTR_SUSP |
+                                        USB_ISTR_RESET | USB_ISTR_SOF | USB_ISTR_ESOF)) == 0U;
+}
+#endif
 
 /* USER CODE END 0 */
 
@@ -159,6 +291,8 @@ static void PCD_SOFCallback(PCD_HandleTypeDef *hpcd)
 void HAL_PCD_SOFCallback(PCD_HandleTypeDef *hpcd)
 #endif /* USE_HAL_PCD_REGISTER_CALLBACKS */
 {
+  /* Latch the capture clock first: it is the timing reference of the SOF */
+  capture_sof(hpcd->Instance->FNR & USB_FNR_FN);
   USBD_LL_SOF((USBD_HandleTypeDef*)hpcd->pData);
 }
 
@@ -329,13 +463,51 @@ USBD_StatusTypeDef USBD_LL_Init(USBD_HandleTypeDef *pdev)
   HAL_PCD_RegisterIsoInIncpltCallback(&hpcd_USB_FS, PCD_ISOINIncompleteCallback);
 #endif /* USE_HAL_PCD_REGISTER_CALLBACKS */
   /* USER CODE BEGIN EndPoint_Configuration */
+#if USB_IN_DOUBLE_BUFFER || USB_ISO_STREAM
+  /* The BTABLE grows to four entries (EP0-EP3, 0x00-0x1F) */
+  HAL_PCDEx_PMAConfig((PCD_HandleTypeDef*)pdev->pData , 0x00 , PCD_SNG_BUF, 0x20);
+  HAL_PCDEx_PMAConfig((PCD_HandleTypeDef*)pdev->pData , 0x80 , PCD_SNG_BUF, 0x60);
+#elif USB_STRIPE_EPS > 1
+  /* The BTABLE grows to five entries (EP0-EP4, 0x00-0x27) */
+  HAL_PCDEx_PMAConfig((PCD_HandleTypeDef*)pdev->pData , 0x00 , PCD_SNG_BUF, 0x28);
+  HAL_PCDEx_PMAConfig((PCD_HandleTypeDef*)pdev->pData , 0x80 , PCD_SNG_BUF, 0x68);
+#else
   HAL_PCDEx_PMAConfig((PCD_HandleTypeDef*)pdev->pData , 0x00 , PCD_SNG_BUF, 0x18);
   HAL_PCDEx_PMAConfig((PCD_HandleTypeDef*)pdev->pData , 0x80 , PCD_SNG_BUF, 0x58);
+#endif
   /* USER CODE END EndPoint_Configuration */
   /* USER CODE BEGIN EndPoint_Configuration_CDC */
+#if USB_ISO_STREAM
+  /* An isochronous endpoint is always double-buffered: the PCD interrupt
+     fills one buffer for the next frame while the other is on the bus.
+     Two VENDOR_ISO_PACKET_SIZE (128-byte) buffers, then EP3 OUT, end at
+     0x1E0 of the 512-byte PMA */
+  HAL_PCDEx_PMAConfig((PCD_HandleTypeDef*)pdev->pData , 0x81 , PCD_DBL_BUF, 0xA0 | (0x120 << 16));
+  HAL_PCDEx_PMAConfig((PCD_HandleTypeDef*)pdev->pData , 0x03 , PCD_SNG_BUF, 0x1A0);
+  HAL_PCDEx_PMAConfig((PCD_HandleTypeDef*)pdev->pData , 0x82 , PCD_SNG_BUF, 0x1E0);
+#elif USB_IN_DOUBLE_BUFFER
+  /* A double-buffered endpoint uses both buffer slots of its BTABLE entry
+     and is IN only, so the data OUT endpoint moves to EP3. While one
+     buffer is on the bus the PCD interrupt fills the other, and the
+     host's back-to-back IN tokens are not NAKed between packets. */
+  HAL_PCDEx_PMAConfig((PCD_HandleTypeDef*)pdev->pData , 0x81 , PCD_DBL_BUF, 0xC0 | (0x100 << 16));
+  HAL_PCDEx_PMAConfig((PCD_HandleTypeDef*)pdev->pData , 0x03 , PCD_SNG_BUF, 0x140);
+  HAL_PCDEx_PMAConfig((PCD_HandleTypeDef*)pdev->pData , 0x82 , PCD_SNG_BUF, 0xA0);
+#elif USB_STRIPE_EPS > 1
+  /* Stripe endpoints EP1, EP3 and EP4 IN, 64 bytes each, then EP1 OUT
+     and EP2 IN (the CDC command or USB_CONTROL_EP endpoint), end at 0x1C8 */
+  HAL_PCDEx_PMAConfig((PCD_HandleTypeDef*)pdev->pData , 0x81 , PCD_SNG_BUF, 0xA8);
+  HAL_PCDEx_PMAConfig((PCD_HandleTypeDef*)pdev->pData , 0x83 , PCD_SNG_BUF, 0xE8);
+  HAL_PCDEx_PMAConfig((PCD_HandleTypeDef*)pdev->pData , 0x84 , PCD_SNG_BUF, 0x128);
+  HAL_PCDEx_PMAConfig((PCD_HandleTypeDef*)pdev->pData , 0x01 , PCD_SNG_BUF, 0x168);
+  HAL_PCDEx_PMAConfig((PCD_HandleTypeDef*)pdev->pData , 0x82 , PCD_SNG_BUF, 0x1A8);
+#else
   HAL_PCDEx_PMAConfig((PCD_HandleTypeDef*)pdev->pData , 0x81 , PCD_SNG_BUF, 0xC0);
   HAL_PCDEx_PMAConfig((PCD_HandleTypeDef*)pdev->pData , 0x01 , PCD_SNG_BUF, 0x110);
-  HAL_PCDEx_PMAConfig((PCD_HandleTypeDef*)pdev->pData , 0x82 , PCD_SNG_BUF, 0x100);
+  /* The CDC command endpoint's 8 bytes before EP1 OUT, or after it the
+     USB_CONTROL_EP endpoint's VENDOR_CTRL_PACKET_SIZE (32) */
+  HAL_PCDEx_PMAConfig((PCD_HandleTypeDef*)pdev->pData , 0x82 , PCD_SNG_BUF, USB_CONTROL_EP ? 0x150 : 0x100);
+#endif
   /* USER CODE END EndPoint_Configuration_CDC */
   return USBD_OK;
 }
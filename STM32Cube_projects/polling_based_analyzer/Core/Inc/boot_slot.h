@@ -0,0 +1,41 @@
+/**
+  ******************************************************************************
+  * @file           : boot_slot.h
+  * @brief          : Both firmwares resident in flash, switched by a reset
+  ******************************************************************************
+  * DUAL_IMAGE builds link with STM32F103C8TX_FLASH_SLOT.ld instead of the
+  * whole-flash script: the interrupt firmware in slot A (0x08000000,
+  * 32 KB), which the core boots, and the polling firmware in slot B
+  * (0x08008000, 31 KB). The last page, the stored clock correction, is
+  * shared. Flash both images once; a switch then costs a reset and a
+  * new enumeration, about a second, instead of an erase and a program.
+  *
+  * Host command 'J' slot(1) keeps the slot in backup register DR1, takes
+  * the device off the bus and resets. Slot A's boot_slot_select, first
+  * thing in main, jumps to slot B when DR1 asks for it and slot B holds
+  * an image. The backup domain outlives a reset but not a power cycle
+  * (VBAT is tied to VDD), so a plugged-in analyzer starts in slot A.
+  ******************************************************************************
+  */
+
+#ifndef __BOOT_SLOT_H
+#define __BOOT_SLOT_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include "main.h"
+
+#define BOOT_SLOT_A 0                       // 'J' slots: the interrupt firmware
+#define BOOT_SLOT_B 1                       // the polling firmware
+#define BOOT_SLOT_B_ADDRESS 0x08008000UL    // STM32F103C8TX_FLASH_SLOT.ld
+
+void boot_slot_select(void);
+void boot_slot_switch(uint32_t slot);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* __BOOT_SLOT_H */
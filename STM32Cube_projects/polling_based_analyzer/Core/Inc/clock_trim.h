@@ -0,0 +1,44 @@
+/**
+  ******************************************************************************
+  * @file           : clock_trim.h
+  * @brief          : Stored correction of the HSE-derived sample clock
+  ******************************************************************************
+  * DWT->CYCCNT, which paces and stamps the samples, runs off the 8 MHz
+  * HSE crystal through the PLL, whose real frequency is off by some tens
+  * of ppm. clock_calibrate.py measures that error from
+  * the in-band SOF pairs against the host's USB frame clock and sends it
+  * with host command 'L'; the correction is kept in the last flash page
+  * and the 'V' reply reports the clock corrected, so captures carry the
+  * calibrated rate in their header. Sample periods stay whole nominal
+  * cycles.
+  *
+  * Writing the page erases it first, which stalls the CPU (and so the
+  * sampling) for about 20 ms.
+  ******************************************************************************
+  */
+
+#ifndef __CLOCK_TRIM_H
+#define __CLOCK_TRIM_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include "main.h"
+
+#define CLOCK_TRIM_CLEAR   ((int32_t)0x80000000)    // 'L' argument: forget the correction
+#define CLOCK_TRIM_MAX_PPB 1000000                  // larger corrections are refused
+#define CLOCK_TRIM_PAGE_WORDS 16                    // words of records a rewrite keeps
+#define CLOCK_TRIM_BOOT_PRESET 4                    // word of the boot capture preset (boot_capture.h)
+
+int32_t clock_trim_ppb(void);
+uint32_t clock_trim_apply(uint32_t hz);
+uint32_t clock_trim_adjust(int32_t ppb);
+const uint32_t *clock_trim_page(void);
+uint32_t clock_trim_store(uint32_t offset, const uint32_t *words, uint32_t count);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* __CLOCK_TRIM_H */
@@ -0,0 +1,63 @@
+/**
+  ******************************************************************************
+  * @file           : dma_cache.h
+  * @brief          : Data cache upkeep of the buffers DMA writes or reads
+  ******************************************************************************
+  * The F103 has no data cache, so DMA and the CPU always see the same
+  * RAM and everything here compiles to nothing. A Cortex-M7 part (the
+  * STM32H743 port, README Development Plans) caches the AXI SRAM the
+  * capture buffers go to, and its CMSIS device header sets
+  * __DCACHE_PRESENT. There:
+  *   dma_cache_clean       writes the CPU's cached bytes back to RAM,
+  *                         before a transfer reads them
+  *   dma_cache_invalidate  drops the cached copy, before the CPU reads
+  *                         what DMA wrote
+  * Both act on whole 32-byte lines, so a buffer declared DMA_BUFFER
+  * starts on one and should fill whole lines: an invalidate must not
+  * drop a neighbour's bytes the CPU has not written back yet.
+  ******************************************************************************
+  */
+
+#ifndef __DMA_CACHE_H
+#define __DMA_CACHE_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include "main.h"
+
+#if defined(__DCACHE_PRESENT) && __DCACHE_PRESENT
+#define DMA_CACHE_LINE 32
+#else
+#define DMA_CACHE_LINE 4
+#endif
+#define DMA_BUFFER __ALIGNED(DMA_CACHE_LINE)    // a DMA buffer starts on a cache line
+
+static inline void dma_cache_clean(const volatile void *buf, uint32_t bytes)
+{
+#if defined(__DCACHE_PRESENT) && __DCACHE_PRESENT
+    uint32_t start = (uint32_t)buf & ~(DMA_CACHE_LINE - 1);
+    SCB_CleanDCache_by_Addr((uint32_t *)start, (int32_t)((uint32_t)buf + bytes - start));
+#else
+    (void)buf;
+    (void)bytes;
+#endif
+}
+
+static inline void dma_cache_invalidate(const volatile void *buf, uint32_t bytes)
+{
+#if defined(__DCACHE_PRESENT) && __DCACHE_PRESENT
+    uint32_t start = (uint32_t)buf & ~(DMA_CACHE_LINE - 1);
+    SCB_InvalidateDCache_by_Addr((uint32_t *)start, (int32_t)((uint32_t)buf + bytes - start));
+#else
+    (void)buf;
+    (void)bytes;
+#endif
+}
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* __DMA_CACHE_H */
@@ -0,0 +1,172 @@
+/**
+  ******************************************************************************
+  * @file           : host_cmd.h
+  * @brief          : Commands sent by the host over the CDC OUT endpoint
+  ******************************************************************************
+  * Each command is one opcode byte followed by a fixed number of
+  * little-endian argument bytes. Commands may span OUT packets; unknown
+  * opcodes are skipped one byte at a time. The USB interrupt only queues
+  * whole commands; host_cmd_process() runs them from the main loop.
+  *
+  *   'C' rate_hz(4) mask(1) samples(2)   set sample rate, channel mask and
+  *                                       samples per block (0 = default);
+  *                                       16-channel builds ignore the mask;
+  *                                       the first block of the new
+  *                                       settings is a BLOCK_MAGIC_HEADER
+  *                                       block of one StreamHeader
+  *   'B' mask(1) value(1) pre(1) rate_hz(4)
+  *                                       burst capture: trigger when the
+  *                                       masked channels change to value,
+  *                                       keep pre percent of the window
+  *                                       before it (rate 0 = fastest)
+  *   'A' mask(1) value(1) pre(1) rate_hz(4) segments(2)
+  *                                       segmented burst: the window split
+  *                                       in segments, each filled at its
+  *                                       own trigger as 'B' fills it and
+  *                                       the next armed at once; uploaded
+  *                                       as 'B' bursts, one after another,
+  *                                       when all are filled (protocol 6)
+  *   'e' mask(1) value(1) rate_hz(4) delay(4) passes(2) samples(2)
+  *                                       equivalent-time capture of a
+  *                                       repeating signal: each pass
+  *                                       waits for the trigger as 'B',
+  *                                       then delay + pass % period
+  *                                       cycles, and runs an unrolled
+  *                                       kernel for samples (0 = burst
+  *                                       window); uploaded after each
+  *                                       pass as BLOCK_MAGIC_EQUIV blocks
+  *                                       timed from the trigger, passes
+  *                                       0 = one per cycle of the period
+  *                                       (protocol 7)
+  *   'S'                                 send and clear the timing
+  *                                       histograms (POLL_STATS builds)
+  *   'R' run(1)                          0 stops sampling, 1 resumes
+  *   'D' window(4)                       POLL_DECIMATE builds: send one
+  *                                       BLOCK_MAGIC_DECIMATE record per
+  *                                       window samples instead of the
+  *                                       samples, 0 = off; applies as 'C'
+  *                                       does, with a header block
+  *   'V'                                 report HOST_INFO_WORDS words:
+  *                                       protocol version, HOST_CAP_*
+  *                                       bits, timestamp clock in Hz,
+  *                                       USB transmit queue high-water
+  *                                       mark, glitches suppressed (0)
+  *   'L' ppb(4)                          add a measured clock error
+  *                                       (signed, against the rate 'V'
+  *                                       reports) to the correction kept
+  *                                       in flash, 0x80000000 clears it;
+  *                                       answers as 'V' does
+  *                                       (clock_trim.h)
+  *   'J' slot(1)                         DUAL_IMAGE builds: reset into the
+  *                                       interrupt (0) or polling (1)
+  *                                       firmware (boot_slot.h)
+  ******************************************************************************
+  */
+
+#ifndef __HOST_CMD_H
+#define __HOST_CMD_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include "main.h"
+
+#define HOST_CMD_CONFIG 'C'
+#define HOST_CMD_BURST  'B'
+#define HOST_CMD_SEGMENTS 'A'
+#define HOST_CMD_STATS  'S'
+#define HOST_CMD_RUN    'R'
+#define HOST_CMD_INFO   'V'
+#define HOST_CMD_TRIM   'L'
+#define HOST_CMD_SLOT   'J'
+#define HOST_CMD_DECIMATE 'D'
+#define HOST_CMD_EQUIVALENT 'e'
+
+#define HOST_CMD_QUEUE  8       // commands waiting for the main loop, power of 2
+#define HOST_PROTOCOL_VERSION 7
+#define HOST_INFO_WORDS 5
+
+/* Capability bits of the 'V' reply, the same in both firmwares */
+#define HOST_CAP_EVENTS   (1UL << 0)    // edge event stream
+#define HOST_CAP_POLL     (1UL << 1)    // paced polling blocks
+#define HOST_CAP_DMA      (1UL << 2)    // DMA-paced sampling
+#define HOST_CAP_BURST    (1UL << 3)    // triggered burst capture, 'B'
+#define HOST_CAP_RLE      (1UL << 4)    // run-length blocks
+#define HOST_CAP_STATS    (1UL << 5)    // timing histograms, 'S'
+#define HOST_CAP_FLUSH    (1UL << 6)    // flush policy, 'F'
+#define HOST_CAP_SNAPSHOT (1UL << 7)    // snapshot event format
+#define HOST_CAP_COMPACT  (1UL << 8)    // compact event stream
+#define HOST_CAP_IC_DMA   (1UL << 9)    // CH2 by timer input capture
+#define HOST_CAP_BULK     (1UL << 10)   // vendor-class bulk device
+#define HOST_CAP_FRAMED   (1UL << 11)   // framed event stream
+#define HOST_CAP_BENCH    (1UL << 12)   // USB benchmark pattern, 'T'
+#define HOST_CAP_SOF_SYNC (1UL << 13)   // periodic USB frame/clock pairs
+#define HOST_CAP_ISO      (1UL << 14)   // isochronous stream, alternate setting 1
+#define HOST_CAP_UART     (1UL << 15)   // on-device UART decoding, 'U'
+#define HOST_CAP_TRIGGER  (1UL << 16)   // triggered event stream, 'G'
+#define HOST_CAP_SPI      (1UL << 17)   // SPI sniffing by the SPI peripherals, 'P'
+#define HOST_CAP_I2C      (1UL << 18)   // on-device I2C framing, 'I'
+#define HOST_CAP_GLITCH   (1UL << 19)   // minimum pulse width filter, 'W'
+#define HOST_CAP_CHANNELS (1UL << 20)   // EXTI channel enable mask, 'E'
+#define HOST_CAP_STORM    (1UL << 21)   // per-channel edge rate limit, 'K'
+#define HOST_CAP_CLOCK    (1UL << 22)   // timestamp clock presets, 'H'
+#define HOST_CAP_LAYOUT   (1UL << 23)   // interrupt priority layouts, 'N'
+#define HOST_CAP_MEASURE  (1UL << 24)   // on-device frequency and duty, 'Q'
+#define HOST_CAP_TRIM     (1UL << 25)   // stored clock correction, 'L'
+#define HOST_CAP_WIDE     (1UL << 26)   // 8 or 16 sampled channels, POLL_CHANNELS
+#define HOST_CAP_SYNC     (1UL << 27)   // shared reference pulse between boards, 'Y'
+#define HOST_CAP_DUAL     (1UL << 28)   // both firmwares resident, 'J' switches
+#define HOST_CAP_ADAPTIVE (1UL << 29)   // 'M' 2: edges or poll blocks by the edge rate
+#define HOST_CAP_DECIMATE (1UL << 31)   // min/max window records, 'D' (polling firmware)
+
+/* Stream header: the first bytes of every stream the host starts (see
+ * 'C'), so the host picks its decoder from the stream instead of from
+ * settings that must match the build. Little-endian, STREAM_HEADER_SIZE
+ * bytes; a later version only appends fields, so a host skips size */
+#define STREAM_HEADER_MAGIC   0x4D525453UL  // "STRM"
+#define STREAM_HEADER_VERSION 1
+#define STREAM_HEADER_SIZE    24
+
+#define STREAM_ENCODING_EDGE     1  // one event word per edge, event_format.h
+#define STREAM_ENCODING_SNAPSHOT 2  // one event word per EXTI interrupt
+#define STREAM_ENCODING_BLOCKS   3  // poll sample blocks, found by their magic
+
+#define STREAM_COMPRESSION_NONE    0
+#define STREAM_COMPRESSION_COMPACT 1  // varint time deltas, STREAM_COMPACT
+#define STREAM_COMPRESSION_RLE     2  // run-length sample blocks, POLL_RLE
+#define STREAM_COMPRESSION_PREDICT 3  // compact with predicted edge runs, STREAM_PREDICT
+#define STREAM_COMPRESSION_DECIMATE 4 // window summary blocks, POLL_DECIMATE
+
+#define STREAM_FLAG_FRAMED 0x01       // transfers carry a checked StreamFrame header
+#define STREAM_FLAG_ISO    0x02       // isochronous endpoint: transfers may be lost
+#define STREAM_FLAG_ADAPTIVE 0x04     // 'M' 2: the device may hand over to the other engine
+
+typedef struct
+{
+    uint32_t magic;         // STREAM_HEADER_MAGIC
+    uint8_t version;        // STREAM_HEADER_VERSION
+    uint8_t size;           // STREAM_HEADER_SIZE
+    uint8_t encoding;       // STREAM_ENCODING_*
+    uint8_t compression;    // STREAM_COMPRESSION_*
+    uint8_t channels;       // probe channels the stream carries
+    uint8_t flags;          // STREAM_FLAG_*
+    uint8_t time_bits;      // bits of an event's time field, 32 for blocks
+    uint8_t protocol;       // HOST_PROTOCOL_VERSION
+    uint32_t tick_hz;       // timestamp clock with the stored correction
+    uint32_t capabilities;  // HOST_CAP_* of the build
+    uint32_t check;         // ~ XOR of the words before
+} StreamHeader;
+
+void host_cmd_receive(const uint8_t *buf, uint32_t len);
+void host_cmd_process(void);
+uint32_t host_cmd_abort_pending(void);
+uint32_t host_cmd_capabilities(void);
+void host_stream_header(StreamHeader *header, uint32_t encoding, uint32_t compression,
+                        uint32_t channels, uint32_t flags, uint32_t time_bits, uint32_t tick_hz);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* __HOST_CMD_H */
@@ -53,6 +53,18 @@ extern "C" {
 void Error_Handler(void);
 
 /* USER CODE BEGIN EFP */
+void sample_tx_complete(void);
+void sample_configure(uint32_t rate_hz, uint32_t mask, uint32_t samples);
+void sample_burst(uint32_t trig_mask, uint32_t trig_value, uint32_t pre_percent, uint32_t rate_hz);
+void sample_burst_segments(uint32_t trig_mask, uint32_t trig_value, uint32_t pre_percent,
+                           uint32_t rate_hz, uint32_t segments);
+void sample_stats_request(void);
+void sample_set_running(uint32_t run);
+void sample_send_info(void);
+void sample_sof(uint32_t frame);
+void sample_decimate(uint32_t window);
+void sample_equivalent(uint32_t trig_mask, uint32_t trig_value, uint32_t rate_hz, uint32_t delay,
+                       uint32_t passes, uint32_t samples);
 
 /* USER CODE END EFP */
 
@@ -75,7 +87,128 @@ void Error_Handler(void);
 #define CH1_GPIO_Port GPIOB
 
 /* USER CODE BEGIN Private defines */
+/* Build options, override with -D:
+ * BUILD_PROFILE      picks the defaults of the geometry options below:
+ *                    PROFILE_GENERAL (four 1 KB blocks),
+ *                    PROFILE_LOW_LATENCY (blocks of 256 bytes),
+ *                    PROFILE_DEEP_BUFFER (two 2 KB blocks, the fewest
+ *                    transfers) or
+ *                    PROFILE_MAX_RATE (the polling loop at its own
+ *                    cost, POLL_MIN_PERIOD in main.c)
+ * SAMPLE_MODE_DMA    1 = TIM2 paces DMA1 copies of GPIOB->IDR; 0 = CPU
+ *                    polling loop paced by DWT->CYCCNT
+ * DMA_SAMPLE_RATE_HZ sample rate of the DMA mode
+ * POLL_SAMPLE_PERIOD CPU cycles between samples of the polling loop;
+ *                    0 = the fastest the loop keeps up with
+ * POLL_CHANNELS      4 = CH1-CH4 on PB4-PB7; 8 adds CH5-CH8 on PB0-PB3;
+ *                    16 adds CH9-CH16 on PB8-PB15 and sends the whole
+ *                    port as 16-bit samples, ignoring the channel mask
+ * SAMPLE_COUNT       samples per block sent over USB, even
+ * BLOCK_POOL         sample blocks, power of 2: one fills while the
+ *                    others wait for or are on USB, so a USB stall of
+ *                    BLOCK_POOL - 1 blocks' fill time costs no samples
+ * POLL_RLE           1 = send (value, run length) records instead of raw
+ *                    samples, so an idle bus costs almost no bandwidth
+ * BURST_SAMPLES      window of a burst capture; the DMA mode uses its
+ *                    sample buffer instead. Both default to what fits
+ *                    the RAM at POLL_CHANNELS
+ * POLL_STATS         1 = histogram sample intervals and USB stalls, sent
+ *                    as a stats block on host command 'S'
+ * POLL_DECIMATE      1 = host command 'D' reduces each window of samples
+ *                    to one record of AND/OR masks and edge counts, for
+ *                    overview captures far longer than the raw rate allows
+ * USB_VENDOR_CLASS   1 = enumerate as a WinUSB/libusb bulk device (one
+ *                    bulk IN, one bulk OUT endpoint) instead of CDC ACM
+ * USB_IN_DOUBLE_BUFFER 1 = double-buffer the data IN endpoint in PMA; the
+ *                    data OUT endpoint moves from 0x01 to 0x03
+ * USB_TX_QUEUE       transfers CDC_Transmit_FS accepts before returning
+ *                    USBD_BUSY, counting the one on the bus; power of 2
+ * SOF_SYNC_FRAMES    USB frames (1 ms) between sync blocks pairing the
+ *                    frame count with DWT->CYCCNT at that SOF; 0 = none
+ * HEALTH_REPORT_MS   period of the link health block while sampling;
+ *                    0 = none
+ * DUAL_IMAGE         1 = slot B of the two-image flash layout, linked
+ *                    with STM32F103C8TX_FLASH_SLOT.ld (boot_slot.h)
+ * RAM_HOT_PATHS      1 = run the polling loops and the block packing
+ *                    from SRAM, clear of flash wait states
+ * MAIN_LOOP_SLEEP    1 = the main loop sleeps (WFE) while it waits for
+ *                    USB, a DMA half buffer or a command, instead of
+ *                    spinning on the bus */
+#define PROFILE_GENERAL     0
+#define PROFILE_LOW_LATENCY 1
+#define PROFILE_DEEP_BUFFER 2
+#define PROFILE_MAX_RATE    3
+#ifndef BUILD_PROFILE
+#define BUILD_PROFILE PROFILE_GENERAL
+#endif
+#ifndef SAMPLE_MODE_DMA
+#define SAMPLE_MODE_DMA 0
+#endif
+#ifndef DMA_SAMPLE_RATE_HZ
+#define DMA_SAMPLE_RATE_HZ 250000
+#endif
+#ifndef POLL_SAMPLE_PERIOD
+#define POLL_SAMPLE_PERIOD (BUILD_PROFILE == PROFILE_MAX_RATE ? 0 : 72)
+#endif
+#ifndef POLL_CHANNELS
+#define POLL_CHANNELS 4
+#endif
+#ifndef SAMPLE_COUNT
+#define SAMPLE_COUNT ((BUILD_PROFILE == PROFILE_LOW_LATENCY ? 2048 : \
+                       BUILD_PROFILE == PROFILE_DEEP_BUFFER ? 16384 : 8192) / POLL_CHANNELS)
+#endif
+#ifndef BLOCK_POOL
+#define BLOCK_POOL (BUILD_PROFILE == PROFILE_DEEP_BUFFER ? 2 : 4)
+#endif
+#ifndef POLL_RLE
+#define POLL_RLE 0
+#endif
+#ifndef BURST_SAMPLES
+#define BURST_SAMPLES (POLL_CHANNELS > 8 ? 5120 : 10240)
+#endif
+#ifndef POLL_STATS
+#define POLL_STATS 0
+#endif
+#ifndef POLL_DECIMATE
+#define POLL_DECIMATE 0
+#endif
+#ifndef USB_VENDOR_CLASS
+#define USB_VENDOR_CLASS 0
+#endif
+#ifndef USB_IN_DOUBLE_BUFFER
+#define USB_IN_DOUBLE_BUFFER 0
+#endif
+#ifndef USB_TX_QUEUE
+#define USB_TX_QUEUE 4
+#endif
+#ifndef SOF_SYNC_FRAMES
+#define SOF_SYNC_FRAMES 100
+#endif
+#ifndef HEALTH_REPORT_MS
+#define HEALTH_REPORT_MS 100
+#endif
+#ifndef DUAL_IMAGE
+#define DUAL_IMAGE 0
+#endif
+#ifndef RAM_HOT_PATHS
+#define RAM_HOT_PATHS 0
+#endif
+#ifndef MAIN_LOOP_SLEEP
+#define MAIN_LOOP_SLEEP 0
+#endif
+#if RAM_HOT_PATHS
+#define HOT_PATH __attribute__((section(".RamFunc")))  // copied to SRAM with .data
+#else
+#define HOT_PATH
+#endif
 
+/* One raw GPIOB->IDR read as the buffers keep it: the low byte holds
+ * PB7-PB0, all of CH1-CH8; 16-channel builds keep the whole port */
+#if POLL_CHANNELS > 8
+typedef uint16_t PollSample;
+#else
+typedef uint8_t PollSample;
+#endif
 /* USER CODE END Private defines */
 
 #ifdef __cplusplus
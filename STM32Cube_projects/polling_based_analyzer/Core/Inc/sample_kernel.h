@@ -0,0 +1,39 @@
+/**
+  ******************************************************************************
+  * @file           : sample_kernel.h
+  * @brief          : Cycle-exact unrolled sampling kernels
+  ******************************************************************************
+  * Each kernel copies GPIOB->IDR (a PollSample) into a buffer with a fixed
+  * number of cycles between reads: eight unrolled read/store slots padded
+  * with NOPs, the last slot's padding shortened by the loop branch. They
+  * run from RAM so flash wait states cannot stretch a slot. The table is
+  * generated at compile time; the nominal period assumes the load/store
+  * and branch costs below, and sample_kernel_init() measures the real one.
+  ******************************************************************************
+  */
+
+#ifndef __SAMPLE_KERNEL_H
+#define __SAMPLE_KERNEL_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include "main.h"
+
+#define KERNEL_UNROLL 8   // samples per loop iteration; counts are multiples of it
+
+typedef struct {
+    uint32_t nominal;   // cycles per sample the kernel was generated for
+    uint32_t period;    // measured cycles per sample
+    void (*run)(PollSample *buf, uint32_t count);
+} SampleKernel;
+
+void sample_kernel_init(void);
+const SampleKernel *sample_kernel_find(uint32_t period);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* __SAMPLE_KERNEL_H */
@@ -0,0 +1,40 @@
+/**
+  ******************************************************************************
+  * @file           : sampler_dma.h
+  * @brief          : Timer-paced DMA sampling of GPIOB
+  ******************************************************************************
+  * Every TIM2 update raises a DMA1 channel 2 request that copies GPIOB->IDR
+  * into a circular PollSample buffer, so samples are spaced exactly one
+  * timer period apart and the CPU does no work per sample. The buffer is
+  * used as two halves: while DMA fills one, the main loop packs and sends
+  * the other. Bits 7-0 of each sample are PB7-PB0, bits 15-8 PB15-PB8 in
+  * 16-channel builds; pins of no channel are ignored when packing.
+  *
+  * The first sample is taken one period after sampler_dma_start(), so the
+  * CYCCNT time of sample n is start + (n + 1) * period.
+  ******************************************************************************
+  */
+
+#ifndef __SAMPLER_DMA_H
+#define __SAMPLER_DMA_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include "main.h"
+
+#define DMA_HALF_SAMPLES SAMPLE_COUNT   // largest half buffer, one block
+
+void sampler_dma_start(uint32_t rate_hz, uint32_t samples);
+PollSample *sampler_dma_next(uint32_t *first_cycle);
+uint32_t sampler_dma_period(void);
+uint32_t sampler_dma_samples(void);
+PollSample *sampler_dma_buffer(uint32_t *size);
+void sampler_dma_stop(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* __SAMPLER_DMA_H */
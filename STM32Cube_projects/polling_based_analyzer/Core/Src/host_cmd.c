@@ -0,0 +1,233 @@
+/**
+  ******************************************************************************
+  * @file           : host_cmd.c
+  * @brief          : Commands sent by the host over the CDC OUT endpoint
+  ******************************************************************************
+  */
+
+#include "host_cmd.h"
+#include "clock_trim.h"
+#include "boot_slot.h"
+#include <string.h>
+
+#define HOST_CMD_MAX 16
+
+static uint8_t cmd_buf[HOST_CMD_MAX];
+static uint32_t cmd_len = 0;
+static uint8_t cmd_queue[HOST_CMD_QUEUE][HOST_CMD_MAX];
+static volatile uint32_t queue_head = 0;   // advanced by the USB interrupt
+static volatile uint32_t queue_tail = 0;   // advanced by the main loop
+static volatile uint32_t aborts_queued = 0;  // queued commands that end a burst wait
+static volatile uint32_t aborts_done = 0;
+volatile uint32_t host_cmd_overruns = 0;   // commands lost to a full queue
+
+static uint32_t get_u16(const uint8_t *p) { return p[0] | (p[1] << 8); }
+static uint32_t get_u32(const uint8_t *p) { return get_u16(p) | (get_u16(p + 2) << 16); }
+
+/**
+ * @brief Total length of a command, opcode included; 0 if unknown
+ */
+static uint32_t cmd_size(uint8_t opcode)
+{
+    switch (opcode)
+    {
+    case HOST_CMD_CONFIG: return 1 + 4 + 1 + 2;
+    case HOST_CMD_BURST:  return 1 + 1 + 1 + 1 + 4;
+    case HOST_CMD_SEGMENTS: return 1 + 1 + 1 + 1 + 4 + 2;
+    case HOST_CMD_EQUIVALENT: return 1 + 1 + 1 + 4 + 4 + 2 + 2;
+#if POLL_STATS
+    case HOST_CMD_STATS:  return 1;
+#endif
+#if POLL_DECIMATE
+    case HOST_CMD_DECIMATE: return 1 + 4;
+#endif
+    case HOST_CMD_RUN:    return 1 + 1;
+    case HOST_CMD_INFO:   return 1;
+    case HOST_CMD_TRIM:   return 1 + 4;
+#if DUAL_IMAGE
+    case HOST_CMD_SLOT:   return 1 + 1;
+#endif
+    default:              return 0;
+    }
+}
+
+/**
+ * @brief Commands that replace the capture in progress; the others wait
+ *        until an armed burst has been captured
+ */
+static uint32_t cmd_aborts(uint8_t opcode)
+{
+    return opcode == HOST_CMD_CONFIG || opcode == HOST_CMD_BURST || opcode == HOST_CMD_RUN
+        || opcode == HOST_CMD_DECIMATE || opcode == HOST_CMD_SEGMENTS || opcode == HOST_CMD_EQUIVALENT;
+}
+
+static void cmd_execute(const uint8_t *cmd)
+{
+    switch (cmd[0])
+    {
+    case HOST_CMD_CONFIG:
+        sample_configure(get_u32(cmd + 1), cmd[5], get_u16(cmd + 6));
+        break;
+    case HOST_CMD_BURST:
+        sample_burst(cmd[1], cmd[2], cmd[3], get_u32(cmd + 4));
+        break;
+    case HOST_CMD_SEGMENTS:
+        sample_burst_segments(cmd[1], cmd[2], cmd[3], get_u32(cmd + 4), get_u16(cmd + 8));
+        break;
+    case HOST_CMD_EQUIVALENT:
+        sample_equivalent(cmd[1], cmd[2], get_u32(cmd + 3), get_u32(cmd + 7), get_u16(cmd + 11), get_u16(cmd + 13));
+        break;
+#if POLL_STATS
+    case HOST_CMD_STATS:
+        sample_stats_request();
+        break;
+#endif
+    case HOST_CMD_RUN:
+        sample_set_running(cmd[1]);
+        break;
+#if POLL_DECIMATE
+    case HOST_CMD_DECIMATE:
+        sample_decimate(get_u32(cmd + 1));
+        break;
+#endif
+    case HOST_CMD_INFO:
+        sample_send_info();
+        break;
+    case HOST_CMD_TRIM:
+        clock_trim_adjust((int32_t)get_u32(cmd + 1));
+        sample_send_info();
+        break;
+#if DUAL_IMAGE
+    case HOST_CMD_SLOT:
+        boot_slot_switch(cmd[1]);
+        break;
+#endif
+    }
+}
+
+/**
+ * @brief HOST_CAP_* bits of this build, reported by 'V'
+ */
+uint32_t host_cmd_capabilities(void)
+{
+    return HOST_CAP_POLL | HOST_CAP_BURST | HOST_CAP_TRIM
+#if SAMPLE_MODE_DMA
+        | HOST_CAP_DMA
+#endif
+#if POLL_RLE
+        | HOST_CAP_RLE
+#endif
+#if POLL_CHANNELS > 4
+        | HOST_CAP_WIDE
+#endif
+#if POLL_STATS
+        | HOST_CAP_STATS
+#endif
+#if POLL_DECIMATE
+        | HOST_CAP_DECIMATE
+#endif
+#if USB_VENDOR_CLASS
+        | HOST_CAP_BULK
+#endif
+#if SOF_SYNC_FRAMES
+        | HOST_CAP_SOF_SYNC
+#endif
+#if DUAL_IMAGE
+        | HOST_CAP_DUAL
+#endif
+        ;
+}
+
+/**
+ * @brief Fills the header a restarted stream begins with
+ * @param header - filled in, check word included
+ * @param encoding - STREAM_ENCODING_*
+ * @param compression - STREAM_COMPRESSION_*
+ * @param channels - probe channels in the stream
+ * @param flags - STREAM_FLAG_*
+ * @param time_bits - bits of an event's time field, 32 for blocks
+ * @param tick_hz - timestamp clock with the stored correction
+ * @retval none
+ */
+void host_stream_header(StreamHeader *header, uint32_t encoding, uint32_t compression,
+                        uint32_t channels, uint32_t flags, uint32_t time_bits, uint32_t tick_hz)
+{
+    const uint32_t *words = (const uint32_t *)header;
+    uint32_t check = 0;
+
+    header->magic = STREAM_HEADER_MAGIC;
+    header->version = STREAM_HEADER_VERSION;
+    header->size = sizeof(StreamHeader);
+    header->encoding = encoding;
+    header->compression = compression;
+    header->channels = channels;
+    header->flags = flags;
+    header->time_bits = time_bits;
+    header->protocol = HOST_PROTOCOL_VERSION;
+    header->tick_hz = tick_hz;
+    header->capabilities = host_cmd_capabilities();
+    for (uint32_t i = 0; i < sizeof(StreamHeader) / 4 - 1; i++) check ^= words[i];
+    header->check = ~check;
+}
+
+/**
+ * @brief Runs the queued commands; called from the main loop between
+ *        blocks
+ * @retval none
+ */
+void host_cmd_process(void)
+{
+    while (queue_tail != queue_head)
+    {
+        const uint8_t *cmd = cmd_queue[queue_tail & (HOST_CMD_QUEUE - 1)];
+        if (cmd_aborts(cmd[0])) aborts_done++;
+        cmd_execute(cmd);
+        queue_tail++;
+    }
+}
+
+/**
+ * @brief Tells a waiting burst capture to give up: a command that
+ *        replaces it ('C', 'B', 'A', 'e', 'R' or 'D') is queued
+ * @retval 1 if the caller should return to the main loop
+ */
+uint32_t host_cmd_abort_pending(void)
+{
+    return aborts_queued != aborts_done;
+}
+
+/**
+ * @brief Feeds bytes received from the host to the command parser and
+ *        queues each complete command; runs in the USB interrupt from
+ *        CDC_Receive_FS
+ * @param buf - received bytes
+ * @param len - number of bytes
+ * @retval none
+ */
+void host_cmd_receive(const uint8_t *buf, uint32_t len)
+{
+    while (len--)
+    {
+        cmd_buf[cmd_len++] = *buf++;
+
+        uint32_t size = cmd_size(cmd_buf[0]);
+        if (size == 0)
+        {
+            cmd_len = 0;  // not an opcode, resync on the next byte
+        }
+        else if (cmd_len == size)
+        {
+            if (queue_head - queue_tail < HOST_CMD_QUEUE)
+            {
+                memcpy(cmd_queue[queue_head & (HOST_CMD_QUEUE - 1)], cmd_buf, size);
+                queue_head++;
+                if (cmd_aborts(cmd_buf[0])) aborts_queued++;
+            }
+            else
+            {
+                host_cmd_overruns++;
+            }
+            cmd_len = 0;
+        }
+    }
+}
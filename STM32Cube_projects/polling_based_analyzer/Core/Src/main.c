@@ -23,21 +23,146 @@
 /* Private includes ----------------------------------------------------------*/
 /* USER CODE BEGIN Includes */
 #include "usbd_cdc_if.h"
+#include "sampler_dma.h"
+#include "sample_kernel.h"
+#include "host_cmd.h"
+#include "clock_trim.h"
+#include "boot_slot.h"
+#include <string.h>
 /* USER CODE END Includes */
 
 /* Private typedef -----------------------------------------------------------*/
 /* USER CODE BEGIN PTD */
+#define BLOCK_DATA_BYTES (SAMPLE_COUNT * POLL_CHANNELS / 8)  // sample data per block
+#define BLOCK_MAX_FIXUPS (BLOCK_POOL < 8 ? 64 / BLOCK_POOL : 8)  // late samples listed per block
+#define POOL_MASK (BLOCK_POOL - 1)
+
+/* Evenly spaced samples: sample i was taken at start + i * period, plus
+ * the late cycles of its fixup if it has one. Fields are naturally
+ * aligned, so the header is written with plain word stores */
+typedef struct {
+    uint16_t magic;     // BLOCK_MAGIC or BLOCK_MAGIC_RLE, lets the host resync
+    uint16_t count;     // BLOCK_MAGIC: samples in data, BLOCK_MAGIC_RLE: bytes
+    uint32_t start;     // DWT->CYCCNT of the first sample
+    uint32_t end;       // DWT->CYCCNT of the last sample
+    uint32_t period;    // CPU cycles between samples
+    uint8_t mask;       // sampled channels, bit n = CH n+1, see channel_pins
+    uint8_t bits;       // bits per packed sample: 1, 2, 4 or 8; 16 = whole port
+    uint16_t fixups;    // BlockFixup entries after the data
+} BlockHeader;
+
+/* A sample taken off its grid, e.g. while the loop catches up after the
+ * buffer swap or an interrupt */
+typedef struct {
+    uint16_t index;     // sample index in the block
+    uint16_t late;      // cycles after start + index * period
+} BlockFixup;
+
+/* A sample holds the levels of the channels in mask, lowest channel in
+ * bit 0. BLOCK_MAGIC: samples packed bits wide, the earliest in the low
+ * bits of each byte; the packers fill a word at a time, 32 / bits samples
+ * per aligned store, which is the same byte order. With 16 bits each sample is the raw GPIOB->IDR
+ * half-word and the host maps pins to channels. BLOCK_MAGIC_RLE: (value, run length) records, see
+ * rle_put. The data is zero-padded to a word, then the fixups follow */
+typedef struct {
+    BlockHeader header;
+    uint8_t data[BLOCK_DATA_BYTES + 3 + BLOCK_MAX_FIXUPS * sizeof(BlockFixup)];
+} SampleBlock;
+
+/* BLOCK_MAGIC_DECIMATE data: record i sums up the window of samples from
+ * start + i * period, period being the window's cycles. Levels are in
+ * channel order (bit n = CH n+1) at any packing, unsampled channels 0;
+ * edges count the changes from the sample before the window, so the
+ * levels entering it are last ^ (channels with an odd count) */
+typedef struct {
+    uint16_t all;       // channels high in every sample of the window (AND)
+    uint16_t any;       // channels high in at least one sample (OR)
+    uint16_t last;      // levels of its last sample
+    uint16_t edges[POLL_CHANNELS];  // level changes per channel, saturating
+} DecimateRecord;
+
+/* Where a filled segment of a segmented burst starts; kept at the end of
+ * the burst window while the other segments are captured */
 typedef struct {
-    uint32_t timestamp;
-    uint8_t value;  // 4 bits: PB4–PB7
-} __attribute__((__packed__)) Sample;
+    uint32_t time;      // CYCCNT of the segment's first sample
+    uint32_t first;     // its ring index in the segment
+} SegmentMark;
 
 /* USER CODE END PTD */
 
 /* Private define ------------------------------------------------------------*/
 /* USER CODE BEGIN PD */
-#define SAMPLE_COUNT 1350  // Number of samples per buffer
-#define BUFFER_SIZE  (SAMPLE_COUNT)
+#define BLOCK_MAGIC  0xB10C
+#define BLOCK_MAGIC_RLE 0xB10D
+#define BLOCK_MAGIC_BURST   0xB10E   // packed block of a burst capture
+#define BLOCK_MAGIC_TRIGGER 0xB10F   // burst block whose first sample triggered
+#define BLOCK_MAGIC_STATS   0xB110   // POLL_STATS histograms, count = words
+#define BLOCK_MAGIC_INFO    0xB111   // reply to host command 'V', count = words
+#define BLOCK_MAGIC_SYNC    0xB112   // USB frame count, CYCCNT at that SOF
+#define BLOCK_MAGIC_HEALTH  0xB113   // link health counters, count = words
+#define BLOCK_MAGIC_HEADER  0xB114   // StreamHeader of new settings, count = words
+#define BLOCK_MAGIC_DECIMATE 0xB116  // POLL_DECIMATE window records, count = records
+#define BLOCK_MAGIC_EQUIV   0xB117   // packed block of an equivalent-time pass, times from its trigger
+#define POLL_CHANNEL_MASK (POLL_CHANNELS > 4 ? 0xFF : 0x0F)  // channels 'C' and 'B' can select
+#define RLE_MAX_RECORD  4            // bytes of a record with run < 2^24
+#define RLE_MAX_SAMPLES (1UL << 20)  // bounds block latency on an idle bus
+#define POLL_MAX_LATE   1024         // cycles behind its sample grid the loop may catch up
+#define FIXUP_LATE      8            // cycles late a polled sample gets a fixup
+#define BURST_MIN_PERIOD 24          // cycles the armed burst loop needs per sample
+#define BURST_MIN_SEGMENT 16         // samples of the shortest segment of a segmented burst
+#define EQUIV_ARM_CYCLES 72000       // cycles an equivalent-time pass waits with interrupts off, then polls for commands
+#define STATS_INTERVAL_BINS 32       // 1-cycle bins around the period, ends saturate
+#define STATS_STALL_BINS    32       // bin n: waits of 2^(n-1) to 2^n - 1 cycles
+#define DECIMATE_RECORDS (BLOCK_DATA_BYTES / sizeof(DecimateRecord))  // records a block holds
+#define DECIMATE_MIN_WINDOW (SAMPLE_COUNT / (DECIMATE_RECORDS - 1) + 1)  // a DMA half buffer's windows fit a block
+#define DECIMATE_MIN_PERIOD 48       // cycles the decimating loop needs per sample with no edge
+#define DECIMATE_MAX_SAMPLES (1UL << 20)  // bounds block latency of the decimating loop
+
+#if POLL_STATS
+#define POLL_STATS_CYCLES 12         // histogram update per polled sample
+#else
+#define POLL_STATS_CYCLES 0
+#endif
+#if POLL_RLE
+#define POLL_MIN_PERIOD (48 + POLL_STATS_CYCLES)  // cycles the polling loop needs per sample
+#else
+#define POLL_MIN_PERIOD (36 + POLL_STATS_CYCLES)
+#endif
+
+#if HSE_VALUE * 9 != 72000000
+#error "SystemClock_Config takes HSE x 9 (the .ioc's 8 MHz crystal) to the 72 MHz the sample periods and USB need"
+#endif
+#if POLL_SAMPLE_PERIOD && POLL_SAMPLE_PERIOD < POLL_MIN_PERIOD
+#error "POLL_SAMPLE_PERIOD below the polling loop's own cost"
+#endif
+#if POLL_CHANNELS != 4 && POLL_CHANNELS != 8 && POLL_CHANNELS != 16
+#error "POLL_CHANNELS must be 4, 8 or 16"
+#endif
+#if POLL_RLE && POLL_CHANNELS > 4
+#error "POLL_RLE records hold 4 channel levels"
+#endif
+#if SAMPLE_COUNT % 2 || SAMPLE_COUNT > 65535
+#error "SAMPLE_COUNT must be even and fit the 16-bit block count"
+#endif
+#if BLOCK_POOL < 2 || (BLOCK_POOL & (BLOCK_POOL - 1))
+#error "BLOCK_POOL must be a power of 2, at least 2"
+#endif
+/* The sample block pool (data, header and fixups), the burst window or
+ * DMA buffer and the SRAM copy of the hot paths, against the SRAM the
+ * rest leaves free (README, Memory Budget) */
+#define POLL_SAMPLE_BYTES (POLL_CHANNELS > 8 ? 2 : 1)
+#if SAMPLE_MODE_DMA
+#define POLL_WINDOW_BYTES (2 * SAMPLE_COUNT * POLL_SAMPLE_BYTES)
+#else
+#define POLL_WINDOW_BYTES (BURST_SAMPLES * POLL_SAMPLE_BYTES)
+#endif
+#define POLL_HOT_PATH_BYTES (RAM_HOT_PATHS ? 1024 : 0)
+#if BLOCK_POOL * (BLOCK_DATA_BYTES + 24 + 4 * BLOCK_MAX_FIXUPS) + POLL_WINDOW_BYTES + POLL_HOT_PATH_BYTES > 15 * 1024 + 512
+#error "SAMPLE_COUNT, BURST_SAMPLES and RAM_HOT_PATHS do not fit the SRAM left beside the USB stack"
+#endif
+#if defined(USB_ISO_STREAM) && USB_ISO_STREAM
+#error "USB_ISO_STREAM needs the framed event stream of interrupt_based_analyzer"
+#endif
 /* USER CODE END PD */
 
 /* Private macro -------------------------------------------------------------*/
@@ -59,9 +184,57 @@ static void MX_GPIO_Init(void);
 
 /* Private user code ---------------------------------------------------------*/
 /* USER CODE BEGIN 0 */
-Sample bufferA[BUFFER_SIZE];
-Sample bufferB[BUFFER_SIZE];
-volatile uint8_t usingBufferA = 1;
+/* Sample blocks go out in the order they are filled and CDC completes
+ * them in that order, so the pool is a ring of three running counts:
+ * blocks filled by the main loop, handed to CDC_Transmit_FS and sent.
+ * pool[filled] is the one being filled, the ones from sent up to it
+ * are queued or on the bus, and the sampler waits only once all of them
+ * are; each count has one writer, so neither side takes a lock */
+static SampleBlock pool[BLOCK_POOL];
+static uint32_t poolBytes[BLOCK_POOL];        // data bytes of each filled block
+static volatile uint32_t poolFilled = 0;      // blocks queued by the main loop
+static volatile uint32_t poolHanded = 0;      // ... of them accepted by CDC_Transmit_FS
+static volatile uint32_t poolSent = 0;        // ... of them sent, free again
+volatile uint32_t stallCount = 0;   // times the sampler lapped USB and waited
+
+#if HEALTH_REPORT_MS
+/* Link health since the last report (send_health) */
+static uint32_t healthLast = 0;     // CYCCNT of the last report
+static uint32_t healthStalls = 0;   // stallCount then
+static uint32_t healthBlocks = 0;   // blocks queued
+static volatile uint32_t healthBytes = 0;  // bytes CDC_Transmit_FS accepted
+static volatile uint32_t healthBusy = 0;   // full buffers CDC_Transmit_FS refused
+#endif
+
+#if POLL_STATS
+/* Timing histograms since the last report: the CYCCNT delta between
+ * consecutive polled samples, centred on the period (the first sample of
+ * a block counts from the last one of the previous block), and how long
+ * each queued block waited for a free buffer (bin 0: not at all) */
+static uint32_t statsInterval[STATS_INTERVAL_BINS];
+static uint32_t statsStall[STATS_STALL_BINS];
+static uint32_t statsLast;          // CYCCNT of the last polled sample
+static volatile uint8_t statsPending = 0;
+
+// __USAT(x, 5) saturates to the 32 bins
+static inline void stats_add_interval(uint32_t delta, uint32_t period) {
+    statsInterval[__USAT((int32_t)(delta - period) + STATS_INTERVAL_BINS / 2, 5)]++;
+}
+
+static void stats_add_stall(uint32_t cycles) {
+    uint32_t bin = 32 - __CLZ(cycles);
+    statsStall[bin < STATS_STALL_BINS ? bin : STATS_STALL_BINS - 1]++;
+}
+
+/**
+ * @brief Asks for the timing histograms; they are sent after the current
+ *        block. Called by the host command parser from the main loop
+ * @retval none
+ */
+void sample_stats_request(void) {
+    statsPending = 1;
+}
+#endif
 
 void DWT_Init(void) {
     CoreDebug->DEMCR |= CoreDebug_DEMCR_TRCENA_Msk;
@@ -69,8 +242,1030 @@ void DWT_Init(void) {
     DWT->CTRL |= DWT_CTRL_CYCCNTENA_Msk;
 }
 
-void send_buffer(Sample *buffer) {
-    while (CDC_Transmit_FS((uint8_t*)buffer, sizeof(Sample) * BUFFER_SIZE) == USBD_BUSY);
+uint8_t send_buffer(SampleBlock *buffer, uint32_t bytes) {
+    uint8_t status = CDC_Transmit_FS((uint8_t*)buffer, sizeof(BlockHeader) + bytes);
+#if HEALTH_REPORT_MS
+    if (status == USBD_OK) healthBytes += sizeof(BlockHeader) + bytes;
+    else healthBusy++;
+#endif
+    return status;
+}
+
+// The block the sampler fills next
+static inline SampleBlock *pool_block(void) {
+    return &pool[poolFilled & POOL_MASK];
+}
+
+// Hands filled blocks to USB while its transmit queue takes them. Runs in
+// the transmit-complete callback, or from the main loop with the USB
+// interrupt masked
+static void pool_transmit(void) {
+    while (poolHanded != poolFilled) {
+        uint32_t i = poolHanded & POOL_MASK;
+        if (send_buffer(&pool[i], poolBytes[i]) != USBD_OK) return;
+        poolHanded++;
+    }
+}
+
+/**
+ * @brief Called from the CDC transmit-complete callback (and on bus reset)
+ *        once per transfer, when the oldest block handed over may be reused
+ * @retval none
+ */
+void sample_tx_complete(void) {
+    poolSent++;
+    pool_transmit();
+}
+
+// Waits for an event while the main loop has nothing to do: any interrupt
+// (USB, SysTick) or, with SEVONPEND, the DMA sampler's half-buffer flag.
+// An interrupt that ran since the caller last looked has set the event
+// register on its return, so WFE falls through and nothing is missed
+static inline void main_sleep(void) {
+#if MAIN_LOOP_SLEEP
+    __WFE();
+#endif
+}
+
+// Hands over the filled blocks USB has room for, e.g. the first block or
+// after the host stopped reading for a while
+static void kick_transmit(void) {
+    HAL_NVIC_DisableIRQ(USB_LP_CAN1_RX0_IRQn);
+    pool_transmit();
+    HAL_NVIC_EnableIRQ(USB_LP_CAN1_RX0_IRQn);
+}
+
+// Queues the sampler's block and moves it to the next one of the pool,
+// which fills while the queued ones drain
+static void queue_block(uint32_t bytes) {
+#if HEALTH_REPORT_MS
+    healthBlocks++;
+#endif
+    poolBytes[poolFilled & POOL_MASK] = bytes;
+    poolFilled++;
+    kick_transmit();
+
+    // Every block is taken: wait for USB, leaving a gap in the capture
+#if POLL_STATS
+    uint32_t waitStart = DWT->CYCCNT, waited = 0;
+#endif
+    if (poolFilled - poolSent == BLOCK_POOL) {
+        stallCount++;
+        while (poolFilled - poolSent == BLOCK_POOL) {
+            main_sleep();  // the transmit-complete callback frees the oldest
+            kick_transmit();
+        }
+#if POLL_STATS
+        waited = DWT->CYCCNT - waitStart;
+#endif
+    }
+#if POLL_STATS
+    stats_add_stall(waited);
+#endif
+}
+
+#if POLL_RLE
+/*
+ * Writes one run of run samples (>= 1) of value:
+ *   byte 0: bit 7 more | bits 6-4 (run - 1) bits 2-0 | bits 3-0 value
+ *   then LEB128 groups of the remaining (run - 1) bits while bit 7 is set
+ * Returns the number of bytes written.
+ */
+HOT_PATH static uint32_t rle_put(uint8_t *out, uint8_t value, uint32_t run) {
+    uint32_t n = 0;
+    run -= 1;
+    uint8_t b = value | ((run & 0x07) << 4);
+    run >>= 3;
+    while (1) {
+        if (run) b |= 0x80;
+        out[n++] = b;
+        if (!run) return n;
+        b = run & 0x7F;
+        run >>= 7;
+    }
+}
+#endif
+
+/* Capture settings; the host changes them with sample_configure() */
+static uint32_t samplePeriod = POLL_SAMPLE_PERIOD ? POLL_SAMPLE_PERIOD : POLL_MIN_PERIOD;  // polling loop cycles per sample
+static uint32_t blockSamples = SAMPLE_COUNT;        // samples per block
+static uint8_t channelMask = POLL_CHANNEL_MASK;
+static uint8_t sampleBits = POLL_CHANNELS;
+static uint8_t packLut[16];    // PB7-PB4 levels -> masked CH1-CH4, compacted
+#if POLL_CHANNELS == 8
+static uint8_t packLutLow[16]; // PB3-PB0 levels -> masked CH5-CH8, above those
+#endif
+static uint8_t sampleRunning = 1;  // 0 while the host has stopped sampling
+
+#if SAMPLE_MODE_DMA
+static uint32_t dmaRate = DMA_SAMPLE_RATE_HZ;
+#endif
+
+static volatile uint8_t configPending = 0;
+static uint32_t pendingRate;
+static uint8_t pendingMask;
+static uint32_t pendingSamples;
+
+#if POLL_DECIMATE
+static uint32_t decimateWindow = 0;  // samples per BLOCK_MAGIC_DECIMATE record, 0 = off
+static uint32_t pendingWindow = 0;
+static uint8_t decimateFresh = 1;    // no sample yet to count the next one's edges from
+
+/**
+ * @brief Turns window decimation on or off (host command 'D'); applies
+ *        from the next block with the settings of the last 'C', opened by
+ *        a new stream header. Called by the host command parser from the
+ *        main loop
+ * @param window - samples per record, raised to DECIMATE_MIN_WINDOW;
+ *        0 sends the samples again
+ * @retval none
+ */
+void sample_decimate(uint32_t window) {
+    pendingWindow = window;
+    configPending = 1;
+}
+#endif
+
+/**
+ * @brief Requests new capture settings; they apply from the next block.
+ *        Called by the host command parser from the main loop
+ * @param rate_hz - sample rate, 0 keeps the current one
+ * @param mask - channels to sample (bit n = CH n+1), 0 selects all;
+ *        16-channel builds always send the whole port
+ * @param samples - samples per block, 0 selects the largest that fits
+ * @retval none
+ */
+void sample_configure(uint32_t rate_hz, uint32_t mask, uint32_t samples) {
+    pendingRate = rate_hz;
+    pendingMask = mask & POLL_CHANNEL_MASK;
+    pendingSamples = samples;
+    configPending = 1;
+}
+
+static void apply_config(void) {
+    configPending = 0;
+    channelMask = pendingMask && POLL_CHANNELS <= 8 ? pendingMask : POLL_CHANNEL_MASK;
+
+    uint32_t channels = __builtin_popcount(channelMask);
+    sampleBits = POLL_CHANNELS > 8 ? 16 : channels == 1 ? 1 : channels == 2 ? 2 : channels <= 4 ? 4 : 8;
+#if POLL_CHANNELS == 8
+    uint32_t low = __builtin_popcount(channelMask & 0x0F);  // CH1-CH4 bits below CH5-CH8
+#endif
+    for (uint32_t v = 0; v < 16; v++) {
+        uint8_t packed = 0;
+        uint32_t bit = 0;
+        for (uint32_t ch = 0; ch < 4; ch++) {
+            if (channelMask & (1 << ch)) packed |= ((v >> ch) & 1) << bit++;
+        }
+        packLut[v] = packed;
+#if POLL_CHANNELS == 8
+        packed = 0;
+        bit = low;
+        for (uint32_t ch = 4; ch < 8; ch++) {
+            if (channelMask & (1 << ch)) packed |= ((v >> (ch - 4)) & 1) << bit++;
+        }
+        packLutLow[v] = packed;
+#endif
+    }
+
+#if SAMPLE_MODE_DMA
+    uint32_t max = DMA_HALF_SAMPLES;
+#else
+    uint32_t max = BLOCK_DATA_BYTES * 8 / sampleBits;
+    if (max > 0xFFFF) max = 0xFFFF;
+#endif
+    blockSamples = pendingSamples;
+    if (blockSamples == 0 || blockSamples > max) blockSamples = max;
+
+#if SAMPLE_MODE_DMA
+    if (pendingRate) dmaRate = pendingRate;
+    sampler_dma_stop();
+    if (sampleRunning) sampler_dma_start(dmaRate, blockSamples);
+#else
+    if (pendingRate) {
+        samplePeriod = (SystemCoreClock + pendingRate / 2) / pendingRate;
+        if (samplePeriod < POLL_MIN_PERIOD) samplePeriod = POLL_MIN_PERIOD;
+    }
+#endif
+
+#if POLL_DECIMATE
+    decimateWindow = pendingWindow;
+    if (decimateWindow && decimateWindow < DECIMATE_MIN_WINDOW) decimateWindow = DECIMATE_MIN_WINDOW;
+    decimateFresh = 1;
+#endif
+}
+
+static BlockFixup fixups[BLOCK_MAX_FIXUPS];
+static uint32_t fixupCount;
+
+static void set_header(SampleBlock *block, uint16_t magic, uint32_t start, uint32_t period) {
+    block->header.magic = magic;
+    block->header.start = start;
+    block->header.period = period;
+    block->header.mask = channelMask;
+    block->header.bits = sampleBits;
+    fixupCount = 0;
+}
+
+// Notes that sample index was taken late cycles off its grid
+static inline void add_fixup(uint32_t index, uint32_t late) {
+    if (fixupCount == BLOCK_MAX_FIXUPS) return;
+    fixups[fixupCount].index = index;
+    fixups[fixupCount].late = late > 0xFFFF ? 0xFFFF : late;
+    fixupCount++;
+}
+
+// Pads used data bytes to a word and appends the fixups; returns the
+// block's size without its header
+static uint32_t finish_block(SampleBlock *block, uint32_t used, uint32_t end) {
+    while (used & 3) block->data[used++] = 0;
+    memcpy(&block->data[used], fixups, fixupCount * sizeof(BlockFixup));
+    block->header.end = end;
+    block->header.fixups = fixupCount;
+    return used + fixupCount * sizeof(BlockFixup);
+}
+
+// Stores a word of packed samples at used; the data follows the 20-byte
+// header, so used stays word-aligned until the last, partial word, whose
+// unused high bits are zero
+static inline uint32_t put_packed(SampleBlock *block, uint32_t used, uint32_t acc, uint32_t shift) {
+    *(uint32_t *)&block->data[used] = acc;
+    return used + (shift + 7) / 8;
+}
+
+// Channel mask (bit n = CH n+1) -> the GPIOB pins of those channels:
+// CH1-CH4 are PB4-PB7, CH5-CH8 PB0-PB3, CH9-CH16 PB8-PB15
+static inline uint32_t channel_pins(uint32_t mask) {
+    return ((mask & 0x0F) << 4) | ((mask >> 4) & 0x0F) | (mask & 0xFF00);
+}
+
+// IDR levels -> the masked channels, compacted
+static inline uint32_t pack_sample(uint32_t idr) {
+#if POLL_CHANNELS == 8
+    return packLut[(idr >> 4) & 0x0F] | packLutLow[idr & 0x0F];
+#else
+    return packLut[(idr >> 4) & 0x0F];
+#endif
+}
+
+#if POLL_DECIMATE
+/* The window in progress; in DMA mode it runs on across half buffers */
+static uint32_t decimateAll, decimateAny, decimateLast;
+static uint32_t decimateEdges[POLL_CHANNELS];
+static uint32_t decimateTaken;     // samples in the window so far
+static uint32_t decimateStart;     // CYCCNT of its first sample
+static uint32_t decimateNext;      // DMA mode: CYCCNT the next half buffer starts at
+
+// IDR levels -> the sampled channels in channel order; the nibble swap of
+// channel_pins is its own inverse
+static inline uint32_t decimate_levels(uint32_t idr) {
+    return channel_pins(idr) & (POLL_CHANNELS > 8 ? 0xFFFF : channelMask);
+}
+
+// Empties the window and takes levels as the sample before it
+static void decimate_restart(uint32_t levels) {
+    decimateAll = 0xFFFF;
+    decimateAny = 0;
+    decimateLast = levels;
+    decimateTaken = 0;
+    memset(decimateEdges, 0, sizeof(decimateEdges));
+    decimateFresh = 0;
+}
+
+// Takes one sample into the window
+HOT_PATH static inline void decimate_add(uint32_t levels) {
+    uint32_t changed = levels ^ decimateLast;
+    decimateAll &= levels;
+    decimateAny |= levels;
+    decimateLast = levels;
+    decimateTaken++;
+    while (changed) {
+        decimateEdges[__builtin_ctz(changed)]++;
+        changed &= changed - 1;
+    }
+}
+
+// Writes the window out as a record and starts the next one
+HOT_PATH static void decimate_close(DecimateRecord *record) {
+    record->all = decimateAll;
+    record->any = decimateAny;
+    record->last = decimateLast;
+    for (uint32_t ch = 0; ch < POLL_CHANNELS; ch++) {
+        record->edges[ch] = decimateEdges[ch] > 0xFFFF ? 0xFFFF : decimateEdges[ch];
+        decimateEdges[ch] = 0;
+    }
+    decimateAll = 0xFFFF;
+    decimateAny = 0;
+    decimateTaken = 0;
+}
+
+// Samples per window at period cycles each, short enough for the block
+// header's 32-bit window period
+static uint32_t decimate_window(uint32_t period) {
+    return decimateWindow > 0xFFFFFFFFUL / period ? 0xFFFFFFFFUL / period : decimateWindow;
+}
+
+// Header of a block of count records, the first window from start
+static uint32_t decimate_finish(SampleBlock *block, uint32_t count, uint32_t start,
+                                uint32_t window_period, uint32_t end) {
+    set_header(block, BLOCK_MAGIC_DECIMATE, start, window_period);
+    block->header.count = count;
+    block->header.bits = POLL_CHANNELS;  // edges entries per record
+    return finish_block(block, count * sizeof(DecimateRecord), end);
+}
+#endif
+
+// Packs count raw samples into a block, returns its data bytes
+HOT_PATH static uint32_t pack_raw(SampleBlock *block, uint16_t magic, const PollSample *samples,
+                                  uint32_t count, uint32_t start, uint32_t period) {
+    uint32_t used = 0;
+
+    set_header(block, magic, start, period);
+    block->header.count = count;
+#if POLL_CHANNELS > 8
+    used = count * sizeof(PollSample);
+    memcpy(block->data, samples, used);
+#else
+    uint32_t bits = sampleBits;
+    uint32_t acc = 0, shift = 0;
+
+    for (uint32_t i = 0; i < count; i++) {
+        acc |= pack_sample(samples[i]) << shift;
+        shift += bits;
+        if (shift == 32) {
+            used = put_packed(block, used, acc, shift);
+            acc = 0;
+            shift = 0;
+        }
+    }
+    if (shift) used = put_packed(block, used, acc, shift);
+#endif
+    return finish_block(block, used, start + (count - 1) * period);
+}
+
+#if SAMPLE_MODE_DMA
+// Packs one DMA half buffer into a block
+uint32_t pack_block(SampleBlock *block, const PollSample *samples, uint32_t start) {
+    return pack_raw(block, BLOCK_MAGIC, samples, sampler_dma_samples(),
+                    start, sampler_dma_period());
+}
+
+#if POLL_DECIMATE
+// Folds one DMA half buffer into windows; returns the block of the
+// windows it closed, or 0 if none did
+HOT_PATH uint32_t pack_block_decimate(SampleBlock *block, const PollSample *samples, uint32_t start) {
+    uint32_t count = sampler_dma_samples();
+    uint32_t period = sampler_dma_period();
+    uint32_t window = decimate_window(period);
+    DecimateRecord *records = (DecimateRecord *)block->data;
+    uint32_t closed = 0, first = 0;
+
+    // a restarted sampler (new settings, a burst) continues no window
+    if (decimateFresh || start != decimateNext) decimate_restart(decimate_levels(samples[0]));
+    decimateNext = start + count * period;
+    for (uint32_t i = 0; i < count; i++) {
+        if (decimateTaken == 0) decimateStart = start + i * period;
+        decimate_add(decimate_levels(samples[i]));
+        if (decimateTaken == window) {
+            if (!closed) first = decimateStart;
+            decimate_close(&records[closed++]);
+        }
+    }
+    if (!closed) return 0;
+    return decimate_finish(block, closed, first, window * period, first + (closed * window - 1) * period);
+}
+#endif
+
+#if POLL_RLE
+// Run-length encodes one DMA half buffer, falling back to pack_block when
+// the signal changes too often for the runs to fit
+HOT_PATH uint32_t pack_block_rle(SampleBlock *block, const PollSample *samples, uint32_t start) {
+    uint32_t count = sampler_dma_samples();
+    uint32_t used = 0;
+    uint8_t value = packLut[samples[0] >> 4];
+    uint32_t run = 1;
+
+    for (uint32_t i = 1; i < count; i++) {
+        uint8_t v = packLut[samples[i] >> 4];
+        if (v == value) {
+            run++;
+            continue;
+        }
+        if (used > BLOCK_DATA_BYTES - 2 * RLE_MAX_RECORD) {
+            return pack_block(block, samples, start);
+        }
+        used += rle_put(&block->data[used], value, run);
+        value = v;
+        run = 1;
+    }
+    used += rle_put(&block->data[used], value, run);
+
+    set_header(block, BLOCK_MAGIC_RLE, start, sampler_dma_period());
+    block->header.count = used;
+    return finish_block(block, used, start + (count - 1) * sampler_dma_period());
+}
+#endif
+#else
+static uint32_t nextSample;  // CYCCNT the polling loop takes its next sample at
+
+// Blocks continue the previous block's sample grid so that consecutive
+// blocks have no gap; the first few samples after the buffer swap are
+// taken late while the loop catches up. Only after a stall does the grid
+// restart at now
+static uint32_t first_sample_time(void) {
+    uint32_t now = DWT->CYCCNT;
+    if ((int32_t)(now - nextSample) > POLL_MAX_LATE) nextSample = now;
+    return nextSample;
+}
+
+#if POLL_RLE
+// Samples every samplePeriod cycles and run-length encodes the samples as
+// they come in, until the block is full or RLE_MAX_SAMPLES long
+HOT_PATH uint32_t fill_block_rle(SampleBlock *block) {
+    uint32_t next = first_sample_time();
+    uint32_t period = samplePeriod;
+    uint32_t used = 0;
+    uint32_t samples = 0;
+    set_header(block, BLOCK_MAGIC_RLE, next, period);
+
+    while ((int32_t)(DWT->CYCCNT - next) < 0);
+    uint8_t value = packLut[(GPIOB->IDR >> 4) & 0x0F];
+    uint32_t run = 1;
+#if POLL_STATS
+    statsLast = next;  // the first sample of a run-length block counts as on time
+#endif
+    next += period;
+
+    uint32_t now = next;
+    while (samples + run < RLE_MAX_SAMPLES) {
+        do now = DWT->CYCCNT; while ((int32_t)(now - next) < 0);
+        uint8_t v = packLut[(GPIOB->IDR >> 4) & 0x0F];
+        if (now - next > FIXUP_LATE) add_fixup(samples + run, now - next);
+#if POLL_STATS
+        stats_add_interval(now - statsLast, period);
+        statsLast = now;
+#endif
+        next += period;
+        if (v == value) {
+            run++;
+            continue;
+        }
+        used += rle_put(&block->data[used], value, run);
+        samples += run;
+        value = v;
+        run = 1;
+        if (used > BLOCK_DATA_BYTES - 2 * RLE_MAX_RECORD) break;
+    }
+    used += rle_put(&block->data[used], value, run);
+    nextSample = next;
+
+    block->header.count = used;
+    return finish_block(block, used, now);
+}
+#endif
+
+#if POLL_DECIMATE
+// Samples every samplePeriod cycles, DECIMATE_MIN_PERIOD at least, and
+// folds the samples into windows as they come in, until the block is full
+// or DECIMATE_MAX_SAMPLES long. A block ends with its last window
+HOT_PATH uint32_t fill_block_decimate(SampleBlock *block) {
+    uint32_t next = first_sample_time();
+    uint32_t period = samplePeriod < DECIMATE_MIN_PERIOD ? DECIMATE_MIN_PERIOD : samplePeriod;
+    uint32_t window = decimate_window(period);
+    DecimateRecord *records = (DecimateRecord *)block->data;
+    uint32_t start = next, count = 0, taken = 0;
+    uint32_t now = next;
+
+    if (decimateFresh) decimate_restart(decimate_levels(GPIOB->IDR));
+    do {
+        for (uint32_t i = 0; i < window; i++) {
+            do now = DWT->CYCCNT; while ((int32_t)(now - next) < 0);
+            decimate_add(decimate_levels(GPIOB->IDR));
+            next += period;
+        }
+        decimate_close(&records[count++]);
+        taken += window;
+    } while (count < DECIMATE_RECORDS && taken < DECIMATE_MAX_SAMPLES);
+    nextSample = next;
+    return decimate_finish(block, count, start, window * period, now);
+}
+#endif
+
+// Samples every samplePeriod cycles into a block
+HOT_PATH uint32_t fill_block(SampleBlock *block) {
+    uint32_t next = first_sample_time();
+    uint32_t period = samplePeriod;
+    uint32_t count = blockSamples;
+#if POLL_CHANNELS > 8
+    uint16_t *out = (uint16_t *)block->data;
+    uint32_t used = count * sizeof(PollSample);
+#else
+    uint32_t bits = sampleBits;
+    uint32_t acc = 0, shift = 0, used = 0;
+#endif
+
+    uint32_t now = next;
+
+    set_header(block, BLOCK_MAGIC, next, period);
+    block->header.count = count;
+    for (uint32_t i = 0; i < count; i++) {
+        do now = DWT->CYCCNT; while ((int32_t)(now - next) < 0);
+#if POLL_CHANNELS > 8
+        out[i] = GPIOB->IDR;
+#else
+        acc |= pack_sample(GPIOB->IDR) << shift;
+#endif
+        if (now - next > FIXUP_LATE) add_fixup(i, now - next);
+#if POLL_STATS
+        stats_add_interval(now - statsLast, period);
+        statsLast = now;
+#endif
+        next += period;
+#if POLL_CHANNELS <= 8
+        shift += bits;
+        if (shift == 32) {
+            used = put_packed(block, used, acc, shift);
+            acc = 0;
+            shift = 0;
+        }
+#endif
+    }
+#if POLL_CHANNELS <= 8
+    if (shift) used = put_packed(block, used, acc, shift);
+#endif
+    nextSample = next;
+    return finish_block(block, used, now);
+}
+#endif
+
+/* Burst capture: one window sampled into RAM with no USB traffic, then
+ * uploaded as BLOCK_MAGIC_BURST blocks */
+#if !SAMPLE_MODE_DMA
+static PollSample burstBuffer[BURST_SAMPLES];  // raw samples, used as a ring
+#endif
+static volatile uint8_t burstPending = 0;
+static uint8_t burstMask;      // trigger channels
+static uint8_t burstValue;     // their levels that trigger
+static uint8_t burstPre;       // pre-trigger share of the window, percent
+static uint32_t burstRate;
+static uint32_t burstSegments; // windows the burst RAM is split into, one per trigger
+
+/**
+ * @brief Arms one burst capture; it starts after the current block.
+ *        Called by the host command parser from the main loop
+ * @param trig_mask - channels the trigger looks at (CH1-CH8), 0 triggers
+ *        at once
+ * @param trig_value - their levels; the trigger fires on the sample where
+ *        the channels change into this pattern
+ * @param pre_percent - share of the window before the trigger
+ * @param rate_hz - sample rate, 0 for the fastest the burst loop reaches
+ * @retval none
+ */
+void sample_burst(uint32_t trig_mask, uint32_t trig_value, uint32_t pre_percent, uint32_t rate_hz) {
+    burstMask = trig_mask & POLL_CHANNEL_MASK;
+    burstValue = trig_value & burstMask;
+    burstPre = pre_percent > 100 ? 100 : pre_percent;
+    burstRate = rate_hz;
+    burstSegments = 1;
+    burstPending = 1;
+}
+
+/**
+ * @brief Arms a segmented burst capture (host command 'A'): the burst
+ *        window is split into segments, each filled around a trigger of
+ *        its own and the next armed at once, with no USB traffic until
+ *        all are filled; then they are uploaded one after the other.
+ *        Called by the host command parser from the main loop
+ * @param segments - triggers to capture, fewer if segments of
+ *        BURST_MIN_SEGMENT samples do not fit; the other parameters
+ *        apply to each segment as to sample_burst's window
+ * @retval none
+ */
+void sample_burst_segments(uint32_t trig_mask, uint32_t trig_value, uint32_t pre_percent,
+                           uint32_t rate_hz, uint32_t segments) {
+    sample_burst(trig_mask, trig_value, pre_percent, rate_hz);
+    burstSegments = segments ? segments : 1;
+}
+
+// Samples into the ring buf every period cycles: first the pre-trigger
+// samples, then armed until the trigger, then the post-trigger samples.
+// Returns the ring index of the trigger sample and sets *trigger_time, or
+// returns size when a new host command aborts the wait
+HOT_PATH static uint32_t burst_capture(PollSample *buf, uint32_t size, uint32_t pre,
+                                       uint32_t period, uint32_t *trigger_time) {
+    uint32_t tmask = channel_pins(burstMask);
+    uint32_t tvalue = channel_pins(burstValue);
+    uint32_t was = burstMask != 0;   // a pattern present when armed does not trigger
+    uint32_t next = DWT->CYCCNT;
+    uint32_t i;
+
+    for (i = 0; i < pre; i++) {
+        while ((int32_t)(DWT->CYCCNT - next) < 0);
+        buf[i] = GPIOB->IDR;
+        next += period;
+    }
+
+    while (1) {
+        while ((int32_t)(DWT->CYCCNT - next) < 0);
+        uint32_t v = GPIOB->IDR;
+        buf[i] = v;
+        uint32_t match = (v & tmask) == tvalue;
+        if (match && !was) break;
+        was = match;
+        next += period;
+        if (++i == size) {
+            i = 0;
+            if (host_cmd_abort_pending()) return size;
+        }
+    }
+    *trigger_time = next;
+
+    uint32_t trigger = i;
+    for (uint32_t n = 1; n < size - pre; n++) {
+        if (++i == size) i = 0;
+        next += period;
+        while ((int32_t)(DWT->CYCCNT - next) < 0);
+        buf[i] = GPIOB->IDR;
+    }
+    return trigger;
+}
+
+// Faster than BURST_MIN_PERIOD there is no time to test the trigger per
+// sample: wait for it in a tight poll, then run an unrolled kernel over the
+// whole window, so these rates keep no pre-trigger samples
+HOT_PATH static uint32_t burst_capture_fast(PollSample *buf, uint32_t size, const SampleKernel *kernel,
+                                            uint32_t *trigger_time) {
+    uint32_t tmask = channel_pins(burstMask);
+    uint32_t tvalue = channel_pins(burstValue);
+
+    if (burstMask) {
+        while ((GPIOB->IDR & tmask) == tvalue) {
+            if (host_cmd_abort_pending()) return size;
+        }
+        while ((GPIOB->IDR & tmask) != tvalue) {
+            if (host_cmd_abort_pending()) return size;
+        }
+    }
+
+    // an interrupt inside the kernel would stretch one sample slot
+    __disable_irq();
+    *trigger_time = DWT->CYCCNT;
+    kernel->run(buf, size);
+    __enable_irq();
+    return 0;
+}
+
+static void run_burst(void) {
+    burstPending = 0;
+#if POLL_DECIMATE
+    decimateFresh = 1;  // the window in progress does not span the burst
+#endif
+    uint32_t period = burstRate ? (SystemCoreClock + burstRate / 2) / burstRate : 0;
+    const SampleKernel *kernel = NULL;
+    if (period < BURST_MIN_PERIOD) {
+        kernel = sample_kernel_find(period);
+        if (!kernel) period = BURST_MIN_PERIOD;
+    }
+
+#if SAMPLE_MODE_DMA
+    sampler_dma_stop();
+    uint32_t size;
+    PollSample *buf = sampler_dma_buffer(&size);
+#else
+    uint32_t size = BURST_SAMPLES;
+    PollSample *buf = burstBuffer;
+#endif
+    // a segmented burst keeps its marks word-aligned behind the segments
+    uint32_t segments = burstSegments;
+    uint32_t most = size * sizeof(PollSample) / (BURST_MIN_SEGMENT * sizeof(PollSample) + sizeof(SegmentMark));
+    if (segments > most) segments = most;
+    SegmentMark single;
+    SegmentMark *marks = &single;
+    if (segments > 1) {
+        marks = (SegmentMark *)((uintptr_t)(buf + size) & ~3UL) - segments;
+        size = ((uint8_t *)marks - (uint8_t *)buf) / sizeof(PollSample) / segments;
+    }
+    if (kernel) size -= size % KERNEL_UNROLL;
+
+    uint32_t pre = (uint64_t)size * burstPre / 100;
+    if (pre == size) pre = size - 1;   // keep the trigger sample
+    if (kernel) {
+        pre = 0;
+        period = kernel->period;
+    }
+
+    uint32_t filled;
+    for (filled = 0; filled < segments; filled++) {
+        PollSample *segment = buf + filled * size;
+        uint32_t trigger_time;
+        uint32_t trigger = kernel ? burst_capture_fast(segment, size, kernel, &trigger_time)
+                                  : burst_capture(segment, size, pre, period, &trigger_time);
+        if (trigger == size) break;   // a new command ends the capture
+        marks[filled].first = (trigger + size - pre) % size;
+        marks[filled].time = trigger_time - pre * period;
+    }
+
+    for (uint32_t s = 0; s < filled; s++) {
+        PollSample *segment = buf + s * size;
+        uint32_t index = marks[s].first;
+        uint32_t time = marks[s].time;
+
+        // split so that the trigger sample starts a block
+        for (uint32_t pos = 0; pos < size; ) {
+            uint32_t n = size - pos;
+            if (n > blockSamples) n = blockSamples;
+            if (n > size - index) n = size - index;
+            if (pos < pre && n > pre - pos) n = pre - pos;
+
+            SampleBlock *current = pool_block();
+            uint16_t magic = pos == pre ? BLOCK_MAGIC_TRIGGER : BLOCK_MAGIC_BURST;
+            queue_block(pack_raw(current, magic, &segment[index], n, time, period));
+
+            pos += n;
+            index += n;
+            if (index == size) index = 0;
+            time += n * period;
+        }
+    }
+
+#if SAMPLE_MODE_DMA
+    if (sampleRunning) sampler_dma_start(dmaRate, blockSamples);
+#endif
+}
+
+/* Equivalent-time capture: many passes over a repeating signal, each
+ * started a cycle later after its trigger, uploaded as BLOCK_MAGIC_EQUIV
+ * blocks whose times count from the trigger */
+static volatile uint8_t equivPending = 0;
+static uint32_t equivRate;
+static uint32_t equivDelay;    // cycles from the trigger to the first pass
+static uint32_t equivPasses;   // passes, 0 = one per cycle of the sample period
+static uint32_t equivSamples;  // samples per pass, 0 = the burst window
+
+/**
+ * @brief Arms an equivalent-time capture (host command 'e'); it starts
+ *        after the current block. Called by the host command parser
+ *        from the main loop
+ * @param trig_mask - channels the trigger looks at (CH1-CH8), not 0
+ * @param trig_value - their levels; each pass starts where the channels
+ *        change into this pattern, as a 'B' trigger does
+ * @param rate_hz - real-time sample rate of a pass, one of the unrolled
+ *        kernels', 0 for the fastest
+ * @param delay - cycles from the trigger to the first sample of pass 0;
+ *        pass k starts k % period cycles later
+ * @param passes - passes to capture, 0 for one per cycle of the period
+ * @param samples - samples per pass, 0 for the burst window
+ * @retval none
+ */
+void sample_equivalent(uint32_t trig_mask, uint32_t trig_value, uint32_t rate_hz, uint32_t delay,
+                       uint32_t passes, uint32_t samples) {
+    burstMask = trig_mask & POLL_CHANNEL_MASK;
+    burstValue = trig_value & burstMask;
+    equivRate = rate_hz;
+    equivDelay = delay;
+    equivPasses = passes;
+    equivSamples = samples;
+    equivPending = burstMask != 0;   // a pass without a trigger has no time reference
+}
+
+// Waits for the trigger pattern with interrupts off, so nothing lands
+// between the edge and the CYCCNT read; they come back on every
+// EQUIV_ARM_CYCLES to let a new command in. Then waits delay cycles from
+// the trigger and runs the kernel. Returns the cycles from the trigger to
+// the kernel's start, or UINT32_MAX when a command aborts the wait
+HOT_PATH static uint32_t equivalent_pass(PollSample *buf, uint32_t size, const SampleKernel *kernel,
+                                         uint32_t delay) {
+    uint32_t tmask = channel_pins(burstMask);
+    uint32_t tvalue = channel_pins(burstValue);
+    uint32_t armed = 0;   // the pattern was absent, as a 'B' trigger wants
+    uint32_t found = 0;
+    uint32_t trigger = 0;
+
+    while (1) {
+        __disable_irq();
+        uint32_t since = DWT->CYCCNT;
+        while (!found && DWT->CYCCNT - since < EQUIV_ARM_CYCLES) {
+            uint32_t match = (GPIOB->IDR & tmask) == tvalue;
+            if (match && armed) {
+                trigger = DWT->CYCCNT;
+                found = 1;
+            }
+            armed = !match;
+        }
+        if (found) break;
+        __enable_irq();
+        if (host_cmd_abort_pending()) return UINT32_MAX;
+    }
+
+    while (DWT->CYCCNT - trigger < delay);
+    uint32_t start = DWT->CYCCNT;
+    kernel->run(buf, size);
+    __enable_irq();
+    return start - trigger;
+}
+
+// Captures and uploads the passes one after the other; the signal
+// repeats, so the upload between passes loses nothing
+static void run_equivalent(void) {
+    equivPending = 0;
+#if POLL_DECIMATE
+    decimateFresh = 1;
+#endif
+    uint32_t period = equivRate ? (SystemCoreClock + equivRate / 2) / equivRate : 0;
+    const SampleKernel *kernel = sample_kernel_find(period);
+    if (!kernel) kernel = sample_kernel_find(0);   // slower rates gain nothing from interleaving
+    period = kernel->period;
+
+#if SAMPLE_MODE_DMA
+    sampler_dma_stop();
+    uint32_t size;
+    PollSample *buf = sampler_dma_buffer(&size);
+#else
+    uint32_t size = BURST_SAMPLES;
+    PollSample *buf = burstBuffer;
+#endif
+    if (equivSamples && equivSamples < size) size = equivSamples;
+    size -= size % KERNEL_UNROLL;
+    if (!size) size = KERNEL_UNROLL;
+    uint32_t passes = equivPasses ? equivPasses : period;
+
+    for (uint32_t k = 0; k < passes; k++) {
+        uint32_t offset = equivalent_pass(buf, size, kernel, equivDelay + k % period);
+        if (offset == UINT32_MAX) break;   // a new command ends the capture
+
+        for (uint32_t pos = 0; pos < size; ) {
+            uint32_t n = size - pos;
+            if (n > blockSamples) n = blockSamples;
+            SampleBlock *current = pool_block();
+            queue_block(pack_raw(current, BLOCK_MAGIC_EQUIV, &buf[pos], n, offset + pos * period, period));
+            pos += n;
+        }
+    }
+
+#if SAMPLE_MODE_DMA
+    if (sampleRunning) sampler_dma_start(dmaRate, blockSamples);
+#endif
+}
+
+/**
+ * @brief Stops or resumes sampling (host command 'R'); while stopped no
+ *        sample or burst blocks are sent; replies to 'S' and 'V' and
+ *        equivalent-time passes ('e') still are.
+ *        Called by the host command parser from the main loop
+ * @param run - 0 to stop, anything else to resume
+ * @retval none
+ */
+void sample_set_running(uint32_t run) {
+    run = run != 0;
+    if (run == sampleRunning) return;
+    sampleRunning = run;
+#if SAMPLE_MODE_DMA
+    if (run) sampler_dma_start(dmaRate, blockSamples);
+    else sampler_dma_stop();
+#endif
+}
+
+/**
+ * @brief Answers host command 'V' with one BLOCK_MAGIC_INFO block: count =
+ *        HOST_INFO_WORDS words of protocol version, HOST_CAP_* bits, the
+ *        DWT->CYCCNT clock in Hz with the stored correction
+ *        (clock_trim.h), the most USB transfers queued at once
+ *        since power-up and 0 glitches suppressed (the interrupt
+ *        firmware's glitch filter). Called by the host command parser
+ *        from the main loop, between blocks
+ * @retval none
+ */
+void sample_send_info(void) {
+    SampleBlock *current = pool_block();
+    uint32_t now = DWT->CYCCNT;
+    uint32_t info[HOST_INFO_WORDS] = {
+        HOST_PROTOCOL_VERSION, host_cmd_capabilities(), clock_trim_apply(SystemCoreClock),
+        usb_tx_queue_peak, 0
+    };
+
+    set_header(current, BLOCK_MAGIC_INFO, now, samplePeriod);
+    current->header.count = HOST_INFO_WORDS;
+    current->header.bits = 0;
+    memcpy(current->data, info, sizeof(info));
+    queue_block(finish_block(current, sizeof(info), now));
+}
+
+#if SOF_SYNC_FRAMES
+static volatile uint32_t sofFrames = 0;     // USB frames since enumeration, extended past 11 bits
+static volatile uint32_t sofSyncFrame;      // frame and CYCCNT of the latest latched pair
+static volatile uint32_t sofSyncCycles;
+static volatile uint8_t sofPending = 0;     // that pair still has to be sent
+#endif
+
+/**
+ * @brief Latches DWT->CYCCNT on a USB start of frame, so the host can tie
+ *        the sample clock to its own USB frame clock. Every
+ *        SOF_SYNC_FRAMES frames the pair is handed to the main loop; a
+ *        pair it has not sent yet is replaced. Called from the SOF
+ *        callback of the USB interrupt
+ * @param frame - 11-bit frame number of this SOF (USB->FNR)
+ * @retval none
+ */
+void sample_sof(uint32_t frame) {
+#if SOF_SYNC_FRAMES
+    uint32_t cycles = DWT->CYCCNT;
+    uint32_t frames = sofFrames + ((frame - sofFrames) & USB_FNR_FN);  // also counts missed SOFs
+
+    sofFrames = frames;
+    if (frames - sofSyncFrame < SOF_SYNC_FRAMES) return;
+    sofSyncFrame = frames;
+    sofSyncCycles = cycles;
+    sofPending = 1;
+#else
+    (void)frame;
+#endif
+}
+
+#if SOF_SYNC_FRAMES
+// Sends the latest latched pair as one BLOCK_MAGIC_SYNC block: count = 2
+// words, the frame count then CYCCNT at that SOF
+static void send_sync(void) {
+    SampleBlock *current = pool_block();
+    uint32_t now = DWT->CYCCNT;
+
+    __disable_irq();
+    uint32_t sync[2] = { sofSyncFrame, sofSyncCycles };
+    sofPending = 0;
+    __enable_irq();
+
+    set_header(current, BLOCK_MAGIC_SYNC, now, samplePeriod);
+    current->header.count = 2;
+    current->header.bits = 0;
+    memcpy(current->data, sync, sizeof(sync));
+    queue_block(finish_block(current, sizeof(sync), now));
+}
+#endif
+
+#if HEALTH_REPORT_MS
+// Sends the link health since the last report as one BLOCK_MAGIC_HEALTH
+// block: count = 5 words, blocks queued, bytes handed to USB, stalls,
+// full buffers USB refused, then the CYCCNT cycles they cover
+static void send_health(void) {
+    SampleBlock *current = pool_block();
+    uint32_t now = DWT->CYCCNT;
+
+    HAL_NVIC_DisableIRQ(USB_LP_CAN1_RX0_IRQn);
+    uint32_t health[5] = { healthBlocks, healthBytes, stallCount - healthStalls,
+                           healthBusy, now - healthLast };
+    healthBytes = healthBusy = 0;
+    HAL_NVIC_EnableIRQ(USB_LP_CAN1_RX0_IRQn);
+    healthBlocks = 0;
+    healthStalls = stallCount;
+    healthLast = now;
+
+    set_header(current, BLOCK_MAGIC_HEALTH, now, samplePeriod);
+    current->header.count = 5;
+    current->header.bits = 0;
+    memcpy(current->data, health, sizeof(health));
+    queue_block(finish_block(current, sizeof(health), now));
+}
+#endif
+
+#if POLL_STATS
+// Sends the histograms as one BLOCK_MAGIC_STATS block: count = words,
+// the interval bins then the stall bins, period = nominal sample period
+// (the interval bins' centre). The counts restart from zero
+static void send_stats(void) {
+    statsPending = 0;
+    SampleBlock *current = pool_block();
+    uint32_t now = DWT->CYCCNT;
+
+    set_header(current, BLOCK_MAGIC_STATS, now, samplePeriod);
+    current->header.count = STATS_INTERVAL_BINS + STATS_STALL_BINS;
+    current->header.bits = 0;
+    memcpy(current->data, statsInterval, sizeof(statsInterval));
+    memcpy(current->data + sizeof(statsInterval), statsStall, sizeof(statsStall));
+    memset(statsInterval, 0, sizeof(statsInterval));
+    memset(statsStall, 0, sizeof(statsStall));
+    queue_block(finish_block(current, sizeof(statsInterval) + sizeof(statsStall), now));
+}
+#endif
+
+// Opens the stream of new settings with one BLOCK_MAGIC_HEADER block:
+// count = the words of a StreamHeader (host_cmd.h), so the host picks
+// its decoder from the firmware instead of its own configuration
+static void send_header(void) {
+    SampleBlock *current = pool_block();
+    uint32_t now = DWT->CYCCNT;
+    StreamHeader header;
+
+    uint32_t compression = POLL_RLE ? STREAM_COMPRESSION_RLE : STREAM_COMPRESSION_NONE;
+#if POLL_DECIMATE
+    if (decimateWindow) compression = STREAM_COMPRESSION_DECIMATE;
+#endif
+
+    host_stream_header(&header, STREAM_ENCODING_BLOCKS, compression,
+                       POLL_CHANNELS, 0, 32, clock_trim_apply(SystemCoreClock));
+    set_header(current, BLOCK_MAGIC_HEADER, now, samplePeriod);
+    current->header.count = sizeof(header) / 4;
+    current->header.bits = 0;
+    memcpy(current->data, &header, sizeof(header));
+    queue_block(finish_block(current, sizeof(header), now));
 }
 /* USER CODE END 0 */
 
@@ -82,7 +1277,9 @@ int main(void)
 {
 
   /* USER CODE BEGIN 1 */
-
+#if DUAL_IMAGE
+  SCB->VTOR = BOOT_SLOT_B_ADDRESS;  // as slot A left it, also when a debugger starts this image
+#endif
   /* USER CODE END 1 */
 
   /* MCU Configuration--------------------------------------------------------*/
@@ -106,24 +1303,74 @@ int main(void)
   MX_USB_DEVICE_Init();
   /* USER CODE BEGIN 2 */
   DWT_Init();
+#if MAIN_LOOP_SLEEP
+  SCB->SCR |= SCB_SCR_SEVONPEND_Msk;  // pending interrupts wake WFE, enabled or not
+#endif
+  sample_kernel_init();
+  sample_configure(0, POLL_CHANNEL_MASK, 0);
+  apply_config();   // also starts the DMA sampler
   /* USER CODE END 2 */
 
   /* Infinite loop */
   /* USER CODE BEGIN WHILE */
   while (1)
   {
-      Sample* current = usingBufferA ? bufferA : bufferB;
-
-      for (int i = 0; i < SAMPLE_COUNT; i++) {
-          current[i].timestamp = DWT->CYCCNT;
-          current[i].value = (GPIOB->IDR >> 4) & 0x0F;
+      host_cmd_process();
+      if (configPending) {
+          apply_config();
+          send_header();
       }
+#if POLL_STATS
+      if (statsPending) send_stats();
+#endif
+#if SOF_SYNC_FRAMES
+      if (sofPending) send_sync();
+#endif
+      if (equivPending) run_equivalent();   // runs stopped too, so no stream blocks come between passes
+      if (!sampleRunning) {
+          main_sleep();
+          continue;
+      }
+#if HEALTH_REPORT_MS
+      if (DWT->CYCCNT - healthLast >= SystemCoreClock / 1000 * HEALTH_REPORT_MS) send_health();
+#endif
+      if (burstPending) run_burst();
+      SampleBlock* current = pool_block();
 
-      // Start USB transmit (non-blocking)
-      send_buffer(current);
+#if SAMPLE_MODE_DMA
+      uint32_t start;
+      PollSample *samples = sampler_dma_next(&start);
+      if (!samples) {
+          main_sleep();
+          continue;
+      }
+#if POLL_DECIMATE
+      if (decimateWindow) {
+          uint32_t bytes = pack_block_decimate(current, samples, start);
+          if (bytes) queue_block(bytes);
+          continue;
+      }
+#endif
+#if POLL_RLE
+      uint32_t bytes = pack_block_rle(current, samples, start);
+#else
+      uint32_t bytes = pack_block(current, samples, start);
+#endif
+#else
+#if POLL_DECIMATE
+      if (decimateWindow) {
+          queue_block(fill_block_decimate(current));
+          continue;
+      }
+#endif
+#if POLL_RLE
+      uint32_t bytes = fill_block_rle(current);
+#else
+      uint32_t bytes = fill_block(current);
+#endif
+#endif
 
-      // Switch buffers
-      usingBufferA ^= 1;
+      queue_block(bytes);
 
     /* USER CODE END WHILE */
 
@@ -202,7 +1449,16 @@ static void MX_GPIO_Init(void)
   HAL_GPIO_Init(GPIOB, &GPIO_InitStruct);
 
   /* USER CODE BEGIN MX_GPIO_Init_2 */
-
+#if POLL_CHANNELS > 4
+  /* CH5-CH8 on PB0-PB3, CH9-CH16 on PB8-PB15 */
+  GPIO_InitStruct.Pin = GPIO_PIN_0|GPIO_PIN_1|GPIO_PIN_2|GPIO_PIN_3;
+#if POLL_CHANNELS > 8
+  GPIO_InitStruct.Pin |= 0xFF00;
+#endif
+  GPIO_InitStruct.Mode = GPIO_MODE_INPUT;
+  GPIO_InitStruct.Pull = GPIO_NOPULL;
+  HAL_GPIO_Init(GPIOB, &GPIO_InitStruct);
+#endif
   /* USER CODE END MX_GPIO_Init_2 */
 }
 
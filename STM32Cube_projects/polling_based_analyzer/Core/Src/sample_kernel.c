@@ -0,0 +1,111 @@
+/**
+  ******************************************************************************
+  * @file           : sample_kernel.c
+  * @brief          : Cycle-exact unrolled sampling kernels
+  ******************************************************************************
+  */
+
+#include "sample_kernel.h"
+
+#define KERNEL_READ_CYCLES 3   // ldr from GPIOB + strb/strh with post-increment
+#define KERNEL_LOOP_CYCLES 4   // subs + taken bne from RAM
+
+#define KERNEL_STR_(x) #x
+#define KERNEL_STR(x) KERNEL_STR_(x)
+
+#if POLL_CHANNELS > 8
+#define KERNEL_STORE "strh r3, [%[buf]], #2\n"
+#else
+#define KERNEL_STORE "strb r3, [%[buf]], #1\n"
+#endif
+
+/*
+ * One kernel per period N: slots 1-7 are read, store and N - READ NOPs;
+ * slot 8 gives LOOP of its padding to the loop counter and branch, so
+ * every read is N cycles after the previous one.
+ */
+#define SAMPLE_KERNEL(N)                                                        \
+__attribute__((section(".RamFunc"), noinline))                                  \
+static void sample_kernel_##N(PollSample *buf, uint32_t count)                  \
+{                                                                               \
+    volatile uint32_t *idr = &GPIOB->IDR;                                       \
+    __asm volatile (                                                            \
+        "1:\n"                                                                  \
+        ".rept 7\n"                                                             \
+        "  ldr  r3, [%[idr]]\n"                                                 \
+        "  " KERNEL_STORE                                                       \
+        "  .rept " #N " - " KERNEL_STR(KERNEL_READ_CYCLES) "\n"                 \
+        "    nop\n"                                                             \
+        "  .endr\n"                                                             \
+        ".endr\n"                                                               \
+        "ldr  r3, [%[idr]]\n"                                                   \
+        KERNEL_STORE                                                            \
+        ".rept " #N " - " KERNEL_STR(KERNEL_READ_CYCLES)                        \
+            " - " KERNEL_STR(KERNEL_LOOP_CYCLES) "\n"                           \
+        "  nop\n"                                                               \
+        ".endr\n"                                                               \
+        "subs %[count], %[count], #8\n"                                         \
+        "bne  1b\n"                                                             \
+        : [buf] "+r" (buf), [count] "+r" (count)                                \
+        : [idr] "r" (idr)                                                       \
+        : "r3", "cc", "memory");                                                \
+}
+
+SAMPLE_KERNEL(8)
+SAMPLE_KERNEL(9)
+SAMPLE_KERNEL(10)
+SAMPLE_KERNEL(12)
+SAMPLE_KERNEL(14)
+SAMPLE_KERNEL(16)
+SAMPLE_KERNEL(18)
+SAMPLE_KERNEL(24)
+
+/* Fastest first */
+static SampleKernel kernels[] = {
+    { 8,  8,  sample_kernel_8 },
+    { 9,  9,  sample_kernel_9 },
+    { 10, 10, sample_kernel_10 },
+    { 12, 12, sample_kernel_12 },
+    { 14, 14, sample_kernel_14 },
+    { 16, 16, sample_kernel_16 },
+    { 18, 18, sample_kernel_18 },
+    { 24, 24, sample_kernel_24 },
+};
+#define KERNEL_COUNT (sizeof(kernels) / sizeof(kernels[0]))
+
+/**
+ * @brief Measures every kernel's real period with DWT->CYCCNT; the
+ *        difference of a short and a long run cancels the call overhead.
+ *        Needs CYCCNT running
+ * @retval none
+ */
+void sample_kernel_init(void)
+{
+    static PollSample scratch[16 * KERNEL_UNROLL];
+
+    for (uint32_t k = 0; k < KERNEL_COUNT; k++)
+    {
+        uint32_t t0 = DWT->CYCCNT;
+        kernels[k].run(scratch, 8 * KERNEL_UNROLL);
+        uint32_t t1 = DWT->CYCCNT;
+        kernels[k].run(scratch, 16 * KERNEL_UNROLL);
+        uint32_t t2 = DWT->CYCCNT;
+
+        uint32_t extra = (t2 - t1) - (t1 - t0);   // cycles of 8 * KERNEL_UNROLL samples
+        kernels[k].period = (extra + 4 * KERNEL_UNROLL) / (8 * KERNEL_UNROLL);
+    }
+}
+
+/**
+ * @brief Picks the fastest kernel that is no faster than period
+ * @param period - wanted cycles per sample, 0 for the fastest kernel
+ * @retval the kernel, or NULL if period is slower than every kernel
+ */
+const SampleKernel *sample_kernel_find(uint32_t period)
+{
+    for (uint32_t k = 0; k < KERNEL_COUNT; k++)
+    {
+        if (kernels[k].period >= period) return &kernels[k];
+    }
+    return NULL;
+}
@@ -0,0 +1,133 @@
+/**
+  ******************************************************************************
+  * @file           : sampler_dma.c
+  * @brief          : Timer-paced DMA sampling of GPIOB
+  ******************************************************************************
+  */
+
+#include "sampler_dma.h"
+#include "dma_cache.h"
+
+static PollSample dma_buf[2 * DMA_HALF_SAMPLES] DMA_BUFFER;
+static uint32_t start_cycle = 0;   // DWT->CYCCNT when TIM2 was enabled
+static uint32_t period = 0;        // CPU (= TIM2) cycles per sample
+static uint32_t half_samples = 0;  // samples per half buffer
+static uint32_t halves_done = 0;   // half buffers handed out so far
+volatile uint32_t dma_overruns = 0;  // halves rewritten before they were sent
+
+/**
+ * @brief Starts sampling GPIOB->IDR at rate_hz into the circular buffer
+ * @param rate_hz - sample rate; TIM2 runs at the 72 MHz CPU clock, so the
+ *        real rate is 72 MHz / round(72 MHz / rate_hz), see sampler_dma_period
+ * @param samples - samples per half buffer, at most DMA_HALF_SAMPLES
+ * @retval none
+ */
+void sampler_dma_start(uint32_t rate_hz, uint32_t samples)
+{
+    __HAL_RCC_TIM2_CLK_ENABLE();
+    __HAL_RCC_DMA1_CLK_ENABLE();
+
+    period = (SystemCoreClock + rate_hz / 2) / rate_hz;
+    if (period < 2) period = 2;
+    // the 16-bit ARR covers periods up to 65536 cycles; slower rates also
+    // need the prescaler and round the period to a multiple of it
+    uint32_t psc = (period - 1) >> 16;
+    uint32_t arr = period / (psc + 1) - 1;
+    period = (psc + 1) * (arr + 1);
+
+    half_samples = samples;
+    if (half_samples == 0 || half_samples > DMA_HALF_SAMPLES) half_samples = DMA_HALF_SAMPLES;
+
+    TIM2->CR1 = 0;
+    TIM2->PSC = psc;
+    TIM2->ARR = arr;
+    TIM2->CNT = 0;
+    TIM2->EGR = TIM_EGR_UG;    // load PSC/ARR without a DMA request
+    TIM2->SR = 0;
+    TIM2->DIER = TIM_DIER_UDE;
+
+    // TIM2_UP is DMA1 channel 2. IDR must be read as a word; the DMA keeps
+    // the low byte (PB7-PB0) or half-word of the port when writing the
+    // narrower memory
+    DMA1_Channel2->CCR = 0;
+    DMA1->IFCR = DMA_IFCR_CGIF2;
+    dma_cache_clean(dma_buf, sizeof(dma_buf));  // lent out: no dirty line may land on samples later
+    DMA1_Channel2->CPAR = (uint32_t)&GPIOB->IDR;
+    DMA1_Channel2->CMAR = (uint32_t)dma_buf;
+    DMA1_Channel2->CNDTR = 2 * half_samples;
+    // MAIN_LOOP_SLEEP: the half and full flags raise an interrupt that
+    // stays disabled in the NVIC, only to wake the main loop's WFE
+    DMA1_Channel2->CCR = DMA_CCR_PL | DMA_CCR_PSIZE_1 | DMA_CCR_MINC |
+                         (sizeof(PollSample) == 2 ? DMA_CCR_MSIZE_0 : 0) |
+                         (MAIN_LOOP_SLEEP ? DMA_CCR_HTIE | DMA_CCR_TCIE : 0) |
+                         DMA_CCR_CIRC | DMA_CCR_EN;
+
+    halves_done = 0;
+    start_cycle = DWT->CYCCNT;
+    TIM2->CR1 = TIM_CR1_CEN;
+}
+
+/**
+ * @brief Returns the next filled half buffer, if DMA has finished one
+ * @param first_cycle - set to the CYCCNT time of its first sample
+ * @retval sampler_dma_samples() samples, or NULL if none is ready yet
+ */
+PollSample *sampler_dma_next(uint32_t *first_cycle)
+{
+    uint32_t half = halves_done & 1;
+    uint32_t flag = half ? DMA_ISR_TCIF2 : DMA_ISR_HTIF2;
+    uint32_t other = half ? DMA_ISR_HTIF2 : DMA_ISR_TCIF2;
+
+    if (!(DMA1->ISR & flag)) return NULL;
+    DMA1->IFCR = flag;
+#if MAIN_LOOP_SLEEP
+    NVIC_ClearPendingIRQ(DMA1_Channel2_IRQn);  // so the next flag is an event again
+#endif
+    if (DMA1->ISR & other)
+    {
+        dma_overruns++;   // DMA is already done with the next half too
+    }
+
+    *first_cycle = start_cycle + (halves_done * half_samples + 1) * period;
+    halves_done++;
+    dma_cache_invalidate(&dma_buf[half * half_samples], half_samples * sizeof(PollSample));
+    return &dma_buf[half * half_samples];
+}
+
+/**
+ * @brief CPU cycles between samples of the running capture
+ */
+uint32_t sampler_dma_period(void)
+{
+    return period;
+}
+
+/**
+ * @brief Samples in each buffer returned by sampler_dma_next
+ */
+uint32_t sampler_dma_samples(void)
+{
+    return half_samples;
+}
+
+/**
+ * @brief Lends the sample buffer out while the sampler is stopped
+ * @param size - set to its size in samples
+ * @retval the buffer
+ */
+PollSample *sampler_dma_buffer(uint32_t *size)
+{
+    *size = sizeof(dma_buf) / sizeof(dma_buf[0]);
+    return dma_buf;
+}
+
+/**
+ * @brief Stops the sampling timer and its DMA channel
+ * @retval none
+ */
+void sampler_dma_stop(void)
+{
+    TIM2->CR1 = 0;
+    TIM2->DIER = 0;
+    DMA1_Channel2->CCR = 0;
+}
@@ -0,0 +1,150 @@
+/**
+  ******************************************************************************
+  * @file    usbd_vendor.h
+  * @brief   Header file for usbd_vendor.c
+  ******************************************************************************
+  * Vendor-specific class: one interface (class 0xFF) with a bulk IN and a
+  * bulk OUT endpoint and nothing else, so the host talks to it through
+  * libusb/WinUSB instead of a serial driver. Windows binds WinUSB without
+  * an INF through the Microsoft OS 1.0 descriptors in usbd_desc.c. The
+  * API mirrors usbd_cdc.h so usbd_cdc_if.c can drive either class.
+  *
+  * The class also describes a high-speed configuration with 512-byte
+  * bulk packets, for a port to a core with a high-speed PHY (the V2
+  * board's USB3300 on an H7 OTG_HS). The F103 always enumerates at full
+  * speed. The receive buffer set with USBD_VENDOR_SetRxBuffer must hold
+  * one packet at the enumerated speed.
+  *
+  * With USB_ISO_STREAM the interface has two alternate settings instead:
+  * 0 with only the bulk OUT endpoint, the default that reserves no
+  * bandwidth, and 1 that adds an isochronous IN endpoint of
+  * VENDOR_ISO_PACKET_SIZE bytes per frame. The host selects 1 to stream.
+  * An isochronous transfer goes out as one packet per frame and a packet
+  * the host misses is not resent.
+  ******************************************************************************
+  */
+
+/* Define to prevent recursive inclusion -------------------------------------*/
+#ifndef __USB_VENDOR_H
+#define __USB_VENDOR_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Includes ------------------------------------------------------------------*/
+#include  "usbd_ioreq.h"
+
+/** @addtogroup STM32_USB_DEVICE_LIBRARY
+  * @{
+  */
+
+/** @defgroup usbd_vendor
+  * @brief This file is the Header file for usbd_vendor.c
+  * @{
+  */
+
+
+/** @defgroup usbd_vendor_Exported_Defines
+  * @{
+  */
+#ifndef USB_ISO_STREAM
+#define USB_ISO_STREAM                              0
+#endif
+
+#define VENDOR_IN_EP                                0x81U  /* EP1 for data IN */
+#if USB_IN_DOUBLE_BUFFER || USB_ISO_STREAM
+#define VENDOR_OUT_EP                               0x03U  /* EP3 for data OUT, EP1 is double-buffered IN */
+#else
+#define VENDOR_OUT_EP                               0x01U  /* EP1 for data OUT */
+#endif
+
+#define VENDOR_DATA_FS_MAX_PACKET_SIZE              64U    /* Endpoint IN & OUT Packet size */
+#define VENDOR_DATA_HS_MAX_PACKET_SIZE              512U   /* Endpoint IN & OUT Packet size */
+
+#define VENDOR_ISO_PACKET_SIZE                      128U   /* Isochronous IN packet, both PMA buffers fit */
+
+#if USB_ISO_STREAM
+#define USB_VENDOR_CONFIG_DESC_SIZ                  48U
+#else
+#define USB_VENDOR_CONFIG_DESC_SIZ                  32U
+#endif
+
+/**
+  * @}
+  */
+
+
+/** @defgroup USBD_CORE_Exported_TypesDefinitions
+  * @{
+  */
+
+typedef struct _USBD_VENDOR_Itf
+{
+  int8_t (* Init)(void);
+  int8_t (* DeInit)(void);
+  int8_t (* Receive)(uint8_t *Buf, uint32_t *Len);
+  int8_t (* TransmitCplt)(uint8_t *Buf, uint32_t *Len, uint8_t epnum);
+
+} USBD_VENDOR_ItfTypeDef;
+
+
+typedef struct
+{
+  uint8_t  *RxBuffer;
+  uint8_t  *TxBuffer;
+  uint32_t RxLength;
+  uint32_t TxLength;
+  uint32_t TxSent;      /* isochronous transfer: bytes already in packets */
+  uint32_t AltSetting;
+
+  __IO uint32_t TxState;
+}
+USBD_VENDOR_HandleTypeDef;
+
+/**
+  * @}
+  */
+
+/** @defgroup USBD_CORE_Exported_Variables
+  * @{
+  */
+
+extern USBD_ClassTypeDef  USBD_VENDOR;
+#define USBD_VENDOR_CLASS    &USBD_VENDOR
+/**
+  * @}
+  */
+
+/** @defgroup USB_CORE_Exported_Functions
+  * @{
+  */
+uint8_t  USBD_VENDOR_RegisterInterface(USBD_HandleTypeDef   *pdev,
+                                       USBD_VENDOR_ItfTypeDef *fops);
+
+uint8_t  USBD_VENDOR_SetTxBuffer(USBD_HandleTypeDef   *pdev,
+                                 uint8_t  *pbuff,
+                                 uint16_t length);
+
+uint8_t  USBD_VENDOR_SetRxBuffer(USBD_HandleTypeDef   *pdev,
+                                 uint8_t  *pbuff);
+
+uint8_t  USBD_VENDOR_ReceivePacket(USBD_HandleTypeDef *pdev);
+
+uint8_t  USBD_VENDOR_TransmitPacket(USBD_HandleTypeDef *pdev);
+/**
+  * @}
+  */
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif  /* __USB_VENDOR_H */
+/**
+  * @}
+  */
+
+/**
+  * @}
+  */
@@ -0,0 +1,765 @@
+/**
+  ******************************************************************************
+  * @file    usbd_vendor.c
+  * @brief   Vendor-specific bulk class: one bulk IN and one bulk OUT endpoint
+  ******************************************************************************
+  * Bulk packets are 64 bytes at full speed and 512 at high speed; the
+  * F103 only runs the former. Transfers on the IN endpoint follow
+  * usbd_cdc.c: a transfer that is a multiple of the packet size ends with
+  * a ZLP, then
+  * TransmitCplt is called. With USB_ISO_STREAM the IN endpoint is
+  * isochronous and only open in alternate setting 1; the class cuts each
+  * transfer into one VENDOR_ISO_PACKET_SIZE packet per frame, without a
+  * ZLP, since the HAL sends a single packet per isochronous transfer. The only control request handled besides the
+  * standard interface ones is the Microsoft OS vendor request that
+  * returns the WinUSB compatible ID (descriptors in usbd_desc.c).
+  ******************************************************************************
+  */
+
+/* Includes ------------------------------------------------------------------*/
+#include "usbd_vendor.h"
+#include "usbd_ctlreq.h"
+#include "usbd_desc.h"
+
+#if USB_VENDOR_CLASS
+
+/** @addtogroup STM32_USB_DEVICE_LIBRARY
+  * @{
+  */
+
+
+/** @defgroup USBD_VENDOR
+  * @brief usbd core module
+  * @{
+  */
+
+/** @defgroup USBD_VENDOR_Private_FunctionPrototypes
+  * @{
+  */
+
+
+static uint8_t  USBD_VENDOR_Init(USBD_HandleTypeDef *pdev,
+                                 uint8_t cfgidx);
+
+static uint8_t  USBD_VENDOR_DeInit(USBD_HandleTypeDef *pdev,
+                                   uint8_t cfgidx);
+
+static uint8_t  USBD_VENDOR_Setup(USBD_HandleTypeDef *pdev,
+                                  USBD_SetupReqTypedef *req);
+
+static uint8_t  USBD_VENDOR_DataIn(USBD_HandleTypeDef *pdev,
+                                   uint8_t epnum);
+
+static uint8_t  USBD_VENDOR_DataOut(USBD_HandleTypeDef *pdev,
+                                    uint8_t epnum);
+
+static uint8_t  *USBD_VENDOR_GetFSCfgDesc(uint16_t *length);
+
+static uint8_t  *USBD_VENDOR_GetHSCfgDesc(uint16_t *length);
+
+static uint8_t  *USBD_VENDOR_GetOtherSpeedCfgDesc(uint16_t *length);
+
+static uint8_t  *USBD_VENDOR_GetDeviceQualifierDescriptor(uint16_t *length);
+
+#if USB_ISO_STREAM
+static void  USBD_VENDOR_SetAlt(USBD_HandleTypeDef *pdev, uint8_t alt);
+#endif
+
+#if (USBD_SUPPORT_USER_STRING_DESC == 1U)
+static uint8_t  *USBD_VENDOR_GetUsrStrDescriptor(USBD_HandleTypeDef *pdev,
+                                                 uint8_t index, uint16_t *length);
+#endif
+
+/* USB Standard Device Descriptor */
+__ALIGN_BEGIN static uint8_t USBD_VENDOR_DeviceQualifierDesc[USB_LEN_DEV_QUALIFIER_DESC] __ALIGN_END =
+{
+  USB_LEN_DEV_QUALIFIER_DESC,
+  USB_DESC_TYPE_DEVICE_QUALIFIER,
+  0x00,
+  0x02,
+  0x00,
+  0x00,
+  0x00,
+  0x40,
+  0x01,
+  0x00,
+};
+
+/**
+  * @}
+  */
+
+/** @defgroup USBD_VENDOR_Private_Variables
+  * @{
+  */
+
+
+/* Vendor interface class callbacks structure */
+USBD_ClassTypeDef  USBD_VENDOR =
+{
+  USBD_VENDOR_Init,
+  USBD_VENDOR_DeInit,
+  USBD_VENDOR_Setup,
+  NULL,                 /* EP0_TxSent, */
+  NULL,                 /* EP0_RxReady, */
+  USBD_VENDOR_DataIn,
+  USBD_VENDOR_DataOut,
+  NULL,
+  NULL,
+  NULL,
+  USBD_VENDOR_GetHSCfgDesc,
+  USBD_VENDOR_GetFSCfgDesc,
+  USBD_VENDOR_GetOtherSpeedCfgDesc,
+  USBD_VENDOR_GetDeviceQualifierDescriptor,
+#if (USBD_SUPPORT_USER_STRING_DESC == 1U)
+  USBD_VENDOR_GetUsrStrDescriptor,
+#endif
+};
+
+/* USB vendor device Configuration Descriptor; the speeds differ only in the
+ * descriptor type and the bulk packet size */
+#if USB_ISO_STREAM
+#define USBD_VENDOR_CFG_DESC(type, packet) \
+{ \
+  /*Configuration Descriptor*/ \
+  0x09,   /* bLength: Configuration Descriptor size */ \
+  (type),                           /* bDescriptorType: Configuration */ \
+  USB_VENDOR_CONFIG_DESC_SIZ,       /* wTotalLength:no of returned bytes */ \
+  0x00, \
+  0x01,   /* bNumInterfaces: 1 interface */ \
+  0x01,   /* bConfigurationValue: Configuration value */ \
+  0x00,   /* iConfiguration: Index of string descriptor describing the configuration */ \
+  0xC0,   /* bmAttributes: self powered */ \
+  0x32,   /* MaxPower 0 mA */ \
+ \
+  /*---------------------------------------------------------------------------*/ \
+ \
+  /*Interface Descriptor, alternate setting 0: no isochronous bandwidth */ \
+  0x09,   /* bLength: Interface Descriptor size */ \
+  USB_DESC_TYPE_INTERFACE,  /* bDescriptorType: Interface */ \
+  0x00,   /* bInterfaceNumber: Number of Interface */ \
+  0x00,   /* bAlternateSetting: Alternate setting */ \
+  0x01,   /* bNumEndpoints: One endpoint used */ \
+  0xFF,   /* bInterfaceClass: Vendor specific */ \
+  0x00,   /* bInterfaceSubClass: */ \
+  0x00,   /* bInterfaceProtocol: */ \
+  USBD_IDX_INTERFACE_STR,   /* iInterface: */ \
+ \
+  /*Endpoint OUT Descriptor*/ \
+  0x07,   /* bLength: Endpoint Descriptor size */ \
+  USB_DESC_TYPE_ENDPOINT,      /* bDescriptorType: Endpoint */ \
+  VENDOR_OUT_EP,                        /* bEndpointAddress */ \
+  0x02,                              /* bmAttributes: Bulk */ \
+  LOBYTE(packet),  /* wMaxPacketSize: */ \
+  HIBYTE(packet), \
+  0x00,                              /* bInterval: ignore for Bulk transfer */ \
+ \
+  /*Interface Descriptor, alternate setting 1: isochronous stream */ \
+  0x09,   /* bLength: Interface Descriptor size */ \
+  USB_DESC_TYPE_INTERFACE,  /* bDescriptorType: Interface */ \
+  0x00,   /* bInterfaceNumber: Number of Interface */ \
+  0x01,   /* bAlternateSetting: Alternate setting */ \
+  0x02,   /* bNumEndpoints: Two endpoints used */ \
+  0xFF,   /* bInterfaceClass: Vendor specific */ \
+  0x00,   /* bInterfaceSubClass: */ \
+  0x00,   /* bInterfaceProtocol: */ \
+  USBD_IDX_INTERFACE_STR,   /* iInterface: */ \
+ \
+  /*Endpoint OUT Descriptor*/ \
+  0x07,   /* bLength: Endpoint Descriptor size */ \
+  USB_DESC_TYPE_ENDPOINT,      /* bDescriptorType: Endpoint */ \
+  VENDOR_OUT_EP,                        /* bEndpointAddress */ \
+  0x02,                              /* bmAttributes: Bulk */ \
+  LOBYTE(packet),  /* wMaxPacketSize: */ \
+  HIBYTE(packet), \
+  0x00,                              /* bInterval: ignore for Bulk transfer */ \
+ \
+  /*Endpoint IN Descriptor*/ \
+  0x07,   /* bLength: Endpoint Descriptor size */ \
+  USB_DESC_TYPE_ENDPOINT,      /* bDescriptorType: Endpoint */ \
+  VENDOR_IN_EP,                         /* bEndpointAddress */ \
+  0x05,                              /* bmAttributes: Isochronous, asynchronous */ \
+  LOBYTE(VENDOR_ISO_PACKET_SIZE),  /* wMaxPacketSize: */ \
+  HIBYTE(VENDOR_ISO_PACKET_SIZE), \
+  0x01                               /* bInterval: every (micro)frame */ \
+}
+#else
+#define USBD_VENDOR_CFG_DESC(type, packet) \
+{ \
+  /*Configuration Descriptor*/ \
+  0x09,   /* bLength: Configuration Descriptor size */ \
+  (type),                           /* bDescriptorType: Configuration */ \
+  USB_VENDOR_CONFIG_DESC_SIZ,       /* wTotalLength:no of returned bytes */ \
+  0x00, \
+  0x01,   /* bNumInterfaces: 1 interface */ \
+  0x01,   /* bConfigurationValue: Configuration value */ \
+  0x00,   /* iConfiguration: Index of string descriptor describing the configuration */ \
+  0xC0,   /* bmAttributes: self powered */ \
+  0x32,   /* MaxPower 0 mA */ \
+ \
+  /*---------------------------------------------------------------------------*/ \
+ \
+  /*Interface Descriptor */ \
+  0x09,   /* bLength: Interface Descriptor size */ \
+  USB_DESC_TYPE_INTERFACE,  /* bDescriptorType: Interface */ \
+  0x00,   /* bInterfaceNumber: Number of Interface */ \
+  0x00,   /* bAlternateSetting: Alternate setting */ \
+  0x02,   /* bNumEndpoints: Two endpoints used */ \
+  0xFF,   /* bInterfaceClass: Vendor specific */ \
+  0x00,   /* bInterfaceSubClass: */ \
+  0x00,   /* bInterfaceProtocol: */ \
+  USBD_IDX_INTERFACE_STR,   /* iInterface: */ \
+ \
+  /*Endpoint OUT Descriptor*/ \
+  0x07,   /* bLength: Endpoint Descriptor size */ \
+  USB_DESC_TYPE_ENDPOINT,      /* bDescriptorType: Endpoint */ \
+  VENDOR_OUT_EP,                        /* bEndpointAddress */ \
+  0x02,                              /* bmAttributes: Bulk */ \
+  LOBYTE(packet),  /* wMaxPacketSize: */ \
+  HIBYTE(packet), \
+  0x00,                              /* bInterval: ignore for Bulk transfer */ \
+ \
+  /*Endpoint IN Descriptor*/ \
+  0x07,   /* bLength: Endpoint Descriptor size */ \
+  USB_DESC_TYPE_ENDPOINT,      /* bDescriptorType: Endpoint */ \
+  VENDOR_IN_EP,                         /* bEndpointAddress */ \
+  0x02,                              /* bmAttributes: Bulk */ \
+  LOBYTE(packet),  /* wMaxPacketSize: */ \
+  HIBYTE(packet), \
+  0x00                               /* bInterval: ignore for Bulk transfer */ \
+}
+#endif
+
+__ALIGN_BEGIN uint8_t USBD_VENDOR_CfgFSDesc[USB_VENDOR_CONFIG_DESC_SIZ] __ALIGN_END =
+  USBD_VENDOR_CFG_DESC(USB_DESC_TYPE_CONFIGURATION, VENDOR_DATA_FS_MAX_PACKET_SIZE);
+
+__ALIGN_BEGIN uint8_t USBD_VENDOR_CfgHSDesc[USB_VENDOR_CONFIG_DESC_SIZ] __ALIGN_END =
+  USBD_VENDOR_CFG_DESC(USB_DESC_TYPE_CONFIGURATION, VENDOR_DATA_HS_MAX_PACKET_SIZE);
+
+/* Full-speed configuration as reported while running at high speed */
+__ALIGN_BEGIN uint8_t USBD_VENDOR_OtherSpeedCfgDesc[USB_VENDOR_CONFIG_DESC_SIZ] __ALIGN_END =
+  USBD_VENDOR_CFG_DESC(USB_DESC_TYPE_OTHER_SPEED_CONFIGURATION, VENDOR_DATA_FS_MAX_PACKET_SIZE);
+
+/**
+  * @}
+  */
+
+/** @defgroup USBD_VENDOR_Private_Functions
+  * @{
+  */
+
+/**
+  * @brief  USBD_VENDOR_PacketSize
+  *         Bulk packet size at the enumerated speed
+  * @param  pdev: device instance
+  * @retval packet size in bytes
+  */
+static uint16_t USBD_VENDOR_PacketSize(USBD_HandleTypeDef *pdev)
+{
+  return (pdev->dev_speed == USBD_SPEED_HIGH) ? VENDOR_DATA_HS_MAX_PACKET_SIZE
+                                              : VENDOR_DATA_FS_MAX_PACKET_SIZE;
+}
+
+#if USB_ISO_STREAM
+/**
+  * @brief  USBD_VENDOR_SetAlt
+  *         Open the isochronous IN endpoint for alternate setting 1, close
+  *         it for 0. The interface's Init drops the transfers queued on
+  *         the previous setting
+  * @param  pdev: device instance
+  * @param  alt: alternate setting
+  */
+static void  USBD_VENDOR_SetAlt(USBD_HandleTypeDef *pdev, uint8_t alt)
+{
+  USBD_VENDOR_HandleTypeDef *hven = (USBD_VENDOR_HandleTypeDef *)pdev->pClassData;
+
+  if (pdev->ep_in[VENDOR_IN_EP & 0xFU].is_used != 0U)
+  {
+    USBD_LL_CloseEP(pdev, VENDOR_IN_EP);
+    pdev->ep_in[VENDOR_IN_EP & 0xFU].is_used = 0U;
+  }
+  hven->TxState = 0U;
+  hven->AltSetting = alt;
+
+  if (alt != 0U)
+  {
+    USBD_LL_OpenEP(pdev, VENDOR_IN_EP, USBD_EP_TYPE_ISOC, VENDOR_ISO_PACKET_SIZE);
+    pdev->ep_in[VENDOR_IN_EP & 0xFU].is_used = 1U;
+  }
+  ((USBD_VENDOR_ItfTypeDef *)pdev->pUserData)->Init();
+}
+#endif
+
+/**
+  * @brief  USBD_VENDOR_Init
+  *         Initialize the vendor interface
+  * @param  pdev: device instance
+  * @param  cfgidx: Configuration index
+  * @retval status
+  */
+static uint8_t  USBD_VENDOR_Init(USBD_HandleTypeDef *pdev, uint8_t cfgidx)
+{
+  uint8_t ret = 0U;
+  USBD_VENDOR_HandleTypeDef   *hven;
+  uint16_t packet = USBD_VENDOR_PacketSize(pdev);
+
+#if !USB_ISO_STREAM
+  /* Open EP IN; the isochronous one opens with alternate setting 1 */
+  USBD_LL_OpenEP(pdev, VENDOR_IN_EP, USBD_EP_TYPE_BULK, packet);
+
+  pdev->ep_in[VENDOR_IN_EP & 0xFU].is_used = 1U;
+#endif
+
+  /* Open EP OUT */
+  USBD_LL_OpenEP(pdev, VENDOR_OUT_EP, USBD_EP_TYPE_BULK, packet);
+
+  pdev->ep_out[VENDOR_OUT_EP & 0xFU].is_used = 1U;
+
+  pdev->pClassData = USBD_malloc(sizeof(USBD_VENDOR_HandleTypeDef));
+
+  if (pdev->pClassData == NULL)
+  {
+    ret = 1U;
+  }
+  else
+  {
+    hven = (USBD_VENDOR_HandleTypeDef *) pdev->pClassData;
+
+    /* Init Xfer state before the interface may start a transfer */
+    hven->TxState = 0U;
+    hven->AltSetting = 0U;
+
+    /* Init  physical Interface components */
+    ((USBD_VENDOR_ItfTypeDef *)pdev->pUserData)->Init();
+
+    /* Prepare Out endpoint to receive next packet */
+    USBD_LL_PrepareReceive(pdev, VENDOR_OUT_EP, hven->RxBuffer, packet);
+  }
+  return ret;
+}
+
+/**
+  * @brief  USBD_VENDOR_DeInit
+  *         DeInitialize the vendor layer
+  * @param  pdev: device instance
+  * @param  cfgidx: Configuration index
+  * @retval status
+  */
+static uint8_t  USBD_VENDOR_DeInit(USBD_HandleTypeDef *pdev, uint8_t cfgidx)
+{
+  uint8_t ret = 0U;
+
+  /* Close EP IN */
+  if (pdev->ep_in[VENDOR_IN_EP & 0xFU].is_used != 0U)
+  {
+    USBD_LL_CloseEP(pdev, VENDOR_IN_EP);
+    pdev->ep_in[VENDOR_IN_EP & 0xFU].is_used = 0U;
+  }
+
+  /* Close EP OUT */
+  USBD_LL_CloseEP(pdev, VENDOR_OUT_EP);
+  pdev->ep_out[VENDOR_OUT_EP & 0xFU].is_used = 0U;
+
+  /* DeInit  physical Interface components */
+  if (pdev->pClassData != NULL)
+  {
+    ((USBD_VENDOR_ItfTypeDef *)pdev->pUserData)->DeInit();
+    USBD_free(pdev->pClassData);
+    pdev->pClassData = NULL;
+  }
+
+  return ret;
+}
+
+/**
+  * @brief  USBD_VENDOR_Setup
+  *         Handle the Microsoft OS vendor request and the standard
+  *         interface requests
+  * @param  pdev: instance
+  * @param  req: usb requests
+  * @retval status
+  */
+static uint8_t  USBD_VENDOR_Setup(USBD_HandleTypeDef *pdev,
+                                  USBD_SetupReqTypedef *req)
+{
+  USBD_VENDOR_HandleTypeDef *hven = (USBD_VENDOR_HandleTypeDef *)pdev->pClassData;
+  uint8_t ifalt = 0U;
+  uint16_t status_info = 0U;
+  uint8_t ret = USBD_OK;
+  uint8_t *pbuf;
+  uint16_t len;
+
+  switch (req->bmRequest & USB_REQ_TYPE_MASK)
+  {
+    case USB_REQ_TYPE_VENDOR:
+      if ((req->bRequest == USBD_MS_VENDOR_CODE) && (req->wIndex == 0x0004U) &&
+          (req->bmRequest & 0x80U))
+      {
+        /* Extended Compat ID OS descriptor */
+        pbuf = USBD_FS_MsCompatIdDescriptor(&len);
+        USBD_CtlSendData(pdev, pbuf, MIN(len, req->wLength));
+      }
+      else
+      {
+        USBD_CtlError(pdev, req);
+        ret = USBD_FAIL;
+      }
+      break;
+
+    case USB_REQ_TYPE_STANDARD:
+      switch (req->bRequest)
+      {
+        case USB_REQ_GET_STATUS:
+          if (pdev->dev_state == USBD_STATE_CONFIGURED)
+          {
+            USBD_CtlSendData(pdev, (uint8_t *)(void *)&status_info, 2U);
+          }
+          else
+          {
+            USBD_CtlError(pdev, req);
+            ret = USBD_FAIL;
+          }
+          break;
+
+        case USB_REQ_GET_INTERFACE:
+          if ((pdev->dev_state == USBD_STATE_CONFIGURED) && (hven != NULL))
+          {
+            ifalt = (uint8_t)hven->AltSetting;
+            USBD_CtlSendData(pdev, &ifalt, 1U);
+          }
+          else
+          {
+            USBD_CtlError(pdev, req);
+            ret = USBD_FAIL;
+          }
+          break;
+
+        case USB_REQ_SET_INTERFACE:
+          if ((pdev->dev_state != USBD_STATE_CONFIGURED) || (hven == NULL) ||
+              (req->wValue > (USB_ISO_STREAM ? 1U : 0U)))
+          {
+            USBD_CtlError(pdev, req);
+            ret = USBD_FAIL;
+          }
+#if USB_ISO_STREAM
+          else if (req->wValue != hven->AltSetting)
+          {
+            USBD_VENDOR_SetAlt(pdev, (uint8_t)req->wValue);
+          }
+#endif
+          break;
+
+        default:
+          USBD_CtlError(pdev, req);
+          ret = USBD_FAIL;
+          break;
+      }
+      break;
+
+    default:
+      USBD_CtlError(pdev, req);
+      ret = USBD_FAIL;
+      break;
+  }
+
+  return ret;
+}
+
+/**
+  * @brief  USBD_VENDOR_DataIn
+  *         Data sent on non-control IN endpoint
+  * @param  pdev: device instance
+  * @param  epnum: endpoint number
+  * @retval status
+  */
+static uint8_t  USBD_VENDOR_DataIn(USBD_HandleTypeDef *pdev, uint8_t epnum)
+{
+  USBD_VENDOR_HandleTypeDef *hven = (USBD_VENDOR_HandleTypeDef *)pdev->pClassData;
+  PCD_HandleTypeDef *hpcd = pdev->pData;
+
+  if (pdev->pClassData != NULL)
+  {
+#if USB_ISO_STREAM
+    if (hven->TxSent < hven->TxLength)
+    {
+      /* Next packet of the transfer, in the next frame */
+      uint32_t len = MIN(hven->TxLength - hven->TxSent, VENDOR_ISO_PACKET_SIZE);
+
+      USBD_LL_Transmit(pdev, epnum, hven->TxBuffer + hven->TxSent, (uint16_t)len);
+      hven->TxSent += len;
+      return USBD_OK;
+    }
+    (void)hpcd;
+#else
+    if ((pdev->ep_in[epnum].total_length > 0U) && ((pdev->ep_in[epnum].total_length % hpcd->IN_ep[epnum].maxpacket) == 0U))
+    {
+      /* Update the packet total length */
+      pdev->ep_in[epnum].total_length = 0U;
+
+      /* Send ZLP */
+      USBD_LL_Transmit(pdev, epnum, NULL, 0U);
+      return USBD_OK;
+    }
+#endif
+    hven->TxState = 0U;
+
+    if (((USBD_VENDOR_ItfTypeDef *)pdev->pUserData)->TransmitCplt != NULL)
+    {
+      ((USBD_VENDOR_ItfTypeDef *)pdev->pUserData)->TransmitCplt(hven->TxBuffer, &hven->TxLength, epnum);
+    }
+    return USBD_OK;
+  }
+  else
+  {
+    return USBD_FAIL;
+  }
+}
+
+/**
+  * @brief  USBD_VENDOR_DataOut
+  *         Data received on non-control Out endpoint
+  * @param  pdev: device instance
+  * @param  epnum: endpoint number
+  * @retval status
+  */
+static uint8_t  USBD_VENDOR_DataOut(USBD_HandleTypeDef *pdev, uint8_t epnum)
+{
+  USBD_VENDOR_HandleTypeDef   *hven = (USBD_VENDOR_HandleTypeDef *) pdev->pClassData;
+
+  if (pdev->pClassData != NULL)
+  {
+    /* Get the received data length */
+    hven->RxLength = USBD_LL_GetRxDataSize(pdev, epnum);
+
+    /* The OUT endpoint NAKs until Receive re-arms it */
+    ((USBD_VENDOR_ItfTypeDef *)pdev->pUserData)->Receive(hven->RxBuffer, &hven->RxLength);
+
+    return USBD_OK;
+  }
+  else
+  {
+    return USBD_FAIL;
+  }
+}
+
+/**
+  * @brief  USBD_VENDOR_GetFSCfgDesc
+  *         Return configuration descriptor
+  * @param  length : pointer data length
+  * @retval pointer to descriptor buffer
+  */
+static uint8_t  *USBD_VENDOR_GetFSCfgDesc(uint16_t *length)
+{
+  *length = sizeof(USBD_VENDOR_CfgFSDesc);
+  return USBD_VENDOR_CfgFSDesc;
+}
+
+/**
+  * @brief  USBD_VENDOR_GetHSCfgDesc
+  *         Return configuration descriptor
+  * @param  length : pointer data length
+  * @retval pointer to descriptor buffer
+  */
+static uint8_t  *USBD_VENDOR_GetHSCfgDesc(uint16_t *length)
+{
+  *length = sizeof(USBD_VENDOR_CfgHSDesc);
+  return USBD_VENDOR_CfgHSDesc;
+}
+
+/**
+  * @brief  USBD_VENDOR_GetOtherSpeedCfgDesc
+  *         Return configuration descriptor
+  * @param  length : pointer data length
+  * @retval pointer to descriptor buffer
+  */
+static uint8_t  *USBD_VENDOR_GetOtherSpeedCfgDesc(uint16_t *length)
+{
+  *length = sizeof(USBD_VENDOR_OtherSpeedCfgDesc);
+  return USBD_VENDOR_OtherSpeedCfgDesc;
+}
+
+/**
+* @brief  DeviceQualifierDescriptor
+*         return Device Qualifier descriptor
+* @param  length : pointer data length
+* @retval pointer to descriptor buffer
+*/
+static uint8_t  *USBD_VENDOR_GetDeviceQualifierDescriptor(uint16_t *length)
+{
+  *length = sizeof(USBD_VENDOR_DeviceQualifierDesc);
+  return USBD_VENDOR_DeviceQualifierDesc;
+}
+
+#if (USBD_SUPPORT_USER_STRING_DESC == 1U)
+/**
+  * @brief  USBD_VENDOR_GetUsrStrDescriptor
+  *         Return the Microsoft OS string descriptor (index 0xEE)
+  * @param  pdev: device instance
+  * @param  index: string index
+  * @param  length : pointer data length
+  * @retval pointer to descriptor buffer, NULL if unknown
+  */
+static uint8_t  *USBD_VENDOR_GetUsrStrDescriptor(USBD_HandleTypeDef *pdev,
+                                                 uint8_t index, uint16_t *length)
+{
+  if (index == USBD_IDX_MS_OS_STR)
+  {
+    return USBD_FS_MsOsStrDescriptor(pdev->dev_speed, length);
+  }
+  *length = 0U;
+  return NULL;
+}
+#endif
+
+/**
+* @brief  USBD_VENDOR_RegisterInterface
+  * @param  pdev: device instance
+  * @param  fops: vendor interface callback
+  * @retval status
+  */
+uint8_t  USBD_VENDOR_RegisterInterface(USBD_HandleTypeDef   *pdev,
+                                       USBD_VENDOR_ItfTypeDef *fops)
+{
+  uint8_t  ret = USBD_FAIL;
+
+  if (fops != NULL)
+  {
+    pdev->pUserData = fops;
+    ret = USBD_OK;
+  }
+
+  return ret;
+}
+
+/**
+  * @brief  USBD_VENDOR_SetTxBuffer
+  * @param  pdev: device instance
+  * @param  pbuff: Tx Buffer
+  * @retval status
+  */
+uint8_t  USBD_VENDOR_SetTxBuffer(USBD_HandleTypeDef   *pdev,
+                                 uint8_t  *pbuff,
+                                 uint16_t length)
+{
+  USBD_VENDOR_HandleTypeDef   *hven = (USBD_VENDOR_HandleTypeDef *) pdev->pClassData;
+
+  if (hven == NULL)
+  {
+    return USBD_FAIL;
+  }
+  hven->TxBuffer = pbuff;
+  hven->TxLength = length;
+
+  return USBD_OK;
+}
+
+
+/**
+  * @brief  USBD_VENDOR_SetRxBuffer
+  * @param  pdev: device instance
+  * @param  pbuff: Rx Buffer
+  * @retval status
+  */
+uint8_t  USBD_VENDOR_SetRxBuffer(USBD_HandleTypeDef   *pdev,
+                                 uint8_t  *pbuff)
+{
+  USBD_VENDOR_HandleTypeDef   *hven = (USBD_VENDOR_HandleTypeDef *) pdev->pClassData;
+
+  if (hven == NULL)
+  {
+    return USBD_FAIL;
+  }
+  hven->RxBuffer = pbuff;
+
+  return USBD_OK;
+}
+
+/**
+  * @brief  USBD_VENDOR_TransmitPacket
+  *         Transmit packet on IN endpoint
+  * @param  pdev: device instance
+  * @retval status
+  */
+uint8_t  USBD_VENDOR_TransmitPacket(USBD_HandleTypeDef *pdev)
+{
+  USBD_VENDOR_HandleTypeDef   *hven = (USBD_VENDOR_HandleTypeDef *) pdev->pClassData;
+
+  if (pdev->pClassData != NULL)
+  {
+#if USB_ISO_STREAM
+    if (hven->AltSetting == 0U)
+    {
+      /* No IN endpoint until the host selects the streaming setting */
+      return USBD_FAIL;
+    }
+#endif
+    if (hven->TxState == 0U)
+    {
+      /* Tx Transfer in progress */
+      hven->TxState = 1U;
+
+      /* Update the packet total length */
+      pdev->ep_in[VENDOR_IN_EP & 0xFU].total_length = hven->TxLength;
+
+#if USB_ISO_STREAM
+      /* First packet; DataIn sends the rest, one per frame */
+      hven->TxSent = MIN(hven->TxLength, VENDOR_ISO_PACKET_SIZE);
+      USBD_LL_Transmit(pdev, VENDOR_IN_EP, hven->TxBuffer,
+                       (uint16_t)hven->TxSent);
+#else
+      /* Transmit next packet */
+      USBD_LL_Transmit(pdev, VENDOR_IN_EP, hven->TxBuffer,
+                       (uint16_t)hven->TxLength);
+#endif
+
+      return USBD_OK;
+    }
+    else
+    {
+      return USBD_BUSY;
+    }
+  }
+  else
+  {
+    return USBD_FAIL;
+  }
+}
+
+
+/**
+  * @brief  USBD_VENDOR_ReceivePacket
+  *         prepare OUT Endpoint for reception
+  * @param  pdev: device instance
+  * @retval status
+  */
+uint8_t  USBD_VENDOR_ReceivePacket(USBD_HandleTypeDef *pdev)
+{
+  USBD_VENDOR_HandleTypeDef   *hven = (USBD_VENDOR_HandleTypeDef *) pdev->pClassData;
+
+  if (pdev->pClassData != NULL)
+  {
+    /* Prepare Out endpoint to receive next packet */
+    USBD_LL_PrepareReceive(pdev,
+                           VENDOR_OUT_EP,
+                           hven->RxBuffer,
+                           USBD_VENDOR_PacketSize(pdev));
+    return USBD_OK;
+  }
+  else
+  {
+    return USBD_FAIL;
+  }
+}
+/**
+  * @}
+  */
+
+/**
+  * @}
+  */
+
+/**
+  * @}
+  */
+
+#endif /* USB_VENDOR_CLASS */
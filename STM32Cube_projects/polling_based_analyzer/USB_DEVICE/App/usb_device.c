@@ -27,7 +27,7 @@
 #include "usbd_cdc_if.h"
 
 /* USER CODE BEGIN Includes */
-
+#include "usbd_vendor.h"
 /* USER CODE END Includes */
 
 /* USER CODE BEGIN PV */
@@ -54,7 +54,7 @@ USBD_HandleTypeDef hUsbDeviceFS;
  * -- Insert your external function declaration here --
  */
 /* USER CODE BEGIN 1 */
-
+extern USBD_VENDOR_ItfTypeDef USBD_Vendor_fops_FS;
 /* USER CODE END 1 */
 
 /**
@@ -72,6 +72,16 @@ void MX_USB_DEVICE_Init(void)
   {
     Error_Handler();
   }
+#if USB_VENDOR_CLASS
+  if (USBD_RegisterClass(&hUsbDeviceFS, &USBD_VENDOR) != USBD_OK)
+  {
+    Error_Handler();
+  }
+  if (USBD_VENDOR_RegisterInterface(&hUsbDeviceFS, &USBD_Vendor_fops_FS) != USBD_OK)
+  {
+    Error_Handler();
+  }
+#else
   if (USBD_RegisterClass(&hUsbDeviceFS, &USBD_CDC) != USBD_OK)
   {
     Error_Handler();
@@ -80,6 +90,7 @@ void MX_USB_DEVICE_Init(void)
   {
     Error_Handler();
   }
+#endif
   if (USBD_Start(&hUsbDeviceFS) != USBD_OK)
   {
     Error_Handler();
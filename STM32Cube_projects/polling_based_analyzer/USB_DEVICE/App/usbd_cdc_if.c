@@ -22,6 +22,9 @@
 #include "usbd_cdc_if.h"
 
 /* USER CODE BEGIN INCLUDE */
+#include "main.h"
+#include "host_cmd.h"
+#include "usbd_vendor.h"
 
 /* USER CODE END INCLUDE */
 
@@ -49,6 +52,12 @@
   */
 
 /* USER CODE BEGIN PRIVATE_TYPES */
+/* One transfer posted through CDC_Transmit_FS */
+typedef struct
+{
+  uint8_t *buf;
+  uint16_t len;
+} TxDescriptor;
 
 /* USER CODE END PRIVATE_TYPES */
 
@@ -62,6 +71,10 @@
   */
 
 /* USER CODE BEGIN PRIVATE_DEFINES */
+#if USB_TX_QUEUE < 2 || (USB_TX_QUEUE & (USB_TX_QUEUE - 1))
+#error "USB_TX_QUEUE must be a power of 2, at least 2"
+#endif
+#define TX_QUEUE_MASK (USB_TX_QUEUE - 1)
 /* USER CODE END PRIVATE_DEFINES */
 
 /**
@@ -74,7 +87,21 @@
   */
 
 /* USER CODE BEGIN PRIVATE_MACRO */
-
+/* With USB_VENDOR_CLASS the same glue drives the bulk class in
+ * usbd_vendor.c, which has the CDC data API without line coding */
+#if USB_VENDOR_CLASS
+#define USBD_IF_SetTxBuffer     USBD_VENDOR_SetTxBuffer
+#define USBD_IF_SetRxBuffer     USBD_VENDOR_SetRxBuffer
+#define USBD_IF_TransmitPacket  USBD_VENDOR_TransmitPacket
+#define USBD_IF_ReceivePacket   USBD_VENDOR_ReceivePacket
+#define USBD_IF_HandleTypeDef   USBD_VENDOR_HandleTypeDef
+#else
+#define USBD_IF_SetTxBuffer     USBD_CDC_SetTxBuffer
+#define USBD_IF_SetRxBuffer     USBD_CDC_SetRxBuffer
+#define USBD_IF_TransmitPacket  USBD_CDC_TransmitPacket
+#define USBD_IF_ReceivePacket   USBD_CDC_ReceivePacket
+#define USBD_IF_HandleTypeDef   USBD_CDC_HandleTypeDef
+#endif
 /* USER CODE END PRIVATE_MACRO */
 
 /**
@@ -85,16 +112,17 @@
   * @brief Private variables.
   * @{
   */
-/* Create buffer for reception and transmission           */
+/* Create buffer for reception                            */
 /* It's up to user to redefine and/or remove those define */
 /** Received data over USB are stored in this buffer      */
 uint8_t UserRxBufferFS[APP_RX_DATA_SIZE];
 
-/** Data to send over USB CDC are stored in this buffer   */
-uint8_t UserTxBufferFS[APP_TX_DATA_SIZE];
-
 /* USER CODE BEGIN PRIVATE_VARIABLES */
-
+/* Transmit queue: tx_queue[tx_head] is on the bus; the transfers behind it
+ * start one by one from the transmit-complete callback */
+static TxDescriptor tx_queue[USB_TX_QUEUE];
+static volatile uint32_t tx_head = 0;
+static volatile uint32_t tx_tail = 0;
 /* USER CODE END PRIVATE_VARIABLES */
 
 /**
@@ -109,7 +137,7 @@ uint8_t UserTxBufferFS[APP_TX_DATA_SIZE];
 extern USBD_HandleTypeDef hUsbDeviceFS;
 
 /* USER CODE BEGIN EXPORTED_VARIABLES */
-
+volatile uint32_t usb_tx_queue_peak = 0;  // most transfers ever queued at once
 /* USER CODE END EXPORTED_VARIABLES */
 
 /**
@@ -125,9 +153,11 @@ static int8_t CDC_Init_FS(void);
 static int8_t CDC_DeInit_FS(void);
 static int8_t CDC_Control_FS(uint8_t cmd, uint8_t* pbuf, uint16_t length);
 static int8_t CDC_Receive_FS(uint8_t* pbuf, uint32_t *Len);
+static int8_t CDC_TransmitCplt_FS(uint8_t *Buf, uint32_t *Len, uint8_t epnum);
 
 /* USER CODE BEGIN PRIVATE_FUNCTIONS_DECLARATION */
-
+static uint8_t CDC_TxStart_FS(void);
+static void CDC_TxFlush_FS(void);
 /* USER CODE END PRIVATE_FUNCTIONS_DECLARATION */
 
 /**
@@ -139,9 +169,20 @@ USBD_CDC_ItfTypeDef USBD_Interface_fops_FS =
   CDC_Init_FS,
   CDC_DeInit_FS,
   CDC_Control_FS,
-  CDC_Receive_FS
+  CDC_Receive_FS,
+  CDC_TransmitCplt_FS
 };
 
+#if USB_VENDOR_CLASS
+USBD_VENDOR_ItfTypeDef USBD_Vendor_fops_FS =
+{
+  CDC_Init_FS,
+  CDC_DeInit_FS,
+  CDC_Receive_FS,
+  CDC_TransmitCplt_FS
+};
+#endif
+
 /* Private functions ---------------------------------------------------------*/
 /**
   * @brief  Initializes the CDC media low layer over the FS USB IP
@@ -151,8 +192,10 @@ static int8_t CDC_Init_FS(void)
 {
   /* USER CODE BEGIN 3 */
   /* Set Application Buffers */
-  USBD_CDC_SetTxBuffer(&hUsbDeviceFS, UserTxBufferFS, 0);
-  USBD_CDC_SetRxBuffer(&hUsbDeviceFS, UserRxBufferFS);
+  USBD_IF_SetTxBuffer(&hUsbDeviceFS, NULL, 0);  // CDC_TxStart_FS sets each transfer's
+  USBD_IF_SetRxBuffer(&hUsbDeviceFS, UserRxBufferFS);
+  // A bus reset aborts the transfers in flight and queued; release them
+  CDC_TxFlush_FS();
   return (USBD_OK);
   /* USER CODE END 3 */
 }
@@ -259,8 +302,9 @@ static int8_t CDC_Control_FS(uint8_t cmd, uint8_t* pbuf, uint16_t length)
 static int8_t CDC_Receive_FS(uint8_t* Buf, uint32_t *Len)
 {
   /* USER CODE BEGIN 6 */
-  USBD_CDC_SetRxBuffer(&hUsbDeviceFS, &Buf[0]);
-  USBD_CDC_ReceivePacket(&hUsbDeviceFS);
+  host_cmd_receive(Buf, *Len);
+  USBD_IF_SetRxBuffer(&hUsbDeviceFS, &Buf[0]);
+  USBD_IF_ReceivePacket(&hUsbDeviceFS);
   return (USBD_OK);
   /* USER CODE END 6 */
 }
@@ -280,17 +324,75 @@ uint8_t CDC_Transmit_FS(uint8_t* Buf, uint16_t Len)
 {
   uint8_t result = USBD_OK;
   /* USER CODE BEGIN 7 */
-  USBD_CDC_HandleTypeDef *hcdc = (USBD_CDC_HandleTypeDef*)hUsbDeviceFS.pClassData;
-  if (hcdc->TxState != 0){
+  // Queues the transfer behind the ones already posted; Buf stays in use
+  // until its transmit-complete callback. Runs from the main loop and
+  // from that callback
+  uint32_t primask = __get_PRIMASK();
+  __disable_irq();
+  uint32_t queued = tx_tail - tx_head;
+  if (queued == USB_TX_QUEUE)
+  {
+    __set_PRIMASK(primask);
     return USBD_BUSY;
   }
-  USBD_CDC_SetTxBuffer(&hUsbDeviceFS, Buf, Len);
-  result = USBD_CDC_TransmitPacket(&hUsbDeviceFS);
+  tx_queue[tx_tail & TX_QUEUE_MASK].buf = Buf;
+  tx_queue[tx_tail & TX_QUEUE_MASK].len = Len;
+  if (queued == 0) result = CDC_TxStart_FS();
+  if (result == USBD_OK)
+  {
+    tx_tail++;
+    if (queued + 1 > usb_tx_queue_peak) usb_tx_queue_peak = queued + 1;
+  }
+  __set_PRIMASK(primask);
   /* USER CODE END 7 */
   return result;
 }
 
 /* USER CODE BEGIN PRIVATE_FUNCTIONS_IMPLEMENTATION */
+/**
+  * @brief  Data transmission complete callback.
+  *         Called by USB device library when a transmission is finished.
+  * @param  Buf: Pointer to transmitted buffer
+  * @param  Len: Pointer to length of transmitted data
+  * @param  epnum: Endpoint number
+  * @retval USBD_OK
+  */
+static int8_t CDC_TransmitCplt_FS(uint8_t *Buf, uint32_t *Len, uint8_t epnum)
+{
+    (void)Buf;
+    (void)Len;
+    (void)epnum;
+    if (tx_head == tx_tail) return (USBD_OK);  // flushed by a bus reset
+    // Start the next queued transfer before the engine reuses this one
+    tx_head++;
+    if (tx_head != tx_tail) CDC_TxStart_FS();
+    sample_tx_complete();
+    return (USBD_OK);
+}
+
+/**
+  * @brief  Puts the transfer at the head of the transmit queue on the bus
+  * @retval USBD_OK if all operations are OK else USBD_FAIL or USBD_BUSY
+  */
+static uint8_t CDC_TxStart_FS(void)
+{
+    TxDescriptor *tx = &tx_queue[tx_head & TX_QUEUE_MASK];
+    uint8_t result = USBD_IF_SetTxBuffer(&hUsbDeviceFS, tx->buf, tx->len);
+    if (result != USBD_OK) return result;
+    return USBD_IF_TransmitPacket(&hUsbDeviceFS);
+}
+
+/**
+  * @brief  Empties the transmit queue after a bus reset. The engine is
+  *         called once per dropped transfer, as if each had completed
+  * @retval None
+  */
+static void CDC_TxFlush_FS(void)
+{
+    uint32_t dropped = tx_tail - tx_head;
+    tx_head = tx_tail;
+    while (dropped--) sample_tx_complete();
+}
 
 /* USER CODE END PRIVATE_FUNCTIONS_IMPLEMENTATION */
 
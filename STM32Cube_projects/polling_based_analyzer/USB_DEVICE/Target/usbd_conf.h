@@ -35,7 +35,9 @@
 #include "stm32f1xx_hal.h"
 
 /* USER CODE BEGIN INCLUDE */
-
+#if USB_VENDOR_CLASS
+#define USBD_SUPPORT_USER_STRING_DESC 1U   /* Microsoft OS string, see usbd_vendor.c */
+#endif
 /* USER CODE END INCLUDE */
 
 /** @addtogroup USBD_OTG_DRIVER
@@ -66,7 +68,7 @@
 /*---------- -----------*/
 #define USBD_MAX_NUM_CONFIGURATION     1
 /*---------- -----------*/
-#define USBD_MAX_STR_DESC_SIZ     512
+#define USBD_MAX_STR_DESC_SIZ     64   /* longest string descriptor in usbd_desc.c is 44 bytes */
 /*---------- -----------*/
 #define USBD_DEBUG_LEVEL     0
 /*---------- -----------*/
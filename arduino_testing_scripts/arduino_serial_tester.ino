@@ -1,54 +1,179 @@
 /* Simple program to test a serial logic analyzer; handles support for
- *  UART, SPI, and I2C connections. To run the program, set COMM_TYPE to 
- * your desired choice; ensure wiring is correct, and run the script and 
- * logic analyzer simultaneously. 
+ *  UART, SPI, and I2C connections. To run the program, set COMM_TYPE to
+ * your desired choice; ensure wiring is correct, and run the script and
+ * logic analyzer simultaneously.
  *
- * Author: Giacomo Rinaldi 
+ * As a benchmark stimulus it sends bursts of BURST_BYTES bytes every
+ * GAP_US at BIT_RATE. With PAYLOAD_SEED non-zero the bytes come from a
+ * xorshift32 generator started at that seed, so a capture can be
+ * checked byte for byte: burst k holds generator outputs
+ * k * BURST_BYTES onwards, the low byte of each. COMM_EDGES toggles the
+ * EDGE_PIN as fast as the port allows, BURST_BYTES pulses per burst,
+ * to find the analyzer's edge-rate limit. COMM_SQUARE runs steady
+ * square waves of SQUARE_HZ on SQUARE_CHANNELS pins from the timers'
+ * compare outputs, for edge_rate_benchmark.py. Every setting below can
+ * be given on the compiler command line, which is how loss_benchmark.py
+ * sweeps the rate.
+ *
+ * Author: Giacomo Rinaldi
  * Date Created: July 12, 2025
- * Last Updated: July 12, 2025 
+ * Last Updated: July 12, 2025
  */
 
 #include <Wire.h>
 #include <SPI.h>
 
-#define I2C 0
-#define SPI 1
-#define UART 2
+#define COMM_I2C 0
+#define COMM_SPI 1   // not SPI: that would hide the SPI object of SPI.h
+#define COMM_UART 2
+#define COMM_EDGES 3
+#define COMM_SQUARE 4
 
-const uint8_t COMM_TYPE = UART; // modify this according to your needs
+#ifndef COMM_TYPE
+#define COMM_TYPE COMM_UART // modify this according to your needs
+#endif
+#ifndef BIT_RATE
+#define BIT_RATE 9600UL     // UART baud, SPI SCK or I2C SCL in Hz (I2C: 31000-400000 at 16 MHz)
+#endif
+#ifndef SPI_DATA_MODE
+#define SPI_DATA_MODE SPI_MODE0
+#endif
+#ifndef BURST_BYTES
+#define BURST_BYTES 13      // bytes (COMM_EDGES: pulses) per burst
+#endif
+#ifndef GAP_US
+#define GAP_US 5000000UL    // from the start of one burst to the next; 0 = back to back
+#endif
+#ifndef PAYLOAD_SEED
+#define PAYLOAD_SEED 0UL    // 0 sends msg over and over
+#endif
+#ifndef I2C_ADDRESS
+#define I2C_ADDRESS 0x01    // no device there: the address is NACKed and no data follows
+#endif
+#ifndef EDGE_PIN
+#define EDGE_PIN 2
+#endif
+#ifndef SQUARE_HZ
+#define SQUARE_HZ 10000UL   // COMM_SQUARE: frequency of each wave, 31 Hz to 8 MHz
+#endif
+#ifndef SQUARE_CHANNELS
+#define SQUARE_CHANNELS 4   // COMM_SQUARE: waves on pins 9, 10, 11 and 3, in that order
+#endif
 
 char msg[13] = {'H', 'e', 'l', 'l', 'o', ',', ' ', 'W', 'o', 'r', 'l', 'd', '!'};
 
+uint8_t burst[BURST_BYTES];
+uint32_t prng = PAYLOAD_SEED;
+uint16_t msg_index = 0;
+uint32_t last_burst = 0;
+
+// next payload byte: xorshift32 from PAYLOAD_SEED, or the next msg character
+uint8_t next_byte() {
+  if (PAYLOAD_SEED == 0) {
+    uint8_t b = msg[msg_index];
+    msg_index = (msg_index + 1) % sizeof msg;
+    return b;
+  }
+  prng ^= prng << 13;
+  prng ^= prng >> 17;
+  prng ^= prng << 5;
+  return prng & 0xFF;
+}
+
+void send_edges() {
+  volatile uint8_t *port = portOutputRegister(digitalPinToPort(EDGE_PIN));
+  uint8_t bit = digitalPinToBitMask(EDGE_PIN);
+  uint8_t low = *port & ~bit;
+  uint8_t high = low | bit;
+
+  noInterrupts(); // an even pulse train, without timer 0 ticks in it
+  for (uint16_t i = 0; i < BURST_BYTES; i++) {
+    *port = high;
+    *port = low;
+  }
+  interrupts();
+}
+
+// Square waves on the compare outputs of timer 1 (OC1A pin 9, OC1B pin 10)
+// and timer 2 (OC2A pin 11, OC2B pin 3) in CTC toggle mode: the same
+// prescaler and TOP for both, with the B outputs a quarter period behind
+// the A outputs and timer 2 an eighth ahead of timer 1, so no two edges
+// coincide. The frequency is
+// F_CPU / (2 * prescaler * (TOP + 1)), the nearest at or above SQUARE_HZ
+void start_square() {
+  static const uint16_t prescalers[] = {1, 8, 64, 256, 1024};
+  static const uint8_t timer2_cs[] = {1, 2, 4, 6, 7};  // CS2x of those prescalers
+  static const uint8_t pins[] = {9, 10, 11, 3};
+  uint8_t p = 0;
+
+  while (p < 4 && F_CPU / (2UL * prescalers[p] * SQUARE_HZ) > 256) p++;
+  uint32_t ticks = F_CPU / (2UL * prescalers[p] * SQUARE_HZ);
+  uint8_t top = ticks ? min(ticks, 256UL) - 1 : 0;
+
+  for (uint8_t ch = 0; ch < SQUARE_CHANNELS; ch++) pinMode(pins[ch], OUTPUT);
+  GTCCR = _BV(TSM) | _BV(PSRASY) | _BV(PSRSYNC);  // hold both prescalers
+  TCCR1A = (SQUARE_CHANNELS > 0 ? _BV(COM1A0) : 0) | (SQUARE_CHANNELS > 1 ? _BV(COM1B0) : 0);
+  TCCR1B = _BV(WGM12) | (p + 1);
+  OCR1A = top;
+  OCR1B = top / 2;
+  TCNT1 = 0;
+  TCCR2A = (SQUARE_CHANNELS > 2 ? _BV(COM2A0) : 0) | (SQUARE_CHANNELS > 3 ? _BV(COM2B0) : 0) | _BV(WGM21);
+  TCCR2B = timer2_cs[p];
+  OCR2A = top;
+  OCR2B = top / 2;
+  TCNT2 = top / 4;
+  GTCCR = 0;  // both start on the same clock
+}
+
 void setup() {
+  if (COMM_TYPE == COMM_SQUARE) {
+    start_square();
+    return;
+  }
   Wire.begin();
-  Serial.begin(9600); // if using UART, change baudrate as needed 
+  if (COMM_TYPE == COMM_I2C) Wire.setClock(BIT_RATE);
+  Serial.begin(COMM_TYPE == COMM_UART ? BIT_RATE : 9600);
   SPI.begin();
   pinMode(SS, OUTPUT);
   digitalWrite(SS, HIGH);
+  pinMode(EDGE_PIN, OUTPUT);
+  digitalWrite(EDGE_PIN, LOW);
 }
 
 void loop() {
+  if (COMM_TYPE == COMM_SQUARE) return;  // the timers run the waves
+  if (GAP_US && last_burst && micros() - last_burst < GAP_US) return;
+  last_burst = micros() | 1; // 0 means no burst sent yet
+
+  if (COMM_TYPE != COMM_EDGES) {
+    for (uint16_t i = 0; i < BURST_BYTES; i++) burst[i] = next_byte();
+  }
+
   // switch for COMM_TYPE
   switch(COMM_TYPE) {
-    case 0: // Handle I2C Communication protocol
-      Wire.beginTransmission(0x01); // send to imaginary device at address 0x01
-      Wire.write(msg, 13);
-      Wire.endTransmission();
-      delay(5000); 
+    case COMM_I2C: // Handle I2C Communication protocol
+      // the Wire buffer holds 32 bytes, so longer bursts go as several transfers
+      for (uint16_t i = 0; i < BURST_BYTES; i += 31) {
+        Wire.beginTransmission(I2C_ADDRESS);
+        Wire.write(burst + i, min(31, BURST_BYTES - i));
+        Wire.endTransmission();
+      }
       break;
 
-    case 1: // Handle SPI Communication protocol
+    case COMM_SPI: // Handle SPI Communication protocol
+      SPI.beginTransaction(SPISettings(BIT_RATE, MSBFIRST, SPI_DATA_MODE));
       digitalWrite(SS, LOW);
-      for (int i=0; i<13; i++) {
-        SPI.transfer(msg[i]);
-      }
+      SPI.transfer(burst, BURST_BYTES);
       digitalWrite(SS, HIGH);
-      delay(5000);
-      break; 
+      SPI.endTransaction();
+      break;
 
-    case 2: // Handle UART Communication protocol 
-      Serial.write(msg, 13); 
-      delay(5000);
+    case COMM_UART: // Handle UART Communication protocol
+      Serial.write(burst, BURST_BYTES);
+      break;
+
+    case COMM_EDGES: // Pulse train on EDGE_PIN
+      send_edges();
       break;
   }
-}
\ No newline at end of file
+}
@@ -0,0 +1,257 @@
+"""Puts the captures of several analyzers, or of one bus taken in both
+capture modes, on one timeline and writes them as one capture the
+decoders open like any other (in python_scripts/common).
+
+  python board_merge.py <merged.lacap> <reference.lacap> <other.lacap> [...]
+                        [--align pulse|sof|start|trigger|edge:<channel>|uart:<channel>:<baud>:<byte, hex>]
+
+The others' times are moved onto the reference's clock. An interrupt
+capture counts TIM3:TIM2 ticks and a polling one DWT cycles, each at
+the rate its header gives, which already includes the correction
+clock_calibrate.py stored; the ratio of the two rates is the starting
+map, and the anchors both captures hold refine it:
+
+  pulse    the reference pulse the boards shared (BOARD_SYNC firmware,
+           see board_sync.h), the default
+  sof      the SOF pairs both recorded on the same host (SOF_SYNC_FRAMES)
+  start    the first record of each
+  trigger  the device triggers
+  edge     the first level change of a channel both captured
+  uart     the UART frames of a byte on a channel both captured (found
+           through the block summaries as capture_query.py finds them)
+
+Pulses are paired by host time, from each capture's SOF pairs: good to
+a millisecond or so, far inside a pulse period. A capture without them
+is paired pulse for pulse from the first, which holds only if both
+boards were listening before the master's first pulse. Trigger and UART
+anchors are paired with the reference's nearest, within ANCHOR_SLACK_S
+once the first pair lines them up. A least squares line through the
+paired anchor times then maps a capture's clock to the reference's:
+offset and rate, which also takes out the drift between the two
+crystals. What is left is about one tick of either clock, or one
+sample period of a polling capture; the residual is printed.
+
+The merged capture keeps every record of an interrupt reference and the
+edges and lost regions of the others, their channels numbered on after
+the reference's and named "B<n> <name>". A polling capture's samples
+become the level changes of each channel that changes, so the merged
+capture is an edge capture at the reference's rate and a decoder reads
+both modes in one pass; a channel's level before its first change is
+not known. Bytes, bus conditions and summaries a board decoded itself
+are left out: their records name a channel in 2 bits. At most
+MAX_CHANNELS channels fit."""
+import argparse
+import sys
+
+import numpy as np
+
+from capture_file import (CaptureFile, CaptureWriter, MODE_EVENTS, MODE_SAMPLES, CHANNEL_LEVELS_HIGH,
+                          CHANNEL_DROP_START, CHANNEL_DROP_END, CHANNEL_DROP_COUNT, read_blocks, level_records)
+from capture_query import find_uart_byte
+from pipeline import channel_levels, level_changes
+
+MAX_CHANNELS = CHANNEL_LEVELS_HIGH  # edge channels 0-13, the rest of the range means samples
+BOARD_CHANNELS = 4
+WRITE_CHUNK = 1 << 20
+ANCHOR_SLACK_S = 1e-3  # a trigger or UART anchor is paired with the reference's within this
+
+def host_line(capture):
+    """(slope, intercept) of host seconds against clock ticks from the
+    capture's SOF pairs, None without two timed pairs"""
+    pairs = [(clock, host) for _, clock, host in capture.syncs() if host is not None]
+    if len(pairs) < 2:
+        return None
+    clocks, hosts = np.array(pairs, dtype=np.float64).T
+    return np.polyfit(clocks, hosts, 1)
+
+def pair_pulses(reference, board):
+    """Indices (reference, board) of the pulses both captures saw"""
+    ref_times, board_times = reference.board_syncs()[0], board.board_syncs()[0]
+    ref_line, board_line = host_line(reference), host_line(board)
+    if ref_line is None or board_line is None or len(ref_times) < 2:
+        count = min(len(ref_times), len(board_times))
+        return np.arange(count), np.arange(count)
+    ref_host = np.polyval(ref_line, ref_times.astype(np.float64))
+    board_host = np.polyval(board_line, board_times.astype(np.float64))
+    half_period = np.median(np.diff(ref_host)) / 2
+    nearest = np.clip(np.searchsorted(ref_host, board_host), 1, len(ref_host) - 1)
+    nearest -= board_host - ref_host[nearest - 1] < ref_host[nearest] - board_host
+    close = np.abs(ref_host[nearest] - board_host) < half_period
+    return nearest[close], np.flatnonzero(close)
+
+def pair_anchors(reference, board, ref_times, board_times):
+    """Indices (reference, board) of the anchors within ANCHOR_SLACK_S of
+    each other once the first of each are lined up at the nominal rate"""
+    if not len(ref_times) or not len(board_times):
+        return np.empty(0, dtype=np.int64), np.empty(0, dtype=np.int64)
+    rate = reference.tick_hz / board.tick_hz
+    placed = rate * (board_times - board_times[0]).astype(np.float64) + ref_times[0]
+    if len(ref_times) == 1:
+        return np.zeros(1, dtype=np.int64), np.zeros(1, dtype=np.int64)
+    nearest = np.clip(np.searchsorted(ref_times, placed), 1, len(ref_times) - 1)
+    nearest -= placed - ref_times[nearest - 1] < ref_times[nearest] - placed
+    close = np.abs(ref_times[nearest] - placed) < ANCHOR_SLACK_S * reference.tick_hz
+    return nearest[close], np.flatnonzero(close)
+
+def first_time(capture):
+    """Time of the capture's first timed record"""
+    times = capture.records['time'][capture.records['channel'] < CHANNEL_DROP_START]
+    return times[:1]
+
+def first_change(capture, name):
+    """Time of the first level change of the channel called name"""
+    if name not in capture.names:
+        return np.empty(0, dtype=np.int64)
+    times, levels = channel_levels(capture.records, capture.names.index(name))
+    if not len(levels):
+        return times
+    return level_changes(times, levels.astype(np.int64), int(levels[0]))[0][:1]
+
+def anchors(capture, path, how):
+    """Clock times of the capture's anchors of kind how"""
+    if how == 'pulse':
+        return capture.board_syncs()[0]
+    if how == 'start':
+        return first_time(capture)
+    if how == 'trigger':
+        return np.array(capture.triggers(), dtype=np.int64)
+    kind, name, *rest = how.split(':')
+    if kind == 'edge':
+        return first_change(capture, name)
+    baud, value = rest
+    blocks = read_blocks(path)
+    if name not in capture.names or len(blocks) < len(capture.seek) or not len(capture.seek):
+        return np.empty(0, dtype=np.int64)
+    found, _ = find_uart_byte(capture, blocks[:len(capture.seek)], capture.names.index(name),
+                              capture.tick_hz / int(baud), int(value, 16))
+    return np.array(found, dtype=np.int64)
+
+def clock_map(reference, board, ref_path, board_path, how):
+    """(rate, offset, pairs, worst residual in reference ticks) of the
+    line reference ticks = rate * board ticks + offset"""
+    rate = reference.tick_hz / board.tick_hz
+    if how == 'sof':
+        ref_line, board_line = host_line(reference), host_line(board)
+        if ref_line is None or board_line is None:
+            return None
+        rate = board_line[0] / ref_line[0]
+        return rate, (board_line[1] - ref_line[1]) / ref_line[0], len(board.syncs()), 0.0
+    ref_all, board_all = anchors(reference, ref_path, how), anchors(board, board_path, how)
+    if how == 'pulse':
+        ref_at, board_at = pair_pulses(reference, board)
+    else:
+        ref_at, board_at = pair_anchors(reference, board, ref_all, board_all)
+    ref_times = ref_all[ref_at].astype(np.float64)
+    board_times = board_all[board_at].astype(np.float64)
+    if len(ref_times) == 0:
+        return None
+    if len(ref_times) > 1:
+        rate = np.polyfit(board_times - board_times[0], ref_times, 1)[0]
+    offset = np.mean(ref_times - rate * board_times)
+    residual = np.abs(ref_times - (rate * board_times + offset)).max()
+    return rate, offset, len(ref_times), residual
+
+def order_keys(records):
+    """Merge key of each record: its time, or for a note the time of
+    the record before it, kept non-decreasing so a stable sort leaves
+    each capture's own order alone"""
+    timed = records['channel'] < CHANNEL_DROP_START
+    keys = np.where(timed, records['time'], np.iinfo(np.int64).min)
+    return np.maximum.accumulate(keys) if len(keys) else keys
+
+def sample_edges(capture):
+    """A polling capture's samples as the level changes of each channel
+    that changes, with its lost regions, in time order"""
+    times, levels = level_records(capture.records)
+    parts = []
+    for ch in range(len(capture.names)):
+        bits = (levels >> ch) & 1
+        if not len(bits):
+            continue
+        change_times, change_levels = level_changes(times, bits, bits[0])
+        part = np.zeros(len(change_times), dtype=capture.records.dtype)
+        part['time'], part['channel'], part['value'] = change_times, ch, change_levels
+        parts.append(part)
+    channels = capture.records['channel']
+    parts.append(np.array(capture.records[(channels == CHANNEL_DROP_START) | (channels == CHANNEL_DROP_END) |
+                                          (channels == CHANNEL_DROP_COUNT)]))
+    records = np.concatenate(parts)
+    return records[np.argsort(order_keys(records), kind='stable')]
+
+def board_records(board, rate, offset, first_channel):
+    """The board's edges and lost regions on the reference clock, its
+    channels numbered from first_channel; (records, channel map, skipped)"""
+    if board.mode == MODE_SAMPLES:
+        source, skipped = sample_edges(board), 0
+    else:
+        channels = board.records['channel']
+        kept = (channels < BOARD_CHANNELS) | (channels == CHANNEL_DROP_START) | \
+               (channels == CHANNEL_DROP_END) | (channels == CHANNEL_DROP_COUNT)
+        source, skipped = board.records[kept], int((~kept).sum())
+    records = np.array(source)
+    used = np.unique(records['channel'][records['channel'] < CHANNEL_LEVELS_HIGH]).tolist()
+    numbers = {ch: first_channel + n for n, ch in enumerate(used)}
+    times = records['channel'] != CHANNEL_DROP_COUNT
+    records['time'][times] = np.rint(rate * records['time'][times].astype(np.float64) + offset)
+    for ch, number in numbers.items():
+        records['channel'][source['channel'] == ch] = number
+    return records, numbers, skipped
+
+def main():
+    parser = argparse.ArgumentParser(description="Merges captures onto the first one's timeline")
+    parser.add_argument("merged")
+    parser.add_argument("reference")
+    parser.add_argument("others", nargs="+")
+    parser.add_argument("--align", default="pulse",
+                        help="pulse, sof, start, trigger, edge:<channel> or uart:<channel>:<baud>:<byte, hex>")
+    args = parser.parse_args()
+    if args.align.split(':')[0] not in ('pulse', 'sof', 'start', 'trigger', 'edge', 'uart'):
+        parser.error(f"--align {args.align}: unknown anchor")
+
+    paths = [args.reference, *args.others]
+    captures = [CaptureFile(path) for path in paths]
+    for path, capture in zip(paths, captures):
+        if capture.mode not in (MODE_EVENTS, MODE_SAMPLES) or not capture.tick_hz:
+            print(f"{path}: need a capture recorded after the firmware's 'V' reply")
+            sys.exit(1)
+        if args.align == 'pulse' and not len(capture.board_syncs()[0]):
+            print(f"{path}: no reference pulses (BOARD_SYNC firmware, 'Y' command); choose another --align")
+            sys.exit(1)
+
+    reference = captures[0]
+    if reference.mode == MODE_SAMPLES:
+        records, numbers, _ = board_records(reference, 1.0, 0.0, 0)
+        names = {number: reference.names[ch] for ch, number in numbers.items()}
+    else:
+        records = np.array(reference.records)
+        names = {ch: reference.names[ch] for ch in range(BOARD_CHANNELS)}
+    parts = [records]
+    for n, (path, board) in enumerate(zip(args.others, captures[1:]), start=2):
+        fit = clock_map(reference, board, args.reference, path, args.align)
+        if fit is None:
+            print(f"{path}: no {args.align} anchor it shares with the reference capture")
+            sys.exit(1)
+        rate, offset, pairs, residual = fit
+        first_channel = max(names, default=-1) + 1
+        records, numbers, skipped = board_records(board, rate, offset, first_channel)
+        if first_channel + len(numbers) > MAX_CHANNELS:
+            print(f"{path}: more than {MAX_CHANNELS} channels in all")
+            sys.exit(1)
+        for ch, number in numbers.items():
+            names[number] = f"B{n} {board.names[ch]}"
+        ppm = (reference.tick_hz / (rate * board.tick_hz) - 1) * 1e6
+        print(f"{path}: {pairs} {args.align.split(':')[0]} anchors paired, clock {ppm:+.3f} ppm against "
+              f"the reference, worst residual {residual / reference.tick_hz * 1e9:.0f} ns"
+              + (f", {skipped} other records left out" if skipped else ""))
+        parts.append(records)
+
+    merged = np.concatenate(parts)
+    merged = merged[np.argsort(np.concatenate([order_keys(part) for part in parts]), kind='stable')]
+    writer = CaptureWriter(args.merged, MODE_EVENTS, names, reference.tick_hz)
+    for begin in range(0, len(merged), WRITE_CHUNK):
+        writer.put(merged[begin:begin + WRITE_CHUNK])
+    writer.close()
+    print(f"{len(names)} channels, {len(merged)} records written to {args.merged}")
+
+if __name__ == "__main__":
+    main()
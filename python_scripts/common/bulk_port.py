@@ -0,0 +1,231 @@
+"""Stand-in for serial.Serial when the firmware is built with
+USB_VENDOR_CLASS 1: the analyzer is then a vendor-class device with one
+bulk IN and one bulk OUT endpoint, read through libusb (pyusb) instead of
+a serial driver. Windows binds WinUSB to it on its own.
+
+Each read asks libusb for READ_SIZE bytes at once; libusb splits such a
+request into several transfers that are all queued on the host
+controller, so the device's IN packets do not wait for Python.
+
+IsoPort reads a USB_ISO_STREAM build instead: it selects alternate
+setting 1 and keeps ISO_TRANSFERS isochronous transfers queued through
+python-libusb1, which hands back each packet of a transfer on its own.
+Packets the host controller misses are gone; the stream framing reports
+them.
+
+A USB_CONTROL_EP build has a second interface whose interrupt IN
+endpoint carries the replies and telemetry records instead of the
+stream. Both ports keep a read of it pending and collect what it brings;
+take_control hands that over, and is None for a build without it.
+
+A USB_STRIPE_EPS build stripes each transfer across two or three bulk IN
+endpoints, in STRIPE_CHUNK chunks that go round the endpoints in turn
+and start again on the first one with each transfer. BulkPort then
+keeps a read of each endpoint pending and puts the chunks back in that
+order; the chunk shorter than STRIPE_CHUNK ends a transfer."""
+import queue
+import threading
+
+import usb.core
+import usb.util
+
+VENDOR_ID = 0x0483
+PRODUCT_IDS = (22337, 22338)  # USBD_PID_FS of the bulk build, and with USB_CONTROL_EP; see usbd_desc.c
+IN_EP = 0x81  # OUT is 0x01, or 0x03 with USB_IN_DOUBLE_BUFFER; read from the descriptor
+CONTROL_INTERFACE = 1
+CONTROL_EP = 0x82  # VENDOR_CTRL_EP, see usbd_vendor.h
+CONTROL_READ_SIZE = 1024  # CONTROL_QUEUE_WORDS words, the longest transfer
+STRIPE_CHUNK = 512  # VENDOR_STRIPE_CHUNK, see usbd_vendor.h
+READ_SIZE = 16384
+ISO_PACKET_SIZE = 128  # VENDOR_ISO_PACKET_SIZE, see usbd_vendor.h
+ISO_PACKETS = 32       # frames (ms) per isochronous transfer
+ISO_TRANSFERS = 4
+
+
+def find_device():
+    for product in PRODUCT_IDS:
+        dev = usb.core.find(idVendor=VENDOR_ID, idProduct=product)
+        if dev is not None:
+            return dev
+    return None
+
+
+class BulkPort:
+    take_control = None  # set when the device has the control interface
+
+    def __init__(self, timeout=1):
+        self.dev = find_device()
+        if self.dev is None:
+            raise IOError("logic analyzer (bulk build) not found")
+        self.dev.set_configuration()
+        usb.util.claim_interface(self.dev, 0)
+        config = self.dev.get_active_configuration()
+        intf = config[(0, 0)]
+        self.out_ep = usb.util.find_descriptor(
+            intf, custom_match=lambda e: usb.util.endpoint_direction(
+                e.bEndpointAddress) == usb.util.ENDPOINT_OUT).bEndpointAddress
+        self.timeout_ms = None if timeout is None else int(timeout * 1000)
+        self.pending = bytearray()
+        self.control = bytearray()
+        self.control_lock = threading.Lock()
+        if config.bNumInterfaces > CONTROL_INTERFACE:
+            usb.util.claim_interface(self.dev, CONTROL_INTERFACE)
+            self.take_control = self._take_control
+            threading.Thread(target=self._read_control, daemon=True).start()
+        stripes = sorted(e.bEndpointAddress for e in intf
+                         if usb.util.endpoint_direction(e.bEndpointAddress) == usb.util.ENDPOINT_IN)
+        if len(stripes) > 1:
+            self.chunks = [queue.Queue() for _ in stripes]
+            self.stripe = 0  # stripe of the next chunk
+            self._fill = self._fill_stripes
+            for ep, chunks in zip(stripes, self.chunks):
+                threading.Thread(target=self._read_stripe, args=(ep, chunks), daemon=True).start()
+
+    def _read_control(self):
+        """Keeps a read of the control endpoint pending, beside the
+        stream's reads. It waits without a timeout, which would drop what
+        a transfer brought so far; close ends it"""
+        while True:
+            try:
+                data = self.dev.read(CONTROL_EP, CONTROL_READ_SIZE, 0)
+            except usb.core.USBError:
+                return  # unplugged or closed
+            with self.control_lock:
+                self.control.extend(data)
+
+    def _read_stripe(self, ep, chunks):
+        """Reads one stripe's chunks in order, without a timeout: a
+        chunk cut short would put every later one out of step"""
+        while True:
+            try:
+                chunks.put(bytes(self.dev.read(ep, STRIPE_CHUNK, 0)))
+            except usb.core.USBError:
+                return  # unplugged or closed
+
+    def _fill_stripes(self, timeout_ms):
+        """Takes the next chunk in stripe order; a short one ends the
+        transfer, and the next transfer starts on the first stripe"""
+        try:
+            chunk = self.chunks[self.stripe].get(timeout=None if timeout_ms is None else timeout_ms / 1000)
+        except queue.Empty:
+            return False
+        self.pending.extend(chunk)
+        self.stripe = 0 if len(chunk) < STRIPE_CHUNK else (self.stripe + 1) % len(self.chunks)
+        return True
+
+    def _take_control(self):
+        """The control endpoint's bytes since the last call"""
+        with self.control_lock:
+            data = bytes(self.control)
+            self.control.clear()
+        return data
+
+    @property
+    def in_waiting(self):
+        return len(self.pending)
+
+    def _fill(self, timeout_ms):
+        try:
+            self.pending.extend(self.dev.read(IN_EP, READ_SIZE, timeout_ms))
+            return True
+        except usb.core.USBTimeoutError:
+            return False
+
+    def read(self, size=1):
+        """Like serial.Serial.read: up to size bytes, fewer on timeout."""
+        while len(self.pending) < size:
+            if not self._fill(self.timeout_ms) and self.timeout_ms is not None:
+                break  # timeout None blocks, as in pyserial
+        data = bytes(self.pending[:size])
+        del self.pending[:size]
+        return data
+
+    def write(self, data):
+        return self.dev.write(self.out_ep, data, self.timeout_ms)
+
+    def reset_input_buffer(self):
+        self.pending.clear()
+        while self._fill(10):
+            self.pending.clear()
+
+    def close(self):
+        if self.take_control is not None:
+            usb.util.release_interface(self.dev, CONTROL_INTERFACE)
+        usb.util.release_interface(self.dev, 0)
+        usb.util.dispose_resources(self.dev)
+
+
+class IsoPort(BulkPort):
+    def __init__(self, timeout=1):
+        import usb1
+        self.usb1 = usb1
+        self.context = usb1.USBContext()
+        self.handle = None
+        for product in PRODUCT_IDS:
+            self.handle = self.handle or self.context.openByVendorIDAndProductID(VENDOR_ID, product)
+        if self.handle is None:
+            raise IOError("logic analyzer (isochronous build) not found")
+        self.handle.claimInterface(0)
+        self.handle.setInterfaceAltSetting(0, 1)
+        setting = [s for s in self.handle.getDevice().iterSettings() if s.getAlternateSetting() == 1][0]
+        self.out_ep = [e.getAddress() for e in setting if not e.getAddress() & 0x80][0]
+        self.timeout_ms = None if timeout is None else int(timeout * 1000)
+        self.pending = bytearray()
+        self.missed = 0  # packets the host controller reported as not received
+        self.transfers = []
+        for _ in range(ISO_TRANSFERS):
+            transfer = self.handle.getTransfer(iso_packets=ISO_PACKETS)
+            transfer.setIsochronous(IN_EP, ISO_PACKETS * ISO_PACKET_SIZE, callback=self._done)
+            transfer.submit()
+            self.transfers.append(transfer)
+        self.control = bytearray()
+        if self.handle.getDevice()[0].getNumInterfaces() > CONTROL_INTERFACE:
+            self.handle.claimInterface(CONTROL_INTERFACE)
+            self.take_control = self._take_control
+            transfer = self.handle.getTransfer()
+            transfer.setInterrupt(CONTROL_EP, CONTROL_READ_SIZE, callback=self._control_done)
+            transfer.submit()
+            self.transfers.append(transfer)
+
+    def _control_done(self, transfer):
+        if transfer.getStatus() == self.usb1.TRANSFER_COMPLETED:
+            self.control.extend(transfer.getBuffer()[:transfer.getActualLength()])
+        if transfer.getStatus() != self.usb1.TRANSFER_CANCELLED:
+            transfer.submit()
+
+    def _take_control(self):
+        """The control endpoint's bytes since the last call; they come in
+        from the event handling _fill does, on this thread"""
+        data = bytes(self.control)
+        self.control.clear()
+        return data
+
+    def _done(self, transfer):
+        for status, data in transfer.iterISO():
+            if status == self.usb1.TRANSFER_COMPLETED:
+                self.pending.extend(data)
+            else:
+                self.missed += 1
+        if transfer.getStatus() != self.usb1.TRANSFER_CANCELLED:
+            transfer.submit()
+
+    def _fill(self, timeout_ms):
+        before = len(self.pending)
+        self.context.handleEventsTimeout(1 if timeout_ms is None else timeout_ms / 1000)
+        return len(self.pending) > before
+
+    def write(self, data):
+        return self.handle.bulkWrite(self.out_ep, data, self.timeout_ms or 0)
+
+    def close(self):
+        for transfer in self.transfers:
+            try:
+                transfer.cancel()
+            except self.usb1.USBError:
+                pass  # already completed
+        self.handle.setInterfaceAltSetting(0, 0)
+        if self.take_control is not None:
+            self.handle.releaseInterface(CONTROL_INTERFACE)
+        self.handle.releaseInterface(0)
+        self.handle.close()
+        self.context.close()
@@ -0,0 +1,291 @@
+"""Columnar compressed archive of a capture (in python_scripts/common).
+
+  python capture_archive.py pack <capture .lacap or .index> <archive.laarc>
+  python capture_archive.py unpack <archive.laarc> <capture.lacap>
+  python capture_archive.py info <archive.laarc>
+
+A capture's records are cut into blocks of BLOCK_RECORDS. Each block is
+stored as columns, each compressed on its own: the channel byte of every
+record in stream order, then per channel the deltas of its record times
+in the narrowest integer type that holds them, and its values. Edges of
+one channel come at steady spacings and alternate 0 and 1, so both
+columns shrink to little; the channel column, run after run of the same
+few bytes, likewise. A block decompresses without any other, and
+reading one channel decompresses only that channel's columns.
+
+Layout, little-endian:
+  header: magic b'LAARCHIV', format version, capture mode, timestamp
+    clock in Hz, codec (CODEC_*), channel name count, then the names,
+    16 bytes each as in the capture header
+  blocks, each: BLOCK_HEADER (magic b'BLCK', records, column count), its
+    seek index entry and block summary (capture_file.SEEK_DTYPE and
+    BLOCK_DTYPE, the entry's record counting from the start of the
+    capture), COLUMN_HEADER per column, then the compressed columns
+  footer: the file offset of every block (uint64), the block count
+    (uint64) and b'LAARCEND'
+The footer lets a reader go straight to any block, and the block
+summaries let it skip blocks the way capture_query.py does.
+
+Compression is zstd through the zstandard package when it is installed,
+else zlib from the standard library, larger and slower to unpack; the
+header records which, and unpacking a zstd archive needs the package."""
+import os
+import struct
+import sys
+import zlib
+
+import numpy as np
+
+from capture_file import (CaptureFile, CaptureWriter, RecordChunks, BlockIndex, RECORD_DTYPE,
+                          SEEK_DTYPE, BLOCK_DTYPE, CHANNELS, CHANNEL_DROP_START, CHANNEL_LEVELS_HIGH,
+                          MODE_SAMPLES, NAME_BYTES)
+
+try:
+    import zstandard
+except ImportError:
+    zstandard = None
+
+MAGIC = b'LAARCHIV'
+VERSION = 1
+HEADER = struct.Struct('<8sHHdHH')  # the names follow
+BLOCK_MAGIC = b'BLCK'
+BLOCK_HEADER = struct.Struct('<4sIH')
+COLUMN_HEADER = struct.Struct('<BBBqII')  # channel, kind, type, first time, values, compressed bytes
+FOOTER = struct.Struct('<Q8s')
+FOOTER_MAGIC = b'LAARCEND'
+CODEC_ZSTD = 1
+CODEC_ZLIB = 2
+ZSTD_LEVEL = 9
+ZLIB_LEVEL = 6
+BLOCK_RECORDS = 1 << 20  # records per block, 10 MB raw
+COLUMN_CHANNELS = 0  # the channel byte of every record
+COLUMN_TIMES = 1     # one channel's time deltas, the first time in the column header
+COLUMN_VALUES = 2    # one channel's values
+COLUMN_TYPES = (np.dtype('<u1'), np.dtype('<u2'), np.dtype('<u4'), np.dtype('<i4'), np.dtype('<i8'))
+
+
+def compressor(codec):
+    """compress(bytes) -> bytes of a codec"""
+    if codec == CODEC_ZSTD:
+        return zstandard.ZstdCompressor(level=ZSTD_LEVEL).compress
+    return lambda data: zlib.compress(data, ZLIB_LEVEL)
+
+
+def decompressor(codec):
+    """decompress(bytes) -> bytes of a codec"""
+    if codec == CODEC_ZSTD:
+        if zstandard is None:
+            raise ValueError("this archive is zstd-compressed: pip install zstandard")
+        return zstandard.ZstdDecompressor().decompress
+    return zlib.decompress
+
+
+def narrow(values):
+    """(type code, values) in the narrowest COLUMN_TYPES that holds them"""
+    if not len(values):
+        return 0, values.astype(COLUMN_TYPES[0])
+    low, high = int(values.min()), int(values.max())
+    for code, dtype in enumerate(COLUMN_TYPES):
+        if np.iinfo(dtype).min <= low and high <= np.iinfo(dtype).max:
+            return code, values.astype(dtype)
+
+
+def encode_block(records, compress):
+    """(column headers, compressed columns) of a block of records"""
+    channels = records['channel']
+    order = np.argsort(channels, kind='stable')
+    present, bounds = np.unique(channels[order], return_index=True)
+    bounds = np.append(bounds, len(order))
+    headers, columns = [], []
+
+    def add(channel, kind, values, first=0):
+        code, values = narrow(values)
+        data = compress(values.tobytes())
+        headers.append(COLUMN_HEADER.pack(channel, kind, code, first, len(values), len(data)))
+        columns.append(data)
+
+    add(0, COLUMN_CHANNELS, channels)
+    for channel, begin, end in zip(present.tolist(), bounds[:-1].tolist(), bounds[1:].tolist()):
+        times = records['time'][order[begin:end]]
+        add(channel, COLUMN_TIMES, np.diff(times), int(times[0]))
+        add(channel, COLUMN_VALUES, records['value'][order[begin:end]])
+    return headers, columns
+
+
+def pack(source, path, block_records=BLOCK_RECORDS):
+    """Archives a capture or rotated capture index; (records, blocks)"""
+    reader = RecordChunks(source, count=block_records)
+    codec = CODEC_ZSTD if zstandard is not None else CODEC_ZLIB
+    compress = compressor(codec)
+    index = BlockIndex(reader.mode, range(CHANNELS[2] if reader.mode == MODE_SAMPLES else CHANNEL_LEVELS_HIGH))
+    names = [name.encode()[:NAME_BYTES].ljust(NAME_BYTES, b'\0') for name in reader.names]
+    offsets, total = [], 0
+    with open(path, 'wb') as f:
+        f.write(HEADER.pack(MAGIC, VERSION, reader.mode, reader.tick_hz, codec, len(names)) + b''.join(names))
+        for records in reader:
+            timed = np.flatnonzero(records['channel'] < CHANNEL_DROP_START)
+            index.put(records)
+            entry, summary = index.close(int(records['time'][timed[0]]) if len(timed) else 0)
+            entry['record'] = total
+            headers, columns = encode_block(records, compress)
+            offsets.append(f.tell())
+            f.write(BLOCK_HEADER.pack(BLOCK_MAGIC, len(records), len(headers)))
+            f.write(entry.tobytes() + summary.tobytes() + b''.join(headers) + b''.join(columns))
+            total += len(records)
+        f.write(np.array(offsets, dtype='<u8').tobytes() + FOOTER.pack(len(offsets), FOOTER_MAGIC))
+    return total, len(offsets)
+
+
+class Archive:
+    """An archive opened for reading: mode, names and tick_hz as in a
+    CaptureFile, and for every block its seek entry and summary
+    (seek, summaries), read from the block headers alone"""
+
+    def __init__(self, path):
+        self.f = open(path, 'rb')
+        magic, version, self.mode, self.tick_hz, codec, count = HEADER.unpack(self.f.read(HEADER.size))
+        if magic != MAGIC:
+            raise ValueError(f"{path}: not a capture archive")
+        if version > VERSION:
+            raise ValueError(f"{path}: archive format v{version}, this script reads v{VERSION}")
+        names = self.f.read(count * NAME_BYTES)
+        self.names = [names[i:i + NAME_BYTES].rstrip(b'\0').decode() or f"CH{i // NAME_BYTES + 1}"
+                      for i in range(0, len(names), NAME_BYTES)]
+        self.decompress = decompressor(codec)
+        self.f.seek(-FOOTER.size, 2)
+        blocks, magic = FOOTER.unpack(self.f.read(FOOTER.size))
+        if magic != FOOTER_MAGIC:
+            raise ValueError(f"{path}: archive cut short, no block directory")
+        self.f.seek(-FOOTER.size - 8 * blocks, 2)
+        self.offsets = np.frombuffer(self.f.read(8 * blocks), dtype='<u8')
+        heads = [self._head(k) for k in range(blocks)]
+        self.seek = np.array([entry for entry, _, _ in heads], dtype=SEEK_DTYPE)
+        self.summaries = np.array([summary for _, summary, _ in heads], dtype=BLOCK_DTYPE)
+        self.counts = [count for _, _, count in heads]
+
+    def __len__(self):
+        return len(self.offsets)
+
+    def close(self):
+        self.f.close()
+
+    def _head(self, k):
+        self.f.seek(int(self.offsets[k]))
+        magic, count, columns = BLOCK_HEADER.unpack(self.f.read(BLOCK_HEADER.size))
+        if magic != BLOCK_MAGIC:
+            raise ValueError(f"block {k}: bad magic")
+        entry = np.frombuffer(self.f.read(SEEK_DTYPE.itemsize), dtype=SEEK_DTYPE)[0]
+        summary = np.frombuffer(self.f.read(BLOCK_DTYPE.itemsize), dtype=BLOCK_DTYPE)[0]
+        return entry, summary, count
+
+    def _columns(self, k, wanted):
+        """{(channel, kind): (first time, values)} of block k's columns
+        that wanted((channel, kind)) picks; the others are not unpacked"""
+        self.f.seek(int(self.offsets[k]))
+        _, count, columns = BLOCK_HEADER.unpack(self.f.read(BLOCK_HEADER.size))
+        self.f.seek(SEEK_DTYPE.itemsize + BLOCK_DTYPE.itemsize, 1)
+        headers = [COLUMN_HEADER.unpack(self.f.read(COLUMN_HEADER.size)) for _ in range(columns)]
+        found = {}
+        for channel, kind, code, first, values, size in headers:
+            if not wanted((channel, kind)):
+                self.f.seek(size, 1)
+                continue
+            data = self.decompress(self.f.read(size))
+            found[channel, kind] = first, np.frombuffer(data, dtype=COLUMN_TYPES[code], count=values)
+        return found
+
+    @staticmethod
+    def _times(first, deltas):
+        times = np.empty(len(deltas) + 1, dtype=np.int64)
+        times[0] = first
+        np.cumsum(deltas, out=times[1:], dtype=np.int64)
+        times[1:] += first
+        return times
+
+    def block(self, k):
+        """The records of block k, as the capture held them"""
+        columns = self._columns(k, lambda key: True)
+        channels = columns.pop((0, COLUMN_CHANNELS))[1].astype(np.uint8)
+        records = np.empty(len(channels), dtype=RECORD_DTYPE)
+        records['channel'] = channels
+        order = np.argsort(channels, kind='stable')
+        present, bounds = np.unique(channels[order], return_index=True)
+        bounds = np.append(bounds, len(order))
+        for channel, begin, end in zip(present.tolist(), bounds[:-1].tolist(), bounds[1:].tolist()):
+            at = order[begin:end]
+            records['time'][at] = self._times(*columns[channel, COLUMN_TIMES])
+            records['value'][at] = columns[channel, COLUMN_VALUES][1]
+        return records
+
+    def channel(self, k, channel):
+        """(times, values) arrays of one record channel in block k,
+        unpacking only its two columns"""
+        columns = self._columns(k, lambda key: key[0] == channel and key[1] != COLUMN_CHANNELS)
+        if (channel, COLUMN_TIMES) not in columns:
+            return np.empty(0, dtype=np.int64), np.empty(0, dtype=np.uint8)
+        return self._times(*columns[channel, COLUMN_TIMES]), columns[channel, COLUMN_VALUES][1].astype(np.uint8)
+
+    def __iter__(self):
+        for k in range(len(self)):
+            yield self.block(k)
+
+    def window(self, start, end=None):
+        """The blocks that can hold records from start to end (ticks; None
+        for the end) as a CaptureFile, found as CaptureFile.window does"""
+        times = np.maximum.accumulate(self.seek['time'])
+        first = max(int(np.searchsorted(times, start, side='right')) - 1, 0)
+        after = int(np.searchsorted(times, end, side='right')) if end is not None else len(self)
+        return self.capture(first, max(after, first + 1))
+
+    def capture(self, first=0, after=None):
+        """Blocks first to after - 1 as a CaptureFile in memory, with the
+        levels before the first, for the decoder core"""
+        after = len(self) if after is None else after
+        parts = [self.block(k) for k in range(first, after)]
+        records = np.concatenate(parts) if parts else np.empty(0, dtype=RECORD_DTYPE)
+        seek = self.seek[first:after].copy()
+        seek['record'] -= int(self.seek['record'][first]) if first < len(self) else 0
+        levels, known = (int(self.seek['levels'][first]), int(self.seek['known'][first])) \
+            if first < len(self) else (0, 0)
+        return CaptureFile.from_records(records, self.mode, self.names, self.tick_hz, seek, levels, known)
+
+
+def unpack(path, capture_path):
+    """Writes an archive back out as a capture; the records come back bit
+    for bit"""
+    archive = Archive(path)
+    writer = CaptureWriter(capture_path, archive.mode, dict(enumerate(archive.names)), archive.tick_hz)
+    for records in archive:
+        writer.put(records)
+    writer.close()
+    archive.close()
+
+
+def main():
+    if len(sys.argv) < 3 or sys.argv[1] not in ('pack', 'unpack', 'info') \
+            or len(sys.argv) != (3 if sys.argv[1] == 'info' else 4):
+        print("Usage: python capture_archive.py pack <capture .lacap or .index> <archive.laarc>")
+        print("       python capture_archive.py unpack <archive.laarc> <capture.lacap>")
+        print("       python capture_archive.py info <archive.laarc>")
+        sys.exit(1)
+    if sys.argv[1] == 'pack':
+        records, blocks = pack(sys.argv[2], sys.argv[3])
+        size = records * RECORD_DTYPE.itemsize
+        packed = os.path.getsize(sys.argv[3])
+        print(f"{records} records in {blocks} blocks, {size / 1e6:.1f} MB -> {packed / 1e6:.1f} MB "
+              f"({size / max(packed, 1):.1f}x)")
+    elif sys.argv[1] == 'unpack':
+        unpack(sys.argv[2], sys.argv[3])
+    else:
+        archive = Archive(sys.argv[2])
+        print(f"{len(archive)} blocks, {sum(archive.counts)} records, channels {', '.join(archive.names)}, "
+              f"{archive.tick_hz:.0f} Hz")
+        for k, (entry, summary) in enumerate(zip(archive.seek, archive.summaries)):
+            changes = ' '.join(f"{name}:{summary['changes'][ch]}" for ch, name in enumerate(archive.names)
+                               if ch < len(summary['changes']) and summary['changes'][ch])
+            print(f"  block {k}: from {entry['time']}, {archive.counts[k]} records, changes {changes}")
+        archive.close()
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,195 @@
+"""Apache Arrow and Parquet tables of a capture, for analysis notebooks
+(in python_scripts/common; needs pyarrow, `pip install pyarrow`).
+
+  python capture_arrow.py <capture> edges <out.parquet|out.arrow>
+  python capture_arrow.py <capture> frames uart|spi|i2c <channels> <out.parquet|out.arrow> [baud]
+
+The capture may be a capture file, a rotated capture's index or an
+archive (capture_archive.py). Two tables come out of it:
+  edges   time (int64 ticks), channel (dictionary of the channel names),
+          level (uint8): every level change of every named channel in
+          time order, poll samples reduced to their changes
+  frames  time, kind (dictionary: byte, start, stop, address, data,
+          lost) and the event's fields as nullable columns, see
+          FRAME_FIELDS: what the chunked decoders (pipeline.ChunkDecoder)
+          make of one bus, lines given comma separated in their order,
+          '-' for a missing one (RX / CLK,MOSI,MISO,SS / SCL,SDA)
+The capture's clock, mode and channel names go into the schema metadata.
+
+Capture records are stored row after row, so turning them into columns
+is one copy, made once here, block by block. Batches are cut at the
+capture's seek index entries (an archive's blocks), grouped to about
+ROW_GROUP_RECORDS records, and each becomes one Parquet row group or one
+Arrow IPC record batch: a time range in the capture is a run of whole
+groups. A Parquet file keeps each group's time range in its statistics,
+so read_range(path, start, end) with pyarrow's filters reads only the
+groups that overlap it. An .arrow file (Arrow IPC, uncompressed) is
+memory-mapped by open_table: its columns are the file's pages with no
+copy and no parse, and read_range picks the batches of a range from
+their first and last times without reading the others."""
+import sys
+
+import numpy as np
+import pyarrow as pa
+import pyarrow.ipc
+import pyarrow.parquet as pq
+
+from capture_file import (CaptureFile, RecordChunks, INDEX_SUFFIX, CHANNEL_LEVELS_HIGH, is_capture_file,
+                          index_segments)
+from pipeline import ChunkDecoder, channel_levels, level_changes, merge_lines
+
+ROW_GROUP_RECORDS = 1 << 20  # capture records per row group or batch, at least, where the seek index allows
+EVENT_KINDS = ['byte', 'start', 'stop', 'address', 'data', 'lost']
+FRAME_FIELDS = {  # the fields after the time of each decoder's events, as columns
+    'uart': {'byte': ('value',)},
+    'spi': {'byte': ('mosi', 'miso'), 'lost': ('bits',)},
+    'i2c': {'start': ('repeated',), 'address': ('value', 'read', 'ack'), 'data': ('value', 'ack')},
+}
+
+
+def aligned_chunks(path, count=ROW_GROUP_RECORDS):
+    """RECORD_DTYPE chunks of a capture, rotated capture or archive, cut
+    at seek index entries (an archive at its blocks) once at least count
+    records are in hand; a capture without a seek index is cut every
+    count records"""
+    if not is_capture_file(path):
+        yield from RecordChunks(path, count=count)
+        return
+    for segment in index_segments(path) if path.endswith(INDEX_SUFFIX) else [path]:
+        capture = CaptureFile(segment)
+        cuts = capture.seek['record'].tolist() if len(capture.seek) else \
+            list(range(count, len(capture.records), count))
+        begin = 0
+        for cut in cuts + [len(capture.records)]:
+            if cut - begin >= count or cut == len(capture.records) and cut > begin:
+                yield capture.records[begin:cut]
+                begin = cut
+
+
+def _metadata(reader):
+    return {b'tick_hz': str(reader.tick_hz).encode(), b'mode': str(reader.mode).encode(),
+            b'names': ",".join(reader.names).encode()}
+
+
+def edge_batches(path):
+    """(schema, iterator of record batches) of the edges table"""
+    reader = RecordChunks(path)
+    channels = [ch for ch, name in enumerate(reader.names) if name and ch < CHANNEL_LEVELS_HIGH]
+    names = pa.array([reader.names[ch] for ch in channels], pa.string())
+    schema = pa.schema([('time', pa.int64()), ('channel', pa.dictionary(pa.int8(), pa.string())),
+                        ('level', pa.uint8())], metadata=_metadata(reader))
+    levels = {ch: -1 for ch in channels}  # -1: the first record is a change
+
+    def batches():
+        for records in aligned_chunks(path):
+            lines = []
+            for ch in channels:
+                times, changes = level_changes(*channel_levels(records, ch), levels[ch])
+                if len(changes):
+                    levels[ch] = int(changes[-1])
+                lines.append((times, changes))
+            times, line, level = merge_lines(*lines)
+            yield pa.record_batch([pa.array(times, pa.int64()),
+                                   pa.DictionaryArray.from_arrays(pa.array(line.astype(np.int8)), names),
+                                   pa.array(level.astype(np.uint8))], schema=schema)
+    return schema, batches()
+
+
+def frame_batches(path, protocol, lines, baud=None):
+    """(schema, iterator of record batches) of the frames table of one
+    bus, lines the channel numbers as decode_chunks takes them"""
+    reader = RecordChunks(path)
+    if protocol == 'uart' and not (reader.tick_hz and baud):
+        raise ValueError("UART needs the capture's clock and the baud rate")
+    fields = sorted({field for kinds in FRAME_FIELDS[protocol].values() for field in kinds})
+    kinds = pa.array(EVENT_KINDS, pa.string())
+    schema = pa.schema([('time', pa.int64()), ('kind', pa.dictionary(pa.int8(), pa.string()))]
+                       + [(field, pa.int16()) for field in fields], metadata=_metadata(reader))
+    decoder = ChunkDecoder(protocol, lines, reader.tick_hz / baud if baud else None)
+
+    def batches():
+        for records in aligned_chunks(path):
+            events = list(decoder.events(records))
+            columns = {field: [None] * len(events) for field in fields}
+            for i, event in enumerate(events):
+                for field, value in zip(FRAME_FIELDS[protocol].get(event[0], ()), event[2:]):
+                    columns[field][i] = None if value is None else int(value)
+            kind = np.array([EVENT_KINDS.index(event[0]) for event in events], dtype=np.int8)
+            yield pa.record_batch([pa.array([event[1] for event in events], pa.int64()),
+                                   pa.DictionaryArray.from_arrays(pa.array(kind), kinds)]
+                                  + [pa.array(columns[field], pa.int16()) for field in fields], schema=schema)
+    return schema, batches()
+
+
+def write_table(schema, batches, out):
+    """Writes the batches to out, one Parquet row group each for a
+    .parquet file, one record batch each of an Arrow IPC file otherwise;
+    returns the rows written"""
+    rows = 0
+    if out.endswith(".parquet"):
+        with pq.ParquetWriter(out, schema) as writer:
+            for batch in batches:
+                writer.write_table(pa.Table.from_batches([batch], schema), row_group_size=max(len(batch), 1))
+                rows += len(batch)
+        return rows
+    with pa.ipc.new_file(out, schema) as writer:
+        for batch in batches:
+            writer.write_batch(batch)
+            rows += len(batch)
+    return rows
+
+
+def open_table(path):
+    """The table in an .arrow file, memory-mapped (no copy), or read from
+    a .parquet file"""
+    if path.endswith(".parquet"):
+        return pq.read_table(path, memory_map=True)
+    return pa.ipc.open_file(pa.memory_map(path)).read_all()
+
+
+def read_range(path, start, end):
+    """Rows of a table file with start <= time < end (ticks): for Parquet
+    through the row group statistics, for Arrow IPC the mapped batches
+    whose first and last times overlap the range, cut to it"""
+    if path.endswith(".parquet"):
+        return pq.read_table(path, filters=[('time', '>=', start), ('time', '<', end)], memory_map=True)
+    reader = pa.ipc.open_file(pa.memory_map(path))
+    parts = []
+    for i in range(reader.num_record_batches):
+        batch = reader.get_batch(i)
+        times = batch.column(0)
+        if not len(batch) or times[len(batch) - 1].as_py() < start or times[0].as_py() >= end:
+            continue
+        values = times.to_numpy()  # a view of the mapped file
+        first, last = np.searchsorted(values, start), np.searchsorted(values, end)
+        parts.append(batch.slice(first, last - first))
+    return pa.Table.from_batches(parts, reader.schema)
+
+
+def main():
+    usage = ("Usage: python capture_arrow.py <capture> edges <out.parquet|out.arrow>\n"
+             "       python capture_arrow.py <capture> frames uart|spi|i2c <channels> <out.parquet|out.arrow> [baud]")
+    args = sys.argv[1:]
+    if len(args) == 3 and args[1] == 'edges':
+        schema, batches = edge_batches(args[0])
+        out = args[2]
+    elif len(args) in (5, 6) and args[1] == 'frames' and args[2] in FRAME_FIELDS:
+        names = RecordChunks(args[0]).names
+        wanted = [name.strip().upper() for name in args[3].split(",")]
+        missing = [name for name in wanted if name != '-' and name not in names]
+        if missing:
+            print(f"Channel {missing[0]} not in the capture, which has {', '.join(names)}")
+            sys.exit(1)
+        lines = tuple(None if name == '-' else names.index(name) for name in wanted)
+        lines += (None,) * ({'uart': 1, 'spi': 4, 'i2c': 2}[args[2]] - len(lines))
+        schema, batches = frame_batches(args[0], args[2], lines, int(args[5]) if len(args) > 5 else None)
+        out = args[4]
+    else:
+        print(usage)
+        sys.exit(1)
+    rows = write_table(schema, batches, out)
+    print(f"{rows} rows written to {out}")
+
+
+if __name__ == "__main__":
+    main()
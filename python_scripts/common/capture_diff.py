@@ -0,0 +1,282 @@
+"""Compares two captures of the same traffic, e.g. before and after a
+firmware update of the device under test, and reports where they first
+diverge (in python_scripts/common).
+
+  python capture_diff.py <a> <b> [--align start|trigger|uart:<channel>:<baud>:<byte, hex>]
+                         [--tolerance <us>] [--decode uart:<ch>:<baud>|spi:<clk>:<mosi>:<miso>[:<ss>]|i2c:<scl>:<sda>]
+                         [--all]
+
+B's times are put on A's clock at an anchor both captures hold: their
+first record (start), the first device trigger (trigger), or the first
+UART frame of a byte on a channel (found through the block summaries
+as capture_query.py finds it). Channels are paired by name.
+
+A is then walked block by block of its seek index (about 100k records
+each). Each block's level changes per channel are set against the next
+changes of the same channel in B's window around the same time, all at
+once with numpy: the same levels in the same order, each within
+--tolerance of A's. A block that agrees costs two slices of the mapped
+files and nothing is decoded. The offset follows the median time
+difference of each agreeing block, so the drift between two crystals
+over a long capture stays inside the tolerance.
+
+At the first block that disagrees, the change that differs is printed
+with each channel's timing envelope over the block: change count and
+the shortest and longest high and low pulse, A's from its block
+summary (capture_file.BlockIndex) and B's from its window. With
+--decode the block is decoded in both captures with the decoder core and
+the first frame that differs is printed, or the difference is reported
+as timing only. --all goes on to list every block that disagrees.
+Captures without block summaries need `python capture_query.py <capture>
+index` first."""
+import argparse
+import sys
+
+import numpy as np
+
+from capture_file import NO_PULSE
+from capture_query import find_uart_byte, open_segment
+from decoder_core import capture_index, decode
+from pipeline import channel_levels, level_changes
+
+TOLERANCE_US = 1.0  # default largest time difference of a matching change
+DECODE_CONTEXT = 1  # blocks decoded before the one that differs, for the frame in progress
+
+
+def changes(records, ch, before):
+    """(times, levels) of a channel's level changes in records, before
+    the level ahead of them, None to take the first level seen"""
+    times, levels = channel_levels(records, ch)
+    levels = levels.astype(np.int64)
+    if before is None:
+        before = int(levels[0]) if len(levels) else 0
+    return level_changes(times, levels, before)
+
+
+def known_level(cut, ch):
+    """The level of a channel before a cut's first record, None if unknown"""
+    return cut.levels >> ch & 1 if ch < 16 and cut.known >> ch & 1 else None
+
+
+def envelope(times, levels, since):
+    """(changes, (shortest, longest) low, (shortest, longest) high) of the
+    pulses ending at these changes, since the time of the change before"""
+    starts = np.concatenate([[since], times[:-1]]) if len(times) else times
+    widths = times - starts
+    ended = 1 - levels
+    out = [len(times)]
+    for level in (0, 1):
+        pulses = widths[(starts >= 0) & (ended == level)]
+        out.append((int(pulses.min()), int(pulses.max())) if len(pulses) else NO_PULSE)
+    return out
+
+
+def anchor(capture, blocks, how):
+    """A's or B's time of the alignment point, None if it has none"""
+    if how == 'start':
+        return int(capture.seek['time'][0])
+    if how == 'trigger':
+        triggers = capture.triggers()
+        return int(triggers[0]) if triggers else None
+    _, name, baud, value = how.split(':')
+    if name not in capture.names:
+        return None
+    found, _ = find_uart_byte(capture, blocks, capture.names.index(name), capture.tick_hz / int(baud),
+                              int(value, 16))
+    return int(found[0]) if found else None
+
+
+class Side:
+    """One capture being walked: per compared channel its level after the
+    records walked and the time of its last change compared so far"""
+
+    def __init__(self, path):
+        self.capture, self.blocks = open_segment(path)
+
+    def pair(self, names, anchor_time):
+        """Compares the channels called names, from anchor_time on"""
+        self.channels = [self.capture.names.index(name) for name in names]
+        self.level = [None] * len(names)
+        self.last = [anchor_time - 1] * len(names)
+
+    def active(self, names):
+        """Which of the channels called names change in the capture, by
+        the block summaries"""
+        changes = self.blocks['changes'].sum(axis=0)
+        return [bool(changes[self.capture.names.index(name)]) for name in names]
+
+
+def compare_block(a, b, block, to_b, tolerance):
+    """Compares A's block with B's window around it. Returns the
+    divergence, (A time, channel index, text) or None, and per channel
+    (A times, B times) of the changes paired and (A levels, B levels) of
+    the changes compared"""
+    first = int(a.capture.seek['time'][block])
+    after = int(a.capture.seek['time'][block + 1]) if block + 1 < len(a.blocks) else None
+    cut_a = a.capture.blocks(block, block + 1)
+    cut_b = b.capture.window(to_b(first) - tolerance, None if after is None else to_b(after) + tolerance)
+    found = None
+    matched = []
+    for k, (ch_a, ch_b) in enumerate(zip(a.channels, b.channels)):
+        level_a = a.level[k] if a.level[k] is not None else known_level(cut_a, ch_a)
+        times_a, levels_a = changes(cut_a.records, ch_a, level_a)
+        times_b, levels_b = changes(cut_b.records, ch_b, known_level(cut_b, ch_b))  # B's window overlaps
+        if len(levels_a):
+            a.level[k] = int(levels_a[-1])
+        elif level_a is not None:
+            a.level[k] = level_a
+        later = times_a > a.last[k]
+        times_a, levels_a = times_a[later], levels_a[later]
+        later = times_b > b.last[k]
+        times_b, levels_b = times_b[later], levels_b[later]
+        if after is not None:
+            times_b, levels_b = times_b[:len(times_a)], levels_b[:len(times_a)]
+        n = min(len(times_a), len(times_b))
+        deltas = to_b(times_a[:n]) - times_b[:n] if n else np.empty(0)
+        bad = np.flatnonzero((levels_a[:n] != levels_b[:n]) | (np.abs(deltas) > tolerance))
+        if len(bad):
+            j = int(bad[0])
+            text = (f"A goes {'high' if levels_a[j] else 'low'}, B goes {'high' if levels_b[j] else 'low'}"
+                    if levels_a[j] != levels_b[j] else f"B is {-deltas[j]:+.0f} ticks off")
+            where = (int(times_a[j]), k, text)
+        elif len(times_a) > n:
+            where = (int(times_a[n]), k, f"B lacks this change and {len(times_a) - n - 1} more")
+        elif len(times_b) > n:
+            where = (first, k, f"B has {len(times_b) - n} changes past A's end")
+        else:
+            where = None
+        if where is not None and (found is None or where[0] < found[0]):
+            found = where
+        matched.append((times_a[:n], times_b[:n], levels_a, levels_b))
+        if len(times_a):
+            a.last[k] = int(times_a[-1])
+        if n:
+            b.last[k] = int(times_b[n - 1])
+    return found, matched
+
+
+def decoded(capture, first, after, spec, start, end):
+    """(time, frame) of the frames of spec ('uart', 'spi' or 'i2c' and
+    the channel names) that start from start to end, the frame being the
+    decoder's event without its time"""
+    protocol, *names = spec
+    cut = capture.blocks(max(first - DECODE_CONTEXT, 0), after)
+    if protocol == 'uart':
+        options = {'channel': names[0], 'bit_time': capture.tick_hz / int(names[1])}
+        names = names[:1]
+    elif protocol == 'spi':
+        options = dict(zip(('clk', 'mosi', 'miso', 'ss'), names))
+    else:
+        options = dict(zip(('scl', 'sda'), names))
+    events = decode(capture_index(cut, names), protocol, **options)
+    return [(event[1], (event[0],) + tuple(event[2:])) for event in events
+            if start <= event[1] and (end is None or event[1] < end)]
+
+
+def report(a, b, block, found, matched, to_b, to_a, decode_spec, names):
+    tick_hz = a.capture.tick_hz
+    us = lambda ticks: f"{ticks * 1e6 / tick_hz:.2f}" if 0 <= ticks < NO_PULSE[0] else "-"
+    at, k, text = found
+    print(f"Block {block} of {len(a.blocks)}: {names[k]} at {at / tick_hz:.6f} s in A "
+          f"({to_b(at) / b.capture.tick_hz:.6f} s in B): {text}")
+    print(f"  {'channel':<10} {'changes A/B':>12} {'low us A':>18} {'low us B':>18} {'high us A':>18} "
+          f"{'high us B':>18}")
+    summary = a.blocks[block]
+    for k, (ch_a, (_, times_b, _, levels_b)) in enumerate(zip(a.channels, matched)):
+        count_b, low_b, high_b = envelope(np.asarray(to_a(times_b), np.int64), levels_b[:len(times_b)],
+                                          int(summary['since'][ch_a]))
+        cells = [f"{us(pulses[0])}-{us(pulses[1])}" for pulses in
+                 (summary['low'][ch_a], low_b, summary['high'][ch_a], high_b)]
+        print(f"  {names[k]:<10} {int(summary['changes'][ch_a]):>5}/{count_b:<6} "
+              + " ".join(f"{cell:>18}" for cell in cells))
+    if decode_spec is None:
+        return
+    first = int(a.capture.seek['time'][block])
+    after = int(a.capture.seek['time'][block + 1]) if block + 1 < len(a.blocks) else None
+    frames_a = decoded(a.capture, block, block + 1, decode_spec, first, after)
+    b_first = max(int(np.searchsorted(np.maximum.accumulate(b.capture.seek['time']), to_b(first),
+                                      side='right')) - 1, 0)
+    b_after = (int(np.searchsorted(np.maximum.accumulate(b.capture.seek['time']), to_b(after), side='right'))
+               if after is not None else len(b.blocks))
+    frames_b = decoded(b.capture, b_first, max(b_after, b_first + 1), decode_spec, to_b(first),
+                       None if after is None else to_b(after))
+    for j, ((t_a, frame_a), (t_b, frame_b)) in enumerate(zip(frames_a, frames_b)):
+        if frame_a != frame_b:
+            print(f"  frame {j} of the block differs: A {frame_a} at {t_a / tick_hz:.6f} s, "
+                  f"B {frame_b} at {t_b / b.capture.tick_hz:.6f} s")
+            return
+    if len(frames_a) != len(frames_b):
+        print(f"  A decodes {len(frames_a)} frames in the block, B {len(frames_b)}")
+    else:
+        print(f"  the {len(frames_a)} decoded frames are the same: the difference is timing only")
+
+
+def arguments():
+    parser = argparse.ArgumentParser(description="Find where two captures of the same traffic diverge")
+    parser.add_argument("a", help="reference capture")
+    parser.add_argument("b", help="capture compared with it")
+    parser.add_argument("--align", default="start",
+                        help="start, trigger or uart:<channel>:<baud>:<byte, hex> (default start)")
+    parser.add_argument("--tolerance", type=float, default=TOLERANCE_US,
+                        help=f"largest time difference of a matching change in us (default {TOLERANCE_US})")
+    parser.add_argument("--decode", help="compare decoded frames where the edges differ: uart:<ch>:<baud>, "
+                                         "spi:<clk>:<mosi>:<miso>[:<ss>] or i2c:<scl>:<sda>")
+    parser.add_argument("--all", action="store_true", help="list every block that differs, not only the first")
+    args = parser.parse_args()
+    if args.align not in ('start', 'trigger') and not (args.align.startswith('uart:')
+                                                        and len(args.align.split(':')) == 4):
+        parser.error(f"--align {args.align}: use start, trigger or uart:<channel>:<baud>:<byte, hex>")
+    if args.decode:
+        args.decode = args.decode.split(':')
+        if args.decode[0] not in ('uart', 'spi', 'i2c'):
+            parser.error(f"--decode {args.decode[0]}: use uart, spi or i2c")
+    return args
+
+
+def main():
+    args = arguments()
+    a, b = Side(args.a), Side(args.b)
+    if not a.capture.tick_hz or not b.capture.tick_hz:
+        print("A capture's clock is unknown, so the two cannot be put on one time line")
+        sys.exit(1)
+    names = [name for name in a.capture.names if name in b.capture.names and not name.startswith("CH")]
+    names = [name for name, on_a, on_b in zip(names, a.active(names), b.active(names)) if on_a or on_b]
+    if not names:
+        print("The captures share no named channel with changes")
+        sys.exit(1)
+
+    anchor_a, anchor_b = anchor(a.capture, a.blocks, args.align), anchor(b.capture, b.blocks, args.align)
+    if anchor_a is None or anchor_b is None:
+        print(f"--align {args.align}: not found in {'A' if anchor_a is None else 'B'}")
+        sys.exit(1)
+    a.pair(names, anchor_a)
+    b.pair(names, anchor_b)
+    rate = b.capture.tick_hz / a.capture.tick_hz
+    offset = [float(anchor_b)]  # B's time of anchor_a, moved along with the drift
+    to_b = lambda t: (np.asarray(t, np.float64) - anchor_a) * rate + offset[0]
+    to_a = lambda t: (np.asarray(t, np.float64) - offset[0]) / rate + anchor_a
+    tolerance = args.tolerance * b.capture.tick_hz / 1e6
+    print(f"Comparing {', '.join(names)}, aligned at {args.align}: A {anchor_a / a.capture.tick_hz:.6f} s, "
+          f"B {anchor_b / b.capture.tick_hz:.6f} s")
+
+    start = max(int(np.searchsorted(np.maximum.accumulate(a.capture.seek['time']), anchor_a, side='right')) - 1, 0)
+    same = differ = 0
+    for block in range(start, len(a.blocks)):
+        found, matched = compare_block(a, b, block, to_b, tolerance)
+        if found is None:
+            same += 1
+            deltas = np.concatenate([times_b - to_b(times_a) for times_a, times_b, _, _ in matched])
+            if len(deltas):
+                offset[0] += float(np.median(deltas))  # follows the drift between the clocks
+            continue
+        differ += 1
+        report(a, b, block, found, matched, to_b, to_a, args.decode, names)
+        if not args.all:
+            break
+    checked = same + differ
+    print(f"{same} of {checked} blocks compared the same"
+          + ("" if differ or checked < len(a.blocks) - start else ": the captures match"))
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,1156 @@
+"""Binary capture container (bitlog.lacap) written by the plotters and
+opened by the decoders; `python capture_file.py <capture> <csv>` exports
+it to the CSV layout the plotters used to write, and
+`python capture_file.py import <csv> [capture]` converts such a CSV back
+(default <csv>.lacap, which the decoders then map instead; see
+read_csv), and `python capture_file.py recover <capture>` repairs one a
+crash cut short (see recover()).
+
+Layout, little-endian:
+  header, HEADER_SIZES[version] bytes: magic b'LACAPTUR', format
+    version, mode (MODE_EVENTS or MODE_SAMPLES), timestamp clock in Hz (0
+    if unknown), CHANNELS[version] 16-byte NUL-padded UTF-8 channel names,
+    zero padding, its last 8 bytes JOURNAL_MAGIC in a journaled capture.
+    Version 1 names four channels; a capture naming any channel past CH4
+    (POLL_CHANNELS firmware) is written as version 2, which names sixteen
+  records: RECORD_DTYPE, back to back up to the end of the file
+
+A record is time(8) channel(1) value(1):
+  channel 0-13     edge of that channel, value 1 rising / 0 falling; past
+    CH4 only in a capture merged from several boards (board_merge.py)
+  CHANNEL_LEVELS   one poll sample, value = levels of CH1-CH8 in bits 0-7
+  CHANNEL_LEVELS_HIGH  right after a sample whose CH9-CH16 are not all
+    low: their levels in bits 0-7; see level_records
+  CHANNEL_UART + (status << 2 | n)  a byte the firmware decoded from
+    channel n (UART_DECODE), time = its start bit, value = the byte;
+    status bit 0 = framing error, bit 1 = parity error
+  CHANNEL_SPI + (overrun << 1 | line)  a byte the firmware's SPI sniffer
+    received (CAPTURE_SPI_DMA), time = its last clock edge; line 0 is
+    the PB5 byte, line 1 the PB15 byte right after it when received;
+    overrun set on the first byte after the SPI lost some
+  CHANNEL_I2C + (event << 1 | flag)  a START, STOP or byte the firmware
+    framed (I2C_SNIFF), value = the byte (address << 1 | R/W for an
+    address), event and flag as the firmware's I2C_EVENT_* and I2C_FLAG
+  CHANNEL_ANALOG + (sample >> 8)  a 12-bit sample of the firmware's
+    analog channel (ANALOG_CAPTURE), value = its low 8 bits; see
+    analog_records
+  CHANNEL_* >= 0x80  a note whose time field holds a number: a lost region
+    is DROP_START, DROP_END, DROP_COUNT records; a SOF pair is SYNC_FRAME,
+    SYNC_CLOCK, SYNC_HOST (host time in ns, -1 before the clock fit); a
+    TRIGGER note holds the clock time a device trigger fired at, a
+    BOARD_SYNC note the clock time of a reference pulse shared with other
+    boards (value = SYNC_FLAG_*, see board_merge.py), a LEVEL_SNAPSHOT
+    note the levels of CH1-CH4 the firmware read off the pins (value =
+    levels | channels << 4, only the channels whose edges are in the
+    capture count, see level_snapshots); a
+    rate-limited channel's summary is STORM (time = end of the window,
+    value = channel | level << 2 | calm << 3) and STORM_COUNT (edges in
+    the window) records; a JOURNAL trailer closes each block written
+Records are in stream order, which keeps each channel's edges in time
+order: one clock stamps them, CHANNEL_SKEW_NS moves a whole channel by
+one offset and board_merge.py keeps each board's own order. The
+decoders rely on it and merge channels instead of sorting them
+(pipeline.merge_lines).
+The fixed record size lets a reader map any capture with numpy.memmap
+without parsing it. A capture cut short by a crash loses at most the
+writer's buffer; a partial last record is ignored.
+
+The writer journals the records: every block it appends, about 1 MB,
+ends in JOURNAL_RECORDS notes on CHANNEL_JOURNAL, value JOURNAL_FIELD +
+n: the block's number in the file, its record count without the
+trailer, the time of its first edge or sample (-1 for none), and its
+seek levels and known channels in the low 32 bits with the CRC-32 of
+the block, the trailer's first three records and those 32 bits above
+them. The block and its trailer go out in one write, synced with
+JOURNAL_SYNC. After a crash or a pulled cable the file may end in a
+torn block; `python capture_file.py recover <capture>` (recover())
+scans back from the end to the last trailer that checks out, moves
+what follows it to bitlog.tail and cuts the file there, and trims the
+seek index and block summaries to the blocks kept. A seek index that
+was lost is rebuilt from the trailers alone, hopping from one to the
+one before by its record count, without reading the records between
+them. So recovery costs the damaged tail, not the file.
+
+A rotated capture (segment_bytes/segment_s) is a series of such files,
+bitlog-0000.lacap and on, each with its own header, plus bitlog.index:
+a CSV of each segment and the time of its first record, so a decoder
+can open just the segments around a time.
+
+Beside each capture file the writer keeps a sparse seek index,
+bitlog.seek (bitlog-0000.seek for a segment): one SEEK_DTYPE entry per
+block it writes, about every 100k records. An entry holds the time of
+the block's first edge or sample, its record number in the file and the
+channel levels just before it, bit n = channel n, with `known` marking
+the channels whose level the capture had shown by then. A reader
+binary-searches it to start anywhere with the right levels; see
+CaptureFile.window. A capture without one (la_ingest.c) is read from
+its first record, unless `python capture_query.py <capture> index`
+has built one since.
+
+bitlog.blocks holds a BLOCK_DTYPE summary of the same blocks, entry for
+entry: per channel the level changes in the block, the time of the
+channel's last change before it and the shortest and longest high and
+low pulse ending in it. capture_query.py reads it to skip the blocks
+that cannot hold what it looks for."""
+import copy
+import csv
+import os
+import queue
+import shutil
+import struct
+import sys
+import threading
+import time
+import zlib
+
+import numpy as np
+
+MAGIC = b'LACAPTUR'
+VERSION = 2
+MODE_EVENTS = 1   # serial_plotter.py: edges
+MODE_SAMPLES = 2  # polling_plotter.py: poll samples
+HEADER = struct.Struct('<8sHHd')  # the channel names follow
+HEADER_SIZE = 128  # of version 1, see la_ingest.c
+HEADER_SIZES = {1: HEADER_SIZE, 2: 384}
+CHANNELS = {1: 4, 2: 16}  # channel names in the header, by version
+TICK_HZ_OFFSET = 12  # of the clock in the header, patched once it is known
+NAME_BYTES = 16
+
+RECORD_DTYPE = np.dtype([('time', '<i8'), ('channel', 'u1'), ('value', 'u1')])
+CHANNEL_LEVELS = 0x0F
+CHANNEL_LEVELS_HIGH = 0x0E
+CHANNEL_DROP_START = 0x80
+CHANNEL_DROP_END = 0x81
+CHANNEL_DROP_COUNT = 0x82
+CHANNEL_SYNC_FRAME = 0x83
+CHANNEL_SYNC_CLOCK = 0x84
+CHANNEL_SYNC_HOST = 0x85
+CHANNEL_TRIGGER = 0x86
+CHANNEL_STORM = 0x87
+CHANNEL_STORM_COUNT = 0x88
+CHANNEL_BOARD_SYNC = 0x89
+CHANNEL_LEVEL_SNAPSHOT = 0x8A
+CHANNEL_JOURNAL = 0x8B
+JOURNAL_FIELD = 0xB0  # value of a trailer's first record, the next ones count on
+JOURNAL_RECORDS = 4
+JOURNAL_MAGIC = b'LAJOURNL'  # the header's last 8 bytes: the writer journals its blocks
+JOURNAL_SYNC = True  # fsync the capture after each block, so a power loss tears at most the last one
+TAIL_SUFFIX = '.tail'  # what recover() cut off a capture
+SNAPSHOT_CHANNELS = 4  # CH1-CH4, the channels of a level snapshot
+SYNC_FLAG_MASTER = 0x01  # in the BOARD_SYNC value: this board drove the pulse, see board_sync.h
+STORM_FLAG_LEVEL = 0x04  # in the STORM value, see storm_limit.h
+STORM_FLAG_CALM = 0x08
+CHANNEL_UART = 0x10  # to 0x1F
+UART_FRAMING_ERROR = 0x01
+UART_PARITY_ERROR = 0x02
+CHANNEL_SPI = 0x20  # to 0x23
+SPI_FLAG_MISO = 0x01  # BUS_SPI flags, see spi_sniff.h
+SPI_FLAG_OVERRUN = 0x02
+CHANNEL_I2C = 0x30  # to 0x37
+I2C_EVENTS = ('start', 'stop', 'address', 'data')  # by I2C_EVENT_*, see i2c_sniff.h
+CHANNEL_ANALOG = 0x40  # to 0x4F
+
+WRITE_BUFFER = 1 << 20
+WRITE_QUEUE = 64  # blocks waiting for the disk before put() waits too
+CHUNK_RECORDS = 1 << 20  # 10 MB, what a chunked decoder holds at a time
+CSV_CHUNK_ROWS = 1 << 20  # CSV rows pandas parses at a time
+CSV_CONVERT = False  # open_csv also writes what it parses to <csv>.lacap, mapped by later runs
+CONVERTED_SUFFIX = '.lacap'  # of a converted CSV export, after the CSV's own name
+EDGE_LABELS = {"falling": 0, "rising": 1}
+CSV_NOTES = frozenset(("DROP", "UART", "SPI", "I2C", "ANALOG", "TRIGGER", "BOARDSYNC", "LEVELS",
+                       "STORM", "SYNC"))  # first columns of the CSV rows that are not edges
+INDEX_SUFFIX = '.index'
+SEEK_SUFFIX = '.seek'
+ARCHIVE_SUFFIX = '.laarc'  # see capture_archive.py
+SEEK_DTYPE = np.dtype([('time', '<i8'), ('record', '<i8'), ('levels', '<u2'), ('known', '<u2')])
+BLOCK_SUFFIX = '.blocks'
+BLOCK_CHANNELS = 16  # summarized channels, the bits of the seek levels
+BLOCK_DTYPE = np.dtype([('changes', '<u4', BLOCK_CHANNELS),
+                        ('since', '<i8', BLOCK_CHANNELS),          # last change before the block, -1 none
+                        ('low', '<i8', (BLOCK_CHANNELS, 2)),       # shortest, longest low pulse
+                        ('high', '<i8', (BLOCK_CHANNELS, 2))])     # ... high pulse; -1 longest = none
+NO_PULSE = (np.iinfo(np.int64).max, -1)
+
+
+def level_records(records):
+    """(times, levels) arrays of the poll samples in records, levels of
+    CH1-CH16 in bits 0-15: a sample's CHANNEL_LEVELS_HIGH record, if it
+    has one, comes right after it"""
+    channels = records['channel']
+    hit = np.flatnonzero(channels == CHANNEL_LEVELS)
+    levels = records['value'][hit].astype(np.uint16)
+    after = np.minimum(hit + 1, len(records) - 1)
+    high = channels[after] == CHANNEL_LEVELS_HIGH
+    levels[high] |= records['value'][after[high]].astype(np.uint16) << 8
+    return records['time'][hit], levels
+
+
+def analog_records(records):
+    """(times, samples) arrays of the analog channel's 12-bit samples in
+    records"""
+    channels = records['channel']
+    hit = (channels >= CHANNEL_ANALOG) & (channels < CHANNEL_ANALOG + 16)
+    return records['time'][hit], (channels[hit].astype(np.uint16) - CHANNEL_ANALOG) << 8 | records['value'][hit]
+
+
+def snapshot_levels(records, channel):
+    """(times, levels) arrays of one edge channel's level in the level
+    snapshots among records that cover it"""
+    values = records['value'].astype(np.int64)
+    hit = (records['channel'] == CHANNEL_LEVEL_SNAPSHOT) & (channel < SNAPSHOT_CHANNELS)
+    hit &= ((values >> (SNAPSHOT_CHANNELS + channel)) & 1) == 1
+    return records['time'][hit], (values[hit] >> channel) & 1
+
+
+def channel_levels(records, channel):
+    """(times, levels) arrays of one channel in a record batch: its edges
+    and its level in the firmware's level snapshots, in time order, or its
+    bit of the poll samples. A snapshot repeats the level unless an edge
+    went missing, so only a lost edge shows as a change at its time"""
+    if channel < CHANNEL_LEVELS_HIGH:
+        hit = records['channel'] == channel
+        if hit.any() or (records['channel'] == CHANNEL_LEVEL_SNAPSHOT).any():
+            return edge_levels(records['time'][hit], records['value'][hit],
+                               *snapshot_levels(records, channel))
+    times, levels = level_records(records)
+    return times, (levels >> channel) & 1
+
+
+def edge_levels(times, levels, snap_times, snap_levels):
+    """A channel's edges merged with its snapshot levels in time order;
+    an edge and a snapshot at the same tick keep the edge first, since
+    the firmware reads the pins after the edges it has timed"""
+    if not len(snap_times):
+        return times, levels
+    times = np.concatenate([times, snap_times])
+    levels = np.concatenate([levels.astype(np.int64), snap_levels])
+    order = np.argsort(times, kind='stable')
+    return times[order], levels[order]
+
+
+def uart_records(records, channel):
+    """(times, bytes, status) arrays of the bytes the firmware decoded
+    from one channel"""
+    channels = records['channel']
+    kinds = channels.astype(np.int64) - CHANNEL_UART
+    hit = (kinds >= 0) & (kinds < 16) & ((kinds & 0x3) == channel)
+    return records['time'][hit], records['value'][hit], kinds[hit] >> 2
+
+
+def spi_records(records):
+    """(times, PB5 bytes, PB15 bytes, flags) arrays of the bytes the
+    firmware's SPI sniffer received, flags as the firmware's SPI_FLAG_*;
+    the PB15 byte is 0 without SPI_FLAG_MISO"""
+    kinds = records['channel'].astype(np.int64) - CHANNEL_SPI
+    spi = (kinds >= 0) & (kinds < 4)
+    first = np.flatnonzero(spi & ((kinds & 1) == 0))
+    after = np.minimum(first + 1, len(records) - 1)
+    paired = spi[after] & ((kinds[after] & 1) == 1) & (after != first)
+    values = records['value'].astype(np.int64)
+    flags = np.where(paired, SPI_FLAG_MISO, 0) | np.where(kinds[first] & 2, SPI_FLAG_OVERRUN, 0)
+    return records['time'][first], values[first], np.where(paired, values[after], 0), flags
+
+
+def i2c_records(records):
+    """(times, events, bytes, flags) arrays of what the firmware's I2C
+    framing sent, events and flags as the firmware's I2C_EVENT_* and
+    I2C_FLAG"""
+    kinds = records['channel'].astype(np.int64) - CHANNEL_I2C
+    hit = (kinds >= 0) & (kinds < 8)
+    return records['time'][hit], kinds[hit] >> 1, records['value'][hit], kinds[hit] & 1
+
+
+def i2c_events(times, events, values, flags):
+    """The firmware's I2C framing as pipeline.I2cStream events"""
+    for t, event, value, flag in zip(times, events, values, flags):
+        name = I2C_EVENTS[event]
+        if name == 'start':
+            yield ('start', t, bool(flag))
+        elif name == 'stop':
+            yield ('stop', t)
+        elif name == 'address':
+            yield ('address', t, value >> 1, bool(value & 1), bool(flag))
+        else:
+            yield ('data', t, value, bool(flag))
+
+
+def segment_path(path, number):
+    """bitlog.lacap -> bitlog-0003.lacap"""
+    stem, dot, ext = path.rpartition('.')
+    return f"{stem}-{number:04d}.{ext}" if dot else f"{path}-{number:04d}"
+
+
+def index_path(path):
+    """bitlog.lacap -> bitlog.index, the segment list of a rotated capture"""
+    stem, dot, _ = path.rpartition('.')
+    return (stem if dot else path) + INDEX_SUFFIX
+
+
+def seek_path(path, suffix=SEEK_SUFFIX):
+    """bitlog.lacap -> bitlog.seek, the sparse seek index of one capture
+    file, or with BLOCK_SUFFIX bitlog.blocks, its block summaries"""
+    stem, dot, _ = path.rpartition('.')
+    return (stem if dot else path) + suffix
+
+
+class BlockIndex:
+    """Follows a capture's records batch by batch for its seek index and
+    block summaries: put() every batch, then close() each block for the
+    seek entry (record number left to the caller) and the summary that
+    describe it. Channels are the edge channels or poll sample bits
+    summarized, at most BLOCK_CHANNELS"""
+
+    def __init__(self, mode, channels):
+        self.mode = mode
+        self.channels = [ch for ch in channels if ch < (CHANNEL_LEVELS_HIGH if mode == MODE_EVENTS
+                                                        else BLOCK_CHANNELS)]
+        self.levels = self.known = 0  # after the records put so far
+        self.changed = np.full(BLOCK_CHANNELS, -1, np.int64)  # time of each channel's latest change
+        self._open()
+
+    def _open(self):
+        self.entry = np.array((0, 0, self.levels, self.known), SEEK_DTYPE)
+        self.summary = np.zeros((), BLOCK_DTYPE)
+        self.summary['since'] = self.changed
+        self.summary['low'][:] = self.summary['high'][:] = NO_PULSE
+
+    def put(self, records):
+        for ch in self.channels:
+            times, levels = channel_levels(records, ch)
+            if not len(times):
+                continue
+            bit = 1 << ch
+            levels = levels.astype(np.int64)
+            before = self.levels >> ch & 1 if self.known & bit else levels[0]
+            previous = np.concatenate([[before], levels[:-1]])
+            changed = levels != previous
+            times, ended = times[changed], previous[changed]
+            if len(times):
+                starts = np.concatenate([[self.changed[ch]], times[:-1]])
+                widths = times - starts
+                for name, level in (('low', 0), ('high', 1)):
+                    pulses = widths[(starts >= 0) & (ended == level)]
+                    if len(pulses):
+                        shortest, longest = self.summary[name][ch]
+                        self.summary[name][ch] = min(shortest, pulses.min()), max(longest, pulses.max())
+                self.summary['changes'][ch] += len(times)
+                self.changed[ch] = times[-1]
+            self.levels = self.levels & ~bit | int(levels[-1]) << ch
+            self.known |= bit
+
+    def close(self, first):
+        """(seek entry, summary) of the block put since the last close,
+        first the time of its first edge or sample"""
+        entry, summary = self.entry, self.summary
+        entry['time'] = first
+        self._open()
+        return entry, summary
+
+
+def read_blocks(path):
+    """BLOCK_DTYPE array of a capture file's block summaries, empty without them"""
+    try:
+        count = os.path.getsize(seek_path(path, BLOCK_SUFFIX)) // BLOCK_DTYPE.itemsize
+    except OSError:
+        return np.empty(0, dtype=BLOCK_DTYPE)
+    return np.fromfile(seek_path(path, BLOCK_SUFFIX), dtype=BLOCK_DTYPE, count=count)
+
+
+def write_index(path, block_records=WRITE_BUFFER // RECORD_DTYPE.itemsize):
+    """Builds the seek index and block summaries of a capture file
+    written without them, in blocks of block_records"""
+    capture = CaptureFile(path)
+    names = range(CHANNELS[capture.version] if capture.mode == MODE_SAMPLES else CHANNEL_LEVELS_HIGH)
+    index = BlockIndex(capture.mode, names)
+    with open(seek_path(path), 'wb') as seek, open(seek_path(path, BLOCK_SUFFIX), 'wb') as blocks:
+        for begin in range(0, len(capture.records), block_records):
+            block = capture.records[begin:begin + block_records]
+            timed = np.flatnonzero(block['channel'] < CHANNEL_DROP_START)
+            index.put(block)
+            entry, summary = index.close(int(block['time'][timed[0]]) if len(timed) else 0)
+            if len(timed):
+                entry['record'] = begin
+                seek.write(entry.tobytes())
+                blocks.write(summary.tobytes())
+    return CaptureFile(path)
+
+
+def journal_trailer(body, number, first, entry):
+    """JOURNAL_RECORDS trailer records of a block of record bytes, its
+    number in the file, the time of its first edge or sample (None for
+    none) and its seek entry"""
+    trailer = np.zeros(JOURNAL_RECORDS, dtype=RECORD_DTYPE)
+    trailer['channel'] = CHANNEL_JOURNAL
+    trailer['value'] = JOURNAL_FIELD + np.arange(JOURNAL_RECORDS)
+    trailer['time'][:3] = number, len(body) // RECORD_DTYPE.itemsize, -1 if first is None else first
+    low = int(entry['known']) << 16 | int(entry['levels'])
+    crc = zlib.crc32(body + trailer[:3].tobytes() + struct.pack('<I', low))
+    check = crc << 32 | low
+    trailer['time'][3] = check - (1 << 64) if check >> 63 else check  # the bits of an int64
+    return trailer.tobytes()
+
+
+def journal_ok(records, k):
+    """True if record k closes a block: a whole trailer whose CRC checks
+    out, right after the trailer before it or the header"""
+    if k < JOURNAL_RECORDS - 1 or k >= len(records):
+        return False
+    trailer = records[k - JOURNAL_RECORDS + 1:k + 1]
+    if ((trailer['channel'] != CHANNEL_JOURNAL).any() or
+            (trailer['value'] != JOURNAL_FIELD + np.arange(JOURNAL_RECORDS)).any()):
+        return False
+    _, count, _, check = trailer['time'].tolist()
+    start = k - JOURNAL_RECORDS + 1 - count
+    if count < 0 or start < 0 or (start and not (records['channel'][start - 1] == CHANNEL_JOURNAL and
+                                                 records['value'][start - 1] == JOURNAL_FIELD + 3)):
+        return False
+    check &= (1 << 64) - 1
+    body = records[start:k].tobytes()  # the block and the trailer's first three records
+    return zlib.crc32(body + struct.pack('<I', check & 0xFFFFFFFF)) == check >> 32
+
+
+def journal_end(records):
+    """Records up to the end of the last block whose trailer checks out,
+    found by scanning back from the end CHUNK_RECORDS at a time"""
+    end = len(records)
+    while end > 0:
+        begin = max(end - CHUNK_RECORDS, 0)
+        chunk = records[begin:end]
+        last = np.flatnonzero((chunk['channel'] == CHANNEL_JOURNAL) & (chunk['value'] == JOURNAL_FIELD + 3))
+        for k in reversed((last + begin).tolist()):
+            if journal_ok(records, k):
+                return k + 1
+        end = begin
+    return 0
+
+
+def journal_seek(records, end):
+    """The seek index of the blocks before end, read off their trailers
+    from the last back to the first; None if the chain breaks"""
+    entries = []
+    k = end - 1
+    while k >= 0:
+        trailer = records[k - JOURNAL_RECORDS + 1:k + 1] if k >= JOURNAL_RECORDS - 1 else records[:0]
+        if len(trailer) < JOURNAL_RECORDS or (trailer['channel'] != CHANNEL_JOURNAL).any():
+            return None
+        _, count, first, check = trailer['time'].tolist()
+        start = k - JOURNAL_RECORDS + 1 - count
+        if count < 0 or start < 0:
+            return None
+        if first >= 0:
+            entries.append((first, start, check & 0xFFFF, check >> 16 & 0xFFFF))
+        k = start - 1
+    return np.array(entries[::-1], dtype=SEEK_DTYPE)
+
+
+def recover(path):
+    """Cuts a capture file back to its last whole block after a crash (see
+    the module doc) and brings its seek index and block summaries in line;
+    returns a line saying what it did. A capture without a journal
+    (la_ingest.c, or written before journaling) only loses a partial last
+    record and the index entries past its records"""
+    capture = CaptureFile(path)
+    journaled = capture.journaled
+    end = journal_end(capture.records) if journaled else len(capture.records)
+    cut = HEADER_SIZES[capture.version] + end * RECORD_DTYPE.itemsize
+    size = os.path.getsize(path)
+    del capture  # unmaps the records before the file shrinks under them
+    if cut < size:
+        with open(path, 'rb') as f, open(seek_path(path, TAIL_SUFFIX), 'wb') as tail:
+            f.seek(cut)
+            shutil.copyfileobj(f, tail)
+        os.truncate(path, cut)
+
+    seek = read_seek(path)
+    kept = seek[seek['record'] < end]
+    rebuilt = journaled and end and not len(kept)
+    if rebuilt:  # the seek index went missing: the trailers hold it
+        kept = journal_seek(CaptureFile(path).records, end)
+        if kept is None:
+            return f"{path}: {end} records kept, the journal is broken; run 'python capture_query.py {path} index'"
+    kept.tofile(seek_path(path))
+    blocks = read_blocks(path)
+    if len(blocks) >= len(kept) and not rebuilt:
+        blocks[:len(kept)].tofile(seek_path(path, BLOCK_SUFFIX))
+    elif os.path.exists(seek_path(path, BLOCK_SUFFIX)):
+        os.remove(seek_path(path, BLOCK_SUFFIX))  # capture_query.py index builds them again
+    return (f"{path}: {end} records in {len(kept)} indexed blocks kept"
+            + (", seek index rebuilt from the journal" if rebuilt else "")
+            + (f", {size - cut} bytes after the last whole block moved to {seek_path(path, TAIL_SUFFIX)}"
+               if cut < size else ", nothing to cut"))
+
+
+class CaptureWriter:
+    """The file sink of a pipeline.Pipeline: collects record batches into
+    blocks of about 1 MB that a background thread writes out, so a disk
+    stall never holds up the reader; the plotters flush about once a
+    second, not once per event. It never drops a batch: once WRITE_QUEUE
+    blocks are waiting, put() waits for the disk.
+
+    With segment_bytes or segment_s set the capture rotates: path names
+    the series, each segment (bitlog-0000.lacap, ...) is a complete
+    capture of its own, and bitlog.index lists every segment with the
+    time of its first record so a reader can open only the ones it needs.
+    Every block also gets a seek index entry, see the module doc"""
+    shed = 0  # lossless
+
+    def __init__(self, path, mode, names, tick_hz=0, segment_bytes=0, segment_s=0):
+        self.path = path
+        self.mode = mode
+        self.tick_hz = tick_hz
+        self.version = 2 if any(ch >= CHANNELS[1] for ch in names) else 1
+        self.names = b''.join((names.get(ch) or '').encode()[:NAME_BYTES].ljust(NAME_BYTES, b'\0')
+                              for ch in range(CHANNELS[self.version]))
+        self.segment_bytes = segment_bytes
+        self.segment_s = segment_s
+        self.batch = bytearray()
+        self.batch_first = None  # time of the batch's first edge or sample
+        self.last_time = None    # of the latest edge or sample handed off
+        self.blocks = BlockIndex(mode, names)
+        self.queue = queue.Queue(WRITE_QUEUE)
+        # writer thread state
+        self.f = None
+        self.seek = None
+        self.summaries = None
+        self.index = None
+        self.segment = -1
+        self.segment_size = 0
+        self.segment_opened = 0
+        self.journal = 0  # blocks written to the segment
+        self.thread = threading.Thread(target=self._run, daemon=True)
+        if not self._rotating():
+            self._open_segment(None)  # the file exists as soon as the writer does
+        self.thread.start()
+
+    def _rotating(self):
+        return bool(self.segment_bytes or self.segment_s)
+
+    def set_tick_hz(self, tick_hz):
+        """Fills in the timestamp clock once the firmware has reported it"""
+        self.queue.put(('tick', tick_hz))
+
+    def put(self, records):
+        """Appends a RECORD_DTYPE batch"""
+        timed = np.flatnonzero(records['channel'] < CHANNEL_DROP_START)  # not notes
+        if len(timed):
+            if self.batch_first is None:
+                self.batch_first = int(records['time'][timed[0]])
+            self.last_time = int(records['time'][timed[-1]])
+        self.blocks.put(records)
+        self.batch += records.tobytes()
+        if len(self.batch) >= WRITE_BUFFER:
+            self._hand_off()
+
+    def _hand_off(self):
+        if self.batch:
+            first = self.batch_first if self.batch_first is not None else self.last_time
+            self.queue.put(('data', bytes(self.batch), first, *self.blocks.close(first or 0)))
+            self.batch.clear()
+            self.batch_first = None
+
+    def flush(self):
+        """Hands everything so far to the thread, which writes it out
+        behind the caller's back"""
+        self._hand_off()
+
+    def close(self):
+        """Writes out the rest and waits for the thread"""
+        self._hand_off()
+        self.queue.put(('close', None))
+        self.thread.join()
+
+    # --- writer thread ---
+
+    def _open_segment(self, first_time):
+        if self.f is not None:
+            self.f.close()
+            self.seek.close()
+            self.summaries.close()
+        self.segment += 1
+        path = segment_path(self.path, self.segment) if self._rotating() else self.path
+        self.f = open(path, 'wb', buffering=0)
+        self.seek = open(seek_path(path), 'wb', buffering=0)
+        self.summaries = open(seek_path(path, BLOCK_SUFFIX), 'wb', buffering=0)
+        size = HEADER_SIZES[self.version]
+        self.f.write((HEADER.pack(MAGIC, self.version, self.mode, self.tick_hz) + self.names)
+                     .ljust(size - len(JOURNAL_MAGIC), b'\0') + JOURNAL_MAGIC)
+        self.segment_size = size
+        self.journal = 0
+        self.segment_opened = time.monotonic()
+        if self._rotating():
+            if self.index is None:
+                self.index = open(index_path(self.path), 'w', newline='')
+                self.index.write("Segment,First-Time\n")
+            self.index.write(f"{os.path.basename(path)},{'' if first_time is None else first_time}\n")
+            self.index.flush()
+
+    def _due(self):
+        return (self.f is None
+                or self.segment_bytes and self.segment_size >= self.segment_bytes
+                or self.segment_s and time.monotonic() - self.segment_opened >= self.segment_s)
+
+    def _run(self):
+        while True:
+            kind, value, *rest = self.queue.get()
+            if kind == 'data':
+                first, entry, summary = rest
+                if self._rotating() and self._due():
+                    self._open_segment(first)
+                if first is not None:
+                    entry['record'] = (self.segment_size - HEADER_SIZES[self.version]) // RECORD_DTYPE.itemsize
+                    self.seek.write(entry.tobytes())
+                    self.summaries.write(summary.tobytes())
+                block = value + journal_trailer(value, self.journal, first, entry)
+                self.f.write(block)
+                if JOURNAL_SYNC:
+                    os.fsync(self.f.fileno())
+                self.segment_size += len(block)
+                self.journal += 1
+            elif kind == 'tick':
+                self.tick_hz = value
+                if self.f is not None:
+                    self.f.seek(TICK_HZ_OFFSET)
+                    self.f.write(struct.pack('<d', value))
+                    self.f.seek(0, 2)
+            else:
+                if self.f is not None:
+                    self.f.close()
+                    self.seek.close()
+                    self.summaries.close()
+                if self.index is not None:
+                    self.index.close()
+                return
+
+
+def is_capture_file(path):
+    """True for a capture or the index of a rotated one"""
+    if path.endswith(INDEX_SUFFIX):
+        return os.path.exists(path)
+    try:
+        with open(path, 'rb') as f:
+            return f.read(len(MAGIC)) == MAGIC
+    except OSError:
+        return False
+
+
+def index_segments(path, start=None, end=None):
+    """Segment paths of a rotated capture's index whose records may fall
+    in [start, end] (ticks; None for open-ended): a segment runs from its
+    first time to the next segment's"""
+    folder = os.path.dirname(path)
+    with open(path, newline='') as f:
+        rows = [(name, int(first) if first else None) for name, first in list(csv.reader(f))[1:]]
+    chosen = []
+    for i, (name, first) in enumerate(rows):
+        following = rows[i + 1][1] if i + 1 < len(rows) else None
+        if end is not None and first is not None and first > end:
+            continue
+        if start is not None and following is not None and following < start:
+            continue
+        chosen.append(os.path.join(folder, name))
+    return chosen
+
+
+def read_seek(path):
+    """SEEK_DTYPE array of a capture file's seek index, empty without one"""
+    try:
+        count = os.path.getsize(seek_path(path)) // SEEK_DTYPE.itemsize
+    except OSError:
+        return np.empty(0, dtype=SEEK_DTYPE)
+    return np.fromfile(seek_path(path), dtype=SEEK_DTYPE, count=count)
+
+
+class CaptureFile:
+    """A capture mapped read-only: records is a RECORD_DTYPE array backed
+    by the file. Given the index of a rotated capture, the segments that
+    may hold [start, end] (ticks) are opened as one. seek is the seek
+    index, its record numbers counting in records; levels and known give
+    the channel levels before the first record, none known unless it
+    comes from window(); journaled is True if its writer journaled it"""
+    levels = known = 0
+    journaled = False
+
+    def __init__(self, path, start=None, end=None):
+        if path.endswith(INDEX_SUFFIX):
+            self._open_segments(path, start, end)
+            return
+        with open(path, 'rb') as f:
+            header = f.read(max(HEADER_SIZES.values()))
+            f.seek(0, 2)
+            size = f.tell()
+        if len(header) < HEADER_SIZE:
+            raise ValueError(f"{path}: not a capture file")
+        magic, self.version, self.mode, self.tick_hz = HEADER.unpack_from(header)
+        if magic != MAGIC:
+            raise ValueError(f"{path}: not a capture file")
+        if self.version > VERSION:
+            raise ValueError(f"{path}: capture format v{self.version}, this script reads v{VERSION}")
+        header_size = HEADER_SIZES[self.version]
+        self.journaled = header[header_size - len(JOURNAL_MAGIC):header_size] == JOURNAL_MAGIC
+        self.names = [header[i:i + NAME_BYTES].rstrip(b'\0').decode()
+                      or f"CH{(i - HEADER.size) // NAME_BYTES + 1}"
+                      for i in range(HEADER.size, HEADER.size + CHANNELS[self.version] * NAME_BYTES,
+                                     NAME_BYTES)]
+        count = (size - header_size) // RECORD_DTYPE.itemsize
+        if count:
+            self.records = np.memmap(path, dtype=RECORD_DTYPE, mode='r',
+                                     offset=header_size, shape=(count,))
+        else:
+            self.records = np.empty(0, dtype=RECORD_DTYPE)
+        self.seek = read_seek(path)
+        self.seek = self.seek[self.seek['record'] < count]  # a crash can leave entries past the data
+
+    @classmethod
+    def from_records(cls, records, mode, names, tick_hz, seek=None, levels=0, known=0):
+        """A capture held in memory instead of mapped from a file, such as
+        blocks of an archive (capture_archive.py)"""
+        capture = cls.__new__(cls)
+        capture.version = 2 if len(names) > CHANNELS[1] else 1
+        capture.mode, capture.names, capture.tick_hz = mode, list(names), tick_hz
+        capture.records = records
+        capture.seek = seek if seek is not None else np.empty(0, dtype=SEEK_DTYPE)
+        capture.levels, capture.known = levels, known
+        return capture
+
+    def _open_segments(self, path, start, end):
+        parts = [CaptureFile(segment) for segment in index_segments(path, start, end)]
+        if not parts:
+            raise ValueError(f"{path}: no segment in that time range")
+        self.version, self.mode, self.names = parts[0].version, parts[0].mode, parts[0].names
+        self.tick_hz = max(part.tick_hz for part in parts)  # the first may predate the 'V' reply
+        if len(parts) == 1:
+            self.records, self.seek = parts[0].records, parts[0].seek
+            return
+        self.records = np.concatenate([part.records for part in parts])
+        firsts = np.cumsum([0] + [len(part.records) for part in parts[:-1]])
+        self.seek = np.concatenate([part.seek for part in parts])
+        self.seek['record'] += np.repeat(firsts, [len(part.seek) for part in parts])
+
+    def window(self, start, end=None):
+        """The capture cut down to the seek index blocks that can hold
+        records from start to end (ticks; None for the end), with the
+        levels before its first record; costs two binary searches of the
+        index, not a pass over the records. Without a seek index the
+        whole capture comes back"""
+        if not len(self.seek):
+            return copy.copy(self)
+        times = np.maximum.accumulate(self.seek['time'])
+        first = max(int(np.searchsorted(times, start, side='right')) - 1, 0)
+        after = int(np.searchsorted(times, end, side='right')) if end is not None else len(self.seek)
+        return self.blocks(first, max(after, first + 1))
+
+    def blocks(self, first, after):
+        """The capture cut down to seek index blocks first to after - 1,
+        with the levels before the first; the first block takes in any
+        notes ahead of it"""
+        cut = copy.copy(self)
+        begin = int(self.seek['record'][first]) if first else 0
+        stop = int(self.seek['record'][after]) if after < len(self.seek) else len(self.records)
+        cut.records = self.records[begin:stop]
+        cut.seek = self.seek[first:after].copy()
+        cut.seek['record'] -= begin
+        cut.levels, cut.known = int(self.seek['levels'][first]), int(self.seek['known'][first])
+        return cut
+
+    def seconds(self, times):
+        """Seconds of record times on the capture's clock, None while the
+        clock is unknown"""
+        return times / self.tick_hz if self.tick_hz else None
+
+    def _notes(self, *channels):
+        """Numbers of consecutive note records, one tuple per group"""
+        columns = [self.records['time'][self.records['channel'] == ch].tolist() for ch in channels]
+        return list(zip(*columns))
+
+    def edges(self, channel):
+        """(times, edges) arrays of one channel's edges, in stream order"""
+        hit = self.records['channel'] == channel
+        return self.records['time'][hit], self.records['value'][hit]
+
+    def samples(self):
+        """(times, levels) arrays of the poll samples, see level_records"""
+        return level_records(self.records)
+
+    def uart_bytes(self, channel):
+        """(times, bytes, status) arrays of the bytes the firmware decoded
+        from a channel, see uart_records"""
+        return uart_records(self.records, channel)
+
+    def spi_bytes(self):
+        """(times, PB5 bytes, PB15 bytes, flags) arrays of the bytes the
+        firmware's SPI sniffer received, see spi_records"""
+        return spi_records(self.records)
+
+    def i2c_frames(self):
+        """(times, events, bytes, flags) arrays of what the firmware's I2C
+        framing sent, see i2c_records"""
+        return i2c_records(self.records)
+
+    def drops(self):
+        """(count, start, end) of each region with lost events"""
+        return [(count, start, end) for start, end, count in
+                self._notes(CHANNEL_DROP_START, CHANNEL_DROP_END, CHANNEL_DROP_COUNT)]
+
+    def syncs(self):
+        """(frame, clock, host time in s or None) of each SOF pair"""
+        return [(frame, clock, None if host < 0 else host / 1e9) for frame, clock, host in
+                self._notes(CHANNEL_SYNC_FRAME, CHANNEL_SYNC_CLOCK, CHANNEL_SYNC_HOST)]
+
+    def storms(self):
+        """(channel, window end, edge count, level, calm) of each summary
+        of a rate-limited channel"""
+        hit = self.records['channel'] == CHANNEL_STORM
+        counts = self.records['time'][self.records['channel'] == CHANNEL_STORM_COUNT].tolist()
+        return [(flags & 0x3, end, count, (flags & STORM_FLAG_LEVEL) >> 2, bool(flags & STORM_FLAG_CALM))
+                for end, flags, count in zip(self.records['time'][hit].tolist(),
+                                             self.records['value'][hit].tolist(), counts)]
+
+    def triggers(self):
+        """Clock times the device trigger fired at"""
+        return [time for time, in self._notes(CHANNEL_TRIGGER)]
+
+    def board_syncs(self):
+        """(times, flags) arrays of the reference pulses shared with other
+        boards"""
+        hit = self.records['channel'] == CHANNEL_BOARD_SYNC
+        return self.records['time'][hit], self.records['value'][hit]
+
+    def level_snapshots(self, channel):
+        """(times, levels) arrays of a channel's level in the firmware's
+        periodic level snapshots (LEVEL_SNAPSHOT_MS)"""
+        return snapshot_levels(self.records, channel)
+
+
+class RecordChunks:
+    """A capture, the index of a rotated one or a CSV export read chunk by
+    chunk: iterating yields RECORD_DTYPE arrays of at most count records
+    in stream order, so a reader's memory depends on the chunk size, not
+    the capture's. mode, names and tick_hz are known on creation. A CSV
+    export is parsed whole on creation (open_csv), which holds its
+    records, not its text; names is not used"""
+
+    def __init__(self, path, names=(), count=CHUNK_RECORDS):
+        self.path, self.count = path, count
+        self.archive = None
+        if path.endswith(ARCHIVE_SUFFIX):
+            from capture_archive import Archive  # it imports this module
+            self.archive = Archive(path)
+            self.mode, self.names, self.tick_hz = self.archive.mode, self.archive.names, self.archive.tick_hz
+            return
+        if is_capture_file(path):
+            self.segments = index_segments(path) if path.endswith(INDEX_SUFFIX) else [path]
+            if not self.segments:
+                raise ValueError(f"{path}: no segments")
+            headers = [CaptureFile(segment) for segment in self.segments]
+            self.mode, self.names = headers[0].mode, headers[0].names
+            self.tick_hz = max(header.tick_hz for header in headers)  # the first may predate the 'V' reply
+            return
+        self.segments = None
+        self.csv = open_csv(path)
+        self.mode, self.names, self.tick_hz = self.csv.mode, self.csv.names, self.csv.tick_hz
+
+    def __iter__(self):
+        if self.archive is not None:
+            sources = iter(self.archive)
+        elif self.segments is None:
+            sources = [self.csv.records]
+        else:
+            sources = (CaptureFile(segment).records for segment in self.segments)
+        for records in sources:
+            for begin in range(0, len(records), self.count):
+                yield records[begin:begin + self.count]
+
+
+def _csv_number(name, numbers, names):
+    """Channel number of an edge channel of a CSV export, the next free
+    one the first time it is named; KeyError once the edge channels run
+    out"""
+    if name not in numbers:
+        if len(names) >= CHANNEL_LEVELS_HIGH:
+            raise KeyError(name)
+        numbers[name] = len(names)
+        names.append(name)
+    return numbers[name]
+
+
+def _csv_row(row, numbers, names):
+    """(time, channel, value) records of one row of a CSV export of edges
+    other than a plain edge row: its DROP rows become drop notes, its
+    LEVELS rows level snapshots and its UART, SPI and I2C rows what the
+    firmware decoded. Raises ValueError, IndexError or KeyError for a row
+    it cannot read"""
+    if row[0] == "DROP":
+        count, start, end = (int(value) for value in row[1:4])
+        return [(start, CHANNEL_DROP_START, 0), (end, CHANNEL_DROP_END, 0), (count, CHANNEL_DROP_COUNT, 0)]
+    if row[0] == "UART":
+        ch = _csv_number(row[1], numbers, names)
+        if ch > 3:
+            raise KeyError(row[1])  # the record has two bits for it
+        return [(int(row[4]), CHANNEL_UART + (int(row[3]) << 2 | ch), int(row[2], 16))]
+    if row[0] == "SPI":
+        kind = CHANNEL_SPI + (int(row[3]) << 1)
+        first = (int(row[4]), kind, int(row[1], 16))
+        return [first, (int(row[4]), kind + 1, int(row[2], 16))] if row[2] else [first]
+    if row[0] == "I2C":
+        event = I2C_EVENTS.index(row[1].lower())
+        return [(int(row[4]), CHANNEL_I2C + (event << 1 | int(row[3])), int(row[2], 16))]
+    if row[0] == "ANALOG":
+        sample = int(row[1])
+        return [(int(row[2]), CHANNEL_ANALOG + (sample >> 8), sample & 0xFF)]
+    if row[0] == "TRIGGER":
+        return [(int(row[1]), CHANNEL_TRIGGER, 0)]
+    if row[0] == "BOARDSYNC":
+        return [(int(row[1]), CHANNEL_BOARD_SYNC, int(row[2]))]
+    if row[0] == "LEVELS":
+        ch = _csv_number(row[2], numbers, names)
+        if ch >= SNAPSHOT_CHANNELS:
+            return []
+        return [(int(row[1]), CHANNEL_LEVEL_SNAPSHOT, int(row[3]) << ch | 1 << (SNAPSHOT_CHANNELS + ch))]
+    if row[0] == "STORM":
+        flags = _csv_number(row[1], numbers, names) | int(row[3]) << 2 | int(row[4]) << 3
+        return [(int(row[5]), CHANNEL_STORM, flags), (int(row[2]), CHANNEL_STORM_COUNT, 0)]
+    return []  # SYNC rows are not read back
+
+
+def _tuple_records(rows):
+    records = np.empty(len(rows), dtype=RECORD_DTYPE)
+    records['time'] = [time for time, _, _ in rows]
+    records['channel'] = [channel for _, channel, _ in rows]
+    records['value'] = [value for _, _, value in rows]
+    return records
+
+
+def _csv_rows(path, mode, numbers, names, clock):
+    """RECORD_DTYPE arrays of a CSV export read row by row, the fallback
+    without pandas"""
+    rows = []
+    with open(path, newline='') as f:
+        reader = csv.reader(f)
+        next(reader)
+        for row in reader:
+            try:
+                if mode == MODE_SAMPLES:
+                    levels = sum(int(level) << ch for ch, level in enumerate(row[1:17]))
+                    rows.append((int(row[0]), CHANNEL_LEVELS, levels & 0xFF))
+                    if levels >> 8:
+                        rows.append((int(row[0]), CHANNEL_LEVELS_HIGH, levels >> 8))
+                elif row[0] in CSV_NOTES:
+                    rows += _csv_row(row, numbers, names)
+                else:
+                    time, level = int(row[2]), EDGE_LABELS[row[1].lower()]
+                    rows.append((time, _csv_number(row[0], numbers, names), level))
+                    if len(row) > 3 and float(row[3]) > 0 and time > clock[0]:
+                        clock[:] = [time, float(row[3])]
+            except (ValueError, IndexError, KeyError):
+                continue
+            if len(rows) >= CSV_CHUNK_ROWS:
+                yield _tuple_records(rows)
+                rows = []
+    if rows:
+        yield _tuple_records(rows)
+
+
+def _csv_frames(pandas, path, mode, width, numbers, names, clock):
+    """RECORD_DTYPE arrays of a CSV export parsed CSV_CHUNK_ROWS rows at a
+    time by pandas' C reader: the channel and edge columns come back as
+    categories, so mapping them to channel numbers and levels costs one
+    lookup per distinct name, not per row. The few rows that are not
+    edges go through _csv_row, and every record keeps its row's place"""
+    numeric = mode == MODE_SAMPLES
+    frames = pandas.read_csv(path, header=None, skiprows=1, names=range(width), engine='c',
+                             dtype=None if numeric else {0: 'category', 1: 'category', 2: str, 3: str,
+                                                          4: str, 5: str},
+                             keep_default_na=numeric, on_bad_lines='skip', chunksize=CSV_CHUNK_ROWS)
+    for frame in frames:
+        if numeric:
+            values = frame.apply(pandas.to_numeric, errors='coerce').dropna().to_numpy(np.int64)
+            levels = (values[:, 1:17] << np.arange(min(width - 1, 16), dtype=np.int64)).sum(axis=1)
+            high = np.flatnonzero(levels >> 8)
+            records = np.empty(len(values) + len(high), dtype=RECORD_DTYPE)
+            at = np.arange(len(values)) + np.searchsorted(high, np.arange(len(values)))  # high halves in between
+            records['time'][at] = values[:, 0]
+            records['channel'][at] = CHANNEL_LEVELS
+            records['value'][at] = levels & 0xFF
+            records['time'][at[high] + 1] = values[high, 0]
+            records['channel'][at[high] + 1] = CHANNEL_LEVELS_HIGH
+            records['value'][at[high] + 1] = levels[high] >> 8
+            yield records
+            continue
+        kinds, labels = frame[0].cat, frame[1].cat
+        kind = kinds.codes.to_numpy()
+        level = np.array([EDGE_LABELS.get(label.lower(), -1) for label in labels.categories] + [-1],
+                         dtype=np.int64)[labels.codes.to_numpy()]  # code -1 is the empty field
+        notes = np.array([name in CSV_NOTES for name in kinds.categories] + [False])[kind]
+        rows = np.flatnonzero((level >= 0) & ~notes)
+        times = pandas.to_numeric(frame[2].iloc[rows], errors='coerce').to_numpy(np.float64)
+        rows, times = rows[~np.isnan(times)], times[~np.isnan(times)].astype(np.int64)
+        channel = np.full(len(kinds.categories) + 1, -1, dtype=np.int64)
+        seen, first = np.unique(kind[rows], return_index=True)
+        for code in seen[np.argsort(first)]:  # numbered in order of first appearance
+            try:
+                if code >= 0:
+                    channel[code] = _csv_number(kinds.categories[code], numbers, names)
+            except KeyError:
+                pass  # past the edge channels
+        seconds = pandas.to_numeric(frame[3].iloc[rows], errors='coerce').to_numpy(np.float64)
+        timed = np.flatnonzero(seconds > 0)
+        if len(timed):
+            latest = timed[np.argmax(times[timed])]
+            if times[latest] > clock[0]:
+                clock[:] = [int(times[latest]), float(seconds[latest])]
+        kept = channel[kind[rows]] >= 0
+        rows, times = rows[kept], times[kept]
+        order = [rows * 4]  # up to 4 records per row
+        edges = np.empty(len(rows), dtype=RECORD_DTYPE)
+        edges['time'], edges['channel'], edges['value'] = times, channel[kind[rows]], level[rows]
+        parts = [edges]
+        extra, keys = [], []
+        noted = np.flatnonzero(notes)
+        for row, values in zip(noted.tolist(), frame.iloc[noted].itertuples(index=False)):
+            try:
+                records = _csv_row([str(value) for value in values], numbers, names)
+            except (ValueError, IndexError, KeyError):
+                continue
+            extra += records
+            keys += range(row * 4, row * 4 + len(records))
+        if extra:
+            parts.append(_tuple_records(extra))
+            order.append(np.array(keys, dtype=np.int64))
+        records = np.concatenate(parts)
+        yield records[np.argsort(np.concatenate(order), kind='stable')]
+
+
+def read_csv(path):
+    """CaptureFile.from_records of a CSV export of the plotters (or of
+    export_csv), parsed by pandas' C reader when it is installed and row
+    by row otherwise, to the same records. The edge channels are
+    numbered in order of first appearance, up to CHANNEL_LEVELS_HIGH of
+    them; the clock is the one the latest edge with seconds was
+    exported with, 0 without seconds"""
+    with open(path, newline='') as f:
+        header = next(csv.reader(f), None)
+    if not header:
+        raise ValueError(f"{path}: empty CSV")
+    if header[0] == "Time":
+        mode, names, width = MODE_SAMPLES, header[1:], len(header)
+    else:
+        mode, names, width = MODE_EVENTS, [], 6  # a STORM row is the widest
+    numbers = {name: ch for ch, name in enumerate(names)}
+    clock = [-1, 0.0]  # latest edge time with seconds, its seconds
+    try:
+        import pandas
+        parts = list(_csv_frames(pandas, path, mode, width, numbers, names, clock))
+    except ImportError:
+        parts = list(_csv_rows(path, mode, numbers, names, clock))
+    records = np.concatenate(parts) if parts else np.empty(0, dtype=RECORD_DTYPE)
+    return CaptureFile.from_records(records, mode, names, round(clock[0] / clock[1]) if clock[1] else 0)
+
+
+def import_csv(csv_path, capture_path):
+    """Converts a CSV export into a capture file, with its seek index, and
+    returns it parsed (read_csv). The capture gets the CSV's modification
+    time once it is complete, which is how converted_csv tells a current
+    conversion from one cut short or made from an older CSV"""
+    capture = read_csv(csv_path)
+    writer = CaptureWriter(capture_path, capture.mode, dict(enumerate(capture.names)), capture.tick_hz)
+    for begin in range(0, len(capture.records), CHUNK_RECORDS):
+        writer.put(capture.records[begin:begin + CHUNK_RECORDS])
+    writer.close()
+    stat = os.stat(csv_path)
+    os.utime(capture_path, ns=(stat.st_atime_ns, stat.st_mtime_ns))
+    return capture
+
+
+def converted_csv(path):
+    """Path of the capture a CSV export was converted to, <path>.lacap, if
+    it matches the CSV as it is now, else None; with CSV_CONVERT a
+    missing or stale conversion is made first"""
+    converted = path + CONVERTED_SUFFIX
+    if os.path.exists(converted) and os.stat(converted).st_mtime_ns == os.stat(path).st_mtime_ns:
+        return converted
+    if CSV_CONVERT:
+        import_csv(path, converted)
+        return converted
+    return None
+
+
+def open_csv(path):
+    """CaptureFile of a CSV export: its conversion mapped when there is a
+    current one (converted_csv), else the CSV parsed (read_csv)"""
+    converted = converted_csv(path)
+    return CaptureFile(converted) if converted else read_csv(path)
+
+
+def export_csv(capture_path, csv_path, chunk=1 << 20):
+    """Writes the rows the plotters used to log to bitlog.csv; edges get
+    their time in seconds too once the capture's clock is known"""
+    capture = CaptureFile(capture_path)
+    labels = ("falling", "rising")
+    with open(csv_path, 'w', newline='') as f:
+        writer = csv.writer(f)
+        if capture.mode == MODE_SAMPLES:
+            writer.writerow(["Time"] + capture.names)
+        else:
+            writer.writerow(["Channel-Type", "Edge", "Time"] + (["Seconds"] if capture.tick_hz else []))
+        syncs = iter(capture.syncs())
+        drops = iter(capture.drops())
+        storms = iter(capture.storms())
+        spis = iter(zip(*capture.spi_bytes()))
+        samples = iter(zip(*(column.tolist() for column in capture.samples())))
+        for begin in range(0, len(capture.records), chunk):
+            block = capture.records[begin:begin + chunk]
+            for time, channel, value in zip(block['time'].tolist(), block['channel'].tolist(),
+                                            block['value'].tolist()):
+                if channel < CHANNEL_LEVELS_HIGH:
+                    row = [capture.names[channel], labels[value], time]
+                    writer.writerow(row + [f"{time / capture.tick_hz:.9f}"] if capture.tick_hz else row)
+                elif channel == CHANNEL_LEVELS:
+                    time, levels = next(samples)
+                    writer.writerow([time] + [(levels >> ch) & 1 for ch in range(len(capture.names))])
+                elif CHANNEL_UART <= channel < CHANNEL_UART + 16:
+                    kind = channel - CHANNEL_UART
+                    writer.writerow(["UART", capture.names[kind & 0x3], f"{value:02X}", kind >> 2, time])
+                elif CHANNEL_SPI <= channel < CHANNEL_SPI + 4 and not channel & 1:
+                    time, mosi, miso, flags = next(spis)
+                    writer.writerow(["SPI", f"{mosi:02X}", f"{miso:02X}" if flags & SPI_FLAG_MISO else "",
+                                     1 if flags & SPI_FLAG_OVERRUN else 0, time])
+                elif CHANNEL_I2C <= channel < CHANNEL_I2C + 8:
+                    kind = channel - CHANNEL_I2C
+                    writer.writerow(["I2C", I2C_EVENTS[kind >> 1].upper(), f"{value:02X}", kind & 1, time])
+                elif CHANNEL_ANALOG <= channel < CHANNEL_ANALOG + 16:
+                    writer.writerow(["ANALOG", (channel - CHANNEL_ANALOG) << 8 | value, time])
+                elif channel == CHANNEL_DROP_START:
+                    count, start, end = next(drops)
+                    writer.writerow(["DROP", count, start, end])
+                elif channel == CHANNEL_SYNC_FRAME:
+                    writer.writerow(["SYNC", *next(syncs)])
+                elif channel == CHANNEL_TRIGGER:
+                    writer.writerow(["TRIGGER", time])
+                elif channel == CHANNEL_BOARD_SYNC:
+                    writer.writerow(["BOARDSYNC", time, value])
+                elif channel == CHANNEL_LEVEL_SNAPSHOT:
+                    for ch in range(SNAPSHOT_CHANNELS):
+                        if value >> (SNAPSHOT_CHANNELS + ch) & 1:
+                            writer.writerow(["LEVELS", time, capture.names[ch], value >> ch & 1])
+                elif channel == CHANNEL_STORM:
+                    ch, end, count, level, calm = next(storms)
+                    writer.writerow(["STORM", capture.names[ch], count, level, int(calm), end])
+
+
+if __name__ == "__main__":
+    if len(sys.argv) in (3, 4) and sys.argv[1] == "import":
+        start = time.perf_counter()
+        out = sys.argv[3] if len(sys.argv) > 3 else sys.argv[2] + CONVERTED_SUFFIX
+        imported = import_csv(sys.argv[2], out)
+        print(f"{len(imported.records)} records, {len(imported.names)} channels, "
+              f"{imported.tick_hz} Hz clock: {out} in {time.perf_counter() - start:.1f} s")
+    elif len(sys.argv) == 3 and sys.argv[1] == "recover":
+        for segment in index_segments(sys.argv[2]) if sys.argv[2].endswith(INDEX_SUFFIX) else [sys.argv[2]]:
+            print(recover(segment))
+    elif len(sys.argv) == 3:
+        export_csv(sys.argv[1], sys.argv[2])
+    else:
+        print("Usage: python capture_file.py <capture.lacap or .index> <output.csv>\n"
+              "       python capture_file.py import <input.csv> [output.lacap]\n"
+              "       python capture_file.py recover <capture.lacap or .index>")
+        sys.exit(1)
@@ -0,0 +1,166 @@
+"""Finds pulses and UART bytes in a long capture without decoding all of
+it (in python_scripts/common).
+
+  python capture_query.py <capture> pulse <channel> <high|low> <min us>[:<max us>] [all]
+  python capture_query.py <capture> uart <channel> <baud> <byte, hex> [all]
+  python capture_query.py <capture> index
+
+The capture writer summarizes every block of about 100k records it
+writes (capture_file.BlockIndex, bitlog.blocks): per channel the level
+changes in the block and the shortest and longest high and low pulse
+ending in it. A pulse query reads only the blocks whose range of widths
+overlaps the one asked for. A UART query works out the low and high
+runs of the byte's 8N1 frame and reads only the pairs of neighbouring
+blocks whose pulses could hold them, decoding those with the decoder
+core. Either starts a block at its seek index entry, with the levels
+the channels had there, so nothing before it is read.
+
+The first match is printed, or every one with `all`, with the number of
+blocks read. A capture or rotated capture index is searched segment by
+segment. `index` builds the seek index and summaries of a capture
+written without them (la_ingest.c, or before they existed)."""
+import sys
+
+import numpy as np
+
+from capture_file import CaptureFile, INDEX_SUFFIX, NO_PULSE, index_segments, read_blocks, write_index
+from decoder_core import capture_index, decode
+from pipeline import channel_levels
+
+EDGE_SLACK = 0.5  # bit times a UART run may differ from nominal
+
+
+def block_changes(capture, blocks, block, ch):
+    """(times, level before, pulse start) arrays of a channel's level
+    changes in one block, as capture_file.BlockIndex counted them"""
+    cut = capture.blocks(block, block + 1)
+    times, levels = channel_levels(cut.records, ch)
+    levels = levels.astype(np.int64)
+    if cut.known >> ch & 1:
+        before = cut.levels >> ch & 1
+    else:
+        before = levels[0] if len(levels) else 0
+    previous = np.concatenate([[before], levels[:-1]])
+    changed = levels != previous
+    times, ended = times[changed], previous[changed]
+    return times, ended, np.concatenate([[blocks['since'][block][ch]], times[:-1]])
+
+
+def find_pulses(capture, blocks, ch, level, shortest, longest):
+    """(start, width) of each pulse of level between shortest and longest
+    ticks, and the number of blocks read"""
+    stats = blocks[('low', 'high')[level]][:, ch]
+    candidates = np.flatnonzero((stats[:, 1] >= shortest) & (stats[:, 0] <= longest))
+    found = []
+    for block in candidates.tolist():
+        times, ended, starts = block_changes(capture, blocks, block, ch)
+        widths = times - starts
+        hit = (starts >= 0) & (ended == level) & (widths >= shortest) & (widths <= longest)
+        found += zip(starts[hit].tolist(), widths[hit].tolist())
+    return found, len(candidates)
+
+
+def frame_runs(value):
+    """(low runs, high runs) in bits of an 8N1 frame of value; the stop
+    bit's run merges with the idle line, so it is left out"""
+    bits = [0] + [value >> n & 1 for n in range(8)] + [1]
+    runs = []
+    for bit in bits:
+        if runs and runs[-1][0] == bit:
+            runs[-1][1] += 1
+        else:
+            runs.append([bit, 1])
+    runs = runs[:-1]
+    return [n for bit, n in runs if bit == 0], [n for bit, n in runs if bit == 1]
+
+
+def find_uart_byte(capture, blocks, ch, bit_time, value):
+    """Start bit times of the frames of value, and the number of blocks
+    read. A frame that starts in a block ends in it or the next, so
+    each block is judged with the next and decoded through it"""
+    lows, highs = frame_runs(value)
+    candidates = np.ones(len(blocks), dtype=bool)
+    for name, runs in (('low', lows), ('high', highs)):
+        if not runs:
+            continue
+        stats = blocks[name][:, ch]
+        shortest = np.minimum(stats[:, 0], np.append(stats[1:, 0], NO_PULSE[0]))
+        longest = np.maximum(stats[:, 1], np.append(stats[1:, 1], NO_PULSE[1]))
+        candidates &= (longest >= (max(runs) - EDGE_SLACK) * bit_time) & \
+                      (shortest <= (min(runs) + EDGE_SLACK) * bit_time)
+    found = []
+    name = capture.names[ch]
+    for block in np.flatnonzero(candidates).tolist():
+        first = capture.seek['time'][block]
+        after = capture.seek['time'][block + 1] if block + 1 < len(blocks) else None
+        index = capture_index(capture.blocks(block, block + 2), (name,))
+        for event in decode(index, 'uart', channel=name, bit_time=bit_time):
+            if event[0] == 'byte' and event[2] == value and event[1] >= first \
+                    and (after is None or event[1] < after):
+                found.append(event[1])
+    return found, int(candidates.sum())
+
+
+def open_segment(path):
+    """(capture, block summaries) of one capture file"""
+    capture = CaptureFile(path)
+    blocks = read_blocks(path)
+    if len(blocks) < len(capture.seek) or not len(capture.seek):
+        print(f"{path}: no block summaries; run 'python capture_query.py {path} index' first")
+        sys.exit(1)
+    return capture, blocks[:len(capture.seek)]
+
+
+def main():
+    if len(sys.argv) < 3 or sys.argv[2] not in ('pulse', 'uart', 'index'):
+        print("Usage: python capture_query.py <capture> pulse <channel> <high|low> <min us>[:<max us>] [all]")
+        print("       python capture_query.py <capture> uart <channel> <baud> <byte, hex> [all]")
+        print("       python capture_query.py <capture> index")
+        sys.exit(1)
+    path, query = sys.argv[1], sys.argv[2]
+    segments = index_segments(path) if path.endswith(INDEX_SUFFIX) else [path]
+    if query == 'index':
+        for segment in segments:
+            print(f"{segment}: {len(write_index(segment).seek)} blocks indexed")
+        return
+
+    every = sys.argv[-1] == 'all'
+    args = sys.argv[3:-1] if every else sys.argv[3:]
+    if len(args) != 3:
+        print(f"'{query}' takes three arguments, see the usage")
+        sys.exit(1)
+    tick_hz = max(CaptureFile(segment).tick_hz for segment in segments)
+    if not tick_hz:
+        print(f"{path}: the capture's clock is unknown, so widths in us cannot be turned into ticks")
+        sys.exit(1)
+    ticks = lambda us: float(us) * tick_hz / 1e6
+
+    read = total = 0
+    for segment in segments:
+        capture, blocks = open_segment(segment)
+        if args[0] not in capture.names:
+            print(f"{segment}: no channel '{args[0]}', have {', '.join(capture.names)}")
+            sys.exit(1)
+        ch = capture.names.index(args[0])
+        if query == 'pulse':
+            level = 1 if args[1].lower() == 'high' else 0
+            low, _, high = args[2].partition(':')
+            found, count = find_pulses(capture, blocks, ch, level, ticks(low),
+                                       ticks(high) if high else NO_PULSE[0])
+            lines = [f"{start / tick_hz:.6f} s ({start} ticks): {args[1]} for {width * 1e6 / tick_hz:.2f} us"
+                     for start, width in found]
+        else:
+            value = int(args[2], 16)
+            found, count = find_uart_byte(capture, blocks, ch, tick_hz / int(args[1]), value)
+            lines = [f"{start / tick_hz:.6f} s ({start} ticks): 0x{value:02X}" for start in found]
+        read += count
+        total += len(blocks)
+        for line in lines if every else lines[:1]:
+            print(line)
+        if lines and not every:
+            break
+    print(f"{read} of {total} blocks read")
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,364 @@
+"""Serves the live capture to remote clients over TCP or WebSocket, and
+records a served capture on another machine (in python_scripts/common).
+
+  python capture_server.py <host>[:<port>] [out.lacap] [drop|latest|close] [zlib]
+  python capture_server.py view <capture> [port]
+
+The server is a pipeline.Sink, ServerSink, on the plotter's ingest
+pipeline (SERVE_PORT in either plotter, or --serve of the headless
+captures). It collects batches into frames of BATCH_RECORDS, or
+whatever came in FRAME_S, and offers each frame to every client. A client has a bounded queue of
+CLIENT_FRAMES frames and a thread that sends them, so a slow client only
+fills its own queue; what happens then is the client's policy:
+  drop    new frames are skipped until there is room (the default)
+  latest  the oldest queued frame goes, for viewers that want the newest
+  close   the client is disconnected
+Frames a client misses are reported to it in a gap frame. The sink
+itself is lossy like the plot's sinks, so neither ingest nor the capture
+file ever waits for the network.
+
+Wire format, little-endian:
+  hello   a capture file header (capture_file.HEADER, version 2, 384
+          bytes): mode, clock (0 until known) and channel names, so a
+          client can write the stream straight into a .lacap
+  frame   FRAME: magic b'LAFR', kind, codec, records, payload bytes;
+          then the payload
+    FRAME_RECORDS  capture_file.RECORD_DTYPE records, zlib-compressed
+                   with codec CODEC_ZLIB
+    FRAME_CLOCK    no payload; records = the clock in Hz
+    FRAME_GAP      no payload; records = how many this client missed
+A TCP client first sends one line, b'LASTREAM [policy] [zlib]\\n'. A
+WebSocket client opens ws://host:port/?policy=latest&codec=zlib, and
+gets every hello and frame as one binary message.
+
+The view mode serves a recorded capture to browsers instead, as the
+min/max tiles of tile_viewer.py."""
+import base64
+import hashlib
+import queue
+import socket
+import struct
+import sys
+import threading
+import time
+import zlib
+from urllib.parse import parse_qs, urlparse
+
+import numpy as np
+
+from capture_file import CaptureWriter, HEADER, HEADER_SIZES, CHANNELS, MAGIC, NAME_BYTES, RECORD_DTYPE
+from pipeline import Sink
+
+DEFAULT_PORT = 7878
+FRAME = struct.Struct('<4sBBII')
+FRAME_MAGIC = b'LAFR'
+FRAME_RECORDS, FRAME_CLOCK, FRAME_GAP = range(3)
+CODEC_NONE, CODEC_ZLIB = range(2)
+BATCH_RECORDS = 1 << 16  # records per frame at most, 640 KB
+FRAME_S = 0.05  # a frame goes out after this long even if not full
+CLIENT_FRAMES = 32  # queued per client
+POLICIES = ('drop', 'latest', 'close')
+HELLO_LINE = b'LASTREAM'
+WS_GUID = b'258EAFA5-E914-47DA-95CA-C5AB0DC85B11'
+REQUEST_BYTES = 8192  # of a client's first line or HTTP request
+
+
+def hello(mode, names, tick_hz):
+    """The capture header a client gets first"""
+    packed = b''.join((names.get(ch) or '').encode()[:NAME_BYTES].ljust(NAME_BYTES, b'\0')
+                      for ch in range(CHANNELS[2]))
+    return (HEADER.pack(MAGIC, 2, mode, tick_hz) + packed).ljust(HEADER_SIZES[2], b'\0')
+
+
+def ws_message(payload):
+    """One unmasked binary WebSocket frame"""
+    n = len(payload)
+    if n < 126:
+        head = struct.pack('!BB', 0x82, n)
+    elif n < 1 << 16:
+        head = struct.pack('!BBH', 0x82, 126, n)
+    else:
+        head = struct.pack('!BBQ', 0x82, 127, n)
+    return head + payload
+
+
+class Frame:
+    """One batch of records, compressed at most once whatever the number
+    of clients that want it so"""
+
+    def __init__(self, kind, count, payload=b''):
+        self.kind, self.count, self.payload = kind, count, payload
+        self.packed = {}
+        self.lock = threading.Lock()
+
+    def encode(self, codec):
+        with self.lock:
+            if codec not in self.packed:
+                payload = zlib.compress(self.payload, 1) if codec == CODEC_ZLIB and self.payload else self.payload
+                used = codec if self.payload else CODEC_NONE
+                self.packed[codec] = FRAME.pack(FRAME_MAGIC, self.kind, used, self.count, len(payload)) + payload
+            return self.packed[codec]
+
+
+class Client:
+    """A connection and the thread that sends it frames"""
+
+    def __init__(self, conn, address, policy, codec, websocket, first):
+        self.conn = conn
+        self.address = address
+        self.policy = policy
+        self.codec = codec
+        self.websocket = websocket
+        self.queue = queue.Queue(CLIENT_FRAMES)
+        self.missed = 0
+        self.lock = threading.Lock()
+        self.closed = False
+        self._send(first)
+        self.thread = threading.Thread(target=self._run, daemon=True)
+        self.thread.start()
+
+    def _send(self, data):
+        self.conn.sendall(ws_message(data) if self.websocket else data)
+
+    def offer(self, frame):
+        """Queues a frame without waiting; False once the client is gone"""
+        if self.closed:
+            return False
+        try:
+            self.queue.put_nowait(frame)
+            return True
+        except queue.Full:
+            pass
+        if self.policy == 'close':
+            self.close()
+            return False
+        with self.lock:
+            if self.policy == 'latest':
+                try:
+                    self.missed += self.queue.get_nowait().count
+                    self.queue.put_nowait(frame)
+                    return True
+                except (queue.Empty, queue.Full):
+                    pass
+            self.missed += frame.count if frame.kind == FRAME_RECORDS else 0
+        return True
+
+    def _run(self):
+        try:
+            while True:
+                frame = self.queue.get()
+                if frame is None:
+                    return
+                with self.lock:
+                    missed, self.missed = self.missed, 0
+                if missed:
+                    self._send(Frame(FRAME_GAP, missed).encode(CODEC_NONE))
+                self._send(frame.encode(self.codec))
+        except OSError:
+            pass
+        finally:
+            self.close()
+
+    def close(self):
+        if not self.closed:
+            self.closed = True
+            try:
+                self.queue.put_nowait(None)
+            except queue.Full:
+                pass
+            self.conn.close()
+            print(f"capture server: {self.address[0]}:{self.address[1]} left")
+
+
+class ServerSink(Sink):
+    """Serves the pipeline's records to remote clients, see the module doc"""
+
+    def __init__(self, port, mode, names, host=''):
+        self.mode = mode
+        self.names = names
+        self.tick_hz = 0
+        self.clients = []
+        self.clients_lock = threading.Lock()
+        self.batch = []
+        self.batch_records = 0
+        self.batch_started = None
+        self.reported_shed = 0
+        self.listener = socket.create_server((host, port))
+        threading.Thread(target=self._accept, daemon=True).start()
+        print(f"capture server: listening on port {port}")
+        super().__init__()
+
+    def _accept(self):
+        while True:
+            try:
+                conn, address = self.listener.accept()
+            except OSError:
+                return
+            threading.Thread(target=self._greet, args=(conn, address), daemon=True).start()
+
+    def _greet(self, conn, address):
+        """Reads the client's request and adds it"""
+        try:
+            conn.settimeout(5)
+            request = b''
+            while b'\n' not in request or (request.startswith(b'GET ') and b'\r\n\r\n' not in request):
+                data = conn.recv(REQUEST_BYTES)
+                if not data or len(request) > REQUEST_BYTES:
+                    raise OSError("no request")
+                request += data
+            conn.settimeout(None)
+            conn.setsockopt(socket.IPPROTO_TCP, socket.TCP_NODELAY, 1)
+            websocket = request.startswith(b'GET ')
+            if websocket:
+                lines = request.decode('latin-1').split('\r\n')
+                query = parse_qs(urlparse(lines[0].split(' ')[1]).query)
+                key = next(line.split(':', 1)[1].strip() for line in lines
+                           if line.lower().startswith('sec-websocket-key:'))
+                accept = base64.b64encode(hashlib.sha1(key.encode() + WS_GUID).digest()).decode()
+                conn.sendall(("HTTP/1.1 101 Switching Protocols\r\nUpgrade: websocket\r\n"
+                              f"Connection: Upgrade\r\nSec-WebSocket-Accept: {accept}\r\n\r\n").encode())
+                policy = query.get('policy', ['drop'])[0]
+                codec = CODEC_ZLIB if query.get('codec', [''])[0] == 'zlib' else CODEC_NONE
+            else:
+                words = request.split(b'\n')[0].decode('latin-1').split()
+                if not words or words[0] != HELLO_LINE.decode():
+                    raise OSError("not a capture client")
+                policy = next((word for word in words[1:] if word in POLICIES), 'drop')
+                codec = CODEC_ZLIB if 'zlib' in words[1:] else CODEC_NONE
+            client = Client(conn, address, policy if policy in POLICIES else 'drop', codec, websocket,
+                            hello(self.mode, self.names, self.tick_hz))
+        except (OSError, StopIteration, IndexError, UnicodeDecodeError):
+            conn.close()
+            return
+        with self.clients_lock:
+            self.clients.append(client)
+        print(f"capture server: {address[0]}:{address[1]} joined, {policy}"
+              + (", zlib" if codec == CODEC_ZLIB else "") + (", WebSocket" if websocket else ""))
+
+    def _broadcast(self, frame):
+        with self.clients_lock:
+            self.clients = [client for client in self.clients if client.offer(frame)]
+
+    def _send_batch(self):
+        if self.batch:
+            records = np.concatenate(self.batch) if len(self.batch) > 1 else self.batch[0]
+            self._broadcast(Frame(FRAME_RECORDS, len(records), records.tobytes()))
+            self.batch, self.batch_records, self.batch_started = [], 0, None
+
+    def consume(self, records):
+        if self.batch_started is None:
+            self.batch_started = time.monotonic()
+        self.batch.append(records)
+        self.batch_records += len(records)
+        if self.batch_records >= BATCH_RECORDS or time.monotonic() - self.batch_started >= FRAME_S:
+            self._send_batch()
+
+    def tick(self, tick_hz):
+        self.tick_hz = int(tick_hz)
+        self._broadcast(Frame(FRAME_CLOCK, self.tick_hz))
+
+    def gap(self):
+        """The sink itself shed batches: every client missed them"""
+        self._send_batch()
+        missed, self.reported_shed = self.shed - self.reported_shed, self.shed
+        self._broadcast(Frame(FRAME_GAP, missed))
+
+    def finish(self):
+        self._send_batch()
+        self.listener.close()
+        with self.clients_lock:
+            for client in self.clients:
+                try:
+                    client.queue.put_nowait(None)  # after what is queued
+                except queue.Full:
+                    client.close()
+            clients, self.clients = self.clients, []
+        for client in clients:
+            client.thread.join(timeout=5)
+
+
+def read_exact(sock, n):
+    data = bytearray()
+    while len(data) < n:
+        part = sock.recv(n - len(data))
+        if not part:
+            raise EOFError
+        data += part
+    return bytes(data)
+
+
+def receive(host, port, policy='drop', codec=CODEC_NONE):
+    """Connects to a capture server over TCP; yields ('hello', mode,
+    names, tick_hz) first, then ('records', array), ('clock', tick_hz)
+    and ('gap', records missed) as they arrive, until the server closes"""
+    with socket.create_connection((host, port)) as sock:
+        sock.sendall(HELLO_LINE + f" {policy}{' zlib' if codec == CODEC_ZLIB else ''}\n".encode())
+        header = read_exact(sock, HEADER_SIZES[2])
+        magic, _, mode, tick_hz = HEADER.unpack_from(header)
+        if magic != MAGIC:
+            raise ValueError("not a capture server")
+        raw = header[HEADER.size:HEADER.size + CHANNELS[2] * NAME_BYTES]
+        names = {ch: raw[ch * NAME_BYTES:(ch + 1) * NAME_BYTES].rstrip(b'\0').decode()
+                 for ch in range(CHANNELS[2])}
+        yield 'hello', mode, {ch: name for ch, name in names.items() if name}, tick_hz
+        while True:
+            try:
+                magic, kind, used, count, size = FRAME.unpack(read_exact(sock, FRAME.size))
+                payload = read_exact(sock, size)
+            except EOFError:
+                return
+            if magic != FRAME_MAGIC:
+                raise ValueError("lost frame sync")
+            if kind == FRAME_RECORDS:
+                payload = zlib.decompress(payload) if used == CODEC_ZLIB else payload
+                yield 'records', np.frombuffer(payload, RECORD_DTYPE)
+            elif kind == FRAME_CLOCK:
+                yield 'clock', count
+            elif kind == FRAME_GAP:
+                yield 'gap', count
+
+
+def main():
+    if len(sys.argv) < 2 or sys.argv[1] == 'view' and len(sys.argv) not in (3, 4):
+        print("Usage: python capture_server.py <host>[:<port>] [out.lacap] [drop|latest|close] [zlib]\n"
+              "       python capture_server.py view <capture> [port]")
+        sys.exit(1)
+    if sys.argv[1] == 'view':
+        from tile_viewer import serve, VIEW_PORT
+        serve(sys.argv[2], int(sys.argv[3]) if len(sys.argv) > 3 else VIEW_PORT)
+        return
+    host, _, port = sys.argv[1].partition(':')
+    rest = sys.argv[2:]
+    policy = next((word for word in rest if word in POLICIES), 'drop')
+    codec = CODEC_ZLIB if 'zlib' in rest else CODEC_NONE
+    out = next((word for word in rest if word not in POLICIES and word != 'zlib'), 'remote.lacap')
+    writer = None
+    received = missed = 0
+    started = last = time.monotonic()
+    try:
+        for message in receive(host, int(port or DEFAULT_PORT), policy, codec):
+            if message[0] == 'hello':
+                _, mode, names, tick_hz = message
+                writer = CaptureWriter(out, mode, names, tick_hz)
+                print(f"Recording {', '.join(names.values()) or 'the stream'} from {sys.argv[1]} to {out}")
+            elif message[0] == 'records':
+                writer.put(message[1])
+                received += len(message[1])
+            elif message[0] == 'clock':
+                writer.set_tick_hz(message[1])
+            else:
+                missed += message[1]
+            now = time.monotonic()
+            if now - last >= 1:
+                writer.flush()
+                print(f"{now - started:.0f} s: {received} records, {missed} missed", flush=True)
+                last = now
+    except KeyboardInterrupt:
+        pass
+    if writer is not None:
+        writer.close()
+    print(f"{received} records received, {missed} missed")
+
+
+if __name__ == "__main__":
+    main()
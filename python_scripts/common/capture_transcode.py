@@ -0,0 +1,144 @@
+"""Background transcoder of a rotated capture's segments into archives
+(in python_scripts/common).
+
+  python capture_transcode.py <capture .index> [workers] [--watch]
+
+Recording stays a raw append; analysis wants capture_archive.py's
+columnar archive. Each finished segment, bitlog-0003.lacap, is packed
+into bitlog-0003.laarc, which carries the seek index and block summary
+of every block, and its level-of-detail tiles are built into
+bitlog-0003.lod, the file tile_viewer.py reads for the segment or its
+archive. Segments go to a pool of worker processes, one segment each,
+so a backlog of segments packs on as many cores as there are workers.
+
+A segment is finished once the index lists a later one. With --watch
+the index is polled every POLL_S for new segments until standard input
+closes, the sign that recording has stopped; then the last segment is
+finished too. The plotters start it that way with TRANSCODE_WORKERS
+(start()) and close the pipe as they exit, so the last segment is
+packed in the background after the plot window is gone. Without
+--watch the capture is taken as finished and every segment is packed.
+
+Workers run at the lowest priority the OS has and, where affinity can
+be set, off the last core, where ingest_priority.py pins the USB
+reader, so transcoding takes the CPU recording leaves idle. An archive
+is written under a .part name and renamed once complete, so a reader
+never opens half of one; a segment whose archive and tiles are newer
+than it is skipped, so a run picks up where an interrupted one left."""
+import concurrent.futures
+import ctypes
+import os
+import subprocess
+import sys
+import threading
+import time
+
+from capture_archive import pack
+from capture_file import ARCHIVE_SUFFIX, INDEX_SUFFIX, RECORD_DTYPE, index_path, index_segments, seek_path
+from tile_viewer import LOD_SUFFIX, TilePyramid
+
+POLL_S = 5.0  # --watch: index polling period
+PART_SUFFIX = '.part'  # of an archive being written
+WORKER_NICE = 19
+IDLE_PRIORITY_CLASS = 0x40
+
+
+def lower_priority():
+    """Worker start-up: the lowest priority, off the reader's core"""
+    if sys.platform == 'win32':
+        kernel = ctypes.windll.kernel32
+        kernel.SetPriorityClass(kernel.GetCurrentProcess(), IDLE_PRIORITY_CLASS)
+        return
+    os.nice(WORKER_NICE)
+    if hasattr(os, 'sched_setaffinity'):
+        cores = os.sched_getaffinity(0)
+        if len(cores) > 1:
+            os.sched_setaffinity(0, cores - {max(cores)})
+
+
+def up_to_date(segment):
+    """Whether a segment's archive and tiles are newer than it"""
+    made = seek_path(segment, ARCHIVE_SUFFIX), seek_path(segment, LOD_SUFFIX)
+    return all(os.path.exists(path) and os.path.getmtime(path) >= os.path.getmtime(segment) for path in made)
+
+
+def transcode(segment):
+    """Packs one segment into its archive and builds its tiles, in a
+    worker; (records, blocks, raw bytes, archive bytes, seconds)"""
+    start = time.monotonic()
+    archive = seek_path(segment, ARCHIVE_SUFFIX)
+    records, blocks = pack(segment, archive + PART_SUFFIX)
+    os.replace(archive + PART_SUFFIX, archive)
+    TilePyramid(segment)  # saves the .lod, read from the segment's memory map
+    return records, blocks, records * RECORD_DTYPE.itemsize, os.path.getsize(archive), time.monotonic() - start
+
+
+def run(index, workers=None, recording=None):
+    """Transcodes the segments of index with workers processes (None: one
+    per core but the reader's) as they finish; recording, a
+    threading.Event, is set while the capture may still grow (None: it
+    has ended). Returns the segments packed"""
+    workers = workers or max((os.cpu_count() or 2) - 1, 1)
+    pending, tried, packed = {}, set(), []
+    with concurrent.futures.ProcessPoolExecutor(workers, initializer=lower_priority) as pool:
+        while True:
+            ended = recording is None or not recording.is_set()
+            segments = index_segments(index) if os.path.exists(index) else []
+            finished = segments if ended else segments[:-1]
+            for segment in finished:
+                if segment not in tried and not up_to_date(segment):
+                    tried.add(segment)
+                    pending[segment] = pool.submit(transcode, segment)
+            for segment, job in list(pending.items()):
+                if not job.done():
+                    continue
+                del pending[segment]
+                try:
+                    records, blocks, size, archived, seconds = job.result()
+                except (OSError, ValueError) as e:
+                    print(f"{os.path.basename(segment)}: not transcoded ({e})", flush=True)
+                    continue
+                packed.append(segment)
+                print(f"{os.path.basename(segment)}: {records} records in {blocks} blocks, "
+                      f"{size / 1e6:.1f} MB -> {archived / 1e6:.1f} MB ({size / max(archived, 1):.1f}x), "
+                      f"{seconds:.1f} s", flush=True)
+            if ended and not pending:
+                return packed
+            time.sleep(POLL_S if not ended else 0.1)
+
+
+def start(capture_path, workers=None):
+    """Starts the transcoder of the rotated capture capture_path in the
+    background, for a plotter; closing the returned process's stdin
+    tells it recording stopped, and it exits once the last segment is
+    packed"""
+    args = [sys.executable, os.path.join(os.path.dirname(os.path.abspath(__file__)), 'capture_transcode.py'),
+            index_path(capture_path), *([str(workers)] if workers else []), '--watch']
+    return subprocess.Popen(args, stdin=subprocess.PIPE)
+
+
+def main():
+    args = [arg for arg in sys.argv[1:] if arg != '--watch']
+    if len(args) not in (1, 2) or not args[0].endswith(INDEX_SUFFIX):
+        print("Usage: python capture_transcode.py <capture .index> [workers] [--watch]")
+        sys.exit(1)
+    recording = None
+    if '--watch' in sys.argv:
+        recording = threading.Event()
+        recording.set()
+
+        def wait_eof():
+            while sys.stdin.buffer.read(4096):
+                pass
+            recording.clear()
+
+        threading.Thread(target=wait_eof, daemon=True).start()
+    try:
+        packed = run(args[0], int(args[1]) if len(args) > 1 else None, recording)
+    except KeyboardInterrupt:
+        sys.exit(1)
+    print(f"{len(packed)} segments transcoded")
+
+
+if __name__ == "__main__":
+    main()
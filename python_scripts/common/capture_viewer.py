@@ -0,0 +1,236 @@
+"""Browses a capture of any size with its decoded bytes, decoding only
+what is on screen (in python_scripts/common).
+
+  python capture_viewer.py <capture> [baud]
+
+The channel names pick the decoders the way the plotters' roles do
+(pipeline.decoder_lanes): RX and TX are UART at baud (default 115200),
+CLK or SCK with MOSI and MISO SPI, SCL or CLK with SDA I2C.
+
+Only the seek index and block summaries are read up front. Each view
+asks for the seek index blocks that cover it, plus MARGIN of its width
+either side. The cut starts with the levels the seek index holds for
+its first block and takes in the level snapshots inside it, so the
+decoders start there in the right state. A cut of at most DETAIL_BLOCKS
+blocks (about 100k records each) is drawn edge by edge and decoded with
+the decoder core, its labels placed by live_annotations' lanes; a wider
+view is drawn from the block summaries as activity and not decoded. The
+last LRU_WINDOWS decoded cuts are kept, keyed by their block range, so
+panning back or zooming inside one decodes nothing. Memory follows the
+view, not the capture, so captures far larger than RAM can be browsed.
+
+A capture, a rotated capture's index or an archive (capture_archive.py)
+opens the same way. A capture written without a seek index (la_ingest.c)
+needs `python capture_query.py <capture> index` first."""
+import bisect
+import collections
+import sys
+
+import matplotlib.pyplot as plt
+import numpy as np
+
+from capture_archive import Archive
+from capture_file import (ARCHIVE_SUFFIX, BLOCK_CHANNELS, CHANNEL_DROP_START, INDEX_SUFFIX, CaptureFile,
+                          index_segments, read_blocks)
+from decoder_core import capture_index, decode
+from live_annotations import AnnotationLane, label
+from pipeline import bus_type, decoder_lanes
+
+MARGIN = 0.5          # of the view's width decoded either side of it
+DETAIL_BLOCKS = 40    # widest cut drawn edge by edge and decoded
+LRU_WINDOWS = 8       # decoded cuts kept
+DRAW_EDGES = 20_000   # edges of a channel drawn as steps; more show as activity
+ACTIVITY_BINS = 2000  # across the view, for channels drawn as activity
+REDRAW_MS = 150       # after the last pan or zoom step
+ROLES = {'SCK': 'CLK', 'SCL': 'CLK', 'CS': 'SS'}  # channel names to plotter roles
+
+
+class CaptureSource:
+    """Seek index and block summaries of a capture, a rotated capture or
+    an archive, the blocks of all its segments numbered in one run, and
+    cuts of it by block range"""
+
+    def __init__(self, path):
+        self.path = path
+        self.archive = None
+        if path.endswith(ARCHIVE_SUFFIX):
+            self.archive = Archive(path)
+            self.mode, self.names, self.tick_hz = self.archive.mode, self.archive.names, self.archive.tick_hz
+            seek, self.summaries = self.archive.seek, self.archive.summaries
+        else:
+            segments = index_segments(path) if path.endswith(INDEX_SUFFIX) else [path]
+            self.parts = [CaptureFile(segment) for segment in segments]
+            summaries = [read_blocks(segment)[:len(part.seek)] for segment, part in zip(segments, self.parts)]
+            if any(not len(part.seek) or len(blocks) < len(part.seek)
+                   for part, blocks in zip(self.parts, summaries)):
+                raise ValueError(f"{path}: no seek index or block summaries; "
+                                 f"run 'python capture_query.py <capture> index' on it first")
+            self.mode, self.names = self.parts[0].mode, self.parts[0].names
+            self.tick_hz = max(part.tick_hz for part in self.parts)
+            self.firsts = np.cumsum([0] + [len(part.seek) for part in self.parts])  # first block of each
+            seek, self.summaries = np.concatenate([part.seek for part in self.parts]), np.concatenate(summaries)
+        self.times = np.maximum.accumulate(seek['time'])
+        last = self.cut(len(self.times) - 1, len(self.times)).records
+        edges = last['time'][last['channel'] < CHANNEL_DROP_START]
+        self.end = int(edges.max()) if len(edges) else int(self.times[-1])
+
+    def blocks(self, start, end):
+        """(first, after) blocks that can hold records from start to end,
+        found as CaptureFile.window does"""
+        first = max(int(np.searchsorted(self.times, start, side='right')) - 1, 0)
+        after = int(np.searchsorted(self.times, end, side='right'))
+        return first, max(after, first + 1)
+
+    def cut(self, first, after):
+        """Blocks first to after - 1 as a CaptureFile, with the levels
+        before the first"""
+        if self.archive is not None:
+            return self.archive.capture(first, after)
+        part = bisect.bisect_right(self.firsts, first) - 1
+        base = int(self.firsts[part])
+        if after <= self.firsts[part + 1]:
+            return self.parts[part].blocks(first - base, after - base)
+        end = int(self.times[after]) if after < len(self.times) else None  # across segments
+        return CaptureFile(self.path, int(self.times[first]), end).window(int(self.times[first]), end)
+
+
+class Viewer:
+    """The plot of a CaptureSource, redrawn for each view"""
+
+    def __init__(self, source, baud):
+        self.source = source
+        changes = source.summaries['changes']
+        self.channels = [ch for ch in range(min(len(source.names), BLOCK_CHANNELS)) if changes[:, ch].any()] \
+            or list(range(len(source.names)))
+        self.scale = 1 / source.tick_hz if source.tick_hz else 1  # plot units (s, or ticks) per tick
+        self.fig, axes = plt.subplots(len(self.channels), 1, sharex=True, squeeze=False,
+                                      figsize=(12, 1.2 + 1.1 * len(self.channels)))
+        self.axes = dict(zip(self.channels, axes[:, 0]))
+        self.steps, self.activity = {}, {}
+        for ch, ax in self.axes.items():
+            ax.set_ylim(-0.2, 1.5)
+            ax.set_yticks([])
+            ax.set_ylabel(source.names[ch], rotation=0, ha='right', va='center')
+            self.steps[ch], = ax.plot([], [], drawstyle='steps-post', lw=1)
+            self.activity[ch] = None
+        axes[-1, 0].set_xlabel("Time (s)" if source.tick_hz else "Time (ticks)")
+
+        mapping = {ch: ROLES.get(name.upper(), name.upper()) for ch, name in enumerate(source.names)}
+        self.lanes = []  # (protocol, decode options, AnnotationLane)
+        for protocol, lines, lane_ch in decoder_lanes(bus_type(mapping), mapping):
+            if lane_ch not in self.axes:
+                continue
+            names = [None if ch is None else source.names[ch] for ch in lines]
+            if protocol == 'uart':
+                if not source.tick_hz:
+                    print(f"{names[0]}: the capture's clock is unknown, so UART is not decoded")
+                    continue
+                options = dict(channel=names[0], bit_time=source.tick_hz / baud)
+            elif protocol == 'spi':
+                if None in names[1:3]:
+                    print("SPI needs MOSI and MISO channels, not decoded")
+                    continue
+                options = dict(clk=names[0], mosi=names[1], miso=names[2], ss=names[3])
+            else:
+                options = dict(scl=names[0], sda=names[1])
+            self.lanes.append((protocol, options, AnnotationLane(protocol, lines, self.axes[lane_ch])))
+
+        self.windows = collections.OrderedDict()  # (first, after) -> (levels by channel, labels by lane)
+        self.status = self.fig.suptitle("")
+        self.timer = self.fig.canvas.new_timer(interval=REDRAW_MS)
+        self.timer.single_shot = True
+        self.timer.add_callback(self.refresh)
+        first_ax = axes[0, 0]
+        first_ax.set_xlim(source.times[0] * self.scale, source.end * self.scale)
+        first_ax.set_autoscalex_on(False)
+        first_ax.callbacks.connect('xlim_changed', lambda ax: self.timer.start())
+        self.first_ax = first_ax
+
+    def window(self, first, after):
+        """Levels and labels of a block range, decoded or from the LRU"""
+        key = (first, after)
+        if key in self.windows:
+            self.windows.move_to_end(key)
+            return self.windows[key]
+        index = capture_index(self.source.cut(first, after))
+        levels = {}
+        for ch in self.channels:
+            name = self.source.names[ch]
+            times, values = index.line(name)
+            levels[ch] = (times, values, index.first_level(name, 0))
+        labels = []
+        for protocol, options, _ in self.lanes:
+            pairs = [label(event) for event in decode(index, protocol, **options)]
+            labels.append(([t * self.scale for t, _ in pairs], [text for _, text in pairs]))
+        self.windows[key] = levels, labels
+        if len(self.windows) > LRU_WINDOWS:
+            self.windows.popitem(last=False)
+        return self.windows[key]
+
+    def _fill(self, ch, edges, busy):
+        if self.activity[ch] is not None:
+            self.activity[ch].remove()
+            self.activity[ch] = None
+        if busy is not None and busy.any():
+            self.activity[ch] = self.axes[ch].fill_between(edges, 0, np.append(busy, 0), step='post',
+                                                           alpha=0.5, lw=0)
+
+    def refresh(self):
+        lo, hi = self.first_ax.get_xlim()
+        start, end = lo / self.scale, hi / self.scale
+        width = end - start
+        first, after = self.source.blocks(start - MARGIN * width, end + MARGIN * width)
+        if after - first > DETAIL_BLOCKS:
+            self._draw_summary(first, after)
+            self.status.set_text(f"{after - first} blocks in view: activity only, zoom in to decode")
+        else:
+            self._draw_detail(*self.window(first, after), start, end)
+            self.status.set_text(f"blocks {first}-{after - 1} decoded ({len(self.windows)} cached)")
+        self.fig.canvas.draw_idle()
+
+    def _draw_summary(self, first, after):
+        """Activity of every channel from the block summaries"""
+        times = self.source.times
+        edges = np.append(times[first:after], times[after] if after < len(times) else self.source.end) * self.scale
+        for ch in self.channels:
+            self.steps[ch].set_data([], [])
+            self._fill(ch, edges, (self.source.summaries['changes'][first:after, ch] > 0).astype(float))
+        for _, _, lane in self.lanes:
+            lane.times, lane.texts = [], []
+            lane.draw(0, 0)
+
+    def _draw_detail(self, levels, labels, start, end):
+        for ch in self.channels:
+            times, values, initial = levels[ch]
+            i0, i1 = np.searchsorted(times, [start, end])
+            if i1 - i0 > DRAW_EDGES:
+                counts, bins = np.histogram(times[i0:i1], ACTIVITY_BINS, (start, end))
+                self.steps[ch].set_data([], [])
+                self._fill(ch, bins * self.scale, (counts > 0).astype(float))
+                continue
+            before = int(values[i0 - 1]) if i0 else (initial or 0)
+            x = np.concatenate(([start], times[i0:i1], [end])) * self.scale
+            y = np.concatenate(([before], values[i0:i1], [values[i1 - 1] if i1 > i0 else before]))
+            self.steps[ch].set_data(x, y)
+            self._fill(ch, None, None)
+        for (_, _, lane), (times, texts) in zip(self.lanes, labels):
+            lane.times, lane.texts = times, texts
+            lane.draw(start * self.scale, end * self.scale)
+
+
+def main():
+    if len(sys.argv) not in (2, 3):
+        print("Usage: python capture_viewer.py <bitlog.lacap, .index or .laarc> [baud]")
+        sys.exit(1)
+    try:
+        source = CaptureSource(sys.argv[1])
+    except (OSError, ValueError) as e:
+        print(f"Error: {e}")
+        sys.exit(1)
+    viewer = Viewer(source, int(sys.argv[2]) if len(sys.argv) == 3 else 115200)
+    viewer.refresh()
+    plt.show()
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,83 @@
+"""Measures the firmware clock's error against the host's USB frame clock
+from the SOF pairs of a capture (SOF_SYNC_FRAMES builds) and, given the
+analyzer's port, stores it on the device with host command 'L'. Shared by
+both script folders (python_scripts/common).
+
+  python clock_calibrate.py bitlog.lacap [port]
+  python clock_calibrate.py clear <port>     forgets the stored correction
+
+The capture's clock, from the firmware's 'V' reply, already includes any
+correction stored before, so the error measured against it is added to
+that correction. Frame count against clock time is fitted by least
+squares over the whole capture; a few minutes of capture pin the error
+to well under 0.1 ppm. From then on the 'V' reply, and with it the
+header of every capture and every decoder reading one, gives the
+calibrated rate.
+
+Flash is written with the page erased first, which stalls the device
+for about 20 ms: send it while nothing is capturing. The port is opened
+as a CDC serial port; USB_VENDOR_CLASS builds are not supported here."""
+import struct
+import sys
+
+import numpy as np
+
+from capture_file import CaptureFile
+
+FRAME_S = 1e-3  # full-speed USB frame
+MIN_SPAN_S = 30.0  # shorter captures are refused
+BAUDRATE = 115200
+CLOCK_TRIM_CLEAR = -0x80000000  # 'L' argument: forget the stored correction
+
+def fit_pairs(syncs):
+    """(ticks per frame, its standard error, seconds covered) of the SOF
+    pairs after the device last enumerated"""
+    frames = np.array([frame for frame, _, _ in syncs], dtype=np.int64)
+    clocks = np.array([clock for _, clock, _ in syncs], dtype=np.int64) & 0xFFFFFFFF
+    restart = np.flatnonzero(np.diff(frames) <= 0)
+    if len(restart):
+        frames, clocks = frames[restart[-1] + 1:], clocks[restart[-1] + 1:]
+    if len(frames) < 3:
+        return None, None, 0.0
+    clocks = np.concatenate(([0], np.cumsum(np.diff(clocks) & 0xFFFFFFFF)))
+    x = (frames - frames[0]).astype(np.float64)
+    y = clocks.astype(np.float64)
+    (rate, _), residuals, _, _, _ = np.polyfit(x, y, 1, full=True)
+    sxx = ((x - x.mean()) ** 2).sum()
+    spread = np.sqrt(residuals[0] / (len(x) - 2)) if len(residuals) else 0.0
+    return rate, spread / np.sqrt(sxx), x[-1] * FRAME_S
+
+def send_trim(port, ppb):
+    import serial
+    with serial.Serial(port, BAUDRATE, timeout=1) as ser:
+        ser.write(struct.pack('<ci', b'L', ppb))
+        ser.flush()
+
+def main():
+    if len(sys.argv) not in (2, 3) or (sys.argv[1] == 'clear' and len(sys.argv) != 3):
+        print("Usage: python clock_calibrate.py <capture.lacap> [port] | clear <port>")
+        sys.exit(1)
+    if sys.argv[1] == 'clear':
+        send_trim(sys.argv[2], CLOCK_TRIM_CLEAR)
+        print("Correction cleared; the next 'V' reply gives the nominal clock")
+        return
+    capture = CaptureFile(sys.argv[1])
+    if not capture.tick_hz:
+        print("The capture does not know its clock: record it after the firmware's 'V' reply")
+        sys.exit(1)
+    rate, error, span = fit_pairs(capture.syncs())
+    if rate is None or span < MIN_SPAN_S:
+        print(f"Need SOF pairs covering {MIN_SPAN_S:.0f} s, the capture has {span:.1f} s "
+              f"(SOF_SYNC_FRAMES firmware)")
+        sys.exit(1)
+
+    nominal = capture.tick_hz * FRAME_S
+    ppm = (rate / nominal - 1) * 1e6
+    print(f"{span:.0f} s of SOF pairs: the {capture.tick_hz:.0f} Hz clock runs at "
+          f"{rate / FRAME_S:.1f} Hz, {ppm:+.3f} ppm (+-{error / nominal * 1e6:.3f})")
+    if len(sys.argv) == 3:
+        send_trim(sys.argv[2], round(ppm * 1000))
+        print("Stored on the device; its next 'V' reply gives the corrected clock")
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,74 @@
+"""Maps firmware clock times to host time using the SOF pairs the firmware
+streams in-band (SOF_SYNC_FRAMES builds).
+
+On a USB start of frame the firmware latches its timestamp clock, and
+every few frames it sends the pair (frame count, clock time). Frames are
+1 ms of the host controller's clock, so:
+- clock time against frame count is a line whose slope is the firmware
+  clock's real rate (drift) and whose intercept is its phase;
+- a pair reaches the host some time after its frame started, never
+  before, so the earliest arrival minus frame count * 1 ms over recent
+  pairs is when frame 0 started on the host clock (offset).
+Both are refitted over a sliding window of pairs, so they follow
+temperature drift and the host's own clock."""
+import time
+from collections import deque
+
+FRAME_S = 1e-3  # full-speed USB frame
+
+
+class ClockSync:
+
+    def __init__(self, window=600):
+        self.pairs = deque(maxlen=window)  # (frame, extended clock, host arrival)
+        self.rate = None    # firmware clock ticks per frame
+        self.origin = None  # (frame, clock) on the fitted line
+        self.offset = None  # host time of frame 0
+
+    def _extend(self, clock):
+        """Places a raw 32-bit clock value nearest to the latest pair"""
+        if not self.pairs:
+            return clock
+        last = self.pairs[-1][1]
+        diff = (clock - last) & 0xFFFFFFFF
+        if diff >= 1 << 31:
+            diff -= 1 << 32
+        return last + diff
+
+    def add(self, frame, clock, arrival=None):
+        """Adds one SOF pair; arrival is the host time it was read at"""
+        if arrival is None:
+            arrival = time.perf_counter()
+        if self.pairs and frame <= self.pairs[-1][0]:
+            self.pairs.clear()  # the device re-enumerated: frames restart
+        self.pairs.append((frame, self._extend(clock), arrival))
+
+        self.offset = min(a - f * FRAME_S for f, _, a in self.pairs)
+        if len(self.pairs) < 2:
+            return
+        # least squares of clock against frame, relative to the first pair
+        f0, c0, _ = self.pairs[0]
+        n = len(self.pairs)
+        mean_f = sum(f - f0 for f, _, _ in self.pairs) / n
+        mean_c = sum(c - c0 for _, c, _ in self.pairs) / n
+        sxx = sum((f - f0 - mean_f) ** 2 for f, _, _ in self.pairs)
+        sxy = sum((f - f0 - mean_f) * (c - c0 - mean_c) for f, c, _ in self.pairs)
+        if sxx == 0:
+            return
+        self.rate = sxy / sxx
+        self.origin = (f0 + mean_f, c0 + mean_c)
+
+    def drift_ppm(self, clock_hz):
+        """Firmware clock error against the USB frame clock, given its
+        nominal rate in Hz"""
+        if self.rate is None:
+            return None
+        return (self.rate / (clock_hz * FRAME_S) - 1) * 1e6
+
+    def to_host(self, clock):
+        """Host time (time.perf_counter() scale) of a raw 32-bit firmware
+        clock value close to the latest pair, or None before two pairs"""
+        if self.rate is None:
+            return None
+        frame = self.origin[0] + (self._extend(clock) - self.origin[1]) / self.rate
+        return self.offset + frame * FRAME_S
@@ -0,0 +1,122 @@
+"""Decode cache of serial_decoder.py and polling_decoder.py, their
+DECODE_CACHE option (in python_scripts/common).
+
+A decode's events are kept next to the capture, in <capture>.decodes/,
+as an event_output .laev file named by a key: a hash of the capture's
+content, the decode window and the decoder parameters as they were
+asked for (a baud rate left to detection stays None). Repeating a decode
+with the same parameters, e.g. only to switch STRUCTURED_OUTPUT, maps
+that file instead of loading the capture and decoding it again. A JSON
+sidecar per entry holds what the decoder reported beside its events,
+such as an estimated baud rate. An I2C, SPI or UART entry also gets its
+value index (value_index.py), built from the events as they are
+stored, or on the first load of an entry cached without one.
+
+The content hash, BLAKE2b over the capture file or a rotated capture's
+index and segments, is remembered in digest.json with the files' sizes
+and modification times, so it is only recomputed when the capture
+changes. Entries are written under a temporary name and renamed, so an
+interrupted decode, or batch workers decoding the same group at once,
+never leave a partial one; `rm -r <capture>.decodes` clears them."""
+import hashlib
+import json
+import os
+
+from capture_file import INDEX_SUFFIX, index_segments
+from event_output import EventWriter, decoder_events, read_events
+import value_index
+
+CACHE_SUFFIX = '.decodes'
+HASH_BLOCK = 1 << 23  # bytes hashed per read
+
+
+def _save_json(path, value):
+    temporary = f"{path}.{os.getpid()}.tmp"
+    with open(temporary, 'w') as f:
+        json.dump(value, f)
+    os.replace(temporary, path)
+
+
+class DecodeCache:
+    """The cached decodes of one capture; window as load_index's"""
+
+    def __init__(self, path, window=None):
+        self.path = path
+        self.folder = path + CACHE_SUFFIX
+        self.window = list(window) if window else None
+        self._digest = None
+
+    def digest(self):
+        """Hex BLAKE2b of the capture's content, from digest.json while
+        the files are unchanged"""
+        if self._digest is not None:
+            return self._digest
+        files = [self.path] + (index_segments(self.path) if self.path.endswith(INDEX_SUFFIX) else [])
+        stamp = [[os.path.basename(name), st.st_size, st.st_mtime_ns]
+                 for name, st in ((name, os.stat(name)) for name in files)]
+        memo = os.path.join(self.folder, 'digest.json')
+        try:
+            with open(memo) as f:
+                known = json.load(f)
+            if known['stamp'] == stamp:
+                self._digest = known['digest']
+                return self._digest
+        except (OSError, ValueError, KeyError):
+            pass
+        h = hashlib.blake2b(digest_size=16)
+        for name in files:
+            with open(name, 'rb') as f:
+                for block in iter(lambda: f.read(HASH_BLOCK), b''):
+                    h.update(block)
+        self._digest = h.hexdigest()
+        try:
+            os.makedirs(self.folder, exist_ok=True)
+            _save_json(memo, {'stamp': stamp, 'digest': self._digest})
+        except OSError:
+            pass  # a read-only capture folder: hashed again next time
+        return self._digest
+
+    def _base(self, protocol, params):
+        key = json.dumps([self.digest(), self.window, protocol, params], sort_keys=True)
+        return os.path.join(self.folder, hashlib.blake2b(key.encode(), digest_size=12).hexdigest())
+
+    def load(self, protocol, params):
+        """(info, {source: events}) of a cached decode, info with the
+        capture's tick_hz, or None"""
+        base = self._base(protocol, params)
+        try:
+            with open(base + '.json') as f:
+                info = json.load(f)
+            tick_hz, sources, records = read_events(base + '.laev')
+        except (OSError, ValueError):
+            return None
+        if len(records) != info.get('events'):
+            return None
+        if protocol in value_index.PROTOCOLS and not os.path.exists(base + value_index.VALUE_SUFFIX):
+            self._index(base + value_index.VALUE_SUFFIX, protocol, tick_hz, records)
+        info['tick_hz'] = tick_hz
+        return info, {source: decoder_events(records[records['source'] == number], protocol)
+                      for number, source in enumerate(sources)}
+
+    def store(self, protocol, params, tick_hz, decoded, **info):
+        """Caches {source: events} of a decode with what else it reported"""
+        try:
+            os.makedirs(self.folder, exist_ok=True)
+            base = self._base(protocol, params)
+            temporary = f"{base}.{os.getpid()}.tmp"
+            with EventWriter(temporary, tick_hz, decoded) as out:
+                for source, events in decoded.items():
+                    out.write(source, protocol, events)
+            _save_json(base + '.json', dict(info, protocol=protocol, params=params, events=out.count))
+            if protocol in value_index.PROTOCOLS:
+                self._index(base + value_index.VALUE_SUFFIX, protocol, tick_hz, read_events(temporary)[2])
+            os.replace(temporary, base + '.laev')
+        except OSError as e:
+            print(f"Decode cache not written: {e}")
+
+    def _index(self, path, protocol, tick_hz, records):
+        """Writes the value index of an entry's events"""
+        try:
+            value_index.write(path, protocol, tick_hz, records, value_index.seek_times(self.path))
+        except (OSError, ValueError) as e:
+            print(f"Value index not written: {e}")
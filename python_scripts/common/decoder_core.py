@@ -0,0 +1,588 @@
+"""Decoder core shared by serial_decoder.py and polling_decoder.py (in
+python_scripts/common). load_index() reads an edge or a poll sample
+capture, a rotated capture's index or a CSV export of either into one
+TransitionIndex: for every channel, sorted arrays of the times its level
+changed and the level after each, plus the lost regions. Poll samples
+are reduced to their level changes on loading, so the decoders see the
+same edges whichever firmware took the capture.
+
+Protocol decoders register with @protocol(name) and take the index and
+their options; decode(index, name, ...) runs one. Each returns its
+events in time order, tuples that start with the kind and the time:
+  'uart'  ('byte', t, value, parity ok, stop bit level)
+          ('lost', t) for a frame overlapping a lost region
+  'spi'   ('byte', t, mosi, miso), ('lost', t, bits discarded)
+  'i2c'   the pipeline.I2cStream events, ('lost', t) for a transaction
+          cut short
+  'onewire', 'ws2812'  ('reset', t, presence, None for WS2812),
+          ('byte', t, value), ('lost', t) for either cut short
+the time being that of the start bit, the last bit, the I2C event, the
+reset or a pulse byte's first bit.
+A channel the firmware decoded as UART itself (UART_DECODE) has no
+edges but its bytes; the 'uart' decoder returns those as they are, and
+the 'spi' decoder likewise the bytes of the firmware's SPI sniffer
+(CAPTURE_SPI_DMA), with ('lost', t, 0) ahead of one after an overrun,
+and the 'i2c' decoder what the firmware's I2C framing sent (I2C_SNIFF).
+The chunked decoders (pipeline.decode_chunks) yield the same kinds.
+
+decode_parallel(index, name, ...) returns what decode() does, over every
+core: a fast pass over the bus finds where its decoder is idle (a UART
+line high for longer than a frame, an I2C STOP, an SPI SS deassertion,
+a 1-Wire reset), the bus is cut there into a piece per core, and the
+pieces are decoded in a process pool and joined."""
+import heapq
+import itertools
+import multiprocessing
+import os
+
+import numpy as np
+
+import decoder_kernels as kernels
+from capture_file import (CaptureFile, MODE_SAMPLES, UART_FRAMING_ERROR, UART_PARITY_ERROR,
+                          SPI_FLAG_MISO, SPI_FLAG_OVERRUN, I2C_EVENTS, INDEX_SUFFIX, i2c_events,
+                          ARCHIVE_SUFFIX, index_segments, is_capture_file, converted_csv, read_csv)
+from capture_archive import Archive
+from pipeline import (I2cStream, ONEWIRE_US, ONEWIRE_OVERDRIVE_US, edge_levels, level_changes, merge_lines,
+                      onewire_decode, pulses, ws2812_decode)
+
+PROTOCOLS = {}  # name -> decoder(index, **options)
+POPCOUNT = np.array([bin(byte).count('1') for byte in range(256)], dtype=np.uint8)  # numpy < 2 has no bitwise_count
+SPLITTERS = {}  # name -> splitter(index, **options): (idle times, the bus's change times)
+PARALLEL_MIN_CHANGES = 200_000  # a bus with fewer changes decodes in one piece, a pool costs more
+
+
+class BitPlanes:
+    """Poll samples bit-sliced: each channel's level in every sample packed
+    into a plane of its own, 64 samples a word, sample i being bit i % 64
+    of word i // 64 in every plane. A level costs one bit whatever the
+    channel count, and a channel's changes come out of whole words: the
+    plane XOR itself shifted on by one sample, the previous word's top
+    bit carried in, counted by popcount, and only the words holding a
+    change unpacked to find them"""
+
+    def __init__(self, levels, numbers):
+        """levels hold channel n in bit n; numbers are the channels kept"""
+        levels = np.asarray(levels, dtype='<u2')
+        self.count = len(levels)
+        self.numbers = list(numbers)
+        words = -(-self.count // 64)
+        self.planes = np.zeros((len(self.numbers), words), dtype='<u8')
+        for k, number in enumerate(self.numbers):
+            packed = np.packbits(((levels >> number) & 1).astype(np.uint8), bitorder='little')
+            self.planes[k].view(np.uint8)[:len(packed)] = packed
+
+    def first(self, k):
+        """Level of plane k's first sample"""
+        return int(self.planes[k, 0] & np.uint64(1)) if self.count else None
+
+    def change_words(self, k):
+        """Plane k's change words: bit i set where sample i differs from
+        sample i - 1; never for the first sample"""
+        plane = self.planes[k]
+        if not self.count:
+            return plane
+        carry = np.empty_like(plane)
+        carry[0] = plane[0] & np.uint64(1)  # the first sample compares with itself
+        carry[1:] = plane[:-1] >> np.uint64(63)
+        changes = plane ^ ((plane << np.uint64(1)) | carry)
+        if self.count % 64:
+            changes[-1] &= np.uint64((1 << (self.count % 64)) - 1)  # the padding after the last sample
+        return changes
+
+    def transitions(self, k):
+        """How often plane k's level changes, without finding where"""
+        return int(POPCOUNT[self.change_words(k).view(np.uint8)].sum(dtype=np.int64))
+
+    def changes(self, k):
+        """(sample numbers, levels after) of plane k's changes"""
+        changes = self.change_words(k)
+        busy = np.flatnonzero(changes)
+        word, bit = np.nonzero(np.unpackbits(changes[busy].view(np.uint8), bitorder='little').reshape(-1, 64))
+        rows = busy[word] * 64 + bit
+        plane = self.planes[k]
+        levels = (plane[rows >> 6] >> (rows & 63).astype(np.uint64)) & np.uint64(1)
+        return rows, levels.astype(np.int64)
+
+
+class TransitionIndex:
+    """Every channel of a capture as (times, levels) int64 arrays of its
+    level changes in time order, with the level before the first change
+    when the capture knows it (poll samples, level snapshots). tick_hz is
+    the capture's clock, 0 if unknown; drops the sorted (start, end) lost regions;
+    sample_period the (mean, std) tick spacing of the first poll samples,
+    None for edges; uart the bytes the firmware decoded, by channel, and
+    spi the (times, PB5 bytes, PB15 bytes, flags) its SPI sniffer
+    received and i2c the (times, events, bytes, flags) its I2C framing
+    sent, None without any"""
+
+    def __init__(self, names, tick_hz=0, drops=(), sample_period=None):
+        self.names = list(names)
+        self.tick_hz = tick_hz
+        self.drops = sorted(drops)
+        self.sample_period = sample_period
+        self.lines = {}     # name -> (times, levels)
+        self.initial = {}   # name -> level before the first change
+        self.uart = {}      # name -> (times, bytes, status) decoded on the device
+        self.spi = None
+        self.i2c = None
+
+    def add(self, name, times, levels, initial=None):
+        """Adds a channel from (times, levels) in time order that may
+        repeat a level; only the changes are kept"""
+        times = np.asarray(times, dtype=np.int64)
+        levels = np.asarray(levels, dtype=np.int64)
+        changed = np.ones(len(levels), dtype=bool)
+        changed[1:] = levels[1:] != levels[:-1]
+        if initial is not None and len(levels):
+            changed[0] = levels[0] != initial
+        self.lines[name] = (times[changed], levels[changed])
+        if initial is not None:
+            self.initial[name] = int(initial)
+
+    def add_samples(self, channels, times, levels):
+        """Adds channels, a {number: name} dict, from poll samples whose
+        levels hold channel n in bit n. The samples are bit-sliced
+        (BitPlanes), so each channel's changes are found 64 samples at a
+        time in one bit per sample"""
+        times = np.asarray(times, dtype=np.int64)
+        levels = np.asarray(levels, dtype='<u2')
+        if not len(levels):
+            for name in channels.values():
+                self.add(name, times, levels)
+            return
+        planes = BitPlanes(levels, sorted(channels))
+        for k, number in enumerate(planes.numbers):
+            rows, after = planes.changes(k)
+            name = channels[number]
+            self.lines[name] = (times[rows], after)
+            self.initial[name] = planes.first(k)
+
+    def __contains__(self, name):
+        return name in self.lines
+
+    def line(self, name):
+        """(times, levels) of a channel; empty arrays for a missing one"""
+        empty = np.empty(0, dtype=np.int64)
+        return self.lines.get(name, (empty, empty))
+
+    def first_level(self, name, idle):
+        """Level of a channel before its first change: the capture's if it
+        knows it, else idle"""
+        return self.initial.get(name, idle)
+
+    def edges(self, name, level):
+        """Times a channel changed to level"""
+        times, levels = self.line(name)
+        return times[levels == level]
+
+    def levels_at(self, name, times, idle=0):
+        """Levels of a channel at each of times, all at once; first_level()
+        before its first change and idle throughout for a missing one"""
+        line_times, levels = self.line(name)
+        before = self.first_level(name, idle)
+        if not len(line_times):
+            return np.full(len(times), before, dtype=np.int64)
+        i = np.searchsorted(line_times, times, side='right')
+        return np.where(i > 0, levels[np.maximum(i - 1, 0)], before)
+
+    def merged(self, *names):
+        """(times, lines, levels) arrays of the changes of several
+        channels merged in time order, lines numbering them in the order
+        given; at equal times the earlier channel comes first"""
+        return merge_lines(*(self.line(name) for name in names))
+
+    def add_storms(self, storms):
+        """Adds the summary windows of rate-limited channels, (name, window
+        end) pairs, to the lost regions: a window starts at its channel's
+        last change or summary before it"""
+        previous = {}
+        for name, end in sorted(storms, key=lambda storm: storm[1]):
+            times = self.line(name)[0]
+            k = int(np.searchsorted(times, end, side='right'))
+            start = previous.get(name, int(times[k - 1]) if k else end)
+            if k:
+                start = max(start, int(times[k - 1]))
+            previous[name] = end
+            self.drops.append((start, end))
+        self.drops.sort()
+
+    def cut(self, start, end):
+        """The changes at or after start and before end (None: open) as an
+        index of their own, with each channel's level before start as its
+        first level and the lost regions that reach into the cut. The
+        bytes the firmware decoded are left out"""
+        drops = [(s, e) for s, e in self.drops
+                 if (start is None or e >= start) and (end is None or s < end)]
+        part = TransitionIndex(self.names, self.tick_hz, drops, self.sample_period)
+        for name, (times, levels) in self.lines.items():
+            lo = 0 if start is None else int(np.searchsorted(times, start))
+            hi = len(times) if end is None else int(np.searchsorted(times, end))
+            part.lines[name] = (times[lo:hi], levels[lo:hi])
+            initial = int(levels[lo - 1]) if lo else self.initial.get(name)
+            if initial is not None:
+                part.initial[name] = initial
+        return part
+
+    def drops_between(self, starts, ends):
+        """True for each [starts[k], ends[k]] that touches a lost region"""
+        if not self.drops:
+            return np.zeros(len(starts), dtype=bool)
+        first = np.array([s for s, _ in self.drops], dtype=np.int64)
+        last = np.maximum.accumulate(np.array([e for _, e in self.drops], dtype=np.int64))
+        i = np.searchsorted(first, ends, side='right') - 1
+        return (i >= 0) & (last[np.maximum(i, 0)] >= starts)
+
+
+def load_index(path, names=None, window=None):
+    """TransitionIndex of a capture, rotated capture index or CSV export,
+    with only the channels in names if given; raises FileNotFoundError
+    for a missing file. window, (start, end) seconds with end None for
+    the end of the capture, loads only that stretch of a capture through
+    its seek index (CaptureFile.window), at the same cost whatever the
+    capture's size; the index may run a block either side of it. An
+    archive (capture_archive.py) is unpacked block by block, only the
+    blocks of the window if given. A CSV export is parsed by
+    capture_file.read_csv, or its conversion mapped if it has a current
+    one (capture_file.converted_csv)"""
+    if path.endswith(ARCHIVE_SUFFIX):
+        archive = Archive(path)
+        if not window:
+            return capture_index(archive.capture(), names)
+        if not archive.tick_hz:
+            raise ValueError(f"{path}: the capture's clock is unknown, so a window in seconds cannot be found")
+        start, end = (None if s is None else int(s * archive.tick_hz) for s in window)
+        return capture_index(archive.window(start, end), names)
+    if not is_capture_file(path):
+        path = converted_csv(path) or path
+    if is_capture_file(path):
+        return capture_index(_open_window(path, window) if window else CaptureFile(path), names)
+    if window:
+        raise ValueError(f"{path}: a window needs a capture file; convert the CSV export with "
+                         f"`python capture_file.py import {path}`")
+    return capture_index(read_csv(path), names)
+
+
+def _open_window(path, window):
+    """CaptureFile.window of a capture or of the segments of a rotated one
+    that cover window, (start, end) seconds"""
+    segments = index_segments(path) if path.endswith(INDEX_SUFFIX) else [path]
+    tick_hz = max((CaptureFile(segment).tick_hz for segment in segments), default=0)
+    if not tick_hz:
+        raise ValueError(f"{path}: the capture's clock is unknown, so a window in seconds cannot be found")
+    start, end = (None if s is None else int(s * tick_hz) for s in window)
+    return CaptureFile(path, start, end).window(start, end)
+
+
+def _period(times):
+    """(mean, std) spacing of the first 1000 poll samples, or None"""
+    diffs = np.diff(times[:1000])
+    diffs = diffs[diffs > 0]
+    return (float(np.mean(diffs)), float(np.std(diffs))) if len(diffs) else None
+
+
+def capture_index(capture, names=None):
+    """TransitionIndex of an open CaptureFile, or a cut of one, with only
+    the channels in names if given"""
+    drops = [(start, end) for _, start, end in capture.drops()]
+    if capture.mode == MODE_SAMPLES:
+        times, values = capture.samples()
+        index = TransitionIndex(capture.names, capture.tick_hz, drops, _period(times))
+        index.add_samples({ch: name for ch, name in enumerate(capture.names)
+                           if names is None or name in names}, times, values)
+        return index
+    index = TransitionIndex(capture.names, capture.tick_hz, drops)
+    for ch, name in enumerate(capture.names):
+        if names is not None and name not in names:
+            continue
+        times, edges = capture.edges(ch)
+        if len(times) > 1 and (times[1:] < times[:-1]).any():  # a capture out of its own order
+            order = np.argsort(times, kind='stable')
+            times, edges = times[order], edges[order]
+        known = capture.known >> ch & 1 if ch < 16 else 0
+        _add_edges(index, name, times, edges, *capture.level_snapshots(ch),
+                   initial=capture.levels >> ch & 1 if known else None)
+        times, values, status = capture.uart_bytes(ch)
+        if len(times):
+            index.uart[name] = (times, values.astype(np.int64), status)
+    spi = capture.spi_bytes()
+    if len(spi[0]):
+        index.spi = spi
+    i2c = capture.i2c_frames()
+    if len(i2c[0]):
+        index.i2c = i2c
+    index.add_storms([(capture.names[ch], end) for ch, end, _, _, _ in capture.storms()
+                      if names is None or capture.names[ch] in names])
+    return index
+
+
+def _add_edges(index, name, times, levels, snap_times, snap_levels, initial=None):
+    """Adds an edge channel with its level snapshots: a snapshot ahead of
+    every edge gives the level before the first change, and a later one
+    that disagrees puts back the change an edge lost to the firmware;
+    initial is the level before the records, if known (a seek window)"""
+    if not len(times) and not len(snap_times) and initial is None:
+        return
+    if initial is None and len(snap_times) and (not len(times) or snap_times[0] < times[0]):
+        initial = int(snap_levels[0])
+    index.add(name, *edge_levels(times, levels, snap_times, snap_levels), initial)
+
+
+def protocol(name):
+    """Registers a decoder(index, **options) under name"""
+    def register(decoder):
+        PROTOCOLS[name] = decoder
+        return decoder
+    return register
+
+
+def decode(index, name, **options):
+    """Events of one registered protocol decoder over an index"""
+    if name not in PROTOCOLS:
+        raise ValueError(f"unknown protocol '{name}', have {', '.join(sorted(PROTOCOLS))}")
+    return PROTOCOLS[name](index, **options)
+
+
+def splitter(name):
+    """Registers splitter(index, **options) of the protocol called name,
+    with its decoder's options: the sorted times its decoder is idle at
+    and can start afresh from, and the bus's change times"""
+    def register(split):
+        SPLITTERS[name] = split
+        return split
+    return register
+
+
+def split(index, name, parts, **options):
+    """Up to parts - 1 times to cut one protocol's bus at, idle points
+    spread evenly over its changes; none with a lost region between the
+    bus's changes either side of it, and none on a bus the firmware
+    decoded or of under PARALLEL_MIN_CHANGES changes"""
+    if name not in SPLITTERS or parts < 2:
+        return []
+    idle, changes = SPLITTERS[name](index, **options)
+    if not len(idle) or len(changes) < PARALLEL_MIN_CHANGES:
+        return []
+    if index.drops:
+        k = np.searchsorted(changes, idle)
+        before = np.minimum(changes[np.maximum(k - 1, 0)], idle)
+        after = np.maximum(changes[np.minimum(k, len(changes) - 1)], idle)
+        idle = idle[~index.drops_between(before, after)]
+    targets = changes[np.arange(1, parts) * len(changes) // parts]
+    k = np.searchsorted(idle, targets)
+    return sorted(set(idle[k[k < len(idle)]].tolist()))
+
+
+def _decode_piece(index, name, options):
+    return decode(index, name, **options)
+
+
+def decode_parallel(index, name, workers=None, **options):
+    """decode() over every core, or workers: the bus is cut at its idle
+    points (split) into a piece per worker, each piece decoded in a
+    process pool and the events joined, the same events as decode()
+    returns. A bus that cannot be split, or a caller that is a pool
+    worker itself, decodes in one piece"""
+    bounds = [] if multiprocessing.current_process().daemon else \
+        split(index, name, workers or os.cpu_count() or 1, **options)
+    if not bounds:
+        return decode(index, name, **options)
+    pieces = [index.cut(start, end) for start, end in zip([None] + bounds, bounds + [None])]
+    with multiprocessing.Pool(len(pieces)) as pool:
+        decoded = pool.starmap(_decode_piece, [(piece, name, options) for piece in pieces])
+    return list(itertools.chain.from_iterable(decoded))  # the pieces are in time order
+
+
+def pack_msb_first(bits):
+    """Bytes of consecutive groups of 8 bits, MSB first"""
+    values = np.zeros(len(bits) // 8, dtype=np.int64)
+    for i in range(8):
+        values = (values << 1) | bits[i:len(values) * 8:8]
+    return values
+
+
+@protocol('uart')
+def decode_uart(index, channel, bit_time, data_bits=8, parity='N', stop_bits=1):
+    """UART frames on one channel, bit_time in ticks. A frame starts at a
+    falling edge after at least 0.8 bit times high whose low lasts at
+    least half a bit; every frame's bits are sampled at once, mid-bit.
+    Bytes the firmware decoded from the channel are returned as they are"""
+    if channel in index.uart:
+        starts, values, status = index.uart[channel]
+        return [('byte', t, value, not flags & UART_PARITY_ERROR, 0 if flags & UART_FRAMING_ERROR else 1)
+                for t, value, flags in zip(starts.tolist(), values.tolist(), status.tolist())]
+    times, levels = index.line(channel)
+    falling = levels == 0
+    idle = np.diff(times, prepend=times[:1])
+    low = np.concatenate([np.diff(times), [-1]])
+    valid = (idle > bit_time * 0.8) & (low >= bit_time * 0.5)
+    if len(valid):
+        valid[0] = low[0] >= bit_time * 0.5  # nothing before the first edge to check
+    starts = times[falling & valid]
+
+    def level_after(bit_offset):
+        return index.levels_at(channel, starts + int(bit_time * bit_offset), idle=1)
+    parity = parity.upper()
+    bits = [level_after(1.5 + i) for i in range(data_bits)]
+    values = np.zeros(len(starts), dtype=np.int64)
+    for i, bit in enumerate(bits):
+        values |= bit << i  # LSB first
+    parity_ok = np.ones(len(starts), dtype=bool)
+    if parity in ('E', 'O'):
+        ones = sum(bits, np.zeros(len(starts), dtype=np.int64)) + level_after(1.5 + data_bits)
+        parity_ok = ones % 2 == (1 if parity == 'O' else 0)
+    stop = level_after(1.5 + data_bits + (1 if parity in ('E', 'O') else 0))
+    frame_bits = 1 + data_bits + (1 if parity in ('E', 'O') else 0) + stop_bits
+    lost = index.drops_between(starts, starts + int(bit_time * frame_bits))
+
+    return [('lost', t) if gone else ('byte', t, value, ok, stop_bit)
+            for t, value, ok, stop_bit, gone in zip(starts.tolist(), values.tolist(), parity_ok.tolist(),
+                                                    stop.tolist(), lost.tolist())]
+
+
+@splitter('uart')
+def split_uart(index, channel, bit_time, data_bits=8, parity='N', stop_bits=1):
+    """Start bits after the line idled high for longer than a frame: the
+    frame before has been sampled in full"""
+    times, levels = index.line(channel)
+    if channel in index.uart:
+        return times[:0], times
+    frame = bit_time * (1 + data_bits + (1 if parity.upper() in ('E', 'O') else 0) + stop_bits)
+    idle = np.diff(times, prepend=times[:1])
+    return times[(levels == 0) & (idle > frame)], times
+
+
+@protocol('spi')
+def decode_spi(index, clk, mosi, miso, ss=None, clock_polarity=0, clock_phase=0):
+    """SPI bytes of a bus, all clock edges sampled at once. With an ss
+    channel only edges while it is low count, and every SS assertion
+    starts a new byte; a byte also starts after a lost region (clock
+    edges may be missing in it), where a partial one is discarded. Bytes
+    the firmware's SPI sniffer received are returned as they are"""
+    if index.spi is not None:
+        events = []
+        for t, mosi_byte, miso_byte, flags in zip(*(column.tolist() for column in index.spi)):
+            if flags & SPI_FLAG_OVERRUN:
+                events.append(('lost', t, 0))
+            events.append(('byte', t, mosi_byte, miso_byte))
+        return events
+    # mode 0 and 3 sample on the rising edge, 1 and 2 on the falling one
+    clk_times = index.edges(clk, 1 if clock_polarity == clock_phase else 0)
+    transfer = None
+    if ss is not None and ss in index:
+        ss_levels = index.line(ss)[1]
+        idle = 1 - int(ss_levels[0]) if len(ss_levels) else 1
+        clk_times = clk_times[index.levels_at(ss, clk_times, idle) == 0]
+        transfer = np.searchsorted(index.edges(ss, 0), clk_times, side='right')  # SS assertions so far
+
+    n = len(clk_times)
+    starts = np.zeros(n, dtype=bool)
+    lost = index.drops_between(clk_times[:-1], clk_times[1:]) if n else starts
+    if n:
+        starts[0] = True
+        starts[1:] = lost if transfer is None else lost | (transfer[1:] != transfer[:-1])
+    first = np.flatnonzero(starts)
+    run = np.diff(np.concatenate([first, [n]])) if n else first  # edges per run of bits
+    owner = np.cumsum(starts) - 1
+    position = np.arange(n) - first[owner]
+    whole = position < (run - run % 8)[owner]
+
+    sampled = clk_times[whole]
+    events = [('byte', t, mosi_byte, miso_byte) for t, mosi_byte, miso_byte in zip(
+        sampled[7::8].tolist(), pack_msb_first(index.levels_at(mosi, sampled)).tolist(),
+        pack_msb_first(index.levels_at(miso, sampled)).tolist())]
+    losses = []
+    if n:
+        for k in (np.flatnonzero(lost) + 1).tolist():
+            bits = int(run[owner[k] - 1]) % 8
+            if bits:
+                losses.append(('lost', int(clk_times[k - 1]), bits))
+    return list(heapq.merge(events, losses, key=lambda event: event[1]))  # both in time order
+
+
+@splitter('spi')
+def split_spi(index, clk, mosi, miso, ss=None, clock_polarity=0, clock_phase=0):
+    """SS deassertions: the next assertion starts a new byte anyway. A bus
+    without an SS channel has no idle point"""
+    clk_times = index.line(clk)[0]
+    if index.spi is not None or ss is None or ss not in index:
+        return clk_times[:0], clk_times
+    return index.edges(ss, 1), clk_times
+
+
+@splitter('i2c')
+def split_i2c(index, scl, sda):
+    """Just after each STOP, SDA rising while SCL is high: the bus is
+    free and both lines high"""
+    changes = index.merged(scl, sda)[0]
+    if index.i2c is not None:
+        return changes[:0], changes
+    rises = index.edges(sda, 1)
+    return rises[index.levels_at(scl, rises, 1) == 1] + 1, changes
+
+
+@protocol('i2c')
+def decode_i2c(index, scl, sda):
+    """I2cStream events of one pass over the SCL and SDA changes merged in
+    time order. Edges may be missing across a lost region: the
+    transaction in progress is dropped and decoding resumes at the next
+    START. What the firmware's I2C framing sent is returned as it is"""
+    if index.i2c is not None:
+        return list(i2c_events(*(column.tolist() for column in index.i2c)))
+    times, lines, levels = index.merged(scl, sda)
+    stream = I2cStream(index.first_level(scl, 1), index.first_level(sda, 1))
+    drops = [start for start, _ in index.drops]
+    ends = np.searchsorted(times, drops, side='right').tolist() + [len(times)]
+    if not kernels.JIT:  # the Python loop runs faster over lists
+        times, lines, levels = times.tolist(), lines.tolist(), levels.tolist()
+    events = []
+    begin = 0
+    for drop_start, end in zip(drops + [None], ends):
+        end = max(end, begin)
+        events += stream.feed(times[begin:end], lines[begin:end], levels[begin:end])
+        if drop_start is not None and stream.lost():
+            events.append(('lost', drop_start))
+        begin = end
+    return events
+
+
+def _decode_pulses(index, channel, decode, idle, **options):
+    """decode (pipeline.onewire_decode or ws2812_decode) over one line's
+    changes, each stretch between lost regions at once; a byte or reset
+    cut short by one is ('lost', drop start)"""
+    times, levels = level_changes(*index.line(channel), index.first_level(channel, idle))
+    drops = [start for start, _ in index.drops]
+    ends = np.searchsorted(times, drops, side='right').tolist() + [len(times)]
+    events = []
+    begin = 0
+    for drop_start, end in zip(drops + [None], ends):
+        end = max(end, begin)
+        found, keep = decode(times[begin:end], levels[begin:end], final=drop_start is None, **options)
+        events += found
+        if drop_start is not None and len(pulses(times[begin + keep:end], levels[begin + keep:end], 1 - idle)[0]):
+            events.append(('lost', drop_start))
+        begin = end
+    return events
+
+
+@protocol('onewire')
+def decode_onewire(index, channel, tick_hz, overdrive=False):
+    """1-Wire resets, presence pulses and bytes on one channel, every low
+    pulse classed by its width at once (pipeline.onewire_decode)"""
+    return _decode_pulses(index, channel, onewire_decode, 1, tick_hz=tick_hz, overdrive=overdrive)
+
+
+@splitter('onewire')
+def split_onewire(index, channel, tick_hz, overdrive=False):
+    """The start of each reset pulse: it ends any byte before it"""
+    times, levels = index.line(channel)
+    starts, widths, _ = pulses(times, levels, 0)
+    reset = (ONEWIRE_OVERDRIVE_US if overdrive else ONEWIRE_US)['reset'] * tick_hz / 1e6
+    return times[starts[widths >= reset]], times
+
+
+@protocol('ws2812')
+def decode_ws2812(index, channel, tick_hz, threshold_ns=625, reset_us=50):
+    """WS2812-style LED data on one channel, every high pulse classed by
+    its width at once (pipeline.ws2812_decode)"""
+    return _decode_pulses(index, channel, ws2812_decode, 0, tick_hz=tick_hz, threshold_ns=threshold_ns,
+                          reset_us=reset_us)
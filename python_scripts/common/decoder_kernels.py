@@ -0,0 +1,169 @@
+"""Compiled inner loops of the streaming decoders (in
+python_scripts/common): numba nopython kernels over numpy edge arrays, which
+pipeline.UartStream and pipeline.I2cStream run when numba is installed
+(`pip install numba`). Without it JIT is False and the streams keep
+their pure Python loops, with the same results.
+
+The decoder core's UART and SPI decoders and SpiStream already sample
+every bit at once with numpy. What stays a loop is the edge by edge
+state of the streaming UART frame search and of the I2C state machine,
+which the decoder core's 'i2c' decoder runs too; those are compiled
+here. A kernel takes its stream's state as a small int64 array, updates
+it in place and writes what it completes to arrays allocated by the
+caller, at most one entry per edge (plus one for UART's idle line),
+returning how many it wrote. The first call of each compiles it, which
+cache=True keeps on disk for the next run."""
+
+try:
+    from numba import njit
+except ImportError:
+    njit = None
+
+JIT = njit is not None
+
+# I2C event kinds written by i2c_feed
+I2C_START, I2C_STOP, I2C_ADDRESS, I2C_DATA = range(4)
+# i2c_feed's state array: SCL, SDA, state (I2cStream.IDLE...), byte kind
+# (0 address, 1 data), value, bit count, byte time (-1 none)
+# UART parity codes
+PARITY_CODES = {'N': 0, 'E': 1, 'O': 2}
+
+
+def _compiled(function):
+    return njit(cache=True, nogil=True)(function) if JIT else None
+
+
+def _level_at(edge_t, edge_l, count, t):
+    """Level of a frame in progress at t; low before its first edge"""
+    level = 0
+    for k in range(count):
+        if edge_t[k] > t:
+            break
+        level = edge_l[k]
+    return level
+
+
+level_at = _compiled(_level_at)
+
+
+def _uart_value(edge_t, edge_l, count, bit_time, data_bits, parity, stop_offset):
+    """Byte of a frame in progress sampled mid-bit, -1 for a framing or
+    parity error"""
+    start = edge_t[0]
+    value = 0
+    ones = 0
+    for i in range(data_bits):
+        bit = level_at(edge_t, edge_l, count, start + bit_time * (1.5 + i))
+        value |= bit << i
+        ones += bit
+    ok = level_at(edge_t, edge_l, count, start + stop_offset) == 1
+    if parity != 0:
+        ones += level_at(edge_t, edge_l, count, start + bit_time * (1.5 + data_bits))
+        ok = ok and ones % 2 == (1 if parity == 2 else 0)
+    return value if ok else -1
+
+
+uart_value = _compiled(_uart_value)
+
+
+def _uart_feed(times, levels, bit_time, data_bits, parity, stop_offset, max_edges,
+               state, edge_t, edge_l, now, has_now, out_t, out_v):
+    """UartStream.feed over arrays. state: line level, edges of the frame
+    in progress (0 for none), which edge_t and edge_l hold from its start
+    bit; out_v -1 for a bad frame"""
+    level = state[0]
+    count = state[1]
+    n = 0
+    for k in range(len(times)):
+        t = times[k]
+        if levels[k] == level:
+            continue
+        level = levels[k]
+        if count and t > edge_t[0] + stop_offset:
+            out_t[n] = edge_t[0]
+            out_v[n] = uart_value(edge_t, edge_l, count, bit_time, data_bits, parity, stop_offset)
+            n += 1
+            count = 0
+        if count == 0:
+            if level == 0:
+                edge_t[0] = t
+                edge_l[0] = 0
+                count = 1
+            continue
+        edge_t[count] = t
+        edge_l[count] = level
+        count += 1
+        if count == 2 and t - edge_t[0] < bit_time / 2:
+            count = 0  # a glitch, not a start bit
+        elif count > max_edges:
+            out_t[n] = edge_t[0]  # noise, not a frame
+            out_v[n] = -1
+            n += 1
+            count = 0
+    if count and has_now and now > edge_t[0] + stop_offset:
+        out_t[n] = edge_t[0]
+        out_v[n] = uart_value(edge_t, edge_l, count, bit_time, data_bits, parity, stop_offset)
+        n += 1
+        count = 0
+    state[0] = level
+    state[1] = count
+    return n
+
+
+uart_feed = _compiled(_uart_feed)
+
+
+def _i2c_feed(times, lines, levels, state, out_kind, out_t, out_a, out_b, out_c):
+    """I2cStream.feed over arrays: out_kind I2C_*, out_a the repeated
+    flag of a start, the address or the byte, out_b the read flag of an
+    address, out_c the ack"""
+    scl, sda, mode, kind = state[0], state[1], state[2], state[3]
+    value, count, byte_time = state[4], state[5], state[6]
+    n = 0
+    for k in range(len(times)):
+        t = times[k]
+        level = levels[k]
+        if lines[k] == 1:
+            if level != sda and scl:
+                if level == 0:
+                    out_kind[n] = I2C_START
+                    out_t[n] = t
+                    out_a[n] = mode != 0
+                    n += 1
+                    mode, kind, value, count = 1, 0, 0, 0  # shifting in the address
+                elif mode != 0:
+                    out_kind[n] = I2C_STOP
+                    out_t[n] = t
+                    n += 1
+                    mode = 0
+            sda = level
+            continue
+        rising = level != 0 and scl == 0
+        scl = level
+        if not rising or mode == 0:
+            continue
+        if mode == 3:  # the ack bit
+            out_t[n] = byte_time
+            out_c[n] = sda == 0
+            if kind == 0:
+                out_kind[n] = I2C_ADDRESS
+                out_a[n] = value >> 1
+                out_b[n] = value & 1
+            else:
+                out_kind[n] = I2C_DATA
+                out_a[n] = value
+            n += 1
+            mode, kind, value, count = 2, 1, 0, 0
+            continue
+        if count == 0:
+            byte_time = t
+        value = (value << 1) | sda
+        count += 1
+        if count == 8:
+            mode = 3
+    state[0], state[1], state[2], state[3] = scl, sda, mode, kind
+    state[4], state[5], state[6] = value, count, byte_time
+    return n
+
+
+i2c_feed = _compiled(_i2c_feed)
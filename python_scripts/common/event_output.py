@@ -0,0 +1,205 @@
+"""Structured decoder output, the decoders' STRUCTURED_OUTPUT option
+(in python_scripts/common): every decoded event as a record with
+its integer timestamp, for tools that post-process a decode rather than
+read it.
+
+Two formats, picked by the file extension:
+  .jsonl  JSON Lines: a header object, {"format": "laevents", "version",
+    "tick_hz", "sources"}, then one object per event with the fields of
+    EVENT_DTYPE, source and kind by name
+  .laev   binary, little-endian: header HEADER (magic b'LAEVENTS', format
+    version, number of sources, timestamp clock in Hz, 0 if unknown),
+    the sources' NAME_BYTES NUL-padded UTF-8 names, then EVENT_DTYPE
+    records back to back up to the end of the file; read_events maps it
+
+A record is time(8) kind(1) source(1) flags(1) pad(1) value(2) aux(2):
+  time    ticks of the capture's clock (CPU cycles for a poll capture)
+  kind    index into KINDS: a UART byte, an SPI byte (value MOSI, aux
+    MISO), an I2C start, stop, address or data byte, lost data (value
+    = the SPI bits discarded), a 1-Wire or WS2812 byte or reset
+  source  index into the header's sources: the UART channel, SPI or I2C,
+    the 1-Wire or WS2812 channel
+  flags   FLAG_*; FLAG_ERROR marks a UART frame whose byte is unknown
+
+Events are packed BATCH at a time and written in one call through a
+WRITE_BUFFER file buffer, so the cost of a large decode is the decoder's
+rather than that of formatting and writing a line per event.
+`python event_output.py <events.laev> <events.jsonl>` converts a binary
+file to JSON Lines."""
+import itertools
+import json
+import os
+import struct
+import sys
+
+import numpy as np
+
+MAGIC = b'LAEVENTS'
+VERSION = 1
+HEADER = struct.Struct('<8sHHd')  # the source names follow
+NAME_BYTES = 16
+EVENT_DTYPE = np.dtype([('time', '<i8'), ('kind', 'u1'), ('source', 'u1'), ('flags', 'u1'),
+                        ('pad', 'u1'), ('value', '<u2'), ('aux', '<u2')])
+KINDS = ('uart', 'spi', 'start', 'stop', 'address', 'data', 'lost', 'wire', 'reset')
+KIND = {kind: n for n, kind in enumerate(KINDS)}
+
+FLAG_ERROR = 1      # UART: framing or parity error, the byte is unknown
+FLAG_PARITY = 2     # UART: parity error
+FLAG_STOP = 4       # UART: stop bit not high
+FLAG_ACK = 8        # I2C address or data byte acknowledged
+FLAG_READ = 16      # I2C address: read
+FLAG_REPEATED = 32  # I2C start: repeated start
+FLAG_PRESENCE = 64  # 1-Wire reset: a device answered it
+
+BATCH = 1 << 16  # events packed per write
+WRITE_BUFFER = 1 << 20
+
+
+def event_fields(protocol, event):
+    """(kind, flags, value, aux) of a decoder event. protocol says what a
+    'byte' is: decoder_core's UART events carry parity and stop bit, the
+    chunked decoder's None for a bad frame"""
+    kind = event[0]
+    if kind == 'lost':
+        return KIND['lost'], 0, event[2] if len(event) > 2 else 0, 0
+    if kind == 'start':
+        return KIND['start'], FLAG_REPEATED if event[2] else 0, 0, 0
+    if kind == 'stop':
+        return KIND['stop'], 0, 0, 0
+    if kind == 'address':
+        return KIND['address'], (FLAG_READ if event[3] else 0) | (FLAG_ACK if event[4] else 0), event[2], 0
+    if kind == 'data':
+        return KIND['data'], FLAG_ACK if event[3] else 0, event[2], 0
+    if kind == 'reset':
+        return KIND['reset'], FLAG_PRESENCE if event[2] else 0, 0, 0
+    if protocol in ('onewire', 'ws2812'):
+        return KIND['wire'], 0, event[2], 0
+    if protocol == 'spi':
+        return KIND['spi'], 0, event[2], event[3]
+    if event[2] is None:
+        return KIND['uart'], FLAG_ERROR, 0, 0
+    flags = 0
+    if len(event) > 3:
+        flags = (0 if event[3] else FLAG_PARITY) | (0 if event[4] == 1 else FLAG_STOP)
+    return KIND['uart'], flags, event[2], 0
+
+
+class EventWriter:
+    """Writes decoder events to path, .jsonl or .laev. sources names what
+    write() is given events of, in order; use as a context manager or
+    close() it"""
+
+    def __init__(self, path, tick_hz, sources):
+        self.path = path
+        self.binary = not path.endswith('.jsonl')
+        self.sources = list(sources)
+        self.count = 0
+        self.f = open(path, 'wb', buffering=WRITE_BUFFER)
+        if self.binary:
+            self.f.write(HEADER.pack(MAGIC, VERSION, len(self.sources), tick_hz or 0.0))
+            self.f.write(b''.join(name.encode()[:NAME_BYTES].ljust(NAME_BYTES, b'\0')
+                                  for name in self.sources))
+        else:
+            self.f.write((json.dumps({"format": "laevents", "version": VERSION, "tick_hz": tick_hz or 0,
+                                      "sources": self.sources}) + "\n").encode())
+            self.prefix = [json.dumps(name) for name in self.sources]
+
+    def write(self, source, protocol, events):
+        """Appends the events of one source, any iterable of decoder
+        events (a generator is consumed BATCH at a time); returns how
+        many"""
+        return self.write_tagged((source, protocol, event) for event in events)
+
+    def write_tagged(self, tagged):
+        """Appends (source, protocol, event) items, e.g. several
+        sources merged in time order; returns how many"""
+        number = {name: n for n, name in enumerate(self.sources)}
+        tagged = iter(tagged)
+        written = 0
+        while True:
+            batch = [(round(event[1]), kind, number[source], flags, 0, value, aux)
+                     for source, protocol, event in itertools.islice(tagged, BATCH)
+                     for kind, flags, value, aux in (event_fields(protocol, event),)]
+            if not batch:
+                break
+            records = np.array(batch, dtype=EVENT_DTYPE)
+            if self.binary:
+                self.f.write(records.tobytes())
+            else:
+                self.f.write(self._lines(records))
+            written += len(records)
+        self.count += written
+        return written
+
+    def _lines(self, records):
+        name = self.prefix
+        return "".join(
+            f'{{"time":{t},"source":{name[s]},"kind":"{KINDS[k]}","flags":{fl},"value":{v},"aux":{a}}}\n'
+            for t, k, s, fl, _, v, a in records.tolist()).encode()
+
+    def close(self):
+        self.f.close()
+
+    def __enter__(self):
+        return self
+
+    def __exit__(self, *exc):
+        self.close()
+
+
+def decoder_events(records, protocol):
+    """The decoder events EVENT_DTYPE records were written from, as
+    decoder_core's decoders return them (event_fields in reverse)"""
+    events = []
+    for t, kind, _, flags, _, value, aux in records.tolist():
+        kind = KINDS[kind]
+        if kind == 'lost':
+            events.append(('lost', t, value) if protocol == 'spi' else ('lost', t))
+        elif kind == 'uart':
+            events.append(('byte', t, None) if flags & FLAG_ERROR else
+                          ('byte', t, value, not flags & FLAG_PARITY, 0 if flags & FLAG_STOP else 1))
+        elif kind == 'spi':
+            events.append(('byte', t, value, aux))
+        elif kind == 'start':
+            events.append(('start', t, bool(flags & FLAG_REPEATED)))
+        elif kind == 'stop':
+            events.append(('stop', t))
+        elif kind == 'address':
+            events.append(('address', t, value, bool(flags & FLAG_READ), bool(flags & FLAG_ACK)))
+        elif kind == 'wire':
+            events.append(('byte', t, value))
+        elif kind == 'reset':
+            events.append(('reset', t, bool(flags & FLAG_PRESENCE) if protocol == 'onewire' else None))
+        else:
+            events.append(('data', t, value, bool(flags & FLAG_ACK)))
+    return events
+
+
+def read_events(path):
+    """(tick_hz, sources, records) of a .laev file, the records an
+    EVENT_DTYPE memmap"""
+    with open(path, 'rb') as f:
+        header = f.read(HEADER.size)
+        if len(header) < HEADER.size:
+            raise ValueError(f"{path}: too short for an event file")
+        magic, version, count, tick_hz = HEADER.unpack(header)
+        if magic != MAGIC or version != VERSION:
+            raise ValueError(f"{path}: not a version {VERSION} event file")
+        names = f.read(count * NAME_BYTES)
+    sources = [names[i:i + NAME_BYTES].rstrip(b'\0').decode() for i in range(0, len(names), NAME_BYTES)]
+    offset = HEADER.size + count * NAME_BYTES
+    records = (os.path.getsize(path) - offset) // EVENT_DTYPE.itemsize  # a partial last record is ignored
+    if records <= 0:
+        return tick_hz, sources, np.zeros(0, EVENT_DTYPE)
+    return tick_hz, sources, np.memmap(path, EVENT_DTYPE, 'r', offset, (records,))
+
+
+if __name__ == "__main__":
+    if len(sys.argv) != 3 or not sys.argv[1].endswith('.laev') or not sys.argv[2].endswith('.jsonl'):
+        print("Usage: python event_output.py <events.laev> <events.jsonl>")
+        sys.exit(1)
+    tick_hz, sources, records = read_events(sys.argv[1])
+    with EventWriter(sys.argv[2], tick_hz, sources) as out:
+        for start in range(0, len(records), BATCH):
+            out.f.write(out._lines(np.asarray(records[start:start + BATCH])))
+    print(f"{len(records)} events written to {sys.argv[2]}")
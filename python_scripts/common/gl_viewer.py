@@ -0,0 +1,265 @@
+"""OpenGL waveform viewer, the plotters' VIEWER = "gl" backend.
+
+Matplotlib rebuilds every visible point in Python each frame, which
+stops keeping up at a few hundred thousand edges. Here each channel's
+steps live in a vertex buffer on the GPU: a frame uploads only the edges
+that arrived since the last one, and panning or zooming only changes
+the shader's view uniforms, so millions of edges per channel draw at
+the display rate. When a channel's buffer fills, its older half is
+dropped and the rest uploaded again, the only full upload.
+
+A vertex is float32 (time high, time low, level). float32 holds a tick
+count exactly only up to 2^24, so a time, relative to the first one the
+viewer saw, is split into a multiple of 65536 and the rest; the shader
+takes the view start off each half before scaling. Single ticks stay
+apart for 2^40 ticks, over four hours at 72 MHz.
+
+Needs vispy and a Qt binding (pip install vispy pyqt6). The wheel zooms
+around the pointer and dragging pans; either stops the view following
+new data, 'f' follows again."""
+import numpy as np
+from vispy import app, gloo, visuals
+
+from capture_file import CHANNEL_DROP_START, CHANNEL_DROP_END
+from pipeline import channel_levels, level_changes
+
+TRACE_EDGES = 1 << 21  # edges kept per channel on the GPU, 48 MB of vertices each
+DROP_REGIONS = 1 << 12  # lost regions kept for shading
+FRAME_S = 1 / 60
+ZOOM_STEP = 1.25  # span factor per wheel notch
+LANE_MARGIN = 0.15  # of a lane's height, above and below its trace
+NAME_WIDTH = 100  # pixels left of the traces for the channel names
+STEP_COLOR = (0.3, 0.8, 1.0, 1.0)
+DROP_COLOR = (1.0, 0.0, 0.0, 0.3)
+
+VERTEX_SHADER = """
+attribute vec3 a_vertex;  // time high, time low, level
+uniform vec2 u_start;     // view start, split the same way
+uniform float u_scale;    // clip units per tick
+uniform float u_left;     // clip x of the view start
+uniform vec2 u_lane;      // clip y of level 0, clip height of level 1
+void main()
+{
+    float x = ((a_vertex.x - u_start.x) + (a_vertex.y - u_start.y)) * u_scale;
+    gl_Position = vec4(u_left + x, u_lane.x + a_vertex.z * u_lane.y, 0.0, 1.0);
+}
+"""
+
+FRAGMENT_SHADER = """
+uniform vec4 u_color;
+void main()
+{
+    gl_FragColor = u_color;
+}
+"""
+
+
+def split_times(times):
+    """float32 (high, low) halves of int64 tick times, see the module doc"""
+    times = np.asarray(times, np.int64)
+    return (times & ~0xFFFF).astype(np.float32), (times & 0xFFFF).astype(np.float32)
+
+
+def step_vertices(times, before, after):
+    """Two vertices per level change: the level before it and after it,
+    both at its time, so a line strip through them draws the steps"""
+    high, low = split_times(times)
+    vertices = np.empty((2 * len(times), 3), np.float32)
+    vertices[:, 0] = np.repeat(high, 2)
+    vertices[:, 1] = np.repeat(low, 2)
+    vertices[0::2, 2] = before
+    vertices[1::2, 2] = after
+    return vertices
+
+
+def span_vertices(starts, ends):
+    """Two triangles per region, level 0 to 1"""
+    corners = np.array([[0, 0], [1, 0], [1, 1], [0, 0], [1, 1], [0, 1]])  # (end?, level)
+    times = np.where(corners[:, 0], np.asarray(ends)[:, None], np.asarray(starts)[:, None]).ravel()
+    vertices = np.empty((len(times), 3), np.float32)
+    vertices[:, 0], vertices[:, 1] = split_times(times)
+    vertices[:, 2] = np.tile(corners[:, 1], len(starts))
+    return vertices
+
+
+class VertexStore:
+    """The vertices of one draw call, in a GPU buffer with a copy kept
+    here; appended in place, and when full the older half is dropped, in
+    whole groups of `group` vertices, and the rest uploaded again"""
+
+    def __init__(self, capacity, group):
+        self.data = np.zeros((capacity, 3), np.float32)
+        self.buffer = gloo.VertexBuffer(self.data)
+        self.group = group
+        self.count = 0
+
+    def append(self, vertices, spare=0):
+        """spare vertices past the end stay free for set_tail"""
+        half = len(self.data) // 2
+        vertices = vertices[len(vertices) - min(len(vertices), (half // self.group - 1) * self.group):]
+        if self.count + len(vertices) + spare > len(self.data):
+            keep = min(self.count, half) // self.group * self.group
+            self.data[:keep] = self.data[self.count - keep:self.count]
+            self.count = keep
+            self.buffer.set_subdata(self.data[:keep])
+        self.data[self.count:self.count + len(vertices)] = vertices
+        self.buffer.set_subdata(vertices, offset=self.count)
+        self.count += len(vertices)
+
+    def set_tail(self, vertex):
+        """Writes one vertex past the end, drawn by view(1) until the next append"""
+        self.data[self.count] = vertex
+        self.buffer.set_subdata(self.data[self.count:self.count + 1], offset=self.count)
+
+    def view(self, extra=0):
+        return self.buffer[0:self.count + extra]
+
+
+class WaveViewer(app.Canvas):
+    """One lane per channel, top to bottom, fed from the SharedRing the
+    ingest process writes"""
+
+    def __init__(self, names, ring, follow_window, title, wrap_bits=None):
+        """names: {channel: name}; follow_window: ticks shown while
+        following; wrap_bits: the width of the record times if they wrap
+        (the poll stream's 32-bit cycle times), None for 64-bit ticks"""
+        app.Canvas.__init__(self, title=title, size=(1200, 100 * len(names)), keys='interactive')
+        self.ring = ring
+        self.channels = list(names)
+        self.wrap = 1 << wrap_bits if wrap_bits else None
+        self.clock = {}  # wrap_bits: each channel's last raw time and its unwrapped time
+        self.traces = {ch: VertexStore(2 * TRACE_EDGES + 2, 2) for ch in names}
+        self.levels = {}  # each channel's level after its latest change
+        self.drops = VertexStore(6 * DROP_REGIONS, 6)
+        self.program = gloo.Program(VERTEX_SHADER, FRAGMENT_SHADER)
+        self.origin = None  # tick time the vertices count from
+        self.latest = 0
+        self.span = float(follow_window)
+        self.start = -self.span
+        self.follow = True
+        self.drag = None  # (pointer x, view start) of a pan in progress
+        self.names = visuals.TextVisual(list(names.values()), color='white', font_size=10,
+                                        anchor_x='left', anchor_y='center')
+        self.status = visuals.TextVisual('', color='gray', font_size=8, anchor_x='right', anchor_y='bottom')
+        gloo.set_state(clear_color='black', blend=True, blend_func=('src_alpha', 'one_minus_src_alpha'))
+        self.timer = app.Timer(FRAME_S, connect=self.on_timer, start=True)
+        self.show()
+
+    def _unwrap(self, ch, raw):
+        raw = np.asarray(raw, np.int64)
+        last_raw, last_time = self.clock.get(ch, (int(raw[0]), int(raw[0])))
+        step = np.diff(raw, prepend=last_raw) % self.wrap
+        step = np.where(step >= self.wrap // 2, step - self.wrap, step)
+        times = last_time + np.cumsum(step)
+        self.clock[ch] = int(raw[-1]), int(times[-1])
+        return times
+
+    def add(self, records):
+        """Appends the level changes and lost regions among records"""
+        for ch in self.channels:
+            times, levels = channel_levels(records, ch)
+            if not len(times):
+                continue
+            times = self._unwrap(ch, times) if self.wrap else times.astype(np.int64)
+            if self.origin is None:
+                self.origin = int(times[0])
+            times = times - self.origin
+            self.latest = max(self.latest, int(times[-1]))
+            level = self.levels.get(ch, 1 - int(levels[0]))
+            times, levels = level_changes(times, levels.astype(np.int64), level)
+            if not len(times):
+                continue
+            before = np.concatenate([[level], levels[:-1]])
+            self.levels[ch] = int(levels[-1])
+            self.traces[ch].append(step_vertices(times, before, levels), spare=1)
+
+        channels = records['channel']
+        starts = records['time'][channels == CHANNEL_DROP_START]
+        ends = records['time'][channels == CHANNEL_DROP_END]
+        count = min(len(starts), len(ends))
+        if count and self.origin is not None and not self.wrap:  # wrapping times carry no lost regions
+            starts = starts[:count] - self.origin
+            self.drops.append(span_vertices(starts, np.maximum(ends[:count] - self.origin, starts + 1)))
+
+    def on_timer(self, event):
+        records, _ = self.ring.read()
+        if len(records):
+            self.add(records)
+        if self.follow:
+            self.start = self.latest - self.span * 0.9
+        self.update()
+
+    def on_resize(self, event):
+        viewport = (0, 0, *self.physical_size)
+        gloo.set_viewport(*viewport)
+        width, height = self.size
+        lane = height / len(self.channels)
+        self.names.pos = [(8, (k + 0.5) * lane) for k in range(len(self.channels))]
+        self.status.pos = (width - 8, height - 4)
+        for text in (self.names, self.status):
+            text.transforms.configure(canvas=self, viewport=viewport)
+
+    def on_draw(self, event):
+        gloo.clear()
+        start = int(np.floor(self.start))
+        high, low = split_times([start])
+        left = -1 + 2 * NAME_WIDTH / self.size[0]
+        self.program['u_start'] = high[0], low[0] + (self.start - start)
+        self.program['u_scale'] = (1 - left) / self.span
+        self.program['u_left'] = left
+
+        lane = 2 / len(self.channels)
+        if self.drops.count:
+            self.program['a_vertex'] = self.drops.view()
+            self.program['u_lane'] = -1, 2
+            self.program['u_color'] = DROP_COLOR
+            self.program.draw('triangles')
+        for k, ch in enumerate(self.channels):
+            trace = self.traces[ch]
+            if not trace.count:
+                continue
+            high, low = split_times([self.latest])
+            trace.set_tail((high[0], low[0], self.levels[ch]))  # the level holds up to the newest data
+            self.program['a_vertex'] = trace.view(1)
+            self.program['u_lane'] = 1 - (k + 1 - LANE_MARGIN) * lane, (1 - 2 * LANE_MARGIN) * lane
+            self.program['u_color'] = STEP_COLOR
+            self.program.draw('line_strip')
+
+        self.status.text = f"{self.span:.0f} ticks" + ("" if self.follow else ", 'f' follows")
+        self.names.draw()
+        self.status.draw()
+
+    def _time_at(self, x):
+        left = NAME_WIDTH
+        return self.start + (x - left) / max(self.size[0] - left, 1) * self.span
+
+    def on_mouse_wheel(self, event):
+        at = self._time_at(event.pos[0])
+        span = max(self.span * ZOOM_STEP ** -event.delta[1], 10.0)
+        self.start = at - (at - self.start) * span / self.span
+        self.span = span
+        self.follow = False
+
+    def on_mouse_press(self, event):
+        self.drag = event.pos[0], self.start
+
+    def on_mouse_release(self, event):
+        self.drag = None
+
+    def on_mouse_move(self, event):
+        if self.drag is None or not event.is_dragging:
+            return
+        x, start = self.drag
+        self.start = start - (event.pos[0] - x) / max(self.size[0] - NAME_WIDTH, 1) * self.span
+        self.follow = False
+
+    def on_key_press(self, event):
+        if event.text == 'f':
+            self.follow = True
+
+
+def run(names, ring, follow_window, title, wrap_bits=None):
+    """Shows the viewer until its window is closed"""
+    viewer = WaveViewer(names, ring, follow_window, title, wrap_bits)
+    app.run()
+    viewer.timer.stop()
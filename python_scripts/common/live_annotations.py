@@ -0,0 +1,132 @@
+"""Decoded bytes drawn over the live waveforms, the plotters' ANNOTATE
+option (in python_scripts/common).
+
+Each frame the plot hands the records it read from the shared ring to
+the protocol's incremental decoder (pipeline.ChunkDecoder), so the cost
+of decoding is that of the new records. What it completes is kept as
+(time, label) in a buffer of ANNOTATION_CAPACITY, the older half dropped
+when full. Drawing finds the labels inside the view by binary search and
+moves a fixed pool of matplotlib Text artists onto them, thinning to
+MAX_LABELS per lane when more are in view, so a frame costs what is on
+screen and never grows with the capture.
+
+The roles the plotter asked for pick the decoders: UART labels each RX
+and TX channel with its bytes (?? for a bad frame), SPI the MOSI lane
+with MOSI/MISO bytes, and I2C the SDA lane with S, Sr and P for start,
+repeated start and stop, the address and R or W, and each data byte,
+followed by A or N for its ack. UART waits until the ingest process has
+published the timestamp clock on the ring, since its bit time is in
+ticks."""
+import bisect
+
+import numpy as np
+
+from pipeline import ChunkDecoder, decoder_lanes
+
+ANNOTATION_CAPACITY = 1 << 16  # labels kept per lane
+MAX_LABELS = 48  # drawn per lane at most
+LABEL_Y = 1.25  # data height of the labels, above a high level
+LABEL_COLOR = 'darkred'
+
+
+def label(event):
+    """(time, text) of a decoder event"""
+    kind, t = event[0], event[1]
+    if kind == 'lost':
+        return t, "lost"
+    if kind == 'start':
+        return t, "Sr" if event[2] else "S"
+    if kind == 'stop':
+        return t, "P"
+    if kind == 'address':
+        return t, f"{event[2]:02X} {'R' if event[3] else 'W'} {'A' if event[4] else 'N'}"
+    if kind == 'data':
+        return t, f"{event[2]:02X} {'A' if event[3] else 'N'}"
+    if len(event) == 4:  # SPI
+        return t, f"{event[2]:02X}/{event[3]:02X}"
+    return t, "??" if event[2] is None else f"{event[2]:02X}"
+
+
+class AnnotationLane:
+    """One decoder's labels on one axes"""
+
+    def __init__(self, protocol, lines, ax):
+        self.protocol = protocol
+        self.lines = lines
+        self.ax = ax
+        self.decoder = None  # until the clock is known, for UART
+        self.times = []  # label times, ascending
+        self.texts = []
+        self.artists = []  # reused; hidden when not needed
+
+    def add(self, events):
+        for event in events:
+            t, text = label(event)
+            at = bisect.bisect_right(self.times, t)  # the firmware's bytes can come late
+            self.times.insert(at, t)
+            self.texts.insert(at, text)
+        if len(self.times) > ANNOTATION_CAPACITY:
+            del self.times[:ANNOTATION_CAPACITY // 2]
+            del self.texts[:ANNOTATION_CAPACITY // 2]
+
+    def draw(self, start, end):
+        lo = bisect.bisect_left(self.times, start)
+        hi = bisect.bisect_right(self.times, end)
+        shown = range(lo, hi)
+        if len(shown) > MAX_LABELS:
+            shown = np.linspace(lo, hi - 1, MAX_LABELS).astype(int).tolist()
+        while len(self.artists) < len(shown):
+            self.artists.append(self.ax.text(0, LABEL_Y, "", fontsize=7, color=LABEL_COLOR,
+                                             ha='center', va='center', clip_on=True))
+        for artist, k in zip(self.artists, shown):
+            artist.set_position((self.times[k], LABEL_Y))
+            artist.set_text(self.texts[k])
+            artist.set_visible(True)
+        for artist in self.artists[len(shown):]:
+            artist.set_visible(False)
+        return self.artists
+
+
+class AnnotationOverlay:
+    """Labels for every decoder lane of a plot. feed() each ring read,
+    then draw() the view"""
+
+    def __init__(self, comm_type, mapping, axes, baud, wrap_bits=None):
+        """axes: {channel: axes}; baud: UART's; wrap_bits: the width of
+        the record times if they wrap (the poll stream's 32-bit cycle
+        times), which are unwrapped the way the plot does"""
+        self.baud = baud
+        self.lanes = [AnnotationLane(protocol, lines, axes[ch])
+                      for protocol, lines, ch in decoder_lanes(comm_type, mapping)]
+        self.wrap = 1 << wrap_bits if wrap_bits else None
+        self.clock = None  # wrap_bits: last raw time and its unwrapped time
+
+    def _unwrap(self, records):
+        raw = records['time'].astype(np.int64)
+        last_raw, last_time = self.clock or (int(raw[0]), int(raw[0]))
+        step = np.diff(raw, prepend=last_raw) % self.wrap
+        step = np.where(step >= self.wrap // 2, step - self.wrap, step)
+        records = records.copy()
+        records['time'] = last_time + np.cumsum(step)
+        self.clock = int(raw[-1]), int(records['time'][-1])
+        return records
+
+    def feed(self, records, lost, tick_hz):
+        """records and lost as SharedRing.read returned them"""
+        if not len(records):
+            return
+        if self.wrap:
+            records = self._unwrap(records)
+        for lane in self.lanes:
+            if lane.decoder is None:
+                if lane.protocol == 'uart' and not tick_hz:
+                    continue
+                lane.decoder = ChunkDecoder(lane.protocol, lane.lines,
+                                            tick_hz / self.baud if tick_hz else None)
+            elif lost:
+                lane.add(lane.decoder.lost(int(records['time'][0])))
+            lane.add(lane.decoder.events(records))
+
+    def draw(self, start, end):
+        """The label artists, placed for the view [start, end]"""
+        return [artist for lane in self.lanes for artist in lane.draw(start, end)]
@@ -0,0 +1,248 @@
+"""pcapng output of decoded traffic, for Wireshark (in
+python_scripts/common): the decoders' STRUCTURED_OUTPUT = 'pcapng' and the
+plotters' LIVE_PCAP.
+
+Decoder events are gathered into frames, one packet each:
+  UART    a chunk: bytes of one line closer than UART_IDLE_S, at most
+          MAX_FRAME of them
+  SPI     a transfer: bytes closer than SPI_IDLE_S, as two packets, the
+          MOSI bytes outbound and the MISO bytes inbound (epb_flags)
+  I2C     a message: START or repeated START to the next one or STOP,
+          the address byte (address << 1 | read) then the data bytes
+  1-Wire, WS2812  the bytes between two resets
+Each source (a UART line, SPI, I2C, a pulse channel) is an interface of
+its own, named after it, with the link type of LINKTYPES. I2C is
+Wireshark's Linux I2C type, with its 5-byte pseudo-header (bus 0, flags
+0). The others are DLT_USER types. Wireshark's DLT_User table
+(Preferences > Protocols > DLT_User) maps one to a dissector, for
+example User 0 (147) to mbrtu for Modbus RTU over UART. A frame with a
+bad UART byte (its value unknown, or a parity or stop bit error) gets
+the symbol error bit of epb_flags, with 00 for an unknown byte. A frame
+cut short by a loss gets the packet-too-short bit.
+
+Timestamps are nanoseconds (if_tsresol 9): the frame's first event on
+the capture's clock, calibrated by its tick_hz, plus origin_ns. That is
+0 for a decode, so times count from the capture's start, and the Unix
+time of the first batch for LIVE_PCAP. Blocks are packed with struct a
+BATCH of events at a time and written in one call through a
+WRITE_BUFFER file buffer, as EventWriter does. The frame in progress of
+each source is all the state, so the writer keeps up with the
+streaming decoders however long they run."""
+import itertools
+import struct
+import time
+
+import numpy as np
+
+from event_output import BATCH, WRITE_BUFFER
+from pipeline import ChunkDecoder, Sink, bus_type, decoder_lanes
+
+UART_IDLE_S = 1e-3  # a longer gap between two bytes of a line starts a new frame
+SPI_IDLE_S = 100e-6
+MAX_FRAME = 4096  # bytes
+LINKTYPES = {'uart': 147, 'spi': 148, 'onewire': 149, 'ws2812': 150, 'i2c': 209}  # DLT_USER0-3, I2C_LINUX
+SHB_TYPE, IDB_TYPE, EPB_TYPE = 0x0A0D0D0A, 1, 6
+BYTE_ORDER_MAGIC = 0x1A2B3C4D
+OPT_END, OPT_IF_NAME, OPT_IF_TSRESOL, OPT_EPB_FLAGS, OPT_SHB_USERAPPL = 0, 2, 9, 2, 4
+INBOUND, OUTBOUND = 1, 2  # epb_flags direction
+TOO_SHORT = 1 << 26  # epb_flags: a frame cut short by a loss
+SYMBOL_ERROR = 1 << 31  # epb_flags: a bad UART byte in the frame
+EPB_HEAD = struct.Struct('<IIIIIII')  # type, length, interface, timestamp high and low, captured and original length
+I2C_HEADER = struct.Struct('>BI')  # bus, flags
+
+
+def _option(code, value):
+    return struct.pack('<HH', code, len(value)) + value + b'\0' * (-len(value) % 4)
+
+
+def _block(kind, body):
+    length = 12 + len(body)
+    return struct.pack('<II', kind, length) + body + struct.pack('<I', length)
+
+
+class _Frame:
+    """The frame in progress of one source"""
+
+    def __init__(self, t):
+        self.t = t
+        self.last = t
+        self.data = bytearray()
+        self.miso = bytearray()  # SPI
+        self.flags = 0
+
+
+class PcapWriter:
+    """Writes decoder events to a pcapng file as frames, with the interface
+    of event_output.EventWriter: sources names what write() is given
+    events of. count is the events taken, frames the packets written"""
+
+    def __init__(self, path, tick_hz, sources, origin_ns=0):
+        self.path = path
+        self.sources = list(sources)
+        self.scale = 1e9 / tick_hz if tick_hz else 1.0  # ns per tick; ticks as ns without a clock
+        self.origin_ns = origin_ns
+        self.count = 0
+        self.frames = 0
+        self.interfaces = {}  # source: interface number, once it has a frame
+        self.open = {}  # source: its _Frame in progress
+        self.protocols = {}  # source: the protocol of its events
+        self.idle = {'uart': UART_IDLE_S * tick_hz if tick_hz else None,
+                     'spi': SPI_IDLE_S * tick_hz if tick_hz else None}
+        self.f = open(path, 'wb', buffering=WRITE_BUFFER)
+        self.f.write(_block(SHB_TYPE, struct.pack('<IHHq', BYTE_ORDER_MAGIC, 1, 0, -1)
+                            + _option(OPT_SHB_USERAPPL, b'STM32 logic analyzer decoders')
+                            + _option(OPT_END, b'')))
+
+    def write(self, source, protocol, events):
+        """Appends the events of one source; returns how many"""
+        return self.write_tagged((source, protocol, event) for event in events)
+
+    def write_tagged(self, tagged):
+        """Appends (source, protocol, event) items, e.g. several sources
+        merged in time order; returns how many"""
+        tagged = iter(tagged)
+        written = 0
+        while True:
+            batch = list(itertools.islice(tagged, BATCH))
+            if not batch:
+                break
+            blocks = []
+            for source, protocol, event in batch:
+                self._event(blocks, source, protocol, event)
+            self.f.write(b''.join(blocks))
+            written += len(batch)
+        self.count += written
+        return written
+
+    def _event(self, blocks, source, protocol, event):
+        kind, t = event[0], event[1]
+        self.protocols[source] = protocol
+        frame = self.open.get(source)
+        if kind == 'lost':
+            if frame is not None:
+                frame.flags |= TOO_SHORT
+                self._close(blocks, source, protocol)
+            return
+        if protocol == 'i2c':
+            if kind == 'start':
+                self._close(blocks, source, protocol)
+                self.open[source] = _Frame(t)
+            elif kind == 'stop':
+                self._close(blocks, source, protocol)
+            elif frame is not None:
+                frame.data.append(event[2] << 1 | event[3] if kind == 'address' else event[2])
+            return
+        if kind == 'reset':  # 1-Wire, WS2812
+            self._close(blocks, source, protocol)
+            return
+        idle = self.idle.get(protocol)
+        if frame is not None and (len(frame.data) >= MAX_FRAME or idle is not None and t - frame.last > idle):
+            self._close(blocks, source, protocol)
+            frame = None
+        if frame is None:
+            frame = self.open[source] = _Frame(t)
+        frame.last = t
+        value = event[2]
+        if protocol == 'uart' and (value is None or len(event) > 3 and not (event[3] and event[4] == 1)):
+            frame.flags |= SYMBOL_ERROR
+        frame.data.append(value or 0)
+        if protocol == 'spi':
+            frame.miso.append(event[3])
+
+    def _interface(self, blocks, source, protocol):
+        if source not in self.interfaces:
+            self.interfaces[source] = len(self.interfaces)
+            blocks.append(_block(IDB_TYPE, struct.pack('<HHI', LINKTYPES[protocol], 0, 0)
+                                 + _option(OPT_IF_NAME, source.encode())
+                                 + _option(OPT_IF_TSRESOL, bytes([9]))
+                                 + _option(OPT_END, b'')))
+        return self.interfaces[source]
+
+    def _close(self, blocks, source, protocol):
+        frame = self.open.pop(source, None)
+        if frame is None or not frame.data:
+            return
+        interface = self._interface(blocks, source, protocol)
+        ns = self.origin_ns + round(frame.t * self.scale)
+        if protocol == 'spi':
+            packets = ((frame.data, frame.flags | OUTBOUND), (frame.miso, frame.flags | INBOUND))
+        elif protocol == 'i2c':
+            packets = ((I2C_HEADER.pack(0, 0) + frame.data, frame.flags),)
+        else:
+            packets = ((frame.data, frame.flags),)
+        for data, flags in packets:
+            options = (_option(OPT_EPB_FLAGS, struct.pack('<I', flags)) + _option(OPT_END, b'')) if flags else b''
+            body_length = 20 + len(data) + (-len(data) % 4) + len(options)
+            blocks.append(EPB_HEAD.pack(EPB_TYPE, 12 + body_length, interface, ns >> 32, ns & 0xFFFFFFFF,
+                                        len(data), len(data))
+                          + data + b'\0' * (-len(data) % 4) + options + struct.pack('<I', 12 + body_length))
+            self.frames += 1
+
+    def close(self):
+        """Writes the frames in progress as they are and closes the file"""
+        blocks = []
+        for source, protocol in self.protocols.items():
+            self._close(blocks, source, protocol)
+        self.f.write(b''.join(blocks))
+        self.f.close()
+
+    def __enter__(self):
+        return self
+
+    def __exit__(self, *exc):
+        self.close()
+
+
+class PcapSink(Sink):
+    """LIVE_PCAP: runs the decoders of the channel roles (decoder_lanes)
+    on every batch and writes what they complete to a pcapng file, the
+    timestamps on the Unix clock from the first batch. UART, at baud,
+    waits for the timestamp clock. wrap_bits: the width of the record
+    times if they wrap (the poll stream's 32-bit cycle times)"""
+
+    def __init__(self, path, mapping, baud=115200, wrap_bits=None):
+        self.path = path
+        self.lanes = decoder_lanes(bus_type(mapping), mapping)
+        self.sources = [mapping[ch] if protocol == 'uart' else protocol.upper() for protocol, _, ch in self.lanes]
+        self.baud = baud
+        self.wrap = 1 << wrap_bits if wrap_bits else None
+        self.clock = None  # wrap_bits: last raw time and its unwrapped time
+        self.tick_hz = None
+        self.writer = None
+        self.decoders = {}  # lane index: ChunkDecoder
+        super().__init__()
+
+    def tick(self, tick_hz):
+        self.tick_hz = tick_hz
+
+    def gap(self):
+        for k, decoder in self.decoders.items():
+            self.writer.write(self.sources[k], self.lanes[k][0], decoder.lost(0))  # closes the frames cut
+
+    def _unwrap(self, records):
+        raw = records['time'].astype(np.int64)
+        last_raw, last_time = self.clock or (int(raw[0]), int(raw[0]))
+        step = np.diff(raw, prepend=last_raw) % self.wrap
+        step = np.where(step >= self.wrap // 2, step - self.wrap, step)
+        records = records.copy()
+        records['time'] = last_time + np.cumsum(step)
+        self.clock = int(raw[-1]), int(records['time'][-1])
+        return records
+
+    def consume(self, records):
+        if not len(records) or not self.tick_hz:
+            return  # timestamps need the clock
+        if self.wrap:
+            records = self._unwrap(records)
+        if self.writer is None:
+            origin = time.time_ns() - round(int(records['time'][0]) * 1e9 / self.tick_hz)
+            self.writer = PcapWriter(self.path, self.tick_hz, self.sources, origin)
+        for k, (protocol, lines, _) in enumerate(self.lanes):
+            if k not in self.decoders:
+                self.decoders[k] = ChunkDecoder(protocol, lines, self.tick_hz / self.baud)
+            self.writer.write(self.sources[k], protocol, self.decoders[k].events(records))
+
+    def finish(self):
+        if self.writer is not None:
+            self.writer.close()
+            print(f"{self.writer.frames} decoded frames written to '{self.path}'")
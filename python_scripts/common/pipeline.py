@@ -0,0 +1,1264 @@
+"""Host side of a capture: the ingest loop feeds a Pipeline, which turns
+what it decoded into record batches (capture_file.RECORD_DTYPE arrays)
+and hands every batch, by reference, to each sink:
+  CaptureWriter  bitlog.lacap (capture_file.py)
+  RingSink       the shared ring the plot reads (shm_ring.py)
+  UartSink       live UART decode of one channel, printed as it arrives
+  StatsSink      event rate and losses, printed every few seconds
+  ThroughputSink record rate and MB/s, for headless captures
+  ProtocolStatsSink  rolling rates of the decoded bus, without its bytes
+Sinks never modify a batch, so they all share one array. UartStream,
+SpiStream, I2cStream and PulseStream (1-Wire, WS2812), the decoders
+that work batch by batch, serve the decoder scripts as well: decode_chunks runs them over a capture
+read in chunks (capture_file.RecordChunks), and ChunkDecoder over
+batches as they come, for the plot's annotations (live_annotations.py).
+With numba installed, UartStream and I2cStream run their edge loops as
+compiled kernels (decoder_kernels.py).
+
+A sink takes batches on a bounded queue and works through them on a
+thread of its own, so a slow sink holds up neither ingest nor the other
+sinks. A lossy sink that falls QUEUE_BATCHES behind sheds new batches
+and counts the records; a lossless one makes the producer wait instead
+once its queue is full. Only the capture file is lossless, and its queue
+holds tens of MB, so a disk stall has to be long to slow ingest down.
+A live decoder sheds newest first instead, given skip_lag_s: once the
+batch it takes waited longer than that, it drops every batch queued but
+the latest, notes the capture time range it skipped (Sink.skips) and
+resyncs its decoder at the next protocol boundary, so what it prints
+stays current. The capture file has the skipped range in full, to be
+decoded offline.
+
+Every stage of the host side counts what it does in a StageStats of its
+process (STAGES): the port read and decode of the ingest loop, the
+Pipeline handing batches over, each sink, and the plot's frame update.
+It counts items in and out, seconds busy and the longest batch, its
+queue's depth and peak, and batches shed. A StageReport prints them as
+one line every few seconds (the plotters' STAGE_STATS_S). On SIGUSR1 it
+writes them to a JSON file (STAGE_STATS_JSON), so a lagging view can be
+traced to its slow stage without a profiler."""
+import collections
+import json
+import os
+import queue
+import signal
+import threading
+import time
+
+import numpy as np
+
+import decoder_kernels as kernels
+from capture_file import (RECORD_DTYPE, CHANNEL_LEVELS, CHANNEL_LEVELS_HIGH, CHANNEL_DROP_START,
+                          CHANNEL_DROP_END, CHANNEL_DROP_COUNT, CHANNEL_SYNC_FRAME, CHANNEL_SYNC_CLOCK,
+                          CHANNEL_SYNC_HOST, CHANNEL_TRIGGER, CHANNEL_BOARD_SYNC, CHANNEL_STORM,
+                          CHANNEL_STORM_COUNT, STORM_FLAG_CALM, CHANNEL_UART, CHANNEL_SPI,
+                          CHANNEL_I2C, CHANNEL_ANALOG, CHANNEL_LEVEL_SNAPSHOT, SNAPSHOT_CHANNELS, SPI_FLAG_MISO,
+                          SPI_FLAG_OVERRUN, uart_records, spi_records, i2c_records, i2c_events,
+                          channel_levels, edge_levels)
+
+QUEUE_BATCHES = 256  # batches a sink may fall behind
+STAGES = {}  # name: StageStats of this process, in the order the stages appeared
+
+
+def level_changes(times, levels, level):
+    """Only the entries of (times, levels) that change the level, level
+    being the one before the first"""
+    previous = np.concatenate([[level], levels[:-1]]) if len(levels) else levels
+    changed = levels != previous
+    return times[changed], levels[changed]
+
+
+def merge_lines(*lines):
+    """(times, lines, levels) arrays of several channels' (times, levels),
+    each in time order as every capture keeps it, merged in time order;
+    lines numbers them in the order given, and at equal times the
+    earlier one comes first. Each channel is placed among the ones
+    before it by binary search, so nothing is sorted"""
+    times = numbers = levels = np.empty(0, dtype=np.int64)
+    for n, (line_times, line_levels) in enumerate(lines):
+        line_times = np.asarray(line_times, dtype=np.int64)
+        at = np.arange(len(line_times)) + np.searchsorted(times, line_times, side='right')
+        rest = np.ones(len(times) + len(line_times), dtype=bool)
+        rest[at] = False
+        merged = [np.empty(len(rest), dtype=np.int64) for _ in range(3)]
+        for column, before, new in zip(merged, (times, numbers, levels), (line_times, n, line_levels)):
+            column[rest] = before
+            column[at] = new
+        times, numbers, levels = merged
+    return times, numbers, levels
+
+
+class StageStats:
+    """What one stage of the host side did: batches, items in and out
+    (bytes, edges or records, as the stage works), seconds busy and the
+    longest batch, its queue's peak depth and the batches and items it
+    shed. One thread updates it; a report reads it as it stands"""
+
+    def __init__(self, name, queue=None):
+        self.name = name
+        self.queue = queue
+        self.batches = self.items_in = self.items_out = 0
+        self.busy_s = self.longest_s = 0.0
+        self.queue_peak = 0
+        self.shed_batches = self.shed_items = 0
+
+    def add(self, items_in, seconds, items_out=None):
+        self.batches += 1
+        self.items_in += items_in
+        self.items_out += items_in if items_out is None else items_out
+        self.busy_s += seconds
+        self.longest_s = max(self.longest_s, seconds)
+
+    def shed(self, items):
+        self.shed_batches += 1
+        self.shed_items += items
+
+    def depth(self):
+        """The queue's depth now, noted for its peak"""
+        if self.queue is None:
+            return 0
+        size = self.queue.qsize()
+        self.queue_peak = max(self.queue_peak, size)
+        return size
+
+    def snapshot(self):
+        return {"batches": self.batches, "in": self.items_in, "out": self.items_out,
+                "busy s": round(self.busy_s, 6), "longest batch s": round(self.longest_s, 6),
+                "queue": self.depth(), "queue peak": self.queue_peak,
+                "queue size": self.queue.maxsize if self.queue is not None else 0,
+                "shed batches": self.shed_batches, "shed": self.shed_items}
+
+
+def stage(name, queue=None):
+    """The StageStats of this process called name. A stage with a queue
+    is a sink and has one of its own, numbered on if two share a name"""
+    if name in STAGES and queue is not None:
+        number = 2
+        while f"{name} {number}" in STAGES:
+            number += 1
+        name = f"{name} {number}"
+    return STAGES.setdefault(name, StageStats(name, queue))
+
+
+class StageReport:
+    """Prints every stage of this process as one line each every_s (0:
+    never), with rates over the period; writes them all to json_path when
+    SIGUSR1 asked for it. poll() it from the process's loop"""
+
+    def __init__(self, role, every_s, json_path):
+        self.role = role
+        self.every_s = every_s
+        self.json_path = json_path
+        self.requested = threading.Event()
+        self.last = time.monotonic()
+        self.before = {}  # name: snapshot at the last line
+        if json_path and hasattr(signal, 'SIGUSR1') and threading.current_thread() is threading.main_thread():
+            signal.signal(signal.SIGUSR1, lambda *_: self.requested.set())
+
+    def poll(self):
+        if self.requested.is_set():
+            self.requested.clear()
+            path = self.json_path.format(role=self.role)
+            with open(path, 'w') as f:
+                json.dump({"role": self.role, "pid": os.getpid(), "time": time.time(),
+                           "stages": {name: stats.snapshot() for name, stats in STAGES.items()}}, f, indent=1)
+            print(f"{self.role}: stage statistics written to {path}", flush=True)
+        now = time.monotonic()
+        if not self.every_s or now - self.last < self.every_s:
+            return
+        seconds, self.last = now - self.last, now
+        parts = []
+        for name, stats in list(STAGES.items()):
+            now_figures = stats.snapshot()
+            old = self.before.get(name, dict.fromkeys(now_figures, 0))
+            self.before[name] = now_figures
+            part = (f"{name} {(now_figures['in'] - old['in']) / seconds:,.0f}/s in "
+                    f"{(now_figures['out'] - old['out']) / seconds:,.0f}/s out "
+                    f"{100 * (now_figures['busy s'] - old['busy s']) / seconds:.0f}% busy")
+            if stats.queue is not None:
+                part += f" q {now_figures['queue']}/{now_figures['queue size']} peak {now_figures['queue peak']}"
+            if now_figures['shed batches'] != old['shed batches']:
+                part += f" shed {now_figures['shed batches'] - old['shed batches']}"
+            parts.append(part)
+        print(f"{self.role}: " + " | ".join(parts), flush=True)
+
+
+class Sink:
+    """Base of the sinks: subclasses set up their state, then call
+    Sink.__init__, which starts the thread that calls consume()"""
+    lossy = True
+
+    def __init__(self, depth=QUEUE_BATCHES, skip_lag_s=None):
+        self.queue = queue.Queue(depth)
+        self.shed = 0  # records not taken because the queue was full
+        self.seen_shed = 0
+        self.skip_lag_s = skip_lag_s
+        self.skips = []  # (first time, last time, records) of the ranges skipped to catch up
+        self.stats = stage(type(self).__name__, self.queue)
+        self.thread = threading.Thread(target=self._run, daemon=True)
+        self.thread.start()
+
+    def put(self, records):
+        if not self.lossy:
+            self.queue.put(('data', records, time.monotonic()))
+            self.stats.depth()
+            return
+        try:
+            self.queue.put_nowait(('data', records, time.monotonic()))
+            self.stats.depth()
+        except queue.Full:
+            self.shed += len(records)
+            self.stats.shed(len(records))
+
+    def set_tick_hz(self, tick_hz):
+        self.queue.put(('tick', tick_hz))
+
+    def flush(self):
+        pass
+
+    def close(self):
+        self.queue.put(('close', None))
+        self.thread.join()
+
+    def _run(self):
+        while True:
+            kind, value, *queued = self.queue.get()
+            if kind == 'data':
+                closing = False
+                if self.skip_lag_s is not None and time.monotonic() - queued[0] > self.skip_lag_s:
+                    value, closing = self._skip_to_latest(value, time.monotonic() - queued[0])
+                if self.shed != self.seen_shed:
+                    self.seen_shed = self.shed
+                    self.gap()
+                start = time.perf_counter()
+                self.consume(value)
+                self.stats.add(len(value), time.perf_counter() - start)
+                if closing:
+                    self.finish()
+                    return
+            elif kind == 'tick':
+                self.tick(value)
+            else:
+                self.finish()
+                return
+
+    def _skip_to_latest(self, records, lag):
+        """Drops the batches queued from records on but the latest; returns
+        it, and True if close() came after it"""
+        batches = [records]
+        closing = False
+        while not closing:
+            try:
+                kind, value, *_ = self.queue.get_nowait()
+            except queue.Empty:
+                break
+            if kind == 'data':
+                batches.append(value)
+            elif kind == 'tick':
+                self.tick(value)
+            else:
+                closing = True
+        latest = batches.pop()
+        if batches:
+            timed = [batch['time'][batch['channel'] < CHANNEL_DROP_START] for batch in batches]
+            timed = [times for times in timed if len(times)]
+            count = sum(len(batch) for batch in batches)
+            self.stats.shed(count)
+            if timed:
+                self.skips.append((int(timed[0][0]), int(timed[-1][-1]), count))
+                self.skip(*self.skips[-1], lag)
+        return latest, closing
+
+    def consume(self, records):
+        raise NotImplementedError
+
+    def tick(self, tick_hz):
+        """The timestamp clock became known"""
+
+    def gap(self):
+        """Batches before the next one were shed"""
+
+    def skip(self, first, last, records, lag):
+        """Batches from first to last (capture times) were skipped, lag
+        seconds behind; the next one is the latest"""
+        self.gap()
+
+    def finish(self):
+        """Everything before close() has been consumed"""
+
+
+class RingSink(Sink):
+    """Copies every batch into a shm_ring.SharedRing. A ring write never
+    waits, so this sink keeps up and is lossless; readers that fall a
+    ring behind count their own losses"""
+    lossy = False
+
+    def __init__(self, ring):
+        self.ring = ring
+        super().__init__()
+
+    def consume(self, records):
+        self.ring.write(records)
+
+    def tick(self, tick_hz):
+        self.ring.set_tick_hz(tick_hz)
+
+
+class StatsSink(Sink):
+    """Prints the edge or sample rate of each channel and the events the
+    firmware lost, every every_s seconds"""
+
+    def __init__(self, names, every_s):
+        self.names = names
+        self.every_s = every_s
+        self.counts = np.zeros(CHANNEL_LEVELS + 1, np.int64)
+        self.lost = 0
+        self.since = time.monotonic()
+        super().__init__()
+
+    def consume(self, records):
+        channels = records['channel']
+        self.counts += np.bincount(channels[channels <= CHANNEL_LEVELS],
+                                   minlength=CHANNEL_LEVELS + 1)
+        self.lost += int(records['time'][channels == CHANNEL_DROP_COUNT].sum())
+        now = time.monotonic()
+        if now - self.since >= self.every_s:
+            self.report(now - self.since)
+            self.counts[:] = 0
+            self.lost = 0
+            self.since = now
+
+    def report(self, seconds):
+        rates = [f"{self.names.get(ch, f'CH{ch + 1}')} {self.counts[ch] / seconds:.0f}/s"
+                 for ch in range(4) if self.counts[ch]]
+        if self.counts[CHANNEL_LEVELS]:
+            rates.append(f"samples {self.counts[CHANNEL_LEVELS] / seconds:.0f}/s")
+        print(f"Stats: {', '.join(rates) or 'idle'}; {self.lost} events lost"
+              + (f"; {self.shed} records not counted" if self.shed else ""))
+
+
+class ThroughputSink(Sink):
+    """Prints the record rate, the MB/s it takes on disk and the events
+    the firmware lost, every every_s seconds; for headless captures.
+    triggered, a threading.Event, is set at the first device trigger"""
+    lossy = False
+
+    def __init__(self, every_s, triggered=None):
+        self.every_s = every_s
+        self.triggered = triggered
+        self.records = self.total = self.lost = 0
+        self.started = self.since = time.monotonic()
+        super().__init__()
+
+    def consume(self, records):
+        channels = records['channel']
+        self.records += len(records)
+        self.lost += int(records['time'][channels == CHANNEL_DROP_COUNT].sum())
+        if self.triggered is not None and (channels == CHANNEL_TRIGGER).any():
+            self.triggered.set()
+        now = time.monotonic()
+        if now - self.since >= self.every_s:
+            self.report(now)
+
+    def report(self, now):
+        seconds = now - self.since
+        self.total += self.records
+        print(f"{now - self.started:.0f} s: {self.records / seconds / 1e6:.2f} M records/s, "
+              f"{self.records * RECORD_DTYPE.itemsize / seconds / 1e6:.1f} MB/s, "
+              f"{self.total * RECORD_DTYPE.itemsize / 1e6:.0f} MB in all; {self.lost} events lost", flush=True)
+        self.records = self.lost = 0
+        self.since = now
+
+    def finish(self):
+        self.report(time.monotonic())
+
+
+class UartStream:
+    """Incremental UART decoder: feed() takes one channel's levels in time
+    order, batch after batch, and returns the frames they complete as
+    (start bit time, byte), byte None for a framing or parity error. What
+    it keeps between batches is the frame in progress, at most
+    MAX_FRAME_EDGES edges, so it can run alongside a capture for hours"""
+    MAX_FRAME_EDGES = 32
+
+    def __init__(self, bit_time, data_bits=8, parity='N'):
+        self.bit_time = bit_time
+        self.data_bits = data_bits
+        self.parity = parity.upper()
+        parity_bits = 1 if self.parity in ('E', 'O') else 0
+        self.stop_offset = bit_time * (1.5 + data_bits + parity_bits)  # middle of the stop bit
+        self.level = 1     # idle line is high
+        self.start = None  # time of the start bit being decoded
+        self.edges = []    # (time, level) since the start bit
+
+    def reset(self):
+        """Drops the frame in progress, after a loss; True if there was one"""
+        busy = self.start is not None
+        self.start = None
+        self.edges = []
+        return busy
+
+    def _level_at(self, t):
+        level = 0
+        for edge_time, edge_level in self.edges:
+            if edge_time > t:
+                break
+            level = edge_level
+        return level
+
+    def _decode(self):
+        start = self.start
+        bits = [self._level_at(start + self.bit_time * (1.5 + i)) for i in range(self.data_bits)]
+        value = sum(bit << i for i, bit in enumerate(bits))
+        ok = self._level_at(start + self.stop_offset) == 1
+        if self.parity in ('E', 'O'):
+            parity_bit = self._level_at(start + self.bit_time * (1.5 + self.data_bits))
+            ok &= (sum(bits) + parity_bit) % 2 == (self.parity == 'O')
+        self.reset()
+        return start, value if ok else None
+
+    def feed(self, times, levels, now=None):
+        """times and levels may repeat a level (poll samples); now is the
+        latest time the capture reached, which completes a frame whose
+        stop bit passed without another edge"""
+        if kernels.JIT:
+            return self._feed_compiled(np.asarray(times), np.asarray(levels), now)
+        frames = []
+        for t, level in zip(times, levels):
+            if level == self.level:
+                continue
+            self.level = level
+            if self.start is not None and t > self.start + self.stop_offset:
+                frames.append(self._decode())
+            if self.start is None:
+                if level == 0:
+                    self.start, self.edges = t, [(t, 0)]
+                continue
+            self.edges.append((t, level))
+            if len(self.edges) == 2 and t - self.start < self.bit_time / 2:
+                self.reset()  # a glitch, not a start bit
+            elif len(self.edges) > self.MAX_FRAME_EDGES:
+                frames.append((self.start, None))  # noise, not a frame
+                self.reset()
+        if self.start is not None and now is not None and now > self.start + self.stop_offset:
+            frames.append(self._decode())  # the line has been idle since the stop bit
+        return frames
+
+    def _feed_compiled(self, times, levels, now):
+        """feed() through decoder_kernels.uart_feed, the frame in progress
+        handed over as arrays and taken back"""
+        count = len(self.edges) if self.start is not None else 0
+        edge_t = np.zeros(self.MAX_FRAME_EDGES + 1, dtype=times.dtype)
+        edge_l = np.zeros(self.MAX_FRAME_EDGES + 1, dtype=np.int64)
+        if count:
+            edge_t[:count], edge_l[:count] = zip(*self.edges)
+        state = np.array([self.level, count], dtype=np.int64)
+        out_t = np.empty(len(times) + 1, dtype=times.dtype)
+        out_v = np.empty(len(times) + 1, dtype=np.int64)
+        n = kernels.uart_feed(times, levels, self.bit_time, self.data_bits, kernels.PARITY_CODES[self.parity],
+                              self.stop_offset, self.MAX_FRAME_EDGES, state, edge_t, edge_l,
+                              now or 0, now is not None, out_t, out_v)
+        self.level, count = int(state[0]), int(state[1])
+        self.start = edge_t[0].item() if count else None
+        self.edges = list(zip(edge_t[:count].tolist(), edge_l[:count].tolist()))
+        return [(t, None if value < 0 else value) for t, value in zip(out_t[:n].tolist(), out_v[:n].tolist())]
+
+
+class SpiStream:
+    """Incremental SPI decoder: feed() takes one batch of the clock, MOSI,
+    MISO and, if the bus has one, SS lines, each (times, levels) arrays
+    in time order that may repeat a level (poll samples), and returns
+    the (time, MOSI, MISO) bytes they complete, with the time of the
+    last bit. The clock edges of a batch are sampled all at once. With
+    SS only edges while it is low count, and each assertion starts a new
+    byte; SS counts from its first entry, the level before it taken as
+    the opposite. Between batches it keeps the line levels and the bits
+    of the byte in progress, at most 7"""
+
+    def __init__(self, clock_polarity=0, clock_phase=0):
+        # mode 0 and 3 sample on the rising edge, 1 and 2 on the falling one
+        self.sample_level = 1 if clock_polarity == clock_phase else 0
+        self.clk = clock_polarity  # idle level
+        self.mosi = self.miso = 0
+        self.ss = None  # until SS is seen
+        self.bits = (np.empty(0, dtype=np.int64),) * 3  # times, MOSI, MISO
+
+    @staticmethod
+    def _at(line, times, level):
+        """Levels of line at times, level before its first entry"""
+        if line is None or not len(line[0]):
+            return np.full(len(times), level, dtype=np.int64)
+        i = np.searchsorted(line[0], times, side='right')
+        return np.where(i > 0, line[1][np.maximum(i - 1, 0)].astype(np.int64), level)
+
+    @staticmethod
+    def _last(line, level):
+        return int(line[1][-1]) if line is not None and len(line[1]) else level
+
+    def lost(self):
+        """Drops the byte in progress after a loss; the bits it had"""
+        bits = len(self.bits[0])
+        self.bits = (self.bits[0][:0],) * 3
+        return bits
+
+    def feed(self, clk, mosi, miso, ss=None):
+        times, levels = level_changes(*clk, self.clk)
+        self.clk = self._last(clk, self.clk)
+        edges = times[levels == self.sample_level]
+        transfer = np.zeros(len(edges), dtype=np.int64)  # SS assertions this batch before each edge
+        if ss is not None and self.ss is None and len(ss[1]):
+            self.ss = 1 - int(ss[1][0])
+        if ss is not None and self.ss is not None:
+            edges = edges[self._at(ss, edges, self.ss) == 0]
+            ss_times, ss_levels = level_changes(*ss, self.ss)
+            transfer = np.searchsorted(ss_times[ss_levels == 0], edges, side='right')
+            self.ss = self._last(ss, self.ss)
+        mosi_bits = self._at(mosi, edges, self.mosi)
+        miso_bits = self._at(miso, edges, self.miso)
+        self.mosi, self.miso = self._last(mosi, self.mosi), self._last(miso, self.miso)
+
+        # The byte in progress continues the transfer the batch starts in;
+        # each assertion starts a byte, discarding a partial one before it
+        pending = len(self.bits[0])
+        times = np.concatenate([self.bits[0], edges])
+        mosi_bits = np.concatenate([self.bits[1], mosi_bits])
+        miso_bits = np.concatenate([self.bits[2], miso_bits])
+        transfer = np.concatenate([np.zeros(pending, dtype=np.int64), transfer])
+        n = len(times)
+        if not n:
+            return []
+        starts = np.zeros(n, dtype=bool)
+        starts[0] = True
+        starts[1:] = transfer[1:] != transfer[:-1]
+        first = np.flatnonzero(starts)
+        run = np.diff(np.concatenate([first, [n]]))  # edges per transfer
+        owner = np.cumsum(starts) - 1
+        position = np.arange(n) - first[owner]
+        whole = position < (run - run % 8)[owner]
+        tail = (owner == len(first) - 1) & ~whole  # the last transfer's partial byte
+        self.bits = (times[tail], mosi_bits[tail], miso_bits[tail])
+
+        times, mosi_bits, miso_bits = times[whole], mosi_bits[whole], miso_bits[whole]
+        pack = lambda bits: sum(bits[i::8] << (7 - i) for i in range(8))  # MSB first
+        if not len(times):
+            return []
+        return list(zip(times[7::8].tolist(), pack(mosi_bits).tolist(), pack(miso_bits).tolist()))
+
+
+class I2cStream:
+    """Incremental I2C decoder: one pass over the SCL and SDA edges merged
+    in time order (line 0 = SCL, 1 = SDA), batch after batch. feed()
+    returns what the edges complete:
+      ('start', t, repeated)  SDA fell while SCL was high
+      ('stop', t)             SDA rose while SCL was high
+      ('address', t, address, read, ack)
+      ('data', t, byte, ack)
+    with t the first SCL rise of a byte. Between batches it keeps the two
+    line levels and the byte in progress. Only edges move the state
+    machine, so a stretched clock needs nothing special. scl and sda are
+    the levels before the first edge, high while the bus is idle"""
+    IDLE, ADDRESS, DATA, ACK = range(4)
+
+    def __init__(self, scl=1, sda=1):
+        self.scl, self.sda = scl, sda
+        self.state = self.IDLE
+        self.kind = None   # 'address' or 'data', of the byte being shifted in
+        self.value = 0
+        self.count = 0
+        self.byte_time = None
+
+    def _byte(self, kind):
+        self.kind, self.value, self.count = kind, 0, 0
+        self.state = self.ADDRESS if kind == 'address' else self.DATA
+
+    def lost(self):
+        """Drops the transaction in progress after a loss; True if there
+        was one. Decoding resumes at the next START"""
+        busy = self.state != self.IDLE
+        self.state = self.IDLE
+        return busy
+
+    def feed(self, times, lines, levels):
+        if kernels.JIT:
+            return self._feed_compiled(np.asarray(times), np.asarray(lines), np.asarray(levels))
+        events = []
+        for t, line, level in zip(times, lines, levels):
+            if line == 1:
+                if level != self.sda and self.scl:
+                    if level == 0:
+                        events.append(('start', t, self.state != self.IDLE))
+                        self._byte('address')
+                    elif self.state != self.IDLE:
+                        events.append(('stop', t))
+                        self.state = self.IDLE
+                self.sda = level
+                continue
+            rising = level and not self.scl
+            self.scl = level
+            if not rising or self.state == self.IDLE:
+                continue
+            if self.state == self.ACK:
+                ack = self.sda == 0
+                if self.kind == 'address':
+                    events.append(('address', self.byte_time, self.value >> 1, bool(self.value & 1), ack))
+                else:
+                    events.append(('data', self.byte_time, self.value, ack))
+                self._byte('data')
+                continue
+            if self.count == 0:
+                self.byte_time = t
+            self.value = (self.value << 1) | self.sda
+            self.count += 1
+            if self.count == 8:
+                self.state = self.ACK
+        return events
+
+    def _feed_compiled(self, times, lines, levels):
+        """feed() through decoder_kernels.i2c_feed"""
+        state = np.array([self.scl, self.sda, self.state, self.kind == 'data', self.value, self.count,
+                          -1 if self.byte_time is None else self.byte_time], dtype=np.int64)
+        out = [np.empty(len(times), dtype=np.int64) for _ in range(4)]
+        out_t = np.empty(len(times), dtype=times.dtype)
+        n = kernels.i2c_feed(times, lines, levels, state, out[0], out_t, *out[1:])
+        self.scl, self.sda, self.state, kind, self.value, self.count, byte_time = state.tolist()
+        if self.state != self.IDLE:
+            self.kind = 'data' if kind else 'address'
+        self.byte_time = None if byte_time < 0 else byte_time
+        events = []
+        for kind, t, a, b, c in zip(out[0][:n].tolist(), out_t[:n].tolist(),
+                                    *(column[:n].tolist() for column in out[1:])):
+            if kind == kernels.I2C_START:
+                events.append(('start', t, bool(a)))
+            elif kind == kernels.I2C_STOP:
+                events.append(('stop', t))
+            elif kind == kernels.I2C_ADDRESS:
+                events.append(('address', t, a, bool(b), bool(c)))
+            else:
+                events.append(('data', t, a, bool(c)))
+        return events
+
+
+ONEWIRE_US = {'reset': 480, 'slot': 120, 'one': 15, 'presence': (60, 240), 'wait': 75}  # standard speed, µs
+ONEWIRE_OVERDRIVE_US = {'reset': 48, 'slot': 16, 'one': 2, 'presence': (8, 24), 'wait': 10}
+
+
+def pulses(times, levels, level):
+    """Indices, widths and the idle before each of the complete pulses to
+    level in (times, levels) of one line's changes, levels alternating;
+    the idle before is -1 for a pulse at the first change"""
+    starts = np.flatnonzero(levels[:-1] == level)
+    idle = np.where(starts > 0, times[starts] - times[np.maximum(starts - 1, 0)], -1)
+    return starts, times[starts + 1] - times[starts], idle
+
+
+def pack_runs(times, bits, breaks, msb_first):
+    """Bytes of runs of bits, a run starting at the first bit and at each
+    bit breaks marks: (times of each byte's first bit, values, index of
+    the last run's partial byte, len(bits) if it has none)"""
+    n = len(bits)
+    if not n:
+        return times[:0], bits[:0], 0
+    starts = breaks.copy()
+    starts[0] = True
+    first = np.flatnonzero(starts)
+    run = np.diff(np.concatenate([first, [n]]))  # bits per run
+    owner = np.cumsum(starts) - 1
+    position = np.arange(n) - first[owner]
+    whole = position < (run - run % 8)[owner]
+    times, bits = times[whole], bits[whole].astype(np.int64)
+    values = np.zeros(len(bits) // 8, dtype=np.int64)
+    for i in range(8):
+        values |= bits[i::8] << (7 - i if msb_first else i)
+    return times[::8], values, int(first[-1] + run[-1] - run[-1] % 8)
+
+
+def _kept(levels, level, *starts):
+    """Where a batch's decode leaves off: the earliest of starts, else the
+    last change, or the one before an unfinished pulse so its gap stays"""
+    n = len(levels)
+    last = n - 2 if n > 1 and levels[-1] == level else n - 1
+    return max(min([last, *starts]), 0)
+
+
+def onewire_decode(times, levels, tick_hz, overdrive=False, final=True):
+    """1-Wire on one line's changes, every low pulse classed by its width
+    at once: a reset (and the presence pulse a device answers it with),
+    or a time slot, a 1 if the line was back high within the 1 bit
+    time. Slots between resets make LSB-first bytes; a partial byte
+    before a reset is dropped. Returns ('reset', t, presence) and
+    ('byte', t, value) at the start of the reset and of the byte's first
+    slot, and the index of the first change to keep for the next batch:
+    unless final, a partial byte and a reset still waiting for its
+    presence pulse are left to it"""
+    limits = ONEWIRE_OVERDRIVE_US if overdrive else ONEWIRE_US
+    us = tick_hz / 1e6
+    starts, widths, idle = pulses(times, levels, 0)
+    reset = widths >= limits['reset'] * us
+    slot = widths < limits['slot'] * us
+    low, high = limits['presence']
+    presence = (np.concatenate([[False], reset[:-1]]) & (idle >= 0) & (idle <= limits['wait'] * us) &
+                (widths >= low * us) & (widths <= high * us))
+
+    held = []
+    resets = np.flatnonzero(reset)
+    if not final and len(resets) and resets[-1] == len(starts) - 1:
+        held.append(int(starts[resets[-1]]))  # its presence pulse may follow
+        resets = resets[:-1]
+    events = [('reset', t, answered) for t, answered in zip(
+        times[starts[resets]].tolist(), np.append(presence, False)[resets + 1].tolist())]
+
+    bit = slot & ~presence
+    k = np.flatnonzero(bit)
+    breaks = np.cumsum(~slot)[k]  # resets and overlong pulses so far
+    byte_times, values, partial = pack_runs(times[starts[k]], widths[k] <= limits['one'] * us,
+                                            np.diff(breaks, prepend=-1) != 0, msb_first=False)
+    events += [('byte', t, value) for t, value in zip(byte_times.tolist(), values.tolist())]
+    if not final and partial < len(k) and slot[k[-1]:].all():
+        held.append(int(starts[k[partial]]))  # the last run is still open
+    return sorted(events, key=lambda event: event[1]), _kept(levels, 0, *held)
+
+
+def ws2812_decode(times, levels, tick_hz, threshold_ns=625, reset_us=50, final=True):
+    """WS2812-style single-wire LED data on one line's changes: every high
+    pulse a bit, a 1 if it is wider than threshold_ns, all classed at
+    once. A low of at least reset_us latches a frame: bits between
+    latches make MSB-first bytes (G, R, B per LED), a partial byte
+    before a latch is dropped. Returns ('reset', t, None) at the start
+    of each latch, seen once the next frame starts, and ('byte', t,
+    value) at its first bit; and the index of the first change to keep
+    for the next batch: unless final, a partial byte is left to it"""
+    starts, widths, idle = pulses(times, levels, 1)
+    latch = idle >= reset_us * tick_hz / 1e6
+    events = [('reset', t, None) for t in times[starts[latch] - 1].tolist()]
+
+    byte_times, values, partial = pack_runs(times[starts], widths > threshold_ns * tick_hz / 1e9,
+                                            latch, msb_first=True)
+    events += [('byte', t, value) for t, value in zip(byte_times.tolist(), values.tolist())]
+    held = [int(starts[partial])] if not final and partial < len(starts) else []
+    return sorted(events, key=lambda event: event[1]), _kept(levels, 1, *held)
+
+
+class PulseStream:
+    """Incremental pulse-width decoder: feed() takes one line's levels in
+    time order, batch after batch, and returns what decode
+    (onewire_decode or ws2812_decode, with options) finds complete in
+    them. Each batch's pulses are classed at once; what it keeps between
+    batches is the changes of the byte in progress, or of a reset still
+    waiting for its presence pulse"""
+
+    def __init__(self, decode, idle, **options):
+        self.decode = decode
+        self.options = options
+        self.level = idle  # the line's level before the changes kept
+        self.pulse = 1 - idle
+        self.times = self.levels = np.empty(0, dtype=np.int64)
+
+    def lost(self):
+        """Drops what is in progress after a loss; True if a byte or a
+        reset was"""
+        busy = len(pulses(self.times, self.levels, self.pulse)[0]) > 0
+        self.times, self.levels = self.times[:0], self.levels[:0]
+        return busy
+
+    def feed(self, times, levels):
+        """times and levels may repeat a level (poll samples)"""
+        times, levels = level_changes(np.asarray(times, dtype=np.int64), np.asarray(levels, dtype=np.int64),
+                                      self.level)
+        if len(levels):
+            self.level = int(levels[-1])
+        times = np.concatenate([self.times, times])
+        levels = np.concatenate([self.levels, levels])
+        events, keep = self.decode(times, levels, final=False, **self.options)
+        self.times, self.levels = times[keep:], levels[keep:]
+        return events
+
+
+def decode_chunks(chunks, protocol, lines, bit_time=None, data_bits=8, parity='N',
+                  clock_polarity=0, clock_phase=0, tick_hz=None, overdrive=False):
+    """Runs one protocol's incremental decoder over a capture's record
+    chunks (capture_file.RecordChunks) and yields its events as the
+    chunks complete them, so memory is that of a chunk and the frame in
+    progress:
+      'uart', lines (rx,)                 ('byte', t, value), value None
+                                          for a framing or parity error;
+                                          bytes the firmware decoded too
+      'spi', lines (clk, mosi, miso, ss)  ('byte', t, mosi, miso); bytes
+                                          the firmware received too
+      'i2c', lines (scl, sda)             the I2cStream events; what the
+                                          firmware framed too
+      'onewire', lines (dq,)              onewire_decode's events, at
+                                          tick_hz, overdrive speed or not
+      'ws2812', lines (din,)              ws2812_decode's events, at tick_hz
+    with lines the channel numbers, None for a missing one (SS None for
+    a bus without it). At a drop note the decoder drops what it had in
+    progress, yielding ('lost', drop start[, bits discarded]) if there
+    was something"""
+    decoder = ChunkDecoder(protocol, lines, bit_time, data_bits, parity, clock_polarity, clock_phase,
+                           tick_hz, overdrive)
+    for chunk in chunks:
+        yield from decoder.events(chunk)
+
+
+class ChunkDecoder:
+    """decode_chunks a chunk at a time, for a caller that gets its
+    chunks as they arrive: events() yields what one chunk completes"""
+
+    def __init__(self, protocol, lines, bit_time=None, data_bits=8, parity='N',
+                 clock_polarity=0, clock_phase=0, tick_hz=None, overdrive=False):
+        self.protocol = protocol
+        self.lines = lines
+        if protocol == 'uart':
+            self.stream = UartStream(bit_time, data_bits, parity)
+        elif protocol == 'spi':
+            self.stream = SpiStream(clock_polarity, clock_phase)
+        elif protocol == 'onewire':
+            self.stream = PulseStream(onewire_decode, 1, tick_hz=tick_hz, overdrive=overdrive)
+        elif protocol == 'ws2812':
+            self.stream = PulseStream(ws2812_decode, 0, tick_hz=tick_hz)
+        else:
+            self.stream = I2cStream()
+
+    def lost(self, start):
+        """Drops what is in progress at a loss that starts at start,
+        yielding the events decode_chunks does at a drop note"""
+        protocol, stream = self.protocol, self.stream
+        if protocol == 'uart':
+            # a frame whose stop bit passed before the loss is whole
+            for t, value in stream.feed([], [], start):
+                yield ('byte', t, value)
+        if protocol == 'spi':
+            bits = stream.lost()
+            if bits:
+                yield ('lost', start, bits)
+        elif stream.reset() if protocol == 'uart' else stream.lost():
+            yield ('lost', start)  # a UART frame, I2C transaction or pulse byte
+
+    def events(self, chunk):
+        begin = 0
+        for end in np.flatnonzero(chunk['channel'] == CHANNEL_DROP_START).tolist() + [None]:
+            yield from _decode_part(self.stream, self.protocol, self.lines, chunk[begin:end])
+            if end is None:
+                break
+            yield from self.lost(int(chunk['time'][end]))
+            begin = end
+
+
+def _decode_part(stream, protocol, lines, records):
+    """decode_chunks for records without a drop note"""
+    if protocol == 'uart':
+        times, levels = level_changes(*channel_levels(records, lines[0]), stream.level)
+        timed = records['time'][records['channel'] < CHANNEL_DROP_START]
+        for t, value in stream.feed(times.tolist(), levels.tolist(),
+                                    int(timed[-1]) if len(timed) else None):
+            yield ('byte', t, value)
+        times, values, status = uart_records(records, lines[0])  # decoded on the device
+        for t, value, bad in zip(times.tolist(), values.tolist(), status.tolist()):
+            yield ('byte', t, None if bad else value)
+    elif protocol == 'spi':
+        times, mosi_bytes, miso_bytes, flags = spi_records(records)  # received on the device
+        for t, mosi_byte, miso_byte, flag in zip(times.tolist(), mosi_bytes.tolist(),
+                                                 miso_bytes.tolist(), flags.tolist()):
+            if flag & SPI_FLAG_OVERRUN:
+                yield ('lost', t, 0)
+            yield ('byte', t, mosi_byte, miso_byte)
+        clk, mosi, miso, ss = (None if ch is None else channel_levels(records, ch) for ch in lines)
+        if clk is None:
+            return
+        for t, mosi_byte, miso_byte in stream.feed(clk, mosi, miso, ss):
+            yield ('byte', t, mosi_byte, miso_byte)
+    elif protocol in ('onewire', 'ws2812'):
+        yield from stream.feed(*channel_levels(records, lines[0]))
+    else:
+        yield from i2c_events(*(column.tolist() for column in i2c_records(records)))  # framed on the device
+        scl = level_changes(*channel_levels(records, lines[0]), stream.scl)
+        sda = level_changes(*channel_levels(records, lines[1]), stream.sda)
+        yield from stream.feed(*(column.tolist() for column in merge_lines(scl, sda)))
+
+
+class UartSink(Sink):
+    """Decodes UART on one channel while the capture runs (UartStream):
+    edges of that channel, or its bit of the poll samples. Each batch's
+    bytes are printed on one line after the time of the first; a frame
+    cut by a loss is printed as ??. Bytes the firmware decoded from the
+    channel itself (UART_DECODE) are printed the same way, ?? for one
+    with a framing or parity error. Waits for the timestamp clock unless
+    tick_hz is given. With skip_lag_s it sheds newest first (see the
+    module doc): after a skip it takes the channel up again once the
+    line has idled high for a frame, and appends the range skipped to
+    the CSV skip_log, if given, for an offline decode"""
+
+    def __init__(self, channel, baud, data_bits=8, parity='N', tick_hz=None, skip_lag_s=None, skip_log=None):
+        self.channel = channel
+        self.baud = baud
+        self.data_bits = data_bits
+        self.parity = parity
+        self.stream = None
+        self.tick_hz = None
+        self.skip_log = skip_log
+        self.resync = False  # skipped: waiting for the line to idle
+        if tick_hz:
+            self.tick(tick_hz)
+        super().__init__(skip_lag_s=skip_lag_s)
+
+    def tick(self, tick_hz):
+        self.tick_hz = tick_hz
+        self.stream = UartStream(tick_hz / self.baud, self.data_bits, self.parity)
+
+    def gap(self):
+        if self.stream is not None:
+            self.stream.reset()
+            print("UART: ?? (data lost)")
+
+    def skip(self, first, last, records, lag):
+        if self.stream is not None:
+            self.stream.reset()
+        self.resync = True
+        span = f"{first / self.tick_hz:.6f}-{last / self.tick_hz:.6f}s" if self.tick_hz else f"ticks {first}-{last}"
+        print(f"UART: {lag:.1f}s behind, skipped {span} ({records} records) to catch up")
+        if self.skip_log:
+            new = not os.path.exists(self.skip_log)
+            with open(self.skip_log, 'a') as f:
+                if new:
+                    f.write("Sink,First-Time,Last-Time,Records,First-Seconds,Last-Seconds\n")
+                seconds = (f"{first / self.tick_hz:.6f},{last / self.tick_hz:.6f}" if self.tick_hz else ",")
+                f.write(f"UART CH{self.channel + 1},{first},{last},{records},{seconds}\n")
+
+    def _after_idle(self, times, levels, now):
+        """The channel's changes after the line first stays high for a
+        frame; none if it does not yet"""
+        times, levels = level_changes(times, levels, -1)
+        if not len(times):
+            return times, levels
+        ends = np.append(times[1:], now if now is not None else times[-1])
+        idle = np.flatnonzero((levels == 1) & (ends - times >= self.stream.stop_offset + self.stream.bit_time))
+        if not len(idle):
+            return times[:0], levels[:0]
+        self.resync = False
+        self.stream.level = 1
+        return times[idle[0] + 1:], levels[idle[0] + 1:]
+
+    def consume(self, records):
+        if self.stream is None:
+            return
+        channels = records['channel']
+        if (channels == CHANNEL_DROP_START).any():
+            self.gap()
+        times, levels = channel_levels(records, self.channel)
+        timed = records['time'][channels < CHANNEL_DROP_START]
+        now = int(timed[-1]) if len(timed) else None
+        if self.resync:
+            times, levels = self._after_idle(times, levels, now)
+        frames = self.stream.feed(times.tolist(), levels.tolist(), now)
+        times, values, status = uart_records(records, self.channel)
+        frames += [(t, None if bad else byte) for t, byte, bad in
+                   zip(times.tolist(), values.tolist(), status.tolist())]
+        if frames:
+            text = " ".join("??" if byte is None else f"{byte:02X}" for _, byte in frames)
+            print(f"UART {frames[0][0] / self.tick_hz:.6f}s: {text}")
+
+
+def decoder_lanes(comm_type, mapping):
+    """[(protocol, lines, lane channel)] of the decoders for a plotter's
+    channel roles, lines as decode_chunks takes them"""
+    role = {name: ch for ch, name in mapping.items()}
+    if comm_type == "UART":
+        return [('uart', (ch,), ch) for ch, name in mapping.items() if name in ("RX", "TX")]
+    if comm_type == "SPI" and "CLK" in role:
+        lines = (role["CLK"], role.get("MOSI"), role.get("MISO"), role.get("SS"))
+        return [('spi', lines, role.get("MOSI", role.get("MISO", role["CLK"])))]
+    if comm_type == "I2C" and "CLK" in role and "SDA" in role:
+        return [('i2c', (role["CLK"], role["SDA"]), role["SDA"])]
+    return []
+
+
+def bus_type(mapping):
+    """The comm type the channel roles of a plotter describe"""
+    names = set(mapping.values())
+    if names & {"RX", "TX"}:
+        return "UART"
+    if "SDA" in names:
+        return "I2C"
+    return "SPI" if names & {"MOSI", "MISO"} else None
+
+
+def size_bucket(n):
+    """Histogram bucket of a transfer of n bytes: 1, 2, 3-4, 5-8, ..."""
+    top = 1 << max(n - 1, 0).bit_length()
+    return str(n) if n <= 2 else f"{top // 2 + 1}-{top}"
+
+
+class ProtocolStatsSink(Sink):
+    """Aggregates the decoded bus instead of keeping its bytes, for long
+    monitoring runs. The decoders of the channel roles (decoder_lanes)
+    run on every batch, and what they complete only bumps counters:
+      UART  per line, bytes and bad frames
+      I2C   per address, transactions, bytes and NACKs
+      SPI   bytes and transfers, with a histogram of transfer sizes in
+            bytes; a transfer is an SS assertion, or without SS a run of
+            bytes closer than SPI_TRANSFER_GAP_S
+    and 'lost' for frames cut by a loss. Counters are kept per period of
+    every_s seconds for the last `periods` periods, so memory is fixed:
+    at most 128 addresses and a histogram bucket per power of two. Each
+    period the rates over that window are printed and, with csv_path,
+    appended to it as (host time, metric, per second) rows. UART waits
+    for the timestamp clock"""
+    SPI_TRANSFER_GAP_S = 100e-6
+
+    def __init__(self, mapping, every_s, baud=115200, periods=6, csv_path=None):
+        self.lanes = decoder_lanes(bus_type(mapping), mapping)
+        self.names = mapping
+        self.every_s = every_s
+        self.baud = baud
+        self.csv_path = csv_path
+        self.decoders = {}  # lane index: ChunkDecoder
+        self.history = collections.deque(maxlen=periods)  # Counters of finished periods
+        self.counts = collections.Counter()
+        self.tick_hz = None
+        self.transfer = 0  # SPI bytes of the transfer in progress
+        self.last_byte = None
+        self.ss = 1
+        self.since = time.monotonic()
+        super().__init__()
+
+    def tick(self, tick_hz):
+        self.tick_hz = tick_hz
+
+    def gap(self):
+        self.counts['lost'] += 1
+        for decoder in self.decoders.values():
+            list(decoder.lost(0))
+        self.transfer, self.last_byte = 0, None
+
+    def _decoder(self, k):
+        if k not in self.decoders:
+            protocol, lines, _ = self.lanes[k]
+            if protocol == 'uart' and not self.tick_hz:
+                return None
+            self.decoders[k] = ChunkDecoder(protocol, lines, self.tick_hz / self.baud if self.tick_hz else None)
+        return self.decoders[k]
+
+    def _spi_transfers(self, byte_times, ss_falls):
+        """Counts the transfers that the bytes and SS assertions close"""
+        gap = self.SPI_TRANSFER_GAP_S * self.tick_hz if self.tick_hz and ss_falls is None else None
+        falls = ss_falls or []
+        k = 0
+        for t in byte_times:
+            while k < len(falls) and falls[k] <= t:
+                self._close_transfer()
+                k += 1
+            if gap and self.last_byte is not None and t - self.last_byte > gap:
+                self._close_transfer()
+            self.transfer += 1
+            self.last_byte = t
+        if k < len(falls):  # asserted again after the last byte
+            self._close_transfer()
+
+    def _close_transfer(self):
+        if self.transfer:
+            self.counts['spi transfers'] += 1
+            self.counts[f'spi size {size_bucket(self.transfer)}'] += 1
+        self.transfer = 0
+
+    def consume(self, records):
+        for k, (protocol, lines, ch) in enumerate(self.lanes):
+            decoder = self._decoder(k)
+            if decoder is None:
+                continue
+            events = list(decoder.events(records))
+            self.counts['lost'] += sum(event[0] == 'lost' for event in events)
+            if protocol == 'uart':
+                name = self.names.get(ch, f"CH{ch + 1}")
+                values = [event[2] for event in events if event[0] == 'byte']
+                self.counts[f'uart {name} bytes'] += len(values)
+                self.counts[f'uart {name} errors'] += values.count(None)
+            elif protocol == 'i2c':
+                address = None
+                for event in events:
+                    if event[0] == 'address':
+                        address = f"0x{event[2]:02X}"
+                        self.counts[f'i2c {address} transactions'] += 1
+                        self.counts[f'i2c {address} nacks'] += not event[4]
+                    elif event[0] == 'data' and address is not None:
+                        self.counts[f'i2c {address} bytes'] += 1
+                        self.counts[f'i2c {address} nacks'] += not event[3]
+            else:
+                byte_times = [event[1] for event in events if event[0] == 'byte']
+                self.counts['spi bytes'] += len(byte_times)
+                ss_falls = None
+                if lines[3] is not None:
+                    times, levels = level_changes(*channel_levels(records, lines[3]), self.ss)
+                    self.ss = int(levels[-1]) if len(levels) else self.ss
+                    ss_falls = times[levels == 0].tolist()
+                self._spi_transfers(byte_times, ss_falls)
+        now = time.monotonic()
+        if now - self.since >= self.every_s:
+            self.history.append(self.counts)
+            self.counts = collections.Counter()
+            self.report(now, now - self.since)
+            self.since = now
+
+    def report(self, now, period_s):
+        totals = sum(self.history, collections.Counter())
+        seconds = period_s * len(self.history)
+        rate = {metric: count / seconds for metric, count in totals.items()}
+        parts = []
+        for metric in sorted(rate):
+            words = metric.split()
+            if words[0] == 'uart' and words[2] == 'bytes':
+                errors = totals[f'uart {words[1]} errors']
+                parts.append(f"{words[1]} {rate[metric]:.0f} B/s, "
+                             f"{100 * errors / max(totals[metric], 1):.2f}% bad frames")
+            elif words[0] == 'i2c' and words[2] == 'transactions':
+                parts.append(f"{words[1]} {rate[metric]:.1f}/s, {rate.get(f'i2c {words[1]} bytes', 0):.0f} B/s, "
+                             f"{totals[f'i2c {words[1]} nacks']} NACK")
+            elif metric == 'spi bytes':
+                buckets = sorted((m for m in totals if m.startswith('spi size')),
+                                 key=lambda m: int(m.split()[2].split('-')[0]))
+                sizes = " ".join(f"{m.split()[2]}:{totals[m]}" for m in buckets)
+                parts.append(f"{rate.get('spi transfers', 0):.1f} transfers/s, {rate[metric]:.0f} B/s"
+                             + (f", sizes {sizes}" if sizes else ""))
+        if totals['lost']:
+            parts.append(f"{totals['lost']} frames lost")
+        print(f"Bus over {seconds:.0f} s: {'; '.join(parts) or 'idle'}"
+              + (f"; {self.shed} records not decoded" if self.shed else ""))
+        if self.csv_path:
+            new = not os.path.exists(self.csv_path)
+            with open(self.csv_path, 'a', newline='') as f:
+                if new:
+                    f.write("Host-Time,Metric,Per-Second\n")
+                f.writelines(f"{time.time():.3f},{metric},{value:.3f}\n" for metric, value in sorted(rate.items()))
+
+
+class Pipeline:
+    """The producer: the ingest loop reports what it decoded here, and each
+    group becomes one record batch handed to every sink"""
+
+    def __init__(self, *sinks):
+        self.sinks = list(sinks)
+        self.stats = stage("publish")
+        # a sink with a thread of its own counts its work there; the others
+        # (the capture writer) work in put(), counted here
+        self.put_stats = [None if isinstance(sink, Sink) else stage(type(sink).__name__, sink.queue)
+                          for sink in self.sinks]
+
+    def publish(self, records):
+        start = time.perf_counter()
+        for sink, stats in zip(self.sinks, self.put_stats):
+            if stats is None:
+                sink.put(records)
+                continue
+            began = time.perf_counter()
+            sink.put(records)
+            stats.add(len(records), time.perf_counter() - began)
+            stats.depth()
+        self.stats.add(len(records), time.perf_counter() - start)
+
+    def queue_fill(self):
+        """The fullest sink queue as a share of its depth: how far the host
+        side has fallen behind the stream"""
+        return max((sink.queue.qsize() / sink.queue.maxsize for sink in self.sinks), default=0.0)
+
+    def _records(self, times, channels, values):
+        records = np.empty(len(times), dtype=RECORD_DTYPE)
+        records['time'] = times
+        records['channel'] = channels
+        records['value'] = values
+        self.publish(records)
+
+    def _notes(self, *notes):
+        self._records([number for _, number in notes], [channel for channel, _ in notes], 0)
+
+    def events(self, edges, channels, times):
+        """Edges as arrays, see serial_plotter.read_events"""
+        self._records(times, channels, edges)
+
+    def samples(self, times, levels):
+        """Poll samples: time and CH1-CH16 levels bit mask; a sample with
+        any of CH9-CH16 high gets a CHANNEL_LEVELS_HIGH record after it"""
+        levels = np.asarray(levels, np.uint16)
+        wide = levels > 0xFF
+        if not wide.any():
+            self._records(times, CHANNEL_LEVELS, levels)
+            return
+        at = np.arange(len(levels)) + np.cumsum(wide) - wide  # of each sample's record
+        records = np.empty(len(levels) + int(wide.sum()), dtype=RECORD_DTYPE)
+        records['time'][at] = times
+        records['channel'][at] = CHANNEL_LEVELS
+        records['value'][at] = levels & 0xFF
+        high = at[wide] + 1
+        records['time'][high] = np.asarray(times)[wide]
+        records['channel'][high] = CHANNEL_LEVELS_HIGH
+        records['value'][high] = levels[wide] >> 8
+        self.publish(records)
+
+    def uart(self, times, channels, values, status):
+        """Bytes the firmware decoded (UART_DECODE): start bit time,
+        source channel, byte and status flags"""
+        self._records(times, CHANNEL_UART + (np.asarray(status) << 2 | np.asarray(channels)), values)
+
+    def spi(self, times, mosi, miso, flags):
+        """Bytes the firmware's SPI sniffer received (CAPTURE_SPI_DMA):
+        time of the last bit, PB5 byte, PB15 byte and SPI_FLAG_* flags"""
+        rows = []
+        for t, first, second, flag in zip(times, mosi, miso, flags):
+            kind = CHANNEL_SPI + (2 if flag & SPI_FLAG_OVERRUN else 0)
+            rows.append((t, kind, first))
+            if flag & SPI_FLAG_MISO:
+                rows.append((t, kind + 1, second))
+        self._records([t for t, _, _ in rows], [kind for _, kind, _ in rows],
+                      [value for _, _, value in rows])
+
+    def i2c(self, times, events, values, flags):
+        """What the firmware's I2C framing sent (I2C_SNIFF): time of the
+        START, STOP or first SCL rise of a byte, I2C_EVENT_*, byte and
+        I2C_FLAG"""
+        self._records(times, CHANNEL_I2C + (np.asarray(events) << 1 | np.asarray(flags)), values)
+
+    def analog(self, times, samples):
+        """12-bit samples of the firmware's analog channel (ANALOG_CAPTURE)
+        at their clock times"""
+        samples = np.asarray(samples)
+        self._records(times, CHANNEL_ANALOG + (samples >> 8), samples & 0xFF)
+
+    def drop(self, count, start, end):
+        self._notes((CHANNEL_DROP_START, start), (CHANNEL_DROP_END, end),
+                    (CHANNEL_DROP_COUNT, count))
+
+    def sync(self, frame, clock, host):
+        self._notes((CHANNEL_SYNC_FRAME, frame), (CHANNEL_SYNC_CLOCK, clock),
+                    (CHANNEL_SYNC_HOST, -1 if host is None else int(host * 1e9)))
+
+    def trigger(self, time):
+        """Clock time a device trigger fired at (CAPTURE_TRIGGER)"""
+        self._notes((CHANNEL_TRIGGER, time))
+
+    def board_sync(self, time, flags):
+        """Clock time of a reference pulse shared by several boards
+        (BOARD_SYNC) and its SYNC_FLAG_* flags"""
+        self._records([time], [CHANNEL_BOARD_SYNC], [flags])
+
+    def levels(self, time, levels, channels):
+        """Levels of CH1-CH4 the firmware read off the pins at a clock time
+        (LEVEL_SNAPSHOT_MS), bit n = channel n; only the channels set in
+        channels stream their edges"""
+        self._records([time], [CHANNEL_LEVEL_SNAPSHOT], [levels | channels << SNAPSHOT_CHANNELS])
+
+    def storm(self, end, channel, count, level, calm):
+        """Summary of a rate-limited channel (STORM_LIMIT): its window's end
+        time and edge count, the channel's level then, and whether edges
+        stream again after it"""
+        self._records([end, count], [CHANNEL_STORM, CHANNEL_STORM_COUNT],
+                      [channel | level << 2 | (STORM_FLAG_CALM if calm else 0), 0])
+
+    def set_tick_hz(self, tick_hz):
+        for sink in self.sinks:
+            sink.set_tick_hz(tick_hz)
+
+    def flush(self):
+        for sink in self.sinks:
+            sink.flush()
+
+    def close(self):
+        for sink in self.sinks:
+            sink.close()
+            if sink.shed:
+                print(f"{type(sink).__name__} fell behind and skipped {sink.shed} records")
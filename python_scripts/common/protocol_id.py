@@ -0,0 +1,313 @@
+"""Protocol identification from edge statistics (in
+python_scripts/common): which of UART, SPI and I2C a capture's channels carry and the
+role of each channel, from the first AUTO_ID_EDGES edges, so a capture
+nobody set up still gets decoded.
+
+identify() works on a decoder_core.TransitionIndex. Every statistic is
+an array operation over a channel's change times:
+  idle level  the level the channel spends most of its time at
+  regularity  share of its pulses within CLOCK_SPREAD of their median
+              width: near 1 for a clock, whose only other pulses are
+              the gaps between bytes
+  bit fit     share of its pulses of up to 10 bits within BIT_SLACK of
+              a whole number of its shortest pulse cluster: near 1 for
+              UART
+  alignment   for every edge of another channel, how near the closest
+              clock edge is and which way that edge went, and the
+              clock's level: SPI data moves on one clock edge, I2C SDA
+              while SCL is low but at START and STOP
+  bursts      rising clock edges between gaps of CLOCK_GAP median
+              pulses: an I2C byte takes 9 with its ack, an SPI byte 8
+The most regular channel with the most edges is the clock candidate.
+With a partner that moves while it is high only at START and STOP, and
+bursts that count in nines, the bus is I2C. Otherwise the channels
+aligned to its edges are SPI data, in the order they first move (MOSI,
+then MISO), and a channel that is low around every clock edge is SS;
+the clock's idle level and the edge the data moves on give the mode.
+Without a clock, the channels that idle high and fit a bit time are
+UART, the one that talks first taken as TX. Roles the statistics cannot
+tell apart (MOSI from MISO, TX from RX) are a guess, and say so.
+
+IdentifySink does the same on the ingest side of a plotter started
+with the AUTO communication type: it holds the first batches until it
+has seen AUTO_ID_EDGES edges, prints what it found and then decodes
+the rest of the capture with the matching incremental decoder
+(pipeline.ChunkDecoder), a line per batch. `python serial_decoder.py
+auto <capture>` identifies a capture and decodes it as a batch."""
+from collections import namedtuple
+
+import numpy as np
+
+from capture_file import CaptureFile, CHANNEL_LEVELS_HIGH, MODE_SAMPLES, level_records
+from decoder_core import capture_index
+from live_annotations import label
+from pipeline import ChunkDecoder, Sink
+
+AUTO_ID_EDGES = 4000  # edges the identification looks at
+AUTO_ID_RETRIES = 3  # times the sink doubles that before it gives up
+MIN_EDGES = 16  # a channel with fewer is idle
+CLOCK_SPREAD = 0.25
+CLOCK_REGULAR = 0.7  # share of a clock's pulses near its median width
+CLOCK_GAP = 3.0
+ALIGN = 0.25  # of the clock's median pulse: an edge this near a clock edge moved with it
+DATA_ALIGNED = 0.6  # share of a data channel's edges aligned to the clock
+SS_COVER = 0.95  # share of clock edges while SS is low
+CLUSTER_GAP = 1.35  # pulse widths further apart than this ratio are different bit counts
+BIT_SLACK = 0.2
+UART_FIT = 0.8
+LINE_LABELS = 24  # decoded events printed per batch at most
+
+Identification = namedtuple('Identification', 'protocol roles options confidence notes')
+Stats = namedtuple('Stats', 'name times levels widths idle median regular bit fit')
+
+
+def auto_mapping(channels):
+    """The channel names of a capture whose roles are to be found"""
+    return {ch: f"CH{ch + 1}" for ch in range(channels)}
+
+
+def is_auto(mapping):
+    return mapping == auto_mapping(len(mapping))
+
+
+def shortest_cluster(widths):
+    """Mean of the shortest cluster of pulse widths holding at least a
+    tenth as many as the largest, clusters split wherever one sorted
+    width is more than CLUSTER_GAP times the one before"""
+    ordered = np.sort(widths)
+    bounds = np.concatenate([[0], np.flatnonzero(ordered[1:] > ordered[:-1] * CLUSTER_GAP) + 1, [len(ordered)]])
+    counts = np.diff(bounds)
+    first = int(np.flatnonzero(counts >= max(int(counts.max()) // 10, 2))[0])
+    return float(ordered[bounds[first]:bounds[first + 1]].mean())
+
+
+def channel_stats(index, name):
+    """Stats of one channel, None for one with under MIN_EDGES changes"""
+    times, levels = index.line(name)
+    widths = np.diff(times)
+    if len(widths) < MIN_EDGES or not (widths > 0).all():
+        return None
+    held = levels[:-1]
+    idle = int(widths[held == 1].sum() >= widths[held == 0].sum())
+    median = float(np.median(widths))
+    regular = float(np.mean(np.abs(widths - median) <= CLOCK_SPREAD * median))
+    bit = shortest_cluster(widths)
+    multiples = np.rint(widths / bit)
+    short = (multiples >= 1) & (multiples <= 10)
+    fit = float(np.mean(np.abs(widths[short] / bit - multiples[short]) <= BIT_SLACK)) if short.mean() >= 0.5 else 0.0
+    if fit:
+        bit = float(widths[short].sum() / multiples[short].sum())  # refined over every pulse
+    return Stats(name, times, levels, widths, idle, median, regular, bit, fit)
+
+
+def alignment(clock, times):
+    """(near, direction) for each of times: True if a clock edge is within
+    ALIGN of its median pulse, and the level that nearest edge went to"""
+    k = np.searchsorted(clock.times, times)
+    before = np.maximum(k - 1, 0)
+    after = np.minimum(k, len(clock.times) - 1)
+    nearest = np.where(np.abs(times - clock.times[before]) <= np.abs(clock.times[after] - times), before, after)
+    near = np.abs(times - clock.times[nearest]) <= ALIGN * clock.median
+    return near, clock.levels[nearest]
+
+
+def bursts(clock):
+    """Rising clock edges of each run between gaps of CLOCK_GAP median pulses"""
+    rising = (clock.levels == 1).astype(np.int64)
+    starts = np.concatenate([[0], np.flatnonzero(clock.widths > CLOCK_GAP * clock.median) + 1])
+    counts = np.add.reduceat(rising, starts)
+    return counts[counts > 0]
+
+
+def _i2c(index, clock, partner):
+    """Identification of clock and partner as SCL and SDA, None if they
+    are not"""
+    if not (clock.idle and partner.idle):
+        return None
+    high = index.levels_at(clock.name, partner.times, clock.idle) == 1
+    counts = bursts(clock)
+    nines, eights = np.mean(counts % 9 == 0), np.mean(counts % 8 == 0)
+    if not 0 < high.mean() < 0.4 or nines <= eights:
+        return None
+    return Identification('i2c', {'SCL': clock.name, 'SDA': partner.name}, {},
+                          float(nines * (1 - high.mean())),
+                          [f"{clock.name} bursts count in nines ({nines:.0%}), {partner.name} moves while it is "
+                           f"high only at START/STOP ({high.mean():.0%} of its edges)"])
+
+
+def _spi(index, clock, others):
+    """Identification of an SPI bus clocked by clock, None without data
+    aligned to it"""
+    notes = []
+    ss = None
+    for other in sorted(others, key=lambda stats: len(stats.times)):
+        covered = index.levels_at(other.name, clock.times, other.idle) == 0
+        if other.idle == 1 and len(other.times) * 8 <= len(clock.times) and covered.mean() >= SS_COVER:
+            ss = other
+            notes.append(f"{other.name} is low around {covered.mean():.0%} of the clock edges")
+            break
+    data, shifts = [], []
+    for other in others:
+        if other is ss:
+            continue
+        near, direction = alignment(clock, other.times)
+        if near.mean() >= DATA_ALIGNED:
+            data.append(other)
+            shifts.append(direction[near])
+    if not data:
+        return None
+    data.sort(key=lambda stats: stats.times[0])
+    shift = np.concatenate(shifts)
+    shift_level = int(shift.mean() >= 0.5)  # the edge the data moves on
+    agreement = float(max(shift.mean(), 1 - shift.mean()))
+    cpol = clock.idle
+    cpha = cpol if shift_level == 0 else 1 - cpol  # sampled on the other edge
+    roles = {'CLK': clock.name, 'MOSI': data[0].name}
+    if len(data) > 1:
+        roles['MISO'] = data[1].name
+        notes.append(f"MOSI and MISO told apart by which moved first ({data[0].name}), a guess")
+    if ss is not None:
+        roles['SS'] = ss.name
+    notes.insert(0, f"data moves on the clock's {'rising' if shift_level else 'falling'} edge "
+                    f"({agreement:.0%} of aligned edges), clock idles {'high' if cpol else 'low'}: mode {cpol << 1 | cpha}")
+    return Identification('spi', roles, {'clock_polarity': cpol, 'clock_phase': cpha},
+                          float(clock.regular * agreement), notes)
+
+
+def _uart(index, stats, tick_hz):
+    lines = sorted((line for line in stats if line.idle == 1 and line.fit >= UART_FIT),
+                   key=lambda line: line.times[0])
+    if not lines:
+        return None
+    roles = {'TX': lines[0].name}
+    if len(lines) > 1:
+        roles['RX'] = lines[1].name
+    bit = min(line.bit for line in lines)
+    notes = [f"{line.name}: {line.fit:.0%} of pulses fit a bit time of {line.bit:.1f} ticks" for line in lines]
+    if len(lines) > 1:
+        notes.append(f"TX is the line that talked first ({lines[0].name}), a guess")
+    options = {'bit_time': bit}
+    if tick_hz:
+        options['baud'] = int(round(tick_hz / bit))
+    return Identification('uart', roles, options, float(min(line.fit for line in lines)), notes)
+
+
+def identify(index, tick_hz=None):
+    """Identification of the bus on an index's channels: I2C if its bursts
+    and START/STOP fit, else the better scoring of SPI and UART; None if
+    none of them fits. SDA also moves with SCL's falling edge, so I2C
+    comes first rather than competing with SPI"""
+    tick_hz = tick_hz or index.tick_hz
+    stats = [line for line in (channel_stats(index, name) for name in index.lines) if line is not None]
+    found = []
+    clocks = sorted((line for line in stats if line.regular >= CLOCK_REGULAR),
+                    key=lambda line: len(line.times), reverse=True)
+    if clocks:
+        clock = clocks[0]
+        others = [line for line in stats if line is not clock]
+        i2c = _i2c(index, clock, others[0]) if len(others) == 1 else None
+        if i2c is not None:
+            return i2c
+        found.append(_spi(index, clock, others))
+    found.append(_uart(index, stats, tick_hz))
+    found = [candidate for candidate in found if candidate is not None]
+    return max(found, key=lambda candidate: candidate.confidence) if found else None
+
+
+def first_edges(index, count=AUTO_ID_EDGES):
+    """The index cut after its first count changes over all channels"""
+    times = np.sort(np.concatenate([index.line(name)[0] for name in index.lines] or [np.empty(0, np.int64)]))
+    return index.cut(None, int(times[count - 1]) + 1) if len(times) > count else index
+
+
+def describe(found):
+    """Lines telling what identify() found"""
+    if found is None:
+        return ["No UART, SPI or I2C bus recognized"]
+    roles = ", ".join(f"{role} = {name}" for role, name in found.roles.items())
+    extra = f", {found.options['baud']} baud" if 'baud' in found.options else ""
+    return ([f"Identified {found.protocol.upper()} ({found.confidence:.0%}): {roles}{extra}"]
+            + [f"  {note}" for note in found.notes])
+
+
+def group_specs(found):
+    """serial_decoder.py batch groups that decode what identify() found"""
+    roles = found.roles
+    if found.protocol == 'uart':
+        return [f"uart:{name}" for name in roles.values()]  # the batch decoder snaps the baud rate
+    if found.protocol == 'spi':
+        mode = found.options['clock_polarity'] << 1 | found.options['clock_phase']
+        return [f"spi:{mode}:{roles['CLK']}:{roles['MOSI']}:{roles.get('MISO', '-')}:{roles.get('SS', '-')}"]
+    return [f"i2c:{roles['SCL']}:{roles['SDA']}"]
+
+
+class IdentifySink(Sink):
+    """Identifies the bus from the first AUTO_ID_EDGES edges of a capture,
+    then decodes it as it arrives, one printed line per batch and
+    decoder; see the module doc. mapping names the channels by number"""
+
+    def __init__(self, mode, mapping, edges=AUTO_ID_EDGES):
+        self.mode = mode
+        self.names = [mapping.get(ch, f"CH{ch + 1}") for ch in range(max(mapping) + 1)]
+        self.edges = edges
+        self.tries = 0
+        self.held = []  # batches until the bus is identified
+        self.seen = 0
+        self.decoders = None  # [(label, ChunkDecoder)] once identified
+        self.tick_hz = None
+        super().__init__()
+
+    def tick(self, tick_hz):
+        self.tick_hz = tick_hz
+
+    def gap(self):
+        for _, decoder in self.decoders or ():
+            list(decoder.lost(0))  # drops the frame in progress
+
+    def consume(self, records):
+        if self.decoders is not None:
+            self._decode(records)
+            return
+        if self.tries > AUTO_ID_RETRIES:
+            return
+        self.held.append(records.copy())
+        if self.mode == MODE_SAMPLES:
+            self.seen += int(np.count_nonzero(np.diff(level_records(records)[1])))
+        else:
+            self.seen += int(np.count_nonzero(records['channel'] < CHANNEL_LEVELS_HIGH))
+        if self.seen < self.edges << self.tries or (self.mode != MODE_SAMPLES and not self.tick_hz):
+            return
+        held = np.concatenate(self.held)
+        index = capture_index(CaptureFile.from_records(held, self.mode, self.names, self.tick_hz or 0))
+        found = identify(first_edges(index, self.edges << self.tries), self.tick_hz)
+        self.tries += 1
+        if found is None:
+            if self.tries > AUTO_ID_RETRIES:
+                print("Auto: no UART, SPI or I2C bus recognized; decode the capture by hand")
+                self.held = []
+            return
+        for line in describe(found):
+            print(f"Auto: {line}")
+        number = {name: ch for ch, name in enumerate(self.names)}
+        roles = found.roles
+        if found.protocol == 'uart':
+            self.decoders = [(name, ChunkDecoder('uart', (number[name],), found.options['bit_time']))
+                             for name in roles.values()]
+        elif found.protocol == 'spi':
+            lines = tuple(number.get(roles.get(role)) for role in ('CLK', 'MOSI', 'MISO', 'SS'))
+            self.decoders = [('SPI', ChunkDecoder('spi', lines, clock_polarity=found.options['clock_polarity'],
+                                                  clock_phase=found.options['clock_phase']))]
+        else:
+            self.decoders = [('I2C', ChunkDecoder('i2c', (number[roles['SCL']], number[roles['SDA']])))]
+        self.held = []
+        self._decode(held)
+
+    def _decode(self, records):
+        for name, decoder in self.decoders:
+            events = list(decoder.events(records))
+            if not events:
+                continue
+            text = " ".join(label(event)[1] for event in events[:LINE_LABELS])
+            more = f" (+{len(events) - LINE_LABELS})" if len(events) > LINE_LABELS else ""
+            start = f"{events[0][1] / self.tick_hz:.6f}s" if self.tick_hz else f"{events[0][1]}"
+            print(f"{name} {start}: {text}{more}")
@@ -0,0 +1,202 @@
+"""Replays a recorded capture (bitlog.lacap, a rotated capture's index or
+a CSV export) through the host side without hardware, so decoder and
+pipeline regressions show up as numbers. Shared by both script folders
+(python_scripts/common).
+
+Stages, each timed on its own with its peak memory:
+  read      capture_file.RecordChunks over the capture
+  pipeline  the plot path: every chunk through a pipeline.Pipeline into a
+            capture file and the shared ring, which the replay drains
+            the way the plot does
+  chunked   pipeline.decode_chunks, the decoders' --chunked path
+  index     decoder_core.load_index and decode, their default path
+With a speed the read, pipeline and chunked stages release the records
+at that multiple of their capture time (1 = real time) and report how
+far they fell behind it; without one they run as fast as they can.
+
+Peak memory is what Python and numpy allocated (tracemalloc), sink
+threads included; pages of the memory-mapped capture are not counted.
+Tracing slows Python-heavy code several times over, so each stage runs
+twice: timed untraced, then traced as fast as it can, when its queues
+run fullest. The rows are added to replay_benchmark.csv, so runs before and after a
+change can be compared."""
+import csv
+import os
+import sys
+import tempfile
+import time
+import tracemalloc
+
+import numpy as np
+
+from capture_file import CaptureWriter, RecordChunks, MODE_EVENTS, MODE_SAMPLES, CHANNEL_LEVELS
+from decoder_core import decode, load_index
+from pipeline import Pipeline, RingSink, decode_chunks
+from shm_ring import SharedRing
+
+# clock of a CSV export, which does not record it: the interrupt
+# firmware's power-up clock, and CYCCNT of the polling firmware
+CSV_TICK_HZ = {MODE_EVENTS: 5_140_000, MODE_SAMPLES: 72_000_000}
+PACE_RECORDS = 4096  # records released at a time when paced
+SPI_CHANNELS = (('SCK', 'CLK'), ('MOSI',), ('MISO',), ('SS', 'CS'))
+I2C_CHANNELS = (('SCL',), ('SDA',))
+RESULTS = "replay_benchmark.csv"
+
+def parse_protocol(spec):
+    """(protocol, channel name candidates per line, options) of
+    uart:<channel>:<baud>, spi[:<mode 0-3>] or i2c"""
+    protocol, *args = spec.lower().split(':')
+    if protocol == 'uart' and len(args) == 2:
+        return protocol, ((spec.split(':')[1],),), {'baud': int(args[1])}
+    if protocol == 'spi' and len(args) <= 1:
+        mode = int(args[0]) if args else 0
+        return protocol, SPI_CHANNELS, {'clock_polarity': mode >> 1, 'clock_phase': mode & 1}
+    if protocol == 'i2c' and not args:
+        return protocol, I2C_CHANNELS, {}
+    raise ValueError(f"bad protocol '{spec}', expected uart:<channel>:<baud>, spi[:<mode>] or i2c")
+
+def paced(chunks, tick_hz, speed, lag):
+    """chunks, in slices released at speed times their capture time;
+    lag[0] becomes the furthest behind that schedule a slice got, in s"""
+    if not speed:
+        yield from chunks
+        return
+    start = first = None
+    for chunk in chunks:
+        for begin in range(0, len(chunk), PACE_RECORDS):
+            part = chunk[begin:begin + PACE_RECORDS]
+            t = int(part['time'][-1])
+            if first is None:
+                start, first = time.perf_counter(), t
+            due = start + (t - first) / tick_hz / speed
+            now = time.perf_counter()
+            if due > now:
+                time.sleep(due - now)
+            else:
+                lag[0] = max(lag[0], now - due)
+            yield part
+
+def measure(stage, run, speed):
+    """Runs one stage, run(speed) returning (records, output); returns its
+    row"""
+    begin = time.perf_counter()
+    records, output = run(speed)
+    seconds = time.perf_counter() - begin
+    tracemalloc.start()
+    run(0.0)
+    peak = tracemalloc.get_traced_memory()[1]
+    tracemalloc.stop()
+    return {'stage': stage, 'records': records, 'output': output, 'seconds': seconds,
+            'records/s': records / seconds if seconds else 0.0, 'peak MB': peak / 1e6}
+
+def replay(path, spec, speed=0.0):
+    """Rows of the four stages for one capture and decoder"""
+    protocol, candidates, options = parse_protocol(spec)
+    names = [name for group in candidates for name in group]
+    reader = RecordChunks(path, names)
+    tick_hz = reader.tick_hz or CSV_TICK_HZ[reader.mode]
+    lines = tuple(next((reader.names.index(name) for name in group if name in reader.names), None)
+                  for group in candidates)
+    if protocol == 'uart' and lines[0] is None:
+        raise ValueError(f"channel {candidates[0][0]} not in the capture")
+    chunk_options = dict(options)
+    if protocol == 'uart':
+        chunk_options = {'bit_time': tick_hz / chunk_options.pop('baud')}
+    lag = {}
+
+    def read(speed):
+        lag.setdefault('read', [0.0])
+        count = 0
+        for chunk in paced(reader, tick_hz, speed, lag['read']):
+            count += len(chunk)
+        return count, count
+
+    def pipeline(speed):
+        lag.setdefault('pipeline', [0.0])
+        ring = SharedRing()
+        with tempfile.TemporaryDirectory() as tmp:
+            mapping = {ch: name for ch, name in enumerate(reader.names)}
+            pipe = Pipeline(CaptureWriter(os.path.join(tmp, "replay.lacap"), reader.mode, mapping,
+                                          tick_hz=tick_hz),
+                            RingSink(ring))
+            count = drawn = lost = 0
+            for chunk in paced(reader, tick_hz, speed, lag['pipeline']):
+                pipe.publish(chunk)
+                count += len(chunk)
+                records, missed = ring.read()
+                drawn += int(np.count_nonzero(records['channel'] <= CHANNEL_LEVELS))
+                lost += missed
+            pipe.close()
+            records, missed = ring.read()
+            drawn += int(np.count_nonzero(records['channel'] <= CHANNEL_LEVELS))
+        ring.close()
+        if lost + missed:
+            print(f"pipeline: the ring reader fell behind and lost {lost + missed} records")
+        return count, drawn
+
+    def chunked(speed):
+        lag.setdefault('chunked', [0.0])
+        counted = [0]
+
+        def counting():
+            for chunk in paced(reader, tick_hz, speed, lag['chunked']):
+                counted[0] += len(chunk)
+                yield chunk
+        events = sum(1 for _ in decode_chunks(counting(), protocol, lines, **chunk_options))
+        return counted[0], events
+
+    def index(_):
+        transitions = load_index(path, names)
+        line_names = [next((name for name in group if name in transitions), None)
+                      for group in candidates]
+        if protocol == 'uart':
+            kwargs = {'channel': line_names[0], 'bit_time': tick_hz / options['baud']}
+        elif protocol == 'spi':
+            kwargs = dict(zip(('clk', 'mosi', 'miso', 'ss'), line_names), **options)
+            kwargs['miso'] = kwargs['miso'] or kwargs['mosi']
+        else:
+            kwargs = {'scl': line_names[0], 'sda': line_names[1]}
+        events = sum(1 for _ in decode(transitions, protocol, **kwargs))
+        return sum(len(transitions.line(name)[0]) for name in line_names if name in transitions), events
+
+    rows = [measure(stage, run, speed) for stage, run in
+            (('read', read), ('pipeline', pipeline), ('chunked', chunked), ('index', index))]
+    for row in rows:
+        row['lag s'] = lag.get(row['stage'], [0.0])[0]
+    return rows
+
+def main():
+    if len(sys.argv) not in (3, 4):
+        print("Usage: python replay_benchmark.py <bitlog.lacap or csv file> <protocol> [speed]")
+        print("Protocols: uart:<channel>:<baud>, spi[:<mode 0-3>], i2c")
+        print("speed: multiple of real time to replay at, 0 or none = as fast as possible")
+        sys.exit(1)
+    path, spec = sys.argv[1], sys.argv[2]
+    speed = float(sys.argv[3]) if len(sys.argv) == 4 else 0.0
+    try:
+        rows = replay(path, spec, speed)
+    except FileNotFoundError:
+        print(f"Error: File '{path}' not found.")
+        sys.exit(1)
+    except ValueError as e:
+        print(f"Error: {e}")
+        sys.exit(1)
+
+    print(f"{'stage':>9} {'records':>10} {'output':>10} {'seconds':>9} {'records/s':>12} "
+          f"{'peak MB':>8}" + (f" {'lag s':>7}" if speed else ""))
+    for row in rows:
+        print(f"{row['stage']:>9} {row['records']:>10} {row['output']:>10} {row['seconds']:>9.3f} "
+              f"{row['records/s']:>12.0f} {row['peak MB']:>8.1f}"
+              + (f" {row['lag s']:>7.3f}" if speed else ""))
+
+    new_file = not os.path.exists(RESULTS)
+    with open(RESULTS, "a", newline='') as f:
+        writer = csv.DictWriter(f, fieldnames=['capture', 'protocol', 'speed'] + list(rows[0]))
+        if new_file:
+            writer.writeheader()
+        for row in rows:
+            writer.writerow({'capture': path, 'protocol': spec, 'speed': speed, **row})
+    print(f"Results added to {RESULTS}")
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,28 @@
+"""Switches a DUAL_IMAGE analyzer between its two firmwares with host
+command 'J' (see boot_slot.h). Shared by both script folders
+(python_scripts/common).
+
+  python select_image.py <port> edge|poll
+
+The device leaves the bus and comes back running the other image, about
+a second later and usually on a new port name. Unplugging it always
+brings back the interrupt firmware. The port is opened as a CDC serial
+port; USB_VENDOR_CLASS builds are not supported here."""
+import struct
+import sys
+
+BAUDRATE = 115200
+SLOTS = {'edge': 0, 'poll': 1}  # BOOT_SLOT_A, BOOT_SLOT_B
+
+def main():
+    if len(sys.argv) != 3 or sys.argv[2] not in SLOTS:
+        print("Usage: python select_image.py <port> edge|poll")
+        sys.exit(1)
+    import serial
+    with serial.Serial(sys.argv[1], BAUDRATE, timeout=1) as ser:
+        ser.write(struct.pack('<cB', b'J', SLOTS[sys.argv[2]]))
+        ser.flush()
+    print(f"Resetting into the {sys.argv[2]} firmware; reopen the port once it enumerates")
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,93 @@
+"""Shared-memory ring that carries capture records (capture_file.py) from
+the ingest process to the plot and any other process that attaches.
+
+One process writes; readers only read. The block starts with a 64-byte
+header whose first word counts the records ever written, followed by
+the ring of `capacity` RECORD_DTYPE records. The third header word is
+the record timestamp clock in Hz once the writer knows it, else 0. The writer copies records
+in, then publishes the new count; it never waits for a reader. Each
+reader keeps its own position, and one that falls more than a ring
+behind skips ahead to the oldest record still there and counts the rest
+as lost. A reader checks the count again after copying, so records the
+writer overwrote meanwhile are dropped instead of returned torn.
+
+A pipeline.RingSink writes every record batch of the capture to it, in
+the same order as to the file."""
+import sys
+from multiprocessing import parent_process, resource_tracker, shared_memory
+
+import numpy as np
+
+from capture_file import RECORD_DTYPE
+
+HEADER_BYTES = 64
+RING_RECORDS = 1 << 20  # 10 MB, seconds of the fastest stream
+
+
+class SharedRing:
+
+    def __init__(self, name=None, capacity=RING_RECORDS):
+        """Creates a ring, or attaches to the one called name"""
+        if name is None:
+            self.shm = shared_memory.SharedMemory(
+                create=True, size=HEADER_BYTES + capacity * RECORD_DTYPE.itemsize)
+            self.owner = True
+        else:
+            if sys.version_info >= (3, 13):
+                self.shm = shared_memory.SharedMemory(name, track=False)
+            else:
+                self.shm = shared_memory.SharedMemory(name)
+                if parent_process() is None:
+                    # a process of its own would unlink the ring when it exits
+                    resource_tracker.unregister(self.shm._name, 'shared_memory')
+            self.owner = False
+        self.name = self.shm.name
+        self.head = np.ndarray((3,), np.uint64, buffer=self.shm.buf)  # written, capacity, tick Hz
+        if self.owner:
+            self.head[:] = (0, capacity, 0)
+        self.capacity = int(self.head[1])
+        self.records = np.ndarray((self.capacity,), RECORD_DTYPE, buffer=self.shm.buf,
+                                  offset=HEADER_BYTES)
+        self.position = int(self.head[0])  # reader: next record to return
+
+    def write(self, records):
+        n = len(records)
+        if n > self.capacity:
+            records, n = records[-self.capacity:], self.capacity
+        written = int(self.head[0])
+        pos = written % self.capacity
+        first = min(n, self.capacity - pos)
+        self.records[pos:pos + first] = records[:first]
+        self.records[:n - first] = records[first:]
+        self.head[0] = written + n
+
+    def set_tick_hz(self, tick_hz):
+        self.head[2] = int(tick_hz)
+
+    @property
+    def tick_hz(self):
+        """The timestamp clock, 0 until the writer sets it"""
+        return int(self.head[2])
+
+    def read(self):
+        """Records written since the last read, and how many were lost
+        because this reader fell a ring behind"""
+        written = int(self.head[0])
+        lost = max(written - self.capacity - self.position, 0)
+        start = self.position + lost
+        pos = start % self.capacity
+        n = written - start
+        first = min(n, self.capacity - pos)
+        records = np.concatenate([self.records[pos:pos + first], self.records[:n - first]])
+        overwritten = int(self.head[0]) - self.capacity - start
+        if overwritten > 0:
+            records = records[overwritten:]
+            lost += overwritten
+        self.position = written
+        return records, lost
+
+    def close(self):
+        self.head = self.records = None
+        self.shm.close()
+        if self.owner:
+            self.shm.unlink()
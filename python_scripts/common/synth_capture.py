@@ -0,0 +1,345 @@
+"""Synthesizes captures of UART, SPI or I2C traffic of any length, for
+scaling the decoders past what the hardware can record (the event time
+field wraps after 1.74 minutes; a long real capture also needs a long
+real stimulus). Shared by both
+script folders (python_scripts/common).
+
+  python synth_capture.py <output .lacap or .csv> <protocol> <events|samples> <seconds>
+                          [rate B/s] [jitter] [glitches/s] [seed]
+
+protocol is uart[:<baud>], spi[:<mode 0-3>[:<SCK Hz>]] or i2c[:<SCL Hz>],
+on the lines TX; SCK, MOSI, MISO, SS; or SCL, SDA, in channel order.
+'events' writes an interrupt-mode capture: edges on the firmware's
+power-up clock. 'samples' writes a polling-mode capture: every sample
+at SAMPLE_HZ on the DWT clock. A .csv output gets the layout
+capture_file.export_csv writes, anything else the binary format.
+
+The payload is seeded random bytes: one per UART frame or SPI
+transfer (SS asserted per byte), I2C_BYTES per I2C write to
+I2C_ADDRESS. Transfers start at random (exponential) gaps that average
+rate payload bytes per second (default: half what the line carries).
+jitter moves every edge by a normal offset of that many bit times,
+cut off at JITTER_CLIP so no line's edges change order. glitches/s
+adds pulses of GLITCH_NS on random lines at random times, where no
+edge is; they may break the bytes they land on.
+
+The ground truth goes to <output>.truth.csv, one row per byte and
+glitch: Kind,Time,Value,Aux, with the time in capture ticks as the
+decoders report it:
+  byte     UART: start bit, Aux empty; SPI: last sampling edge, Aux the
+           MISO byte
+  address  I2C: first SCL rise of the byte, Value the 7-bit address
+  data     I2C: first SCL rise of the byte
+  glitch   start of the pulse, Value its channel, Aux its width
+Generation runs CHUNK_UNITS transfers at a time, so memory does not
+grow with the duration."""
+import csv
+import sys
+import time
+from operator import itemgetter
+
+import numpy as np
+
+from capture_file import CaptureWriter, MODE_EVENTS, MODE_SAMPLES, CHANNEL_LEVELS, RECORD_DTYPE
+
+EVENT_TICK_HZ = 72_000_000 / 14  # the interrupt firmware's power-up clock
+SAMPLE_TICK_HZ = 72_000_000      # DWT->CYCCNT of the polling firmware
+SAMPLE_HZ = 1_000_000            # POLL_SAMPLE_PERIOD 72
+CHUNK_UNITS = 1 << 14            # transfers generated at a time
+CHUNK_SAMPLES = 1 << 20          # samples written at a time
+LINES = {'uart': ('TX',), 'spi': ('SCK', 'MOSI', 'MISO', 'SS'), 'i2c': ('SCL', 'SDA')}
+LINE_HZ = {'uart': 115200, 'spi': 1_000_000, 'i2c': 100_000}  # default baud, SCK or SCL Hz
+I2C_ADDRESS = 0x50
+I2C_BYTES = 16                   # data bytes per I2C write
+JITTER_CLIP = 0.1                # bit times
+GLITCH_NS = (50, 300)            # shortest and longest glitch
+SEED = 0x2545F491
+
+
+def parse_protocol(spec):
+    """(protocol, line Hz, SPI mode) of uart[:baud], spi[:mode[:Hz]] or
+    i2c[:Hz]"""
+    protocol, *args = spec.lower().split(':')
+    if protocol == 'uart' and len(args) <= 1:
+        return protocol, int(args[0]) if args else LINE_HZ['uart'], 0
+    if protocol == 'spi' and len(args) <= 2:
+        mode = int(args[0]) if args else 0
+        if not 0 <= mode <= 3:
+            raise ValueError(f"bad SPI mode {mode}")
+        return protocol, int(args[1]) if len(args) > 1 else LINE_HZ['spi'], mode
+    if protocol == 'i2c' and len(args) <= 1:
+        return protocol, int(args[0]) if args else LINE_HZ['i2c'], 0
+    raise ValueError(f"bad protocol '{spec}', expected uart[:<baud>], spi[:<mode>[:<Hz>]] or i2c[:<Hz>]")
+
+
+def uart_units(payload, starts, bit, _):
+    """8N1 frames, LSB first: per-line (times, levels) per frame, truth
+    columns, ticks a frame takes"""
+    levels = np.empty((len(starts), 10), dtype=np.int8)
+    levels[:, 0] = 0
+    levels[:, 1:9] = (payload[:, None] >> np.arange(8)) & 1
+    levels[:, 9] = 1
+    times = starts[:, None] + np.arange(10) * bit
+    return [(times, levels)], [('byte', starts, payload, None)], 10 * bit
+
+
+def spi_units(payload, starts, bit, mode):
+    """One byte per SS assertion, MSB first; MISO carries the payload
+    byte reversed, so both lines are checked"""
+    cpol, cpha = mode >> 1, mode & 1
+    half = bit / 2
+    miso = np.array([int(f'{b:08b}'[::-1], 2) for b in range(256)], dtype=np.int64)[payload]
+    n = len(starts)
+    t0 = starts[:, None] + half  # SS falls half a bit before the first data bit
+    k = np.arange(8)
+
+    clock_times = t0 + half * (np.arange(16) + 1)
+    clock_levels = np.broadcast_to(np.where(np.arange(16) % 2 == 0, 1 - cpol, cpol), (n, 16))
+    data_times = t0 + k * bit + (half if cpha else 0)  # set half a bit before the sampling edge
+    mosi_levels = (payload[:, None] >> (7 - k)) & 1
+    miso_levels = (miso[:, None] >> (7 - k)) & 1
+    ss_times = np.concatenate([starts[:, None], t0 + 8 * bit + half], axis=1)
+    ss_levels = np.broadcast_to(np.array([0, 1]), (n, 2))
+    last_sample = starts + half + 7 * bit + (bit if cpha else half)
+    return ([(clock_times, clock_levels), (data_times, mosi_levels), (data_times, miso_levels),
+             (ss_times, ss_levels)],
+            [('byte', last_sample, payload, miso)], 10 * bit)
+
+
+def i2c_units(payload, starts, bit, _):
+    """A write of I2C_BYTES to I2C_ADDRESS per transaction, every byte
+    ACKed: START, the bits with SDA set mid-low, STOP"""
+    n = len(starts)
+    frame = np.concatenate([np.full((n, 1), I2C_ADDRESS << 1), payload.reshape(n, I2C_BYTES)], axis=1)
+    bits = np.zeros((n, I2C_BYTES + 1, 9), dtype=np.int64)  # bit 8 of each byte: ACK low
+    bits[:, :, :8] = (frame[:, :, None] >> np.arange(7, -1, -1)) & 1
+    bits = bits.reshape(n, -1)
+    count = bits.shape[1]
+    half, quarter = bit / 2, bit / 4
+    i = np.arange(count)
+    end = half + count * bit  # SCL low after the last ACK
+
+    sda_times = np.concatenate([[0], half + i * bit + quarter, [end + quarter, end + bit]])
+    sda_levels = np.concatenate([np.zeros((n, 1)), bits, np.zeros((n, 1)), np.ones((n, 1))], axis=1)
+    scl_times = np.concatenate([[half], np.stack([(i + 1) * bit, (i + 1) * bit + half], axis=1).ravel(),
+                                [end + half]])
+    scl_levels = np.concatenate([[0], np.tile([1, 0], count), [1]])
+    byte_times = starts[:, None] + (9 * np.arange(I2C_BYTES + 1) + 1) * bit  # first SCL rises
+    return ([(starts[:, None] + scl_times, np.broadcast_to(scl_levels, (n, len(scl_levels)))),
+             (starts[:, None] + sda_times, sda_levels.astype(np.int8))],
+            [('address', byte_times[:, 0], np.full(n, I2C_ADDRESS), None),
+             ('data', byte_times[:, 1:].ravel(), payload, None)], end + 3 * bit)
+
+
+UNITS = {'uart': (uart_units, 1), 'spi': (spi_units, 1), 'i2c': (i2c_units, I2C_BYTES)}
+
+
+class Synth:
+    """Generates the capture one chunk of transfers at a time"""
+
+    def __init__(self, protocol, line_hz, mode, tick_hz, rate, jitter, glitch_rate, seed):
+        self.build, self.unit_bytes = UNITS[protocol]
+        self.lines = len(LINES[protocol])
+        self.mode, self.tick_hz = mode, tick_hz
+        self.bit = tick_hz / line_hz
+        if self.bit / (4 if protocol == 'i2c' else 2) < 1:
+            raise ValueError(f"{line_hz} Hz is too fast for a {tick_hz:.0f} Hz clock")
+        self.duration = self.build(np.zeros(self.unit_bytes, dtype=np.int64), np.zeros(1), self.bit, mode)[2]
+        self.max_rate = self.unit_bytes * tick_hz / self.duration
+        self.rate = rate or self.max_rate / 2
+        if self.rate > self.max_rate:
+            raise ValueError(f"rate above what the line carries, {self.max_rate:.0f} B/s")
+        self.gap = self.unit_bytes * tick_hz / self.rate - self.duration  # mean ticks between transfers
+        self.jitter, self.glitch_rate = jitter, glitch_rate
+        self.glitch_ticks = tuple(max(1, round(ns * 1e-9 * tick_hz)) for ns in GLITCH_NS)
+        self.rng = np.random.default_rng(seed)
+        self.cursor = self.bit  # next transfer's earliest start
+        self.levels = [None] * self.lines  # each line's level at the cursor
+
+    def chunk(self, end):
+        """(edges per line as (times, levels), truth rows, chunk end, line
+        levels at the chunk start) of the next transfers starting before
+        tick end, or None past it"""
+        if self.cursor >= end:
+            return None
+        n = CHUNK_UNITS
+        gaps = self.rng.exponential(self.gap, n) if self.gap > 0 else np.zeros(n)
+        starts = self.cursor + np.cumsum(gaps) + np.arange(n) * self.duration
+        starts = starts[starts < end]
+        n = len(starts)
+        if not n:
+            self.cursor = end
+            return None
+        chunk_end = starts[-1] + self.duration
+        payload = self.rng.integers(0, 256, n * self.unit_bytes, dtype=np.int64)
+        lines, truth, _ = self.build(payload, starts, self.bit, self.mode)
+
+        edges = []
+        start_levels = []
+        for line, (times, levels) in enumerate(lines):
+            times, levels = times.ravel(), np.asarray(levels, dtype=np.int8).ravel()
+            if self.jitter:
+                cut = JITTER_CLIP * self.bit
+                times = times + np.clip(self.rng.normal(0, self.jitter * self.bit, len(times)), -cut, cut)
+            if self.levels[line] is None:
+                self.levels[line] = levels[len(levels) // n - 1]  # where the first transfer leaves it
+            start_levels.append(self.levels[line])
+            before = np.concatenate([[self.levels[line]], levels[:-1]])
+            changed = levels != before
+            edges.append((np.rint(times[changed]).astype(np.int64), levels[changed]))
+            self.levels[line] = levels[-1]
+        rows = [(kind, np.rint(t).astype(np.int64), value, aux) for kind, t, value, aux in truth]
+        rows += self._glitch(edges, start_levels, int(self.cursor), int(chunk_end))
+        self.cursor = chunk_end
+        return edges, rows, int(chunk_end), start_levels
+
+    def _glitch(self, edges, start_levels, begin, end):
+        count = self.rng.poisson(self.glitch_rate * (end - begin) / self.tick_hz)
+        if not count:
+            return []
+        starts = np.sort(self.rng.integers(begin, end, count))
+        widths = self.rng.integers(self.glitch_ticks[0], self.glitch_ticks[1] + 1, count)
+        channels = self.rng.integers(0, self.lines, count)
+        kept = np.zeros(count, dtype=bool)
+        for line, (times, levels) in enumerate(edges):
+            mine = np.flatnonzero(channels == line)
+            g, w = starts[mine], widths[mine]
+            before = np.searchsorted(times, g, 'left')
+            clear = (before == np.searchsorted(times, g + w, 'right')) & (g + w < end)
+            g, w, before = g[clear], w[clear], before[clear]
+            level = level_before(levels, before, start_levels[line])
+            times = np.concatenate([times, g, g + w])
+            levels = np.concatenate([levels, 1 - level, level]).astype(np.int8)
+            order = np.argsort(times, kind='stable')
+            edges[line] = (times[order], levels[order])
+            kept[mine[clear]] = True
+        return [('glitch', starts[kept], channels[kept], widths[kept])]
+
+
+def level_before(levels, index, first):
+    """Level of a line before each of its edges at index, first before
+    the first one"""
+    if not len(levels):
+        return np.full(len(index), first, dtype=np.int8)
+    return np.where(index > 0, levels[np.maximum(index - 1, 0)], first).astype(np.int8)
+
+
+def sample_records(edges, begin, end, first_levels):
+    """Poll sample records every SAMPLE_TICK_HZ / SAMPLE_HZ ticks from
+    begin to end, CHUNK_SAMPLES at a time"""
+    period = SAMPLE_TICK_HZ // SAMPLE_HZ
+    start = -(-begin // period) * period
+    for t0 in range(start, end, CHUNK_SAMPLES * period):
+        times = np.arange(t0, min(end, t0 + CHUNK_SAMPLES * period), period, dtype=np.int64)
+        values = np.zeros(len(times), dtype=np.uint8)
+        for line, (edge_times, levels) in enumerate(edges):
+            level = level_before(levels, np.searchsorted(edge_times, times, 'right'), first_levels[line])
+            values |= level.astype(np.uint8) << np.uint8(line)
+        records = np.empty(len(times), dtype=RECORD_DTYPE)
+        records['time'], records['channel'], records['value'] = times, CHANNEL_LEVELS, values
+        yield records
+
+
+def event_records(edges):
+    """Edge records of all lines in time order"""
+    times = np.concatenate([t for t, _ in edges])
+    order = np.argsort(times, kind='stable')
+    records = np.empty(len(times), dtype=RECORD_DTYPE)
+    records['time'] = times[order]
+    records['channel'] = np.concatenate([np.full(len(t), line) for line, (t, _) in enumerate(edges)])[order]
+    records['value'] = np.concatenate([levels for _, levels in edges])[order]
+    return records
+
+
+class CsvSink:
+    """Writes records as capture_file.export_csv lays them out"""
+
+    def __init__(self, path, mode, names, tick_hz):
+        self.f = open(path, 'w', newline='')
+        self.writer = csv.writer(self.f)
+        self.mode, self.names, self.tick_hz = mode, names, tick_hz
+        if mode == MODE_SAMPLES:
+            self.writer.writerow(["Time"] + names)
+        else:
+            self.writer.writerow(["Channel-Type", "Edge", "Time", "Seconds"])
+
+    def put(self, records):
+        times, channels, values = (records[field].tolist() for field in ('time', 'channel', 'value'))
+        if self.mode == MODE_SAMPLES:
+            self.writer.writerows([t] + [(v >> ch) & 1 for ch in range(4)] for t, v in zip(times, values))
+        else:
+            labels = ("falling", "rising")
+            self.writer.writerows((self.names[ch], labels[v], t, f"{t / self.tick_hz:.9f}")
+                                  for t, ch, v in zip(times, channels, values))
+
+    def close(self):
+        self.f.close()
+
+
+def synthesize(path, spec, kind, seconds, rate=0.0, jitter=0.0, glitch_rate=0.0, seed=SEED):
+    """Writes the capture and its truth file; returns (payload bytes, records)"""
+    protocol, line_hz, spi_mode = parse_protocol(spec)
+    if kind not in ('events', 'samples'):
+        raise ValueError(f"bad capture kind '{kind}', expected events or samples")
+    mode = MODE_EVENTS if kind == 'events' else MODE_SAMPLES
+    tick_hz = EVENT_TICK_HZ if mode == MODE_EVENTS else SAMPLE_TICK_HZ
+    synth = Synth(protocol, line_hz, spi_mode, tick_hz, rate, jitter, glitch_rate, seed)
+    names = list(LINES[protocol]) + [f"CH{ch + 1}" for ch in range(len(LINES[protocol]), 4)]
+    if path.lower().endswith('.csv'):
+        sink = CsvSink(path, mode, names, tick_hz)
+    else:
+        sink = CaptureWriter(path, mode, dict(enumerate(LINES[protocol])), tick_hz=tick_hz)
+    stem = path.rpartition('.')[0] or path
+
+    end = int(seconds * tick_hz)
+    payload = count = 0
+    begin = 0
+    with open(stem + ".truth.csv", 'w', newline='') as f:
+        truth = csv.writer(f)
+        truth.writerow(["Kind", "Time", "Value", "Aux"])
+        while True:
+            chunk = synth.chunk(end)
+            if chunk is None:
+                break
+            edges, rows, chunk_end, first_levels = chunk
+            if mode == MODE_EVENTS:
+                records = event_records(edges)
+                sink.put(records)
+                count += len(records)
+            else:
+                for records in sample_records(edges, begin, chunk_end, first_levels):
+                    sink.put(records)
+                    count += len(records)
+            begin = chunk_end
+            lines = []
+            for kind_name, times, values, aux in rows:
+                payload += len(times) if kind_name in ('byte', 'data') else 0
+                aux = aux.tolist() if aux is not None else [''] * len(times)
+                lines += zip([kind_name] * len(times), times.tolist(), values.tolist(), aux)
+            truth.writerows(sorted(lines, key=itemgetter(1)))
+    sink.close()
+    return payload, count
+
+
+def main():
+    if not 5 <= len(sys.argv) <= 9:
+        print("Usage: python synth_capture.py <output .lacap or .csv> <protocol> <events|samples> <seconds>")
+        print("                               [rate B/s] [jitter] [glitches/s] [seed]")
+        print("Protocols: uart[:<baud>], spi[:<mode 0-3>[:<SCK Hz>]], i2c[:<SCL Hz>]")
+        print("jitter: edge time noise in bit times; rate 0 = half what the line carries")
+        sys.exit(1)
+    path, spec, kind = sys.argv[1:4]
+    numbers = [float(arg) for arg in sys.argv[4:8]]
+    seconds, rate, jitter, glitch_rate = numbers + [0.0] * (4 - len(numbers))
+    seed = int(sys.argv[8], 0) if len(sys.argv) == 9 else SEED
+    begin = time.perf_counter()
+    try:
+        payload, count = synthesize(path, spec, kind, seconds, rate, jitter, glitch_rate, seed)
+    except ValueError as e:
+        print(f"Error: {e}")
+        sys.exit(1)
+    print(f"{payload} payload bytes, {count} records in {time.perf_counter() - begin:.1f} s")
+
+
+if __name__ == "__main__":
+    main()
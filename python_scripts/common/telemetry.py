@@ -0,0 +1,57 @@
+"""Link health panel of the live plots. The ingest process keeps the
+latest figures in a Telemetry, which lives in shared memory so the plot
+process reads it without a pipe; TelemetryPanel draws them as text beside
+the waveforms, a figure in red once it nears its limit. The device
+figures come from the firmware's periodic health reports (BUS_HEALTH
+records, BLOCK_MAGIC_HEALTH blocks), the host ones from the ingest loop."""
+import math
+import multiprocessing
+
+FIELDS = ("events/s", "blocks/s", "bytes/s", "ring peak %", "dropped/s", "dropped total",
+          "stalls/s", "USB busy/s", "commands lost", "EXTI max cycles", "host queue %", "port backlog",
+          "ingest stall ms")
+# a figure at or above its limit is drawn in red; port backlog is bytes
+# the OS holds for the ingest process, ingest stall ms the longest its
+# reader was kept off the CPU between reads (ingest_priority.py)
+LIMITS = {"ring peak %": 75.0, "dropped/s": 1.0, "stalls/s": 1.0, "commands lost": 1.0, "host queue %": 75.0,
+          "port backlog": 1 << 16, "ingest stall ms": 20.0}
+
+
+class Telemetry:
+    """The latest value of each of FIELDS, NaN until something reports it.
+    Pass it to the ingest process as an argument"""
+
+    def __init__(self):
+        self.values = multiprocessing.Array('d', [math.nan] * len(FIELDS))
+
+    def update(self, figures):
+        """figures: {FIELDS entry: value}"""
+        with self.values.get_lock():
+            for name, value in figures.items():
+                self.values[FIELDS.index(name)] = value
+
+    def read(self):
+        with self.values.get_lock():
+            return dict(zip(FIELDS, self.values[:]))
+
+
+class TelemetryPanel:
+    """One text line per reported figure on an axes of its own"""
+
+    def __init__(self, ax, telemetry):
+        self.telemetry = telemetry
+        ax.set_axis_off()
+        ax.set_title("Link health")
+        self.texts = [ax.text(0.0, 1.0 - i / len(FIELDS), "", transform=ax.transAxes, family='monospace',
+                              va='top') for i in range(len(FIELDS))]
+
+    def draw(self):
+        """Refreshes the text; returns the artists for FuncAnimation"""
+        shown = [(name, value) for name, value in self.telemetry.read().items()
+                 if not math.isnan(value)]
+        for text, (name, value) in zip(self.texts, shown):
+            text.set_text(f"{name:>13} {value:>12,.0f}")
+            text.set_color('red' if value >= LIMITS.get(name, math.inf) else 'black')
+        for text in self.texts[len(shown):]:
+            text.set_text("")
+        return self.texts
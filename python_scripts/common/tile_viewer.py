@@ -0,0 +1,328 @@
+"""Web viewer of a capture file: a level-of-detail pyramid of min/max
+tiles, served over HTTP to a page that fetches only the tiles it shows
+(in python_scripts/common).
+
+  python capture_server.py view <capture> [port]
+
+then open http://host:port/ in any browser; nothing but the page and
+the tiles leaves the machine.
+
+A tile is TILE_BINS bins of one zoom level for every channel, one byte
+per bin and channel: bit 0 set if the channel was low at some time in
+the bin, bit 1 if it was high, so 3 is activity, 1 or 2 a steady level
+and 0 unknown (before its first edge). Level 0 splits the capture into
+at most LOD_BINS bins; each level above merges pairs of bins (OR) up to
+one tile for the whole capture. Levels 0 and up are built in one pass
+over the records and kept beside the capture as <capture>.lod, reused
+while it is newer than the capture, so opening a GB capture again costs
+a file read. An archive (capture_archive.py) is read block by block and
+shares the .lod capture_transcode.py builds from its segment. Levels
+below 0 halve the bin down to one tick; their tiles span a small part
+of the capture and are computed on request from the seek index blocks
+that hold them (CaptureFile.window, or the archive's), with the levels
+the index holds for the first, and the last FINE_TILES are kept.
+
+The page picks the level whose bins are about a pixel wide, so what it
+downloads follows the window's width, not the capture's size; wheel
+zooms around the pointer and dragging pans. Tiles are fetched as they
+come into view and the browser keeps the last 512."""
+import collections
+import gzip
+import json
+import os
+import threading
+from http.server import BaseHTTPRequestHandler, ThreadingHTTPServer
+from urllib.parse import parse_qs, urlparse
+
+import numpy as np
+
+from capture_archive import Archive
+from capture_file import (CaptureFile, ARCHIVE_SUFFIX, CHANNEL_DROP_START, CHANNEL_LEVELS_HIGH, CHUNK_RECORDS,
+                          seek_path)
+from pipeline import channel_levels
+
+VIEW_PORT = 8080
+TILE_BINS = 1024  # bins per tile
+LOD_BINS = 1 << 20  # bins of level 0, the finest kept on disk
+LOD_SUFFIX = '.lod'
+FINE_TILES = 256  # tiles below level 0 kept in memory
+
+
+def bin_states(times, levels, initial, start, width, count):
+    """States of one channel in count bins of width ticks from start:
+    bit 0 the channel was low in the bin, bit 1 high. initial is its
+    level at the first record, -1 if unknown; changes before start only
+    set the level the first bin starts with"""
+    times = np.asarray(times, dtype=np.int64)
+    levels = np.asarray(levels, dtype=np.int64)
+    end = start + width * count
+    before = times < start
+    if before.any():
+        initial = int(levels[before][-1])
+    inside = ~before & (times < end)
+    times, levels = times[inside], levels[inside]
+    seen = np.zeros(count, dtype=np.uint8)
+    np.bitwise_or.at(seen, (times - start) // width, (1 << levels).astype(np.uint8))
+    last = np.searchsorted(times, start + width * np.arange(count), side='left') - 1  # change before each bin
+    held = np.where(last >= 0, levels[np.maximum(last, 0)], initial)
+    seen |= np.where(held >= 0, 1 << np.maximum(held, 0), 0).astype(np.uint8)
+    return seen
+
+
+def time_span(records):
+    """(first, last) time of the records that are edges or samples"""
+    def timed(begin):
+        chunk = records[max(begin, 0):begin + CHUNK_RECORDS]
+        return chunk['time'][chunk['channel'] < CHANNEL_DROP_START]
+
+    first = next((times[0] for times in map(timed, range(0, len(records), CHUNK_RECORDS)) if len(times)), None)
+    last = next((times[-1] for times in map(timed, range(len(records) - CHUNK_RECORDS, -CHUNK_RECORDS, -CHUNK_RECORDS))
+                 if len(times)), None)
+    return (0, 0) if first is None else (int(first), int(last))
+
+
+def archive_span(archive):
+    """time_span of an archive, unpacking a block from either end"""
+    def timed(k):
+        records = archive.block(k)
+        return records['time'][records['channel'] < CHANNEL_DROP_START]
+
+    first = next((times[0] for times in map(timed, range(len(archive))) if len(times)), None)
+    last = next((times[-1] for times in map(timed, reversed(range(len(archive)))) if len(times)), None)
+    return (0, 0) if first is None else (int(first), int(last))
+
+
+class TilePyramid:
+    """The min/max tiles of a capture or archive, see the module doc"""
+
+    def __init__(self, path):
+        if path.endswith(ARCHIVE_SUFFIX):
+            self.capture = Archive(path)
+            self.start, end = archive_span(self.capture)
+        else:
+            self.capture = CaptureFile(path)
+            self.start, end = time_span(self.capture.records)
+        self.channels = [ch for ch, name in enumerate(self.capture.names) if name and ch < CHANNEL_LEVELS_HIGH]
+        self.width = max(1, -(-(end - self.start + 1) // LOD_BINS))  # ticks per level 0 bin
+        self.bins = -(-(end - self.start + 1) // self.width)
+        self.end = end
+        lod = seek_path(path, LOD_SUFFIX)
+        seen = None
+        if os.path.exists(lod) and os.path.getmtime(lod) >= os.path.getmtime(path):
+            saved = np.load(lod)
+            if int(saved['start']) == self.start and int(saved['width']) == self.width \
+                    and saved['seen'].shape == (len(self.channels), self.bins):
+                seen = saved['seen']
+        if seen is None:
+            seen = self._build()
+            with open(lod, 'wb') as f:
+                np.savez(f, start=self.start, width=self.width, seen=seen)
+        self.levels = [seen]
+        while self.levels[-1].shape[1] > TILE_BINS:
+            below = self.levels[-1]
+            if below.shape[1] % 2:
+                below = np.concatenate([below, np.zeros((len(below), 1), dtype=np.uint8)], axis=1)
+            self.levels.append(below[:, 0::2] | below[:, 1::2])
+        self.finest = -(self.width.bit_length() - 1)  # the level of one-tick bins
+        self.fine = collections.OrderedDict()  # (level, index): tile below level 0
+        self.lock = threading.Lock()
+
+    def _build(self):
+        """Level 0 in one pass over the records, chunk by chunk; a bin a
+        chunk boundary falls in is merged from both chunks"""
+        seen = np.zeros((len(self.channels), self.bins), dtype=np.uint8)
+        carried = [-1] * len(self.channels)
+        first = 0
+        for chunk in self._chunks():
+            timed = chunk['time'][chunk['channel'] < CHANNEL_DROP_START]
+            if not len(timed):
+                continue
+            last = min((int(timed[-1]) - self.start) // self.width, self.bins - 1)
+            for k, ch in enumerate(self.channels):
+                times, levels = channel_levels(chunk, ch)
+                seen[k, first:last + 1] |= bin_states(times, levels, carried[k], self.start + first * self.width,
+                                                      self.width, last - first + 1)
+                if len(levels):
+                    carried[k] = int(levels[-1])
+            first = last
+        for k, level in enumerate(carried):
+            if level >= 0:
+                seen[k, first:] |= 1 << level
+        return seen
+
+    def _chunks(self):
+        """The records in stream order, CHUNK_RECORDS or an archive block
+        at a time"""
+        if not hasattr(self.capture, 'records'):
+            yield from self.capture
+            return
+        records = self.capture.records
+        for begin in range(0, len(records), CHUNK_RECORDS):
+            yield records[begin:begin + CHUNK_RECORDS]
+
+    def info(self):
+        return {'names': [self.capture.names[ch] for ch in self.channels], 'tick_hz': self.capture.tick_hz,
+                'start': self.start, 'end': self.end, 'width': self.width, 'levels': len(self.levels),
+                'finest': self.finest, 'tile_bins': TILE_BINS}
+
+    def tile(self, level, index):
+        """One tile, channels × TILE_BINS bytes, channel after channel;
+        None for a level the pyramid does not have"""
+        if not self.finest <= level < len(self.levels) or index < 0:
+            return None
+        if level >= 0:
+            tile = np.zeros((len(self.channels), TILE_BINS), dtype=np.uint8)
+            part = self.levels[level][:, index * TILE_BINS:(index + 1) * TILE_BINS]
+            tile[:, :part.shape[1]] = part
+            return tile.tobytes()
+        with self.lock:
+            if (level, index) in self.fine:
+                self.fine.move_to_end((level, index))
+                return self.fine[(level, index)]
+        width = self.width >> -level
+        start = self.start + index * TILE_BINS * width
+        cut = self.capture.window(start, start + TILE_BINS * width)
+        tile = np.stack([bin_states(*channel_levels(cut.records, ch),
+                                    cut.levels >> ch & 1 if cut.known >> ch & 1 else -1,
+                                    start, width, TILE_BINS) for ch in self.channels]).tobytes()
+        with self.lock:
+            self.fine[(level, index)] = tile
+            while len(self.fine) > FINE_TILES:
+                self.fine.popitem(last=False)
+        return tile
+
+
+PAGE = """<!doctype html>
+<html><head><meta charset="utf-8"><title>Capture</title>
+<style>body{margin:0;font:12px sans-serif;background:#111;color:#ccc}canvas{display:block;cursor:grab}
+#bar{padding:4px 8px}</style></head>
+<body><div id="bar">loading</div><canvas id="view"></canvas><script>
+const ROW = 36, LABEL = 90, MAX_TILES = 512;
+const canvas = document.getElementById('view'), ctx = canvas.getContext('2d'), bar = document.getElementById('bar');
+const tiles = new Map(), pending = new Set();
+let info, start, span;
+
+fetch('info').then(r => r.json()).then(i => {
+  info = i; start = i.start; span = Math.max(i.end - i.start, 1); resize();
+});
+addEventListener('resize', () => info && resize());
+
+function resize() {
+  canvas.width = innerWidth;
+  canvas.height = info.names.length * ROW + 8;
+  draw();
+}
+
+function binWidth(level) {
+  return level >= 0 ? info.width * 2 ** level : Math.floor(info.width / 2 ** -level);
+}
+
+function seconds(t) {
+  return info.tick_hz ? ((t - info.start) / info.tick_hz).toPrecision(9) + ' s' : (t - info.start) + ' ticks';
+}
+
+function request(level, index, key) {
+  if (pending.has(key)) return;
+  pending.add(key);
+  fetch(`tile?level=${level}&index=${index}`).then(r => r.arrayBuffer()).then(data => {
+    pending.delete(key);
+    tiles.set(key, new Uint8Array(data));
+    while (tiles.size > MAX_TILES) tiles.delete(tiles.keys().next().value);
+    draw();
+  });
+}
+
+function draw() {
+  const width = canvas.width - LABEL, perPixel = span / width;
+  const level = Math.max(info.finest, Math.min(info.levels - 1, Math.floor(Math.log2(Math.max(perPixel / info.width, 2 ** info.finest)))));
+  const bin = binWidth(level), tileSpan = bin * info.tile_bins;
+  ctx.fillStyle = '#111';
+  ctx.fillRect(0, 0, canvas.width, canvas.height);
+  ctx.fillStyle = '#ccc';
+  info.names.forEach((name, k) => ctx.fillText(name, 8, k * ROW + ROW / 2 + 4));
+  const first = Math.max(0, Math.floor((start - info.start) / tileSpan));
+  const last = Math.floor((start + span - info.start) / tileSpan);
+  let missing = 0;
+  for (let i = first; i <= last; i++) {
+    const key = level + ':' + i, tile = tiles.get(key);
+    if (!tile) { request(level, i, key); missing++; continue; }
+    tiles.delete(key); tiles.set(key, tile);  // the newest last: the map's order is its LRU
+    info.names.forEach((name, k) => {
+      const top = k * ROW + 6, bottom = top + ROW - 14;
+      for (let b = 0; b < info.tile_bins; b++) {
+        const state = tile[k * info.tile_bins + b];
+        if (!state) continue;
+        const x = LABEL + (info.start + i * tileSpan + b * bin - start) / perPixel, w = Math.max(bin / perPixel, 1);
+        if (x + w < LABEL || x > canvas.width) continue;
+        ctx.fillStyle = state === 3 ? '#3a8' : '#5c5';
+        if (state === 3) ctx.fillRect(x, top, w, bottom - top);
+        else ctx.fillRect(x, state === 2 ? top : bottom, w, 1.5);
+      }
+    });
+  }
+  bar.textContent = `${seconds(start)} to ${seconds(start + span)}, level ${level}` + (missing ? `, ${missing} tiles loading` : '');
+}
+
+canvas.addEventListener('wheel', e => {
+  e.preventDefault();
+  const at = start + (e.offsetX - LABEL) / (canvas.width - LABEL) * span;
+  const scale = e.deltaY > 0 ? 1.25 : 0.8;
+  span = Math.min(Math.max(span * scale, 8), (info.end - info.start) * 1.1);
+  start = at - (e.offsetX - LABEL) / (canvas.width - LABEL) * span;
+  draw();
+}, {passive: false});
+
+let dragging = null;
+canvas.addEventListener('mousedown', e => { dragging = {x: e.clientX, start}; });
+addEventListener('mouseup', () => { dragging = null; });
+addEventListener('mousemove', e => {
+  if (!dragging) return;
+  start = dragging.start - (e.clientX - dragging.x) / (canvas.width - LABEL) * span;
+  draw();
+});
+</script></body></html>
+"""
+
+
+def serve(path, port=VIEW_PORT):
+    """Serves the viewer page, the pyramid's info and its tiles until
+    Ctrl-C"""
+    pyramid = TilePyramid(path)
+
+    class Handler(BaseHTTPRequestHandler):
+        def do_GET(self):
+            url = urlparse(self.path)
+            query = parse_qs(url.query)
+            body, kind = None, 'application/octet-stream'
+            if url.path == '/':
+                body, kind = PAGE.encode(), 'text/html; charset=utf-8'
+            elif url.path == '/info':
+                body, kind = json.dumps(pyramid.info()).encode(), 'application/json'
+            elif url.path == '/tile':
+                try:
+                    body = pyramid.tile(int(query['level'][0]), int(query['index'][0]))
+                except (KeyError, ValueError):
+                    pass
+            if body is None:
+                self.send_error(404)
+                return
+            self.send_response(200)
+            if url.path == '/tile' and 'gzip' in self.headers.get('Accept-Encoding', ''):
+                body = gzip.compress(body, 1)  # mostly runs of one state
+                self.send_header('Content-Encoding', 'gzip')
+            self.send_header('Content-Type', kind)
+            self.send_header('Content-Length', str(len(body)))
+            self.end_headers()
+            self.wfile.write(body)
+
+        def log_message(self, *args):
+            pass
+
+    server = ThreadingHTTPServer(('', port), Handler)
+    print(f"{len(pyramid.channels)} channels, {len(pyramid.levels)} stored levels "
+          f"down to {pyramid.width} ticks a bin; viewer at http://localhost:{port}/")
+    try:
+        server.serve_forever()
+    except KeyboardInterrupt:
+        pass
+    server.server_close()
@@ -0,0 +1,328 @@
+"""Timing statistics of a capture's edges: periods, pulse widths and
+duty, channel-to-channel skew, setup and hold against a clock and UART
+bit-period jitter (in python_scripts/common).
+
+  python timing_stats.py <capture> period <channel> [rising|falling]
+  python timing_stats.py <capture> duty <channel>
+  python timing_stats.py <capture> skew <channel> <reference> [rising|falling]
+  python timing_stats.py <capture> setup <clock> <data> [rising|falling]
+  python timing_stats.py <capture> bits <channel> <baud>
+
+period times each edge of one direction (default rising) from the one
+before; duty the high and low pulses, the period they make and the
+share of it spent high; skew each edge of the channel against the
+nearest edge of the same direction on the reference; setup each clock
+edge of the sampling direction (default rising) against the data line's
+last change before it, and hold against its next change after it; bits
+each pulse of a UART line divided by the whole number of bits it spans,
+so the spread is the bit-period jitter.
+
+The capture is read chunk by chunk (capture_file.RecordChunks), with the
+few edges a pairing needs carried from one chunk to the next, and every
+pairing is a searchsorted over the chunk's edge arrays, so any length of
+capture runs in the memory of a chunk. The statistics are kept in fixed
+memory (Distribution): count, mean, spread and extremes exactly,
+percentiles and the histogram from bins that widen as the values
+spread. Times print in ns when the capture knows its clock, else ticks."""
+import collections
+import sys
+
+import numpy as np
+
+from capture_file import RecordChunks
+from pipeline import channel_levels, level_changes
+
+MAX_BINS = 4096  # histogram bins a Distribution keeps before it widens them
+HISTOGRAM_ROWS = 16
+MAX_PENDING = 1 << 16  # edges carried to the next chunk, at most
+DUTY_SCALE = 10000  # duty is kept in 0.01 % steps
+BIT_SCALE = 100  # bit periods are kept in 0.01 tick steps
+MAX_BITS = 10  # longest UART pulse, in bits, that bits divides
+
+
+class Distribution:
+    """Running statistics of integer values in fixed memory. Count, mean,
+    standard deviation and extremes are exact (chunk means and squared
+    deviations merged as they come, so a large mean does not swamp a
+    small spread); percentiles and the histogram come from counts in bins
+    of `width`, which doubles, halving the bins, whenever more than
+    MAX_BINS are in use"""
+
+    def __init__(self, name, scale=1):
+        self.name = name
+        self.scale = scale  # values per tick, or per unit for a ratio
+        self.count = 0
+        self.mean = 0.0
+        self.squares = 0.0  # sum of squared deviations from the mean
+        self.low = self.high = None
+        self.width = 1
+        self.bins = collections.Counter()
+
+    def add(self, values):
+        values = np.asarray(values, dtype=np.int64)
+        if not len(values):
+            return
+        n, mean = len(values), float(values.mean())
+        delta = mean - self.mean
+        total = self.count + n
+        self.squares += float(((values - mean) ** 2).sum()) + delta * delta * self.count * n / total
+        self.mean += delta * n / total
+        self.count = total
+        low, high = int(values.min()), int(values.max())
+        self.low = low if self.low is None else min(self.low, low)
+        self.high = high if self.high is None else max(self.high, high)
+        keys, counts = np.unique(values // self.width, return_counts=True)
+        self.bins.update(dict(zip(keys.tolist(), counts.tolist())))
+        while len(self.bins) > MAX_BINS:
+            self.width *= 2
+            wider = collections.Counter()
+            for key, count in self.bins.items():
+                wider[key // 2] += count
+            self.bins = wider
+
+    def std(self):
+        return (self.squares / self.count) ** 0.5 if self.count else 0.0
+
+    def percentile(self, share):
+        """Value below which share of the values lie, to a bin"""
+        rank, seen = share * self.count, 0
+        for key in sorted(self.bins):
+            seen += self.bins[key]
+            if seen >= rank:
+                return min(max((key + 0.5) * self.width, self.low), self.high)
+        return self.high
+
+    def histogram(self, rows=HISTOGRAM_ROWS):
+        """(from, to, count) rows covering the values, at most rows of them"""
+        first, last = min(self.bins), max(self.bins)
+        step = -(-(last - first + 1) // rows)
+        counts = collections.Counter()
+        for key, count in self.bins.items():
+            counts[(key - first) // step] += count
+        return [((first + row * step) * self.width, (first + (row + 1) * step) * self.width, counts[row])
+                for row in range(max(counts) + 1)]
+
+
+class Carry:
+    """Level changes of the channels a measurement reads, chunk by chunk,
+    with each channel's last level carried over so a chunk boundary is
+    not taken for a change"""
+
+    def __init__(self, channels):
+        self.levels = {ch: -1 for ch in channels}  # -1: the first record is a change
+
+    def changes(self, records, ch):
+        times, levels = level_changes(*channel_levels(records, ch), self.levels[ch])
+        levels = levels.astype(np.int64)
+        if len(levels):
+            self.levels[ch] = int(levels[-1])
+        return times.astype(np.int64), levels
+
+
+class Period:
+    """Edge-to-edge time of one direction on a channel"""
+
+    def __init__(self, ch, level=1):
+        self.ch, self.level = ch, level
+        self.last = np.empty(0, dtype=np.int64)
+        self.stats = [Distribution("period")]
+
+    def feed(self, carry, records):
+        times, levels = carry.changes(records, self.ch)
+        edges = np.concatenate([self.last, times[levels == self.level]])
+        self.stats[0].add(np.diff(edges))
+        self.last = edges[-1:]
+
+
+class Duty:
+    """High and low pulse widths of a channel, the period of each high
+    pulse and the low one after it, and the duty of that cycle"""
+
+    def __init__(self, ch):
+        self.ch = ch
+        self.previous = None  # (time, level) of the change before this chunk
+        self.pending = None   # (width) of a high pulse whose low one is not over
+        self.stats = [Distribution("high"), Distribution("low"), Distribution("period"),
+                      Distribution("duty", DUTY_SCALE)]
+
+    def feed(self, carry, records):
+        times, levels = carry.changes(records, self.ch)
+        if self.previous is not None:
+            times = np.concatenate([[self.previous[0]], times])
+            levels = np.concatenate([[self.previous[1]], levels])
+        if not len(times):
+            return
+        self.previous = (int(times[-1]), int(levels[-1]))
+        widths, during = np.diff(times), levels[:-1]  # each pulse and the level it held
+        self.stats[0].add(widths[during == 1])
+        self.stats[1].add(widths[during == 0])
+        if self.pending is not None:
+            widths = np.concatenate([[self.pending], widths])
+            during = np.concatenate([[1], during])
+        high = np.flatnonzero((during[:-1] == 1) & (during[1:] == 0))
+        period = widths[high] + widths[high + 1]
+        self.stats[2].add(period)
+        self.stats[3].add(widths[high] * DUTY_SCALE // np.maximum(period, 1))
+        self.pending = int(widths[-1]) if len(during) and during[-1] == 1 else None
+
+
+class Skew:
+    """Each edge of one direction on a channel minus the nearest edge of
+    that direction on a reference channel. An edge after the reference's
+    last one waits for the next chunk, which may hold a nearer one"""
+
+    def __init__(self, ch, ref, level=1):
+        self.ch, self.ref, self.level = ch, ref, level
+        self.ref_last = np.empty(0, dtype=np.int64)
+        self.pending = np.empty(0, dtype=np.int64)
+        self.stats = [Distribution("skew")]
+
+    def feed(self, carry, records):
+        times, levels = carry.changes(records, self.ch)
+        ref_times, ref_levels = carry.changes(records, self.ref)
+        ref = np.concatenate([self.ref_last, ref_times[ref_levels == self.level]])
+        own = np.concatenate([self.pending, times[levels == self.level]])
+        if not len(ref):
+            self.pending = own[-MAX_PENDING:]
+            return
+        ready = own[own <= ref[-1]]
+        self.pending = own[len(ready):][-MAX_PENDING:]
+        self._pair(ready, ref)
+        self.ref_last = ref[-2:]
+
+    def finish(self):
+        """Pairs the edges still waiting with the reference's last ones"""
+        if len(self.ref_last):
+            self._pair(self.pending, self.ref_last)
+
+    def _pair(self, own, ref):
+        if len(ref) == 1:
+            self.stats[0].add(own - ref[0])
+        elif len(own):
+            i = np.clip(np.searchsorted(ref, own), 1, len(ref) - 1)
+            nearest = np.where(own - ref[i - 1] <= ref[i] - own, ref[i - 1], ref[i])
+            self.stats[0].add(own - nearest)
+
+
+class SetupHold:
+    """Each sampling edge of a clock against the data line's last change
+    at or before it (setup) and its first change after it (hold); a
+    clock edge after the data's last change waits for the next chunk for
+    its hold"""
+
+    def __init__(self, clock, data, level=1):
+        self.clock, self.data, self.level = clock, data, level
+        self.data_last = np.empty(0, dtype=np.int64)
+        self.pending = np.empty(0, dtype=np.int64)  # clock edges still without a hold
+        self.stats = [Distribution("setup"), Distribution("hold")]
+
+    def feed(self, carry, records):
+        times, levels = carry.changes(records, self.clock)
+        data_times, _ = carry.changes(records, self.data)
+        clock = times[levels == self.level]
+        data = np.concatenate([self.data_last, data_times])
+        if len(clock) and len(data):
+            before = np.searchsorted(data, clock, side='right') - 1
+            has = before >= 0
+            self.stats[0].add(clock[has] - data[before[has]])
+        waiting = np.concatenate([self.pending, clock])
+        after = np.searchsorted(data_times, waiting, side='right')
+        held = after < len(data_times)
+        self.stats[1].add(data_times[after[held]] - waiting[held])
+        self.pending = waiting[~held][-MAX_PENDING:]
+        self.data_last = data[-1:]
+
+
+class Bits:
+    """Each pulse of a UART line divided by the whole number of bits it
+    spans at the nominal baud (up to MAX_BITS): the bit period it shows"""
+
+    def __init__(self, ch, baud):
+        self.ch, self.baud = ch, baud
+        self.previous = np.empty(0, dtype=np.int64)
+        self.stats = [Distribution("bit period", BIT_SCALE)]
+        self.bit = None  # ticks, once the clock is known
+
+    def feed(self, carry, records):
+        times, _ = carry.changes(records, self.ch)
+        times = np.concatenate([self.previous, times])
+        self.previous = times[-1:]
+        widths = np.diff(times)
+        bits = np.rint(widths / self.bit).astype(np.int64)
+        whole = (bits >= 1) & (bits <= MAX_BITS)
+        self.stats[0].add(widths[whole] * BIT_SCALE // bits[whole])
+
+
+def print_stats(stats, tick_hz):
+    """Summary and histogram of each Distribution, in ns if tick_hz is
+    known, ticks otherwise; duty in percent"""
+    def show(value, dist):
+        if dist.name == "duty":
+            return f"{100 * value / dist.scale:.2f} %"
+        value /= dist.scale
+        return f"{value * 1e9 / tick_hz:.1f} ns" if tick_hz else f"{value:.2f} ticks"
+
+    for dist in stats:
+        if not dist.count:
+            print(f"{dist.name}: no values")
+            continue
+        print(f"{dist.name}: {dist.count} values, mean {show(dist.mean, dist)}, std {show(dist.std(), dist)}")
+        print(f"  min {show(dist.low, dist)}, 1 % {show(dist.percentile(0.01), dist)}, "
+              f"median {show(dist.percentile(0.5), dist)}, 99 % {show(dist.percentile(0.99), dist)}, "
+              f"max {show(dist.high, dist)}")
+        rows = dist.histogram()
+        peak = max(count for _, _, count in rows)
+        for low, high, count in rows:
+            print(f"  {show(low, dist):>14} .. {show(high, dist):>14} {count:>10} {'#' * (40 * count // peak)}")
+
+
+def main():
+    usage = ("Usage: python timing_stats.py <capture> period <channel> [rising|falling]\n"
+             "       python timing_stats.py <capture> duty <channel>\n"
+             "       python timing_stats.py <capture> skew <channel> <reference> [rising|falling]\n"
+             "       python timing_stats.py <capture> setup <clock> <data> [rising|falling]\n"
+             "       python timing_stats.py <capture> bits <channel> <baud>")
+    arity = {'period': (1, 2), 'duty': (1, 1), 'skew': (2, 3), 'setup': (2, 3), 'bits': (2, 2)}
+    if len(sys.argv) < 3 or sys.argv[2] not in arity \
+            or not arity[sys.argv[2]][0] <= len(sys.argv) - 3 <= arity[sys.argv[2]][1]:
+        print(usage)
+        sys.exit(1)
+    reader = RecordChunks(sys.argv[1])
+    kind, args = sys.argv[2], sys.argv[3:]
+    count = 1 if kind in ('period', 'duty', 'bits') else 2
+    missing = [name for name in args[:count] if name.upper() not in reader.names]
+    if missing:
+        print(f"Channel {missing[0]} not in the capture, which has {', '.join(reader.names)}")
+        sys.exit(1)
+    channels = [reader.names.index(name.upper()) for name in args[:count]]
+    if len(set(channels)) < count:
+        print("The two channels must differ")
+        sys.exit(1)
+    level = 0 if args[count:] and args[count].lower() == 'falling' else 1
+    if kind == 'period':
+        measure = Period(channels[0], level)
+    elif kind == 'duty':
+        measure = Duty(channels[0])
+    elif kind == 'skew':
+        measure = Skew(channels[0], channels[1], level)
+    elif kind == 'setup':
+        measure = SetupHold(channels[0], channels[1], level)
+    else:
+        if not reader.tick_hz:
+            print("The capture does not know its clock, so the bit time is unknown")
+            sys.exit(1)
+        measure = Bits(channels[0], int(args[1]))
+        measure.bit = reader.tick_hz / measure.baud
+
+    carry = Carry(channels)
+    for records in reader:
+        measure.feed(carry, records)
+    if kind == 'skew':
+        measure.finish()
+    print(f"{kind} of {' against '.join(args[:count])}"
+          + (f", {reader.tick_hz:.0f} Hz clock" if reader.tick_hz else ", clock unknown: ticks"))
+    print_stats(measure.stats, reader.tick_hz)
+
+
+if __name__ == "__main__":
+    main()
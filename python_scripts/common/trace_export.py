@@ -0,0 +1,309 @@
+"""Streams a capture to a VCD file or a sigrok session (.sr), the formats
+PulseView and GTKWave open (in python_scripts/common).
+
+  python trace_export.py <capture .lacap, .index or .laarc> <out.vcd or out.sr> [sample rate Hz]
+
+Records are read chunk by chunk (capture_file.RecordChunks) and turned
+into one timeline of channel level masks with numpy, so memory does not
+grow with the capture. A VCD chunk is formatted in one go: the change
+times' digits and the '<level><id>' lines of the channels that changed
+are laid out in a byte matrix, padding dropped, and written as one
+block, with no Python loop over the changes. Times are in ns once the
+capture's clock is known, else in ticks.
+
+A .sr session holds samples, not changes: the levels are repeated onto a
+grid of the sample rate (the capture's clock, at most SR_MAX_RATE, if
+not given), so its size grows with the capture's duration. Samples go
+out in SR_CHUNK_BYTES zip members as libsigrok writes them.
+
+Either also runs live: set EXPORT in a plotter, and an ExportSink on the
+ingest pipeline (pipeline.py) writes the stream as it comes."""
+import sys
+import time
+import zipfile
+
+import numpy as np
+
+from capture_file import (RecordChunks, RECORD_DTYPE, MODE_SAMPLES, CHANNEL_LEVELS_HIGH, channel_levels,
+                          level_records)
+from pipeline import Sink
+
+WRITE_BUFFER = 1 << 20
+TIME_DIGITS = 20  # of an int64
+ID_FIRST = ord('!')  # VCD identifier of CH1; one printable character per channel
+SR_MAX_RATE = 10_000_000  # default .sr sample rate cap, Hz
+SR_CHUNK_BYTES = 4 << 20  # samples per logic-1-<n> member
+SAMPLE_WRAP = 1 << 32  # poll sample times are the 32-bit cycle counter
+
+
+def vcd_block(times, masks, previous, channels):
+    """VCD text of a run of level masks: '#<time>' and one '<level><id>'
+    line per channel that changed since the mask before, built as one
+    byte array"""
+    n, count = len(times), len(channels)
+    digits = np.empty((n, TIME_DIGITS), np.uint8)
+    rest = times.copy()
+    for k in range(TIME_DIGITS - 1, -1, -1):
+        digits[:, k] = ord('0') + rest % 10
+        rest //= 10
+    leading = np.cumsum(digits != ord('0'), axis=1) == 0
+    leading[:, -1] = False  # time 0 keeps one digit
+    digits[leading] = 0
+    shifts = np.array(channels, np.int64)
+    before = np.concatenate([[previous], masks[:-1]])
+    changed = (((masks ^ before)[:, None] >> shifts) & 1).astype(bool)
+    lines = np.empty((n, count, 3), np.uint8)
+    lines[:, :, 0] = ord('0') + ((masks[:, None] >> shifts) & 1)
+    lines[:, :, 1] = ID_FIRST + np.arange(count)
+    lines[:, :, 2] = ord('\n')
+    lines[~changed] = 0
+    rows = np.concatenate([np.full((n, 1), ord('#'), np.uint8), digits,
+                           np.full((n, 1), ord('\n'), np.uint8), lines.reshape(n, 3 * count)], axis=1)
+    return rows[rows != 0].tobytes()
+
+
+class TraceExport:
+    """Turns record batches into (time, level mask) changes for a
+    writer: put() each batch in stream order, close() at the end"""
+
+    def __init__(self, path, mode, names, tick_hz=0):
+        self.path = path
+        self.mode = mode
+        limit = len(names) if mode == MODE_SAMPLES else min(len(names), CHANNEL_LEVELS_HIGH)
+        self.channels = list(range(limit))
+        self.names = [names[ch] for ch in self.channels]
+        self.tick_hz = tick_hz
+        self.levels = 0       # mask after the latest change
+        self.known = 0        # channels whose level a record has shown
+        self.last_time = None  # of the latest change written, output units
+        self.clock = None     # poll samples: last raw time and its unwrapped time
+
+    def set_tick_hz(self, tick_hz):
+        if not self.tick_hz:
+            self.tick_hz = tick_hz
+
+    def _unwrap(self, raw):
+        raw = raw.astype(np.int64)
+        last_raw, last_time = self.clock or (int(raw[0]), int(raw[0]))
+        step = np.diff(raw, prepend=last_raw) % SAMPLE_WRAP
+        step = np.where(step >= SAMPLE_WRAP // 2, step - SAMPLE_WRAP, step)
+        times = last_time + np.cumsum(step)
+        self.clock = int(raw[-1]), int(times[-1])
+        return times
+
+    def _masks(self, records):
+        """(times, masks) of the level masks through records"""
+        if self.mode == MODE_SAMPLES:
+            times, masks = level_records(records)
+            if not len(times):
+                return times, masks
+            self.known = (1 << len(self.channels)) - 1
+            return self._unwrap(times), masks.astype(np.int64)
+        parts = []
+        for ch in self.channels:
+            times, levels = channel_levels(records, ch)
+            if len(times):
+                order = np.argsort(times, kind='stable')
+                parts.append((ch, times[order], levels[order].astype(np.int64)))
+        if not parts:
+            return np.empty(0, np.int64), np.empty(0, np.int64)
+        times = np.sort(np.concatenate([t for _, t, _ in parts]), kind='stable')
+        masks = np.full(len(times), self.levels, np.int64)
+        for ch, line_times, levels in parts:
+            before = self.levels >> ch & 1 if self.known >> ch & 1 else 1 - levels[0]
+            at = np.searchsorted(line_times, times, side='right') - 1
+            level = np.where(at >= 0, levels[np.maximum(at, 0)], before)
+            masks = masks & ~(1 << ch) | level << ch
+            self.known |= 1 << ch
+        return times, masks
+
+    def _output_times(self, ticks):
+        """ns once the clock is known, else ticks; never before the last"""
+        times = np.rint(ticks * (1e9 / self.tick_hz)).astype(np.int64) if self.tick_hz else ticks
+        if self.last_time is not None:
+            times = np.maximum(times, self.last_time)
+        return np.maximum.accumulate(times)
+
+    def put(self, records):
+        ticks, masks = self._masks(records)
+        if not len(ticks):
+            return
+        times = self._output_times(ticks)
+        last = np.append(times[1:] != times[:-1], True)  # one mask per time: the last
+        times, masks = times[last], masks[last]
+        first = self.last_time is None
+        previous = masks[0] ^ -1 if first else self.levels
+        before = np.concatenate([[previous], masks[:-1]])
+        keep = masks != before
+        if first:
+            self.begin(int(times[0]))
+        self.levels = int(masks[-1])
+        if keep.any():
+            self.write(times[keep], masks[keep], previous)
+            self.last_time = int(times[keep][-1])
+        elif first:
+            self.last_time = int(times[0])
+
+    def begin(self, first_time):
+        """Called with the time of the first change before any write"""
+
+    def write(self, times, masks, previous):
+        raise NotImplementedError
+
+    def close(self):
+        raise NotImplementedError
+
+
+class VcdExport(TraceExport):
+
+    def begin(self, first_time):
+        self.f = open(self.path, 'wb', buffering=WRITE_BUFFER)
+        header = [f"$date {time.strftime('%Y-%m-%d %H:%M:%S')} $end",
+                  "$version STM32 logic analyzer trace_export.py $end"]
+        if not self.tick_hz:
+            header.append("$comment times are capture ticks, the clock was unknown $end")
+        header += ["$timescale 1 ns $end", "$scope module logic $end"]
+        header += [f"$var wire 1 {chr(ID_FIRST + k)} {name.replace(' ', '_')} $end"
+                   for k, name in enumerate(self.names)]
+        header += ["$upscope $end", "$enddefinitions $end", ""]
+        self.f.write("\n".join(header).encode())
+
+    def write(self, times, masks, previous):
+        self.f.write(vcd_block(times, masks, previous, self.channels))
+
+    def close(self):
+        if self.last_time is not None:
+            self.f.close()
+
+
+class SigrokExport(TraceExport):
+
+    def __init__(self, path, mode, names, tick_hz=0, rate=None):
+        super().__init__(path, mode, names, tick_hz)
+        self.rate = rate
+        self.unitsize = 1 if len(self.channels) <= 8 else 2
+        self.pending = []  # sample arrays not yet in a member
+        self.pending_bytes = 0
+        self.members = 0
+        self.zip = None
+
+    def begin(self, first_time):
+        if self.rate is None:
+            self.rate = int(min(self.tick_hz, SR_MAX_RATE)) if self.tick_hz else SR_MAX_RATE
+        self.origin = first_time
+        self.position = 0  # samples written
+        self.zip = zipfile.ZipFile(self.path, 'w', zipfile.ZIP_DEFLATED, compresslevel=1)
+        self.zip.writestr("version", "2")
+
+    def _indices(self, times):
+        """Sample numbers of output times; with the clock unknown a tick
+        is a sample"""
+        if not self.tick_hz:
+            return times - self.origin
+        return np.floor((times - self.origin) * (self.rate / 1e9)).astype(np.int64)
+
+    def write(self, times, masks, previous):
+        starts = np.maximum(self._indices(times), self.position)
+        values = np.concatenate([[previous], masks[:-1]])
+        lengths = np.diff(np.concatenate([[self.position], starts]))
+        self._emit(values, lengths)
+        self.position = int(starts[-1])
+
+    def _emit(self, values, lengths):
+        """Repeats values[k] lengths[k] times into the pending samples,
+        a long run a member at a time"""
+        dtype = np.uint8 if self.unitsize == 1 else np.dtype('<u2')
+        room = SR_CHUNK_BYTES // self.unitsize
+        k = 0
+        while k < len(values):
+            space = room - self.pending_bytes // self.unitsize
+            ends = np.cumsum(lengths[k:])
+            take = int(np.searchsorted(ends, space, side='right'))
+            if take:
+                self._pend(np.repeat(values[k:k + take].astype(dtype), lengths[k:k + take]))
+                k += take
+            else:
+                self._pend(np.full(space, values[k], dtype))
+                lengths = lengths.copy()
+                lengths[k] -= space
+
+    def _pend(self, samples):
+        self.pending.append(samples)
+        self.pending_bytes += samples.nbytes
+        if self.pending_bytes >= SR_CHUNK_BYTES:
+            self._flush_member()
+
+    def _flush_member(self):
+        if self.pending:
+            self.members += 1
+            self.zip.writestr(f"logic-1-{self.members}", b''.join(part.tobytes() for part in self.pending))
+            self.pending, self.pending_bytes = [], 0
+
+    def close(self):
+        if self.zip is None:
+            return
+        self._emit(np.array([self.levels]), np.array([1]))  # the last level, one sample
+        self._flush_member()
+        probes = [f"probe{k + 1}={name}" for k, name in enumerate(self.names)]
+        self.zip.writestr("metadata", "\n".join(
+            ["[global]", "sigrok version=0.5.2", "", "[device 1]", "capturefile=logic-1",
+             f"total probes={len(self.names)}", f"samplerate={rate_string(self.rate)}",
+             "total analog=0"] + probes + [f"unitsize={self.unitsize}", ""]))
+        self.zip.close()
+
+
+def rate_string(hz):
+    """A sample rate the way libsigrok writes it in a session"""
+    for scale, unit in ((1_000_000_000, "GHz"), (1_000_000, "MHz"), (1_000, "kHz")):
+        if hz % scale == 0:
+            return f"{hz // scale} {unit}"
+    return f"{hz} Hz"
+
+
+def open_export(path, mode, names, tick_hz=0, rate=None):
+    """A VcdExport or SigrokExport by the file's extension"""
+    if path.lower().endswith('.sr'):
+        return SigrokExport(path, mode, names, tick_hz, rate)
+    return VcdExport(path, mode, names, tick_hz)
+
+
+class ExportSink(Sink):
+    """Writes the live stream to a VCD or .sr file; lossless, like the
+    capture file"""
+    lossy = False
+
+    def __init__(self, path, mode, names, rate=None):
+        top = max(names) + 1 if names else 4
+        self.export = open_export(path, mode, [names.get(ch) or f"CH{ch + 1}" for ch in range(top)], 0, rate)
+        super().__init__()
+
+    def consume(self, records):
+        self.export.put(records)
+
+    def tick(self, tick_hz):
+        self.export.set_tick_hz(tick_hz)
+
+    def finish(self):
+        self.export.close()
+
+
+def main():
+    if len(sys.argv) not in (3, 4):
+        print("Usage: python trace_export.py <capture .lacap, .index or .laarc> <out.vcd or out.sr> [sample rate Hz]")
+        sys.exit(1)
+    reader = RecordChunks(sys.argv[1])
+    export = open_export(sys.argv[2], reader.mode, reader.names, reader.tick_hz,
+                         int(sys.argv[3]) if len(sys.argv) == 4 else None)
+    started = time.monotonic()
+    records = 0
+    for chunk in reader:
+        export.put(chunk)
+        records += len(chunk)
+    export.close()
+    seconds = time.monotonic() - started
+    print(f"{records} records exported to {sys.argv[2]} in {seconds:.1f} s "
+          f"({records * RECORD_DTYPE.itemsize / max(seconds, 1e-9) / 1e6:.0f} MB/s of capture)")
+
+
+if __name__ == "__main__":
+    main()
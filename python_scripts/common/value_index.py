@@ -0,0 +1,274 @@
+"""Inverted index over the values of cached decodes (in
+python_scripts/common).
+
+  python value_index.py <capture> i2c <address, hex> [read|write]
+  python value_index.py <capture> spi <first byte, hex> [miso]
+  python value_index.py <capture> uart <text> [channel]
+
+A pattern search over raw edges (capture_query.py) decodes whatever
+blocks could match. Once a capture has been decoded, DecodeCache.store
+also writes an index beside the decode's .laev entry, <entry>.lavi,
+keyed by value, so "every write to 0x3C" or "every 'ERR'" is a binary
+search in a memory-mapped file rather than a decode:
+  i2c   per address byte (address << 1 | read) the time of its
+        transaction's START
+  spi   per first byte of a transfer (lane << 8 | byte, lane 0 MOSI and
+        1 MISO) its time; a transfer is a run of bytes less than
+        SPI_GAP_S apart, as in pipeline.ProtocolStatsSink
+  uart  per source and three consecutive good bytes (UART_GRAM) the
+        time of the first; a longer text intersects the trigrams at
+        consecutive byte ordinals of the source, a shorter one scans
+        the .laev's bytes
+Every row also holds the event's position in the .laev and the block of
+the capture's seek index (counting across a rotated capture's
+segments) it falls in, so a hit opens with CaptureFile.window or the
+decode entry without a search.
+
+Layout, little-endian: header HEADER (magic b'LAVINDEX', format
+version, table count), then per table TABLE (name, rows) and its
+columns (COLUMNS) one after another, rows sorted by key then time. Each
+column is memory-mapped on its own, so a lookup reads the pages its
+binary search touches."""
+import glob
+import json
+import os
+import struct
+import sys
+import time
+
+import numpy as np
+
+from capture_file import ARCHIVE_SUFFIX, INDEX_SUFFIX, index_segments, read_seek
+from event_output import FLAG_ERROR, FLAG_READ, KIND, read_events
+
+VALUE_SUFFIX = '.lavi'
+MAGIC = b'LAVINDEX'
+VERSION = 1
+HEADER = struct.Struct('<8sHH')
+TABLE = struct.Struct('<8sQ')
+COLUMNS = (('key', '<u8'), ('time', '<i8'), ('event', '<i8'), ('ordinal', '<i8'), ('block', '<i8'))
+UART_GRAM = 3  # bytes per UART key
+UART_BITS = 9  # bits per byte in a UART key, for 9-bit frames
+SPI_GAP_S = 100e-6
+PROTOCOLS = ('i2c', 'spi', 'uart')  # decodes that are indexed
+
+
+def seek_times(path):
+    """Times of a capture's seek index entries, segment after segment,
+    never decreasing, for numbering blocks"""
+    if path.endswith(ARCHIVE_SUFFIX):
+        from capture_archive import Archive
+        archive = Archive(path)
+        times = archive.seek['time'].astype(np.int64)
+        archive.close()
+    elif path.endswith(INDEX_SUFFIX):
+        parts = [read_seek(segment)['time'] for segment in index_segments(path)]
+        times = np.concatenate(parts).astype(np.int64) if parts else np.empty(0, np.int64)
+    else:
+        times = read_seek(path)['time'].astype(np.int64)
+    return np.maximum.accumulate(times) if len(times) else times
+
+
+def _rows(keys, times, events, ordinals=None):
+    return {'key': np.asarray(keys, np.uint64), 'time': np.asarray(times, np.int64),
+            'event': np.asarray(events, np.int64),
+            'ordinal': np.asarray(events if ordinals is None else ordinals, np.int64)}
+
+
+def i2c_rows(records):
+    """Address bytes keyed by address << 1 | read, at their START"""
+    at = np.flatnonzero(records['kind'] == KIND['address'])
+    starts = np.flatnonzero(records['kind'] == KIND['start'])
+    before = np.searchsorted(starts, at) - 1
+    times = np.where(before >= 0, records['time'][starts[np.maximum(before, 0)]], records['time'][at]) \
+        if len(starts) else records['time'][at]
+    read = (records['flags'][at] & FLAG_READ) != 0
+    return _rows(records['value'][at].astype(np.uint64) << 1 | read, times, at)
+
+
+def spi_rows(records, tick_hz):
+    """First bytes of transfers keyed by lane << 8 | byte"""
+    at = np.flatnonzero(records['kind'] == KIND['spi'])
+    times = records['time'][at]
+    gap = int(tick_hz * SPI_GAP_S) if tick_hz else 0
+    first = np.ones(len(at), dtype=bool)
+    first[1:] = (np.diff(times) > gap) | (records['source'][at][1:] != records['source'][at][:-1])
+    at, times = at[first], times[first]
+    keys = np.concatenate([records['value'][at], (1 << 8) | records['aux'][at].astype(np.uint64)])
+    return _rows(keys, np.concatenate([times, times]), np.concatenate([at, at]))
+
+
+def uart_rows(records):
+    """Runs of UART_GRAM good bytes of one source keyed by source and
+    bytes, with the ordinal of the first among the source's bytes"""
+    parts = []
+    for source in np.unique(records['source']).tolist():
+        at = np.flatnonzero((records['kind'] == KIND['uart']) & (records['source'] == source))
+        if len(at) < UART_GRAM:
+            continue
+        good = (records['flags'][at] & FLAG_ERROR) == 0
+        values = records['value'][at].astype(np.uint64)
+        runs = len(at) - UART_GRAM + 1
+        keys = np.full(runs, source, dtype=np.uint64)
+        whole = np.ones(runs, dtype=bool)
+        for k in range(UART_GRAM):
+            keys = keys << UART_BITS | values[k:k + runs]
+            whole &= good[k:k + runs]
+        ordinals = np.flatnonzero(whole)
+        parts.append(_rows(keys[whole], records['time'][at[ordinals]], at[ordinals], ordinals))
+    if not parts:
+        return _rows([], [], [])
+    return {name: np.concatenate([part[name] for part in parts]) for name in parts[0]}
+
+
+def uart_key(source, data):
+    key = source
+    for byte in data:
+        key = key << UART_BITS | byte
+    return key
+
+
+def write(path, protocol, tick_hz, records, blocks):
+    """Writes the index of a decode's EVENT_DTYPE records to path, under
+    a temporary name and renamed; blocks are the capture's seek_times"""
+    if protocol == 'i2c':
+        tables = {'i2c': i2c_rows(records)}
+    elif protocol == 'spi':
+        tables = {'spi': spi_rows(records, tick_hz)}
+    else:
+        tables = {'uart': uart_rows(records)}
+    temporary = f"{path}.{os.getpid()}.tmp"
+    with open(temporary, 'wb') as f:
+        f.write(HEADER.pack(MAGIC, VERSION, len(tables)))
+        for name, rows in tables.items():
+            order = np.lexsort((rows['time'], rows['key']))
+            rows['block'] = np.maximum(np.searchsorted(blocks, rows['time'], side='right') - 1, 0)
+            f.write(TABLE.pack(name.encode(), len(order)))
+            for column, dtype in COLUMNS:
+                f.write(rows[column][order].astype(dtype).tobytes())
+    os.replace(temporary, path)
+
+
+class ValueIndex:
+    """An index file mapped for lookups: tables[name][column] arrays"""
+
+    def __init__(self, path):
+        self.tables = {}
+        with open(path, 'rb') as f:
+            magic, version, count = HEADER.unpack(f.read(HEADER.size))
+            if magic != MAGIC or version != VERSION:
+                raise ValueError(f"{path}: not a version {VERSION} value index")
+            offset = HEADER.size
+            for _ in range(count):
+                f.seek(offset)
+                name, rows = TABLE.unpack(f.read(TABLE.size))
+                offset += TABLE.size
+                table = {}
+                for column, dtype in COLUMNS:
+                    table[column] = np.memmap(path, dtype, 'r', offset, (rows,)) if rows else np.empty(0, dtype)
+                    offset += rows * np.dtype(dtype).itemsize
+                self.tables[name.rstrip(b'\0').decode()] = table
+
+    def rows(self, name, low, high=None):
+        """Row numbers of a table whose key is in [low, high]"""
+        keys = self.tables.get(name, {}).get('key')
+        if keys is None:
+            return np.empty(0, np.int64)
+        high = low if high is None else high
+        return np.arange(np.searchsorted(keys, np.uint64(low), 'left'),
+                         np.searchsorted(keys, np.uint64(high), 'right'))
+
+    def column(self, name, column, rows):
+        return np.asarray(self.tables[name][column][rows])
+
+    def uart(self, source, data, records=None):
+        """Row numbers (of the first trigram) where a source's good bytes
+        spell data; records, the .laev's, for data shorter than a gram"""
+        if len(data) >= UART_GRAM:
+            rows = self.rows('uart', uart_key(source, data[:UART_GRAM]))
+            ordinals = self.column('uart', 'ordinal', rows)
+            for k in range(1, len(data) - UART_GRAM + 1):
+                later = self.column('uart', 'ordinal', self.rows('uart', uart_key(source, data[k:k + UART_GRAM])))
+                keep = np.isin(ordinals + k, later)
+                rows, ordinals = rows[keep], ordinals[keep]
+            return rows, None
+        return None, scan_uart(records, source, data)
+
+
+def scan_uart(records, source, data):
+    """Event positions where a source's good bytes spell a short data"""
+    at = np.flatnonzero((records['kind'] == KIND['uart']) & (records['source'] == source))
+    values = np.where(records['flags'][at] & FLAG_ERROR, -1, records['value'][at].astype(np.int64))
+    hit = np.ones(max(len(at) - len(data) + 1, 0), dtype=bool)
+    for k, byte in enumerate(data):
+        hit &= values[k:k + len(hit)] == byte
+    return at[np.flatnonzero(hit)]
+
+
+def entries(capture, protocol):
+    """(base path, sidecar info) of the cached decodes of a capture for a
+    protocol that have an index"""
+    from decode_cache import CACHE_SUFFIX  # it imports this module
+    for sidecar in sorted(glob.glob(os.path.join(capture + CACHE_SUFFIX, '*.json'))):
+        base = sidecar[:-len('.json')]
+        try:
+            with open(sidecar) as f:
+                info = json.load(f)
+        except (OSError, ValueError):
+            continue
+        if info.get('protocol') == protocol and os.path.exists(base + VALUE_SUFFIX):
+            yield base, info
+
+
+def main():
+    if len(sys.argv) < 4 or sys.argv[2] not in PROTOCOLS:
+        print("Usage: python value_index.py <capture> i2c <address, hex> [read|write]")
+        print("       python value_index.py <capture> spi <first byte, hex> [miso]")
+        print("       python value_index.py <capture> uart <text> [channel]")
+        sys.exit(1)
+    capture, protocol, value = sys.argv[1:4]
+    option = sys.argv[4] if len(sys.argv) > 4 else None
+    found = 0
+    started = time.perf_counter()
+    for base, info in entries(capture, protocol):
+        tick_hz, sources, records = read_events(base + '.laev')
+        index = ValueIndex(base + VALUE_SUFFIX)
+        hits = []  # (time, block, source, what)
+        if protocol == 'i2c':
+            address = int(value, 16)
+            low = address << 1 | (option == 'read')
+            rows = index.rows('i2c', low, low if option else low | 1)
+            keys = index.column('i2c', 'key', rows)
+            hits = [(t, b, sources[0], f"{'read' if k & 1 else 'write'} 0x{k >> 1:02X}") for t, b, k in
+                    zip(index.column('i2c', 'time', rows).tolist(), index.column('i2c', 'block', rows).tolist(),
+                        keys.tolist())]
+        elif protocol == 'spi':
+            rows = index.rows('spi', (option == 'miso') << 8 | int(value, 16))
+            hits = [(t, b, sources[0], f"{option or 'mosi'} 0x{int(value, 16):02X}") for t, b in
+                    zip(index.column('spi', 'time', rows).tolist(), index.column('spi', 'block', rows).tolist())]
+        else:
+            data = value.encode().decode('unicode_escape').encode('latin-1')
+            blocks = None
+            for source, name in enumerate(sources):
+                if option is not None and name != option:
+                    continue
+                rows, events = index.uart(source, data, records)
+                if rows is not None:
+                    hits += [(t, b, name, repr(value)) for t, b in zip(index.column('uart', 'time', rows).tolist(),
+                                                                      index.column('uart', 'block', rows).tolist())]
+                    continue
+                if blocks is None:
+                    blocks = seek_times(capture)
+                times = records['time'][events]
+                hits += [(t, b, name, repr(value)) for t, b in
+                         zip(times.tolist(), np.maximum(np.searchsorted(blocks, times, 'right') - 1, 0).tolist())]
+        print(f"{os.path.basename(base)} ({json.dumps(info.get('params'))}): {len(hits)} found")
+        for t, block, source, what in sorted(hits):
+            when = f"{t / tick_hz:.6f} s" if tick_hz else f"{t} ticks"
+            print(f"  {when}  block {block}  [{source}] {what}")
+        found += len(hits)
+    print(f"{found} found in {(time.perf_counter() - started) * 1000:.1f} ms")
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,36 @@
+"""Stores the boot capture preset of a BOOT_CAPTURE analyzer with host
+command 'Z' (see boot_capture.h).
+
+  python boot_capture.py <port> off|fill|wrap [channel mask] [clock preset]
+
+From the next power-up the analyzer captures edges before its USB is
+up, so a target powered with it has its boot in the capture. The ring
+keeps the first (fill) or the newest (wrap) ring's worth until
+serial_plotter.py starts its stream, which then begins with them. The
+channel mask (e.g. 0b0011, default all) and clock preset (0 72 MHz ...
+6 1 MHz, default the build's) are the ones 'E' and 'H' take. off clears
+the preset. The flash page write stalls capture for about 20 ms."""
+import struct
+import sys
+
+BAUDRATE = 115200
+MODES = {'off': 0, 'fill': 1, 'wrap': 2}  # BOOT_CAPTURE_*
+CLOCK_KEEP = 0xFF  # BOOT_CLOCK_KEEP
+
+def main():
+    if not 3 <= len(sys.argv) <= 5 or sys.argv[2] not in MODES:
+        print("Usage: python boot_capture.py <port> off|fill|wrap [channel mask] [clock preset]")
+        sys.exit(1)
+    mask = int(sys.argv[3], 0) if len(sys.argv) > 3 else 0
+    clock = int(sys.argv[4], 0) if len(sys.argv) > 4 else CLOCK_KEEP
+    import serial
+    with serial.Serial(sys.argv[1], BAUDRATE, timeout=1) as ser:
+        ser.write(struct.pack('<cBBB', b'Z', MODES[sys.argv[2]], mask, clock))
+        ser.flush()
+    if sys.argv[2] == 'off':
+        print("Boot capture cleared")
+    else:
+        print(f"Boot capture ({sys.argv[2]}) stored; it starts at the next power-up")
+
+if __name__ == "__main__":
+    main()
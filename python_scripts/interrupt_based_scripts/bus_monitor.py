@@ -0,0 +1,339 @@
+"""Unattended bus monitor: serial_plotter.py's ingest feeding the
+streaming decoders and a set of rules, for analyzers left on a bus for
+weeks to catch rare protocol violations.
+
+  python bus_monitor.py --port /dev/ttyACM0 --channels CLK,SDA --out monitor
+  python bus_monitor.py --channels RX --no-rules --match "55 AA 01" --pulse 1:0:8:120
+
+No capture file is written. An AlertSink keeps the last --pre seconds of
+records in memory, decodes the bus the channel roles describe
+(pipeline.decoder_lanes) and checks what the decoders complete against
+the rules:
+  i2c-nack     NACK_STORM NACKs within its window (a NACK storm)
+  uart-error   UART_ERRORS bad frames (framing or parity) within its window
+  spi-length   an SPI transfer of a size outside the normal ones: SPI_SIZES,
+               or the sizes of the first SPI_LEARN transfers
+and against the triggers given, which work like rules that fire on
+every hit (TRIGGER_HOLDOFF_S), for conditions too involved for the
+firmware's trigger or on a firmware without one:
+  match        --match: a byte sequence received in a row, UART bytes
+               or SPI MOSI or MISO bytes
+  i2c-address  --address: an I2C transaction to one of these addresses
+  pulse        --pulse: a pulse on a channel shorter or longer than
+               given, whatever the bus
+With --no-rules only the triggers fire. A rule that fires opens an alert: the records held, plus the next --post
+seconds, become <out>/<date>-<time>-<rule>.lacap, a capture the decoders
+and viewers open as any other, and a line in <out>/alerts.csv. Further
+violations during an alert's window are counted in its line, and a rule
+stays quiet for HOLDOFF_S after firing. Only the newest --keep alert
+captures are kept, so memory is the pre-window (at most WINDOW_RECORDS
+records) and disk --keep windows, however long the monitor runs. The
+decoders keep only the frame in progress; the sink sheds batches when it
+falls behind, which the decoders treat as a loss. Ctrl-C stops it."""
+import argparse
+import collections
+import os
+import signal
+import threading
+import time
+
+os.environ.setdefault("MPLBACKEND", "Agg")  # serial_plotter imports pyplot; no window is opened
+
+import common_path  # puts python_scripts/common on sys.path
+import serial_plotter as plotter
+from capture_file import (CaptureWriter, MODE_EVENTS, CHANNEL_DROP_START, BLOCK_SUFFIX, seek_path)
+from pipeline import (Sink, ChunkDecoder, ProtocolStatsSink, decoder_lanes, bus_type, channel_levels,
+                      level_changes)
+
+NACK_STORM = (10, 0.1)  # (NACKs, seconds): that many within that long is a storm
+UART_ERRORS = (1, 1.0)  # (bad frames, seconds)
+SPI_SIZES = None  # the normal SPI transfer sizes in bytes, e.g. {4, 16}; None learns them
+SPI_LEARN = 1000  # transfers whose sizes are taken as the normal ones
+HOLDOFF_S = 60.0  # a rule that fired stays quiet this long, in capture time
+TRIGGER_HOLDOFF_S = 0.0  # ... and a trigger this long; hits in an alert's window are counted in it anyway
+RULES = ('i2c-nack', 'uart-error', 'spi-length')
+WINDOW_RECORDS = 4 << 20  # most records held before an alert, and recorded after one (40 MB)
+ALERT_LOG = "alerts.csv"
+
+
+class AlertSink(Sink):
+    """Decodes the bus batch by batch and records a window of the capture
+    around every rule violation, see the module doc. Rules are evaluated
+    in capture time, so they wait for the timestamp clock"""
+
+    def __init__(self, mapping, out_dir, pre_s, post_s, keep, baud=115200, rules=True,
+                 match=None, addresses=(), pulses=()):
+        """match: bytes to trigger on, addresses: I2C addresses to trigger
+        on, pulses: (channel, level, shortest s, longest s) of the
+        normal pulses, the others trigger"""
+        self.lanes = decoder_lanes(bus_type(mapping), mapping)
+        self.mapping = mapping
+        self.rules = rules
+        self.match = bytes(match or b'')
+        self.addresses = set(addresses)
+        self.pulses = list(pulses)
+        self.tails = collections.defaultdict(bytearray)  # (lane, event field): latest bytes, for match
+        self.pulse_start = {}  # channel: (level, time it changed to it, None if unseen)
+        self.out_dir = out_dir
+        self.pre_s, self.post_s, self.keep = pre_s, post_s, keep
+        self.baud = baud
+        self.tick_hz = None
+        self.decoders = {}  # lane index: ChunkDecoder
+        self.held = collections.deque()  # (last time, records) of the pre-window
+        self.held_records = 0
+        self.recent = collections.defaultdict(collections.deque)  # rule: times of its latest violations
+        self.fired = {}  # rule: capture time it last fired at
+        self.alert = None  # the alert being recorded
+        self.transfer = 0  # SPI bytes of the transfer in progress
+        self.last_byte = None
+        self.ss = 1
+        self.normal = set(SPI_SIZES) if SPI_SIZES else set()
+        self.learning = 0 if SPI_SIZES else SPI_LEARN
+        os.makedirs(out_dir, exist_ok=True)
+        super().__init__()
+
+    def tick(self, tick_hz):
+        self.tick_hz = tick_hz
+        self.decoders.clear()  # UART's bit time follows the clock
+
+    def gap(self):
+        for decoder in self.decoders.values():
+            list(decoder.lost(0))
+        self.transfer, self.last_byte = 0, None
+        self.tails.clear()
+        self.pulse_start.clear()  # a pulse across the loss has no known width
+
+    def consume(self, records):
+        timed = records['time'][records['channel'] < CHANNEL_DROP_START]
+        last = int(timed[-1]) if len(timed) else None
+        found = []  # (time, rule, detail)
+        if self.tick_hz:
+            for k, (protocol, lines, ch) in enumerate(self.lanes):
+                if k not in self.decoders:
+                    self.decoders[k] = ChunkDecoder(protocol, lines, self.tick_hz / self.baud)
+                events = list(self.decoders[k].events(records))
+                if protocol == 'uart':
+                    name = self.mapping.get(ch, f"CH{ch + 1}")
+                    if self.rules:
+                        found += [(event[1], 'uart-error', name) for event in events
+                                  if event[0] == 'byte' and event[2] is None]
+                    found += self._matches(events, (k, 2), name)
+                elif protocol == 'i2c':
+                    if self.rules:
+                        found += [(event[1], 'i2c-nack',
+                                   f"0x{event[2]:02X}" if event[0] == 'address' else "data")
+                                  for event in events if event[0] == 'address' and not event[4]
+                                  or event[0] == 'data' and not event[3]]
+                    found += [(event[1], 'i2c-address', f"0x{event[2]:02X} " + ("read" if event[3] else "write"))
+                              for event in events if event[0] == 'address' and event[2] in self.addresses]
+                else:
+                    if self.rules:
+                        found += self._spi_transfers(events, records, lines)
+                    found += self._matches(events, (k, 2), "MOSI") + self._matches(events, (k, 3), "MISO")
+            for pulse in self.pulses:
+                found += self._pulses(records, *pulse)
+
+        if self.alert is not None:
+            self.alert['batches'].append(records)
+            self.alert['records'] += len(records)
+        self.held.append((last, records))
+        self.held_records += len(records)
+        newest = next((t for t, _ in reversed(self.held) if t is not None), None)
+        while len(self.held) > 1 and (self.held_records > WINDOW_RECORDS or self.tick_hz and newest is not None
+                                      and self.held[0][0] is not None
+                                      and newest - self.held[0][0] > self.pre_s * self.tick_hz):
+            self.held_records -= len(self.held.popleft()[1])
+
+        for t, rule, detail in sorted(found):
+            self._violation(t, rule, detail)
+        alert = self.alert
+        if alert is not None and (last is not None and last >= alert['end'] or alert['records'] > 2 * WINDOW_RECORDS):
+            self._write()
+
+    def finish(self):
+        if self.alert is not None:
+            self._write()
+
+    def _matches(self, events, key, name):
+        """Hits of the match sequence in the bytes at field key[1] of the
+        byte events; a bad byte or a loss breaks a sequence"""
+        if not self.match:
+            return []
+        tail = self.tails[key]
+        found = []
+        for event in events:
+            if event[0] != 'byte' or event[key[1]] is None:
+                tail.clear()
+                continue
+            tail.append(event[key[1]])
+            del tail[:-len(self.match)]
+            if tail == self.match:
+                found.append((event[1], 'match', f"{name} {self.match.hex(' ')}"))
+        return found
+
+    def _pulses(self, records, channel, level, shortest_s, longest_s):
+        """The pulses at level on channel that ended in records and were
+        shorter than shortest_s or longer than longest_s"""
+        times, levels = channel_levels(records, channel)
+        if not len(times):
+            return []
+        was, since = self.pulse_start.get(channel, (int(levels[0]), None))
+        times, levels = level_changes(times, levels, was)
+        found = []
+        for t, now in zip(times.tolist(), levels.tolist()):
+            if was == level and since is not None:
+                width = (t - since) / self.tick_hz
+                if not shortest_s <= width <= longest_s:
+                    found.append((t, 'pulse', f"{self.mapping.get(channel, f'CH{channel + 1}')} "
+                                              f"{'high' if level else 'low'} {width * 1e6:.3f} us"))
+            was, since = now, t
+        self.pulse_start[channel] = (was, since)
+        return found
+
+    def _spi_transfers(self, events, records, lines):
+        """Violations of the SPI transfers the bytes and SS assertions
+        close, transfers bounded as ProtocolStatsSink bounds them"""
+        byte_times = [event[1] for event in events if event[0] == 'byte']
+        falls = []
+        if lines[3] is not None:
+            times, levels = level_changes(*channel_levels(records, lines[3]), self.ss)
+            self.ss = int(levels[-1]) if len(levels) else self.ss
+            falls = times[levels == 0].tolist()
+        gap = ProtocolStatsSink.SPI_TRANSFER_GAP_S * self.tick_hz if lines[3] is None else None
+        found = []
+        k = 0
+        for t in byte_times:
+            while k < len(falls) and falls[k] <= t:
+                found += self._close_transfer()
+                k += 1
+            if gap and self.last_byte is not None and t - self.last_byte > gap:
+                found += self._close_transfer()
+            self.transfer += 1
+            self.last_byte = t
+        if k < len(falls):  # asserted again after the last byte
+            found += self._close_transfer()
+        return found
+
+    def _close_transfer(self):
+        size, self.transfer = self.transfer, 0
+        if not size:
+            return []
+        if self.learning:
+            self.normal.add(size)
+            self.learning -= 1
+            return []
+        return [] if size in self.normal else [(self.last_byte, 'spi-length', f"{size} bytes")]
+
+    def _violation(self, t, rule, detail):
+        count, window_s = {'i2c-nack': NACK_STORM, 'uart-error': UART_ERRORS}.get(rule, (1, 0))
+        recent = self.recent[rule]
+        recent.append(t)
+        while recent and t - recent[0] > window_s * self.tick_hz:
+            recent.popleft()
+        if len(recent) < count:
+            return
+        recent.clear()
+        if self.alert is not None:
+            self.alert['further'] += 1
+            return
+        holdoff = HOLDOFF_S if rule in RULES else TRIGGER_HOLDOFF_S
+        if rule in self.fired and t - self.fired[rule] < holdoff * self.tick_hz:
+            return
+        self.fired[rule] = t
+        self.alert = {'time': t, 'rule': rule, 'detail': detail, 'further': 0,
+                      'end': t + int(self.post_s * self.tick_hz),
+                      'batches': [records for _, records in self.held], 'records': self.held_records}
+
+    def _write(self):
+        """Writes the alert's window out as a capture, logs it and removes
+        the oldest captures past --keep"""
+        alert, self.alert = self.alert, None
+        stamp = time.strftime('%Y%m%d-%H%M%S')
+        path = os.path.join(self.out_dir, f"{stamp}-{alert['rule']}.lacap")
+        writer = CaptureWriter(path, MODE_EVENTS, self.mapping, self.tick_hz or 0)
+        for records in alert['batches']:
+            writer.put(records)
+        writer.close()
+        log = os.path.join(self.out_dir, ALERT_LOG)
+        new = not os.path.exists(log)
+        with open(log, 'a', newline='') as f:
+            if new:
+                f.write("Host-Time,Rule,Detail,Clock-Time,Further,Capture\n")
+            f.write(f"{stamp},{alert['rule']},{alert['detail']},{alert['time']},{alert['further']},"
+                    f"{os.path.basename(path)}\n")
+        print(f"{stamp} {alert['rule']} ({alert['detail']}) at {alert['time'] / self.tick_hz:.6f}s"
+              + (f", {alert['further']} more in its window" if alert['further'] else "")
+              + f": {path}", flush=True)
+        captures = sorted(name for name in os.listdir(self.out_dir) if name.endswith(".lacap"))
+        for name in captures[:max(len(captures) - self.keep, 0)]:
+            old = os.path.join(self.out_dir, name)
+            for part in (old, seek_path(old), seek_path(old, BLOCK_SUFFIX)):
+                if os.path.exists(part):
+                    os.remove(part)
+
+
+def arguments():
+    parser = argparse.ArgumentParser(description="Decode a bus continuously and record a window around "
+                                                 "each protocol violation")
+    parser.add_argument("--port", default=plotter.SERIAL_PORT, help="serial port of the analyzer")
+    parser.add_argument("--bulk", action="store_true", help="USB_VENDOR_CLASS firmware: read through libusb")
+    parser.add_argument("--channels", required=True,
+                        help="roles of CH1, CH2, ... comma separated: RX,TX or CLK,MOSI,MISO,SS or CLK,SDA")
+    parser.add_argument("--flush", default="BATCH,16,2000",
+                        help="firmware flush policy MODE,batch events,latency us (default BATCH,16,2000)")
+    parser.add_argument("--baud", type=int, default=115200, help="UART baud rate")
+    parser.add_argument("--out", default="monitor", help="folder of the alert captures and alerts.csv")
+    parser.add_argument("--pre", type=float, default=2.0, help="seconds recorded before an alert")
+    parser.add_argument("--post", type=float, default=1.0, help="seconds recorded after an alert")
+    parser.add_argument("--keep", type=int, default=200, help="alert captures kept, the oldest removed first")
+    parser.add_argument("--no-rules", action="store_true", help="only the triggers below fire, not the rules")
+    parser.add_argument("--match", help="trigger on these bytes in a row, hex, e.g. \"55 AA 01\"")
+    parser.add_argument("--address", help="trigger on I2C transactions to these 7-bit addresses, e.g. 0x50,0x68")
+    parser.add_argument("--pulse", action="append", default=[],
+                        help="CH:LEVEL:MIN_US:MAX_US, trigger on a LEVEL pulse of CH (1-14) outside "
+                             "MIN_US to MAX_US; repeat for more channels")
+    args = parser.parse_args()
+
+    mode, batch, latency_us = (args.flush.split(",") + ["16", "2000"])[:3]
+    if mode.upper() not in plotter.FLUSH_MODES:
+        parser.error(f"flush mode {mode}: use one of {', '.join(plotter.FLUSH_MODES)}")
+    args.flush = plotter.FLUSH_MODES[mode.upper()], int(batch), int(latency_us)
+    args.mapping = {ch: name.strip().upper() for ch, name in enumerate(args.channels.split(",")) if name.strip()}
+    try:
+        args.match = bytes.fromhex(args.match) if args.match else None
+        args.address = [int(value, 0) for value in args.address.split(",")] if args.address else []
+    except ValueError as error:
+        parser.error(str(error))
+    pulses = []
+    for pulse in args.pulse:
+        fields = pulse.split(":")
+        if (len(fields) != 4 or not fields[0].isdigit() or not 1 <= int(fields[0]) <= 14
+                or fields[1] not in ("0", "1")):
+            parser.error(f"--pulse {pulse}: use CH:LEVEL:MIN_US:MAX_US, e.g. 1:0:8:120")
+        pulses.append((int(fields[0]) - 1, int(fields[1]), float(fields[2]) / 1e6, float(fields[3]) / 1e6))
+    args.pulse = pulses
+    if (not args.no_rules or args.match or args.address) and not decoder_lanes(bus_type(args.mapping), args.mapping):
+        parser.error(f"--channels {args.channels}: no UART, SPI or I2C bus in these roles")
+    if args.no_rules and not (args.match or args.address or args.pulse):
+        parser.error("--no-rules needs a --match, --address or --pulse trigger")
+    return args
+
+
+def main():
+    args = arguments()
+    plotter.SERIAL_PORT = args.port
+    plotter.BULK_USB = plotter.BULK_USB or args.bulk
+    plotter.CAPTURE_PATH = None  # the alert windows are the only files
+
+    stop = threading.Event()
+    signal.signal(signal.SIGINT, lambda *_: stop.set())
+    print(f"Monitoring {bus_type(args.mapping)} on {', '.join(args.mapping.values())} from {args.port}, "
+          f"alerts to {args.out}; Ctrl-C stops", flush=True)
+    plotter.ingest(None, args.mapping, args.flush, stop,
+                   sinks=[AlertSink(args.mapping, args.out, args.pre, args.post, args.keep, args.baud,
+                                    not args.no_rules, args.match, args.address, args.pulse)])
+    print("Monitor stopped")
+
+
+if __name__ == "__main__":
+    main()
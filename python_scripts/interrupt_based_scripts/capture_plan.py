@@ -0,0 +1,198 @@
+"""Predicts whether an edge capture fits the USB link and the event ring,
+before it starts and while it runs.
+
+  python capture_plan.py RATE [--channels N] [--encoding E] [--transport T] [--ring-kib K]
+  python capture_plan.py --from bitlog.lacap [--window-ms MS] [--encoding E] [--transport T]
+
+The link ceiling is the latest usb_benchmark.py run for the transport
+(usb_benchmark.jsonl; a rough full-speed figure until there is one).
+Each event costs the ring one word and the link the encoding's bytes:
+4 for edge and snapshot words, about 1.5 compact and less with
+prediction on steady clocks. The link drains the ring at ceiling /
+bytes-per-event events per second; an edge rate above that grows the
+ring by the difference, so the ring's free words over the difference is
+the time left before events are lost.
+
+RATE is edges per second over all channels. --from takes the rates
+from a capture instead, every --window-ms, and replays the ring over
+them: the peak window, the windows that would have lost events and how
+many are printed next to the plan for the mean rate.
+
+serial_plotter.py runs a CapacityEstimator when CAPACITY_PLAN is on. It
+needs the firmware's link health reports (HEALTH_REPORT_MS): they carry
+the edge rate at the pins, not the rate that reaches the host, the
+bytes each event really took and the ring's size and peak fill. Every
+report it predicts the headroom and, when the link falls behind, the
+seconds until the ring overflows, and warns once that drops near
+CAPACITY_WARN_S. With CAPACITY_AUTO it also turns on the storm limit
+('K') on every channel at the rate the link sustains, so the busiest
+channels are counted rather than lost, and the capture marks where."""
+import argparse
+import json
+import math
+import os
+
+import numpy as np
+
+import common_path  # puts python_scripts/common on sys.path
+from capture_file import CHANNEL_LEVELS_HIGH, RecordChunks
+
+LINK_REPORT = "usb_benchmark.jsonl"  # usb_benchmark.py appends its measured ceilings here
+LINK_DEFAULT = {"cdc": 0.9e6, "bulk": 1.1e6, "iso": 1.0e6}  # bytes/s, full-speed figures until measured
+EVENT_BYTES = {"edge": 4.0, "snapshot": 4.0, "compact": 1.5, "predicted": 0.5}  # link bytes per event
+RING_KIB = 8  # the default build's event ring, README Memory Budget
+MARGIN = 0.9  # the share of the ceiling a plan counts on
+STORM_BURST_MAX = 0xFFFF  # 'K' burst is 2 bytes
+
+
+def link_ceiling(transport, path=LINK_REPORT):
+    """(bytes/s, source) of the latest benchmark of transport"""
+    ceiling = None
+    if os.path.exists(path):
+        with open(path) as f:
+            for line in f:
+                run = json.loads(line)
+                if run.get("transport") == transport and not run.get("errors"):
+                    ceiling = run["bytes_per_s"], f"{path} {run['date']}"
+    return ceiling or (LINK_DEFAULT[transport], "default, run usb_benchmark.py to measure")
+
+
+class Plan:
+    """What rate edges/s costs a link of ceiling bytes/s at bytes_per_event,
+    with ring_words of the ring free"""
+
+    def __init__(self, rate, bytes_per_event, ceiling, ring_words):
+        self.rate = rate
+        self.bytes_per_event = bytes_per_event
+        self.ceiling = ceiling
+        self.drain = ceiling * MARGIN / bytes_per_event  # events/s the link takes
+        self.load = rate * bytes_per_event / ceiling  # share of the ceiling
+        self.headroom = self.drain / rate if rate else math.inf
+        growth = rate - self.drain  # ring words/s
+        self.overflow_s = ring_words / growth if growth > 0 else math.inf
+
+    def describe(self):
+        line = (f"{self.rate:,.0f} edges/s x {self.bytes_per_event:.2f} B = {self.load:.0%} of "
+                f"{self.ceiling / 1e6:.2f} MB/s, headroom x{self.headroom:.2f}")
+        if math.isinf(self.overflow_s):
+            return line + "; sustained"
+        return line + f"; the ring overflows after {self.overflow_s:.3f} s"
+
+
+class CapacityEstimator:
+    """Predicts from each link health report. update returns the storm
+    limit to send as (channel, rate, burst), or None"""
+
+    def __init__(self, ceiling, channels, warn_s, auto):
+        self.ceiling = ceiling
+        self.channels = max(channels, 1)
+        self.warn_s = warn_s
+        self.auto = auto
+        self.warned = False
+        self.limited = False
+
+    def update(self, events_per_s, bytes_per_s, ring_peak, ring_words):
+        """ring_peak: the fullest the ring was in the report, 0 to 1"""
+        if events_per_s <= 0 or bytes_per_s <= 0:
+            return None
+        bytes_per_event = bytes_per_s / events_per_s
+        plan = Plan(events_per_s, bytes_per_event, self.ceiling, ring_words * (1.0 - ring_peak))
+        if plan.overflow_s > self.warn_s:
+            if self.warned and plan.headroom > 1.0:
+                print(f"Capacity: {plan.describe()}")
+                self.warned = False
+            return None
+        if not self.warned:
+            print(f"WARNING: {plan.describe()}")
+            self.warned = True
+        if not self.auto or self.limited:
+            return None
+        self.limited = True
+        rate = int(plan.drain / self.channels)
+        burst = min(int(ring_words / 2 / self.channels), STORM_BURST_MAX)
+        print(f"Capacity: storm limit on every channel, {rate:,} edges/s with bursts of {burst}")
+        return None, rate, burst
+
+
+def window_rates(path, window_ms):
+    """(edges per window, seconds per window) of a capture's edge records"""
+    chunks = RecordChunks(path)
+    if not chunks.tick_hz:
+        raise SystemExit(f"{path}: the capture's clock is unknown")
+    window = max(int(chunks.tick_hz * window_ms / 1e3), 1)
+    counts = np.zeros(0, np.int64)
+    first = None
+    for records in chunks:
+        times = records['time'][records['channel'] < CHANNEL_LEVELS_HIGH]
+        if not len(times):
+            continue
+        if first is None:
+            first = int(times[0])
+        bins = np.bincount(np.maximum(times - first, 0) // window)
+        if len(bins) > len(counts):
+            counts = np.pad(counts, (0, len(bins) - len(counts)))
+        counts[:len(bins)] += bins
+    return counts, window / chunks.tick_hz
+
+
+def replay(counts, seconds, drain, ring_words):
+    """(windows that overflowed, events lost) with the ring drained at
+    drain events/s, each window's edges arriving evenly"""
+    fill = 0.0
+    lost = 0.0
+    overflowed = 0
+    for count in counts:
+        fill += count - drain * seconds
+        if fill > ring_words:
+            lost += fill - ring_words
+            fill = ring_words
+            overflowed += 1
+        fill = max(fill, 0.0)
+    return overflowed, int(lost)
+
+
+def main():
+    parser = argparse.ArgumentParser(description="Predicts whether a capture fits the USB link and ring")
+    parser.add_argument("rate", nargs="?", type=float, help="edges per second over all channels")
+    parser.add_argument("--from", dest="capture", help="take the rates from this capture")
+    parser.add_argument("--window-ms", type=float, default=10.0, help="rate window of --from (default 10)")
+    parser.add_argument("--channels", type=int, default=4, help="channels the rate is spread over (default 4)")
+    parser.add_argument("--encoding", choices=EVENT_BYTES, default="edge", help="stream encoding (default edge)")
+    parser.add_argument("--transport", choices=LINK_DEFAULT, default="cdc", help="USB transport (default cdc)")
+    parser.add_argument("--ring-kib", type=float, default=RING_KIB, help=f"event ring size (default {RING_KIB})")
+    args = parser.parse_args()
+    if (args.rate is None) == (args.capture is None):
+        parser.error("give a RATE or --from a capture")
+
+    ceiling, source = link_ceiling(args.transport)
+    ring_words = int(args.ring_kib * 1024 / 4)
+    bytes_per_event = EVENT_BYTES[args.encoding]
+    print(f"Link: {ceiling / 1e6:.2f} MB/s over {args.transport} ({source}); "
+          f"ring {ring_words} words; {args.encoding} at {bytes_per_event} B per event")
+
+    if args.capture is None:
+        plan = Plan(args.rate, bytes_per_event, ceiling, ring_words)
+        print(plan.describe())
+        print(f"Sustains {plan.drain:,.0f} edges/s, {plan.drain / args.channels:,.0f} per channel of {args.channels}")
+        cheaper = [name for name, cost in EVENT_BYTES.items()
+                   if cost < bytes_per_event and Plan(args.rate, cost, ceiling, ring_words).headroom > 1.0]
+        if plan.headroom <= 1.0 and cheaper:
+            print(f"Fits with: {', '.join(cheaper)}")
+        return
+
+    counts, seconds = window_rates(args.capture, args.window_ms)
+    if not len(counts):
+        raise SystemExit(f"{args.capture}: no edges")
+    mean = Plan(counts.sum() / (len(counts) * seconds), bytes_per_event, ceiling, ring_words)
+    peak = Plan(counts.max() / seconds, bytes_per_event, ceiling, ring_words)
+    print(f"Mean: {mean.describe()}")
+    print(f"Peak {args.window_ms:g} ms: {peak.describe()}")
+    for name, cost in EVENT_BYTES.items():
+        drain = ceiling * MARGIN / cost
+        overflowed, lost = replay(counts, seconds, drain, ring_words)
+        verdict = f"{overflowed} windows overflow, about {lost:,} events lost" if overflowed else "no loss"
+        print(f"  {name:10s} {verdict}")
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,8 @@
+"""Puts python_scripts/common, the modules both script folders share, on
+the import path; the scripts here import it before the first of them."""
+import os
+import sys
+
+COMMON_DIR = os.path.join(os.path.dirname(os.path.dirname(os.path.abspath(__file__))), 'common')
+if COMMON_DIR not in sys.path:
+    sys.path.append(COMMON_DIR)
@@ -0,0 +1,163 @@
+"""Finds the highest square-wave frequency the interrupt analyzer captures
+without loss, for 1 to 4 channels, so a firmware change that lowers it
+shows. arduino_serial_tester.ino is rebuilt as COMM_SQUARE (see
+loss_benchmark.py for the arduino-cli setup) to run SQUARE_HZ on that
+many of its pins 9, 10, 11 and 3, wired to analyzer CH1-CH4. Each
+probe captures HOLD_S through serial_plotter.ingest with only those
+channels enabled, into edge-rate-<channels>-<Hz>.lacap, and passes if:
+  no drop markers or storm summaries
+  every channel alternates rising and falling over about HOLD_S
+  no gap between edges of a channel reaches GAP_LIMIT times the median
+    (a missed rising and falling pair)
+  the edge count is within COUNT_TOLERANCE of the wave's (the two
+    boards' clocks differ)
+The frequency is bisected geometrically from MIN_HZ, which must pass,
+towards MAX_HZ, assumed to fail, until the bounds are RESOLUTION
+apart; probes use the frequencies the timers can make.
+
+  python edge_rate_benchmark.py [label]
+
+Each run appends one JSON object to edge_rate_benchmark.jsonl with the
+repository revision, the label (e.g. the build options) and per channel
+count the highest passing frequency, its edges per second and every
+probe, so the figures can be tracked across firmware revisions."""
+import datetime
+import json
+import math
+import multiprocessing
+import os
+import subprocess
+import sys
+import time
+
+import numpy as np
+
+import common_path  # puts python_scripts/common on sys.path
+import serial_plotter
+from capture_file import CaptureFile
+from loss_benchmark import upload_sketch, FLUSH_POLICY, SETTLE_S
+from shm_ring import SharedRing
+
+COMM_SQUARE = 4       # the sketch's COMM_TYPE
+ARDUINO_F_CPU = 16_000_000
+PRESCALERS = (1, 8, 64, 256, 1024)  # common to the sketch's timers 1 and 2
+HOLD_S = 60.0
+MIN_HZ = 1000
+MAX_HZ = 2_000_000
+RESOLUTION = 0.02     # stop once the bounds are this close, relative
+GAP_LIMIT = 2.5
+COUNT_TOLERANCE = 0.01
+REPORT = "edge_rate_benchmark.jsonl"
+
+def square_hz(hz):
+    """The frequency the sketch makes for SQUARE_HZ hz: the nearest at or
+    above it that its timers reach"""
+    for prescaler in PRESCALERS:
+        ticks = ARDUINO_F_CPU // (2 * prescaler * hz)
+        if ticks <= 256:
+            break
+    return ARDUINO_F_CPU / (2 * prescaler * min(max(ticks, 1), 256))
+
+def ingest_channels(mask, *args):
+    """serial_plotter.ingest with only the channels in mask enabled; the
+    setting is made in the ingest process itself"""
+    serial_plotter.CHANNEL_MASK = mask
+    serial_plotter.ingest(*args)
+
+def capture(path, channels):
+    """Records HOLD_S of the first channels to path"""
+    mapping = {ch: f"SQ{ch + 1}" for ch in range(channels)}
+    ring = SharedRing()
+    stop = multiprocessing.Event()
+    reader = multiprocessing.Process(target=ingest_channels,
+                                     args=((1 << channels) - 1, ring.name, mapping, FLUSH_POLICY, stop))
+    reader.start()
+    time.sleep(HOLD_S)
+    stop.set()
+    reader.join()
+    ring.close()
+    os.replace("bitlog.lacap", path)
+
+def verify(path, channels, hz):
+    """(passed, edges captured, reason) of one probe's capture"""
+    capture_file = CaptureFile(path)
+    lost = sum(count for count, _, _ in capture_file.drops())
+    if lost:
+        return False, 0, f"{lost} events dropped"
+    if capture_file.storms():
+        return False, 0, "storm limited"
+    edges = 0
+    for ch in range(channels):
+        times, values = capture_file.edges(ch)
+        edges += len(times)
+        if len(times) < 3:
+            return False, edges, f"CH{ch + 1}: no wave"
+        span = (int(times[-1]) - int(times[0])) / capture_file.tick_hz
+        if span < 0.95 * HOLD_S:
+            return False, edges, f"CH{ch + 1}: {span:.1f} s of edges"
+        if np.any(values[1:] == values[:-1]):
+            return False, edges, f"CH{ch + 1}: edge missed"
+        gaps = np.diff(times)
+        if gaps.max() >= GAP_LIMIT * np.median(gaps):
+            return False, edges, f"CH{ch + 1}: gap of {gaps.max() / capture_file.tick_hz * 1e6:.1f} us"
+        expected = span * 2 * hz
+        if abs(len(times) - 1 - expected) > COUNT_TOLERANCE * expected:
+            return False, edges, f"CH{ch + 1}: {len(times)} edges, {expected:.0f} expected"
+    return True, edges, ""
+
+def probe(channels, hz):
+    """Runs one frequency; returns its report entry"""
+    upload_sketch({'COMM_TYPE': COMM_SQUARE, 'SQUARE_HZ': f'{round(hz)}UL',
+                   'SQUARE_CHANNELS': channels})
+    time.sleep(SETTLE_S)
+    path = f"edge-rate-{channels}-{round(hz)}.lacap"
+    capture(path, channels)
+    passed, edges, reason = verify(path, channels, hz)
+    print(f"  {channels} ch {hz:>11.1f} Hz: {'pass' if passed else 'FAIL ' + reason}")
+    return {'hz': hz, 'passed': passed, 'edges': edges, 'reason': reason}
+
+def search(channels):
+    """(highest passing Hz or 0, probes) for one channel count"""
+    probes = [probe(channels, square_hz(MIN_HZ))]
+    if not probes[0]['passed']:
+        return 0.0, probes
+    low, high = probes[0]['hz'], float(MAX_HZ)
+    while high / low > 1 + RESOLUTION:
+        hz = square_hz(int(math.sqrt(low * high)))
+        if not low < hz < high:
+            break  # no timer setting left between the bounds
+        probes.append(probe(channels, hz))
+        if probes[-1]['passed']:
+            low = hz
+        else:
+            high = hz
+    return low, probes
+
+def revision():
+    """git describe of the repository, or '' outside a checkout"""
+    try:
+        return subprocess.run(['git', 'describe', '--always', '--dirty'], capture_output=True, text=True,
+                              cwd=os.path.dirname(os.path.abspath(__file__)), check=True).stdout.strip()
+    except (OSError, subprocess.CalledProcessError):
+        return ''
+
+def main():
+    if len(sys.argv) > 2:
+        print("Usage: python edge_rate_benchmark.py [label]")
+        sys.exit(1)
+    report = {'date': datetime.datetime.now().isoformat(timespec='seconds'), 'revision': revision(),
+              'label': sys.argv[1] if len(sys.argv) == 2 else '', 'hold_s': HOLD_S, 'results': []}
+    for channels in range(1, 5):
+        hz, probes = search(channels)
+        report['results'].append({'channels': channels, 'max_hz': hz, 'edges_per_s': 2 * hz * channels,
+                                  'probes': probes})
+
+    print(f"{'channels':>8} {'max Hz':>12} {'edges/s':>12}")
+    for result in report['results']:
+        print(f"{result['channels']:>8} {result['max_hz']:>12.1f} {result['edges_per_s']:>12.0f}")
+    with open(REPORT, "a") as f:
+        f.write(json.dumps(report) + "\n")
+    print(f"Report added to {REPORT}")
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,145 @@
+"""Drives a FLASH_LOG analyzer's offline log with host command 'O' (see
+flash_log.h) and turns a downloaded log into a capture.
+
+  python flash_log.py <port> erase|start|stop|status
+  python flash_log.py <port> download [out.lacap] [channels]
+
+erase empties the chip, which takes tens of seconds; start logs the edge
+stream to it until stop, or until the chip is full, and the analyzer can
+be unplugged from the host in between (a power loss keeps what was
+written). status reports the log's state and size, but not while it
+logs: the edge stream is restarted with 'M' to read the answer, which
+the firmware refuses then. download reads the log as fast as USB goes
+and replays it through serial_plotter.py's ingest, as if it had been
+captured live, into out.lacap (default bitlog.lacap) with the channel
+names given comma separated (default CH1,CH2,...). The raw log is kept beside it
+as <out>.flog. The edge stream restarts on USB afterwards."""
+import os
+import struct
+import sys
+import threading
+import time
+
+os.environ.setdefault("MPLBACKEND", "Agg")  # serial_plotter imports pyplot; no window is opened
+
+BAUDRATE = 115200
+MODES = {'stop': 0, 'erase': 1, 'start': 2, 'download': 3}  # FLASH_LOG_*
+DOWNLOAD_MAGIC = struct.pack('<I', 0x474F4C46)  # FLASH_DOWNLOAD_MAGIC
+ANSWER_TIMEOUT_S = 90  # a chip erase takes up to a minute
+CHANNELS = 8
+
+
+class LogPort:
+    """A downloaded log in place of the serial port, for ingest: reads
+    hand out its bytes, writes are dropped, stop is set once it is read"""
+
+    def __init__(self, data, stop):
+        self.data = memoryview(data)
+        self.at = 0
+        self.stop = stop
+
+    @property
+    def in_waiting(self):
+        return min(len(self.data) - self.at, 1 << 16)
+
+    def read(self, size=1):
+        piece = bytes(self.data[self.at:self.at + size])
+        self.at += len(piece)
+        if self.at >= len(self.data):
+            self.stop.set()
+        return piece
+
+    def write(self, data):
+        return len(data)
+
+    def reset_input_buffer(self):
+        pass
+
+
+def quiet(ser):
+    """Stops capturing and drops what the stream still had in flight"""
+    ser.write(struct.pack('<cB', b'R', 0))
+    time.sleep(0.2)
+    ser.reset_input_buffer()
+
+
+def answer(ser, plotter):
+    """The BUS_FLASH answer to 'O', decoded from the edge stream the
+    caller synchronised to, or None"""
+    deadline = time.monotonic() + ANSWER_TIMEOUT_S
+    while not plotter.flash_log_replies and time.monotonic() < deadline:
+        plotter.read_events(ser)
+    return plotter.flash_log_replies[-1] if plotter.flash_log_replies else None
+
+
+def download(ser):
+    """The log's bytes, its page counts taken out by the firmware"""
+    quiet(ser)
+    ser.write(struct.pack('<cB', b'O', MODES['download']))
+    data = bytearray()
+    deadline = time.monotonic() + ANSWER_TIMEOUT_S
+    while DOWNLOAD_MAGIC not in data[:-4] or len(data) < data.find(DOWNLOAD_MAGIC) + 8:
+        if time.monotonic() > deadline:
+            raise OSError("no download came; is the log empty or still logging?")
+        data += ser.read(ser.in_waiting or 1)
+    at = data.find(DOWNLOAD_MAGIC)
+    size, = struct.unpack_from('<I', data, at + 4)
+    log = data[at + 8:]
+    start, last = time.monotonic(), time.monotonic()
+    while len(log) < size:
+        piece = ser.read(min(ser.in_waiting or 1, size - len(log)))
+        if not piece:
+            raise OSError(f"download stopped at {len(log)} of {size} bytes")
+        log += piece
+        if time.monotonic() - last >= 1:
+            print(f"  {len(log) >> 10} of {size >> 10} KiB", flush=True)
+            last = time.monotonic()
+    seconds = time.monotonic() - start
+    print(f"Downloaded {size} bytes in {seconds:.1f} s ({size / max(seconds, 1e-3) / 1e6:.2f} MB/s)")
+    return bytes(log[:size])
+
+
+def main():
+    if len(sys.argv) < 3 or sys.argv[2] not in (*MODES, 'status') \
+            or len(sys.argv) > (5 if sys.argv[2] == 'download' else 3):
+        print("Usage: python flash_log.py <port> erase|start|stop|status\n"
+              "       python flash_log.py <port> download [out.lacap] [channels]")
+        sys.exit(1)
+    import serial
+    import serial_plotter as plotter
+    mode = sys.argv[2]
+    with serial.Serial(sys.argv[1], BAUDRATE, timeout=5) as ser:
+        if mode != 'download':
+            if mode in ('erase', 'status'):
+                plotter.send_event_mode(ser)  # a fresh stream to decode the answer from
+            ser.write(struct.pack('<cB', b'O', MODES.get(mode, 4)))  # 'O' 4 only reports
+            if mode == 'start':
+                print("Logging; the analyzer can leave the host until 'stop'")
+                return  # the answer went to the log
+            if mode == 'erase':
+                print("Erasing the chip...", flush=True)
+            elif mode == 'stop':
+                plotter.read_stream_header(ser)  # the edge stream restarts on USB
+            if answer(ser, plotter) is None:
+                print("No answer; is this a FLASH_LOG build?")
+            return
+        try:
+            log = download(ser)
+        except OSError as e:
+            print(f"Error: {e}")
+            sys.exit(1)
+        ser.write(struct.pack('<cB', b'M', 0))  # back to the live stream
+
+    out = sys.argv[3] if len(sys.argv) > 3 else plotter.CAPTURE_PATH
+    with open(out + '.flog', 'wb') as f:
+        f.write(log)
+    names = sys.argv[4].split(",") if len(sys.argv) > 4 else [f"CH{ch + 1}" for ch in range(CHANNELS)]
+    mapping = {ch: name.strip().upper() for ch, name in enumerate(names) if name.strip()}
+    plotter.CAPTURE_PATH = out
+    stop = threading.Event()
+    plotter.ingest(None, mapping, (plotter.FLUSH_MODES['BATCH'], 16, 2000), stop, port=LogPort(log, stop))
+    print(f"Capture written: {out}")
+
+
+if __name__ == "__main__":
+    main()
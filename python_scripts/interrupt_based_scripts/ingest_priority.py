@@ -0,0 +1,162 @@
+"""Keeps serial_plotter.py's reader on a CPU when the machine is loaded.
+
+The reader only has to wake when the port has bytes, but on a busy host
+it can wait for a CPU long enough for the OS serial buffer to fill, and
+the overflow loses events however low the average load is. With
+INGEST_REALTIME the ingest process calls raise_priority() once its sink
+threads are running, so only the reader thread gets:
+  Linux    SCHED_FIFO at FIFO_PRIORITY (root or CAP_SYS_NICE, else the
+           highest nice the limits allow) and pinned to one core
+  Windows  THREAD_PRIORITY_TIME_CRITICAL in a HIGH_PRIORITY_CLASS
+           process and pinned to one core
+  macOS    the highest nice the limits allow; it has no affinity call
+The sink threads keep normal priority on the other cores. A priority
+the OS refuses is reported and left as it was.
+
+PortReader reads what the port holds into one buffer allocated at start
+(os.readv on a POSIX serial port; a larger driver buffer on Windows),
+and gc.freeze() moves everything set up before the loop out of the
+collector's way, so the loop allocates little and collections stay
+short.
+
+StallMeter measures what is left: the time the reader was off the CPU
+between two port reads (wall time less thread CPU time): the
+scheduler's doing, a page fault or the capture writer's queue being
+full, never the reader's own work. A stall
+over STALL_MS counts; the report gives their number, the worst and the
+99th percentile, and where the OS counts them the involuntary context
+switches."""
+import ctypes
+import gc
+import os
+import sys
+import time
+
+import numpy as np
+import serial
+
+FIFO_PRIORITY = 50  # of 1-99; the kernel's own threads run at 50 and up
+NICE = -20  # tried when SCHED_FIFO is refused, stopping at the first the limits allow
+STALL_MS = 2.0  # off-CPU time between reads that counts as a stall
+THREAD_PRIORITY_TIME_CRITICAL = 15
+HIGH_PRIORITY_CLASS = 0x80
+
+
+def raise_priority(core=None):
+    """Raises the calling thread's scheduling priority as far as the OS
+    allows and pins it to core (the last one allowed if None). Returns
+    what was applied or refused, for the console"""
+    done = []
+    if sys.platform == 'win32':
+        kernel = ctypes.windll.kernel32
+        thread = kernel.GetCurrentThread()
+        kernel.SetPriorityClass(kernel.GetCurrentProcess(), HIGH_PRIORITY_CLASS)
+        done.append("THREAD_PRIORITY_TIME_CRITICAL" if kernel.SetThreadPriority(thread, THREAD_PRIORITY_TIME_CRITICAL)
+                    else "time-critical priority refused")
+        core = os.cpu_count() - 1 if core is None else core
+        done.append(f"pinned to core {core}" if kernel.SetThreadAffinityMask(thread, 1 << core)
+                    else f"core {core} refused")
+        return done
+    if hasattr(os, 'sched_setaffinity'):
+        core = max(os.sched_getaffinity(0)) if core is None else core
+        try:
+            os.sched_setaffinity(0, {core})  # 0: the calling thread
+            done.append(f"pinned to core {core}")
+        except OSError as e:
+            done.append(f"core {core} refused ({e.strerror})")
+    if hasattr(os, 'sched_setscheduler'):
+        try:
+            os.sched_setscheduler(0, os.SCHED_FIFO, os.sched_param(FIFO_PRIORITY))
+            done.append(f"SCHED_FIFO {FIFO_PRIORITY}")
+            return done
+        except OSError:
+            done.append("SCHED_FIFO refused (needs root or CAP_SYS_NICE)")
+    for nice in range(NICE, 0):
+        try:
+            os.setpriority(os.PRIO_PROCESS, 0, nice)
+            done.append(f"nice {nice}")
+            break
+        except OSError:
+            continue
+    else:
+        done.append("nice refused")
+    return done
+
+
+def freeze_heap():
+    """Collects once, then leaves everything allocated so far out of later
+    collections"""
+    gc.collect()
+    gc.freeze()
+
+
+class PortReader:
+    """Reads what a port holds into one preallocated buffer of size bytes.
+    A POSIX serial port is read with os.readv straight into it; other
+    ports (libusb, Windows) go through their read(), with the Windows
+    driver's buffer raised to size"""
+
+    def __init__(self, ser, size):
+        self.buffer = bytearray(size)
+        self.view = memoryview(self.buffer)
+        self.fd = ser.fileno() if isinstance(ser, serial.Serial) and os.name == 'posix' else None
+        if hasattr(ser, 'set_buffer_size'):
+            ser.set_buffer_size(rx_size=size)
+
+    def read(self, ser, count):
+        """Up to count bytes of the ones the port holds; a count of 0 or 1
+        goes through ser.read(), which waits for them"""
+        if self.fd is None or count <= 1:
+            return ser.read(count)
+        try:
+            n = os.readv(self.fd, [self.view[:min(count, len(self.buffer))]])
+        except BlockingIOError:
+            return b''
+        return bytes(self.view[:n])
+
+
+class StallMeter:
+    """Off-CPU time of the reader between port reads; see the module doc.
+    reading() goes before each read and read() after it"""
+
+    def __init__(self):
+        self.began = None  # (wall, thread CPU) when the last read returned
+        self.stalls = []  # ms of each stall since the last report
+        self.worst = 0.0  # ms, since the last take_worst()
+        self.switches = self._switches()
+
+    @staticmethod
+    def _switches():
+        try:
+            import resource
+            return resource.getrusage(resource.RUSAGE_THREAD).ru_nivcsw
+        except (ImportError, AttributeError, OSError):
+            return None
+
+    def reading(self):
+        if self.began is None:
+            return
+        off = ((time.perf_counter() - self.began[0]) - (time.thread_time() - self.began[1])) * 1e3
+        self.worst = max(self.worst, off)
+        if off >= STALL_MS:
+            self.stalls.append(off)
+
+    def read(self):
+        self.began = (time.perf_counter(), time.thread_time())
+
+    def take_worst(self):
+        """Longest off-CPU time since the last call, ms"""
+        worst, self.worst = self.worst, 0.0
+        return worst
+
+    def report(self, seconds):
+        """A console line on the stalls of the last seconds; starts over"""
+        switches = self._switches()
+        line = f"Ingest stalls over {STALL_MS:g} ms in the last {seconds:.0f} s: {len(self.stalls)}"
+        if self.stalls:
+            line += f", worst {max(self.stalls):.1f} ms, p99 {np.percentile(self.stalls, 99):.1f} ms"
+        if switches is not None:
+            line += f", {switches - self.switches} involuntary context switches"
+            self.switches = switches
+        self.stalls.clear()
+        return line
@@ -0,0 +1,932 @@
+/*
+ * la_ingest: native ingest for serial_plotter.py (NATIVE_INGEST = True)
+ *
+ * Reads the event stream of a USB_VENDOR_CLASS firmware build through
+ * libusb with LA_TRANSFERS bulk IN transfers always queued, decodes the
+ * edge or snapshot event words, and writes the records both to a
+ * bitlog.lacap capture (capture_file.py) and to the shared-memory ring
+ * the plot reads (shm_ring.py). It does the same work as the Python
+ * ingest process, without the interpreter in the read path.
+ *
+ * Build (Linux, macOS; needs libusb-1.0):
+ *   cc -O2 -o la_ingest la_ingest.c $(pkg-config --cflags --libs libusb-1.0)
+ * Linux glibc older than 2.34 also needs -lrt for shm_open.
+ *
+ * Usage: la_ingest <ring name> <capture path> [-f] [-s] [-n names] [-F mode,batch,us]
+ *   -f  STREAM_FRAMED build: check and strip the frame headers
+ *   -s  snapshot event format (EVENT_FORMAT_SNAPSHOT 1)
+ *       (-f and -s are for firmware before protocol v5; newer firmware
+ *       says both in the stream header it sends after 'M')
+ *   -n  comma-separated names of CH1-CH4 for the capture header
+ *   -F  flush policy sent with 'F', see host_cmd.h
+ * serial_plotter.py starts it with the ring it created and stops it with
+ * SIGINT; the capture is flushed about once a second and on exit.
+ *
+ * BUS_PULSE records and pulse words (PULSE_RECORDS) are decoded into
+ * their two edges, in time order within a transfer.
+ * STREAM_COMPACT and USB_ISO_STREAM builds are left to the Python ingest.
+ * SOF pairs are recorded with an unknown host time (-1): the clock fit
+ * lives in clock_sync.py.
+ */
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <libusb.h>
+
+#define LA_VENDOR_ID   0x0483
+#define LA_PRODUCT_ID  22337        /* USBD_PID_FS of the bulk build, see usbd_desc.c */
+#define LA_CONTROL_PRODUCT_ID 22338 /* with USB_CONTROL_EP; its replies stay on interface 1 */
+#define LA_IN_EP       0x81
+#define LA_TRANSFERS   32           /* bulk IN transfers kept queued */
+#define LA_TRANSFER_SIZE 16384
+#define LA_FLUSH_NS    1000000000LL /* capture flush period, as FLUSH_EVERY_S */
+#define LA_HEADER_NS   500000000LL  /* stream header wait, as HEADER_TIMEOUT_S */
+
+/* StreamHeader, see host_cmd.h */
+#define STREAM_HEADER_MAGIC      0x4D525453UL
+#define STREAM_HEADER_SIZE       24
+#define STREAM_ENCODING_SNAPSHOT 2
+#define STREAM_COMPRESSION_NONE  0
+#define STREAM_FLAG_FRAMED       0x01
+
+/* capture_file.py */
+#define CAPTURE_HEADER_SIZE   128
+#define CAPTURE_TICK_HZ_OFFSET 12
+#define CAPTURE_NAME_BYTES    16
+#define CAPTURE_VERSION       1
+#define CAPTURE_MODE_EVENTS   1
+#define CAPTURE_BUFFER        (1 << 20)
+#define CHANNEL_DROP_START    0x80
+#define CHANNEL_DROP_END      0x81
+#define CHANNEL_DROP_COUNT    0x82
+#define CHANNEL_SYNC_FRAME    0x83
+#define CHANNEL_SYNC_CLOCK    0x84
+#define CHANNEL_SYNC_HOST     0x85
+#define CHANNEL_TRIGGER       0x86
+#define CHANNEL_STORM         0x87  /* value = channel | level << 2 | calm << 3 */
+#define CHANNEL_STORM_COUNT   0x88
+#define CHANNEL_LEVEL_SNAPSHOT 0x8A /* value = levels | channels << 4 */
+#define CHANNEL_UART          0x10  /* + (status << 2 | channel) */
+#define CHANNEL_SPI           0x20  /* + (overrun << 1 | line) */
+#define CHANNEL_I2C           0x30  /* + (event << 1 | flag) */
+#define CHANNEL_ANALOG        0x40  /* + (sample >> 8), value = its low 8 bits */
+
+/* shm_ring.py */
+#define RING_HEADER_BYTES 64
+
+/* event_format.h */
+#define EDGE_TIME_BITS     29
+#define SNAPSHOT_TIME_BITS 24
+#define MARKER_EPOCH 0
+#define MARKER_DROP  1
+#define MARKER_INFO  2
+#define MARKER_SOF   3
+#define MARKER_UART  4
+#define MARKER_WINDOW  5
+#define MARKER_TRIGGER 6
+#define MARKER_BUS   7
+#define MARKER_DROP_WORDS 3
+#define MARKER_INFO_WORDS 5
+#define MARKER_SOF_WORDS  2
+#define MARKER_UART_WORDS 2
+#define MARKER_WINDOW_WORDS  3
+#define MARKER_TRIGGER_WORDS 1
+#define MARKER_BUS_WORDS  2
+#define BUS_SPI 0
+#define BUS_I2C 1
+#define BUS_STORM 2
+#define BUS_STATS 3
+#define BUS_MEASURE 4
+#define BUS_HEALTH 5
+#define BUS_LEVELS 8
+#define BUS_ANALOG 12
+#define BUS_ANALOG_PERIOD 13
+#define BUS_OVERLOAD 14
+#define OVERLOAD_ENTER 1
+#define BUS_PULSE 17
+#define PULSE_BUS_WIDTH  0x7FFFF
+#define PULSE_FLAG_LEVEL 0x01
+#define PULSE_FLAG_EDGE  0x02
+#define PULSE_FLAG_OFF   0x04
+#define SPI_FLAG_MISO    0x01
+#define SPI_FLAG_OVERRUN 0x02
+#define FRAME_SYNC   0xA55A
+#define FRAME_HEADER 12
+#define FRAME_MAX    (FRAME_HEADER + 65535)
+
+/* HOST_CAP_* bits of the 'V' reply, as CAPABILITIES in serial_plotter.py */
+static const char *const capability_names[] = {
+    "events", "poll", "dma", "burst", "rle", "stats", "flush", "snapshot",
+    "compact", "ic_dma", "bulk", "framed", "bench", "sof_sync", "iso", "uart",
+    "trigger", "spi", "i2c", "glitch", "channels",
+    "storm", "clock", "layout", "measure", "trim", "wide", "sync", "dual", "adaptive"};
+
+#pragma pack(push, 1)
+typedef struct
+{
+    int64_t time;
+    uint8_t channel;
+    uint8_t value;
+} Record;  /* RECORD_DTYPE */
+#pragma pack(pop)
+
+static volatile sig_atomic_t stopping = 0;
+
+/* Output: the capture file and the ring */
+static int capture_fd = -1;
+static uint8_t *capture_buffer;
+static size_t capture_used = 0;
+static uint64_t *ring_head;     /* records written, capacity, tick Hz */
+static uint8_t *ring_records;
+static uint64_t ring_capacity;
+
+/* Records decoded from one transfer, handed out together */
+#define BATCH_RECORDS 65536
+static Record batch[BATCH_RECORDS];
+static size_t batch_used = 0;
+
+/* Stream decoder, as decode_usb_packet in serial_plotter.py */
+static int snapshot_format = 0;
+static int framed = 0;
+static uint64_t epoch = 0;
+static uint64_t last_time = 0;
+static int epoch_unsure = 0;
+static uint32_t analog_period = 0;  /* ticks between BUS_ANALOG samples */
+static uint32_t overload_bits = 0;  /* quantum bits of the dense region the edges are in, 0 outside */
+static uint32_t pulse_channels = 0; /* bit n: channel n sends pulse records (pulse_record.h) */
+static uint32_t pulse_known = 0;    /* bit n: and its anchor is known */
+static uint64_t pulse_anchor[4];    /* end of the channel's last record */
+static uint32_t payload[MARKER_INFO_WORDS];
+static uint32_t payload_type, payload_words, payload_left = 0;
+static uint8_t word_part[4];
+static uint32_t word_part_used = 0;
+
+/* Frame reader, as FrameReader in serial_plotter.py */
+static uint8_t frame_pending[2 * FRAME_MAX + LA_TRANSFER_SIZE];
+static size_t frame_used = 0;
+static int frame_offset_known = 0;
+static uint32_t frame_offset = 0;
+static size_t frame_skipped = 0;
+static uint32_t crc_table[256];
+
+static int64_t now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+/**
+ * @brief Writes out the capture buffer with one write call
+ */
+static void capture_flush(void)
+{
+    size_t done = 0;
+    while (done < capture_used)
+    {
+        ssize_t n = write(capture_fd, capture_buffer + done, capture_used - done);
+        if (n < 0)
+        {
+            if (errno == EINTR) continue;
+            perror("capture write");
+            exit(1);
+        }
+        done += (size_t)n;
+    }
+    capture_used = 0;
+}
+
+static int capture_open(const char *path, const char *names)
+{
+    uint8_t header[CAPTURE_HEADER_SIZE] = {0};
+    uint16_t version = CAPTURE_VERSION, mode = CAPTURE_MODE_EVENTS;
+
+    capture_fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (capture_fd < 0) return -1;
+    if (posix_memalign((void **)&capture_buffer, 4096, CAPTURE_BUFFER)) return -1;
+
+    memcpy(header, "LACAPTUR", 8);
+    memcpy(header + 8, &version, 2);
+    memcpy(header + 10, &mode, 2);
+    /* tick_hz stays 0 until the 'V' reply */
+    for (int ch = 0; ch < 4 && names && *names; ch++)
+    {
+        size_t len = strcspn(names, ",");
+        memcpy(header + 20 + ch * CAPTURE_NAME_BYTES, names,
+               len < CAPTURE_NAME_BYTES ? len : CAPTURE_NAME_BYTES);
+        names += len + (names[len] == ',');
+    }
+    memcpy(capture_buffer, header, sizeof header);
+    capture_used = sizeof header;
+    capture_flush();  /* so the clock can be patched in place later */
+    return 0;
+}
+
+static void capture_set_tick_hz(double tick_hz)
+{
+    __atomic_store_n(&ring_head[2], (uint64_t)tick_hz, __ATOMIC_RELAXED);  /* for the plot */
+    if (pwrite(capture_fd, &tick_hz, sizeof tick_hz, CAPTURE_TICK_HZ_OFFSET) != sizeof tick_hz)
+    {
+        perror("capture header");
+    }
+}
+
+static int ring_attach(const char *name)
+{
+    char path[256];
+    snprintf(path, sizeof path, "/%s", name);  /* SharedMemory names drop the slash */
+    int fd = shm_open(path, O_RDWR, 0);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) != 0) return -1;
+    uint8_t *base = mmap(NULL, (size_t)st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (base == MAP_FAILED) return -1;
+    ring_head = (uint64_t *)base;
+    ring_capacity = ring_head[1];
+    ring_records = base + RING_HEADER_BYTES;
+    return 0;
+}
+
+/**
+ * @brief Hands the batch to the capture buffer and the ring; readers see
+ *        the ring records once the count is published
+ */
+static void batch_emit(void)
+{
+    size_t bytes = batch_used * sizeof(Record);
+    if (!batch_used) return;
+
+    if (capture_used + bytes > CAPTURE_BUFFER) capture_flush();
+    memcpy(capture_buffer + capture_used, batch, bytes);
+    capture_used += bytes;
+
+    const Record *records = batch;
+    size_t n = batch_used;
+    if (n > ring_capacity)
+    {
+        records += n - ring_capacity;
+        n = ring_capacity;
+    }
+    uint64_t written = __atomic_load_n(&ring_head[0], __ATOMIC_RELAXED);
+    size_t pos = written % ring_capacity;
+    size_t first = n < ring_capacity - pos ? n : ring_capacity - pos;
+    memcpy(ring_records + pos * sizeof(Record), records, first * sizeof(Record));
+    memcpy(ring_records, records + first, (n - first) * sizeof(Record));
+    __atomic_store_n(&ring_head[0], written + n, __ATOMIC_RELEASE);
+    batch_used = 0;
+}
+
+/**
+ * @brief Makes room for n records in the batch, so a note's records are
+ *        published together
+ */
+static void batch_room(size_t n)
+{
+    if (batch_used + n > BATCH_RECORDS) batch_emit();
+}
+
+static void emit(int64_t time, uint8_t channel, uint8_t value)
+{
+    batch_room(1);
+    batch[batch_used].time = time;
+    batch[batch_used].channel = channel;
+    batch[batch_used].value = value;
+    batch_used++;
+}
+
+/**
+ * @brief Emits a pulse's two edges, the leading one moved back past the
+ *        other channels' edges of the batch that came after it
+ */
+static void emit_pulse(int64_t start, int64_t end, uint8_t channel, uint8_t level)
+{
+    batch_room(2);
+    size_t at = batch_used;
+    while (at && batch[at - 1].time > start) at--;
+    memmove(&batch[at + 1], &batch[at], (batch_used - at) * sizeof(Record));
+    batch[at].time = start;
+    batch[at].channel = channel;
+    batch[at].value = level;
+    batch_used++;
+    emit(end, channel, level ^ 1);
+}
+
+/**
+ * @brief A pulse word's end is the first time with its low 16 bits after
+ *        the channel's anchor; without one the word is skipped until the
+ *        channel's next BUS_PULSE
+ */
+static void decode_pulse_word(uint32_t data)
+{
+    uint32_t ch = (data >> 29) & 0x3;
+    if (!(pulse_known & (1U << ch))) return;
+    uint64_t end = pulse_anchor[ch] + (((data & 0xFFFF) - pulse_anchor[ch]) & 0xFFFF);
+    pulse_anchor[ch] = end;
+    emit_pulse((int64_t)(end - ((data >> 16) & 0x1FFF)), (int64_t)end, ch, data >> 31);
+}
+
+static uint64_t extend_clock(uint32_t clock)
+{
+    return last_time + (int64_t)(int32_t)(clock - (uint32_t)last_time);
+}
+
+static void print_info(const uint32_t *words)
+{
+    printf("Firmware protocol v%u, %u Hz timestamps, capabilities: ", words[0], words[2]);
+    int any = 0;
+    for (unsigned bit = 0; bit < sizeof capability_names / sizeof capability_names[0]; bit++)
+    {
+        if (words[1] & (1UL << bit))
+        {
+            printf("%s%s", any ? ", " : "", capability_names[bit]);
+            any = 1;
+        }
+    }
+    printf("%s\n", any ? "" : "none");
+    printf("USB transmit queue high-water mark: %u\n", words[3]);
+    if (words[4])
+        printf("Glitch filter: %u pulses shorter than the minimum width dropped\n", words[4]);
+    fflush(stdout);
+    capture_set_tick_hz(words[2]);
+}
+
+static void decode_payload(void)
+{
+    if (payload_type == MARKER_INFO)
+    {
+        print_info(payload);
+    }
+    else if (payload_type == MARKER_SOF)
+    {
+        int64_t clock = (int64_t)extend_clock(payload[1]);
+        batch_room(3);
+        emit(payload[0], CHANNEL_SYNC_FRAME, 0);
+        emit(clock, CHANNEL_SYNC_CLOCK, 0);
+        emit(-1, CHANNEL_SYNC_HOST, 0);
+    }
+    else if (payload_type == MARKER_UART)
+    {
+        /* byte | status << 8 | channel << 16, decoded by the firmware */
+        uint32_t data = payload[1];
+        emit((int64_t)extend_clock(payload[0]),
+             CHANNEL_UART + (((data >> 6) & 0x0C) | ((data >> 16) & 0x03)), data & 0xFF);
+    }
+    else if (payload_type == MARKER_BUS)
+    {
+        /* byte | aux << 8 | flags << 16 | kind << 24, received by the firmware */
+        uint32_t data = payload[1];
+        int64_t clock = (int64_t)extend_clock(payload[0]);
+        uint8_t channel = CHANNEL_SPI + ((data >> 16) & SPI_FLAG_OVERRUN);
+        if (data >> 24 == BUS_I2C)
+        {
+            emit(clock, CHANNEL_I2C + (((data >> 7) & 0x06) | ((data >> 16) & 0x01)), data & 0xFF);
+            return;
+        }
+        if (data >> 24 == BUS_STORM)
+        {
+            batch_room(2);
+            emit(clock, CHANNEL_STORM, (data >> 16) & 0x0F);
+            emit(data & 0xFFFF, CHANNEL_STORM_COUNT, 0);
+            return;
+        }
+        if (data >> 24 == BUS_LEVELS)
+        {
+            emit(clock, CHANNEL_LEVEL_SNAPSHOT, (data & 0x0F) | ((data >> 4) & 0xF0));
+            return;
+        }
+        if (data >> 24 == BUS_ANALOG_PERIOD)
+        {
+            analog_period = data & 0xFFFFFF;
+            return;
+        }
+        if (data >> 24 == BUS_ANALOG)
+        {
+            /* two 12-bit samples, the second a period after the first */
+            batch_room(2);
+            emit(clock, CHANNEL_ANALOG + ((data >> 8) & 0x0F), data & 0xFF);
+            emit(clock + analog_period, CHANNEL_ANALOG + ((data >> 20) & 0x0F), (data >> 12) & 0xFF);
+            return;
+        }
+        if (data >> 24 == BUS_PULSE)
+        {
+            /* width | flags << 19 | channel << 22: sets the channel's anchor */
+            uint32_t ch = (data >> 22) & 0x3, flags = (data >> 19) & 0x7;
+            if (flags & PULSE_FLAG_OFF)
+            {
+                pulse_channels &= ~(1U << ch);
+                pulse_known &= ~(1U << ch);
+                return;
+            }
+            pulse_channels |= 1U << ch;
+            pulse_known |= 1U << ch;
+            pulse_anchor[ch] = (uint64_t)clock;
+            if (flags & PULSE_FLAG_EDGE) emit(clock, ch, flags & PULSE_FLAG_LEVEL);
+            else emit_pulse(clock - (data & PULSE_BUS_WIDTH), clock, ch, flags & PULSE_FLAG_LEVEL);
+            return;
+        }
+        if (data >> 24 == BUS_OVERLOAD)
+        {
+            /* the edge words after it pair up on a coarser clock, or no longer do */
+            uint32_t fill = 100 * ((data >> 8) & 0xFF) / 256;
+            overload_bits = (data >> 16) & OVERLOAD_ENTER ? data & 0xFF : 0;
+            if (overload_bits)
+            {
+                printf("WARNING: ring %u%% full at t=%lld: edges pair up on a %u-tick clock\n",
+                       fill, (long long)clock, 1U << overload_bits);
+            }
+            else
+            {
+                printf("Ring drained to %u%% at t=%lld: edges exact again\n", fill, (long long)clock);
+            }
+            fflush(stdout);
+            return;
+        }
+        if (data >> 24 != BUS_SPI) return;  /* BUS_STATS, BUS_MEASURE, BUS_HEALTH: serial_plotter.py shows them */
+        batch_room(2);
+        emit(clock, channel, data & 0xFF);
+        if ((data >> 16) & SPI_FLAG_MISO) emit(clock, channel + 1, (data >> 8) & 0xFF);
+    }
+    else if (payload_type == MARKER_TRIGGER)
+    {
+        uint64_t clock = extend_clock(payload[0]);
+        emit((int64_t)clock, CHANNEL_TRIGGER, 0);
+        printf("Trigger fired at t=%llu\n", (unsigned long long)clock);
+        fflush(stdout);
+    }
+    else
+    {
+        uint64_t start = extend_clock(payload[1]);
+        uint64_t end = extend_clock(payload[2]);
+        if (payload_type == MARKER_WINDOW)
+        {
+            /* the pre-trigger window starts: earlier events were discarded */
+            if (payload[0])
+            {
+                printf("Trigger window: %u earlier events discarded between t=%llu and t=%llu\n",
+                       payload[0], (unsigned long long)start, (unsigned long long)end);
+            }
+        }
+        else
+        {
+            batch_room(3);
+            emit((int64_t)start, CHANNEL_DROP_START, 0);
+            emit((int64_t)end, CHANNEL_DROP_END, 0);
+            emit(payload[0], CHANNEL_DROP_COUNT, 0);
+            printf("WARNING: %u events lost between t=%llu and t=%llu\n", payload[0],
+                   (unsigned long long)start, (unsigned long long)end);
+        }
+        fflush(stdout);
+        /* an epoch marker may have been lost with the events, and the
+           records pulse words count from */
+        epoch = end >> (snapshot_format ? SNAPSHOT_TIME_BITS : EDGE_TIME_BITS);
+        last_time = end;
+        pulse_known = 0;
+    }
+}
+
+static void start_payload(uint32_t type)
+{
+    payload_type = type;
+    payload_words = type == MARKER_DROP ? MARKER_DROP_WORDS :
+                    type == MARKER_INFO ? MARKER_INFO_WORDS :
+                    type == MARKER_SOF ? MARKER_SOF_WORDS :
+                    type == MARKER_UART ? MARKER_UART_WORDS :
+                    type == MARKER_WINDOW ? MARKER_WINDOW_WORDS :
+                    type == MARKER_TRIGGER ? MARKER_TRIGGER_WORDS : MARKER_BUS_WORDS;
+    payload_left = payload_words;
+}
+
+/**
+ * @brief Places a word's time on the 64-bit timeline; a step back by more
+ *        than half the time field is a wrap whose epoch marker was lost
+ */
+static uint64_t unwrap_time(uint32_t raw_time, int bits)
+{
+    uint64_t time = (epoch << bits) | raw_time;
+    if (time + (1ULL << (bits - 1)) < last_time)
+    {
+        epoch++;
+        time += 1ULL << bits;
+    }
+    return time;
+}
+
+static void decode_word(uint32_t data)
+{
+    if (payload_left)
+    {
+        payload[payload_words - payload_left] = data;
+        if (--payload_left == 0) decode_payload();
+        return;
+    }
+
+    if (snapshot_format)
+    {
+        uint32_t levels = (data >> 28) & 0xF;
+        uint32_t changed = (data >> 24) & 0xF;
+        uint32_t raw_time = data & ((1UL << SNAPSHOT_TIME_BITS) - 1);
+        if (changed == 0)
+        {
+            if (levels == MARKER_EPOCH) epoch = raw_time;
+            else if (levels <= MARKER_BUS) start_payload(levels);
+            return;
+        }
+        last_time = unwrap_time(raw_time, SNAPSHOT_TIME_BITS);
+        for (int ch = 0; ch < 4; ch++)
+        {
+            if (changed & (1U << ch)) emit((int64_t)last_time, ch, (levels >> ch) & 1);
+        }
+        return;
+    }
+
+    uint32_t raw_time = data & ((1UL << EDGE_TIME_BITS) - 1);
+    if (raw_time == (1UL << EDGE_TIME_BITS) - 1)
+    {
+        uint32_t type = data >> 29;
+        if (type == MARKER_EPOCH) epoch++;
+        else start_payload(type);  /* every other type has a payload */
+        return;
+    }
+    if (pulse_channels & (1U << ((data >> 29) & 0x3)))
+    {
+        decode_pulse_word(data);
+        return;
+    }
+    if (epoch_unsure)
+    {
+        /* a short loss spans at most one wrap */
+        epoch_unsure = 0;
+        if (((epoch << EDGE_TIME_BITS) | raw_time) < last_time) epoch++;
+    }
+    last_time = unwrap_time(raw_time, EDGE_TIME_BITS);
+    if (overload_bits)
+    {
+        /* a dense word: one edge at its time step, maybe a second the
+           steps in its low bits after it */
+        uint64_t step = last_time & ~((1ULL << overload_bits) - 1);
+        batch_room(2);
+        emit((int64_t)step, (data >> 29) & 0x3, data >> 31);
+        if ((data >> (overload_bits - 1)) & 1)
+        {
+            uint64_t after = data & ((1UL << (overload_bits - 4)) - 1);
+            emit((int64_t)(step + (after << overload_bits)), (data >> (overload_bits - 4)) & 0x3,
+                 (data >> (overload_bits - 2)) & 1);
+        }
+        return;
+    }
+    emit((int64_t)last_time, (data >> 29) & 0x3, data >> 31);
+}
+
+/**
+ * @brief Decodes whole words of an unframed stream or a frame payload;
+ *        a partial last word waits for the next call
+ */
+static void decode_bytes(const uint8_t *data, size_t length)
+{
+    uint32_t word;
+    while (word_part_used && length)
+    {
+        word_part[word_part_used++] = *data++;
+        length--;
+        if (word_part_used == 4)
+        {
+            memcpy(&word, word_part, 4);
+            decode_word(word);
+            word_part_used = 0;
+        }
+    }
+    for (; length >= 4; data += 4, length -= 4)
+    {
+        memcpy(&word, data, 4);
+        decode_word(word);
+    }
+    while (length--) word_part[word_part_used++] = *data++;
+}
+
+static void lost_sync(void)
+{
+    payload_left = 0;
+    epoch_unsure = 1;
+    pulse_known = 0;
+}
+
+static void crc_init(void)
+{
+    for (uint32_t byte = 0; byte < 256; byte++)
+    {
+        uint32_t crc = byte << 24;
+        for (int i = 0; i < 8; i++) crc = crc & 0x80000000 ? (crc << 1) ^ 0x04C11DB7 : crc << 1;
+        crc_table[byte] = crc;
+    }
+}
+
+/* CRC-32 as the F103 CRC unit computes it over little-endian words */
+static uint32_t crc_words(uint32_t crc, const uint8_t *data, size_t length)
+{
+    for (size_t i = 0; i < length; i += 4)
+    {
+        for (int b = 3; b >= 0; b--)
+        {
+            uint8_t byte = i + b < length ? data[i + b] : 0;  /* zero-padded last word */
+            crc = (crc << 8) ^ crc_table[(crc >> 24) ^ byte];
+        }
+    }
+    return crc;
+}
+
+static void frame_resync(void)
+{
+    size_t at = 1;
+    while (at + 1 < frame_used &&
+           !(frame_pending[at] == (FRAME_SYNC & 0xFF) && frame_pending[at + 1] == FRAME_SYNC >> 8))
+    {
+        at++;
+    }
+    if (at + 1 >= frame_used) at = frame_used - 1;
+    memmove(frame_pending, frame_pending + at, frame_used - at);
+    frame_used -= at;
+    frame_skipped += at;
+}
+
+static void frame_feed(const uint8_t *data, size_t length)
+{
+    memcpy(frame_pending + frame_used, data, length);
+    frame_used += length;
+    size_t done = 0;
+
+    while (frame_used - done >= FRAME_HEADER)
+    {
+        const uint8_t *frame = frame_pending + done;
+        uint16_t sync, size;
+        uint32_t offset, crc;
+        memcpy(&sync, frame, 2);
+        memcpy(&size, frame + 2, 2);
+        memcpy(&offset, frame + 4, 4);
+        memcpy(&crc, frame + 8, 4);
+        if (sync != FRAME_SYNC || size % 4 ||
+            (frame_used - done >= (size_t)FRAME_HEADER + size &&
+             crc_words(crc_words(0xFFFFFFFF, frame, 8), frame + FRAME_HEADER, size) != crc))
+        {
+            memmove(frame_pending, frame, frame_used - done);
+            frame_used -= done;
+            done = 0;
+            frame_resync();
+            continue;
+        }
+        if (frame_used - done < (size_t)FRAME_HEADER + size) break;
+        if (frame_skipped)
+        {
+            printf("WARNING: skipped %zu corrupt stream bytes\n", frame_skipped);
+            frame_skipped = 0;
+            lost_sync();
+        }
+        if (frame_offset_known && offset != frame_offset)
+        {
+            printf("WARNING: %u stream bytes lost before offset %u\n", offset - frame_offset, offset);
+            lost_sync();
+        }
+        frame_offset_known = 1;
+        frame_offset = offset + size;
+        word_part_used = 0;
+        decode_bytes(frame + FRAME_HEADER, size);
+        done += FRAME_HEADER + size;
+    }
+    memmove(frame_pending, frame_pending + done, frame_used - done);
+    frame_used -= done;
+}
+
+static void LIBUSB_CALL transfer_done(struct libusb_transfer *transfer)
+{
+    if (transfer->status == LIBUSB_TRANSFER_COMPLETED ||
+        transfer->status == LIBUSB_TRANSFER_TIMED_OUT)
+    {
+        if (framed) frame_feed(transfer->buffer, transfer->actual_length);
+        else decode_bytes(transfer->buffer, transfer->actual_length);
+        batch_emit();
+    }
+    if (transfer->status == LIBUSB_TRANSFER_NO_DEVICE)
+    {
+        fprintf(stderr, "la_ingest: device gone\n");
+        stopping = 1;
+    }
+    if (stopping || transfer->status == LIBUSB_TRANSFER_CANCELLED ||
+        libusb_submit_transfer(transfer) != 0)
+    {
+        transfer->user_data = NULL;  /* no longer queued */
+    }
+}
+
+static void on_signal(int sig)
+{
+    (void)sig;
+    stopping = 1;
+}
+
+/**
+ * @brief Waits for the StreamHeader that opens the stream after 'M' and
+ *        takes the format from it over -f and -s, then decodes the bytes
+ *        behind it. Without one in LA_HEADER_NS (firmware before
+ *        protocol v5) the options stand and what was read is dropped
+ * @retval 0, or -1 for a stream this helper cannot decode
+ */
+static int read_stream_header(libusb_device_handle *dev)
+{
+    static uint8_t data[LA_TRANSFER_SIZE + STREAM_HEADER_SIZE];
+    size_t used = 0;
+    int64_t deadline = now_ns() + LA_HEADER_NS;
+
+    while (now_ns() < deadline)
+    {
+        int got = 0;
+        libusb_bulk_transfer(dev, LA_IN_EP, data + used, LA_TRANSFER_SIZE, &got, 10);
+        used += got;
+        for (size_t at = 0; at + STREAM_HEADER_SIZE <= used; at++)
+        {
+            uint32_t words[STREAM_HEADER_SIZE / 4];
+            memcpy(words, data + at, sizeof words);
+            if (words[0] != STREAM_HEADER_MAGIC ||
+                words[5] != ~(words[0] ^ words[1] ^ words[2] ^ words[3] ^ words[4]))
+                continue;
+
+            const uint8_t *header = data + at;
+            size_t size = header[5] > STREAM_HEADER_SIZE ? header[5] : STREAM_HEADER_SIZE;
+            if (header[7] != STREAM_COMPRESSION_NONE)
+            {
+                fprintf(stderr, "la_ingest: compressed stream, use the Python ingest\n");
+                return -1;
+            }
+            snapshot_format = header[6] == STREAM_ENCODING_SNAPSHOT;
+            framed = (header[9] & STREAM_FLAG_FRAMED) != 0;
+            printf("Stream header v%u (protocol v%u): %s events, %u channels, %u Hz%s\n",
+                   header[4], header[11], snapshot_format ? "snapshot" : "edge", header[8],
+                   words[3], framed ? ", framed" : "");
+            fflush(stdout);
+            capture_set_tick_hz(words[3]);
+            if (at + size < used)
+            {
+                if (framed) frame_feed(data + at + size, used - at - size);
+                else decode_bytes(data + at + size, used - at - size);
+                batch_emit();
+            }
+            return 0;
+        }
+        if (used >= STREAM_HEADER_SIZE)  /* keep what may start a header */
+        {
+            memmove(data, data + used - (STREAM_HEADER_SIZE - 1), STREAM_HEADER_SIZE - 1);
+            used = STREAM_HEADER_SIZE - 1;
+        }
+    }
+    fprintf(stderr, "la_ingest: no stream header, decoding as the options say\n");
+    return 0;
+}
+
+static uint8_t find_out_endpoint(libusb_device_handle *dev)
+{
+    struct libusb_config_descriptor *config;
+    uint8_t out = 0x01;
+    if (libusb_get_active_config_descriptor(libusb_get_device(dev), &config) == 0)
+    {
+        const struct libusb_interface_descriptor *intf = &config->interface[0].altsetting[0];
+        for (int i = 0; i < intf->bNumEndpoints; i++)
+        {
+            if (!(intf->endpoint[i].bEndpointAddress & 0x80)) out = intf->endpoint[i].bEndpointAddress;
+        }
+        if (intf->bNumEndpoints > 2) out = 0;  /* USB_STRIPE_EPS: the stream is striped */
+        libusb_free_config_descriptor(config);
+    }
+    return out;
+}
+
+static void send_command(libusb_device_handle *dev, uint8_t ep, const void *data, int length)
+{
+    int sent;
+    if (libusb_bulk_transfer(dev, ep, (unsigned char *)data, length, &sent, 1000) != 0)
+    {
+        fprintf(stderr, "la_ingest: command not sent\n");
+    }
+}
+
+int main(int argc, char **argv)
+{
+    const char *names = NULL;
+    unsigned flush_mode = 1, flush_batch = 16, flush_latency_us = 2000;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "fsn:F:")) != -1)
+    {
+        switch (opt)
+        {
+        case 'f': framed = 1; break;
+        case 's': snapshot_format = 1; break;
+        case 'n': names = optarg; break;
+        case 'F':
+            if (sscanf(optarg, "%u,%u,%u", &flush_mode, &flush_batch, &flush_latency_us) != 3)
+            {
+                fprintf(stderr, "la_ingest: -F takes mode,batch,latency_us\n");
+                return 2;
+            }
+            break;
+        default:
+            return 2;
+        }
+    }
+    if (argc - optind != 2)
+    {
+        fprintf(stderr, "Usage: la_ingest <ring name> <capture path> [-f] [-s] [-n names] [-F mode,batch,us]\n");
+        return 2;
+    }
+    if (ring_attach(argv[optind]) != 0)
+    {
+        perror("la_ingest: ring");
+        return 1;
+    }
+    if (capture_open(argv[optind + 1], names) != 0)
+    {
+        perror("la_ingest: capture");
+        return 1;
+    }
+    crc_init();
+
+    libusb_context *ctx;
+    libusb_device_handle *dev;
+    if (libusb_init(&ctx) != 0) return 1;
+    dev = libusb_open_device_with_vid_pid(ctx, LA_VENDOR_ID, LA_PRODUCT_ID);
+    if (!dev) dev = libusb_open_device_with_vid_pid(ctx, LA_VENDOR_ID, LA_CONTROL_PRODUCT_ID);
+    if (!dev || libusb_claim_interface(dev, 0) != 0)
+    {
+        fprintf(stderr, "la_ingest: logic analyzer (bulk build) not found\n");
+        return 1;
+    }
+    uint8_t out_ep = find_out_endpoint(dev);
+    if (!out_ep)
+    {
+        fprintf(stderr, "la_ingest: a striped (USB_STRIPE_EPS) build needs the Python ingest\n");
+        return 1;
+    }
+
+    /* 'M' 0: edge engine, whose stream restarts behind a stream header */
+    uint8_t mode[2] = {'M', 0};
+    send_command(dev, out_ep, mode, sizeof mode);
+    if (read_stream_header(dev) != 0) return 1;
+    /* 'F' mode(1) batch(2) latency_us(4), then 'V' */
+    uint8_t flush[8] = {'F', (uint8_t)flush_mode};
+    uint16_t batch16 = (uint16_t)flush_batch;
+    uint32_t latency32 = flush_latency_us;
+    memcpy(flush + 2, &batch16, 2);
+    memcpy(flush + 4, &latency32, 4);
+    send_command(dev, out_ep, flush, sizeof flush);
+    send_command(dev, out_ep, "V", 1);
+
+    signal(SIGINT, on_signal);
+    signal(SIGTERM, on_signal);
+
+    struct libusb_transfer *transfers[LA_TRANSFERS];
+    static uint8_t buffers[LA_TRANSFERS][LA_TRANSFER_SIZE];
+    for (int i = 0; i < LA_TRANSFERS; i++)
+    {
+        transfers[i] = libusb_alloc_transfer(0);
+        libusb_fill_bulk_transfer(transfers[i], dev, LA_IN_EP, buffers[i], LA_TRANSFER_SIZE,
+                                  transfer_done, transfers[i], 0);
+        if (libusb_submit_transfer(transfers[i]) != 0) transfers[i]->user_data = NULL;
+    }
+
+    int64_t last_flush = now_ns();
+    while (!stopping)
+    {
+        struct timeval tv = {0, 100000};
+        libusb_handle_events_timeout_completed(ctx, &tv, NULL);
+        if (now_ns() - last_flush >= LA_FLUSH_NS)
+        {
+            capture_flush();
+            last_flush = now_ns();
+        }
+    }
+
+    for (int i = 0; i < LA_TRANSFERS; i++)
+    {
+        if (transfers[i]->user_data) libusb_cancel_transfer(transfers[i]);
+    }
+    for (int pending = 1; pending;)
+    {
+        struct timeval tv = {0, 100000};
+        libusb_handle_events_timeout_completed(ctx, &tv, NULL);
+        pending = 0;
+        for (int i = 0; i < LA_TRANSFERS; i++) pending |= transfers[i]->user_data != NULL;
+    }
+    for (int i = 0; i < LA_TRANSFERS; i++) libusb_free_transfer(transfers[i]);
+    capture_flush();
+    close(capture_fd);
+    libusb_release_interface(dev, 0);
+    libusb_close(dev);
+    libusb_exit(ctx);
+    return 0;
+}
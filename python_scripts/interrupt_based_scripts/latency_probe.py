@@ -0,0 +1,157 @@
+"""Times an edge from the probe pin to the plot, stage by stage, with a
+LATENCY_PROBE_MS firmware and a wire from PA0 to a probe channel.
+
+Every LATENCY_PROBE_MS the firmware toggles PA0 and stamps the toggle
+(a BUS_LATENCY record). The probe channel captures the edge like any
+other, and once the USB transfer carrying its word has completed a
+second record stamps that. The ingest process notes when it read and
+decoded the edge, the plot process when the edge reached a frame and
+when the canvas finished drawing it. The stages:
+  pin        toggle to the edge's timestamp: EXTI entry
+  ring+usb   timestamp to the transfer's completion: the ring, the
+             flush interval and the transfer
+  host read  completion to the read that returned the edge: driver,
+             tty and the reader's wakeup
+  decode     the read to the decoded edge
+  to plot    decoded to the frame that took it: pipeline, shared ring
+             and the animation interval
+  render     the frame to the end of the canvas draw
+End to end is the sum of them. host read and end to end need the SOF
+fit (clock_sync.py, SOF_SYNC_FRAMES firmware) to place the completion
+on the host clock. The fit counts the link's fastest delivery of a SOF
+pair as none, so they come out low by that much.
+
+The edges are matched by time between the processes: CHANNEL_SKEW_NS
+must leave the probe channel alone."""
+import queue
+import time
+from collections import defaultdict
+
+import numpy as np
+
+STAGES = ("pin", "ring+usb", "host read", "decode", "to plot", "render", "end to end")
+MAX_PENDING = 64  # toggles or edges waiting for the rest of their sample
+
+
+class LatencyProbe:
+    """Ingest side: pairs each toggle with the probe channel's edge and
+    the transfer that carried it, and puts each pair on out as (edge
+    time, {stage: seconds}, host time of the toggle or None)"""
+
+    def __init__(self, channel, out):
+        self.channel = channel
+        self.out = out
+        self.pending = {}  # toggle number: {"toggle", "edge", "read", "decoded", "sent", "host"}
+
+    def toggle(self, seq, clock):
+        if len(self.pending) >= MAX_PENDING:
+            self.pending.pop(next(iter(self.pending)))  # its edge was lost
+        self.pending.pop(seq, None)  # the 8-bit number came round
+        self.pending[seq] = {"toggle": clock, "edge": None}
+
+    def edges(self, channels, times, read_at, decoded_at):
+        """A decoded batch: each toggle still waiting takes the probe
+        channel's first edge after it and before the next toggle"""
+        probe = times[channels == self.channel].tolist()
+        entries = list(self.pending.items())
+        for i, (seq, entry) in enumerate(entries):
+            if entry["edge"] is not None:
+                continue
+            before = entries[i + 1][1]["toggle"] if i + 1 < len(entries) else None
+            edge = next((t for t in probe if t >= entry["toggle"] and (before is None or t < before)), None)
+            if edge is None:
+                continue
+            entry.update(edge=edge, read=read_at, decoded=decoded_at)
+            if "sent" in entry:
+                self._complete(seq)
+
+    def sent(self, seq, clock, host_at, tick_hz):
+        """The transfer with toggle seq's edge completed at clock, host_at
+        on the host clock (None without the SOF fit)"""
+        entry = self.pending.get(seq)
+        if entry is None or not tick_hz:
+            return
+        entry.update(sent=clock, host=host_at, tick_hz=tick_hz)
+        if entry["edge"] is not None:
+            self._complete(seq)
+
+    def _complete(self, seq):
+        entry = self.pending.pop(seq)
+        tick_hz = entry["tick_hz"]
+        stages = {"pin": (entry["edge"] - entry["toggle"]) / tick_hz,
+                  "ring+usb": (entry["sent"] - entry["edge"]) / tick_hz,
+                  "decode": entry["decoded"] - entry["read"]}
+        origin = None
+        if entry["host"] is not None:
+            stages["host read"] = entry["read"] - entry["host"]
+            origin = entry["host"] - (entry["sent"] - entry["toggle"]) / tick_hz
+        self.out.put((entry["edge"], stages, entry["decoded"], origin))
+
+
+class LatencyReport:
+    """Plot side: notes when the probe channel's edges reach a frame and
+    when the canvas has drawn them, joins them to the ingest's stages
+    and prints each stage's p50 and p99 every every_s"""
+
+    def __init__(self, channel, samples, every_s):
+        self.channel = channel
+        self.samples = samples
+        self.every_s = every_s
+        self.framed = {}  # edge time: [frame time, drawn time or None]
+        self.undrawn = []  # edge times of frames the canvas has not drawn yet
+        self.ingested = {}  # edge time: (stages, decoded at, toggle's host time)
+        self.stages = defaultdict(list)  # stage: seconds of each sample since the last print
+        self.last = time.monotonic()
+
+    def frame(self, records):
+        """A frame took records from the shared ring"""
+        now = time.perf_counter()
+        for edge in records['time'][records['channel'] == self.channel].tolist():
+            self.framed[edge] = [now, None]
+            self.undrawn.append(edge)
+        while len(self.framed) > MAX_PENDING:
+            self.framed.pop(next(iter(self.framed)))
+
+    def drawn(self, event=None):
+        """The canvas finished a draw (its draw_event)"""
+        now = time.perf_counter()
+        for edge in self.undrawn:
+            if edge in self.framed:
+                self.framed[edge][1] = now
+        self.undrawn.clear()
+        self._join()
+        if time.monotonic() - self.last >= self.every_s:
+            self.report()
+
+    def _join(self):
+        while True:
+            try:
+                edge, stages, decoded_at, origin = self.samples.get_nowait()
+            except queue.Empty:
+                break
+            self.ingested[edge] = stages, decoded_at, origin
+        for edge in list(self.ingested):
+            if edge not in self.framed or self.framed[edge][1] is None:
+                continue
+            stages, decoded_at, origin = self.ingested.pop(edge)
+            framed_at, drawn_at = self.framed.pop(edge)
+            stages = dict(stages, **{"to plot": framed_at - decoded_at, "render": drawn_at - framed_at})
+            if origin is not None:
+                stages["end to end"] = drawn_at - origin
+            for name, seconds in stages.items():
+                self.stages[name].append(seconds)
+        while len(self.ingested) > MAX_PENDING:
+            self.ingested.pop(next(iter(self.ingested)))
+
+    def report(self):
+        self.last = time.monotonic()
+        if not self.stages:
+            print("Latency: no probe edges drawn yet; is PA0 wired to the probe channel?")
+            return
+        parts = []
+        for name in STAGES:
+            if self.stages[name]:
+                p50, p99 = np.percentile(self.stages[name], (50, 99)) * 1e3
+                parts.append(f"{name} {p50:.2f}/{p99:.2f}")
+        print(f"Latency ms p50/p99 over {len(self.stages['render'])} edges: " + " | ".join(parts))
+        self.stages.clear()
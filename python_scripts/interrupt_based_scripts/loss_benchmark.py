@@ -0,0 +1,189 @@
+"""Finds the stimulus rate at which the interrupt analyzer starts losing
+data. For each rate of the sweep, arduino_serial_tester.ino is rebuilt
+with arduino-cli to send that rate with a seeded xorshift32 payload and
+uploaded to the stimulus board. Then the analyzer captures for
+CAPTURE_S through serial_plotter.ingest, into loss-<rate>.lacap.
+Each capture is decoded with the decoder core and compared with the
+payload the sketch sent.
+
+One table row per rate:
+  bytes       payload bytes the capture spans, after aligning it on
+              the payload (ANCHOR_BYTES in a row that match)
+  errors      bytes decoded wrong, not decoded or decoded extra
+  edges       edges in the capture; lost: events the firmware reported
+              dropped, as a share of both
+  good B/s    payload bytes decoded right per second of capture
+With PROTOCOL 'edges' the sketch sends pulse trains and the rate is
+bursts per second: bytes and errors count the pulses expected and
+missing. The rows also go to loss_benchmark.csv, so runs of two firmware
+builds can be compared on one curve."""
+import csv
+import difflib
+import multiprocessing
+import os
+import shutil
+import subprocess
+import tempfile
+import time
+
+import numpy as np
+
+import common_path  # puts python_scripts/common on sys.path
+import serial_plotter
+from capture_file import CaptureFile
+from decoder_core import decode, load_index
+from shm_ring import SharedRing
+
+SKETCH = os.path.join(os.path.dirname(os.path.abspath(__file__)), '..', '..',
+                      'arduino_testing_scripts', 'arduino_serial_tester.ino')
+ARDUINO_PORT = '/dev/tty.usbmodem14101'  # stimulus board; change to its port
+ARDUINO_FQBN = 'arduino:avr:uno'
+# 'uart', 'spi', 'i2c' (needs a device that ACKs the sketch's I2C_ADDRESS) or 'edges'
+PROTOCOL = 'uart'
+RATES = (9600, 57600, 115200, 250000, 500000, 1000000)  # baud, SCK or SCL Hz; 'edges': bursts/s
+BURST_BYTES = 64  # bytes, or pulses, per burst
+GAP_US = 0        # from the start of one burst to the next, 0 = back to back
+SEED = 0x2545F491
+CAPTURE_S = 10.0
+SETTLE_S = 3.0    # upload, reset and bootloader before the capture starts
+FLUSH_POLICY = (serial_plotter.FLUSH_MODES["BATCH"], 16, 2000)
+ANCHOR_BYTES = 8
+# analyzer channel index -> line, as wired to the stimulus board
+WIRING = {'uart': {0: 'TX'}, 'spi': {0: 'SCK', 1: 'MOSI', 2: 'SS'},
+          'i2c': {0: 'SCL', 1: 'SDA'}, 'edges': {0: 'EDGE'}}
+COMM_TYPES = {'i2c': 0, 'spi': 1, 'uart': 2, 'edges': 3}  # the sketch's COMM_*
+
+def upload_stimulus(rate):
+    """Builds the sketch for one rate of the sweep and uploads it"""
+    flags = {'COMM_TYPE': COMM_TYPES[PROTOCOL], 'BURST_BYTES': BURST_BYTES,
+             'PAYLOAD_SEED': f'{SEED}UL'}
+    if PROTOCOL == 'edges':
+        flags['GAP_US'] = f'{round(1e6 / rate)}UL'
+    else:
+        flags['BIT_RATE'] = f'{rate}UL'
+        flags['GAP_US'] = f'{GAP_US}UL'
+    upload_sketch(flags)
+
+def upload_sketch(flags):
+    """Builds the sketch with flags as -D defines and uploads it"""
+    with tempfile.TemporaryDirectory() as tmp:
+        sketch_dir = os.path.join(tmp, 'arduino_serial_tester')  # arduino-cli wants the names to match
+        os.mkdir(sketch_dir)
+        shutil.copy(SKETCH, sketch_dir)
+        subprocess.run(['arduino-cli', 'compile', '--upload', '--port', ARDUINO_PORT,
+                        '--fqbn', ARDUINO_FQBN, '--build-property',
+                        'compiler.cpp.extra_flags=' + ' '.join(f'-D{k}={v}' for k, v in flags.items()),
+                        sketch_dir], check=True, capture_output=True)
+
+def capture(path, mapping):
+    """Records CAPTURE_S of the analyzer's edge stream to path"""
+    ring = SharedRing()
+    stop = multiprocessing.Event()
+    reader = multiprocessing.Process(target=serial_plotter.ingest,
+                                     args=(ring.name, mapping, FLUSH_POLICY, stop))
+    reader.start()
+    time.sleep(CAPTURE_S)
+    stop.set()
+    reader.join()
+    ring.close()
+    os.replace("bitlog.lacap", path)
+
+def payload(count):
+    """The first count payload bytes: low bytes of xorshift32 from SEED"""
+    out = np.empty(count, dtype=np.int16)
+    x = SEED
+    for i in range(count):
+        x ^= (x << 13) & 0xFFFFFFFF
+        x ^= x >> 17
+        x ^= (x << 5) & 0xFFFFFFFF
+        out[i] = x & 0xFF
+    return out
+
+def decoded_bytes(index, rate):
+    """Payload bytes of a capture in stream order, -1 for one that did
+    not decode cleanly"""
+    if PROTOCOL == 'uart':
+        events = decode(index, 'uart', channel='TX', bit_time=index.tick_hz / rate)
+        return [event[2] if event[0] == 'byte' and event[3] and event[4] == 1 else -1
+                for event in events]
+    if PROTOCOL == 'spi':
+        events = decode(index, 'spi', clk='SCK', mosi='MOSI', miso='MOSI', ss='SS')
+        return [event[2] if event[0] == 'byte' else -1 for event in events]
+    events = decode(index, 'i2c', scl='SCL', sda='SDA')
+    return [event[2] if event[0] == 'data' else -1 for event in events if event[0] in ('data', 'lost')]
+
+def byte_errors(got, want):
+    """(bytes of want the capture spans, bytes wrong, missing or extra).
+    Runs of ANCHOR_BYTES that match the payload pin the capture to it;
+    between two of them the bytes are matched with difflib"""
+    heads = {}
+    for p in range(len(want) - ANCHOR_BYTES + 1):
+        heads.setdefault(want[p:p + ANCHOR_BYTES].tobytes(), p)
+    anchors = []
+    i = 0
+    while i <= len(got) - ANCHOR_BYTES:
+        p = heads.get(got[i:i + ANCHOR_BYTES].tobytes())
+        if p is not None and (not anchors or p > anchors[-1][1]):
+            anchors.append((i, p))
+            i += ANCHOR_BYTES
+        else:
+            i += 1
+    if not anchors:
+        return 0, 0
+    errors = 0
+    for (i0, p0), (i1, p1) in zip(anchors, anchors[1:]):
+        a, b = got[i0:i1].tolist(), want[p0:p1].tolist()
+        matched = sum(block.size for block in
+                      difflib.SequenceMatcher(None, a, b, autojunk=False).get_matching_blocks())
+        errors += max(len(a), len(b)) - matched
+    return anchors[-1][1] + ANCHOR_BYTES - anchors[0][1], errors
+
+def measure(path, rate):
+    """One row of the table from a capture"""
+    capture_file = CaptureFile(path)
+    records = capture_file.records
+    edge_times = records['time'][records['channel'] < 4]
+    edges = len(edge_times)
+    lost = sum(count for count, _, _ in capture_file.drops())
+    seconds = (int(edge_times[-1]) - int(edge_times[0])) / capture_file.tick_hz if edges > 1 else 0.0
+
+    if PROTOCOL == 'edges':
+        expected = round(seconds * rate) * BURST_BYTES
+        sent, errors = expected, max(expected - edges // 2, 0)
+    else:
+        index = load_index(path)
+        got = np.array(decoded_bytes(index, rate), dtype=np.int16)
+        bursts_per_s = 1e6 / GAP_US if GAP_US else rate / 8 / BURST_BYTES  # at most
+        want = payload(int((SETTLE_S + CAPTURE_S + 5) * bursts_per_s + 1) * BURST_BYTES)
+        sent, errors = byte_errors(got, want)
+    return {'rate': rate, 'bytes': sent, 'errors': errors,
+            'error %': 100.0 * errors / sent if sent else 0.0,
+            'edges': edges, 'lost': lost,
+            'loss %': 100.0 * lost / (edges + lost) if edges + lost else 0.0,
+            'edges/s': edges / seconds if seconds else 0.0,
+            'good B/s': (sent - errors) / seconds if seconds and PROTOCOL != 'edges' else 0.0}
+
+def main():
+    mapping = WIRING[PROTOCOL]
+    rows = []
+    print(f"{'rate':>10} {'bytes':>9} {'errors':>8} {'error %':>8} {'edges':>10} {'lost':>8} "
+          f"{'loss %':>7} {'edges/s':>10} {'good B/s':>10}")
+    for rate in RATES:
+        upload_stimulus(rate)
+        time.sleep(SETTLE_S)
+        path = f"loss-{rate}.lacap"
+        capture(path, mapping)
+        row = measure(path, rate)
+        rows.append(row)
+        print(f"{rate:>10} {row['bytes']:>9} {row['errors']:>8} {row['error %']:>8.3f} "
+              f"{row['edges']:>10} {row['lost']:>8} {row['loss %']:>7.3f} "
+              f"{row['edges/s']:>10.0f} {row['good B/s']:>10.0f}")
+
+    with open("loss_benchmark.csv", "w", newline='') as f:
+        writer = csv.DictWriter(f, fieldnames=list(rows[0]))
+        writer.writeheader()
+        writer.writerows(rows)
+    print("Results written to loss_benchmark.csv")
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,180 @@
+"""Headless capture from a rack of analyzers in one process: every
+device's port is read by one asyncio event loop as it becomes readable,
+instead of a blocking ingest process per device.
+
+  python multi_ingest.py --device /dev/ttyACM0 RX,TX --device /dev/ttyACM1 SDA,SCL --out board{n}.lacap
+
+Each device gets its own copy of serial_plotter.py's decoder (the
+module is loaded once per device, so each has its own stream state),
+its own SharedRing and its own pipeline: the capture file --out with
+{n} replaced by the device's index, and the live sinks serial_plotter.py
+has on. The ring names are printed; a plot or any other reader can
+attach to them while the capture runs.
+
+The ports are set non-blocking after the settings went out, and the
+loop wakes on whichever are readable; one wakeup drains what every
+ready port holds and decodes it in batches, so the host's work follows
+the bytes that came, not the number of devices. Only serial ports work:
+a BULK_USB or ISO_USB analyzer has no file descriptor to wait on. A
+device that goes away is closed and the others keep running; Ctrl-C
+closes them all."""
+import argparse
+import asyncio
+import importlib.util
+import os
+import signal
+import time
+
+os.environ.setdefault("MPLBACKEND", "Agg")  # serial_plotter imports pyplot; no window is opened
+
+import serial
+
+import common_path  # puts python_scripts/common on sys.path
+import serial_plotter as plotter
+from pipeline import Pipeline
+from shm_ring import SharedRing
+
+STATS_EVERY_S = 5.0  # per-device rate lines this often, 0 = never
+
+
+def load_decoder(index):
+    """A copy of serial_plotter with module state of its own"""
+    spec = importlib.util.spec_from_file_location(f"serial_plotter_{index}", plotter.__file__)
+    module = importlib.util.module_from_spec(spec)
+    spec.loader.exec_module(module)
+    return module
+
+
+class Device:
+    """One analyzer: its port, decoder copy, ring and pipeline"""
+
+    def __init__(self, index, port, mapping, out):
+        self.index = index
+        self.port = port
+        self.mapping = mapping
+        self.decoder = load_decoder(index)
+        self.decoder.SERIAL_PORT = port
+        self.decoder.CAPTURE_PATH = out
+        self.decoder.BULK_USB = self.decoder.ISO_USB = False
+        self.ser = None
+        self.ring = None
+        self.pipeline = None
+        self.tick_hz = None
+        self.events = 0
+        self.reported = (0, 0)  # stream bytes, events at the last rate line
+
+    def start(self, flush_policy):
+        """Opens the port and sends the settings; blocks for the stream
+        header, so the devices are started side by side in threads"""
+        self.ser = self.decoder.open_port()
+        self.decoder.configure(self.ser, flush_policy)
+        self.ser.timeout = 0
+        self.ring = SharedRing()
+        self.pipeline = Pipeline(*self.decoder.ingest_sinks(self.ring, self.mapping))
+
+    def readable(self):
+        """Decodes what the port holds and hands it on; False once the
+        port is gone"""
+        decoder = self.decoder
+        try:
+            edges, channels, times = decoder.read_events(self.ser)
+            if decoder.FLOW_CREDIT_KIB and self.pipeline.queue_fill() < decoder.CREDIT_QUEUE_FILL:
+                decoder.grant_credit(self.ser)
+            decoder.send_capacity_limits(self.ser)
+        except (serial.SerialException, OSError) as error:
+            print(f"[{self.index}] {self.port}: {error}", flush=True)
+            return False
+        self.events += len(times)
+        self.tick_hz = decoder.forward(self.pipeline, edges, channels, times, self.tick_hz)
+        return True
+
+    def report(self, seconds):
+        stream_bytes = self.decoder.stream_bytes
+        old_bytes, old_events = self.reported
+        print(f"[{self.index}] {self.port}: {(self.events - old_events) / seconds:,.0f} events/s, "
+              f"{(stream_bytes - old_bytes) / seconds / 1e6:.2f} MB/s", flush=True)
+        self.reported = (stream_bytes, self.events)
+
+    def close(self):
+        if self.pipeline is not None:
+            self.pipeline.close()
+        if self.ring is not None:
+            self.ring.close()
+        if self.ser is not None:
+            self.ser.close()
+
+
+async def run(devices, flush_policy):
+    loop = asyncio.get_running_loop()
+    stop = asyncio.Event()
+    loop.add_signal_handler(signal.SIGINT, stop.set)
+    await asyncio.gather(*(asyncio.to_thread(device.start, flush_policy) for device in devices))
+    live = set()
+
+    def readable(device):
+        if not device.readable():
+            loop.remove_reader(device.ser.fileno())
+            live.discard(device)
+            if not live:
+                stop.set()
+
+    for device in devices:
+        print(f"[{device.index}] {device.port}: {', '.join(device.mapping.values())} "
+              f"to {device.decoder.CAPTURE_PATH}, ring {device.ring.name}", flush=True)
+        loop.add_reader(device.ser.fileno(), readable, device)
+        live.add(device)
+        readable(device)  # the bytes behind the stream header are already read
+
+    last_flush = last_stats = time.monotonic()
+    while not stop.is_set():
+        try:
+            await asyncio.wait_for(stop.wait(), plotter.FLUSH_EVERY_S)
+        except asyncio.TimeoutError:
+            pass
+        now = time.monotonic()
+        if now - last_flush >= plotter.FLUSH_EVERY_S:
+            for device in live:
+                device.pipeline.flush()
+            last_flush = now
+        if STATS_EVERY_S and now - last_stats >= STATS_EVERY_S:
+            for device in sorted(live, key=lambda device: device.index):
+                device.report(now - last_stats)
+            last_stats = now
+    for device in live:
+        loop.remove_reader(device.ser.fileno())
+
+
+def arguments():
+    parser = argparse.ArgumentParser(description="Headless capture from several analyzers in one process")
+    parser.add_argument("--device", nargs=2, action="append", required=True, metavar=("PORT", "CHANNELS"),
+                        help="serial port and names of its CH1, CH2, ... comma separated; repeat per analyzer")
+    parser.add_argument("--flush", default="BATCH,16,2000",
+                        help="firmware flush policy MODE,batch events,latency us (default BATCH,16,2000)")
+    parser.add_argument("--out", default="board{n}.lacap", help="capture files, {n} the device's index")
+    args = parser.parse_args()
+
+    mode, batch, latency_us = (args.flush.split(",") + ["16", "2000"])[:3]
+    if mode.upper() not in plotter.FLUSH_MODES:
+        parser.error(f"flush mode {mode}: use one of {', '.join(plotter.FLUSH_MODES)}")
+    args.flush = plotter.FLUSH_MODES[mode.upper()], int(batch), int(latency_us)
+    if len(args.device) > 1 and "{n}" not in args.out:
+        parser.error("--out needs {n} for more than one device")
+    args.devices = [(port, {ch: name.strip().upper() for ch, name in enumerate(names.split(","))
+                            if name.strip()}) for port, names in args.device]
+    return args
+
+
+def main():
+    args = arguments()
+    devices = [Device(index, port, mapping, args.out.format(n=index))
+               for index, (port, mapping) in enumerate(args.devices)]
+    try:
+        asyncio.run(run(devices, args.flush))
+    finally:
+        for device in devices:
+            device.close()
+    print(f"Captures closed: {', '.join(device.decoder.CAPTURE_PATH for device in devices)}")
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,86 @@
+"""Headless edge capture: serial_plotter.py's ingest without its prompts,
+plot or shared ring, for unattended captures on machines without a
+display.
+
+  python serial_capture.py --port /dev/ttyACM0 --channels RX,TX --duration 3600 --out run.lacap
+
+The channel names, flush policy, duration, trigger and output come from
+the arguments; the other settings are serial_plotter.py's, which this
+runs in-process. Only the ingest loop and the sinks behind it run, the
+capture writer and a pipeline.ThroughputSink that prints the record rate
+and MB/s every --stats seconds. The capture ends after --duration
+seconds, counted from the device trigger if --trigger is given, or at
+Ctrl-C; either way the capture file is flushed and closed."""
+import argparse
+import os
+import signal
+import threading
+
+os.environ.setdefault("MPLBACKEND", "Agg")  # serial_plotter imports pyplot; no window is opened
+
+import common_path  # puts python_scripts/common on sys.path
+import serial_plotter as plotter
+from pipeline import ThroughputSink
+
+
+def arguments():
+    parser = argparse.ArgumentParser(description="Headless edge capture to a .lacap file")
+    parser.add_argument("--port", default=plotter.SERIAL_PORT, help="serial port of the analyzer")
+    parser.add_argument("--bulk", action="store_true", help="USB_VENDOR_CLASS firmware: read through libusb")
+    parser.add_argument("--channels", required=True,
+                        help="names of CH1, CH2, ... comma separated, e.g. RX,TX or MOSI,MISO,CLK,SS")
+    parser.add_argument("--flush", default="BATCH,16,2000",
+                        help="firmware flush policy MODE,batch events,latency us (default BATCH,16,2000)")
+    parser.add_argument("--duration", type=float, default=0, help="seconds to capture, 0 = until Ctrl-C")
+    parser.add_argument("--trigger", help="type,channel,value,mask,param,pre,post as serial_plotter.TRIGGER; "
+                                          "the duration counts from the trigger")
+    parser.add_argument("--out", default=plotter.CAPTURE_PATH, help="capture file (default bitlog.lacap)")
+    parser.add_argument("--stats", type=float, default=1.0, help="seconds between throughput lines")
+    parser.add_argument("--serve", type=int, help="also serve the capture to remote clients on this TCP port "
+                                                  "(capture_server.py)")
+    args = parser.parse_args()
+
+    mode, batch, latency_us = (args.flush.split(",") + ["16", "2000"])[:3]
+    if mode.upper() not in plotter.FLUSH_MODES:
+        parser.error(f"flush mode {mode}: use one of {', '.join(plotter.FLUSH_MODES)}")
+    args.flush = plotter.FLUSH_MODES[mode.upper()], int(batch), int(latency_us)
+    args.mapping = {ch: name.strip().upper() for ch, name in enumerate(args.channels.split(",")) if name.strip()}
+    if args.trigger:
+        args.trigger = tuple(int(value, 0) for value in args.trigger.split(","))
+        if len(args.trigger) != 7:
+            parser.error("--trigger takes seven values, see serial_plotter.TRIGGER")
+    return args
+
+
+def main():
+    args = arguments()
+    plotter.SERIAL_PORT = args.port
+    plotter.BULK_USB = plotter.BULK_USB or args.bulk
+    plotter.CAPTURE_PATH = args.out
+    plotter.SERVE_PORT = args.serve or plotter.SERVE_PORT
+    plotter.TRIGGER = args.trigger or plotter.TRIGGER
+
+    stop = threading.Event()
+    triggered = threading.Event()
+    if not plotter.TRIGGER:
+        triggered.set()
+    signal.signal(signal.SIGINT, lambda *_: stop.set())
+
+    def timer():
+        while not triggered.wait(0.5):
+            if stop.is_set():
+                return
+        if args.duration:
+            stop.wait(args.duration)
+            stop.set()
+
+    threading.Thread(target=timer, daemon=True).start()
+    print(f"Capturing {', '.join(args.mapping.values())} from {args.port} to {args.out}"
+          + (f" for {args.duration:g} s" if args.duration else ", Ctrl-C stops")
+          + (" after the trigger" if plotter.TRIGGER else ""), flush=True)
+    plotter.ingest(None, args.mapping, args.flush, stop, sinks=[ThroughputSink(args.stats, triggered)])
+    print(f"Capture closed: {args.out}")
+
+
+if __name__ == "__main__":
+    main()
@@ -1,262 +1,299 @@
-import csv
+import heapq
+import itertools
+import multiprocessing
+import os
 import sys
-from collections import defaultdict
+
+import numpy as np
+
+import common_path  # puts python_scripts/common on sys.path
+from capture_file import RecordChunks, uart_records
+from decode_cache import DecodeCache
+from decoder_core import TransitionIndex, decode, decode_parallel, load_index
+from event_output import EventWriter
+from pcap_output import PcapWriter
+from pipeline import channel_levels, decode_chunks
+from protocol_id import describe, first_edges, group_specs, identify
+
+TICK_HZ = 5_140_000  # interrupt firmware power-up clock, for CSV files without seconds
+WINDOW_S = None  # (start, end) seconds, e.g. (2820, 2880): decode only that stretch of a capture
+STRUCTURED_OUTPUT = None  # 'jsonl' or 'laev': write event records (event_output.py) instead of text reports;
+                          # 'pcapng': decoded frames for Wireshark (pcap_output.py)
+DECODE_CACHE = True  # keep decodes in <capture>.decodes/ and reuse them for the same parameters (decode_cache.py)
+PARALLEL_DECODE = True  # cut one long bus at its idle points and decode the pieces on every core (decoder_core.py)
+tick_hz = TICK_HZ    # clock of the loaded capture: times are 64-bit ticks of it
+
+def us(ticks):
+    """Microseconds of a tick time or span on the loaded capture's clock"""
+    return ticks * 1e6 / tick_hz
+
+def decode_bus(index, protocol, **options):
+    """decode(), over every core with PARALLEL_DECODE"""
+    return (decode_parallel if PARALLEL_DECODE else decode)(index, protocol, **options)
+
+# ========== CAPTURE LOADING ==========
+def load(filepath, names=None):
+    """decoder_core.load_index of a capture or CSV export, with only the
+    channels in names if given. Sets tick_hz from the capture header and
+    warns about regions with lost events"""
+    global tick_hz
+    index = load_index(filepath, names, WINDOW_S)
+    tick_hz = index.tick_hz or TICK_HZ
+    if index.drops:
+        print(f"WARNING: capture lost events in {len(index.drops)} region(s); affected data is flagged")
+    return index
+
+def cached(filepath, protocol, params, compute):
+    """({source: events}, info) of a decode: compute(), which loads the
+    capture, or what DECODE_CACHE kept of the same decode of the same
+    capture. Sets tick_hz either way"""
+    global tick_hz
+    cache = DecodeCache(filepath, WINDOW_S) if DECODE_CACHE else None
+    hit = cache.load(protocol, params) if cache else None
+    if hit:
+        info, decoded = hit
+        tick_hz = info['tick_hz'] or TICK_HZ
+        print(f"{protocol.upper()} decode loaded from '{cache.folder}'")
+        return decoded, info
+    decoded, info = compute()
+    if cache:
+        cache.store(protocol, params, tick_hz, decoded, **info)
+    return decoded, info
+
+def structured(name, sources):
+    """EventWriter, or PcapWriter, of the STRUCTURED_OUTPUT file for an
+    output name"""
+    writer = PcapWriter if STRUCTURED_OUTPUT == 'pcapng' else EventWriter
+    return writer(f"{name}.{STRUCTURED_OUTPUT}", tick_hz, sources)
+
+def hex_str(values):
+    return ' '.join('??' if b is None else f'{b:02X}' for b in values)
+
+def ascii_str(values):
+    return ''.join('?' if b is None else (chr(b) if 32 <= b < 127 else '.') for b in values)
 
 # ========== UART DECODER ==========
-def get_line_level_at(transitions, sample_time):
-    """Get the logic level at a specific time based on transitions"""
-    level = 1  # UART idle line is high
-    for edge, t in transitions:
-        if t > sample_time:
-            break
-        if edge == 'falling':
-            level = 0
-        elif edge == 'rising':
-            level = 1
-    return level
-
-def detect_uart_frames(transitions, bit_time_us):
-    """
-    Improved UART frame detection that handles inter-character gaps properly
-    """
-    frames = []
-    min_start_width = bit_time_us * 0.5  # Start bit must be at least 50% of bit time
-    min_idle_time = bit_time_us * 0.8    # Minimum idle time between frames
-    
-    i = 0
-    while i < len(transitions):
-        edge, time = transitions[i]
-        
-        # Look for falling edge (potential start bit)
-        if edge != 'falling':
-            i += 1
-            continue
-            
-        # Check if line was idle (high) for sufficient time before this falling edge
-        if i > 0:
-            prev_edge, prev_time = transitions[i-1]
-            if prev_edge == 'falling' and (time - prev_time) < min_idle_time:
-                i += 1
+STANDARD_BAUDS = (300, 600, 1200, 2400, 4800, 9600, 14400, 19200, 28800, 31250, 38400, 57600,
+                  76800, 115200, 230400, 250000, 460800, 500000, 921600, 1000000)
+BAUD_SNAP = 0.05     # an estimate this close to a standard rate is taken as it
+CLUSTER_GAP = 1.35   # pulse widths further apart than this ratio are different bit counts
+
+def estimate_baud(times):
+    """Baud rate of a UART line from its sorted edge times, or None with
+    too few edges. Every pulse, low or high, is a whole number of bits.
+    The sorted pulse widths are split into clusters wherever one width is
+    more than CLUSTER_GAP times the previous, a histogram with one bin per
+    bit count; the shortest cluster holding at least a tenth as many
+    pulses as the largest is one bit. All pulses of up to 10 bits then
+    refine that bit time, which is snapped to a standard rate when one is
+    within BAUD_SNAP"""
+    widths = np.diff(np.asarray(times, dtype=np.int64))
+    widths = widths[widths > 0]
+    if len(widths) < 8:
+        return None
+    ordered = np.sort(widths)
+    bounds = np.concatenate([[0], np.flatnonzero(ordered[1:] > ordered[:-1] * CLUSTER_GAP) + 1,
+                             [len(ordered)]])
+    counts = np.diff(bounds)
+    shortest = int(np.flatnonzero(counts >= max(int(counts.max()) // 10, 2))[0])
+    near = ordered[int(bounds[shortest]):int(bounds[shortest + 1])]
+    bit = near.sum() / len(near)
+    multiples = np.rint(widths / bit)
+    fit = (multiples >= 1) & (multiples <= 10)
+    bit = widths[fit].sum() / multiples[fit].sum()
+    baud = tick_hz / bit
+    standard = min(STANDARD_BAUDS, key=lambda rate: abs(baud / rate - 1))
+    return standard if abs(baud / standard - 1) <= BAUD_SNAP else int(round(baud))
+
+def uart_channels(filepath, baud_rate, data_bits, parity, stop_bits):
+    """Frames of every UART channel of a capture, found by the decoder
+    core's 'uart' decoder, and {'bauds': each channel's baud rate}"""
+    index = load(filepath)
+    decoded, bauds = {}, {}
+    # Process each channel; the firmware decoded some itself (UART_DECODE)
+    for channel in list(index.lines) + [name for name in index.uart if name not in index.lines]:
+        baud = baud_rate
+        if channel in index.uart:
+            baud = baud or 1  # already bytes: the bit time is not used
+        elif baud is None:
+            baud = estimate_baud(index.line(channel)[0])
+            if baud is None:
+                print(f"{channel}: too few edges to estimate the baud rate")
                 continue
-        
-        # Find the next rising edge to measure start bit width
-        start_bit_end = None
-        for j in range(i + 1, len(transitions)):
-            next_edge, next_time = transitions[j]
-            if next_edge == 'rising':
-                start_bit_width = next_time - time
-                if start_bit_width >= min_start_width:
-                    start_bit_end = next_time
-                    frames.append(time)
-                break
-        
-        i += 1
-    
-    return frames
-
-def decode_uart_frame(transitions, start_time, bit_time_us, data_bits=8, parity='N'):
-    """
-    Decode a single UART frame starting at start_time
-    """
-    
-    # Sample data bits at the center of each bit period
-    bits = []
-    for bit_index in range(data_bits):
-        sample_time = start_time + int(bit_time_us * (1.5 + bit_index))
-        bit_value = get_line_level_at(transitions, sample_time)
-        bits.append(bit_value)
-    
-    # Handle parity bit if enabled
-    parity_bit = None
-    parity_ok = True
-    if parity.upper() in ('E', 'O'):
-        parity_sample_time = start_time + int(bit_time_us * (1.5 + data_bits))
-        parity_bit = get_line_level_at(transitions, parity_sample_time)
-        
-        # Check parity
-        data_ones = sum(bits)
-        if parity.upper() == 'E':  
-            parity_ok = (data_ones % 2) == (1 - parity_bit)
-        else:  
-            parity_ok = (data_ones % 2) == parity_bit
-            
-        if not parity_ok:
-            print(f"  WARNING: Parity error!")
-    
-    # Check stop bit(s)
-    stop_sample_time = start_time + int(bit_time_us * (1.5 + data_bits + (1 if parity != 'N' else 0)))
-    stop_bit = get_line_level_at(transitions, stop_sample_time)
-    if stop_bit != 1:
-        print(f"  WARNING: Stop bit error! Expected 1, got {stop_bit}")
-    
-    # Compose byte (LSB first for UART)
-    byte_value = 0
-    for idx, bit_val in enumerate(bits):
-        byte_value |= (bit_val << idx)
-        
-    return byte_value, parity_ok
+            print(f"{channel}: estimated {baud} baud")
+        decoded[channel] = decode_bus(index, 'uart', channel=channel, bit_time=tick_hz / baud,
+                                  data_bits=data_bits, parity=parity, stop_bits=stop_bits)
+        bauds[channel] = baud
+    return decoded, {'bauds': bauds}
 
 def decode_uart(filepath, baud_rate, data_bits=8, parity='N', stop_bits=1):
     """
-    Main UART decoder function
+    Main UART decoder function, frames found by the decoder core's 'uart'
+    decoder; baud_rate None estimates each channel's rate from its pulse
+    widths (estimate_baud)
     """
-    bit_time_us = 5_140_000 / baud_rate # set as needed based on resolution (5.14 MHz)
-    
-    # Read CSV file
-    channel_data = {}
     try:
-        with open(filepath, 'r', newline='') as csvfile:
-            reader = csv.reader(csvfile)
-            header = next(reader)
-            print(f"CSV header: {header}")
-            
-            for row in reader:
-                if len(row) != 3:
-                    continue
-                channel, edge, timestamp = row
-                try:
-                    timestamp = int(timestamp)
-                except ValueError:
-                    print(f"Warning: Invalid timestamp '{timestamp}' - skipping")
-                    continue
-                
-                if channel not in channel_data:
-                    channel_data[channel] = []
-                channel_data[channel].append((edge.lower(), timestamp))
-                
+        decoded, info = cached(filepath, 'uart', dict(baud=baud_rate, data_bits=data_bits, parity=parity,
+                                                      stop_bits=stop_bits),
+                               lambda: uart_channels(filepath, baud_rate, data_bits, parity, stop_bits))
     except FileNotFoundError:
         print(f"Error: File '{filepath}' not found")
         return
     except Exception as e:
         print(f"Error reading file: {e}")
         return
-    
-    # Process each channel
-    for channel, transitions in channel_data.items():
-        
-        # Sort transitions by time
-        transitions.sort(key=lambda x: x[1])
-        
-        # Detect UART frames
-        frame_start_times = detect_uart_frames(transitions, bit_time_us)
+
+    for channel, frames in decoded.items():
+        baud = info['bauds'][channel]
+        bit_time = tick_hz / baud  # in ticks of the capture's clock
         
-        if not frame_start_times:
+        if not frames:
             print("No valid UART frames detected!")
             continue
+        if STRUCTURED_OUTPUT:
+            with structured(f"{channel}_uart_decoded", [channel]) as out:
+                out.write(channel, 'uart', frames)
+            print(f"{channel}: {out.count} events written to '{out.path}'")
+            continue
         
-        # Decode each frame
         decoded_bytes = []
-        for start_time in frame_start_times:
-            try:
-                byte_val, parity_ok = decode_uart_frame(transitions, start_time, bit_time_us, data_bits, parity)
-                decoded_bytes.append(byte_val)
-            except Exception as e:
-                print(f"Error decoding frame at {start_time}µs: {e}")
+        for event in frames:
+            if event[0] == 'lost':
+                print(f"  WARNING: frame at {us(event[1]):.2f}µs overlaps lost events, not decoded")
+                decoded_bytes.append(None)
+                continue
+            _, _, byte_val, parity_ok, stop_bit = event
+            if not parity_ok:
+                print(f"  WARNING: Parity error!")
+            if stop_bit != 1:
+                print(f"  WARNING: Stop bit error! Expected 1, got {stop_bit}")
+            decoded_bytes.append(byte_val)
         
         # Output results
         print(f"\n{'='*20} Results for {channel} {'='*20}")
         print(f"Decoded {len(decoded_bytes)} bytes:")
-        print(f"Hex:   {' '.join(f'{b:02X}' for b in decoded_bytes)}")
-        print(f"ASCII: {''.join(chr(b) if 32 <= b < 127 else '.' for b in decoded_bytes)}")
+        print(f"Hex:   {hex_str(decoded_bytes)}")
+        print(f"ASCII: {ascii_str(decoded_bytes)}")
         
         # Save to file
         output_file = f"{channel}_uart_decoded.txt"
         try:
             with open(output_file, 'w') as f:
                 f.write(f"UART Decode Results - Channel {channel}\n")
-                f.write(f"Baud: {baud_rate}, Data: {data_bits}, Parity: {parity}, Stop: {stop_bits}\n")
-                f.write(f"Bit time: {bit_time_us:.2f}µs\n")
+                f.write(f"Baud: {baud}, Data: {data_bits}, Parity: {parity}, Stop: {stop_bits}\n")
+                f.write(f"Bit time: {us(bit_time):.2f}µs\n")
                 f.write("=" * 50 + "\n")
-                f.write(f"Hex:   {' '.join(f'{b:02X}' for b in decoded_bytes)}\n")
-                f.write(f"ASCII: {''.join(chr(b) if 32 <= b < 127 else '.' for b in decoded_bytes)}\n")
+                f.write(f"Hex:   {hex_str(decoded_bytes)}\n")
+                f.write(f"ASCII: {ascii_str(decoded_bytes)}\n")
             print(f"Results saved to: {output_file}")
         except Exception as e:
             print(f"Error saving file: {e}")
 
+# ========== UART SETTINGS SCAN ==========
+SCAN_EDGES = 4000    # edges of the channel every candidate is scored on
+SCAN_FRAMES = ('8N1', '8E1', '8O1', '7N1', '7E1', '7O1')
+SCAN_MIN_FRAMES = 8  # a candidate decoding fewer frames is not ranked
+SCAN_CLEAN = 0.02    # error rate under which the winner counts as a clean decode
+
+def score_uart(sample, baud, frame):
+    """(error rate, frames) of one candidate setting on a sample index,
+    an error being a frame with a bad parity or stop bit"""
+    frames = decode(sample, 'uart', channel=sample.names[0], bit_time=sample.tick_hz / baud,
+                    data_bits=int(frame[0]), parity=frame[1], stop_bits=int(frame[2]))
+    frames = [event for event in frames if event[0] == 'byte']
+    errors = sum(1 for event in frames if not event[3] or event[4] != 1)
+    return (errors / len(frames) if frames else 1.0), len(frames)
+
+def scan_uart(filepath, channel):
+    """Decodes the first SCAN_EDGES edges of a channel with every standard
+    baud rate its shortest pulses allow and every SCAN_FRAMES format, in
+    a worker pool, ranks them by error rate, then runs decode_uart with
+    the winner on the whole capture. At equal error rates a format with
+    parity wins, since a parity bit that keeps checking is evidence and
+    one read as data is not"""
+    index = load(filepath, (channel,))
+    if channel in index.uart:
+        print(f"{channel} was decoded on the device; its settings are the firmware's")
+        return
+    times, levels = index.line(channel)
+    if len(times) < 2 * SCAN_MIN_FRAMES:
+        print(f"{channel}: too few edges to scan")
+        return
+    sample = TransitionIndex([channel], tick_hz, index.drops)
+    sample.add(channel, times[:SCAN_EDGES], levels[:SCAN_EDGES], index.initial.get(channel))
+    shortest = np.percentile(np.diff(times[:SCAN_EDGES]), 1)
+    bauds = {baud for baud in STANDARD_BAUDS if tick_hz / baud <= 1.5 * shortest}  # a bit fits in a pulse
+    bauds |= {estimate_baud(times[:SCAN_EDGES])} - {None}
+    candidates = [(baud, frame) for baud in sorted(bauds or STANDARD_BAUDS) for frame in SCAN_FRAMES]
+    print(f"Scoring {len(candidates)} UART settings on {min(len(times), SCAN_EDGES)} edges of {channel}")
+    with multiprocessing.Pool(os.cpu_count() or 1) as pool:
+        scores = pool.starmap(score_uart, [(sample, baud, frame) for baud, frame in candidates])
+
+    ranked = sorted((rate, frame[1] == 'N', -count, baud, frame)
+                    for (baud, frame), (rate, count) in zip(candidates, scores) if count >= SCAN_MIN_FRAMES)
+    if not ranked:
+        print(f"No setting decodes {SCAN_MIN_FRAMES} frames on {channel}")
+        return
+    for rate, _, count, baud, frame in ranked[:5]:
+        print(f"  {baud:>7} {frame}: {-count} frames, {rate:.1%} errors")
+    rate, _, _, baud, frame = ranked[0]
+    if rate > SCAN_CLEAN:
+        print(f"WARNING: no setting decodes cleanly; the best has {rate:.1%} errors")
+    print(f"Decoding the capture at {baud} {frame}")
+    decode_uart(filepath, baud, int(frame[0]), frame[1], int(frame[2]))
+
 # ========== SPI DECODER ==========
+SPI_CHANNELS = ('SCK', 'CLK', 'MOSI', 'MISO', 'SS', 'CS')
+
+def spi_lines(index):
+    """Options naming the clk, mosi, miso and ss channels of an SPI bus
+    for the decoder core's 'spi' decoder: the clock is SCK or CLK, SS
+    may be CS or missing"""
+    pick = lambda *names: next((name for name in names if name in index), None)
+    return dict(clk=pick('SCK', 'CLK'), mosi='MOSI', miso='MISO', ss=pick('SS', 'CS'))
+
 def decode_spi(csv_file, clock_polarity=0, clock_phase=0):
     """
     Decode SPI protocol
     clock_polarity: 0 = idle low, 1 = idle high
     clock_phase: 0 = sample on leading edge, 1 = sample on trailing edge
+    Sampling is done by the decoder core's 'spi' decoder
     """
-    transitions = defaultdict(list)
-    output_lines = []
+    def compute():
+        index = load(csv_file, SPI_CHANNELS)
+        lines = spi_lines(index)
+        if index.spi is not None:
+            print(f"Found {len(index.spi[0])} bytes received by the firmware")
+        else:
+            print(f"Found {len(index.edges(lines['clk'], 1 if clock_polarity == clock_phase else 0))} "
+                  f"clock edges for sampling")
+            if lines['ss'] is not None:
+                print(f"Only those while {lines['ss']} was low are counted")
+        return {'SPI': decode_bus(index, 'spi', clock_polarity=clock_polarity, clock_phase=clock_phase, **lines)}, {}
+
+    decoded, _ = cached(csv_file, 'spi', dict(clock_polarity=clock_polarity, clock_phase=clock_phase), compute)
+    events = decoded['SPI']
+    if STRUCTURED_OUTPUT:
+        with structured("decoded_spi_output", ['SPI']) as out:
+            out.write('SPI', 'spi', events)
+        print(f"{out.count} SPI events written to '{out.path}'")
+        return
+    mosi_bytes = [event[2] for event in events if event[0] == 'byte']
+    miso_bytes = [event[3] for event in events if event[0] == 'byte']
 
-    with open(csv_file, 'r') as f:
-        reader = csv.reader(f)
-        next(reader)  # Skip header
-        for row in reader:
-            if len(row) != 3:
-                continue
-            channel, edge, timestamp = row
-            try:
-                timestamp = int(timestamp)
-            except ValueError:
-                continue
-            transitions[channel].append((edge.lower(), timestamp))
-
-    # Sort all transitions by time
-    for channel in transitions:
-        transitions[channel].sort(key=lambda x: x[1])
-
-    # Determine sampling edge based on polarity and phase
-    if clock_polarity == 0:  
-        sample_edge = 'rising' if clock_phase == 0 else 'falling'
-    else:  
-        sample_edge = 'falling' if clock_phase == 0 else 'rising'
-
-    clk_edges = [t for e, t in transitions.get('SCK', []) if e == sample_edge]
-    mosi_transitions = transitions.get('MOSI', [])
-    miso_transitions = transitions.get('MISO', [])
-
-    print(f"Found {len(clk_edges)} clock edges for sampling")
-
-    mosi_byte = 0
-    miso_byte = 0
-    bit_count = 0
-
-    for clk_time in clk_edges:
-        # Find MOSI level at clock edge
-        mosi_level = 0
-        for e, t in reversed(mosi_transitions):
-            if t <= clk_time:
-                mosi_level = 1 if e == 'rising' else 0
-                break
-
-        # Find MISO level at clock edge
-        miso_level = 0
-        for e, t in reversed(miso_transitions):
-            if t <= clk_time:
-                miso_level = 1 if e == 'rising' else 0
-                break
-
-        # SPI is MSB first
-        mosi_byte = (mosi_byte << 1) | mosi_level
-        miso_byte = (miso_byte << 1) | miso_level
-        bit_count += 1
-
-        if bit_count == 8:
-            # Convert to ASCII characters if printable
-            mosi_char = chr(mosi_byte) if 32 <= mosi_byte < 127 else '.'
-            miso_char = chr(miso_byte) if 32 <= miso_byte < 127 else '.'
-            
-            output_lines.append(f"{clk_time}µs: SPI MOSI = 0x{mosi_byte:02X} ('{mosi_char}'), MISO = 0x{miso_byte:02X} ('{miso_char}')")
-            print(f"SPI byte at {clk_time}µs: MOSI=0x{mosi_byte:02X} ('{mosi_char}'), MISO=0x{miso_byte:02X} ('{miso_char}')")
-            mosi_byte = 0
-            miso_byte = 0
-            bit_count = 0
-
-    # Collect all MOSI and MISO bytes for ASCII representation
-    mosi_bytes = []
-    miso_bytes = []
-    for line in output_lines:
-        # Extract hex values from output lines
-        if 'MOSI = 0x' in line:
-            mosi_hex = line.split('MOSI = 0x')[1].split(' ')[0]
-            miso_hex = line.split('MISO = 0x')[1].split(' ')[0]
-            mosi_bytes.append(int(mosi_hex, 16))
-            miso_bytes.append(int(miso_hex, 16))
+    output_lines = []
+    for event in events:
+        t = event[1]
+        if event[0] == 'lost':
+            output_lines.append(f"{us(t):.2f}µs: SPI data lost ({event[2]} bits discarded)")
+            print(f"SPI data lost at {us(t):.2f}µs, {event[2]} bits discarded")
+            continue
+        mosi_byte, miso_byte = event[2], event[3]
+        # Convert to ASCII characters if printable
+        mosi_char = chr(mosi_byte) if 32 <= mosi_byte < 127 else '.'
+        miso_char = chr(miso_byte) if 32 <= miso_byte < 127 else '.'
+        output_lines.append(f"{us(t):.2f}µs: SPI MOSI = 0x{mosi_byte:02X} ('{mosi_char}'), MISO = 0x{miso_byte:02X} ('{miso_char}')")
+        print(f"SPI byte at {us(t):.2f}µs: MOSI=0x{mosi_byte:02X} ('{mosi_char}'), MISO=0x{miso_byte:02X} ('{miso_char}')")
 
     with open("decoded_spi_output.txt", "w") as f:
         f.write("=== SPI Decoded Data ===\n")
@@ -274,94 +311,49 @@ def decode_spi(csv_file, clock_polarity=0, clock_phase=0):
     print(f"Decoded SPI output written to 'decoded_spi_output.txt'")
 
 # ========== I2C DECODER ==========
-def decode_i2c(csv_file):
-    transitions = defaultdict(list)
-    output_lines = []
-
-    with open(csv_file, 'r') as f:
-        reader = csv.reader(f)
-        next(reader)  # Skip header
-        for row in reader:
-            if len(row) != 3:
-                continue
-            channel, edge, timestamp = row
-            try:
-                timestamp = int(timestamp)
-            except ValueError:
-                continue
-            transitions[channel].append((edge.lower(), timestamp))
-
-    # Sort transitions by time
-    for channel in transitions:
-        transitions[channel].sort(key=lambda x: x[1])
-
-    sda_transitions = transitions.get('SDA', [])
-    scl_transitions = transitions.get('SCL', [])
+def i2c_line(event):
+    """Output line of an I2cStream event, without its time"""
+    kind = event[0]
+    if kind == 'start':
+        return "I2C repeated START" if event[2] else "I2C START"
+    if kind == 'stop':
+        return "I2C STOP"
+    ack = "ACK" if event[-1] else "NACK"
+    if kind == 'address':
+        return f"I2C address 0x{event[2]:02X} {'read' if event[3] else 'write'}, {ack}"
+    char_repr = chr(event[2]) if 32 <= event[2] < 127 else '.'
+    return f"I2C byte = 0x{event[2]:02X} ('{char_repr}'), {ack}"
 
-    print(f"Found {len(sda_transitions)} SDA transitions, {len(scl_transitions)} SCL transitions")
 
-    # Detect start/stop conditions
-    start_stops = []
-    scl_high_periods = []
-    
-    # Find SCL high periods
-    scl_level = 0
-    scl_high_start = None
-    for edge, time in scl_transitions:
-        if edge == 'rising':
-            scl_level = 1
-            scl_high_start = time
-        elif edge == 'falling' and scl_level == 1:
-            scl_level = 0
-            if scl_high_start is not None:
-                scl_high_periods.append((scl_high_start, time))
-
-    # Detect start/stop conditions (SDA transitions while SCL is high)
-    for sda_edge, sda_time in sda_transitions:
-        for scl_start, scl_end in scl_high_periods:
-            if scl_start <= sda_time <= scl_end:
-                if sda_edge == 'falling':
-                    start_stops.append(('START', sda_time))
-                elif sda_edge == 'rising':
-                    start_stops.append(('STOP', sda_time))
-                break
-
-    # Sample data bits on SCL rising edges
-    bits = []
-    current_byte = 0
-    bit_count = 0
+def decode_i2c(csv_file):
+    """Decodes the SCL and SDA channels with the decoder core's 'i2c'
+    decoder"""
+    def compute():
+        index = load(csv_file, ('SCL', 'SDA'))
+        print(f"Found {len(index.line('SDA')[0])} SDA transitions, {len(index.line('SCL')[0])} SCL transitions")
+        if index.i2c is not None:
+            print(f"Found {len(index.i2c[0])} events framed by the firmware")
+        return {'I2C': decode_bus(index, 'i2c', scl='SCL', sda='SDA')}, {}
+
+    decoded, _ = cached(csv_file, 'i2c', {}, compute)
+    events = decoded['I2C']
+    output_lines = []
+    if STRUCTURED_OUTPUT:
+        with structured("decoded_i2c_output", ['I2C']) as out:
+            out.write('I2C', 'i2c', events)
+        print(f"{out.count} I2C events written to '{out.path}'")
+        return
     decoded_bytes = []
-
-    for edge, time in scl_transitions:
-        if edge == 'rising':
-            # Sample SDA at SCL rising edge
-            sda_val = 0
-            for e, st in reversed(sda_transitions):
-                if st <= time:
-                    sda_val = 1 if e == 'rising' else 0
-                    break
-
-            bits.append(sda_val)
-            bit_count += 1
-
-            if bit_count == 8:
-                current_byte = sum([bit << (7 - i) for i, bit in enumerate(bits)])
-                decoded_bytes.append(current_byte)
-                
-                # Convert to ASCII character if printable
-                char_repr = chr(current_byte) if 32 <= current_byte < 127 else '.'
-                output_lines.append(f"{time}µs: I2C byte = 0x{current_byte:02X} ('{char_repr}')")
-                print(f"I2C byte at {time}µs: 0x{current_byte:02X} ('{char_repr}')")
-                bits = []
-                bit_count = 0
-
-    # Add start/stop conditions to output
-    for condition, time in start_stops:
-        output_lines.append(f"{time}µs: I2C {condition}")
-        print(f"I2C {condition} at {time}µs")
-
-    # Sort output by time
-    output_lines.sort(key=lambda x: int(x.split('µs:')[0]))
+    for event in events:
+        if event[0] == 'lost':
+            line = "I2C data lost, transaction dropped"
+        else:
+            line = i2c_line(event)
+        if event[0] == 'data':
+            decoded_bytes.append(event[2])
+        output_lines.append(f"{us(event[1]):.2f}µs: {line}")
+    if output_lines:
+        print("\n".join(output_lines))
 
     with open("decoded_i2c_output.txt", "w") as f:
         f.write("=== I2C Decoded Data ===\n")
@@ -376,11 +368,302 @@ def decode_i2c(csv_file):
     print(f"ASCII: {''.join(chr(b) if 32 <= b < 127 else '.' for b in decoded_bytes)}")
     print(f"Decoded I2C output written to 'decoded_i2c_output.txt'")
 
+# ========== PULSE-WIDTH DECODERS ==========
+def pulse_line(protocol, event):
+    if event[0] == 'lost':
+        return f"{protocol.upper()} data lost, byte dropped"
+    if event[0] == 'reset':
+        if protocol == 'ws2812':
+            return "WS2812 latch"
+        return f"1-Wire reset, {'presence pulse' if event[2] else 'no device answered'}"
+    return f"{'1-Wire' if protocol == 'onewire' else 'WS2812'} byte = 0x{event[2]:02X}"
+
+def decode_pulses(filepath, protocol, channel, overdrive=False):
+    """Decodes one channel with the decoder core's 'onewire' or 'ws2812'
+    decoder, every pulse of it classed by width at once. A pulse channel
+    of the firmware ('p', PULSES) loads as edges like any other"""
+    def compute():
+        index = load(filepath, (channel,))
+        print(f"Found {len(index.line(channel)[0])} {channel} transitions")
+        options = dict(overdrive=overdrive) if protocol == 'onewire' else {}
+        return {channel: decode_bus(index, protocol, channel=channel, tick_hz=tick_hz, **options)}, {}
+
+    decoded, _ = cached(filepath, protocol, [channel, overdrive], compute)
+    events = decoded[channel]
+    if STRUCTURED_OUTPUT:
+        with structured(f"{channel}_{protocol}_decoded", [channel]) as out:
+            out.write(channel, protocol, events)
+        print(f"{out.count} {protocol.upper()} events written to '{out.path}'")
+        return
+    output_lines = [f"{us(event[1]):.2f}µs: {pulse_line(protocol, event)}" for event in events]
+    decoded_bytes = [event[2] for event in events if event[0] == 'byte']
+    output_file = f"{channel}_{protocol}_decoded.txt"
+    with open(output_file, "w") as f:
+        f.write(f"=== {protocol.upper()} Decoded Data ===\n")
+        for line in output_lines:
+            f.write(line + "\n")
+        f.write(f"\nHex: {hex_str(decoded_bytes)}\n")
+    print("\n".join(output_lines[:50]))
+    if len(output_lines) > 50:
+        print(f"... {len(output_lines) - 50} more")
+    print(f"{len(decoded_bytes)} bytes, {sum(event[0] == 'reset' for event in events)} resets, "
+          f"written to '{output_file}'")
+
+# ========== BATCH DECODER ==========
+def parse_group(spec):
+    """(protocol, options) of a batch channel group:
+    uart:<channel>[:<baud>[:<8N1>]] with an empty or missing baud
+    detected, spi[:<mode 0-3>[:<clk>:<mosi>:<miso>[:<ss>]]] with '-' for
+    a missing MISO or SS, or i2c[:<scl>:<sda>]; SPI and I2C without
+    channel names take SPI_CHANNELS and SCL/SDA"""
+    protocol, *args = spec.split(':')
+    protocol = protocol.lower()
+    if protocol == 'uart' and 1 <= len(args) <= 3:
+        baud = int(args[1]) if len(args) > 1 and args[1] else None
+        frame = args[2] if len(args) > 2 else '8N1'
+        if len(frame) != 3 or frame[1].upper() not in 'NEO':
+            raise ValueError(f"bad UART frame format '{frame}', expected e.g. 8N1")
+        return protocol, (args[0], baud, int(frame[0]), frame[1].upper(), int(frame[2]))
+    if protocol == 'spi' and len(args) in (0, 1, 4, 5):
+        mode = int(args[0]) if args else 0
+        if not 0 <= mode <= 3:
+            raise ValueError(f"bad SPI mode {mode}, expected 0-3")
+        lines = tuple(None if name == '-' else name for name in args[1:])
+        return protocol, (mode >> 1, mode & 1) + (lines + (None,) * (4 - len(lines)) if lines else ())
+    if protocol == 'i2c' and len(args) in (0, 2):
+        return protocol, tuple(args)
+    raise ValueError(f"bad channel group '{spec}'")
+
+def group_label(group):
+    """Annotation label of a parse_group channel group"""
+    return group[1][0] if group[0] == 'uart' else group[0].upper()
+
+def group_events(filepath, group):
+    """({label: events}, {'notes': [...]}) of one channel group, loading
+    only its channels"""
+    global tick_hz
+    protocol, options = group
+    notes = []
+    if protocol == 'uart':
+        channel, baud, data_bits, parity, stop_bits = options
+        index = load_index(filepath, (channel,), WINDOW_S)
+        tick_hz = index.tick_hz or TICK_HZ
+        if channel in index.uart:
+            baud = baud or 1  # decoded on the device: the bit time is not used
+        elif baud is None:
+            baud = estimate_baud(index.line(channel)[0])
+            if baud is None:
+                return {channel: []}, {'notes': [f"{channel}: too few edges to estimate the baud rate"]}
+            notes.append(f"{channel}: estimated {baud} baud")
+        events = decode(index, 'uart', channel=channel, bit_time=tick_hz / baud,
+                        data_bits=data_bits, parity=parity, stop_bits=stop_bits)
+    elif protocol == 'spi':
+        named = options[2:]
+        index = load_index(filepath, tuple(name for name in named if name) or SPI_CHANNELS, WINDOW_S)
+        tick_hz = index.tick_hz or TICK_HZ
+        lines = dict(zip(('clk', 'mosi', 'miso', 'ss'), named)) if named else spi_lines(index)
+        events = decode(index, 'spi', clock_polarity=options[0], clock_phase=options[1], **lines)
+    else:
+        scl, sda = options or ('SCL', 'SDA')
+        index = load_index(filepath, (scl, sda), WINDOW_S)
+        tick_hz = index.tick_hz or TICK_HZ
+        events = decode(index, 'i2c', scl=scl, sda=sda)
+    if index.drops:
+        notes.insert(0, f"WARNING: capture lost events in {len(index.drops)} region(s); affected data is flagged")
+    return {group_label(group): events}, {'notes': notes}
+
+def decode_group(filepath, group, raw=False):
+    """Worker of decode_batch: opens the capture in its own process (the
+    memory map shares the pages with every other worker) and decodes one
+    channel group, or takes it from DECODE_CACHE. Returns the capture's
+    tick_hz, notes for the console and the (time, label, text)
+    annotations in time order; raw makes them (time, label, protocol,
+    event) with the decoder's events for STRUCTURED_OUTPUT"""
+    protocol, options = group
+    label = group_label(group)
+    decoded, info = cached(filepath, protocol, list(options), lambda: group_events(filepath, group))
+    annotations = []
+    for event in decoded[label]:
+        if raw:
+            annotations.append((event[1], label, protocol, event))
+            continue
+        if protocol == 'uart':
+            if event[0] == 'lost':
+                annotations.append((event[1], label, "?? (frame overlaps lost events)"))
+                continue
+            _, t, byte_val, parity_ok, stop_bit = event
+            text = f"0x{byte_val:02X} ('{ascii_str([byte_val])}')"
+            if not parity_ok:
+                text += ", parity error"
+            if stop_bit != 1:
+                text += ", stop bit error"
+        elif protocol == 'spi':
+            if event[0] == 'lost':
+                text = f"data lost ({event[2]} bits discarded)"
+            else:
+                text = f"MOSI=0x{event[2]:02X} ('{ascii_str([event[2]])}'), MISO=0x{event[3]:02X} ('{ascii_str([event[3]])}')"
+        else:
+            text = "data lost, transaction dropped" if event[0] == 'lost' else i2c_line(event)[4:]
+        annotations.append((event[1], label, text))
+    return tick_hz, info['notes'], annotations
+
+def decode_batch(filepath, specs):
+    """Decodes several channel groups of one capture at once, each in a
+    worker process, and merges their annotations into one stream in time
+    order"""
+    global tick_hz
+    groups = [parse_group(spec) for spec in specs]
+    raw = bool(STRUCTURED_OUTPUT)
+    if DECODE_CACHE:
+        DecodeCache(filepath, WINDOW_S).digest()  # hashed once here, not by every worker
+    with multiprocessing.Pool(min(len(groups), os.cpu_count() or 1)) as pool:
+        results = pool.starmap(decode_group, [(filepath, group, raw) for group in groups])
+
+    tick_hz = results[0][0]
+    for note in dict.fromkeys(note for _, notes, _ in results for note in notes):
+        print(note)
+    if raw:
+        merged = heapq.merge(*(annotations for _, _, annotations in results), key=lambda a: a[0])
+        with structured("decoded_batch", dict.fromkeys(group_label(group) for group in groups)) as out:
+            out.write_tagged((label, protocol, event) for _, label, protocol, event in merged)
+        print(f"{out.count} events from {len(groups)} channel groups written to '{out.path}'")
+        return
+    output_lines = [f"{us(t):.2f}µs [{label}] {text}" for t, label, text in
+                    heapq.merge(*(annotations for _, _, annotations in results), key=lambda a: a[0])]
+    if output_lines:
+        print("\n".join(output_lines))
+
+    with open("decoded_batch.txt", "w") as f:
+        f.write("=== Batch Decoded Data ===\n")
+        f.write(f"Groups: {' '.join(specs)}\n")
+        for line in output_lines:
+            f.write(line + "\n")
+    print(f"\n{len(output_lines)} annotations from {len(groups)} channel groups written to 'decoded_batch.txt'")
+
+def decode_auto(filepath):
+    """Identifies the bus from the capture's first AUTO_ID_EDGES edges
+    (protocol_id.py) and decodes the whole capture as that, as a batch"""
+    index = load(filepath)
+    found = identify(first_edges(index), tick_hz)
+    for line in describe(found):
+        print(line)
+    if found is not None:
+        decode_batch(filepath, group_specs(found))
+
+# ========== CHUNKED DECODER ==========
+def decode_chunked(filepath, protocol, channel=None, baud_rate=None, data_bits=8, parity='N',
+                   clock_polarity=0, clock_phase=0, overdrive=False):
+    """Decodes a capture of any size chunk by chunk with the incremental
+    decoders (pipeline.decode_chunks), so memory follows the chunk size,
+    not the capture. Lines go to the output file as they are decoded;
+    there is no summary, which would grow with the capture. UART decodes
+    one channel, its baud rate estimated from the first chunk if None"""
+    global tick_hz
+    names = ((channel,) if protocol in ('uart', 'onewire', 'ws2812') else SPI_CHANNELS if protocol == 'spi'
+             else ('SCL', 'SDA'))
+    reader = RecordChunks(filepath, names)
+    tick_hz = reader.tick_hz or TICK_HZ
+    number = lambda *candidates: next((reader.names.index(name) for name in candidates
+                                       if name in reader.names), None)
+    chunks = iter(reader)
+    options = {}
+    if protocol == 'uart':
+        if channel not in reader.names:
+            print(f"Channel {channel} not found in the capture")
+            return
+        lines = (reader.names.index(channel),)
+        if baud_rate is None:
+            first = next(chunks, None)
+            chunks = itertools.chain([] if first is None else [first], chunks)
+            baud_rate = None if first is None else estimate_baud(channel_levels(first, lines[0])[0].tolist())
+            if baud_rate is None and first is not None and len(uart_records(first, lines[0])[0]):
+                baud_rate = 1  # decoded on the device: the bit time is not used
+            elif baud_rate is None:
+                print(f"{channel}: too few edges to estimate the baud rate")
+                return
+            else:
+                print(f"{channel}: estimated {baud_rate} baud")
+        options = dict(bit_time=tick_hz / baud_rate, data_bits=data_bits, parity=parity)
+        output_file = f"{channel}_uart_decoded.txt"
+    elif protocol == 'spi':
+        lines = (number('SCK', 'CLK'), number('MOSI'), number('MISO'), number('SS', 'CS'))
+        options = dict(clock_polarity=clock_polarity, clock_phase=clock_phase)
+        output_file = "decoded_spi_output.txt"
+    elif protocol in ('onewire', 'ws2812'):
+        if channel not in reader.names:
+            print(f"Channel {channel} not found in the capture")
+            return
+        lines = (reader.names.index(channel),)
+        options = dict(tick_hz=tick_hz, overdrive=overdrive)
+        output_file = f"{channel}_{protocol}_decoded.txt"
+    else:
+        lines = (number('SCL'), number('SDA'))
+        if None in lines:
+            print("SCL and SDA channels not found in the capture")
+            return
+        output_file = "decoded_i2c_output.txt"
+
+    if STRUCTURED_OUTPUT:
+        source = channel if protocol in ('uart', 'onewire', 'ws2812') else protocol.upper()
+        with structured(os.path.splitext(output_file)[0], [source]) as out:
+            out.write(source, protocol, decode_chunks(chunks, protocol, lines, **options))
+        print(f"Decoded {out.count} {protocol.upper()} events, written to '{out.path}'")
+        return
+
+    count = 0
+    with open(output_file, 'w') as f:
+        f.write(f"=== {protocol.upper()} Decoded Data (chunked) ===\n")
+        for event in decode_chunks(chunks, protocol, lines, **options):
+            kind = event[0]
+            if protocol == 'uart':
+                line = (f"{channel} ?? (data lost)" if kind == 'lost' else
+                        f"{channel} ?? (framing or parity error)" if event[2] is None else
+                        f"{channel} 0x{event[2]:02X} ('{ascii_str([event[2]])}')")
+            elif protocol == 'spi':
+                line = (f"SPI data lost ({event[2]} bits discarded)" if kind == 'lost' else
+                        f"SPI MOSI = 0x{event[2]:02X} ('{ascii_str([event[2]])}'), "
+                        f"MISO = 0x{event[3]:02X} ('{ascii_str([event[3]])}')")
+            elif protocol in ('onewire', 'ws2812'):
+                line = pulse_line(protocol, event)
+            else:
+                line = "I2C data lost, transaction dropped" if kind == 'lost' else i2c_line(event)
+            f.write(f"{us(event[1]):.2f}µs: {line}\n")
+            count += 1
+    print(f"Decoded {count} {protocol.upper()} events, written to '{output_file}'")
+
 # ========== MAIN SELECTOR ==========
 if __name__ == "__main__":
-    if len(sys.argv) != 3:
-        print("Usage: python protocol_decoder.py <protocol> <csv_file>")
-        print("Supported protocols: uart, spi, i2c")
+    if len(sys.argv) >= 4 and sys.argv[1].lower() == 'batch':
+        try:
+            decode_batch(sys.argv[2], sys.argv[3:])
+        except FileNotFoundError:
+            print(f"Error: File '{sys.argv[2]}' not found.")
+        except ValueError as e:
+            print(f"Error: {e}")
+        sys.exit(0)
+    if len(sys.argv) == 3 and sys.argv[1].lower() == 'auto':
+        try:
+            decode_auto(sys.argv[2])
+        except FileNotFoundError:
+            print(f"Error: File '{sys.argv[2]}' not found.")
+        sys.exit(0)
+    if len(sys.argv) == 4 and sys.argv[1].lower() == 'scan':
+        try:
+            scan_uart(sys.argv[2], sys.argv[3])
+        except FileNotFoundError:
+            print(f"Error: File '{sys.argv[2]}' not found.")
+        sys.exit(0)
+
+    chunked = len(sys.argv) == 4 and sys.argv[3] == '--chunked'
+    if len(sys.argv) != 3 and not chunked:
+        print("Usage: python serial_decoder.py <protocol> <bitlog.lacap or csv file> [--chunked]")
+        print("       python serial_decoder.py batch <bitlog.lacap or csv file> <group>...")
+        print("       python serial_decoder.py scan <bitlog.lacap or csv file> <channel>")
+        print("       python serial_decoder.py auto <bitlog.lacap or csv file>")
+        print("Supported protocols: uart, spi, i2c, onewire, ws2812")
+        print("Batch groups: uart:<channel>[:<baud>[:<8N1>]], spi[:<mode 0-3>[:<clk>:<mosi>:<miso>[:<ss>]]], "
+              "i2c[:<scl>:<sda>]")
+        print("--chunked decodes a capture of any size in bounded memory")
         sys.exit(1)
 
     protocol = sys.argv[1].lower()
@@ -389,23 +672,44 @@ if __name__ == "__main__":
     try:
         if protocol == 'uart':
             print("UART Decoder Configuration:")
-            baud = int(input("Enter UART baud rate (e.g., 9600): "))
-            data_bits = int(input("Enter number of data bits (7 or 8): "))
-            parity = input("Enter parity (N = none, E = even, O = odd): ").upper()
-            stop_bits = int(input("Enter number of stop bits (1 or 2): "))
-            decode_uart(file_path, baud, data_bits, parity, stop_bits)
+            if chunked:
+                channel = input("Enter UART channel name (e.g., RX): ").strip()
+            # Enter alone picks auto baud and 8N1
+            baud = input("Enter UART baud rate (e.g., 9600, Enter to detect it): ").strip()
+            baud = int(baud) if baud else None
+            data_bits = int(input("Enter number of data bits (7 or 8): ") or 8)
+            parity = (input("Enter parity (N = none, E = even, O = odd): ") or 'N').upper()
+            stop_bits = int(input("Enter number of stop bits (1 or 2): ") or 1)
+            if chunked:
+                decode_chunked(file_path, 'uart', channel, baud, data_bits, parity)
+            else:
+                decode_uart(file_path, baud, data_bits, parity, stop_bits)
             
         elif protocol == 'spi':
             print("SPI Decoder Configuration:")
             clock_pol = int(input("Enter clock polarity (0 = idle low, 1 = idle high): "))
             clock_phase = int(input("Enter clock phase (0 = sample on leading edge, 1 = trailing edge): "))
-            decode_spi(file_path, clock_pol, clock_phase)
+            if chunked:
+                decode_chunked(file_path, 'spi', clock_polarity=clock_pol, clock_phase=clock_phase)
+            else:
+                decode_spi(file_path, clock_pol, clock_phase)
             
         elif protocol == 'i2c':
-            decode_i2c(file_path)
+            if chunked:
+                decode_chunked(file_path, 'i2c')
+            else:
+                decode_i2c(file_path)
+
+        elif protocol in ('onewire', 'ws2812'):
+            channel = input(f"Enter {protocol.upper()} channel name (e.g., CH1): ").strip()
+            overdrive = protocol == 'onewire' and input("Overdrive speed? (y/N): ").strip().lower() == 'y'
+            if chunked:
+                decode_chunked(file_path, protocol, channel, overdrive=overdrive)
+            else:
+                decode_pulses(file_path, protocol, channel, overdrive)
             
         else:
-            print("Unsupported protocol. Use 'uart', 'spi', or 'i2c'.")
+            print("Unsupported protocol. Use 'uart', 'spi', 'i2c', 'onewire' or 'ws2812'.")
             
     except FileNotFoundError:
         print(f"Error: File '{file_path}' not found.")
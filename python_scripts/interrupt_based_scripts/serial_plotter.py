@@ -1,25 +1,380 @@
 import serial
 import struct
-import csv
-import threading
+import multiprocessing
+import signal
+import subprocess
+import time
+import numpy as np
 import matplotlib.pyplot as plt
 import matplotlib.animation as animation
-from collections import defaultdict, deque
+from collections import defaultdict
+
+import common_path  # puts python_scripts/common on sys.path
+from capture_file import (CaptureWriter, MODE_EVENTS, CHANNEL_DROP_START, CHANNEL_DROP_END,
+                          CHANNEL_TRIGGER, analog_records)
+from capture_plan import CapacityEstimator, link_ceiling
+import capture_transcode
+from pipeline import (Pipeline, RingSink, StatsSink, UartSink, ProtocolStatsSink, StageReport, channel_levels,
+                      level_changes, stage)
+from trace_export import ExportSink
+from pcap_output import PcapSink
+from capture_server import ServerSink
+from live_annotations import AnnotationOverlay
+from protocol_id import IdentifySink, auto_mapping, is_auto
+from clock_sync import ClockSync
+from latency_probe import LatencyProbe, LatencyReport
+from ingest_priority import PortReader, StallMeter, freeze_heap, raise_priority
+from shm_ring import SharedRing
+import stream_codec
+from telemetry import Telemetry, TelemetryPanel
 
 # ========================
 # Data Structures
 # ========================
 
-channel_data = defaultdict(lambda: deque(maxlen=1000))  # stores (time, edge)
-data_log = []  # stores raw CSV log
+STEP_CAPACITY = 1 << 20  # edges kept per channel for the plot
+BYTE_GAP = 1000          # time gap that starts a new byte in the view
+
+
+class StepBuffer:
+    """One channel's latest edges in a preallocated ring, appended a batch
+    at a time. Every edge is stored twice, capacity apart, so the edges
+    held are always one contiguous run of the arrays: view() and
+    visible() are slices, never copies, and a full ring overwrites only
+    as many of the oldest edges as arrive. Keeps the start of the latest
+    byte up to date so a frame only looks at new edges"""
+
+    def __init__(self, capacity=STEP_CAPACITY, dtype=np.int8):
+        self.capacity = capacity
+        self.times = np.empty(2 * capacity, np.int64)
+        self.edges = np.empty(2 * capacity, dtype)
+        self.total = 0       # edges ever appended
+        self.count = 0       # edges held, the latest ones
+        self.byte_start = 0  # number (of total) of the first edge after the latest gap
+
+    def append(self, times, edges):
+        n = len(times)
+        if n > self.capacity:
+            times, edges, n = times[-self.capacity:], edges[-self.capacity:], self.capacity
+        if not n:
+            return
+        pos = self.total % self.capacity
+        first = min(n, self.capacity - pos)
+        for at in (pos, pos + self.capacity):
+            self.times[at:at + first] = times[:first]
+            self.edges[at:at + first] = edges[:first]
+        for at in (0, self.capacity):
+            self.times[at:at + n - first] = times[first:]
+            self.edges[at:at + n - first] = edges[first:]
+        self.total += n
+        self.count = min(self.count + n, self.capacity)
+        held, _ = self.view()
+        tail = held[-(n + 1):]  # with the edge before the batch, if held
+        gaps = np.flatnonzero(np.diff(tail) > BYTE_GAP)
+        if len(gaps):
+            self.byte_start = self.total - len(tail) + int(gaps[-1]) + 1
+        self.byte_start = max(self.byte_start, self.total - self.count)
+
+    def view(self):
+        """(times, edges) of the edges held, oldest first"""
+        start = (self.total - self.count) % self.capacity
+        return self.times[start:start + self.count], self.edges[start:start + self.count]
+
+    def latest_byte(self):
+        """Times of the edges since the latest gap"""
+        times, _ = self.view()
+        return times[self.byte_start - (self.total - self.count):]
+
+    def visible(self, start, end):
+        """Edges drawn inside [start, end]: the ones in it plus the edge
+        before it, whose level holds into the window"""
+        times, edges = self.view()
+        lo = max(int(np.searchsorted(times, start, side='right')) - 1, 0)
+        hi = int(np.searchsorted(times, end, side='right'))
+        return times[lo:hi], edges[lo:hi]
+
+
+channel_data = defaultdict(StepBuffer)
+analog_data = StepBuffer(dtype=np.int16)  # the analog channel's samples, drawn as a line
+analog_line = None  # its Line2D, None without ANALOG_RATE
+ring = None  # SharedRing the ingest process writes the capture records to
+panel = None  # TelemetryPanel beside the waveforms, None without one
+annotations = None  # AnnotationOverlay of decoded bytes, None without one
+plot_stage = stage("plot")  # records the frames took from the ring; those lost to it count as shed
+plot_report = None  # StageReport of the plot process, set by main
+
+SERIAL_PORT = '/dev/tty.usbmodem385A439452311'  # Change to correct port if needed
+BAUDRATE = 115200
+# True for a USB_VENDOR_CLASS firmware build: read through libusb (bulk_port.py)
+BULK_USB = False
+# True for a USB_ISO_STREAM firmware build (also set BULK_USB and STREAM_FRAMED):
+# read the isochronous alternate setting through python-libusb1
+ISO_USB = False
+# True to read through the native ingest helper (la_ingest.c, build it first):
+# BULK_USB builds in the edge or snapshot format only
+NATIVE_INGEST = False
+NATIVE_HELPER = "./la_ingest"
+# The stream codec library (Core/Src/stream_codec.c of the interrupt firmware,
+# built as a shared library) to decode compact records and check frame CRCs
+# with; if it is not there, or None, they are decoded in Python
+NATIVE_CODEC = "./stream_codec.so"
+
+# The stream header the firmware sends after 'M' (protocol v5) sets these two;
+# for older firmware they must match the build: "edge" (EVENT_FORMAT_SNAPSHOT 0),
+# "snapshot" (EVENT_FORMAT_SNAPSHOT 1) or "compact" (STREAM_COMPACT 1)
+EVENT_FORMAT = "edge"
+# True for a STREAM_FRAMED firmware build: every transfer has a checked header
+STREAM_FRAMED = False
+STREAM_HEADER = struct.Struct('<I8B3I')  # StreamHeader, see host_cmd.h
+STREAM_HEADER_MAGIC = b'STRM'
+STREAM_ENCODINGS = {1: "edge", 2: "snapshot", 3: "blocks"}  # STREAM_ENCODING_*
+STREAM_COMPRESSIONS = {0: "none", 1: "compact", 2: "rle", 3: "predicted", 4: "decimated"}  # STREAM_COMPRESSION_*
+STREAM_FLAG_FRAMED = 0x01
+STREAM_FLAG_ISO = 0x02
+STREAM_FLAG_ADAPTIVE = 0x04
+HEADER_TIMEOUT_S = 0.5  # firmware without the header is taken as configured after this
+FRAME_SYNC = 0xA55A
+FRAME_STRUCT = struct.Struct('<HHII')  # sync, payload length, stream offset, CRC-32
+EDGE_TIME_BITS = 29
+SNAPSHOT_TIME_BITS = 24
+MARKER_EPOCH = 0  # in-band marker: the event time field wrapped
+MARKER_DROP = 1   # in-band marker: the ring overflowed, 3 payload words follow
+MARKER_DROP_WORDS = 3
+MARKER_INFO = 2   # in-band marker: reply to 'V', 5 payload words follow
+MARKER_INFO_WORDS = 5
+MARKER_SOF = 3    # in-band marker: USB frame count and clock time at that SOF follow
+MARKER_SOF_WORDS = 2
+MARKER_UART = 4   # in-band marker: start bit clock time and byte | status << 8 | channel << 16 follow
+MARKER_UART_WORDS = 2
+MARKER_WINDOW = 5  # in-band marker: a pre-trigger window starts, laid out as a drop marker
+MARKER_WINDOW_WORDS = 3
+MARKER_TRIGGER = 6  # in-band marker: the trigger's clock time follows
+MARKER_TRIGGER_WORDS = 1
+MARKER_BUS = 7  # in-band marker: clock time and byte | aux << 8 | flags << 16 | kind << 24 follow
+MARKER_BUS_WORDS = 2
+BUS_SPI = 0  # bus marker kind: a byte of the SPI sniffer, aux = the PB15 byte
+BUS_I2C = 1  # bus marker kind: an I2C START, STOP or byte, aux = the I2C_EVENT_*
+BUS_STORM = 2  # bus marker kind: a rate-limited channel's edge count, see storm_limit.h
+BUS_STATS = 3  # bus marker kind: 16 bits of an interrupt timing item, see irq_timing.h
+BUS_MEASURE = 4  # bus marker kind: 20 bits of a channel's window summary, see measure.h
+MEASURE_FIELDS = ("rises", "high", "span", "window")  # MEASURE_FIELD_*; window ends a summary
+BUS_HEALTH = 5  # bus marker kind: 20 bits of a link health counter, see event_format.h
+HEALTH_ITEMS = {0: "events", 1: "bytes", 2: "ring peak", 3: "ring words", 4: "dropped",
+                5: "usb busy", 6: "commands lost", 7: "exti max", 15: "period"}  # HEALTH_*; period ends a report
+BUS_CONFIG = 6  # bus marker kind: two argument bytes of a host command the device ran
+CONFIG_LAST = 0x80  # flags: the command's last record
+BUS_SYNC = 7  # bus marker kind: a shared reference pulse, 16-bit pulse count, see board_sync.h
+BUS_LEVELS = 8  # bus marker kind: CH1-CH4 levels read off the pins, and the channels streaming edges
+BUS_HANDOFF = 9  # bus marker kind: 'M' 2 hands over to poll blocks, the poll stream's header follows
+BUS_FLASH = 10  # bus marker kind: answer to 'O', 4 KiB blocks of the flash log and its state, see flash_log.h
+BUS_FILTER = 11  # bus marker kind: transactions an 'X' filter dropped, 16-bit count, FILTER_* bus
+FILTER_BUSES = {1: 'I2C', 2: 'UART'}  # FILTER_*, event_format.h
+BUS_ANALOG = 12  # bus marker kind: two 12-bit ADC samples, the second a period after the first
+BUS_ANALOG_PERIOD = 13  # bus marker kind: ticks between the analog samples that follow
+BUS_OVERLOAD = 14  # bus marker kind: edge words after it pair up on a coarser clock, or no longer do
+OVERLOAD_ENTER = 1  # flags: a dense region opens
+BUS_CREDIT = 15  # bus marker kind: 16-bit KiB of 'c' credit left, flags CREDIT_HELD | ring fill in 1/128ths
+CREDIT_HELD = 0x80  # flags: no credit held the stream
+BUS_TRIGGER_OUT = 16  # bus marker kind: 16-bit ticks from the trigger to the trigger-out pin rising, flags TRIG_OUT_*
+BUS_PULSE = 17  # bus marker kind: a pulse or lone edge of a pulse channel, its anchor, see pulse_record.h
+PULSE_BUS_WIDTH = 0x7FFFF  # BUS_PULSE width bits
+PULSE_FLAG_LEVEL, PULSE_FLAG_EDGE, PULSE_FLAG_OFF = 0x1, 0x2, 0x4  # BUS_PULSE flags, data bits 21-19
+BUS_RECONFIG = 18  # bus marker kind: an 's' commit ran byte commands, the edges held 16-bit ticks
+STAGE_COMMIT, STAGE_BEGIN = 0, 1  # 's' modes
+BUS_LATENCY = 19  # bus marker kind: LATENCY_PROBE_MS toggled PA0, or with LATENCY_SENT its edge's transfer completed
+LATENCY_SENT = 0x1  # BUS_LATENCY flags
+TRIG_OUT_COMPARE, TRIG_OUT_LATE = 0x01, 0x02  # flags: raised by TIM2's compare; the compare was missed, trigger.h
+TRIG_RECORD = 6  # 'G' type of the flight recorder, trigger.h
+CREDIT_START, CREDIT_ADD = 1, 2  # 'c' modes, event_ring.h
+CREDIT_QUEUE_FILL = 0.5  # no credit is granted while the host pipeline's queue is fuller than this
+ANALOG_VIEW_SAMPLES = 500  # analog samples in view when no edges set the window
+FILTER_PRINT_S = 5  # dropped transaction totals printed at most this often
+FLASH_LOG_STATES = ("idle", "erasing", "logging", "sending", "full", "absent")  # FLASH_LOG_*
+POLL_BLOCK_STRUCT = struct.Struct('<HHIIIBBH')  # magic, count, start, end, period, mask, bits, fixups
+POLL_FIXUP_STRUCT = struct.Struct('<HH')  # sample index, cycles late
+POLL_BLOCK_MAGIC = 0xB10C  # packed samples, see poll_capture.c
+POLL_BLOCK_MAGIC_HEADER = 0xB114  # the poll stream's StreamHeader
+POLL_BLOCK_MAGIC_HANDOFF = 0xB115  # edge clock time, CPU cycles and engine of an 'M' 2 handoff
+POLL_WORD_MAGICS = (0xB111, 0xB112, POLL_BLOCK_MAGIC_HEADER, POLL_BLOCK_MAGIC_HANDOFF)  # count = words
+CAPTURE_MODE_EVENTS = 0
+COMMAND_ARGUMENTS = {'F': 7, 'M': 1, 'C': 7, 'R': 1, 'T': 6, 'U': 6, 'G': 12, 'P': 2, 'I': 2,
+                     'W': 5, 'E': 1, 'K': 7, 'H': 1, 'N': 1, 'Q': 3, 'L': 4, 'Y': 3, 'J': 1, 'O': 1, 'X': 4, 'Z': 3, 'a': 4, 'c': 3, 'p': 2, 's': 1, 'd': 8, 'g': 3}  # argument bytes, host_cmd.h
+IRQ_ITEM_HIGH = 0x80  # the record holds bits 31-16 of the item's value
+IRQ_TIMERS = ("EXTI handler", "EXTI entry to timestamp", "USB handler", "main loop flush",
+              "CDC_Transmit_FS", "USB packet copy")
+IRQ_LAYOUTS = ("flat", "edges first", "USB first")  # 'N' layouts
+PAYLOAD_WORDS = {MARKER_DROP: MARKER_DROP_WORDS, MARKER_INFO: MARKER_INFO_WORDS,
+                 MARKER_SOF: MARKER_SOF_WORDS, MARKER_UART: MARKER_UART_WORDS,
+                 MARKER_WINDOW: MARKER_WINDOW_WORDS, MARKER_TRIGGER: MARKER_TRIGGER_WORDS,
+                 MARKER_BUS: MARKER_BUS_WORDS}
+# HOST_CAP_* bits of the 'V' reply, see host_cmd.h
+CAPABILITIES = ["events", "poll", "dma", "burst", "rle", "stats", "flush",
+                "snapshot", "compact", "ic_dma", "bulk", "framed", "bench", "sof_sync", "iso",
+                "uart", "trigger", "spi", "i2c", "glitch", "channels", "storm", "clock", "layout", "measure",
+                "trim", "wide", "sync", "dual", "adaptive", "flash_log", "decimate"]
+epoch = 0  # number of time field wraps seen so far
+last_time = 0  # extended time of the last decoded event
+epoch_unsure = False  # bytes were lost: an epoch marker may have gone with them
+payload = []  # raw words collected for the current marker
+payload_type = None
+payload_left = 0
+drop_log = []  # (lost count, start, end) regions not yet logged
+drop_regions = []  # regions to shade on the plot, from the ring's drop notes
+drawn_drops = 0
+clock_sync = ClockSync()  # firmware clock -> host time, from SOF markers
+sync_log = []  # (frame, time, host time) pairs not yet logged
+uart_log = []  # (time, channel, byte, status) of device-decoded bytes not yet logged
+trigger_log = []  # device trigger times not yet logged
+board_sync_log = []  # (time, flags) of reference pulses not yet logged
+levels_log = []  # (time, levels, channels) of level snapshots not yet logged
+spi_log = []  # (time, PB5 byte, PB15 byte, flags) of device-received SPI bytes not yet logged
+i2c_log = []  # (time, event, byte, flag) of device-framed I2C events not yet logged
+storm_log = []  # (window end, channel, count, level, calm) of edge storm summaries not yet logged
+analog_log = []  # (time, sample) of analog samples not yet logged
+analog_period = 0  # ticks between analog samples, from BUS_ANALOG_PERIOD
+overload_bits = 0  # quantum bits of the dense region the edge words are in, 0 outside one
+stream_bytes = 0  # bytes read_events took from the port
+credit_granted = 0  # stream_bytes the device's 'c' credit covers
+flash_log_replies = []  # (state, KiB used) of BUS_FLASH answers, for flash_log.py
+filter_dropped = {}  # FILTER_* bus -> transactions its 'X' filter dropped so far
+filter_printed = 0.0  # monotonic time the totals were last printed
+irq_stats = {}  # items of the interrupt timing report being received
+measure_window = {}  # channel -> fields of the summary being received
+measure_totals = {}  # channel -> summed summaries since the last measurement print
+last_measure_print = 0.0
+health_report = {}  # items of the link health report being received
+health_dropped = 0  # events the health reports counted lost
+config_echo = bytearray()  # argument bytes of the command echo being received
+device_config = {}  # opcode -> argument bytes of the last command the device echoed
+telemetry = None  # Telemetry of the plot's health panel, set by ingest
+latency_probe = None  # LatencyProbe of LATENCY_PROBE, set by ingest
+latency_report = None  # its LatencyReport in the plot process
+port_reader = None  # PortReader of INGEST_REALTIME, set by ingest
+stall_meter = None  # StallMeter of the reader, set by ingest
+capacity = None  # CapacityEstimator fed by the health reports, set by configure with CAPACITY_PLAN
+capacity_limits = []  # storm limits it asked for, sent by send_capacity_limits
+device_caps = 0  # HOST_CAP_* bits from the stream header or the 'V' reply
+stream_clock_hz = None  # timestamp clock from the stream header or the 'V' reply
+stream_head = bytearray()  # bytes read behind the stream header, decoded first
+control_pending = bytearray()  # control endpoint bytes of a record not complete yet
+pulse_anchor = {}  # pulse channel -> end of its last record, None until its next BUS_PULSE
+poll_stretch = None  # PollStretch while an 'M' 2 firmware sends poll blocks
+DRIFT_EVERY = 100  # SOF pairs between drift reports
+CAPTURE_PATH = "bitlog.lacap"  # None: no capture file, the sinks alone (bus_monitor.py)
+FLUSH_EVERY_S = 1.0  # bitlog.lacap buffer flush period
+SEGMENT_MB = 0  # soak tests: start a new bitlog-NNNN.lacap segment after this many MB, 0 = one file
+SEGMENT_MINUTES = 0  # ... or after this many minutes, 0 = never
+TRANSCODE_WORKERS = 0  # with segments: pack each finished one into an archive and tiles on this many background processes (capture_transcode.py), 0 = off
+LIVE_STATS_S = 0  # print edge rates and losses this often while capturing, 0 = never
+STAGE_STATS_S = 0  # e.g. 5: print what each host stage did this often, from both processes, 0 = never
+STAGE_STATS_JSON = "stage_stats-{role}.json"  # SIGUSR1 writes every stage's counters here, None = off
+STATS_EVERY_S = 0  # IRQ_TIMING firmware: ask for interrupt timing statistics this often, 0 = never
+# interrupt priority layout: 0 flat (power-up), 1 edge capture preempts USB, 2 USB preempts it
+IRQ_LAYOUT = None
+LIVE_UART = None  # (channel index, baud), e.g. (0, 115200): print that channel's UART bytes while capturing
+LIVE_SKIP_LAG_S = 2.0  # LIVE_UART falling this far behind skips to the latest batch, None = never
+LIVE_SKIP_LOG = "live_skips.csv"  # the capture time ranges it skipped, to decode offline, None = off
+PROTOCOL_STATS_S = 0  # e.g. 10: print rolling I2C/UART/SPI rates of the decoded bus this often, 0 = never
+PROTOCOL_STATS_BAUD = 115200  # UART's baud for them
+PROTOCOL_STATS_CSV = None  # e.g. "protocol_stats.csv": also append every report to it
+LIVE_EXPORT = None  # "bitlog.vcd" or "bitlog.sr": also write the capture for PulseView/GTKWave (trace_export.py)
+LIVE_PCAP = None  # (path, UART baud), e.g. ("live.pcapng", 115200): also write the decoded frames for Wireshark (pcap_output.py)
+SERVE_PORT = None  # e.g. 7878: serve the live capture to remote clients over TCP/WebSocket (capture_server.py)
+# (channel index, baud, data bits, parity 'N'/'E'/'O'), e.g. (0, 1000000, 8, 'N'): a
+# UART_DECODE firmware decodes that channel itself and streams bytes instead of its edges
+DEVICE_UART = None
+# (type, channel, value, mask, param, pre words, post events), e.g. (1, 0, 0, 0, 0, 1024, 0):
+# a CAPTURE_TRIGGER firmware holds the stream until a falling edge on CH1, then sends the
+# 1024 ring words before it and everything after; see trigger.h for the types
+TRIGGER = None
+# (ring words, ms), e.g. (0, 2000): instead of TRIGGER, a CAPTURE_TRIGGER firmware keeps a
+# flight recorder (TRIG_RECORD) and sends nothing until asked; pressing d in the plot
+# window dumps its newest ms (0: all) of history, at most that many ring words (0: all)
+RECORDER = None
+# (mode 0-3, chip select channel index or None, PB15 too), e.g. (0, 0, True): a
+# CAPTURE_SPI_DMA firmware receives PB5 (and PB15) with its SPI peripherals and
+# streams bytes instead of edges; SCK must also be wired to PB3 (and PB13)
+DEVICE_SPI = None
+# (chip select channel index, gated channel mask, active level), e.g. (0, 0b0110, 0): an
+# SS_GATE firmware masks those channels' interrupts while the chip select is not at the
+# level, so a shared bus's transfers to other devices never reach the ring or the link
+SS_GATE = None
+# (SCL channel index, SDA channel index), e.g. (0, 1): an I2C_SNIFF firmware frames
+# the bus itself and streams START, STOP and bytes instead of the two channels' edges
+DEVICE_I2C = None
+# (7-bit address, address mask), e.g. (0x50, 0x7C): with DEVICE_I2C the firmware keeps
+# only transactions to matching addresses and counts the others ('X', protocol 6)
+DEVICE_I2C_FILTER = None
+# (first byte, mask, idle frames ending a message), e.g. (0xAA, 0xFF, 2): with DEVICE_UART
+# the firmware keeps only messages starting with a matching byte and counts the others
+DEVICE_UART_FILTER = None
+# (channel index or None for all, minimum pulse width in ns), e.g. (None, 200): a
+# GLITCH_FILTER firmware drops shorter pulses before they reach the stream
+GLITCH_FILTER = None
+# bit n set to capture channel n, e.g. 0b0011 for two UART lines: the others' EXTI
+# lines are switched off, so floating inputs cost no ISR time or ring space
+CHANNEL_MASK = None
+# (channel index or None for all, edges per second, burst edges), e.g. (None, 100000, 64):
+# a STORM_LIMIT firmware sends a channel's edge count every STORM_WINDOW_US instead of
+# its edges while it toggles faster than that
+STORM_LIMIT = None
+# timestamp clock preset: 0 72 MHz (13.9 ns ticks, 32-bit time wraps after 60 s) ... 4 5.14 MHz
+# (power-up) ... 6 1 MHz (72 min), see host_cmd.h; the 'V' reply reports the clock in use
+CLOCK_PRESET = None
+# (channel mask, summaries per second), e.g. (0b0011, 100): a CHANNEL_MEASURE firmware sends
+# those channels' rising edge count, high time and period span instead of their edges;
+# mask 0x10 counts channel index 2 (PB6) with a timer instead, for inputs up to ~36 MHz
+MEASURE = None
+# True: 'M' 2, an ADAPTIVE_RATE firmware streams edges while their rate allows and
+# poll blocks above it; the blocks come back as edges and snapshots on the edge clock
+ADAPTIVE = False
+# (mode, period in ms), e.g. (2, 100) on one board and (1, 0) on the others: a BOARD_SYNC
+# firmware drives (2) or only timestamps (1) a pulse shared by several analyzers, so
+# board_merge.py can put their captures on one timeline; see board_sync.h for the wiring
+BOARD_SYNC = None
+# (CH1, CH2, CH3, CH4) ns, as skew_calibrate.py prints them: each channel's interrupt
+# latency against CH1, taken off its edges so simultaneous edges share a time
+CHANNEL_SKEW_NS = None
+# samples per second, e.g. 10000: an ANALOG_CAPTURE firmware samples PA1 with its ADC on
+# the edge clock and sends the samples beside the edges; they are plotted below them
+ANALOG_RATE = None
+# KiB, e.g. 256: a FLOW_CREDIT firmware sends at most this much stream the ingest process has
+# not read and passed on; when it falls behind, the device holds edges in its ring (and pairs
+# them, with OVERLOAD_PAIRING) instead of losing them in the OS buffers. Not with ISO_USB
+FLOW_CREDIT_KIB = None
+# (channel mask, levels), e.g. (0b0001, 0b0001): a PULSE_RECORDS firmware sends each high
+# (levels bit set) or low pulse of those channels as one word instead of two edges, which
+# halves the ring and link load of step clocks, PWM and the like; they come back as edges
+PULSES = None
+# Edge-to-display latency, with LATENCY_PROBE_MS firmware and PA0 wired to a probe channel:
+# the channel's index, e.g. 3, prints p50/p99 of each stage (latency_probe.py); None = off
+LATENCY_PROBE = None
+LATENCY_REPORT_S = 10.0  # ... this often
+MEASURE_PRINT_S = 1.0  # print the measured frequency and duty this often
+READ_TIMEOUT_S = 0.5  # longest the ingest process waits before checking for exit
+# raise the reader's priority (SCHED_FIFO, THREAD_PRIORITY_TIME_CRITICAL where permitted), pin it to
+# INGEST_CORE, read into a preallocated buffer and freeze the heap before the loop (ingest_priority.py)
+INGEST_REALTIME = False
+INGEST_CORE = None  # core the reader is pinned to, None = the last one
+INGEST_READ_KB = 4096  # its read buffer, and the Windows driver's
+STALL_REPORT_S = 0  # e.g. 10: print the reader's scheduling stalls this often, 0 = never (they go to the health panel)
+HEALTH_PANEL = True  # show the link health panel beside the waveforms (telemetry.py)
+HEALTH_EVERY_S = 0.2  # the panel's host figures are refreshed this often
+CAPACITY_PLAN = False  # predict the link headroom and time to a ring overflow from the health reports (capture_plan.py)
+CAPACITY_WARN_S = 10.0  # warn when the ring would overflow within this many seconds
+CAPACITY_AUTO = False  # then also storm-limit every channel to the rate the link sustains
+VIEWER = "matplotlib"  # or "gl": the OpenGL viewer for millions of edges (gl_viewer.py, needs vispy)
+GL_FOLLOW_WINDOW = 50000  # ticks the OpenGL viewer shows while following
+ANNOTATE = False  # label the waveforms with the bytes decoded as they arrive (live_annotations.py)
+ANNOTATE_BAUD = 115200  # UART's baud for the labels
 
 # ========================
 # User Setup Phase
 # ========================
 
 def get_comm_type():
-    comm_type = input("Enter communication type (UART, SPI, I2C): ").strip().upper()
-    if comm_type not in {"UART", "SPI", "I2C"}:
+    comm_type = input("Enter communication type (UART, SPI, I2C, AUTO to identify it): ").strip().upper()
+    if comm_type not in {"UART", "SPI", "I2C", "AUTO"}:
         print("Invalid communication type.")
         exit(1)
     return comm_type
@@ -37,90 +392,1528 @@ def get_channel_mapping(comm_type):
     elif comm_type == "I2C":
         mapping[0] = input("Assign channel CH1 to (CLK or SDA): ").strip().upper()
         mapping[1] = input("Assign channel CH2 to (CLK or SDA): ").strip().upper()
+    elif comm_type == "AUTO":
+        mapping = auto_mapping(4)  # protocol_id.py names the roles once it has seen the bus
     return mapping
 
+FLUSH_MODES = {"LATENCY": 0, "BATCH": 1, "ADAPTIVE": 2}  # firmware FLUSH_* policies
+
+def get_flush_policy():
+    """Asks how the firmware should batch events into USB transfers:
+    LATENCY for interactive debugging, BATCH or ADAPTIVE for long captures"""
+    mode = input("Flush mode (LATENCY, BATCH, ADAPTIVE) [BATCH]: ").strip().upper() or "BATCH"
+    if mode not in FLUSH_MODES:
+        print("Invalid flush mode.")
+        exit(1)
+    if mode == "LATENCY":
+        batch = 1
+        latency_us = int(input("Latency bound in us [200]: ").strip() or 200)
+    else:
+        batch = int(input("Batch size in events [16]: ").strip() or 16)
+        latency_us = int(input("Latency bound in us [2000]: ").strip() or 2000)
+    return FLUSH_MODES[mode], batch, latency_us
+
+def send_event_mode(ser):
+    # 'M' mode(1): the combined firmware image restarts its edge engine
+    # behind a stream header, 2 adaptively; drop whatever the old stream still had
+    ser.write(struct.pack('<cB', b'M', 2 if ADAPTIVE else 0))
+    if not read_stream_header(ser):
+        ser.reset_input_buffer()
+
+def send_flush_policy(ser, mode, batch, latency_us):
+    # 'F' mode(1) batch(2) latency_us(4), see host_cmd.h
+    ser.write(struct.pack('<cBHI', b'F', mode, batch, latency_us))
+
+def send_uart_decode(ser, channel, baud, data_bits=8, parity='N'):
+    # 'U' channel(1) baud(4) frame(1): data bits in bits 3-0, parity in bits 5-4
+    frame = data_bits | {'N': 0, 'E': 1, 'O': 2}[parity.upper()] << 4
+    ser.write(struct.pack('<cBIB', b'U', channel, baud, frame))
+
+def send_trigger(ser, trig_type, channel, value, mask, param, pre, post):
+    # 'G' type(1) channel(1) value(1) mask(1) param(4) pre(2) post(4), see trigger.h
+    ser.write(struct.pack('<cBBBBIHI', b'G', trig_type, channel, value, mask, param, pre, post))
+
+def send_dump(ser, words, ms):
+    # 'd' words(4) ms(4): the armed trigger's window, cut to the newest of both (0: all)
+    ser.write(struct.pack('<cII', b'd', words, ms))
+
+def send_spi_sniff(ser, mode, cs_channel=None, miso=False):
+    # 'P' mode(1) cs_channel(1): SPI mode in bits 1-0, bit 3 also PB15, bit 7 on
+    ser.write(struct.pack('<cBB', b'P', 0x80 | (0x08 if miso else 0) | mode,
+                          0xFF if cs_channel is None else cs_channel))
+
+def send_ss_gate(ser, ss_channel, mask, level):
+    # 'g' ss(1) mask(1) level(1): ss None stops
+    ser.write(struct.pack('<cBBB', b'g', 0xFF if ss_channel is None else ss_channel, mask, level))
+
+def send_i2c_sniff(ser, scl_channel, sda_channel):
+    # 'I' scl(1) sda(1): scl 0xFF stops
+    ser.write(struct.pack('<cBB', b'I', scl_channel, sda_channel))
+
+def send_bus_filter(ser, bus, match, mask, gap=0):
+    # 'X' bus(1) match(1) mask(1) gap(1): bus 1 I2C address, 2 UART first byte; mask 0 keeps all
+    ser.write(struct.pack('<cBBBB', b'X', bus, match, mask, gap))
+
+def send_glitch_filter(ser, channel, width_ns):
+    # 'W' channel(1) width_ns(4): channel 0xFF = all, width 0 stops
+    ser.write(struct.pack('<cBI', b'W', 0xFF if channel is None else channel, width_ns))
+
+def send_channel_mask(ser, mask):
+    # 'E' mask(1): bit n keeps channel n's EXTI line on
+    ser.write(struct.pack('<cB', b'E', mask))
+
+def send_storm_limit(ser, channel, rate, burst):
+    # 'K' channel(1) rate(4) burst(2): channel 0xFF = all, rate 0 stops
+    ser.write(struct.pack('<cBIH', b'K', 0xFF if channel is None else channel, rate, burst))
+
+def send_clock_preset(ser, preset):
+    # 'H' preset(1): restarts the edge stream and answers with an info marker
+    ser.write(struct.pack('<cB', b'H', preset))
+
+def send_measure(ser, mask, rate):
+    # 'Q' mask(1) rate_hz(2): rate 0 stops
+    ser.write(struct.pack('<cBH', b'Q', mask, rate))
+
+def send_board_sync(ser, mode, period_ms):
+    # 'Y' mode(1) period_ms(2): 0 off, 1 listen on PA2, 2 also drive PA8
+    ser.write(struct.pack('<cBH', b'Y', mode, period_ms))
+
+def send_analog(ser, rate_hz):
+    # 'a' rate_hz(4): 0 stops
+    ser.write(struct.pack('<cI', b'a', rate_hz))
+
+def send_credit(ser, mode, kib):
+    # 'c' mode(1) kib(2): CREDIT_START, CREDIT_ADD or 0 for no limit
+    ser.write(struct.pack('<cBH', b'c', mode, min(kib, 0xFFFF)))
+
+def send_pulses(ser, mask, levels):
+    # 'p' mask(1) levels(1): mask 0 stops
+    ser.write(struct.pack('<cBB', b'p', mask, levels))
+
+def send_staged(ser, *commands):
+    # 's' mode(1) around commands, each (send function, arguments...): a CONFIG_STAGE
+    # firmware runs them together at one point of a running capture, edges held meanwhile
+    ser.write(struct.pack('<cB', b's', STAGE_BEGIN))
+    for send, *args in commands:
+        send(ser, *args)
+    ser.write(struct.pack('<cB', b's', STAGE_COMMIT))
+
+def grant_credit(ser):
+    """Grants the device back the stream read since the last grant, in
+    steps of at least a quarter of FLOW_CREDIT_KIB"""
+    global credit_granted
+    kib = (stream_bytes - credit_granted) >> 10
+    if kib >= max(FLOW_CREDIT_KIB // 4, 1):
+        send_credit(ser, CREDIT_ADD, kib)
+        credit_granted += min(kib, 0xFFFF) << 10
+
+def send_irq_layout(ser, layout):
+    # 'N' layout(1), see irq_timing.h
+    ser.write(struct.pack('<cB', b'N', layout))
+
+def send_info_request(ser):
+    # 'V': the firmware answers in-band with an info marker
+    ser.write(b'V')
+
+def stream_header_valid(raw):
+    """True if raw starts with a StreamHeader whose check word matches"""
+    words = struct.unpack_from('<6I', raw)
+    check = 0
+    for word in words[:5]:
+        check ^= word
+    return words[5] == ~check & 0xFFFFFFFF
+
+def take_stream_header(data, quiet=False):
+    """Takes EVENT_FORMAT, STREAM_FRAMED and the clock from the valid
+    StreamHeader data starts with; returns its size. quiet leaves out
+    the summary, for the headers of 'M' 2 handoffs"""
+    global EVENT_FORMAT, STREAM_FRAMED, stream_clock_hz, overload_bits, device_caps
+    (_, version, size, encoding, compression, channels, flags, time_bits, protocol,
+     tick_hz, caps, _) = STREAM_HEADER.unpack_from(data)
+    if compression in (1, 3):
+        EVENT_FORMAT = "compact"
+        compact_decoder.restart(compression == 3)
+    elif encoding in (1, 2):
+        EVENT_FORMAT = STREAM_ENCODINGS[encoding]
+    else:
+        print(f"WARNING: the firmware streams {STREAM_ENCODINGS.get(encoding, encoding)}, "
+              f"not edges; keeping EVENT_FORMAT = {EVENT_FORMAT!r}")
+    STREAM_FRAMED = bool(flags & STREAM_FLAG_FRAMED)
+    stream_clock_hz = tick_hz
+    device_caps = caps
+    overload_bits = 0  # a new stream starts exact
+    pulse_anchor.clear()  # and with edges until a channel's first BUS_PULSE
+    if not quiet:
+        names = [name for bit, name in enumerate(CAPABILITIES) if caps & (1 << bit)]
+        print(f"Stream header v{version} (protocol v{protocol}): {EVENT_FORMAT} events, "
+              f"{channels} channels, {time_bits}-bit times at {tick_hz} Hz"
+              + (", framed" if STREAM_FRAMED else "") + (", isochronous" if flags & STREAM_FLAG_ISO else "")
+              + (", adaptive" if flags & STREAM_FLAG_ADAPTIVE else "")
+              + f"; capabilities: {', '.join(names) or 'none'}")
+    return max(size, STREAM_HEADER.size)
+
+def read_stream_header(ser):
+    """Waits for the StreamHeader that opens the stream after 'M' and
+    takes EVENT_FORMAT, STREAM_FRAMED and the clock from it; the bytes
+    behind it go to read_events. False if none came within
+    HEADER_TIMEOUT_S (firmware before protocol v5): the configured
+    format stands"""
+    data = bytearray()
+    deadline = time.monotonic() + HEADER_TIMEOUT_S
+    while time.monotonic() < deadline:
+        data += ser.read(ser.in_waiting or 1)
+        at = data.find(STREAM_HEADER_MAGIC)
+        while at >= 0 and len(data) - at >= STREAM_HEADER.size:
+            if stream_header_valid(data[at:]):
+                break
+            at = data.find(STREAM_HEADER_MAGIC, at + 1)
+        if at < 0:
+            del data[:-3]  # a magic may straddle two reads
+            continue
+        del data[:at]  # the old stream
+        if len(data) < STREAM_HEADER.size:
+            continue
+        stream_head[:] = data[take_stream_header(data):]
+        return True
+    print(f"No stream header within {HEADER_TIMEOUT_S} s: "
+          f"decoding as configured, EVENT_FORMAT = {EVENT_FORMAT!r}, STREAM_FRAMED = {STREAM_FRAMED}")
+    return False
+
 # ========================
 # USB Handler
 # ========================
 
+def extend_clock(clock):
+    """Places a raw 32-bit firmware clock value on the host timeline,
+    nearest to the last decoded event"""
+    diff = (clock - last_time) & 0xFFFFFFFF
+    if diff >= 1 << 31:
+        diff -= 1 << 32
+    return last_time + diff
+
+def report_drop(count, start, end):
+    """Queues a ring overflow region for the capture, which passes it on
+    to the plot"""
+    drop_log.append((count, start, end))
+    print(f"WARNING: {count} events lost between t={start} and t={end}")
+
+def print_info(version, caps, clock_hz, tx_queue_peak=None, glitches=None):
+    """Shows the firmware's reply to 'V'"""
+    global stream_clock_hz, device_caps
+    stream_clock_hz = clock_hz
+    device_caps = caps
+    names = [name for bit, name in enumerate(CAPABILITIES) if caps & (1 << bit)]
+    print(f"Firmware protocol v{version}, {clock_hz} Hz timestamps, "
+          f"capabilities: {', '.join(names) or 'none'}")
+    if tx_queue_peak is not None:
+        # 1 means USB always kept up; the firmware's USB_TX_QUEUE means
+        # producers found the transmit queue full
+        print(f"USB transmit queue high-water mark: {tx_queue_peak}")
+    if glitches:
+        print(f"Glitch filter: {glitches} pulses shorter than the minimum width dropped")
+
+def report_sync(frame, sof_time):
+    """Feeds one SOF pair to the clock fit and queues it for the CSV log
+    with the host time it maps to"""
+    clock_sync.add(frame, sof_time & 0xFFFFFFFF)
+    sync_log.append((frame, sof_time, clock_sync.to_host(sof_time & 0xFFFFFFFF)))
+    drift = clock_sync.drift_ppm(stream_clock_hz) if stream_clock_hz else None
+    if drift is not None and len(clock_sync.pairs) % DRIFT_EVERY == 0:
+        print(f"Firmware clock {drift:+.1f} ppm against the USB frame clock")
+
+def report_uart(start, word):
+    """Queues a byte the firmware decoded for the capture"""
+    uart_log.append((start, (word >> 16) & 0x3, word & 0xFF, (word >> 8) & 0x3))
+
+def report_bus(clock, word):
+    """Queues a byte or bus condition the firmware's bus sniffer sent for
+    the capture"""
+    global poll_stretch, analog_period, overload_bits
+    if word >> 24 == BUS_SPI:
+        spi_log.append((clock, word & 0xFF, (word >> 8) & 0xFF, (word >> 16) & 0xFF))
+    elif word >> 24 == BUS_I2C:
+        i2c_log.append((clock, (word >> 8) & 0x3, word & 0xFF, (word >> 16) & 0x1))
+    elif word >> 24 == BUS_STORM:
+        flags = (word >> 16) & 0xFF
+        storm_log.append((clock, flags & 0x3, word & 0xFFFF, (flags >> 2) & 1, bool(flags & 0x8)))
+        if not flags & 0x8:
+            print(f"WARNING: CH{(flags & 0x3) + 1} rate-limited, {word & 0xFFFF} edges summarised up to t={clock}")
+    elif word >> 24 == BUS_STATS:
+        item = (word >> 16) & 0x7F
+        if word & (IRQ_ITEM_HIGH << 16):
+            irq_stats[item] = irq_stats.get(item, 0) | (word & 0xFFFF) << 16
+        elif item == 0:
+            print_irq_stats(word & 0xFFFF, irq_stats)
+            irq_stats.clear()
+        else:
+            irq_stats[item] = word & 0xFFFF
+    elif word >> 24 == BUS_MEASURE:
+        report_measure((word >> 22) & 0x3, MEASURE_FIELDS[(word >> 20) & 0x3], word & 0xFFFFF)
+    elif word >> 24 == BUS_HEALTH:
+        report_health(HEALTH_ITEMS.get((word >> 20) & 0xF), word & 0xFFFFF)
+    elif word >> 24 == BUS_CONFIG:
+        report_config((word >> 16) & 0xFF, word & 0xFFFF)
+    elif word >> 24 == BUS_SYNC:
+        board_sync_log.append((clock, (word >> 16) & 0xFF))
+    elif word >> 24 == BUS_LEVELS:
+        levels_log.append((clock, word & 0x0F, (word >> 8) & 0x0F))
+    elif word >> 24 == BUS_HANDOFF:
+        poll_stretch = PollStretch(clock)
+    elif word >> 24 == BUS_FLASH:
+        state = (word >> 16) & 0xFF
+        flash_log_replies.append((FLASH_LOG_STATES[state] if state < len(FLASH_LOG_STATES) else state,
+                                  (word & 0xFFFF) * 4))
+        print("Flash log {}, {} KiB used".format(*flash_log_replies[-1]))
+    elif word >> 24 == BUS_FILTER:
+        report_filter((word >> 16) & 0xFF, word & 0xFFFF)
+    elif word >> 24 == BUS_ANALOG_PERIOD:
+        analog_period = word & 0xFFFFFF
+    elif word >> 24 == BUS_ANALOG:
+        analog_log.extend(((clock, word & 0xFFF), (clock + analog_period, (word >> 12) & 0xFFF)))
+    elif word >> 24 == BUS_CREDIT:
+        report_credit(clock, word & 0xFFFF, (word >> 16) & 0xFF)
+    elif word >> 24 == BUS_TRIGGER_OUT:
+        report_trigger_out(clock, word & 0xFFFF, (word >> 16) & 0xFF)
+    elif word >> 24 == BUS_LATENCY:
+        if latency_probe is not None and (word >> 16) & LATENCY_SENT:
+            latency_probe.sent(word & 0xFF, clock, clock_sync.to_host(clock & 0xFFFFFFFF), stream_clock_hz)
+        elif latency_probe is not None:
+            latency_probe.toggle(word & 0xFF, clock)
+    elif word >> 24 == BUS_RECONFIG:
+        print(f"Reconfigured at t={clock}: {word & 0xFF} staged commands, edges held {(word >> 8) & 0xFFFF} ticks")
+    elif word >> 24 == BUS_OVERLOAD:
+        fill = 100 * ((word >> 8) & 0xFF) // 256
+        if (word >> 16) & OVERLOAD_ENTER:
+            overload_bits = word & 0xFF
+            print(f"WARNING: ring {fill}% full at t={clock}: edges pair up on a {1 << overload_bits}-tick clock")
+        else:
+            overload_bits = 0
+            print(f"Ring drained to {fill}% at t={clock}: edges exact again")
+
+def report_pulse(clock, word):
+    """Returns the edges of a BUS_PULSE record as (edge, channel, time);
+    the record's time is its channel's anchor for the pulse words after
+    it, or with PULSE_FLAG_OFF the channel streams edges again"""
+    channel = (word >> 22) & 0x3
+    flags = (word >> 19) & 0x7
+    level = flags & PULSE_FLAG_LEVEL
+    if flags & PULSE_FLAG_OFF:
+        pulse_anchor.pop(channel, None)
+        return []
+    pulse_anchor[channel] = clock
+    if flags & PULSE_FLAG_EDGE:
+        return [(level, channel, clock)]
+    return [(level, channel, clock - (word & PULSE_BUS_WIDTH)), (level ^ 1, channel, clock)]
+
+def forget_pulse_anchors():
+    """The records a pulse word counts from may be lost: skip the words
+    until each channel's next BUS_PULSE"""
+    for channel in pulse_anchor:
+        pulse_anchor[channel] = None
+
+def report_trigger_out(clock, ticks, flags):
+    """Shows when the trigger-out pin rose after the trigger edge, the
+    offset to take off another instrument's trigger time"""
+    delay = f"{ticks} ticks" if not stream_clock_hz else f"{ticks} ticks ({ticks * 1e9 / stream_clock_hz:.0f} ns)"
+    if flags & TRIG_OUT_LATE:
+        print(f"WARNING: trigger out at t={clock} missed its compare, raised {delay} after the edge; raise TRIGGER_OUT_DELAY")
+    else:
+        how = "compare" if flags & TRIG_OUT_COMPARE else "interrupt"
+        print(f"Trigger out rose {delay} after the edge at t={clock} ({how})")
+
+def report_credit(clock, kib, flags):
+    """Shows the device's credit and ring fill on the health panel; a
+    held stream means the ingest process fell behind"""
+    fill = 100.0 * (flags & 0x7F) / 128
+    if flags & CREDIT_HELD:
+        print(f"WARNING: ingest behind, the device held the stream at t={clock} with its ring {fill:.0f}% full")
+    if telemetry is not None:
+        telemetry.update({"device credit KiB": kib, "device ring %": fill})
+
+def report_filter(bus, count):
+    """Adds a filter's dropped transactions to its total, printed every
+    FILTER_PRINT_S"""
+    global filter_printed
+    filter_dropped[bus] = filter_dropped.get(bus, 0) + count
+    if time.monotonic() - filter_printed >= FILTER_PRINT_S:
+        filter_printed = time.monotonic()
+        print("Filtered out on the device: " + ", ".join(
+            f"{total} {FILTER_BUSES.get(b, b)}" for b, total in sorted(filter_dropped.items())))
+
+def report_config(flags, data):
+    """Collects a command echo and records the settings the device runs
+    with once its last record arrives; the echo's padding byte is cut
+    to the command's length"""
+    config_echo.extend(data.to_bytes(2, 'little'))
+    if not flags & CONFIG_LAST:
+        return
+    opcode = chr(flags & 0x7F)
+    arguments = bytes(config_echo[:COMMAND_ARGUMENTS.get(opcode, len(config_echo))])
+    config_echo.clear()
+    device_config[opcode] = arguments
+    print(f"Device ran '{opcode}' {arguments.hex(' ')}")
+
+def report_health(item, value):
+    """Collects a link health report and hands its rates to the health
+    panel once the period that ends it arrives"""
+    global health_dropped
+    health_report[item] = value
+    if item != "period":
+        return
+    seconds = max(value, 1) / 1e6
+    health_dropped += health_report.get("dropped", 0)
+    if capacity is not None and health_report.get("ring words"):
+        limit = capacity.update(health_report.get("events", 0) / seconds, health_report.get("bytes", 0) / seconds,
+                                health_report.get("ring peak", 0) / health_report["ring words"],
+                                health_report["ring words"])
+        if limit and device_caps & (1 << CAPABILITIES.index("storm")):
+            capacity_limits.append(limit)
+        elif limit:
+            print("Capacity: the firmware has no storm limit (STORM_LIMIT 0); nothing to fall back to")
+    if telemetry is not None:
+        telemetry.update({
+            "events/s": health_report.get("events", 0) / seconds,
+            "bytes/s": health_report.get("bytes", 0) / seconds,
+            "ring peak %": 100.0 * health_report.get("ring peak", 0) / max(health_report.get("ring words", 1), 1),
+            "dropped/s": health_report.get("dropped", 0) / seconds,
+            "dropped total": health_dropped,
+            "USB busy/s": health_report.get("usb busy", 0) / seconds,
+            "commands lost": health_report.get("commands lost", 0)})
+        if "exti max" in health_report:
+            telemetry.update({"EXTI max cycles": health_report["exti max"]})
+    health_report.clear()
+
+def report_measure(channel, field, value):
+    """Collects a channel's window summaries and prints its frequency and
+    duty cycle every MEASURE_PRINT_S"""
+    global last_measure_print
+    fields = measure_window.setdefault(channel, {})
+    fields[field] = value
+    if field != "window":
+        return
+    total = measure_totals.setdefault(channel, {"rises": 0, "high": 0, "window": 0,
+                                                 "periods": 0, "span": 0, "timer": False})
+    total["rises"] += fields.get("rises", 0)
+    total["window"] += value
+    total["timer"] = "high" not in fields  # TIM4 counts: no high time or span
+    total["high"] += fields.get("high", 0)
+    if fields.get("rises", 0) > 1:
+        total["periods"] += fields["rises"] - 1
+        total["span"] += fields["span"]
+    measure_window.pop(channel)
+    if not stream_clock_hz or time.monotonic() - last_measure_print < MEASURE_PRINT_S:
+        return
+    last_measure_print = time.monotonic()
+    for ch, t in sorted(measure_totals.items()):
+        seconds = t["window"] / stream_clock_hz
+        if t["span"]:
+            hz = t["periods"] * stream_clock_hz / t["span"]
+        else:
+            hz = t["rises"] / seconds if seconds else 0.0
+        duty = "" if t["timer"] else f", duty {100.0 * t['high'] / max(t['window'], 1):.1f}%"
+        print(f"CH{ch + 1}: {hz:.6g} Hz{duty}, {t['rises']} rising edges in {seconds:.3f} s")
+    measure_totals.clear()
+
+def print_irq_stats(layout, items):
+    """Shows an interrupt timing report: CPU cycles of each timed span
+    since the last report, and the edges the USB handler held back"""
+    name = IRQ_LAYOUTS[layout] if layout < len(IRQ_LAYOUTS) else layout
+    print(f"Interrupt timing, {name} priorities:")
+    for t, timer in enumerate(IRQ_TIMERS):
+        base = 4 + 20 * t
+        count = items.get(base, 0)
+        if not count:
+            continue
+        print(f"  {timer}: {count} times, min {items.get(base + 1, 0)}, "
+              f"max {items.get(base + 2, 0)}, mean {items.get(base + 3, 0)} cycles")
+        for b in range(16):
+            if items.get(base + 4 + b):
+                low = 0 if b == 0 else 1 << (b - 1)
+                span = f">={low}" if b == 15 else f"{low}-{(1 << b) - 1}"
+                print(f"    {span:>12} cycles: {items[base + 4 + b]}")
+    if items.get(1):
+        print(f"WARNING: USB handler delayed {items[1]} edge interrupts, by up to {items.get(2, 0)} cycles")
+
+def report_window(count, start, end):
+    """The retained pre-trigger window starts: count events before it
+    were discarded while the trigger was armed"""
+    if count:
+        print(f"Trigger window: {count} earlier events discarded between t={start} and t={end}")
+
+def report_trigger(clock):
+    """Queues the time a device trigger fired at for the capture"""
+    trigger_log.append(clock)
+    print(f"Trigger fired at t={clock}")
+
+def resync_after_drop(end):
+    """An epoch marker may have been lost with the events: take the epoch
+    from the clock time of the last loss"""
+    global epoch, last_time
+    bits = SNAPSHOT_TIME_BITS if EVENT_FORMAT == "snapshot" else EDGE_TIME_BITS
+    epoch = end >> bits
+    last_time = end
+
 def decode_usb_packet(packet_bytes):
+    """Returns the list of (edge, channel, time) edges carried by one event,
+    with time extended past the wire field width using epoch markers.
+    Ring overflows are reported through drop_log"""
+    global epoch, last_time, payload_left, payload_type, epoch_unsure
     if len(packet_bytes) != 4:
-        return None
+        return []
     data, = struct.unpack('<I', packet_bytes)
+
+    if payload_left:  # raw words following a marker
+        payload.append(data)
+        payload_left -= 1
+        if payload_left == 0:
+            if payload_type == MARKER_INFO:
+                print_info(*payload)
+            elif payload_type == MARKER_SOF:
+                frame, clock = payload
+                report_sync(frame, extend_clock(clock))
+            elif payload_type == MARKER_UART:
+                clock, word = payload
+                report_uart(extend_clock(clock), word)
+            elif payload_type == MARKER_TRIGGER:
+                report_trigger(extend_clock(payload[0]))
+            elif payload_type == MARKER_BUS:
+                clock, word = payload
+                if word >> 24 == BUS_PULSE:
+                    payload.clear()
+                    return report_pulse(extend_clock(clock), word)
+                report_bus(extend_clock(clock), word)
+            else:
+                count, first, last = payload
+                start, end = extend_clock(first), extend_clock(last)
+                if payload_type == MARKER_WINDOW:
+                    report_window(count, start, end)
+                else:
+                    report_drop(count, start, end)
+                resync_after_drop(end)
+                forget_pulse_anchors()
+            payload.clear()
+        return []
+
+    if EVENT_FORMAT == "snapshot":
+        # levels(4) | changed(4) | time(24); one event covers simultaneous edges
+        levels = (data >> 28) & 0xF
+        changed = (data >> 24) & 0xF
+        raw_time = data & ((1 << SNAPSHOT_TIME_BITS) - 1)
+        if changed == 0:  # marker: type in the level bits, 24-bit payload
+            if levels == MARKER_EPOCH:
+                epoch = raw_time
+            elif levels in PAYLOAD_WORDS:
+                payload_type, payload_left = levels, PAYLOAD_WORDS[levels]
+            return []
+        time = (epoch << SNAPSHOT_TIME_BITS) | raw_time
+        if time < last_time - (1 << (SNAPSHOT_TIME_BITS - 1)):
+            epoch += 1  # the wrap's epoch marker was lost
+            time += 1 << SNAPSHOT_TIME_BITS
+        last_time = time
+        return [((levels >> ch) & 0x1, ch, time) for ch in range(4) if changed & (1 << ch)]
+
+    raw_time = data & ((1 << EDGE_TIME_BITS) - 1)
+    if raw_time == (1 << EDGE_TIME_BITS) - 1:  # marker: type in bits 31-29
+        if (data >> 29) == MARKER_EPOCH:
+            epoch += 1
+        elif (data >> 29) in PAYLOAD_WORDS:
+            payload_type, payload_left = data >> 29, PAYLOAD_WORDS[data >> 29]
+        return []
     edge = (data >> 31) & 0x1
     channel = (data >> 29) & 0x3
-    time = data & 0x1FFFFFFF
-    return edge, channel, time
+    if channel in pulse_anchor:
+        return list(zip(*decode_pulses(np.array([data], np.uint32))))
+    if epoch_unsure:
+        # a short loss (isochronous packets) spans at most one wrap
+        epoch_unsure = False
+        if (epoch << EDGE_TIME_BITS) | raw_time < last_time:
+            epoch += 1
+    time = (epoch << EDGE_TIME_BITS) | raw_time
+    if time < last_time - (1 << (EDGE_TIME_BITS - 1)):
+        epoch += 1  # the wrap's epoch marker was lost
+        time += 1 << EDGE_TIME_BITS
+    last_time = time
+    if overload_bits:
+        return list(zip(*split_pairs(np.array([data], np.uint32), np.array([edge]), np.array([channel]),
+                                     np.array([time], np.int64))))
+    return [(edge, channel, time)]
+
+def decode_control(data):
+    """Reports the records a USB_CONTROL_EP build sent on its control
+    endpoint: edge-format marker words and their payloads, whatever the
+    stream's format, with the clock times placed by the stream's epoch"""
+    control_pending.extend(data)
+    at = 0
+    while at + 4 <= len(control_pending):
+        marker, = struct.unpack_from('<I', control_pending, at)
+        count = PAYLOAD_WORDS.get(marker >> 29, 0)
+        if at + 4 + 4 * count > len(control_pending):
+            break
+        words = struct.unpack_from(f'<{count}I', control_pending, at + 4)
+        at += 4 + 4 * count
+        if marker >> 29 == MARKER_INFO:
+            print_info(*words)
+        elif marker >> 29 == MARKER_BUS:
+            report_bus(extend_clock(words[0]), words[1])
+    del control_pending[:at]
+
+def _crc_table():
+    table = []
+    for byte in range(256):
+        crc = byte << 24
+        for _ in range(8):
+            crc = (crc << 1) ^ 0x04C11DB7 if crc & 0x80000000 else crc << 1
+        table.append(crc & 0xFFFFFFFF)
+    return table
+
+CRC_TABLE = _crc_table()
+native_codec = stream_codec.load(NATIVE_CODEC)
+
+def stm32_crc(data):
+    """CRC-32 as the F103 CRC unit computes it over little-endian words:
+    poly 0x04C11DB7, init all ones, each word most significant byte first"""
+    if native_codec is not None:
+        return stream_codec.crc(native_codec, data)
+    crc = 0xFFFFFFFF
+    for i in range(0, len(data), 4):
+        for byte in reversed(data[i:i + 4]):
+            crc = ((crc << 8) & 0xFFFFFFFF) ^ CRC_TABLE[(crc >> 24) ^ byte]
+    return crc
+
+class FrameReader:
+    """Splits a STREAM_FRAMED byte stream into checked payloads. Bytes are
+    skipped until a header with a matching CRC; a jump in the stream
+    offset means whole transfers were lost and is reported in bytes"""
+
+    def __init__(self):
+        self.pending = bytearray()
+        self.offset = None  # stream offset of the next payload
+        self.skipped = 0    # bytes dropped while looking for a header
+
+    def _resync(self):
+        """Drops bytes up to the next possible sync word"""
+        at = self.pending.find(struct.pack('<H', FRAME_SYNC), 1)
+        n = at if at > 0 else len(self.pending) - 1
+        del self.pending[:n]
+        self.skipped += n
+
+    def feed(self, data):
+        """Yields the payloads completed by data; a loss is reported when
+        the iteration reaches it, so payloads before it decode first"""
+        self.pending += data
+        while len(self.pending) >= FRAME_STRUCT.size:
+            sync, length, offset, crc = FRAME_STRUCT.unpack_from(self.pending)
+            if sync != FRAME_SYNC or (EVENT_FORMAT != "compact" and length % 4):
+                self._resync()
+                continue
+            end = FRAME_STRUCT.size + length
+            if len(self.pending) < end:
+                break
+            padded = self.pending[:8] + self.pending[FRAME_STRUCT.size:end] + bytes(-length % 4)
+            if stm32_crc(padded) != crc:
+                self._resync()
+                continue
+            if self.skipped:
+                print(f"WARNING: skipped {self.skipped} corrupt stream bytes")
+                self.skipped = 0
+                lost_sync()
+            if self.offset is not None and offset != self.offset:
+                lost = (offset - self.offset) & 0xFFFFFFFF
+                print(f"WARNING: {lost} stream bytes lost before offset {offset}")
+                lost_sync()
+            self.offset = (offset + length) & 0xFFFFFFFF
+            payload_bytes = bytes(self.pending[FRAME_STRUCT.size:end])
+            del self.pending[:end]
+            yield payload_bytes
+
+frame_reader = FrameReader()
+
+def lost_sync():
+    """Forgets decoder state that spanned the missing bytes"""
+    global payload_left, epoch_unsure
+    payload_left = 0
+    epoch_unsure = True
+    payload.clear()
+    forget_pulse_anchors()
+    compact_decoder.lost()
+
+def report_marker(kind, time, values):
+    """Reports a marker record of a compact stream: its MARKER_* type, time
+    and the values that follow its head"""
+    if kind in (MARKER_DROP, MARKER_WINDOW):
+        report = report_drop if kind == MARKER_DROP else report_window
+        report(values[0], time, time + values[1])
+    elif kind == MARKER_TRIGGER:
+        report_trigger(time)
+    elif kind == MARKER_INFO:
+        print_info(*values[:MARKER_INFO_WORDS])
+    elif kind == MARKER_SOF:
+        report_sync(values[0], time)
+    elif kind == MARKER_UART:
+        report_uart(time, values[0])
+    elif kind == MARKER_BUS:
+        report_bus(time, values[0])
+
+class CompactDecoder:
+    """Streaming decoder for STREAM_COMPACT records. Records are
+    variable-length and may straddle USB packets, so bytes are buffered
+    until a record is complete. Record layout:
+      byte 0: type(4) | more(1) | delta bits 2-0
+      then 7 delta bits per byte (LEB128) while the previous byte's
+      continuation bit is set
+    type 0-7 is an edge (edge << 2 | channel), 8-15 a marker; delta is the
+    zigzag-encoded tick difference to the previous record. A drop record's
+    delta moves to the first lost event and is followed by two more
+    LEB128 values: lost count and span in ticks; an info record is
+    followed by the five words of the 'V' reply; a SOF record's delta
+    moves to the clock time latched at a USB frame, whose count follows;
+    a UART record's delta moves to a decoded byte's start bit, whose data
+    word follows; a window record is laid out as a drop record, a
+    trigger record's delta moves to the trigger time, and a bus record
+    is laid out as a UART record.
+
+    A STREAM_PREDICT stream (compression 3) adds run records of type 8,
+    whose delta field is an edge count less one. Their edges are the
+    ones the model of event_format.c predicts, and their residuals follow
+    as prefix codes from bit 0 of each byte on, padded to whole bytes:
+    0 for 0, 1 0 sign for +-1, 1 1 (|r| - 2) sign for +-2 and +-3. The
+    model restarts with the stream, and on a framed stream with the first
+    record that starts in each frame"""
+
+    MARKER_BASE = 8
+    RUN = MARKER_BASE + MARKER_EPOCH  # never sent as a marker
+    PREDICT_SLACK = 3
+
+    def __init__(self):
+        self.pending = bytearray()
+        self.time = 0
+        self.predict = False
+        self.restart_at = None  # pending offset where a new frame's records start
+        self.reset_model()
+
+    def reset_model(self):
+        self.last = [0] * 4    # per channel: time of the last edge,
+        self.gaps = [[0, 0] for _ in range(4)]  # the last two intervals, newer first,
+        self.level = [0] * 4   # the level after that edge
+        self.seen = [0] * 4    # the edges since the reset, up to 3,
+        self.steady = [False] * 4  # and whether the last came as predicted
+
+    def restart(self, predict):
+        """A new stream, STREAM_PREDICT or not, follows its header"""
+        self.predict = predict
+        self.restart_at = None
+        self.reset_model()
+
+    def lost(self):
+        """Bytes were lost: drops the partial record held"""
+        self.pending.clear()
+        self.restart_at = None
+
+    def arrays(self, data, frame=False):
+        """feed() as (edges, channels, times) arrays"""
+        return event_arrays(self.feed(data, frame))
+
+    def _learn(self, ch, time, level):
+        if self.seen[ch]:
+            gap = time - self.last[ch]
+            self.steady[ch] = self.seen[ch] == 3 and abs(gap - self.gaps[ch][1]) <= self.PREDICT_SLACK
+            self.gaps[ch] = [min(gap, 0xFFFFFFFF), self.gaps[ch][0]]
+        self.seen[ch] = min(self.seen[ch] + 1, 3)
+        self.last[ch] = time
+        self.level[ch] = level
+
+    def _predict(self):
+        """(channel, time) of the edge the model expects next, as
+        event_format.c's predict_next"""
+        best = None
+        for ch in range(4):
+            if not self.steady[ch]:
+                continue
+            t = self.last[ch] + self.gaps[ch][1]
+            if t + self.PREDICT_SLACK < self.time:
+                continue
+            if best is None or t < best[1]:
+                best = (ch, t)
+        return best
+
+    def _residuals(self, pos, count):
+        """Reads count residual codes from pos; returns (residuals, end)
+        or None when the record continues in a later packet"""
+        residuals = []
+        bit = 0
+
+        def take(n):
+            nonlocal bit
+            value = 0
+            for i in range(n):
+                at = pos + (bit >> 3)
+                if at >= len(self.pending):
+                    raise IndexError
+                value |= ((self.pending[at] >> (bit & 7)) & 1) << i
+                bit += 1
+            return value
+
+        try:
+            for _ in range(count):
+                if not take(1):
+                    residuals.append(0)
+                elif not take(1):
+                    residuals.append(-1 if take(1) else 1)
+                else:
+                    size = 2 + take(1)
+                    residuals.append(-size if take(1) else size)
+        except IndexError:
+            return None
+        return residuals, pos + (bit + 7) // 8
+
+    def _varint(self, pos, value=0, shift=0, more=True):
+        """Reads LEB128 groups from pos; returns (value, end) or None when
+        the record continues in a later packet"""
+        while more:
+            if pos >= len(self.pending):
+                return None
+            byte = self.pending[pos]
+            value |= (byte & 0x7F) << shift
+            shift += 7
+            more = byte & 0x80
+            pos += 1
+        return value, pos
+
+    def feed(self, data, frame=False):
+        """Returns the list of (edge, channel, time) edges completed by data,
+        a frame's payload if frame is set; ring overflows are reported
+        through drop_log"""
+        if frame and self.predict:
+            self.restart_at = len(self.pending)
+        self.pending += data
+        events = []
+        pos = 0
+        while pos < len(self.pending):
+            if self.restart_at is not None and pos >= self.restart_at:
+                self.reset_model()  # the first record the device encoded for this frame
+                self.restart_at = None
+            head = self.pending[pos]
+            kind = head >> 4
+            parsed = self._varint(pos + 1, head & 0x07, 3, head & 0x08)
+            if parsed is None:
+                break  # the rest of this record is in a later packet
+            delta, end = parsed
+            if kind == self.RUN and self.predict:
+                run = self._residuals(end, delta + 1)
+                if run is None:
+                    break
+                residuals, end = run
+                for residual in residuals:
+                    predicted = self._predict()
+                    if predicted is None:
+                        continue  # the model went out of step after lost bytes
+                    ch, t = predicted
+                    self.time = t + residual
+                    level = 1 - self.level[ch]
+                    self._learn(ch, self.time, level)
+                    events.append((level, ch, self.time))
+                pos = end
+                continue
+            if kind in (self.MARKER_BASE + MARKER_DROP, self.MARKER_BASE + MARKER_WINDOW):
+                count = self._varint(end)
+                span = self._varint(count[1]) if count else None
+                if span is None:
+                    break
+                end = span[1]
+            elif kind in (self.MARKER_BASE + MARKER_SOF, self.MARKER_BASE + MARKER_UART,
+                          self.MARKER_BASE + MARKER_BUS):
+                frame = self._varint(end)  # frame count, UART or bus data word
+                if frame is None:
+                    break
+                end = frame[1]
+            elif kind == self.MARKER_BASE + MARKER_INFO:
+                info = []
+                for _ in range(MARKER_INFO_WORDS):
+                    word = self._varint(end)
+                    if word is None:
+                        break
+                    info.append(word[0])
+                    end = word[1]
+                if len(info) < MARKER_INFO_WORDS:
+                    break
+            pos = end
+
+            self.time += (delta >> 1) ^ -(delta & 1)  # undo zigzag
+            if kind in (self.MARKER_BASE + MARKER_DROP, self.MARKER_BASE + MARKER_WINDOW):
+                report_marker(kind - self.MARKER_BASE, self.time, (count[0], span[0]))
+                self.time += span[0]
+            elif kind == self.MARKER_BASE + MARKER_INFO:
+                report_marker(MARKER_INFO, self.time, info)
+            elif kind in (self.MARKER_BASE + MARKER_SOF, self.MARKER_BASE + MARKER_UART,
+                          self.MARKER_BASE + MARKER_BUS):
+                report_marker(kind - self.MARKER_BASE, self.time, (frame[0],))
+            elif kind >= self.MARKER_BASE:
+                report_marker(kind - self.MARKER_BASE, self.time, ())
+            elif kind < self.MARKER_BASE:
+                events.append(((kind >> 2) & 0x1, kind & 0x3, self.time))
+                if self.predict:
+                    self._learn(kind & 0x3, self.time, (kind >> 2) & 0x1)
+        del self.pending[:pos]
+        if self.restart_at is not None:
+            self.restart_at = max(self.restart_at - pos, 0)
+        return events
+
+class NativeCompactDecoder:
+    """CompactDecoder's work done by the stream codec library
+    (NATIVE_CODEC): the firmware's own decoder and edge model, in C"""
+
+    def __init__(self, lib):
+        self.decoder = stream_codec.Decoder(lib)
+
+    def restart(self, predict):
+        self.decoder.restart(predict)
+
+    def lost(self):
+        self.decoder.lost()
+
+    def arrays(self, data, frame=False):
+        """(edges, channels, times) arrays of the edges data completes;
+        its markers are reported first"""
+        edges, channels, times, markers = self.decoder.decode(data, frame)
+        for marker in markers.tolist():
+            report_marker(marker[2], marker[0], marker[1])
+        if not len(times):
+            return NO_EVENTS
+        return edges, channels, times
+
+compact_decoder = NativeCompactDecoder(native_codec) if native_codec is not None else CompactDecoder()
+read_stage = stage("port read")  # bytes read
+decode_stage = stage("decode")   # bytes in, edges out
+
+class PollStretch:
+    """Turns the poll blocks an 'M' 2 firmware sends while the edge rate
+    is above its ADAPTIVE_RATE back into edges on the edge clock. The
+    edge stream ends with a BUS_HANDOFF record; the poll stream's header
+    block follows, then a handoff block pairing the edge clock with the
+    CPU cycle counter, then sample blocks, and a second handoff block
+    ends them ahead of the next edge stream's header. A snapshot gives
+    the channels' levels at the first sample and their changes become
+    edges. The edges missed while the device sent its ring, and in a
+    stall between blocks, are lost regions without a count"""
+
+    def __init__(self, start):
+        self.pending = bytearray()
+        self.start = start      # edge clock time of the handoff
+        self.tick_hz = stream_clock_hz
+        self.cycle_hz = None    # CPU clock, from the poll stream's header
+        self.origin = None      # extended cycle count at start
+        self.cycles = None      # latest extended cycle count
+        self.mask = None        # sampled channels of the last block
+        self.level = None       # packed levels of its last sample
+        self.next_start = None  # cycle count the next block should start at
+        self.end = None         # edge clock time of the closing handoff
+        self.rest = None        # bytes behind the closing handoff block
+
+    def _extend(self, cycles):
+        diff = (cycles - self.cycles) & 0xFFFFFFFF
+        if diff >= 1 << 31:
+            diff -= 1 << 32
+        self.cycles += diff
+        return self.cycles
+
+    def _ticks(self, cycles):
+        """Edge clock times of extended cycle counts"""
+        return self.start + np.rint((cycles - self.origin) * (self.tick_hz / self.cycle_hz)).astype(np.int64)
+
+    def _handoff(self, clock, cycles, mode):
+        if self.origin is None:
+            self.origin = self.cycles = cycles
+            print(f"Edge rate above the firmware's limit: polling from t={self.start}")
+        elif mode == CAPTURE_MODE_EVENTS:
+            self.end = extend_clock(clock)
+            self.rest = bytearray()
+            print(f"Edge capture resumed at t={self.end}")
+
+    def _samples(self, start, count, period, mask, bits, data, late):
+        """Edges of one sample block as (edges, channels, times) arrays"""
+        global last_time
+        index = np.arange(count)
+        first = self._extend(start)
+        cycles = first + index.astype(np.int64) * period
+        if late:
+            cycles[np.array(list(late.keys()))] += np.array(list(late.values()))
+        times = self._ticks(cycles)
+        per_byte = 8 // bits
+        packed = (np.frombuffer(bytes(data), np.uint8)[index // per_byte]
+                  >> (bits * (index % per_byte))) & ((1 << bits) - 1)
+        channels = [ch for ch in range(4) if mask & (1 << ch)]
+        if self.next_start is None:
+            drop_log.append((0, self.start, int(times[0])))
+        elif (start - self.next_start) & 0xFFFFFFFF >= period:  # both blocks waited for USB
+            drop_log.append((0, int(self._ticks(first - ((start - self.next_start) & 0xFFFFFFFF))),
+                             int(times[0])))
+        self.next_start = (start + count * period) & 0xFFFFFFFF
+        if mask != self.mask:
+            levels = sum(((int(packed[0]) >> k) & 1) << ch for k, ch in enumerate(channels))
+            levels_log.append((int(times[0]), levels, mask))
+            self.mask, self.level = mask, int(packed[0])
+        samples = np.concatenate([[self.level], packed])
+        self.level = int(packed[-1])
+        last_time = int(times[-1])
+        parts = []
+        for k, ch in enumerate(channels):
+            bit = (samples >> k) & 1
+            at = np.flatnonzero(bit[1:] != bit[:-1])
+            parts.append((bit[at + 1].astype(np.int64), np.full(len(at), ch, np.int64), times[at]))
+        edges, chans, stamps = (np.concatenate([part[j] for part in parts]) for j in range(3))
+        order = np.argsort(stamps, kind='stable')
+        return edges[order], chans[order], stamps[order]
+
+    def feed(self, data):
+        """Returns the (edges, channels, times) parts completed by data;
+        once the closing handoff block came, rest collects what follows"""
+        if self.rest is not None:
+            self.rest += data
+            return []
+        self.pending += data
+        parts = []
+        while self.rest is None and len(self.pending) >= POLL_BLOCK_STRUCT.size:
+            if self.pending[:4] == STREAM_HEADER_MAGIC:  # the device stayed with edges
+                self.end = self.start
+                self.rest = bytearray()
+                break
+            magic, count, start, _, period, mask, bits, fixups = POLL_BLOCK_STRUCT.unpack_from(self.pending)
+            if magic in POLL_WORD_MAGICS and bits == 0 and fixups == 0:
+                end = POLL_BLOCK_STRUCT.size + count * 4
+                if len(self.pending) < end:
+                    break
+                words = struct.unpack_from(f'<{count}I', self.pending, POLL_BLOCK_STRUCT.size)
+                if magic == POLL_BLOCK_MAGIC_HEADER and count >= 4:
+                    self.cycle_hz = words[3]
+                elif magic == POLL_BLOCK_MAGIC_HANDOFF and count >= 3:
+                    self._handoff(*words[:3])
+                del self.pending[:end]
+                continue
+            if magic != POLL_BLOCK_MAGIC or period == 0 or bits not in (1, 2, 4):
+                del self.pending[0]
+                continue
+            size = (count * bits + 7) // 8
+            fix_start = POLL_BLOCK_STRUCT.size + (size + 3) // 4 * 4  # data is word-padded
+            end = fix_start + fixups * POLL_FIXUP_STRUCT.size
+            if len(self.pending) < end:
+                break
+            if count and self.origin is not None and self.cycle_hz:
+                late = dict(POLL_FIXUP_STRUCT.iter_unpack(bytes(self.pending[fix_start:end])))
+                packed = self.pending[POLL_BLOCK_STRUCT.size:POLL_BLOCK_STRUCT.size + size]
+                parts.append(self._samples(start, count, period, mask, bits, packed, late))
+            del self.pending[:end]
+        if self.rest is not None:
+            self.rest += self.pending
+            self.pending.clear()
+        return parts
+
+NO_EVENTS = (np.empty(0, np.int64),) * 3
+word_pending = bytearray()  # unframed word stream: bytes of a partial word
+
+def event_arrays(events):
+    """(edges, channels, times) arrays of a list of (edge, channel, time)"""
+    if not events:
+        return NO_EVENTS
+    table = np.array(events, dtype=np.int64)
+    return table[:, 0], table[:, 1], table[:, 2]
+
+def unwrap_run(times, bits):
+    """Adds the wraps of a run whose epoch markers were lost: a step back by
+    more than half the time field can only be one"""
+    global epoch
+    back = np.diff(times, prepend=last_time) < -(1 << (bits - 1))
+    if not back.any():
+        return times
+    wraps = np.cumsum(back)
+    epoch += int(wraps[-1])
+    return times + (wraps << bits)
+
+def decode_run(words):
+    """Decodes a run of event words that holds no marker, as array
+    operations; same results as decode_usb_packet word by word"""
+    global last_time
+    if EVENT_FORMAT == "snapshot":
+        levels = (words >> 28) & 0xF
+        changed = (words >> 24) & 0xF
+        times = (words & ((1 << SNAPSHOT_TIME_BITS) - 1)).astype(np.int64) + (epoch << SNAPSHOT_TIME_BITS)
+        times = unwrap_run(times, SNAPSHOT_TIME_BITS)
+        index, edges, channels = [], [], []
+        for ch in range(4):
+            hit = np.flatnonzero((changed >> ch) & 1)
+            index.append(hit)
+            edges.append((levels[hit] >> ch) & 1)
+            channels.append(np.full(len(hit), ch))
+        index = np.concatenate(index)
+        order = np.argsort(index, kind='stable')  # word order, then channel
+        last_time = int(times[-1])
+        return (np.concatenate(edges)[order].astype(np.int64),
+                np.concatenate(channels)[order].astype(np.int64),
+                times[index[order]])
+    pulses = None
+    if pulse_anchor:
+        pulsed = np.isin((words >> 29) & 0x3, list(pulse_anchor))
+        if pulsed.any():
+            pulses = decode_pulses(words[pulsed])
+            words = words[~pulsed]
+            if not len(words):
+                return pulses
+    times = (words & ((1 << EDGE_TIME_BITS) - 1)).astype(np.int64) + (epoch << EDGE_TIME_BITS)
+    times = unwrap_run(times, EDGE_TIME_BITS)
+    last_time = int(times[-1])
+    edges, channels = (words >> 31).astype(np.int64), ((words >> 29) & 0x3).astype(np.int64)
+    if overload_bits:
+        return split_pairs(words, edges, channels, times)
+    if pulses is not None:
+        # a pulse's leading edge comes with its trailing one, behind the
+        # other channels' edges between them
+        merged = [np.concatenate((p, e)) for p, e in zip(pulses, (edges, channels, times))]
+        order = np.argsort(merged[2], kind='stable')
+        return tuple(part[order] for part in merged)
+    return edges, channels, times
+
+def decode_pulses(words):
+    """Returns the edges of pulse words (pulse_record.h) as (edges,
+    channels, times) arrays. Each word's end is the first time with its
+    low 16 bits after its channel's anchor; a channel without one skips
+    its words until its next BUS_PULSE"""
+    channels = ((words >> 29) & 0x3).astype(np.int64)
+    parts = []
+    for channel in np.unique(channels).tolist():
+        anchor = pulse_anchor.get(channel)
+        if anchor is None:
+            continue
+        own = words[channels == channel]
+        low = (own & 0xFFFF).astype(np.int64)
+        ends = anchor + np.cumsum(np.diff(low, prepend=anchor & 0xFFFF) & 0xFFFF)
+        starts = ends - ((own >> 16) & 0x1FFF).astype(np.int64)
+        levels = (own >> 31).astype(np.int64)
+        pulse_anchor[channel] = int(ends[-1])
+        parts.append((np.column_stack((levels, levels ^ 1)).ravel(),
+                      np.full(2 * len(own), channel, np.int64),
+                      np.column_stack((starts, ends)).ravel()))
+    if not parts:
+        return NO_EVENTS
+    return tuple(np.concatenate([part[j] for part in parts]) for j in range(3))
+
+def split_pairs(words, edges, channels, times):
+    """Splits the dense words of an overload region into their edges:
+    the first at the word's time step, a second one the steps in its low
+    bits after it (event_format.h)"""
+    bits = overload_bits
+    times = times & ~((1 << bits) - 1)
+    paired = np.flatnonzero((words >> (bits - 1)) & 1)
+    if not len(paired):
+        return edges, channels, times
+    low = words[paired].astype(np.int64)
+    after = paired + 1
+    return (np.insert(edges, after, (low >> (bits - 2)) & 1),
+            np.insert(channels, after, (low >> (bits - 4)) & 0x3),
+            np.insert(times, after, times[paired] + ((low & ((1 << (bits - 4)) - 1)) << bits)))
+
+def decode_words(data):
+    """Decodes a block of whole event words. Runs between markers go
+    through decode_run; markers, their payload words and the first edge
+    after a loss go one at a time through decode_usb_packet. The words
+    behind a BUS_HANDOFF record go to the poll stretch it starts.
+    Returns (edges, channels, times) arrays"""
+    words = np.frombuffer(data, dtype='<u4', count=len(data) // 4)
+    if EVENT_FORMAT == "snapshot":
+        markers = np.flatnonzero(((words >> 24) & 0xF) == 0)
+    else:
+        mask = (1 << EDGE_TIME_BITS) - 1
+        markers = np.flatnonzero((words & mask) == mask)
+    parts = []
+    i = 0
+    while i < len(words):
+        if payload_left or (epoch_unsure and EVENT_FORMAT != "snapshot"):
+            parts.append(event_arrays(decode_usb_packet(data[4 * i:4 * i + 4])))
+            i += 1
+            if poll_stretch is not None:
+                poll_stretch.pending += data[4 * i:]
+                break
+            continue
+        k = np.searchsorted(markers, i)
+        end = int(markers[k]) if k < len(markers) else len(words)
+        if end > i:
+            parts.append(decode_run(words[i:end]))
+        if end < len(words):
+            decode_usb_packet(data[4 * end:4 * end + 4])
+        i = end + 1
+    if not parts:
+        return NO_EVENTS
+    return tuple(np.concatenate([part[j] for part in parts]) for j in range(3))
+
+def poll_handoff(data):
+    """Feeds data to the poll stretch; returns its (edges, channels,
+    times) parts and, once the next edge stream's header came, the bytes
+    behind that header (else None)"""
+    global poll_stretch
+    parts = poll_stretch.feed(data)
+    rest = poll_stretch.rest
+    if rest is None or len(rest) < STREAM_HEADER.size:
+        return parts, None
+    resync_after_drop(poll_stretch.end)  # the new edge stream's epoch is implicit
+    poll_stretch = None
+    if not rest.startswith(STREAM_HEADER_MAGIC) or not stream_header_valid(rest):
+        print("WARNING: no stream header after the poll blocks")
+        return parts, bytes(rest)
+    return parts, bytes(rest[take_stream_header(rest, quiet=True):])
+
+def read_events(ser):
+    """Reads everything the port holds (at least one byte) and returns the
+    edges it completes as (edges, channels, times) arrays; an 'M' 2
+    firmware's poll blocks come back as edges too"""
+    global stream_bytes
+    if stall_meter is not None:
+        stall_meter.reading()
+    began = time.perf_counter()
+    count = ser.in_waiting or (0 if stream_head else 1)
+    data = port_reader.read(ser, count) if port_reader is not None else ser.read(count)
+    read_stage.add(len(data), time.perf_counter() - began)
+    if stall_meter is not None:
+        stall_meter.read()
+    began = time.perf_counter()
+    stream_bytes += len(data)
+    if getattr(ser, 'take_control', None):
+        decode_control(ser.take_control())
+    if stream_head:
+        data = bytes(stream_head) + data
+        stream_head.clear()
+    parts = []
+    while True:
+        if poll_stretch is not None:
+            stretch_parts, data = poll_handoff(data)
+            parts += stretch_parts
+            if data is None:
+                break
+        parts.append(decode_stream(data))
+        if poll_stretch is None:
+            break
+        data = bytes(word_pending)  # a BUS_HANDOFF record: the rest is poll blocks
+        word_pending.clear()
+    parts = [part for part in parts if len(part[2])]
+    events = tuple(np.concatenate([part[j] for part in parts]) for j in range(3)) if parts else NO_EVENTS
+    decode_stage.add(len(data), time.perf_counter() - began, len(events[2]))
+    if latency_probe is not None and len(events[2]):
+        latency_probe.edges(events[1], events[2], began, time.perf_counter())
+    return events
+
+def deskew(edges, channels, times, tick_hz):
+    """Takes each channel's CHANNEL_SKEW_NS off its edges' times, at the
+    clock's tick, and puts the edges back in time order"""
+    skew = np.round(np.asarray(CHANNEL_SKEW_NS, np.float64) * tick_hz / 1e9).astype(np.int64)
+    known = channels < len(skew)
+    times = times - np.where(known, skew[np.minimum(channels, len(skew) - 1)], 0)
+    order = np.argsort(times, kind='stable')
+    return edges[order], channels[order], times[order]
+
+def decode_stream(data):
+    """Decodes edge stream bytes into (edges, channels, times) arrays"""
+    if not STREAM_FRAMED:
+        if EVENT_FORMAT == "compact":
+            return compact_decoder.arrays(data)
+        word_pending.extend(data)
+        whole = len(word_pending) & ~3
+        block = bytes(word_pending[:whole])
+        del word_pending[:whole]
+        return decode_words(block)
+    parts = []
+    for payload_bytes in frame_reader.feed(data):
+        if EVENT_FORMAT == "compact":
+            parts.append(compact_decoder.arrays(payload_bytes, frame=True))
+        else:
+            parts.append(decode_words(payload_bytes))
+    if not parts:
+        return NO_EVENTS
+    return tuple(np.concatenate([part[j] for part in parts]) for j in range(3))
 
 # ========================
 # Real-Time Update Func
 # ========================
 
 def update_plot(frame):
+    began = time.perf_counter()
+    # Only the records that arrived since the last frame are processed
+    records, lost = ring.read()
+    if lost:
+        plot_stage.shed(lost)
+    if latency_report is not None:
+        latency_report.frame(records)
+    drawn = draw_frame(records, lost)
+    plot_stage.add(len(records), time.perf_counter() - began)
+    plot_report.poll()
+    return drawn
+
+def draw_frame(records, lost):
+    global drawn_drops
+    if panel is not None:
+        panel.draw()
+    if annotations is not None:
+        annotations.feed(records, lost, ring.tick_hz)
+    channels = records['channel']
+    drop_regions.extend(zip(records['time'][channels == CHANNEL_DROP_START].tolist(),
+                            records['time'][channels == CHANNEL_DROP_END].tolist()))
+    # Mark where the device trigger fired
+    for trigger in records['time'][channels == CHANNEL_TRIGGER].tolist():
+        for line in lines.values():
+            line.axes.axvline(trigger, color='green', linestyle='--')
+    for ch in lines:
+        buf = channel_data[ch]
+        times, levels = channel_levels(records, ch)
+        if len(levels):
+            # Snapshots repeat the level unless an edge was lost: keep only
+            # changes, so they neither add points nor move the view
+            before = buf.view()[1][-1] if buf.count else 1 - levels[0]
+            times, levels = level_changes(times, levels, before)
+        buf.append(times, levels)
+    if analog_line is not None:
+        analog_data.append(*analog_records(records))
+
+    # Shade regions where the firmware ring overflowed and edges are missing
+    while drawn_drops < len(drop_regions):
+        start, end = drop_regions[drawn_drops]
+        for line in lines.values():
+            line.axes.axvspan(start, max(end, start + 1), color='red', alpha=0.3)
+        drawn_drops += 1
+
+    # Center the view on the latest byte: edges since the last gap
+    window = None
+    for ch in lines:
+        byte = channel_data[ch].latest_byte()
+        if len(byte):
+            byte_start, byte_end = byte[0], byte[-1]
+            if len(byte) > 1:
+                # Window should be slightly wider than one byte
+                size = max((byte_end - byte_start) * 1.5, 1500)
+            else:
+                size = 1500
+            center = (byte_start + byte_end) / 2
+            window = (center - size / 2, center + size / 2)
+
+    drawn = list(lines.values()) + ([analog_line] if analog_line is not None else [])
+    if window is None and analog_data.count:
+        # No edges yet: follow the newest analog samples
+        times, _ = analog_data.view()
+        start = times[-ANALOG_VIEW_SAMPLES:][0]
+        window = (start, max(times[-1], start + 1))
+    if window is None:
+        return drawn
     for ch, line in lines.items():
-        if channel_data[ch]:
-            raw_times, raw_edges = zip(*channel_data[ch])
-            
-            # Create step-wise waveform: duplicate each time, except the last
-            times = []
-            edges = []
-            for i in range(len(raw_times)):
-                times.append(raw_times[i])
-                edges.append(raw_edges[i])
-                if i < len(raw_times) - 1:
-                    times.append(raw_times[i + 1])
-                    edges.append(raw_edges[i])  # Hold current level until next edge
-            
-            line.set_data(times, edges)
-            ax = line.axes
-            
-            # Fix the x-axis scaling issue
-            if len(times) > 0:
-                if len(times) > 1:
-                    # Detect current byte by finding the largest time gap (>1000 units indicates new byte)
-                    current_byte_start = 0
-                    for i in range(len(raw_times) - 1, 0, -1):
-                        if raw_times[i] - raw_times[i-1] > 1000:  # Gap indicates new byte
-                            current_byte_start = i
-                            break
-                    
-                    # Extract times for current byte only
-                    current_byte_times = raw_times[current_byte_start:]
-                    
-                    if len(current_byte_times) > 1:
-                        byte_start = min(current_byte_times)
-                        byte_end = max(current_byte_times)
-                        byte_center = (byte_start + byte_end) / 2
-                        byte_width = byte_end - byte_start
-                        
-                        # Window should be slightly wider than one byte
-                        window_size = max(byte_width * 1.5, 1500)
-                        
-                        ax.set_xlim(byte_center - window_size/2, byte_center + window_size/2)
-                    else:
-                        # Single edge in current byte, center on it
-                        ax.set_xlim(current_byte_times[0] - 750, current_byte_times[0] + 750)
-                else:
-                    # Single point total
-                    ax.set_xlim(times[0] - 750, times[0] + 750)
+        line.set_data(*channel_data[ch].visible(*window))
+        line.axes.set_xlim(*window)
+    if analog_line is not None:
+        analog_line.set_data(*analog_data.visible(*window))
+        analog_line.axes.set_xlim(*window)
+    if annotations is not None:
+        return drawn + annotations.draw(*window)
+
+    return drawn
+
+# ========================
+# Ingest Process
+# ========================
+
+def open_port():
+    """The analyzer's port: ISO_USB, BULK_USB or SERIAL_PORT"""
+    if ISO_USB:
+        from bulk_port import IsoPort
+        return IsoPort(timeout=READ_TIMEOUT_S)
+    if BULK_USB:
+        from bulk_port import BulkPort
+        return BulkPort(timeout=READ_TIMEOUT_S)
+    return serial.Serial(SERIAL_PORT, BAUDRATE, timeout=READ_TIMEOUT_S)
 
-    return list(lines.values())
+def configure(ser, flush_policy):
+    """Starts the edge stream and sends the settings that are on"""
+    global credit_granted, capacity
+    send_event_mode(ser)
+    if IRQ_LAYOUT is not None:
+        send_irq_layout(ser, IRQ_LAYOUT)
+    if CLOCK_PRESET is not None:
+        send_clock_preset(ser, CLOCK_PRESET)  # first: the settings below are converted to its ticks
+    send_flush_policy(ser, *flush_policy)
+    if CHANNEL_MASK is not None:
+        send_channel_mask(ser, CHANNEL_MASK)
+    if DEVICE_UART:
+        send_uart_decode(ser, *DEVICE_UART)
+        if DEVICE_UART_FILTER:
+            send_bus_filter(ser, 2, *DEVICE_UART_FILTER)
+    if RECORDER:
+        send_trigger(ser, TRIG_RECORD, 0, 0, 0, 0, 0, 0)
+    elif TRIGGER:
+        send_trigger(ser, *TRIGGER)
+    if DEVICE_SPI:
+        send_spi_sniff(ser, *DEVICE_SPI)
+    if SS_GATE:
+        send_ss_gate(ser, *SS_GATE)
+    if DEVICE_I2C:
+        send_i2c_sniff(ser, *DEVICE_I2C)
+        if DEVICE_I2C_FILTER:
+            send_bus_filter(ser, 1, *DEVICE_I2C_FILTER)
+    if GLITCH_FILTER:
+        send_glitch_filter(ser, *GLITCH_FILTER)
+    if STORM_LIMIT:
+        send_storm_limit(ser, *STORM_LIMIT)
+    if MEASURE:
+        send_measure(ser, *MEASURE)
+    if PULSES:
+        send_pulses(ser, *PULSES)
+    if BOARD_SYNC:
+        send_board_sync(ser, *BOARD_SYNC)
+    if ANALOG_RATE:
+        send_analog(ser, ANALOG_RATE)
+    if FLOW_CREDIT_KIB and not ISO_USB:
+        send_credit(ser, CREDIT_START, FLOW_CREDIT_KIB)
+        credit_granted = stream_bytes
+    if CAPACITY_PLAN:
+        capacity = CapacityEstimator(link_ceiling("iso" if ISO_USB else "bulk" if BULK_USB else "cdc")[0],
+                                     bin(CHANNEL_MASK).count("1") if CHANNEL_MASK is not None else 4,
+                                     CAPACITY_WARN_S, CAPACITY_AUTO)
+    send_info_request(ser)
+
+def send_capacity_limits(ser):
+    """Sends the storm limits the capacity estimator asked for, as one
+    staged change"""
+    if capacity_limits:
+        send_staged(ser, *((send_storm_limit, *limit) for limit in capacity_limits))
+        capacity_limits.clear()
+
+def ingest_sinks(out, mapping, sinks=()):
+    """The capture file, the RingSink of out if given, the live sinks
+    that are on and sinks"""
+    sinks = [*([CaptureWriter(CAPTURE_PATH, MODE_EVENTS, mapping, segment_bytes=SEGMENT_MB << 20,
+                              segment_s=SEGMENT_MINUTES * 60)] if CAPTURE_PATH else []),
+             *([RingSink(out)] if out is not None else []), *sinks]
+    if LIVE_STATS_S:
+        sinks.append(StatsSink(mapping, LIVE_STATS_S))
+    if LIVE_UART:
+        sinks.append(UartSink(*LIVE_UART, skip_lag_s=LIVE_SKIP_LAG_S, skip_log=LIVE_SKIP_LOG))
+    if PROTOCOL_STATS_S:
+        sinks.append(ProtocolStatsSink(mapping, PROTOCOL_STATS_S, PROTOCOL_STATS_BAUD,
+                                       csv_path=PROTOCOL_STATS_CSV))
+    if LIVE_EXPORT:
+        sinks.append(ExportSink(LIVE_EXPORT, MODE_EVENTS, mapping))
+    if LIVE_PCAP:
+        sinks.append(PcapSink(LIVE_PCAP[0], mapping, LIVE_PCAP[1]))
+    if SERVE_PORT:
+        sinks.append(ServerSink(SERVE_PORT, MODE_EVENTS, mapping))
+    if is_auto(mapping):
+        sinks.append(IdentifySink(MODE_EVENTS, mapping))
+    return sinks
+
+def forward(pipeline, edges, channels, times, tick_hz):
+    """Hands what read_events decoded, and the records its markers
+    logged, to pipeline; returns the clock it runs at"""
+    if stream_clock_hz != tick_hz:
+        tick_hz = stream_clock_hz
+        pipeline.set_tick_hz(tick_hz)
+    while drop_log:
+        pipeline.drop(*drop_log.pop(0))
+    while sync_log:
+        pipeline.sync(*sync_log.pop(0))
+    if uart_log:
+        pipeline.uart(*zip(*uart_log))
+        uart_log.clear()
+    while trigger_log:
+        pipeline.trigger(trigger_log.pop(0))
+    while board_sync_log:
+        pipeline.board_sync(*board_sync_log.pop(0))
+    while levels_log:
+        pipeline.levels(*levels_log.pop(0))
+    if spi_log:
+        pipeline.spi(*zip(*spi_log))
+        spi_log.clear()
+    if i2c_log:
+        pipeline.i2c(*zip(*i2c_log))
+        i2c_log.clear()
+    while storm_log:
+        pipeline.storm(*storm_log.pop(0))
+    if analog_log:
+        pipeline.analog(*zip(*analog_log))
+        analog_log.clear()
+    if len(times):
+        if CHANNEL_SKEW_NS and tick_hz:
+            edges, channels, times = deskew(edges, channels, times, tick_hz)
+        pipeline.events(edges, channels, times)
+    return tick_hz
+
+def ingest(ring_name, mapping, flush_policy, stop, health=None, sinks=(), port=None, latency=None, dump=None):
+    """Reads and decodes the stream in a process of its own, so rendering
+    never delays USB reads. Everything decoded goes to bitlog.lacap and
+    the shared ring the plot reads (none if ring_name is None), and to
+    the live sinks that are on (pipeline.py) and sinks; the link health
+    figures go to health, a Telemetry, if given. port, if given, is read
+    instead of opening one (flash_log.py's replay). The LATENCY_PROBE
+    samples go to latency, a queue, if given. Setting dump, an event,
+    dumps the RECORDER. Returns once stop is set"""
+    global telemetry, latency_probe, port_reader, stall_meter
+    telemetry = health
+    latency_probe = LatencyProbe(LATENCY_PROBE, latency) if latency is not None else None
+    ser = port if port is not None else open_port()
+    configure(ser, flush_policy)
+    out = SharedRing(ring_name) if ring_name else None
+    pipeline = Pipeline(*ingest_sinks(out, mapping, sinks))
+    report = StageReport("ingest", STAGE_STATS_S, STAGE_STATS_JSON)
+    tick_hz = None
+    stall_meter = StallMeter() if telemetry is not None or STALL_REPORT_S else None
+    if INGEST_REALTIME:
+        # the sink threads are running: only this one, the reader, is raised
+        print("Ingest reader: " + ", ".join(raise_priority(INGEST_CORE)))
+        port_reader = PortReader(ser, INGEST_READ_KB << 10)
+        freeze_heap()
+    last_stats = time.monotonic()
+    last_flush = time.monotonic()
+    last_health = time.monotonic()
+    last_stalls = time.monotonic()
+    while not stop.is_set():
+        if STATS_EVERY_S and time.monotonic() - last_stats >= STATS_EVERY_S:
+            ser.write(b'S')
+            last_stats = time.monotonic()
+        if telemetry is not None and time.monotonic() - last_health >= HEALTH_EVERY_S:
+            telemetry.update({"host queue %": 100.0 * pipeline.queue_fill(),
+                              "port backlog": ser.in_waiting, "ingest stall ms": stall_meter.take_worst()})
+            last_health = time.monotonic()
+        if STALL_REPORT_S and time.monotonic() - last_stalls >= STALL_REPORT_S:
+            print(stall_meter.report(time.monotonic() - last_stalls))
+            last_stalls = time.monotonic()
+        edges, channels, times = read_events(ser)
+        if FLOW_CREDIT_KIB and not ISO_USB and pipeline.queue_fill() < CREDIT_QUEUE_FILL:
+            grant_credit(ser)
+        send_capacity_limits(ser)
+        if dump is not None and dump.is_set():
+            dump.clear()
+            send_dump(ser, *RECORDER)
+        tick_hz = forward(pipeline, edges, channels, times, tick_hz)
+        report.poll()
+        if time.monotonic() - last_flush >= FLUSH_EVERY_S:
+            pipeline.flush()
+            last_flush = time.monotonic()
+    pipeline.close()
+    if out is not None:
+        out.close()
 
 # ========================
 # Main Function
 # ========================
 
 def main():
-    global lines 
+    global lines, ring, panel, annotations, analog_line, plot_report, latency_report
 
     comm_type = get_comm_type()
     mapping = get_channel_mapping(comm_type)
+    flush_policy = get_flush_policy()
 
-    # Create one subplot per channel
+    # Create one subplot per channel, and a column for the health panel
     num_channels = len(mapping)
-    fig, axes = plt.subplots(num_channels, 1, sharex=True, figsize=(10, 2 * num_channels))
-    if num_channels == 1:
-        axes = [axes]  # ensure it's iterable
+    rows = num_channels + (1 if ANALOG_RATE else 0)  # the analog channel below the edges
+    health = Telemetry() if HEALTH_PANEL and not NATIVE_INGEST and VIEWER != "gl" else None
+    fig = None if VIEWER == "gl" else plt.figure(figsize=(13 if health else 10, 2 * rows))
+    axes = []
+    if fig is not None:
+        grid = fig.add_gridspec(rows, 2 if health else 1, width_ratios=(4, 1) if health else None)
+        axes = [fig.add_subplot(grid[0, 0])]
+        axes += [fig.add_subplot(grid[i, 0], sharex=axes[0]) for i in range(1, rows)]
+    panel = TelemetryPanel(fig.add_subplot(grid[:, 1]), health) if health else None
 
     lines = {}
 
@@ -128,38 +1921,68 @@ def main():
     channel_names = {ch: mapping[ch] for ch in mapping}
 
     for idx, (ch, ax) in enumerate(zip(mapping, axes)):
-        lines[ch], = ax.plot([], [], label=f"{channel_names[ch]}")
+        lines[ch], = ax.plot([], [], label=f"{channel_names[ch]}", drawstyle='steps-post')
         ax.set_xlim(0, 50000)
         ax.set_ylim(-0.5, 1.5)
         ax.set_ylabel("Edge")
         ax.set_title(f"Channel {ch+1}: {channel_names[ch]}")
         ax.legend(loc="upper right")
+    if ANALOG_RATE and axes:
+        ax = axes[-1]
+        analog_line, = ax.plot([], [], label="PA1", color='purple')
+        ax.set_ylim(-100, 4195)
+        ax.set_ylabel("ADC")
+        ax.set_title(f"Analog: PA1 at {ANALOG_RATE} Hz")
+        ax.legend(loc="upper right")
 
-    axes[-1].set_xlabel("Time")
-
-    ser = serial.Serial('/dev/tty.usbmodem385A439452311', 115200)  # Change to correct port if needed
-
-    with open("bitlog.csv", "w", newline='') as f:
-        writer = csv.writer(f)
-        writer.writerow(["Channel-Type", "Edge", "Time"])
-
-        def read_serial():
-            while True:
-                packet = ser.read(4)
-                decoded = decode_usb_packet(packet)
-                if decoded:
-                    edge, channel, time = decoded
-                    channel_name = mapping.get(channel)
-                    channel_data[channel].append((time, edge))
-                    edge_label = "rising" if edge else "falling"
-                    writer.writerow([channel_name, edge_label, time])
-                    f.flush()  # Ensure data is written to file immediately
+    if axes:
+        axes[-1].set_xlabel("Time (ticks)")
+    if ANNOTATE and axes:
+        annotations = AnnotationOverlay(comm_type, mapping, dict(zip(mapping, axes)), ANNOTATE_BAUD)
 
-        thread = threading.Thread(target=read_serial, daemon=True)
-        thread.start()
+    ring = SharedRing()
+    plot_report = StageReport("plot", STAGE_STATS_S, STAGE_STATS_JSON)
+    transcoder = None
+    if TRANSCODE_WORKERS and CAPTURE_PATH and (SEGMENT_MB or SEGMENT_MINUTES) and not NATIVE_INGEST:
+        transcoder = capture_transcode.start(CAPTURE_PATH, TRANSCODE_WORKERS)
+    latency = None
+    if LATENCY_PROBE is not None and fig is not None and not NATIVE_INGEST:
+        latency = multiprocessing.Queue()
+        latency_report = LatencyReport(LATENCY_PROBE, latency, LATENCY_REPORT_S)
+        fig.canvas.mpl_connect('draw_event', latency_report.drawn)
+    dump = None
+    if RECORDER and fig is not None and not NATIVE_INGEST:
+        dump = multiprocessing.Event()
+        fig.canvas.mpl_connect('key_press_event', lambda event: event.key == 'd' and dump.set())
+    if NATIVE_INGEST:
+        if EVENT_FORMAT == "compact" or ISO_USB or ADAPTIVE:
+            print("The native ingest reads edge and snapshot bulk streams only, without poll blocks.")
+            exit(1)
+        reader = subprocess.Popen(
+            [NATIVE_HELPER, ring.name, CAPTURE_PATH,
+             "-n", ",".join(mapping.get(ch, "") for ch in range(4)),
+             "-F", ",".join(str(value) for value in flush_policy)]
+            + (["-f"] if STREAM_FRAMED else []) + (["-s"] if EVENT_FORMAT == "snapshot" else []))
+    else:
+        stop = multiprocessing.Event()
+        reader = multiprocessing.Process(target=ingest, args=(ring.name, mapping, flush_policy, stop, health, (), None, latency, dump))
+        reader.start()
 
+    if VIEWER == "gl":
+        import gl_viewer
+        gl_viewer.run(channel_names, ring, GL_FOLLOW_WINDOW, "Logic analyzer: edges")
+    else:
         ani = animation.FuncAnimation(fig, update_plot, interval=100)
         plt.show()
+    if NATIVE_INGEST:
+        reader.send_signal(signal.SIGINT)
+        reader.wait()
+    else:
+        stop.set()
+        reader.join()
+    if transcoder is not None:
+        transcoder.stdin.close()  # recording stopped: it packs the last segment and exits
+    ring.close()
 
 if __name__ == "__main__":
     main()
\ No newline at end of file
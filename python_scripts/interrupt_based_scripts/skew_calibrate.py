@@ -0,0 +1,85 @@
+"""Measures how far apart the edge firmware timestamps edges that happen
+at the same instant on different channels, for serial_plotter.py's
+CHANNEL_SKEW_NS.
+
+  python skew_calibrate.py bitlog.lacap
+
+PB4 interrupts through EXTI4 and PB5-PB7 share EXTI9_5, whose handler
+stamps the lines it finds pending with one clock read per pass: a line
+that becomes pending during a pass, or whose vector is entered second,
+gets a later time than an edge that happened with it. That latency is
+fixed per channel in CPU cycles, so it is measured once, in ns, and the
+ingest process takes it off every later capture's edges.
+
+Wire one square wave to every enabled channel, slow enough that its
+edges are far apart next to the skew (1-10 kHz), and capture a second
+or more of it with serial_plotter.py, on the 72 MHz clock preset for
+the finest ticks. Each channel's edges are paired with the nearest edge
+of the same direction on the reference channel, the first one with
+edges; the median difference is the channel's skew, and the spread of
+the pairs is the jitter that correcting it leaves."""
+import sys
+
+import numpy as np
+
+import common_path  # puts python_scripts/common on sys.path
+from capture_file import CaptureFile
+
+EDGE_CHANNELS = 4  # CH1-CH4, the EXTI lines
+MIN_PAIRS = 100  # fewer paired edges than this and a channel is not measured
+
+
+def pair_offsets(ref_times, ref_edges, times, edges):
+    """Time of each edge minus the reference channel's nearest edge of
+    the same direction, for the edges within half a reference period
+    of one"""
+    offsets = []
+    for level in (0, 1):
+        ref = ref_times[ref_edges == level]
+        own = times[edges == level]
+        if len(ref) < 2 or not len(own):
+            continue
+        i = np.clip(np.searchsorted(ref, own), 1, len(ref) - 1)
+        nearest = np.where(own - ref[i - 1] <= ref[i] - own, ref[i - 1], ref[i])
+        offset = own - nearest
+        offsets.append(offset[np.abs(offset) < np.median(np.diff(ref)) / 2])
+    return np.concatenate(offsets) if offsets else np.empty(0, np.int64)
+
+
+def main():
+    if len(sys.argv) != 2:
+        print("Usage: python skew_calibrate.py <capture.lacap>")
+        sys.exit(1)
+    capture = CaptureFile(sys.argv[1])
+    if not capture.tick_hz:
+        print("The capture does not know its clock: record it after the firmware's 'V' reply")
+        sys.exit(1)
+    edges = {ch: capture.edges(ch) for ch in range(EDGE_CHANNELS)}
+    edges = {ch: (times.astype(np.int64), values) for ch, (times, values) in edges.items() if len(times)}
+    if len(edges) < 2:
+        print("Need edges on at least two channels driven by the same source")
+        sys.exit(1)
+
+    ns_per_tick = 1e9 / capture.tick_hz
+    reference = min(edges)
+    skew = [0.0] * EDGE_CHANNELS
+    print(f"{capture.tick_hz:.0f} Hz clock ({ns_per_tick:.1f} ns ticks), "
+          f"against {capture.names[reference]}:")
+    for ch, (times, values) in sorted(edges.items()):
+        if ch == reference:
+            continue
+        offsets = pair_offsets(*edges[reference], times, values)
+        if len(offsets) < MIN_PAIRS:
+            print(f"  {capture.names[ch]}: {len(offsets)} paired edges, not measured; is it on the same source?")
+            continue
+        median = float(np.median(offsets))
+        low, high = np.percentile(offsets - median, (1, 99))
+        skew[ch] = round(median * ns_per_tick, 1)
+        print(f"  {capture.names[ch]}: {median:+.0f} ticks ({skew[ch]:+.1f} ns) over {len(offsets)} edges, "
+              f"{low:+.0f} to {high:+.0f} ticks around it (1-99 %)")
+    print("Set in serial_plotter.py:")
+    print(f"CHANNEL_SKEW_NS = ({', '.join(f'{value:g}' for value in skew)})")
+
+
+if __name__ == "__main__":
+    main()
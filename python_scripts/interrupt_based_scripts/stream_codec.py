@@ -0,0 +1,96 @@
+"""ctypes binding of the stream codec, the interrupt firmware's
+Core/Src/stream_codec.c built as a shared library (see its header or the
+README). serial_plotter.py loads it from NATIVE_CODEC to decode
+STREAM_COMPACT records and check STREAM_FRAMED CRCs in C, with the same
+code and edge model as the firmware's encoder, so the two cannot drift
+apart. Without the library it decodes in Python as before.
+
+A Decoder keeps the bytes of a record that continues in a later packet,
+as CompactDecoder does, and hands the library the whole pending buffer
+each time. Output arrays are sized so one call decodes everything whole:
+a record yields at most 8 edges per byte (a run codes each in one bit or
+more) and one marker."""
+import ctypes
+
+import numpy as np
+
+CODEC_RUN_MAX = 32  # edges of one run record, stream_codec.h
+MARKER_INFO_WORDS = 5
+MARKER_DTYPE = np.dtype([('time', '<i8'), ('words', '<u8', (MARKER_INFO_WORDS,)), ('type', '<u4')], align=True)
+NO_MARKERS = np.empty(0, MARKER_DTYPE)
+NO_EDGES = np.empty(0, np.int64)
+
+
+class _Output(ctypes.Structure):
+    """CodecOutput"""
+    _fields_ = [('times', ctypes.c_void_p), ('levels', ctypes.c_void_p), ('channels', ctypes.c_void_p),
+                ('edges', ctypes.c_uint32), ('edge_room', ctypes.c_uint32),
+                ('markers', ctypes.c_void_p), ('marker_count', ctypes.c_uint32),
+                ('marker_room', ctypes.c_uint32)]
+
+
+def load(path):
+    """The library at path, or None if there is none (path None) or it
+    does not load"""
+    if path is None:
+        return None
+    try:
+        lib = ctypes.CDLL(path)
+    except OSError:
+        return None
+    lib.codec_decoder_size.restype = ctypes.c_uint32
+    lib.codec_decoder_restart.argtypes = [ctypes.c_void_p, ctypes.c_uint32]
+    lib.codec_decoder_frame.argtypes = [ctypes.c_void_p, ctypes.c_uint32]
+    lib.codec_decoder_lost.argtypes = [ctypes.c_void_p]
+    lib.codec_decode.argtypes = [ctypes.c_void_p, ctypes.c_void_p, ctypes.c_uint32, ctypes.POINTER(_Output)]
+    lib.codec_decode.restype = ctypes.c_uint32
+    lib.codec_crc32.argtypes = [ctypes.c_uint32, ctypes.c_char_p, ctypes.c_uint32]
+    lib.codec_crc32.restype = ctypes.c_uint32
+    return lib
+
+
+def crc(lib, data, crc=0xFFFFFFFF):
+    """CRC-32 of the F103 CRC unit over data, zero-padded to whole words"""
+    return lib.codec_crc32(crc, bytes(data), len(data))
+
+
+class Decoder:
+    """One compact stream's decoder state, held by the library"""
+
+    def __init__(self, lib):
+        self.lib = lib
+        self.state = ctypes.create_string_buffer(lib.codec_decoder_size())  # zeroed: time 0
+        self.pending = bytearray()
+        lib.codec_decoder_restart(self.state, 0)
+
+    def restart(self, predict):
+        """A new stream, STREAM_PREDICT or not, follows its header"""
+        self.lib.codec_decoder_restart(self.state, int(predict))
+
+    def lost(self):
+        """Bytes were lost: drops the partial record held"""
+        self.pending.clear()
+        self.lib.codec_decoder_lost(self.state)
+
+    def decode(self, data, frame=False):
+        """Returns (edges, channels, times, markers) of the records data
+        completes, a frame's payload if frame is set: int64 arrays of the
+        edges in order, and a MARKER_DTYPE array of the markers"""
+        if frame:
+            self.lib.codec_decoder_frame(self.state, len(self.pending))
+        self.pending += data
+        if not self.pending:
+            return NO_EDGES, NO_EDGES, NO_EDGES, NO_MARKERS
+        buf = np.frombuffer(bytes(self.pending), np.uint8)
+        room = 8 * len(buf) + CODEC_RUN_MAX
+        times = np.empty(room, np.int64)
+        levels = np.empty(room, np.uint8)
+        channels = np.empty(room, np.uint8)
+        markers = np.empty(len(buf) + 1, MARKER_DTYPE)
+        out = _Output(times.ctypes.data, levels.ctypes.data, channels.ctypes.data, 0, room,
+                      markers.ctypes.data, 0, len(markers))
+        used = self.lib.codec_decode(self.state, buf.ctypes.data, len(buf), ctypes.byref(out))
+        del self.pending[:used]
+        n = out.edges
+        return (levels[:n].astype(np.int64), channels[:n].astype(np.int64), times[:n].copy(),
+                markers[:out.marker_count].copy())
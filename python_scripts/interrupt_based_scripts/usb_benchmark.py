@@ -0,0 +1,158 @@
+"""Measures the device-to-host ceiling of the USB stream against an
+interrupt_based_analyzer build with USB_BENCHMARK 1. That firmware does
+not capture: it fills the event ring with a 32-bit counter and sends it
+through the same transfer path, flush policy and framing as the edge
+stream.
+
+Reports the throughput, pattern errors (words that do not follow the
+previous one) and, for a paced pattern, how late each read got the
+newest word compared with the fastest read of the run. A run as fast as
+USB takes the words appends its throughput to usb_benchmark.jsonl, the
+link ceiling capture_plan.py plans with."""
+import datetime
+import json
+import serial
+import struct
+import time
+
+import common_path  # puts python_scripts/common on sys.path
+from serial_plotter import FrameReader, get_flush_policy, print_info, send_flush_policy
+
+# True for a USB_VENDOR_CLASS firmware build: read through libusb (bulk_port.py)
+BULK_USB = False
+# True for a USB_ISO_STREAM firmware build: read the isochronous alternate setting
+ISO_USB = False
+# True for a STREAM_FRAMED firmware build
+STREAM_FRAMED = False
+PORT = '/dev/tty.usbmodem385A439452311'  # Change to correct port if needed
+INFO_MARKER = (2 << 29) | 0x1FFFFFFF  # MARKER_INFO in the edge format
+INFO_WORDS = 5
+REPORT = "usb_benchmark.jsonl"
+
+def send_run(ser, run):
+    # 'R' run(1)
+    ser.write(struct.pack('<cB', b'R', run))
+
+def send_bench(ser, rate, size):
+    # 'T' rate(4) bytes(2), see host_cmd.h
+    ser.write(struct.pack('<cIH', b'T', rate, size))
+
+class Stream:
+    """Returns the stream's payload bytes, unframed if needed"""
+
+    def __init__(self, ser):
+        self.ser = ser
+        self.frames = FrameReader() if STREAM_FRAMED else None
+
+    def read(self):
+        data = self.ser.read(self.ser.in_waiting or 1)
+        if self.frames is None:
+            return data
+        return b''.join(self.frames.feed(data))
+
+def read_info(ser, stream):
+    """Asks for the 'V' reply while the pattern is stopped"""
+    ser.write(b'V')
+    data = b''
+    deadline = time.perf_counter() + 1
+    while len(data) < 4 * (1 + INFO_WORDS) and time.perf_counter() < deadline:
+        data += stream.read()
+    words = struct.unpack_from(f'<{len(data) // 4}I', data)
+    if len(words) < 1 + INFO_WORDS or words[0] != INFO_MARKER:
+        print("WARNING: no info reply; is this a USB_BENCHMARK build?")
+        return
+    print_info(*words[1:1 + INFO_WORDS])
+
+def percentiles(values, points=(50, 90, 99, 99.9)):
+    values = sorted(values)
+    return {p: values[min(len(values) - 1, int(len(values) * p / 100))] for p in points}
+
+def main():
+    size = int(input("Largest transfer in bytes [1024]: ").strip() or 1024)
+    rate = int(input("Pattern words per second, 0 = as fast as USB takes them [0]: ").strip() or 0)
+    flush_policy = get_flush_policy()
+    duration = float(input("Duration in s [10]: ").strip() or 10)
+
+    if ISO_USB:
+        from bulk_port import IsoPort
+        ser = IsoPort(timeout=0.1)
+    elif BULK_USB:
+        from bulk_port import BulkPort
+        ser = BulkPort(timeout=0.1)
+    else:
+        ser = serial.Serial(PORT, 115200, timeout=0.1)
+    stream = Stream(ser)
+
+    send_run(ser, 0)
+    time.sleep(0.2)
+    ser.reset_input_buffer()
+    read_info(ser, stream)
+    send_flush_policy(ser, *flush_policy)
+    send_bench(ser, rate, size)
+    send_run(ser, 1)
+
+    total = 0      # bytes after the first read, which starts the clock
+    expected = None
+    errors = 0
+    missing = 0
+    pending = b''
+    first = None   # arrival time and value of the first word
+    lateness = []  # per read: arrival minus due time of its newest word
+    gaps = []      # per read: time since the previous read with data
+    last = None
+    end = time.perf_counter() + duration
+    while time.perf_counter() < end:
+        data = stream.read()
+        now = time.perf_counter()
+        if not data:
+            continue
+        if last is None:
+            start = now
+        else:
+            total += len(data)
+            gaps.append(now - last)
+        last = now
+
+        pending += data
+        n = len(pending) // 4
+        words = struct.unpack_from(f'<{n}I', pending)
+        pending = pending[n * 4:]
+        for word in words:
+            if expected is not None and word != expected:
+                errors += 1
+                skipped = (word - expected) & 0xFFFFFFFF
+                if skipped < 1 << 31:
+                    missing += skipped
+            expected = (word + 1) & 0xFFFFFFFF
+        if words and rate:
+            if first is None:
+                first = (now, words[-1])
+            due = first[0] + ((words[-1] - first[1]) & 0xFFFFFFFF) / rate
+            lateness.append(now - due)
+
+    send_run(ser, 0)
+    if not gaps:
+        print("No data received")
+        return
+    elapsed = last - start
+    print(f"Received {total} bytes in {elapsed:.2f} s: {total / elapsed / 1e6:.3f} MB/s")
+    print(f"Pattern errors: {errors}, {missing} words missing")
+    if not rate:
+        transport = "iso" if ISO_USB else "bulk" if BULK_USB else "cdc"
+        with open(REPORT, "a") as f:
+            f.write(json.dumps({'date': datetime.datetime.now().isoformat(timespec='seconds'),
+                                'transport': transport, 'framed': STREAM_FRAMED, 'transfer': size,
+                                'bytes_per_s': total / elapsed, 'errors': errors}) + "\n")
+        print(f"Ceiling of {transport} appended to {REPORT}")
+    p = percentiles(gaps)
+    print("Gap between reads (ms): " + ", ".join(f"p{k} {v * 1e3:.3f}" for k, v in p.items())
+          + f", max {max(gaps) * 1e3:.3f}")
+    if lateness:
+        best = min(lateness)
+        p = percentiles([x - best for x in lateness])
+        print("Latency over the fastest read (ms): "
+              + ", ".join(f"p{k} {v * 1e3:.3f}" for k, v in p.items())
+              + f", max {(max(lateness) - best) * 1e3:.3f}")
+
+if __name__ == "__main__":
+    main()
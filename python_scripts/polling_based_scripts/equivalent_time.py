@@ -0,0 +1,150 @@
+"""Equivalent-time capture of a repeating signal: many triggered passes
+of the polling firmware's fastest sampling kernel, each started a cycle
+later after its trigger, interleaved into one waveform with a sample
+every CPU cycle (13.9 ns at 72 MHz) instead of every kernel period.
+
+  python equivalent_time.py --port /dev/ttyACM0 --channels CLK,DATA --trigger 1:1 --out frame.lacap
+
+The firmware ('e', protocol 7) waits for the trigger with interrupts
+off, then delay + pass % period cycles, and runs the kernel for
+--samples samples; it uploads each pass as BLOCK_MAGIC_EQUIV blocks
+whose times count from the trigger, measured with DWT->CYCCNT, so a pass
+that started a cycle late is placed where it was taken. The passes
+cover every cycle of the period --repeat times; samples that land on
+the same cycle are merged by a majority vote per channel. The result is
+an ordinary poll capture whose times are cycles after the trigger.
+
+Only a signal that repeats exactly relative to the trigger comes out
+right, e.g. a clock and its data on a periodic frame. An edge's place is
+uncertain by the few cycles the trigger loop takes to see the pattern;
+--repeat above 1 votes that spread down to where most passes put the
+edge."""
+import argparse
+import os
+import struct
+import time
+
+os.environ.setdefault("MPLBACKEND", "Agg")  # polling_plotter imports pyplot; no window is opened
+
+import numpy as np
+import serial
+
+import common_path  # puts python_scripts/common on sys.path
+import polling_plotter as plotter
+from capture_file import CaptureWriter, MODE_SAMPLES
+from pipeline import Pipeline
+
+KERNEL_UNROLL = 8  # samples per kernel loop: the firmware rounds a pass down to a multiple
+IDLE_S = 5.0  # no pass this long and the trigger is reported missing
+
+
+def send_equivalent(ser, trigger, rate_hz, delay, passes, samples):
+    """'e' mask(1) value(1) rate_hz(4) delay(4) passes(2) samples(2)"""
+    mask, value = trigger
+    ser.write(struct.pack('<cBBIIHH', b'e', mask, value, rate_hz, delay, passes, samples))
+
+
+def interleave(times, levels, channels):
+    """One sample per distinct time, each channel high where most of the
+    samples at that time saw it high"""
+    order = np.argsort(times, kind='stable')
+    times, levels = times[order], levels[order]
+    unique, counts = np.unique(times, return_counts=True)
+    votes = np.zeros((len(unique), channels), np.int64)
+    bits = (levels[:, None] >> np.arange(channels)) & 1
+    np.add.at(votes, np.repeat(np.arange(len(unique)), counts), bits)
+    merged = ((2 * votes >= counts[:, None]) << np.arange(channels)).sum(axis=1).astype(np.uint16)
+    return unique, merged
+
+
+def arguments():
+    parser = argparse.ArgumentParser(description="Equivalent-time capture of a repeating signal")
+    parser.add_argument("--port", default=plotter.SERIAL_PORT, help="serial port of the analyzer")
+    parser.add_argument("--bulk", action="store_true", help="USB_VENDOR_CLASS firmware: read through libusb")
+    parser.add_argument("--channels", required=True,
+                        help="names of CH1, CH2, ... comma separated, blank to leave one out")
+    parser.add_argument("--trigger", required=True, help="CH:LEVEL, every pass starts when CH (1-8) goes to LEVEL")
+    parser.add_argument("--rate", type=int, default=0, help="real-time rate of a pass in Hz, 0 = fastest kernel")
+    parser.add_argument("--delay", type=int, default=0, help="cycles from the trigger to the first sample")
+    parser.add_argument("--samples", type=int, default=1024, help="samples per pass")
+    parser.add_argument("--repeat", type=int, default=1, help="passes per cycle offset, merged by majority")
+    parser.add_argument("--out", default="equivalent.lacap", help="capture file")
+    args = parser.parse_args()
+
+    args.mapping = {ch: name.strip().upper() for ch, name in enumerate(args.channels.split(",")) if name.strip()}
+    ch, _, level = args.trigger.partition(":")
+    if not ch.isdigit() or not 1 <= int(ch) <= min(plotter.CHANNELS, 8) or level not in ("0", "1"):
+        parser.error("--trigger takes CH:LEVEL, e.g. 1:1")
+    bit = 1 << (int(ch) - 1)
+    args.trigger = (bit, bit if level == "1" else 0)
+    args.samples -= args.samples % KERNEL_UNROLL
+    if not 0 < args.samples < 1 << 16:
+        parser.error(f"--samples must be {KERNEL_UNROLL} to 65535")
+    return args
+
+
+def main():
+    args = arguments()
+    if args.bulk or plotter.BULK_USB:
+        from bulk_port import BulkPort
+        ser = BulkPort(timeout=0.2)
+    else:
+        ser = serial.Serial(args.port, plotter.BAUDRATE, timeout=0.2)
+    plotter.send_poll_mode(ser)
+    plotter.send_info_request(ser)
+    plotter.send_config(ser, 0, args.mapping)
+    ser.write(struct.pack('<cB', b'R', 0))  # no stream blocks between the passes
+
+    # the info block comes first and gives the clock. A round of passes
+    # covers every cycle of the kernel's period once, and the period shows
+    # in the samples of the first pass; the next round is asked for once
+    # the last one is in, since an 'e' ends the capture in progress
+    buffer = bytearray()
+    times, levels = [], []
+    period = None
+    asked = done = received = 0
+    last = time.monotonic()
+    try:
+        while done < args.repeat:
+            buffer.extend(ser.read(max(ser.in_waiting, 256)))
+            if asked == done and plotter.stream_clock_hz:
+                send_equivalent(ser, args.trigger, args.rate, args.delay, 0, args.samples)
+                asked += 1
+            got_times, got_levels = plotter.parse_blocks(buffer, keep=(plotter.BLOCK_MAGIC_EQUIV,))
+            if len(got_times):
+                times.append(got_times)
+                levels.append(got_levels)
+                received += len(got_times)
+                steps = np.diff(got_times)
+                if period is None and (steps > 0).any():
+                    period = int(steps[steps > 0].min())
+                last = time.monotonic()
+            if period and received >= period * args.samples:
+                received -= period * args.samples
+                done += 1
+                print(f"Round {done} of {args.repeat}: {period} passes of {args.samples} samples", flush=True)
+            elif asked and time.monotonic() - last > IDLE_S:
+                print("No pass for a while: is the trigger repeating?", flush=True)
+                last = time.monotonic()
+    except KeyboardInterrupt:
+        pass
+    ser.write(struct.pack('<cB', b'R', 1))
+    ser.close()
+    if not times:
+        print("Nothing captured")
+        return
+
+    tick_hz = plotter.stream_clock_hz
+    times, levels = interleave(np.concatenate(times) & 0xFFFFFFFF, np.concatenate(levels), plotter.CHANNELS)
+    writer = CaptureWriter(args.out, MODE_SAMPLES, args.mapping, tick_hz)
+    pipeline = Pipeline(writer)
+    pipeline.samples(times, levels)
+    pipeline.close()
+    covered = len(np.unique(times % period)) if period else 0
+    print(f"{len(times)} samples from {args.delay} to {int(times[-1])} cycles after the trigger, "
+          f"{covered} of {period} offsets in the kernel period covered, "
+          f"{1e9 / tick_hz:.1f} ns per cycle: {args.out}")
+
+
+if __name__ == "__main__":
+    main()
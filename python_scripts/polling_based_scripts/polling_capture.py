@@ -0,0 +1,74 @@
+"""Headless poll capture: polling_plotter.py's ingest without its
+prompts, plot or shared ring, for unattended captures on machines
+without a display.
+
+  python polling_capture.py --port /dev/ttyACM0 --channels RX,TX --rate 1000000 --duration 3600 --out run.lacap
+
+The channel names, sample rate, burst trigger, duration and output come
+from the arguments; the other settings are polling_plotter.py's, which
+this runs in-process. Only the ingest loop and the sinks behind it run,
+the capture writer and a pipeline.ThroughputSink that prints the record
+rate and MB/s every --stats seconds. The capture ends after --duration
+seconds or at Ctrl-C; either way the capture file is flushed and
+closed."""
+import argparse
+import os
+import signal
+import threading
+
+os.environ.setdefault("MPLBACKEND", "Agg")  # polling_plotter imports pyplot; no window is opened
+
+import common_path  # puts python_scripts/common on sys.path
+import polling_plotter as plotter
+from pipeline import ThroughputSink
+
+
+def arguments():
+    parser = argparse.ArgumentParser(description="Headless poll capture to a .lacap file")
+    parser.add_argument("--port", default=plotter.SERIAL_PORT, help="serial port of the analyzer")
+    parser.add_argument("--bulk", action="store_true", help="USB_VENDOR_CLASS firmware: read through libusb")
+    parser.add_argument("--channels", required=True,
+                        help="names of CH1, CH2, ... comma separated, blank to leave one out, e.g. RX,TX or SCL,SDA")
+    parser.add_argument("--rate", type=int, default=plotter.SAMPLE_RATE_HZ, help="sample rate in Hz, 0 = firmware default")
+    parser.add_argument("--burst", help="burst capture: CH:LEVEL to trigger when CH (1-8) goes to LEVEL, "
+                                        "or 'now' to start at once")
+    parser.add_argument("--duration", type=float, default=0, help="seconds to capture, 0 = until Ctrl-C")
+    parser.add_argument("--out", default=plotter.CAPTURE_PATH, help="capture file (default bitlog.lacap)")
+    parser.add_argument("--stats", type=float, default=1.0, help="seconds between throughput lines")
+    parser.add_argument("--serve", type=int, help="also serve the capture to remote clients on this TCP port "
+                                                  "(capture_server.py)")
+    args = parser.parse_args()
+
+    args.mapping = {ch: name.strip().upper() for ch, name in enumerate(args.channels.split(",")) if name.strip()}
+    if args.burst == "now":
+        args.burst = (0, 0)
+    elif args.burst:
+        ch, _, level = args.burst.partition(":")
+        if not ch.isdigit() or not 1 <= int(ch) <= min(plotter.CHANNELS, 8) or level not in ("0", "1"):
+            parser.error("--burst takes CH:LEVEL, e.g. 1:0, or now")
+        bit = 1 << (int(ch) - 1)
+        args.burst = (bit, bit if level == "1" else 0)
+    return args
+
+
+def main():
+    args = arguments()
+    plotter.SERIAL_PORT = args.port
+    plotter.BULK_USB = plotter.BULK_USB or args.bulk
+    plotter.CAPTURE_PATH = args.out
+    plotter.SERVE_PORT = args.serve or plotter.SERVE_PORT
+
+    stop = threading.Event()
+    signal.signal(signal.SIGINT, lambda *_: stop.set())
+    if args.duration:
+        timer = threading.Timer(args.duration, stop.set)
+        timer.daemon = True
+        timer.start()
+    print(f"Capturing {', '.join(args.mapping.values())} from {args.port} to {args.out}"
+          + (f" for {args.duration:g} s" if args.duration else ", Ctrl-C stops"), flush=True)
+    plotter.ingest(None, args.mapping, args.rate, args.burst, stop, sinks=[ThroughputSink(args.stats)])
+    print(f"Capture closed: {args.out}")
+
+
+if __name__ == "__main__":
+    main()
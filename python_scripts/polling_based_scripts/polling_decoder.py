@@ -1,84 +1,76 @@
-import csv
 import sys
-from collections import defaultdict
-import numpy as np
+
+import common_path  # puts python_scripts/common on sys.path
+from capture_file import RecordChunks
+from decode_cache import DecodeCache
+from decoder_core import decode, decode_parallel, load_index
+from event_output import EventWriter
+from pcap_output import PcapWriter
+from pipeline import decode_chunks
 
 # CPU frequency for STM32F103 (72 MHz)
 CPU_FREQ_HZ = 72_000_000
+WINDOW_S = None  # (start, end) seconds, e.g. (2820, 2880): decode only that stretch of a capture
+STRUCTURED_OUTPUT = None  # 'jsonl' or 'laev': write event records (event_output.py) instead of text reports;
+                          # 'pcapng': decoded frames for Wireshark (pcap_output.py)
+DECODE_CACHE = True  # keep decodes in <capture>.decodes/ and reuse them for the same parameters (decode_cache.py)
+PARALLEL_DECODE = True  # cut one long bus at its idle points and decode the pieces on every core (decoder_core.py)
+
+def decode_bus(index, protocol, **options):
+    """decode(), over every core with PARALLEL_DECODE"""
+    return (decode_parallel if PARALLEL_DECODE else decode)(index, protocol, **options)
 
 def cycles_to_microseconds(cycles):
     """Convert CPU cycles to microseconds"""
     return cycles / CPU_FREQ_HZ * 1_000_000
 
+def cached(filepath, protocol, params, compute):
+    """({source: events}, info) of a decode: compute(), which loads the
+    capture, or what DECODE_CACHE kept of the same decode of the same
+    capture; None when compute() found nothing to decode"""
+    cache = DecodeCache(filepath, WINDOW_S) if DECODE_CACHE else None
+    hit = cache.load(protocol, params) if cache else None
+    if hit:
+        print(f"{protocol.upper()} decode loaded from '{cache.folder}'")
+        return hit[1], hit[0]
+    result = compute()
+    if cache and result:
+        decoded, info = result
+        cache.store(protocol, params, CPU_FREQ_HZ, decoded, **info)
+    return result
+
+def structured(name, sources):
+    """EventWriter, or PcapWriter, of the STRUCTURED_OUTPUT file for an
+    output name, times in CPU cycles"""
+    writer = PcapWriter if STRUCTURED_OUTPUT == 'pcapng' else EventWriter
+    return writer(f"{name}.{STRUCTURED_OUTPUT}", CPU_FREQ_HZ, sources)
+
 def load_csv_data(filepath):
-    """Load CSV data and return channel data with cycle timestamps"""
-    channel_data = {}
-    
+    """Load a CSV export or bitlog.lacap capture into the decoder core's
+    TransitionIndex, every channel reduced to its level changes with
+    cycle timestamps"""
     try:
-        with open(filepath, 'r', newline='') as csvfile:
-            reader = csv.reader(csvfile)
-            header = next(reader)
-            print(f"CSV header: {header}")
-            
-            # Parse header to find channel columns
-            time_col = 0  # First column is time
-            channel_cols = {}
-            for i, col_name in enumerate(header[1:], 1):  # Skip time column
-                channel_cols[col_name] = i
-                channel_data[col_name] = []
-            
-            # Read data
-            for row in reader:
-                if len(row) != len(header):
-                    continue
-                    
-                try:
-                    timestamp = int(row[time_col])
-                except ValueError:
-                    continue
-                
-                # Store (timestamp, level) for each channel
-                for channel_name, col_idx in channel_cols.items():
-                    try:
-                        level = int(row[col_idx])
-                        channel_data[channel_name].append((timestamp, level))
-                    except (ValueError, IndexError):
-                        continue
-                        
+        index = load_index(filepath, window=WINDOW_S)
     except FileNotFoundError:
         print(f"Error: File '{filepath}' not found")
         return None
     except Exception as e:
         print(f"Error reading file: {e}")
         return None
-    
-    return channel_data
+    if index.tick_hz:
+        print(f"Capture channels: {index.names}, {index.tick_hz:.0f} Hz timestamps")
+    if index.drops:
+        print(f"WARNING: capture lost samples in {len(index.drops)} region(s); frames across them are flagged")
+    return index
 
-def calculate_actual_sampling_rate(channel_data):
-    """Calculate actual sampling rate from timestamp differences"""
-    # Use the first channel to analyze timing
-    first_channel = next(iter(channel_data.values()))
-    
-    if len(first_channel) < 100:
+def calculate_actual_sampling_rate(index):
+    """Calculate actual sampling rate from the spacing of the first poll
+    samples, measured when the capture was loaded"""
+    if index.sample_period is None:
         print("Warning: Not enough samples to accurately determine sampling rate")
         return None
     
-    # Calculate time differences between consecutive samples
-    time_diffs = []
-    for i in range(1, min(1000, len(first_channel))):  # Use first 1000 samples
-        time_diff = first_channel[i][0] - first_channel[i-1][0]
-        if time_diff > 0:  # Only positive differences
-            time_diffs.append(time_diff)
-    
-    if not time_diffs:
-        return None
-    
-    # Calculate statistics
-    avg_cycles_per_sample = np.mean(time_diffs)
-    std_cycles_per_sample = np.std(time_diffs)
-    
-    # Assuming 72 MHz CPU frequency
-    CPU_FREQ_HZ = 72_000_000
+    avg_cycles_per_sample, std_cycles_per_sample = index.sample_period
     actual_sampling_rate = CPU_FREQ_HZ / avg_cycles_per_sample
     
     print(f"Sampling Analysis:")
@@ -89,145 +81,67 @@ def calculate_actual_sampling_rate(channel_data):
     
     return actual_sampling_rate, avg_cycles_per_sample
 
-def find_edges(samples):
-    """Convert continuous samples to edge transitions"""
-    edges = []
-    if not samples:
-        return edges
-    
-    prev_level = samples[0][1]
-    for timestamp, level in samples[1:]:
-        if level != prev_level:
-            edge_type = 'rising' if level > prev_level else 'falling'
-            edges.append((edge_type, timestamp))
-            prev_level = level
-    
-    return edges
-
-def get_level_at_time(samples, target_time):
-    """Get signal level at a specific time from continuous samples"""
-    if not samples:
-        return 0
-    
-    # Find the sample at or before target_time
-    for i, (timestamp, level) in enumerate(samples):
-        if timestamp > target_time:
-            if i == 0:
-                return samples[0][1]
-            return samples[i-1][1]
-    
-    # If target_time is after all samples, return last level
-    return samples[-1][1]
-
 # ========== UART DECODER ==========
-def decode_uart_polling(channel_data, channel_name, baud_rate, data_bits=8, parity='N', stop_bits=1):
-    """Decode UART using actual sampling rate from CSV data"""
-    
-    if channel_name not in channel_data:
-        print(f"Channel {channel_name} not found in data")
-        return
+def decode_uart_polling(filepath, channel_name, baud_rate, data_bits=8, parity='N', stop_bits=1):
+    """Decode UART with the decoder core's 'uart' decoder, reporting the
+    bit time in samples of the actual sampling rate"""
+    bit_time_cycles = CPU_FREQ_HZ / baud_rate
     
-    # Calculate actual sampling rate
-    sampling_info = calculate_actual_sampling_rate(channel_data)
-    if not sampling_info:
-        print("Could not determine sampling rate")
+    def compute():
+        index = load_csv_data(filepath)
+        if index is None:
+            return None
+        if channel_name not in index:
+            print(f"Channel {channel_name} not found in data")
+            return None
+        
+        # Calculate actual sampling rate
+        sampling_info = calculate_actual_sampling_rate(index)
+        if not sampling_info:
+            print("Could not determine sampling rate")
+            return None
+        frames = decode_bus(index, 'uart', channel=channel_name, bit_time=bit_time_cycles,
+                        data_bits=data_bits, parity=parity, stop_bits=stop_bits)
+        return {channel_name: frames}, {'sampling': list(sampling_info)}
+    
+    result = cached(filepath, 'uart', dict(channel=channel_name, baud=baud_rate, data_bits=data_bits,
+                                           parity=parity, stop_bits=stop_bits), compute)
+    if result is None:
         return
+    decoded, info = result
+    frames = decoded[channel_name]
+    actual_sampling_rate, avg_cycles_per_sample = info['sampling']
     
-    actual_sampling_rate, avg_cycles_per_sample = sampling_info
-    
-    samples = channel_data[channel_name]
-    
-    # Calculate bit time in CPU cycles and samples
-    CPU_FREQ_HZ = 72_000_000
-    bit_time_cycles = CPU_FREQ_HZ / baud_rate
+    # Bit time in CPU cycles and samples
     bit_time_samples = bit_time_cycles / avg_cycles_per_sample
     
     print(f"\nDecoding UART on {channel_name}")
     print(f"Baud rate: {baud_rate}")
     print(f"Theoretical bit time: {bit_time_cycles:.0f} cycles ({bit_time_cycles/CPU_FREQ_HZ*1000000:.1f}µs)")
     print(f"Bit time in samples: {bit_time_samples:.2f} samples")
+    print(f"Found {len(frames)} potential UART frames")
+    if STRUCTURED_OUTPUT:
+        with structured(f"{channel_name}_uart_decoded", [channel_name]) as out:
+            out.write(channel_name, 'uart', frames)
+        print(f"{out.count} events written to: {out.path}")
+        return
     
-    # Find edges for frame detection
-    edges = find_edges(samples)
-    
-    # Detect UART frames (look for falling edges that could be start bits)
-    frame_starts = []
-    min_idle_time_samples = bit_time_samples * 0.8
-    
-    for i, (edge_type, timestamp) in enumerate(edges):
-        if edge_type == 'falling':
-            # Check if line was idle before this
-            if i == 0:
-                frame_starts.append(timestamp)
-            else:
-                # Check time since last edge
-                time_since_last = timestamp - edges[i-1][1]
-                samples_since_last = time_since_last / avg_cycles_per_sample
-                
-                if samples_since_last > min_idle_time_samples:
-                    # Verify it's a valid start bit
-                    next_rising = None
-                    for j in range(i+1, len(edges)):
-                        if edges[j][0] == 'rising':
-                            next_rising = edges[j][1]
-                            break
-                    
-                    if next_rising:
-                        start_bit_duration = (next_rising - timestamp) / avg_cycles_per_sample
-                        if start_bit_duration >= bit_time_samples * 0.5:
-                            frame_starts.append(timestamp)
-    
-    print(f"Found {len(frame_starts)} potential UART frames")
-    
-    # Decode each frame
+    # Report timing info for the first few frames and every error
     decoded_bytes = []
-    for start_time in frame_starts:
-        try:
-            # Sample data bits at bit centers
-            bits = []
-            for bit_index in range(data_bits):
-                # Sample at 1.5 bit times + bit_index * bit_time from start
-                sample_time = start_time + int(avg_cycles_per_sample * bit_time_samples * (1.5 + bit_index))
-                bit_value = get_level_at_time(samples, sample_time)
-                bits.append(bit_value)
-            
-            # Handle parity if enabled
-            parity_ok = True
-            if parity.upper() in ('E', 'O'):
-                parity_sample_time = start_time + int(avg_cycles_per_sample * bit_time_samples * (1.5 + data_bits))
-                parity_bit = get_level_at_time(samples, parity_sample_time)
-                
-                data_ones = sum(bits)
-                if parity.upper() == 'E':
-                    parity_ok = (data_ones % 2) == (1 - parity_bit)
-                else:
-                    parity_ok = (data_ones % 2) == parity_bit
-            
-            # Check stop bit
-            stop_bit_offset = 1.5 + data_bits + (1 if parity != 'N' else 0)
-            stop_sample_time = start_time + int(avg_cycles_per_sample * bit_time_samples * stop_bit_offset)
-            stop_bit = get_level_at_time(samples, stop_sample_time)
-            
-            # Compose byte (LSB first for UART)
-            byte_value = 0
-            for idx, bit_val in enumerate(bits):
-                byte_value |= (bit_val << idx)
-            
-            decoded_bytes.append(byte_value)
-            
-            # Report timing info for first few frames
-            if len(decoded_bytes) <= 3:
-                start_time_us = start_time / CPU_FREQ_HZ * 1000000
-                print(f"  Frame {len(decoded_bytes)}: Start at {start_time_us:.1f}µs, Byte: 0x{byte_value:02X} ('{chr(byte_value) if 32 <= byte_value < 127 else '.'}')")
-                print(f"    Bits: {' '.join(str(b) for b in bits)}")
-            
-            if not parity_ok:
-                print(f"  WARNING: Parity error at {start_time/CPU_FREQ_HZ*1000000:.1f}µs")
-            if stop_bit != 1:
-                print(f"  WARNING: Stop bit error at {start_time/CPU_FREQ_HZ*1000000:.1f}µs")
-                
-        except Exception as e:
-            print(f"Error decoding frame at {start_time/CPU_FREQ_HZ*1000000:.1f}µs: {e}")
+    for n, event in enumerate(frames):
+        start_time_us = cycles_to_microseconds(event[1])
+        if event[0] == 'lost':
+            print(f"  WARNING: Frame at {start_time_us:.1f}µs overlaps lost samples, not decoded")
+            continue
+        _, _, byte_value, ok, stop_bit = event
+        decoded_bytes.append(byte_value)
+        if n < 3:
+            print(f"  Frame {n + 1}: Start at {start_time_us:.1f}µs, Byte: 0x{byte_value:02X} ('{chr(byte_value) if 32 <= byte_value < 127 else '.'}')")
+            print(f"    Bits: {' '.join(str((byte_value >> i) & 1) for i in range(data_bits))}")
+        if not ok:
+            print(f"  WARNING: Parity error at {start_time_us:.1f}µs")
+        if stop_bit != 1:
+            print(f"  WARNING: Stop bit error at {start_time_us:.1f}µs")
     
     # Output results
     print(f"\n{'='*50}")
@@ -257,59 +171,48 @@ def decode_uart_polling(channel_data, channel_name, baud_rate, data_bits=8, pari
     print(f"Results saved to: {output_file}")
 
 # ========== SPI DECODER ==========
-def decode_spi_polling(channel_data, clk_channel, mosi_channel, miso_channel, clock_polarity=0, clock_phase=0):
-    """Decode SPI from continuous sampling data"""
-    
-    required_channels = [clk_channel, mosi_channel, miso_channel]
-    for ch in required_channels:
-        if ch not in channel_data:
-            print(f"Channel {ch} not found in data")
-            return
-    
-    clk_samples = channel_data[clk_channel]
-    mosi_samples = channel_data[mosi_channel]
-    miso_samples = channel_data[miso_channel]
+def decode_spi_polling(filepath, clk_channel, mosi_channel, miso_channel, clock_polarity=0, clock_phase=0):
+    """Decode SPI from continuous sampling data with the decoder core's
+    'spi' decoder"""
     
     print(f"Decoding SPI: CLK={clk_channel}, MOSI={mosi_channel}, MISO={miso_channel}")
     print(f"Clock polarity: {clock_polarity}, Clock phase: {clock_phase}")
     
-    # Find clock edges
-    clk_edges = find_edges(clk_samples)
-    
-    # Determine sampling edge
-    if clock_polarity == 0:
-        sample_edge = 'rising' if clock_phase == 0 else 'falling'
-    else:
-        sample_edge = 'falling' if clock_phase == 0 else 'rising'
-    
-    # Find sampling edges
-    sample_times = [timestamp for edge_type, timestamp in clk_edges if edge_type == sample_edge]
-    
-    print(f"Found {len(sample_times)} sampling edges")
-    
-    # Sample data at each clock edge
-    mosi_bytes = []
-    miso_bytes = []
-    current_mosi = 0
-    current_miso = 0
-    bit_count = 0
-    
-    for sample_time in sample_times:
-        mosi_bit = get_level_at_time(mosi_samples, sample_time)
-        miso_bit = get_level_at_time(miso_samples, sample_time)
-        
-        # SPI is MSB first
-        current_mosi = (current_mosi << 1) | mosi_bit
-        current_miso = (current_miso << 1) | miso_bit
-        bit_count += 1
+    def compute():
+        index = load_csv_data(filepath)
+        if index is None:
+            return None
+        required_channels = [clk_channel, mosi_channel, miso_channel]
+        for ch in required_channels:
+            if ch not in index:
+                print(f"Channel {ch} not found in data")
+                return None
         
-        if bit_count == 8:
-            mosi_bytes.append(current_mosi)
-            miso_bytes.append(current_miso)
-            print(f"SPI byte at {cycles_to_microseconds(sample_time):.1f}µs: MOSI=0x{current_mosi:02X}, MISO=0x{current_miso:02X}")
-            current_mosi = 0
-            current_miso = 0
-            bit_count = 0
+        # Mode 0 and 3 sample on the rising edge, 1 and 2 on the falling one
+        sample_times = index.edges(clk_channel, 1 if clock_polarity == clock_phase else 0)
+        print(f"Found {len(sample_times)} sampling edges")
+        return {'SPI': decode_bus(index, 'spi', clk=clk_channel, mosi=mosi_channel, miso=miso_channel,
+                              clock_polarity=clock_polarity, clock_phase=clock_phase)}, {}
+    
+    result = cached(filepath, 'spi', dict(clk=clk_channel, mosi=mosi_channel, miso=miso_channel,
+                                          clock_polarity=clock_polarity, clock_phase=clock_phase), compute)
+    if result is None:
+        return
+    events = result[0]['SPI']
+    if STRUCTURED_OUTPUT:
+        with structured("spi_decoded", ['SPI']) as out:
+            out.write('SPI', 'spi', events)
+        print(f"{out.count} SPI events written to: {out.path}")
+        return
+    mosi_bytes, miso_bytes = [], []
+    for event in events:
+        if event[0] == 'lost':
+            print(f"SPI data lost at {cycles_to_microseconds(event[1]):.1f}µs, {event[2]} bits discarded")
+            continue
+        _, sample_time, current_mosi, current_miso = event
+        mosi_bytes.append(current_mosi)
+        miso_bytes.append(current_miso)
+        print(f"SPI byte at {cycles_to_microseconds(sample_time):.1f}µs: MOSI=0x{current_mosi:02X}, MISO=0x{current_miso:02X}")
     
     # Output results
     print(f"\n{'='*20} SPI Results {'='*20}")
@@ -333,57 +236,55 @@ def decode_spi_polling(channel_data, clk_channel, mosi_channel, miso_channel, cl
     print("Results saved to: spi_decoded.txt")
 
 # ========== I2C DECODER ==========
-def decode_i2c_polling(channel_data, scl_channel, sda_channel):
-    """Decode I2C from continuous sampling data"""
-    
-    if scl_channel not in channel_data or sda_channel not in channel_data:
-        print(f"Required channels not found in data")
-        return
-    
-    scl_samples = channel_data[scl_channel]
-    sda_samples = channel_data[sda_channel]
+def i2c_line(event):
+    """Report line of an I2cStream event, without its time"""
+    kind = event[0]
+    if kind == 'start':
+        return "I2C repeated START" if event[2] else "I2C START"
+    if kind == 'stop':
+        return "I2C STOP"
+    if kind == 'address':
+        return f"I2C address 0x{event[2]:02X} {'read' if event[3] else 'write'}, {'ACK' if event[4] else 'NACK'}"
+    return f"I2C byte 0x{event[2]:02X}, {'ACK' if event[3] else 'NACK'}"
+
+def decode_i2c_polling(filepath, scl_channel, sda_channel):
+    """Decode I2C from continuous sampling data with the decoder core's
+    'i2c' decoder: one pass over the SCL and SDA changes merged in time
+    order, through the I2cStream state machine"""
     
     print(f"Decoding I2C: SCL={scl_channel}, SDA={sda_channel}")
     
-    # Find edges
-    scl_edges = find_edges(scl_samples)
-    sda_edges = find_edges(sda_samples)
-    
-    # Detect start/stop conditions (SDA changes while SCL is high)
-    start_stop_conditions = []
-    
-    for edge_type, timestamp in sda_edges:
-        scl_level = get_level_at_time(scl_samples, timestamp)
-        if scl_level == 1:  # SCL is high
-            if edge_type == 'falling':
-                start_stop_conditions.append(('START', timestamp))
-            elif edge_type == 'rising':
-                start_stop_conditions.append(('STOP', timestamp))
-    
-    # Sample data on SCL rising edges
-    scl_rising_times = [timestamp for edge_type, timestamp in scl_edges if edge_type == 'rising']
+    def compute():
+        index = load_csv_data(filepath)
+        if index is None:
+            return None
+        if scl_channel not in index or sda_channel not in index:
+            print(f"Required channels not found in data")
+            return None
+        return {'I2C': decode_bus(index, 'i2c', scl=scl_channel, sda=sda_channel)}, {}
+    
+    result = cached(filepath, 'i2c', dict(scl=scl_channel, sda=sda_channel), compute)
+    if result is None:
+        return
+    events = result[0]['I2C']
+    if STRUCTURED_OUTPUT:
+        with structured("i2c_decoded", ['I2C']) as out:
+            out.write('I2C', 'i2c', events)
+        print(f"{out.count} I2C events written to: {out.path}")
+        return
     
+    report = []
     decoded_bytes = []
-    current_byte = 0
-    bit_count = 0
-    
-    for sample_time in scl_rising_times:
-        sda_bit = get_level_at_time(sda_samples, sample_time)
-        
-        # I2C is MSB first
-        current_byte = (current_byte << 1) | sda_bit
-        bit_count += 1
-        
-        if bit_count == 8:
-            decoded_bytes.append(current_byte)
-            print(f"I2C byte at {cycles_to_microseconds(sample_time):.1f}µs: 0x{current_byte:02X}")
-            current_byte = 0
-            bit_count = 0
+    for event in events:
+        if event[0] == 'data':
+            decoded_bytes.append(event[2])
+        line = "I2C data lost, transaction dropped" if event[0] == 'lost' else i2c_line(event)
+        report.append(f"{line} at {cycles_to_microseconds(event[1]):.1f}µs")
     
     # Output results
     print(f"\n{'='*20} I2C Results {'='*20}")
-    for condition, timestamp in start_stop_conditions:
-        print(f"I2C {condition} at {cycles_to_microseconds(timestamp):.1f}µs")
+    for line in report:
+        print(line)
     
     print(f"Decoded bytes: {' '.join(f'{b:02X}' for b in decoded_bytes)}")
     print(f"ASCII: {''.join(chr(b) if 32 <= b < 127 else '.' for b in decoded_bytes)}")
@@ -395,55 +296,124 @@ def decode_i2c_polling(channel_data, scl_channel, sda_channel):
         f.write(f"CPU Frequency: {CPU_FREQ_HZ:,} Hz\n")
         f.write("=" * 50 + "\n")
         
-        for condition, timestamp in start_stop_conditions:
-            f.write(f"I2C {condition} at {cycles_to_microseconds(timestamp):.1f}µs\n")
+        for line in report:
+            f.write(line + "\n")
         
         f.write(f"Hex: {' '.join(f'{b:02X}' for b in decoded_bytes)}\n")
         f.write(f"ASCII: {''.join(chr(b) if 32 <= b < 127 else '.' for b in decoded_bytes)}\n")
     
     print("Results saved to: i2c_decoded.txt")
 
+# ========== CHUNKED DECODER ==========
+def decode_chunked_polling(reader, protocol, channels, baud_rate=None, data_bits=8, parity='N',
+                           clock_polarity=0, clock_phase=0):
+    """Decode a capture of any size chunk by chunk with the incremental
+    decoders (pipeline.decode_chunks), so memory follows the chunk size,
+    not the capture. channels names the protocol's lines: (rx,),
+    (clk, mosi, miso) or (scl, sda). Lines go to the output file as they
+    are decoded; there is no summary, which would grow with the capture"""
+    for name in channels:
+        if name not in reader.names:
+            print(f"Channel {name} not found in data")
+            return
+    lines = tuple(reader.names.index(name) for name in channels)
+    options = {}
+    if protocol == 'uart':
+        options = dict(bit_time=CPU_FREQ_HZ / baud_rate, data_bits=data_bits, parity=parity)
+        output_file = f"{channels[0]}_uart_decoded.txt"
+    elif protocol == 'spi':
+        lines += (None,)  # no SS line
+        options = dict(clock_polarity=clock_polarity, clock_phase=clock_phase)
+        output_file = "spi_decoded.txt"
+    else:
+        output_file = "i2c_decoded.txt"
+    
+    if STRUCTURED_OUTPUT:
+        source = channels[0] if protocol == 'uart' else protocol.upper()
+        with structured(output_file.rsplit(".", 1)[0], [source]) as out:
+            out.write(source, protocol, decode_chunks(reader, protocol, lines, **options))
+        print(f"Decoded {out.count} {protocol.upper()} events, written to: {out.path}")
+        return
+    
+    count = 0
+    with open(output_file, 'w') as f:
+        f.write(f"=== {protocol.upper()} Decoded Data (chunked) ===\n")
+        f.write(f"Channels: {', '.join(channels)}, CPU Frequency: {CPU_FREQ_HZ:,} Hz\n")
+        f.write("=" * 50 + "\n")
+        for event in decode_chunks(reader, protocol, lines, **options):
+            if event[0] == 'lost':
+                line = f"{protocol.upper()} data lost"
+            elif protocol == 'uart':
+                line = "UART framing or parity error" if event[2] is None else f"UART byte 0x{event[2]:02X}"
+            elif protocol == 'spi':
+                line = f"SPI byte MOSI=0x{event[2]:02X}, MISO=0x{event[3]:02X}"
+            else:
+                line = i2c_line(event)
+            f.write(f"{line} at {cycles_to_microseconds(event[1]):.1f}µs\n")
+            count += 1
+    
+    print(f"Decoded {count} {protocol.upper()} events, written to: {output_file}")
+
 # ========== MAIN FUNCTION ==========
 def main():
-    if len(sys.argv) != 3:
-        print("Usage: python polling_decoder.py <protocol> <csv_file>")
+    chunked = len(sys.argv) == 4 and sys.argv[3] == '--chunked'
+    if len(sys.argv) != 3 and not chunked:
+        print("Usage: python polling_decoder.py <protocol> <bitlog.lacap or csv file> [--chunked]")
         print("Supported protocols: uart, spi, i2c")
+        print("--chunked decodes a capture of any size in bounded memory")
         sys.exit(1)
     
     protocol = sys.argv[1].lower()
     csv_file = sys.argv[2]
     
-    # Load data
-    channel_data = load_csv_data(csv_file)
-    if not channel_data:
+    # Only the channel names: the decoders load the capture when
+    # DECODE_CACHE does not hold their decode, or read it chunk by chunk
+    try:
+        reader = RecordChunks(csv_file)
+    except FileNotFoundError:
+        print(f"Error: File '{csv_file}' not found")
         return
+    except Exception as e:
+        print(f"Error reading file: {e}")
+        return
+    names = reader.names
     
-    print(f"Available channels: {list(channel_data.keys())}")
+    print(f"Available channels: {names}")
     
     try:
         if protocol == 'uart':
             print("\nUART Decoder Configuration:")
-            channel = input(f"Enter UART channel name from {list(channel_data.keys())}: ")
+            channel = input(f"Enter UART channel name from {names}: ")
             baud = int(input("Enter UART baud rate (e.g., 9600): "))
             data_bits = int(input("Enter number of data bits (7 or 8): "))
             parity = input("Enter parity (N = none, E = even, O = odd): ").upper()
             stop_bits = int(input("Enter number of stop bits (1 or 2): "))
-            decode_uart_polling(channel_data, channel, baud, data_bits, parity, stop_bits)
+            if chunked:
+                decode_chunked_polling(reader, 'uart', (channel,), baud, data_bits, parity)
+            else:
+                decode_uart_polling(csv_file, channel, baud, data_bits, parity, stop_bits)
             
         elif protocol == 'spi':
             print("\nSPI Decoder Configuration:")
-            clk_ch = input(f"Enter CLK channel name from {list(channel_data.keys())}: ")
-            mosi_ch = input(f"Enter MOSI channel name from {list(channel_data.keys())}: ")
-            miso_ch = input(f"Enter MISO channel name from {list(channel_data.keys())}: ")
+            clk_ch = input(f"Enter CLK channel name from {names}: ")
+            mosi_ch = input(f"Enter MOSI channel name from {names}: ")
+            miso_ch = input(f"Enter MISO channel name from {names}: ")
             clock_pol = int(input("Enter clock polarity (0 = idle low, 1 = idle high): "))
             clock_phase = int(input("Enter clock phase (0 = sample on leading edge, 1 = trailing edge): "))
-            decode_spi_polling(channel_data, clk_ch, mosi_ch, miso_ch, clock_pol, clock_phase)
+            if chunked:
+                decode_chunked_polling(reader, 'spi', (clk_ch, mosi_ch, miso_ch),
+                                       clock_polarity=clock_pol, clock_phase=clock_phase)
+            else:
+                decode_spi_polling(csv_file, clk_ch, mosi_ch, miso_ch, clock_pol, clock_phase)
             
         elif protocol == 'i2c':
             print("\nI2C Decoder Configuration:")
-            scl_ch = input(f"Enter SCL channel name from {list(channel_data.keys())}: ")
-            sda_ch = input(f"Enter SDA channel name from {list(channel_data.keys())}: ")
-            decode_i2c_polling(channel_data, scl_ch, sda_ch)
+            scl_ch = input(f"Enter SCL channel name from {names}: ")
+            sda_ch = input(f"Enter SDA channel name from {names}: ")
+            if chunked:
+                decode_chunked_polling(reader, 'i2c', (scl_ch, sda_ch))
+            else:
+                decode_i2c_polling(csv_file, scl_ch, sda_ch)
             
         else:
             print("Unsupported protocol. Use 'uart', 'spi', or 'i2c'.")
@@ -454,4 +424,4 @@ def main():
         print(f"Error: {e}")
 
 if __name__ == "__main__":
-    main()
\ No newline at end of file
+    main()
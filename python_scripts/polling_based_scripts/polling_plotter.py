@@ -1,33 +1,321 @@
 import serial
 import struct
-import csv
-import threading
+import multiprocessing
+import os
+import time
+import numpy as np
 import matplotlib.pyplot as plt
 import matplotlib.animation as animation
-from collections import defaultdict, deque
+
+import common_path  # puts python_scripts/common on sys.path
+from capture_file import CaptureWriter, MODE_SAMPLES, level_records
+import capture_transcode
+from pipeline import Pipeline, RingSink, StatsSink, UartSink, ProtocolStatsSink, StageReport, stage
+from trace_export import ExportSink
+from pcap_output import PcapSink
+from capture_server import ServerSink
+from live_annotations import AnnotationOverlay
+from protocol_id import IdentifySink, auto_mapping, is_auto
+from trace_export import ExportSink
+from clock_sync import ClockSync
+from shm_ring import SharedRing
+from telemetry import Telemetry, TelemetryPanel
 
 # ========================
 # Config
 # ========================
 SERIAL_PORT = '/dev/tty.usbmodem385A439452311'  # Update as needed
 BAUDRATE = 115200
-SAMPLE_STRUCT = struct.Struct("<IB")  # uint32_t timestamp + uint8_t value
-SAMPLE_SIZE = SAMPLE_STRUCT.size  # 5 bytes per sample
-MAX_SAMPLES = 2500000  # Max samples per channel for plotting (2.5 mill)
+BULK_USB = False  # True for a USB_VENDOR_CLASS firmware build: read through libusb (bulk_port.py)
+# Block header + packed samples of the sampled channels, sample i at
+# start + i * period
+# magic, count, start, end, period, mask, bits, fixups
+BLOCK_STRUCT = struct.Struct("<HHIIIBBH")
+FIXUP_STRUCT = struct.Struct("<HH")  # sample index, cycles late
+BLOCK_MAGIC = 0xB10C
+BLOCK_MAGIC_RLE = 0xB10D  # POLL_RLE firmware: count = bytes of run records
+BLOCK_MAGIC_BURST = 0xB10E    # packed block of a burst capture
+BLOCK_MAGIC_TRIGGER = 0xB10F  # burst block starting at the trigger sample
+BLOCK_MAGIC_EQUIV = 0xB117  # equivalent-time pass, times counted from its trigger (equivalent_time.py)
+PACKED_MAGICS = (BLOCK_MAGIC, BLOCK_MAGIC_BURST, BLOCK_MAGIC_TRIGGER, BLOCK_MAGIC_EQUIV)
+BLOCK_MAGIC_STATS = 0xB110  # POLL_STATS firmware: timing histograms
+STATS_INTERVAL_BINS = 32   # 1-cycle bins of sample interval - period, from -16
+BLOCK_MAGIC_INFO = 0xB111  # reply to 'V': protocol version, capabilities, clock
+BLOCK_MAGIC_SYNC = 0xB112  # SOF_SYNC_FRAMES firmware: USB frame count, CYCCNT at that SOF
+BLOCK_MAGIC_HEALTH = 0xB113  # HEALTH_REPORT_MS firmware: blocks, bytes, stalls, USB busy, cycles
+BLOCK_MAGIC_HEADER = 0xB114  # opens the stream of new 'C' settings: one StreamHeader, see host_cmd.h
+WORD_MAGICS = (BLOCK_MAGIC_STATS, BLOCK_MAGIC_INFO, BLOCK_MAGIC_SYNC, BLOCK_MAGIC_HEALTH,
+               BLOCK_MAGIC_HEADER)  # count = words
+BLOCK_MAGIC_DECIMATE = 0xB116  # POLL_DECIMATE firmware after 'D': count = window records, bits = channels
+STREAM_HEADER_MAGIC = 0x4D525453  # "STRM"
+STREAM_COMPRESSIONS = {0: "packed", 1: "compact", 2: "run-length", 3: "predicted",
+                       4: "decimated"}  # STREAM_COMPRESSION_*
+# HOST_CAP_* bits of the 'V' reply, see host_cmd.h
+CAPABILITIES = ["events", "poll", "dma", "burst", "rle", "stats", "flush",
+                "snapshot", "compact", "ic_dma", "bulk", "framed", "bench", "sof_sync", "iso",
+                "uart", "trigger", "spi", "i2c", "glitch", "channels", "storm", "clock", "layout", "measure",
+                "trim", "wide", "sync", "dual", "adaptive", "flash_log", "decimate"]
+CHANNELS = 4           # LOGIC mode names CH1 to this; 8 or 16 for a POLL_CHANNELS firmware
+SAMPLE_RATE_HZ = 0     # 0 = firmware default
+BLOCK_SAMPLES = 0      # samples per USB block, 0 = largest that fits
+BURST_PRE_PERCENT = 50  # share of a burst window before the trigger
+BURST_SEGMENTS = 1     # e.g. 200: split the burst window into this many, one per trigger (protocol v6 firmware)
+STATS_EVERY_S = 0      # POLL_STATS firmware: ask for timing histograms this often, 0 = never
+DECIMATE_WINDOW = 0    # POLL_DECIMATE firmware: samples the device sums up per window, for overviews of long captures; 0 = every sample
+MAX_SAMPLES = 1 << 22  # Samples kept for plotting (4.2 mill), a multiple of the top LOD bucket
+LOD_FANOUT = 8         # samples per bucket of the next coarser plot level
+LOD_LEVELS = 8         # full detail plus 7 min/max levels, up to 2M samples a bucket
+MAX_POINTS = 2000      # buckets drawn per channel before a coarser level is used
+HISTORY_PATH = "bitlog.history"  # folder the pyramid spills its older halves to, paged back on scroll; None = discard them
+FOLLOW_WINDOW = 200000  # cycles shown before the latest sample while following
+CAPTURE_PATH = "bitlog.lacap"
+FLUSH_EVERY_S = 1.0    # bitlog.lacap buffer flush period
+SEGMENT_MB = 0         # soak tests: start a new bitlog-NNNN.lacap segment after this many MB, 0 = one file
+SEGMENT_MINUTES = 0    # ... or after this many minutes, 0 = never
+TRANSCODE_WORKERS = 0  # with segments: pack each finished one into an archive and tiles on this many background processes (capture_transcode.py), 0 = off
+LIVE_STATS_S = 0       # print sample rates this often while capturing, 0 = never
+STAGE_STATS_S = 0      # e.g. 5: print what each host stage did this often, from both processes, 0 = never
+STAGE_STATS_JSON = "stage_stats-{role}.json"  # SIGUSR1 writes every stage's counters here, None = off
+LIVE_UART = None       # (channel index, baud), e.g. (0, 115200): print that channel's UART bytes while capturing
+LIVE_SKIP_LAG_S = 2.0  # LIVE_UART falling this far behind skips to the latest batch, None = never
+LIVE_SKIP_LOG = "live_skips.csv"  # the capture time ranges it skipped, to decode offline, None = off
+PROTOCOL_STATS_S = 0   # e.g. 10: print rolling I2C/UART/SPI rates of the decoded bus this often, 0 = never
+PROTOCOL_STATS_BAUD = 115200  # UART's baud for them
+PROTOCOL_STATS_CSV = None  # e.g. "protocol_stats.csv": also append every report to it
+LIVE_EXPORT = None     # "bitlog.vcd" or "bitlog.sr": also write the capture for PulseView/GTKWave (trace_export.py)
+LIVE_PCAP = None       # (path, UART baud), e.g. ("live.pcapng", 115200): also write the decoded frames for Wireshark (pcap_output.py)
+SERVE_PORT = None      # e.g. 7878: serve the live capture to remote clients over TCP/WebSocket (capture_server.py)
+HEALTH_PANEL = True    # show the link health panel beside the waveforms (telemetry.py)
+HEALTH_EVERY_S = 0.2   # the panel's host figures are refreshed this often
+VIEWER = "matplotlib"  # or "gl": the OpenGL viewer for millions of changes (gl_viewer.py, needs vispy)
+ANNOTATE = False       # label the waveforms with the bytes decoded as they arrive (live_annotations.py)
+ANNOTATE_BAUD = 115200  # UART's baud for the labels
 
 # ========================
 # Data Storage
 # ========================
-channel_data = defaultdict(lambda: deque(maxlen=MAX_SAMPLES))
-prev_levels = {ch: 0 for ch in range(4)}  # previous pin values
+class SamplePyramid:
+    """Samples of all channels with min/max levels of detail, appended
+    as they arrive. Level 0 holds every sample's time and CH1-CH16 bit mask;
+    a bucket of level k covers LOD_FANOUT ** k samples and keeps the AND
+    (low if any sample is low) and OR (high if any is high) of their masks.
+    Times are unwrapped to 64 bits so a view can be found by binary search.
+    When full, the older half is dropped from every level, into history
+    (a SampleHistory) if given. Samples and buckets are numbered from the
+    first ever kept, the history's first, then the pyramid's."""
+
+    def __init__(self, capacity=MAX_SAMPLES, history=None):
+        self.times = np.empty(capacity, np.int64)
+        self.values = np.empty(capacity, np.uint16)
+        self.lo = [None] + [np.empty(capacity // LOD_FANOUT ** k, np.uint16) for k in range(1, LOD_LEVELS)]
+        self.hi = [None] + [np.empty(capacity // LOD_FANOUT ** k, np.uint16) for k in range(1, LOD_LEVELS)]
+        self.counts = [0] * LOD_LEVELS
+        self.history = history
+        self.last_raw = None  # 32-bit cycle time of the latest sample
+
+    def _unwrap(self, raw):
+        prev = np.concatenate([[self.last_raw if self.last_raw is not None else raw[0]], raw[:-1]])
+        step = (raw - prev) & 0xFFFFFFFF
+        step = np.where(step >= 1 << 31, step - (1 << 32), step)
+        base = self.times[self.counts[0] - 1] if self.counts[0] else int(raw[0])
+        self.last_raw = int(raw[-1])
+        return base + np.cumsum(step)
+
+    def _drop_half(self):
+        for k in range(LOD_LEVELS):
+            drop = len(self.times) // 2 // LOD_FANOUT ** k
+            keep = self.counts[k] - drop
+            if self.history is not None:
+                self.history.spill(k, *self._hot(k, 0, drop))
+            if k == 0:
+                self.times[:keep] = self.times[drop:self.counts[0]]
+                self.values[:keep] = self.values[drop:self.counts[0]]
+            else:
+                self.lo[k][:keep] = self.lo[k][drop:self.counts[k]]
+                self.hi[k][:keep] = self.hi[k][drop:self.counts[k]]
+            self.counts[k] = keep
+
+    def append(self, raw_times, values):
+        raw_times = raw_times[-(len(self.times) // 2):].astype(np.int64)
+        values = values[-(len(self.times) // 2):]
+        n = len(raw_times)
+        if not n:
+            return
+        times = self._unwrap(raw_times)
+        if self.counts[0] + n > len(self.times):
+            self._drop_half()
+        first = self.counts[0]
+        self.times[first:first + n] = times
+        self.values[first:first + n] = values
+        self.counts[0] += n
+        # complete buckets of each level, built from the level below
+        for k in range(1, LOD_LEVELS):
+            new = self.counts[k - 1] // LOD_FANOUT
+            old = self.counts[k]
+            if new == old:
+                break
+            src_lo = self.values if k == 1 else self.lo[k - 1]
+            src_hi = self.values if k == 1 else self.hi[k - 1]
+            block_lo = src_lo[old * LOD_FANOUT:new * LOD_FANOUT]
+            block_hi = src_hi[old * LOD_FANOUT:new * LOD_FANOUT]
+            lo = block_lo[0::LOD_FANOUT]
+            hi = block_hi[0::LOD_FANOUT]
+            for r in range(1, LOD_FANOUT):
+                lo = lo & block_lo[r::LOD_FANOUT]
+                hi = hi | block_hi[r::LOD_FANOUT]
+            self.lo[k][old:new] = lo
+            self.hi[k][old:new] = hi
+            self.counts[k] = new
+
+    def latest(self):
+        return int(self.times[self.counts[0] - 1]) if self.counts[0] else None
+
+    def _hot(self, k, j0, j1):
+        """(times, values) of level 0, or (lo, hi) of level k, [j0, j1) of the pyramid's own"""
+        if k == 0:
+            return self.times[j0:j1], self.values[j0:j1]
+        return self.lo[k][j0:j1], self.hi[k][j0:j1]
+
+    def _spilled(self, k):
+        return self.history.counts[k] if self.history is not None else 0
+
+    def _count(self, k):
+        return self._spilled(k) + self.counts[k]
+
+    def _level(self, k, j0, j1):
+        """_hot() by numbers over the history and the pyramid: the history's
+        part is read from its maps"""
+        old = self._spilled(k)
+        if j0 >= old:
+            return self._hot(k, j0 - old, j1 - old)
+        cold = self.history.level(k)
+        if j1 <= old:
+            return tuple(np.asarray(part[j0:j1]) for part in cold)
+        return tuple(np.concatenate([part[j0:], hot]) for part, hot in zip(cold, self._hot(k, 0, j1 - old)))
+
+    def _times_at(self, numbers):
+        old = self._spilled(0)
+        times = np.empty(len(numbers), np.int64)
+        hot = numbers >= old
+        times[hot] = self.times[numbers[hot] - old]
+        if not hot.all():
+            times[~hot] = self.history.level(0)[0][numbers[~hot]]
+        return times
+
+    def _search(self, t):
+        """Number of the first sample after t"""
+        old = self._spilled(0)
+        if old and (not self.counts[0] or t < self.times[0]):
+            return int(np.searchsorted(self.history.level(0)[0], t, side='right'))
+        return old + int(np.searchsorted(self.times[:self.counts[0]], t, side='right'))
+
+    def _points(self, k, i0, i1):
+        """x and mask parts for samples [i0, i1) from level k down"""
+        if k == 0:
+            times, values = self._level(0, i0, i1)
+            return [times], [values]
+        size = LOD_FANOUT ** k
+        j0 = i0 // size
+        j1 = min(-(-i1 // size), self._count(k))
+        if j1 <= j0:
+            return self._points(k - 1, i0, i1)
+        # each bucket is drawn low from its start and high from its middle:
+        # a flat line when all its samples agree, a full-height pulse otherwise
+        starts = np.arange(j0, j1) * size
+        ends = np.minimum(starts + size, self._count(0) - 1)
+        t_start = self._times_at(starts)
+        t_mid = (t_start + self._times_at(ends)) // 2
+        x = np.empty(2 * (j1 - j0), np.int64)
+        y = np.empty(2 * (j1 - j0), np.uint16)
+        x[0::2] = t_start
+        x[1::2] = t_mid
+        y[0::2], y[1::2] = self._level(k, j0, j1)
+        xs, ys = [x], [y]
+        if j1 * size < i1:
+            tail_x, tail_y = self._points(k - 1, j1 * size, i1)
+            xs += tail_x
+            ys += tail_y
+        return xs, ys
+
+    def view(self, start, end):
+        """(times, masks) to draw for [start, end], at most about
+        MAX_POINTS buckets: the sample before the view holds into it, and
+        the one after it carries the line to the edge"""
+        i0 = max(self._search(start) - 1, 0)
+        i1 = min(self._search(end) + 1, self._count(0))
+        k = 0
+        while k < LOD_LEVELS - 1 and (i1 - i0) // LOD_FANOUT ** k > MAX_POINTS:
+            k += 1
+        xs, ys = self._points(k, i0, i1)
+        return np.concatenate(xs), np.concatenate(ys)
+
+
+class SampleHistory:
+    """The halves SamplePyramid dropped, every level of them, appended to
+    files in a folder and read back through read-only memory maps. A view
+    scrolled back before the pyramid finds its samples by binary search on
+    the spilled times and draws from the spilled min/max level that fits,
+    so the OS pages in only what it draws and a session of any length
+    stays scrollable while the plot's own memory stays the pyramid's. The
+    folder is cleared when a session starts"""
+
+    def __init__(self, path):
+        os.makedirs(path, exist_ok=True)
+        self.path = path
+        self.counts = [0] * LOD_LEVELS
+        self.files = {}  # level -> its two files, open for appending
+        self.maps = {}   # level -> its two memory maps, until the next spill
+        for k in range(LOD_LEVELS):
+            self.files[k] = tuple(open(self._file(k, part), 'wb') for part in (0, 1))
+
+    def _file(self, k, part):
+        name = ("times", "values")[part] if k == 0 else f"{('lo', 'hi')[part]}{k}"
+        return os.path.join(self.path, name)
+
+    def _dtype(self, k, part):
+        return np.int64 if k == 0 and part == 0 else np.uint16
+
+    def spill(self, k, first, second):
+        """Appends dropped (times, values) of level 0 or (lo, hi) of level k"""
+        for f, data in zip(self.files[k], (first, second)):
+            f.write(data.tobytes())
+            f.flush()
+        self.counts[k] += len(first)
+        self.maps.pop(k, None)
+
+    def level(self, k):
+        """The two arrays of level k spilled so far, memory mapped"""
+        if k not in self.maps:
+            self.maps[k] = tuple(np.memmap(self._file(k, part), self._dtype(k, part), 'r', shape=(self.counts[k],))
+                                 for part in (0, 1))
+        return self.maps[k]
+
+
+samples_data = SamplePyramid()
+ring = None  # SharedRing the ingest process writes the capture records to
+panel = None  # TelemetryPanel beside the waveforms, None without one
+annotations = None  # AnnotationOverlay of decoded bytes, None without one
+read_stage = stage("port read")  # bytes read
+decode_stage = stage("decode")   # bytes in, samples out
+plot_stage = stage("plot")  # records the frames took from the ring; those lost to it count as shed
+plot_report = None  # StageReport of the plot process, set by main
+telemetry = None  # Telemetry of the plot's health panel, set by ingest
+follow = True       # the view tracks the latest sample until the user zooms or pans
+last_xlim = None    # view set by the last update
+prev_value = None  # CH1-CH16 mask of the latest sample kept
+next_block_start = None  # cycle time the next block starts at if none was lost
+clock_sync = ClockSync()  # CYCCNT -> host time, from sync blocks
+sync_log = []  # (frame, cycles, host time) pairs not yet logged
+stream_clock_hz = None  # CYCCNT clock from the info block
+DRIFT_EVERY = 100  # sync blocks between drift reports
 
 # ========================
 # User Setup Phase
 # ========================
 
 def get_comm_type():
-    comm_type = input("Enter communication type (UART, SPI, I2C): ").strip().upper()
-    if comm_type not in {"UART", "SPI", "I2C"}:
+    comm_type = input("Enter communication type (UART, SPI, I2C, LOGIC, AUTO to identify it): ").strip().upper()
+    if comm_type not in {"UART", "SPI", "I2C", "LOGIC", "AUTO"}:
         print("Invalid communication type.")
         exit(1)
     return comm_type
@@ -45,96 +333,447 @@ def get_channel_mapping(comm_type):
     elif comm_type == "I2C":
         mapping[0] = input("Assign channel CH1 to (CLK or SDA): ").strip().upper()
         mapping[1] = input("Assign channel CH2 to (CLK or SDA): ").strip().upper()
+    elif comm_type == "LOGIC":
+        for ch in range(CHANNELS):
+            name = input(f"Name of channel CH{ch + 1} (blank to leave it out): ").strip().upper()
+            if name:
+                mapping[ch] = name
+    elif comm_type == "AUTO":
+        mapping = auto_mapping(4)  # protocol_id.py names the roles once it has seen the bus
     return mapping
 
+def get_sample_rate():
+    rate = input("Sample rate in Hz (blank for default): ").strip()
+    return int(rate) if rate else SAMPLE_RATE_HZ
+
+def get_burst_trigger():
+    """Returns None to stream, else (mask, value) of the burst trigger."""
+    mode = input("Capture mode (STREAM or BURST): ").strip().upper()
+    if mode != "BURST":
+        return None
+    ch = input(f"Trigger channel (1-{min(CHANNELS, 8)}, blank to trigger at once): ").strip()
+    if not ch:
+        return (0, 0)
+    level = input("Trigger when the channel goes to (0 or 1): ").strip()
+    return (1 << (int(ch) - 1), (1 << (int(ch) - 1)) if level == "1" else 0)
+
+def send_burst(ser, trigger, rate_hz):
+    """'B' mask(1) value(1) pre(1) rate_hz(4): with rate 0 the firmware
+    samples as fast as its burst loop runs. With BURST_SEGMENTS above 1,
+    'A' with the same fields and segments(2) instead: each segment is a
+    window of its own trigger, and all are uploaded once the last one
+    triggered, each marked by its trigger block."""
+    mask, value = trigger
+    if BURST_SEGMENTS > 1:
+        ser.write(struct.pack('<cBBBIH', b'A', mask, value, BURST_PRE_PERCENT, rate_hz, BURST_SEGMENTS))
+    else:
+        ser.write(struct.pack('<cBBBI', b'B', mask, value, BURST_PRE_PERCENT, rate_hz))
+
+def send_poll_mode(ser):
+    """'M' mode(1): the combined firmware image switches to its polling
+    engine; the polling firmware skips the command. Block parsing
+    resyncs on the magic past any edge events still in flight."""
+    ser.write(struct.pack('<cB', b'M', 1))
+
+def send_info_request(ser):
+    """'V': the firmware answers with one BLOCK_MAGIC_INFO block."""
+    ser.write(b'V')
+
+def send_config(ser, rate_hz, mapping):
+    """'C' rate_hz(4) mask(1) samples(2): only the assigned channels are
+    sampled, so fewer channels leave USB bandwidth for a higher rate; a
+    16-channel firmware always sends them all."""
+    mask = sum(1 << ch for ch in mapping if ch < 8)
+    ser.write(struct.pack('<cIBH', b'C', rate_hz, mask, BLOCK_SAMPLES))
+
+def send_decimate(ser, window):
+    """'D' window(4): a POLL_DECIMATE firmware sends one record per window
+    samples instead of the samples, 0 turns it off; other builds skip it."""
+    ser.write(struct.pack('<cI', b'D', window))
+
 # ========================
-# Serial Reader Thread
+# Stream Parsing
 # ========================
-def read_usb(mapping):
-    ser = serial.Serial(SERIAL_PORT, BAUDRATE, timeout=1)
-    with open("bitlog.csv", "w", newline='') as f:
-        writer = csv.writer(f)
-        
-        # Create header with channel names
-        header = ["Time"]
-        for ch in range(4):
-            if ch in mapping:
-                header.append(f"{mapping[ch]}")
+def expand_table(mask):
+    """Channel levels of every packed value, as an array to index with them:
+    packed bit k is the k-th sampled channel of mask; unsampled channels
+    read as 0."""
+    channels = np.flatnonzero((mask >> np.arange(8)) & 1)
+    packed = np.arange(1 << len(channels))
+    return (((packed[:, None] >> np.arange(len(channels))) & 1) << channels).sum(axis=1).astype(np.uint16)
+
+def port_levels(raw):
+    """Channel levels of 16-bit GPIOB samples (bits = 16): CH1-CH4 are
+    PB4-PB7, CH5-CH8 PB0-PB3 and CH9-CH16 PB8-PB15"""
+    raw = raw.astype(np.uint16)
+    return (raw & 0xFF00) | ((raw >> 4) & 0x0F) | ((raw & 0x0F) << 4)
+
+def print_stats(period, words):
+    """Shows a BLOCK_MAGIC_STATS block: how far consecutive samples were
+    from the nominal period, and how long blocks waited for USB."""
+    interval, stall = words[:STATS_INTERVAL_BINS], words[STATS_INTERVAL_BINS:]
+    print(f"Sample intervals (period {period} cycles):")
+    for i, n in enumerate(interval):
+        if n:
+            d = i - STATS_INTERVAL_BINS // 2
+            edge = "<=" if i == 0 else ">=" if i == STATS_INTERVAL_BINS - 1 else ""
+            print(f"  {edge}{period + d:6d} cycles: {n}")
+    print(f"USB waits: {stall[0]} blocks queued without waiting")
+    for i, n in enumerate(stall[1:], 1):
+        if n:
+            print(f"  {1 << (i - 1):>10d}-{(1 << i) - 1} cycles: {n}")
+
+def print_info(version, caps, clock_hz, tx_queue_peak=None, glitches=None):
+    """Shows a BLOCK_MAGIC_INFO block."""
+    global stream_clock_hz
+    stream_clock_hz = clock_hz
+    names = [name for bit, name in enumerate(CAPABILITIES) if caps & (1 << bit)]
+    print(f"Firmware protocol v{version}, {clock_hz} Hz timestamps, "
+          f"capabilities: {', '.join(names) or 'none'}")
+    if tx_queue_peak is not None:
+        # 1 means USB always kept up; the firmware's USB_TX_QUEUE means
+        # producers found the transmit queue full
+        print(f"USB transmit queue high-water mark: {tx_queue_peak}")
+    if glitches:
+        print(f"Glitch filter: {glitches} pulses shorter than the minimum width dropped")
+
+def report_header(words):
+    """Shows a BLOCK_MAGIC_HEADER block and takes the clock from it; the
+    blocks themselves say how they are packed, so only a channel count
+    other than CHANNELS needs the user"""
+    global stream_clock_hz
+    check = 0
+    for word in words[:5]:
+        check ^= word
+    if len(words) < 6 or words[0] != STREAM_HEADER_MAGIC or words[5] != ~check & 0xFFFFFFFF:
+        print("WARNING: corrupt stream header block")
+        return
+    version, _, _, compression = words[1].to_bytes(4, 'little')
+    channels, _, _, protocol = words[2].to_bytes(4, 'little')
+    stream_clock_hz = words[3]
+    print(f"Stream header v{version} (protocol v{protocol}): {channels} channels, "
+          f"{STREAM_COMPRESSIONS.get(compression, compression)} blocks, {words[3]} Hz timestamps")
+    if channels != CHANNELS:
+        print(f"WARNING: the firmware samples {channels} channels, set CHANNELS = {channels}")
+
+def report_sync(frame, cycles):
+    """Feeds a BLOCK_MAGIC_SYNC pair to the clock fit and queues it for the
+    CSV log with the host time it maps to."""
+    clock_sync.add(frame, cycles)
+    sync_log.append((frame, cycles, clock_sync.to_host(cycles)))
+    drift = clock_sync.drift_ppm(stream_clock_hz) if stream_clock_hz else None
+    if drift is not None and len(clock_sync.pairs) % DRIFT_EVERY == 0:
+        print(f"Firmware clock {drift:+.1f} ppm against the USB frame clock")
+
+def report_health(blocks, sent, stalls, busy, cycles):
+    """Hands a BLOCK_MAGIC_HEALTH block's rates to the health panel"""
+    if telemetry is None or not stream_clock_hz:
+        return
+    seconds = max(cycles, 1) / stream_clock_hz
+    telemetry.update({"blocks/s": blocks / seconds, "bytes/s": sent / seconds,
+                      "stalls/s": stalls / seconds, "USB busy/s": busy / seconds})
+
+def decimate_dtype(channels):
+    """A BLOCK_MAGIC_DECIMATE record: AND and OR of the window's levels,
+    its last levels, then level changes per channel, saturating"""
+    return np.dtype([('all', '<u2'), ('any', '<u2'), ('last', '<u2'), ('edges', '<u2', (channels,))])
+
+def expand_windows(records, start, period):
+    """Two samples per window record, drawn the way SamplePyramid draws a
+    bucket: from the window's start the level each channel entered it
+    with, from its middle the level it left with. A channel that changed
+    more than once is low, then high, so it shows as a pulse; a lone edge
+    shows mid-window in its direction. The edge rate goes to the health
+    panel."""
+    edges = records['edges']
+    weights = (1 << np.arange(edges.shape[1])).astype(np.uint16)
+    odd = ((edges & 1) * weights).sum(axis=1).astype(np.uint16)
+    busy = ((edges > 1) * weights).sum(axis=1).astype(np.uint16)
+    last = records['last']
+    times = start + np.arange(len(records), dtype=np.int64) * period
+    out_times = np.empty(2 * len(records), np.int64)
+    out_levels = np.empty(2 * len(records), np.uint16)
+    out_times[0::2] = times
+    out_times[1::2] = times + period // 2
+    out_levels[0::2] = ((last ^ odd) & ~busy) | (records['all'] & busy)
+    out_levels[1::2] = (last & ~busy) | (records['any'] & busy)
+    if telemetry is not None and stream_clock_hz and len(records):
+        telemetry.update({"events/s": int(edges.sum()) * stream_clock_hz / (len(records) * period)})
+    return out_times & 0xFFFFFFFF, out_levels
+
+def parse_blocks(buffer, keep=None):
+    """Removes whole sample blocks from the front of buffer and expands them
+    to (timestamps, values) arrays; skips bytes until a valid header is
+    found. Run-length blocks yield one entry per run, at the run's first
+    sample. With keep, only sample blocks of those magics are expanded."""
+    global next_block_start
+    parts = []
+    while len(buffer) >= BLOCK_STRUCT.size:
+        magic, count, start, end_time, period, mask, bits, nfix = BLOCK_STRUCT.unpack_from(buffer)
+        if magic in WORD_MAGICS and bits == 0 and nfix == 0:
+            end = BLOCK_STRUCT.size + count * 4
+            if len(buffer) < end:
+                break
+            words = struct.unpack_from(f"<{count}I", buffer, BLOCK_STRUCT.size)
+            if magic == BLOCK_MAGIC_STATS:
+                print_stats(period, words)
+            elif magic == BLOCK_MAGIC_SYNC:
+                report_sync(*words[:2])
+            elif magic == BLOCK_MAGIC_HEALTH:
+                report_health(*words[:5])
+            elif magic == BLOCK_MAGIC_HEADER:
+                report_header(words)
+            else:
+                print_info(*words[:5])
+            del buffer[:end]
+            continue
+        if magic == BLOCK_MAGIC_DECIMATE and period and bits in (4, 8, 16):
+            record = decimate_dtype(bits)
+            end = BLOCK_STRUCT.size + (count * record.itemsize + 3) // 4 * 4 + nfix * FIXUP_STRUCT.size
+            if len(buffer) < end:
+                break
+            if next_block_start is not None and (start - next_block_start) & 0xFFFFFFFF >= period:
+                print(f"Capture gap of {(start - next_block_start) & 0xFFFFFFFF} cycles before block at {start}")
+            records = np.frombuffer(bytes(buffer[BLOCK_STRUCT.size:BLOCK_STRUCT.size + count * record.itemsize]),
+                                    record)
+            parts.append(expand_windows(records, start, period))
+            next_block_start = (start + count * period) & 0xFFFFFFFF
+            del buffer[:end]
+            continue
+        if (magic not in PACKED_MAGICS + (BLOCK_MAGIC_RLE,) or period == 0
+                or bits not in (1, 2, 4, 8, 16)):
+            del buffer[0]
+            continue
+        per_byte = max(8 // bits, 1)
+        if magic == BLOCK_MAGIC_RLE:
+            size = count
+        else:
+            size = (count + per_byte - 1) // per_byte * max(bits // 8, 1)
+        fix_start = BLOCK_STRUCT.size + (size + 3) // 4 * 4  # data is word-padded
+        end = fix_start + nfix * FIXUP_STRUCT.size
+        if len(buffer) < end:
+            break
+        data = buffer[BLOCK_STRUCT.size:BLOCK_STRUCT.size + size]
+        late = dict(FIXUP_STRUCT.iter_unpack(bytes(buffer[fix_start:end])))
+        burst = magic in (BLOCK_MAGIC_BURST, BLOCK_MAGIC_TRIGGER, BLOCK_MAGIC_EQUIV)
+        if keep is not None and magic not in keep:
+            del buffer[:end]
+            continue
+        if magic == BLOCK_MAGIC_TRIGGER:
+            print(f"Burst triggered at {start}")
+        if (not burst and next_block_start is not None
+                and (start - next_block_start) & 0xFFFFFFFF >= period):
+            # the firmware waited for USB with both buffers full
+            gap = (start - next_block_start) & 0xFFFFFFFF
+            print(f"Capture gap of {gap} cycles before block at {start}")
+        if magic == BLOCK_MAGIC_RLE:
+            runs, count = decode_runs(data, start, period, late)
+            if runs:
+                times, packed = zip(*runs)
+                parts.append((np.array(times, np.int64), expand_table(mask)[np.array(packed)]))
+        elif count:
+            index = np.arange(count)
+            times = start + index.astype(np.int64) * period
+            if late:
+                times[np.array(list(late.keys()))] += np.array(list(late.values()))
+            if bits == 16:
+                levels = port_levels(np.frombuffer(bytes(data), '<u2'))
             else:
-                header.append(f"CH{ch+1}")
-        writer.writerow(header)
-        
-        buffer = bytearray()
-        while True:
-            chunk = ser.read(256)
-            buffer.extend(chunk)
-            
-            while len(buffer) >= SAMPLE_SIZE:
-                raw = buffer[:SAMPLE_SIZE]
-                buffer = buffer[SAMPLE_SIZE:]
-                timestamp, value = SAMPLE_STRUCT.unpack(raw)
-                
-                # Extract all 4 channels
-                levels = [(value >> ch) & 0x1 for ch in range(4)]
-                
-                # Append to plot buffers
-                for ch in range(4):
-                    channel_data[ch].append((timestamp, levels[ch]))
-                
-                # Write full line to CSV
-                writer.writerow([timestamp] + levels)
-                f.flush()  # Ensure data is written to file immediately
+                field = (1 << bits) - 1
+                packed = (np.frombuffer(bytes(data), np.uint8)[index // per_byte]
+                          >> (bits * (index % per_byte))) & field
+                levels = expand_table(mask)[packed]
+            parts.append((times & 0xFFFFFFFF, levels))
+        # streaming resumes after a burst upload at an unrelated time
+        next_block_start = None if burst else (start + count * period) & 0xFFFFFFFF
+        del buffer[:end]
+    if not parts:
+        return np.empty(0, np.int64), np.empty(0, np.uint16)
+    return np.concatenate([p[0] for p in parts]), np.concatenate([p[1] for p in parts])
+
+def decode_runs(data, start, period, late):
+    """Expands (value, run length) records: byte 0 holds the value in bits
+    3-0 and run - 1 bits 2-0 in bits 6-4, LEB128 groups follow while bit 7
+    is set. late maps sample indexes to their fixup. Returns the runs and
+    the number of samples they cover."""
+    runs = []
+    index = 0
+    pos = 0
+    while pos < len(data):
+        b = data[pos]
+        pos += 1
+        value = b & 0x0F
+        length = (b >> 4) & 0x07
+        shift = 3
+        while b & 0x80 and pos < len(data):
+            b = data[pos]
+            pos += 1
+            length |= (b & 0x7F) << shift
+            shift += 7
+        runs.append(((start + index * period + late.get(index, 0)) & 0xFFFFFFFF, value))
+        index += length + 1
+    return runs, index
+
+# ========================
+# Ingest Process
+# ========================
+def ingest(ring_name, mapping, rate_hz, trigger, stop, health=None, sinks=()):
+    """Reads and unpacks the blocks in a process of its own, so rendering
+    never delays USB reads. Samples go to bitlog.lacap and the shared ring
+    the plot reads (none if ring_name is None), and to the live sinks that
+    are on (pipeline.py) and sinks; the link health figures go to health,
+    a Telemetry, if given. Returns once stop is set"""
+    global prev_value, telemetry
+    telemetry = health
+    if BULK_USB:
+        from bulk_port import BulkPort
+        ser = BulkPort(timeout=1)
+    else:
+        ser = serial.Serial(SERIAL_PORT, BAUDRATE, timeout=1)
+    send_poll_mode(ser)
+    send_info_request(ser)
+    send_config(ser, rate_hz, mapping)
+    if DECIMATE_WINDOW:
+        send_decimate(ser, DECIMATE_WINDOW)
+    if trigger is not None:
+        send_burst(ser, trigger, rate_hz)
+    out = SharedRing(ring_name) if ring_name else None
+    sinks = [CaptureWriter(CAPTURE_PATH, MODE_SAMPLES, mapping,
+                           segment_bytes=SEGMENT_MB << 20, segment_s=SEGMENT_MINUTES * 60),
+             *([RingSink(out)] if out is not None else []), *sinks]
+    if LIVE_STATS_S:
+        sinks.append(StatsSink(mapping, LIVE_STATS_S))
+    if LIVE_UART:
+        sinks.append(UartSink(*LIVE_UART, skip_lag_s=LIVE_SKIP_LAG_S, skip_log=LIVE_SKIP_LOG))
+    if PROTOCOL_STATS_S:
+        sinks.append(ProtocolStatsSink(mapping, PROTOCOL_STATS_S, PROTOCOL_STATS_BAUD,
+                                       csv_path=PROTOCOL_STATS_CSV))
+    if LIVE_EXPORT:
+        sinks.append(ExportSink(LIVE_EXPORT, MODE_SAMPLES, mapping))
+    if LIVE_PCAP:
+        sinks.append(PcapSink(LIVE_PCAP[0], mapping, LIVE_PCAP[1], wrap_bits=32))
+    if SERVE_PORT:
+        sinks.append(ServerSink(SERVE_PORT, MODE_SAMPLES, mapping))
+    if is_auto(mapping):
+        sinks.append(IdentifySink(MODE_SAMPLES, mapping))
+    pipeline = Pipeline(*sinks)
+    report = StageReport("ingest", STAGE_STATS_S, STAGE_STATS_JSON)
+    tick_hz = None
+    buffer = bytearray()
+    last_stats = time.monotonic()
+    last_flush = time.monotonic()
+    last_health = time.monotonic()
+    while not stop.is_set():
+        if STATS_EVERY_S and time.monotonic() - last_stats >= STATS_EVERY_S:
+            ser.write(b'S')
+            last_stats = time.monotonic()
+        if telemetry is not None and time.monotonic() - last_health >= HEALTH_EVERY_S:
+            telemetry.update({"host queue %": 100.0 * pipeline.queue_fill(),
+                              "port backlog": ser.in_waiting})
+            last_health = time.monotonic()
+        began = time.perf_counter()
+        chunk = ser.read(max(ser.in_waiting, 256))
+        read_stage.add(len(chunk), time.perf_counter() - began)
+        buffer.extend(chunk)
+
+        began = time.perf_counter()
+        times, values = parse_blocks(buffer)
+        decode_stage.add(len(chunk), time.perf_counter() - began, len(times))
+        if stream_clock_hz != tick_hz:
+            tick_hz = stream_clock_hz
+            pipeline.set_tick_hz(tick_hz)
+        while sync_log:
+            pipeline.sync(*sync_log.pop(0))
+        if len(times):
+            # keep the samples where a level changed: the levels hold in
+            # between. The latest one is kept too, so the plot keeps up
+            before = np.concatenate([[values[0] ^ 1 if prev_value is None else prev_value],
+                                     values[:-1]])
+            changed = np.flatnonzero(values != before)
+            prev_value = int(values[-1])
+            if not len(changed) or changed[-1] != len(values) - 1:
+                changed = np.concatenate([changed, [len(values) - 1]])
+            pipeline.samples(times[changed], values[changed])
+        report.poll()
+        if time.monotonic() - last_flush >= FLUSH_EVERY_S:
+            pipeline.flush()
+            last_flush = time.monotonic()
+    pipeline.close()
+    if out is not None:
+        out.close()
 
 # ========================
 # Plot Update Function (with step-wise waveform)
 # ========================
 def update_plot(_):
+    began = time.perf_counter()
+    # Only the samples that arrived since the last frame are processed
+    records, lost = ring.read()
+    if lost:
+        plot_stage.shed(lost)
+    drawn = draw_frame(records, lost)
+    plot_stage.add(len(records), time.perf_counter() - began)
+    plot_report.poll()
+    return drawn
+
+def draw_frame(records, lost):
+    global follow, last_xlim
+    if panel is not None:
+        panel.draw()
+    samples_data.append(*level_records(records))
+    if annotations is not None:
+        annotations.feed(records, lost, ring.tick_hz)
+    latest = samples_data.latest()
+    if latest is None:
+        return list(lines.values())
+
+    ax = next(iter(lines.values())).axes
+    if last_xlim is not None and tuple(ax.get_xlim()) != last_xlim:
+        follow = False  # zoomed or panned; 'f' resumes following
+    if follow:
+        if samples_data.counts[0] > 1:
+            # Show a large window of recent data
+            ax.set_xlim(latest - FOLLOW_WINDOW, latest + FOLLOW_WINDOW / 10)
+        else:
+            # Single point total
+            ax.set_xlim(latest - 25000, latest + 25000)
+    last_xlim = tuple(ax.get_xlim())
+
+    times, masks = samples_data.view(*last_xlim)
     for ch, line in lines.items():
-        if channel_data[ch]:
-            raw_times, raw_levels = zip(*channel_data[ch])
-            
-            # Create step-wise waveform: duplicate each time, except the last
-            times = []
-            levels = []
-            for i in range(len(raw_times)):
-                times.append(raw_times[i])
-                levels.append(raw_levels[i])
-                if i < len(raw_times) - 1:
-                    times.append(raw_times[i + 1])
-                    levels.append(raw_levels[i])  # Hold current level until next edge
-            
-            line.set_data(times, levels)
-            ax = line.axes
-            
-            # Dynamic x-axis scaling with much larger window
-            if len(times) > 0:
-                if len(times) > 1:
-                    # Show a large window of recent data
-                    latest_time = raw_times[-1]
-                    window_size = 200000  # Much larger window size
-                    
-                    ax.set_xlim(latest_time - window_size, latest_time + window_size/10)
-                else:
-                    # Single point total
-                    ax.set_xlim(times[0] - 25000, times[0] + 25000)
+        line.set_data(times, (masks >> ch) & 1)
+    if annotations is not None:
+        return list(lines.values()) + annotations.draw(*last_xlim)
 
     return list(lines.values())
 
+def on_key(event):
+    global follow
+    if event.key == 'f':
+        follow = True
+
 # ========================
 # Main Function
 # ========================
 def main():
-    global lines
+    global lines, ring, panel, annotations, plot_report
 
     # User setup phase
     comm_type = get_comm_type()
     mapping = get_channel_mapping(comm_type)
+    rate_hz = get_sample_rate()
+    trigger = get_burst_trigger()
 
-    # Create one subplot per assigned channel
+    # Create one subplot per assigned channel, and a column for the health panel
     num_channels = len(mapping)
-    fig, axes = plt.subplots(num_channels, 1, sharex=True, figsize=(10, 2 * num_channels))
-    if num_channels == 1:
-        axes = [axes]  # ensure it's iterable
+    health = Telemetry() if HEALTH_PANEL and VIEWER != "gl" else None
+    fig = None if VIEWER == "gl" else plt.figure(figsize=(13 if health else 10, 2 * num_channels))
+    axes = []
+    if fig is not None:
+        grid = fig.add_gridspec(num_channels, 2 if health else 1, width_ratios=(4, 1) if health else None)
+        axes = [fig.add_subplot(grid[0, 0])]
+        axes += [fig.add_subplot(grid[i, 0], sharex=axes[0]) for i in range(1, num_channels)]
+    panel = TelemetryPanel(fig.add_subplot(grid[:, 1]), health) if health else None
 
     lines = {}
 
@@ -149,16 +788,38 @@ def main():
         ax.set_title(f"Channel {ch+1}: {channel_names[ch]}")
         ax.legend(loc="upper right")
 
-    axes[-1].set_xlabel("Time (cycles)")
-    plt.tight_layout()
+    if axes:
+        axes[-1].set_xlabel("Time (cycles)")
+        plt.tight_layout()
+        if HISTORY_PATH:
+            samples_data.history = SampleHistory(HISTORY_PATH)
+    if ANNOTATE and axes:
+        annotations = AnnotationOverlay(comm_type, mapping, dict(zip(mapping, axes)), ANNOTATE_BAUD, wrap_bits=32)
+
+    # Start the ingest process
+    ring = SharedRing()
+    plot_report = StageReport("plot", STAGE_STATS_S, STAGE_STATS_JSON)
+    stop = multiprocessing.Event()
+    reader = multiprocessing.Process(target=ingest, args=(ring.name, mapping, rate_hz, trigger, stop, health))
+    reader.start()
+    transcoder = None
+    if TRANSCODE_WORKERS and CAPTURE_PATH and (SEGMENT_MB or SEGMENT_MINUTES):
+        transcoder = capture_transcode.start(CAPTURE_PATH, TRANSCODE_WORKERS)
 
-    # Start serial reader thread
-    thread = threading.Thread(target=read_usb, args=(mapping,), daemon=True)
-    thread.start()
+    if VIEWER == "gl":
+        import gl_viewer
+        gl_viewer.run(channel_names, ring, FOLLOW_WINDOW, "Logic analyzer: poll samples", wrap_bits=32)
+    else:
+        fig.canvas.mpl_connect('key_press_event', on_key)
 
-    # Start animation
-    ani = animation.FuncAnimation(fig, update_plot, interval=10)
-    plt.show()
+        # Start animation
+        ani = animation.FuncAnimation(fig, update_plot, interval=10)
+        plt.show()
+    stop.set()
+    reader.join()
+    if transcoder is not None:
+        transcoder.stdin.close()  # recording stopped: it packs the last segment and exits
+    ring.close()
 
 if __name__ == "__main__":
     main()
\ No newline at end of file